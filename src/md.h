@@ -104,15 +104,23 @@ struct md_t {
     unsigned defn_line_number;      /* line number of definition */
     
     const char *configured_name;    /* name this MD was configured with, if different */
+    
+    struct apr_array_header_t *dns_names; /* md_dns_name_t of domains, for matching */
+    const struct apr_array_header_t *dns_names_of; /* the domains array dns_names are for */
 };
 
 #define MD_KEY_ACCOUNT          "account"
+#define MD_KEY_ACCOUNTS         "accounts"
+#define MD_KEY_ACCT_CHECK       "account-check"
 #define MD_KEY_ACME_TLS_1       "acme-tls/1"
 #define MD_KEY_ACTIVATION_DELAY "activation-delay"
 #define MD_KEY_ACTIVITY         "activity"
 #define MD_KEY_AGREEMENT        "agreement"
 #define MD_KEY_AUTHORIZATIONS   "authorizations"
+#define MD_KEY_AUTHZ_PARALLEL   "authz-parallel"
 #define MD_KEY_BITS             "bits"
+#define MD_KEY_CURVE            "curve"
+#define MD_KEY_CALLS            "calls"
 #define MD_KEY_CA               "ca"
 #define MD_KEY_CA_URL           "ca-url"
 #define MD_KEY_CERT             "cert"
@@ -121,15 +129,22 @@ struct md_t {
 #define MD_KEY_CHALLENGE        "challenge"
 #define MD_KEY_CHALLENGES       "challenges"
 #define MD_KEY_CMD_DNS01        "cmd-dns-01"
+#define MD_KEY_CMD_DNS01_BATCH  "cmd-dns-01-batch"
 #define MD_KEY_COMPLETE         "complete"
+#define MD_KEY_CONNECT          "connect"
 #define MD_KEY_CONTACT          "contact"
 #define MD_KEY_CONTACTS         "contacts"
+#define MD_KEY_COUNT            "count"
 #define MD_KEY_CSR              "csr"
 #define MD_KEY_DETAIL           "detail"
 #define MD_KEY_DISABLED         "disabled"
 #define MD_KEY_DIR              "dir"
+#define MD_KEY_DIRECTORY        "directory"
+#define MD_KEY_DIR_MAX_AGE      "directory-max-age"
 #define MD_KEY_DOMAIN           "domain"
+#define MD_KEY_DNS              "dns"
 #define MD_KEY_DOMAINS          "domains"
+#define MD_KEY_ENDPOINT         "endpoint"
 #define MD_KEY_ENTRIES          "entries"
 #define MD_KEY_ERRORED          "errored"
 #define MD_KEY_ERROR            "error"
@@ -137,28 +152,49 @@ struct md_t {
 #define MD_KEY_EXPIRES          "expires"
 #define MD_KEY_FINALIZE         "finalize"
 #define MD_KEY_FINISHED         "finished"
+#define MD_KEY_FIRST_BYTE       "first-byte"
 #define MD_KEY_FROM             "from"
 #define MD_KEY_GOOD             "good"
+#define MD_KEY_HITS             "hits"
+#define MD_KEY_HOLDER           "holder"
+#define MD_KEY_HOSTS            "hosts"
 #define MD_KEY_HTTP             "http"
 #define MD_KEY_HTTPS            "https"
+#define MD_KEY_HTTP_CLIENTS     "http-clients"
 #define MD_KEY_ID               "id"
 #define MD_KEY_IDENTIFIER       "identifier"
+#define MD_KEY_IN_FLIGHT        "in-flight"
 #define MD_KEY_KEY              "key"
 #define MD_KEY_KEYAUTHZ         "keyAuthorization"
 #define MD_KEY_LAST             "last"
+#define MD_KEY_LAST_DURATION    "last-duration-ms"
 #define MD_KEY_LAST_RUN         "last-run"
+#define MD_KEY_LATENCY          "latency"
+#define MD_KEY_LE_USEC          "le-usec"
+#define MD_KEY_LIMIT            "limit"
 #define MD_KEY_LOCATION         "location"
+#define MD_KEY_LOCK_WAIT        "lock-wait"
+#define MD_KEY_LOCK_WAITS       "lock-waits"
 #define MD_KEY_LOG              "log"
+#define MD_KEY_LOOKUPS          "lookups"
+#define MD_KEY_MAX_CONNS        "max-conns"
+#define MD_KEY_MAX_HOST_CONNS   "max-host-conns"
+#define MD_KEY_MAX_IN_FLIGHT    "max-in-flight"
 #define MD_KEY_MDS              "managed-domains"
 #define MD_KEY_MESSAGE          "message"
+#define MD_KEY_MISSES           "misses"
 #define MD_KEY_MUST_STAPLE      "must-staple"
 #define MD_KEY_NAME             "name"
 #define MD_KEY_NEXT_RUN         "next-run"
 #define MD_KEY_NOTIFIED         "notified"
+#define MD_KEY_OFFSET           "offset"
 #define MD_KEY_OCSP             "ocsp"
 #define MD_KEY_OCSPS            "ocsps"
 #define MD_KEY_ORDERS           "orders"
+#define MD_KEY_P50              "p50-ms"
+#define MD_KEY_P99              "p99-ms"
 #define MD_KEY_PERMANENT        "permanent"
+#define MD_KEY_PHASES           "phases"
 #define MD_KEY_PKEY             "privkey"
 #define MD_KEY_PKEY_FILE        "pkey-file"
 #define MD_KEY_PROBLEM          "problem"
@@ -171,6 +207,7 @@ struct md_t {
 #define MD_KEY_RENEWAL          "renewal"
 #define MD_KEY_RENEWING         "renewing"
 #define MD_KEY_RENEW_WINDOW     "renew-window"
+#define MD_KEY_REQUESTS         "requests"
 #define MD_KEY_REQUIRE_HTTPS    "require-https"
 #define MD_KEY_RESOURCE         "resource"
 #define MD_KEY_RESPONSE         "response"
@@ -181,8 +218,11 @@ struct md_t {
 #define MD_KEY_STATE            "state"
 #define MD_KEY_STATUS           "status"
 #define MD_KEY_STORE            "store"
+#define MD_KEY_STORE_READS      "store-reads"
 #define MD_KEY_SUBPROBLEMS      "subproblems"
 #define MD_KEY_TEMPORARY        "temporary"
+#define MD_KEY_TIMINGS          "timings"
+#define MD_KEY_TLS              "tls"
 #define MD_KEY_TOKEN            "token"
 #define MD_KEY_TOTAL            "total"
 #define MD_KEY_TRANSITIVE       "transitive"
@@ -192,11 +232,13 @@ struct md_t {
 #define MD_KEY_URL              "url"
 #define MD_KEY_URI              "uri"
 #define MD_KEY_VALID            "valid"
+#define MD_KEY_VALIDATED        "validated"
 #define MD_KEY_VALID_FROM       "valid-from"
 #define MD_KEY_VALUE            "value"
 #define MD_KEY_VERSION          "version"
 #define MD_KEY_WATCHED          "watched"
 #define MD_KEY_WHEN             "when"
+#define MD_KEY_WAITS            "waits"
 #define MD_KEY_WARN_WINDOW      "warn-window"
 
 /* Check if a string member of a new MD (n) has 
@@ -210,6 +252,13 @@ struct md_t {
  */
 int md_contains(const md_t *md, const char *domain, int case_sensitive);
 
+/**
+ * Make the lower case names of the domains of md, used for matching, or add the
+ * domains added since the last call. Matching falls back to the domains themselves
+ * while the names are not up to date.
+ */
+void md_update_dns_names(md_t *md, apr_pool_t *p);
+
 /**
  * Determine if the names of the two managed domains overlap.
  */
@@ -251,6 +300,44 @@ md_t *md_get_by_domain(struct apr_array_header_t *mds, const char *domain);
  */
 md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md);
 
+/**
+ * An immutable index over an array of managed domains, for lookups by
+ * name and by DNS name without scanning them all. Results are the same as
+ * from the md_get_by_* functions on the array, as long as the array and
+ * its managed domains are not modified.
+ */
+typedef struct md_index_t md_index_t;
+
+md_index_t *md_index_make(apr_pool_t *p, struct apr_array_header_t *mds);
+
+/**
+ * Look up a managed domain by its name, see md_get_by_name().
+ */
+md_t *md_index_get_by_name(const md_index_t *idx, const char *name);
+
+/**
+ * Look up a managed domain by a DNS name it contains, see md_get_by_domain().
+ */
+md_t *md_index_get_by_domain(const md_index_t *idx, const char *domain);
+
+/**
+ * Find a managed domain, different from the given one, that has overlaps
+ * in the domain list, see md_get_by_dns_overlap(). If pdomain is not NULL, 
+ * it is set to the first domain of md found in the other.
+ */
+md_t *md_index_get_by_dns_overlap(const md_index_t *idx, const md_t *md, 
+                                  const char **pdomain);
+
+/**
+ * Find the managed domain that contains all domains of md or, if there is none,
+ * the one that has the most domains in common with it. The first one in order 
+ * wins, a managed domain with the same name as md before all others. Managed 
+ * domains whose names are keys in excluded are not considered. Returns NULL if no 
+ * managed domain has any domain of md.
+ */
+md_t *md_index_get_closest(const md_index_t *idx, const md_t *md, 
+                           struct apr_hash_t *excluded, apr_pool_t *p);
+
 /**
  * Create and empty md record, structures initialized.
  */
@@ -22,6 +22,8 @@
 #include <apr_buckets.h>
 #include <apr_hash.h>
 #include <apr_uri.h>
+#include <apr_date.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -89,23 +91,48 @@ static apr_status_t problem_status_get(const char *type) {
 /**************************************************************************************************/
 /* acme requests */
 
+static void nonce_add(md_acme_t *acme, const char *nonce)
+{
+    int i;
+    
+    for (i = 0; i < acme->nonces->nelts; ++i) {
+        if (!strcmp(nonce, APR_ARRAY_IDX(acme->nonces, i, const char*))) return;
+    }
+    if (acme->nonces->nelts >= MD_ACME_NONCES_MAX) {
+        /* the oldest is the one most likely to have expired at the server */
+        md_array_remove_at(acme->nonces, 0);
+    }
+    APR_ARRAY_PUSH(acme->nonces, const char*) = apr_pstrdup(acme->p, nonce);
+}
+
+/* Take the most recent nonce. After a badNonce, that is the one sent along with the 
+ * error, which the retry of the request will then use. */
+static const char *nonce_take(md_acme_t *acme)
+{
+    const char **pnonce = apr_array_pop(acme->nonces);
+    return pnonce? *pnonce : NULL;
+}
+
 static void req_update_nonce(md_acme_t *acme, apr_table_t *hdrs)
 {
     if (hdrs) {
         const char *nonce = apr_table_get(hdrs, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonce_add(acme, nonce);
         }
     }
 }
 
+static void dir_check_changed(md_acme_t *acme, const char *url, int status);
+
 static apr_status_t http_update_nonce(const md_http_response_t *res, void *data)
 {
     md_acme_t *acme = data;
+    dir_check_changed(acme, res->req->url, res->status);
     if (res->headers) {
         const char *nonce = apr_table_get(res->headers, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            nonce_add(acme, nonce);
         }
     }
     return APR_SUCCESS;
@@ -152,6 +179,230 @@ static apr_status_t acmev2_new_nonce(md_acme_t *acme)
     return md_http_HEAD_perform(acme->http, acme->api.v2.new_nonce, NULL, http_update_nonce, acme);
 }
 
+typedef struct {
+    md_acme_t *acme;
+    const char *url;
+    int remain;
+} nonce_fetch_ctx;
+
+static apr_status_t nonce_next_req(md_http_request_t **preq, void *baton, 
+                                   md_http_t *http, int in_flight)
+{
+    nonce_fetch_ctx *ctx = baton;
+    md_http_request_t *hreq;
+    apr_status_t rv;
+    
+    if (ctx->remain <= 0 || in_flight >= ctx->acme->max_parallel) return APR_ENOENT;
+    rv = md_http_HEAD_create(&hreq, http, ctx->url, NULL);
+    if (APR_SUCCESS == rv) {
+        md_http_set_on_response_cb(hreq, http_update_nonce, ctx->acme);
+        --ctx->remain;
+        *preq = hreq;
+    }
+    return rv;
+}
+
+/* Make sure there are n unused nonces available, fetching the missing 
+ * ones in parallel. */
+static apr_status_t nonces_prefetch(md_acme_t *acme, int n)
+{
+    nonce_fetch_ctx ctx;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (n > MD_ACME_NONCES_MAX) n = MD_ACME_NONCES_MAX;
+    n -= acme->nonces->nelts;
+    if (n <= 0) goto leave;
+    if (n == 1 || acme->max_parallel <= 1) {
+        rv = acme->new_nonce_fn(acme);
+        goto leave;
+    }
+    ctx.acme = acme;
+    ctx.url = (MD_ACME_VERSION_MAJOR(acme->version) > 1)? 
+               acme->api.v2.new_nonce : acme->api.v1.new_reg;
+    ctx.remain = n;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "prefetching %d nonces", n);
+    rv = md_http_multi_perform(acme->http, nonce_next_req, &ctx);
+leave:
+    if (APR_SUCCESS != rv && acme->nonces->nelts > 0) rv = APR_SUCCESS;
+    return rv;
+}
+
+
+/**************************************************************************************************/
+/* request limits per CA */
+
+typedef struct {
+    double tokens;
+    apr_time_t refilled;
+    apr_time_t blocked_until;
+} ca_limit_t;
+
+struct md_acme_limits_t {
+    apr_pool_t *p;                     /* own allocator, used with the lock held */
+    int rate;
+    int burst;
+    apr_hash_t *cas;                   /* ca url -> ca_limit_t* */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+static void limits_lock(md_acme_limits_t *limits)
+{
+#if APR_HAS_THREADS
+    if (limits->mutex) apr_thread_mutex_lock(limits->mutex);
+#else
+    (void)limits;
+#endif
+}
+
+static void limits_unlock(md_acme_limits_t *limits)
+{
+#if APR_HAS_THREADS
+    if (limits->mutex) apr_thread_mutex_unlock(limits->mutex);
+#else
+    (void)limits;
+#endif
+}
+
+apr_status_t md_acme_limits_create(md_acme_limits_t **plimits, apr_pool_t *p,
+                                   int rate, int burst)
+{
+    md_acme_limits_t *limits;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    limits = apr_pcalloc(p, sizeof(*limits));
+    limits->rate = (rate > 0)? rate : MD_ACME_CA_RATE;
+    limits->burst = (burst > 0)? burst : MD_ACME_CA_BURST;
+    /* CAs are added by renewal threads at runtime, not from p which others use */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+    apr_allocator_max_free_set(allocator, 1);
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&limits->p, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto leave;
+    }
+    apr_allocator_owner_set(allocator, limits->p);
+    apr_pool_tag(limits->p, "md_acme_limits");
+    limits->cas = apr_hash_make(limits->p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&limits->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+leave:
+    *plimits = (APR_SUCCESS == rv)? limits : NULL;
+    return rv;
+}
+
+/* call with lock held */
+static ca_limit_t *ca_limit_get(md_acme_limits_t *limits, const char *ca_url)
+{
+    ca_limit_t *ca;
+    
+    if (!(ca = apr_hash_get(limits->cas, ca_url, APR_HASH_KEY_STRING))) {
+        ca = apr_pcalloc(limits->p, sizeof(*ca));
+        ca->tokens = limits->burst;
+        ca->refilled = apr_time_now();
+        apr_hash_set(limits->cas, apr_pstrdup(limits->p, ca_url), APR_HASH_KEY_STRING, ca);
+    }
+    return ca;
+}
+
+apr_status_t md_acme_limits_acquire(md_acme_limits_t *limits, const char *ca_url,
+                                    apr_time_t *pretry_at)
+{
+    ca_limit_t *ca;
+    apr_time_t now;
+    apr_interval_time_t wait;
+    
+    *pretry_at = 0;
+    for (;;) {
+        limits_lock(limits);
+        ca = ca_limit_get(limits, ca_url);
+        now = apr_time_now();
+        if (ca->blocked_until > now) {
+            *pretry_at = ca->blocked_until;
+            limits_unlock(limits);
+            return APR_EAGAIN;
+        }
+        ca->tokens += (double)(now - ca->refilled) * limits->rate / APR_USEC_PER_SEC;
+        if (ca->tokens > limits->burst) ca->tokens = limits->burst;
+        ca->refilled = now;
+        if (ca->tokens >= 1.0) {
+            ca->tokens -= 1.0;
+            limits_unlock(limits);
+            return APR_SUCCESS;
+        }
+        wait = (apr_interval_time_t)((1.0 - ca->tokens) * APR_USEC_PER_SEC / limits->rate) + 1;
+        limits_unlock(limits);
+        apr_sleep(wait);
+    }
+}
+
+void md_acme_limits_block(md_acme_limits_t *limits, const char *ca_url, apr_time_t until)
+{
+    ca_limit_t *ca;
+    
+    limits_lock(limits);
+    ca = ca_limit_get(limits, ca_url);
+    if (until > ca->blocked_until) ca->blocked_until = until;
+    limits_unlock(limits);
+}
+
+apr_time_t md_acme_limits_blocked_until(md_acme_limits_t *limits, const char *ca_url)
+{
+    ca_limit_t *ca;
+    apr_time_t until;
+    
+    limits_lock(limits);
+    ca = apr_hash_get(limits->cas, ca_url, APR_HASH_KEY_STRING);
+    until = (ca && ca->blocked_until > apr_time_now())? ca->blocked_until : 0;
+    limits_unlock(limits);
+    return until;
+}
+
+/* Check with the limits of the CA before sending req. */
+static apr_status_t req_check_limits(md_acme_req_t *req)
+{
+    char ts[APR_RFC822_DATE_LEN];
+    apr_time_t retry_at;
+    apr_status_t rv;
+    
+    if (!req->acme->limits) return APR_SUCCESS;
+    rv = md_acme_limits_acquire(req->acme->limits, req->acme->url, &retry_at);
+    if (APR_SUCCESS != rv) {
+        apr_rfc822_date(ts, retry_at);
+        md_result_printf(req->result, rv, "the CA asked us to retry after %s", ts);
+        md_result_delay_set(req->result, retry_at);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, req->p, 
+                      "not sending %s %s: %s", req->method, req->url, req->result->detail);
+    }
+    return rv;
+}
+
+/* Remember a Retry-After the CA gave for req and hold back all requests to it. */
+static void req_note_retry_after(md_acme_req_t *req, const md_http_response_t *res)
+{
+    const char *s;
+    apr_time_t now, until = 0;
+    
+    if (!(s = apr_table_get(res->headers, "Retry-After"))) return;
+    now = apr_time_now();
+    if (apr_isdigit(*s)) {
+        until = now + apr_time_from_sec(apr_atoi64(s));
+    }
+    else if ((until = apr_date_parse_http(s)) == APR_DATE_BAD) {
+        return;
+    }
+    if (until <= now) return;
+    md_result_delay_set(req->result, until);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
+                  "%s answered %d with Retry-After: %s", req->url, res->status, s);
+    if (req->acme->limits) {
+        /* what is said to one request should not hold everyone back for days */
+        if (until > now + MD_ACME_CA_BLOCK_MAX) until = now + MD_ACME_CA_BLOCK_MAX;
+        md_acme_limits_block(req->acme->limits, req->acme->url, until);
+    }
+}
 
 apr_status_t md_acme_init(apr_pool_t *p, const char *base,  int init_ssl)
 {
@@ -330,9 +581,15 @@ static apr_status_t on_response(const md_http_response_t *res, void *data)
             md_result_log(req->result, MD_LOG_ERR);
         }
     }
-    else if (APR_EAGAIN == (rv = inspect_problem(req, res))) {
-        /* leave req alive */
-        return rv;
+    else {
+        dir_check_changed(req->acme, req->url, res->status);
+        if (429 == res->status || 503 == res->status) {
+            req_note_retry_after(req, res);
+        }
+        if (APR_EAGAIN == (rv = inspect_problem(req, res))) {
+            /* leave req alive */
+            return rv;
+        }
     }
 
     md_acme_req_done(req, rv);
@@ -345,18 +602,15 @@ static apr_status_t acmev2_GET_as_POST_init(md_acme_req_t *req, void *baton)
     return md_acme_req_body_init(req, NULL);
 }
 
-static apr_status_t md_acme_req_send(md_acme_req_t *req)
+/* Prepare the request for sending: on a POST, sign it with a fresh nonce. This
+ * happens again on each retry of the request. */
+static apr_status_t req_prepare(md_acme_req_t *req, md_data_t **pbody)
 {
     apr_status_t rv;
     md_acme_t *acme = req->acme;
     md_data_t *body = NULL;
     md_result_t *result;
 
-    assert(acme->url);
-    
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
-                  "sending req: %s %s", req->method, req->url);
-    md_result_reset(req->acme->last);
     result = md_result_make(req->p, APR_SUCCESS);
     
     /* Whom are we talking to? */
@@ -379,21 +633,30 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
     
     /* Besides GET/HEAD, we always need a fresh nonce */
     if (strcmp("GET", req->method) && strcmp("HEAD", req->method)) {
+        const char *nonce;
+        
         if (acme->version == MD_ACME_VERSION_UNKNOWN) {
             rv = md_acme_setup(acme, result);
             if (APR_SUCCESS != rv) goto leave;
         }
-        if (!acme->nonce && (APR_SUCCESS != (rv = acme->new_nonce_fn(acme)))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
-                          "error retrieving new nonce from ACME server");
-            goto leave;
+        if (!(nonce = nonce_take(acme))) {
+            if (APR_SUCCESS != (rv = acme->new_nonce_fn(acme))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
+                              "error retrieving new nonce from ACME server");
+                goto leave;
+            }
+            if (!(nonce = nonce_take(acme))) {
+                rv = APR_EINVAL;
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, req->p, 
+                              "ACME server did not send a new nonce");
+                goto leave;
+            }
         }
         
-        apr_table_set(req->prot_hdrs, "nonce", acme->nonce);
+        apr_table_set(req->prot_hdrs, "nonce", nonce);
         if (MD_ACME_VERSION_MAJOR(acme->version) > 1) {
             apr_table_set(req->prot_hdrs, "url", req->url);
         }
-        acme->nonce = NULL;
     }
     
     rv = req->on_init? req->on_init(req, req->baton) : APR_SUCCESS;
@@ -416,6 +679,25 @@ static apr_status_t md_acme_req_send(md_acme_req_t *req)
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
                       "req: %s %s", req->method, req->url);
     }
+leave:
+    *pbody = (APR_SUCCESS == rv)? body : NULL;
+    return rv;
+}
+
+static apr_status_t md_acme_req_send(md_acme_req_t *req)
+{
+    apr_status_t rv;
+    md_data_t *body = NULL;
+
+    assert(req->acme->url);
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->p, 
+                  "sending req: %s %s", req->method, req->url);
+    md_result_reset(req->acme->last);
+    
+    if (APR_SUCCESS != (rv = req_check_limits(req))) goto leave;
+    rv = req_prepare(req, &body);
+    if (APR_SUCCESS != rv) goto leave;
     
     if (!strcmp("GET", req->method)) {
         rv = md_http_GET_perform(req->acme->http, req->url, NULL, on_response, req);
@@ -445,6 +727,30 @@ leave:
     return rv;
 }
 
+md_acme_req_t *md_acme_req_make(md_acme_t *acme, const char *method, const char *url,
+                                md_acme_req_init_cb *on_init,
+                                md_acme_req_json_cb *on_json,
+                                md_acme_req_res_cb *on_res,
+                                md_acme_req_err_cb *on_err,
+                                void *baton)
+{
+    md_acme_req_t *req;
+    
+    assert(url);
+    assert(on_json || on_res);
+
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme %s: %s", method, url);
+    req = md_acme_req_create(acme, method, url);
+    if (req) {
+        req->on_init = on_init;
+        req->on_json = on_json;
+        req->on_res = on_res;
+        req->on_err = on_err;
+        req->baton = baton;
+    }
+    return req;
+}
+
 apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
                           md_acme_req_init_cb *on_init,
                           md_acme_req_json_cb *on_json,
@@ -454,18 +760,8 @@ apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
 {
     md_acme_req_t *req;
     
-    assert(url);
-    assert(on_json || on_res);
-
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme POST: %s", url);
-    req = md_acme_req_create(acme, "POST", url);
-    req->on_init = on_init;
-    req->on_json = on_json;
-    req->on_res = on_res;
-    req->on_err = on_err;
-    req->baton = baton;
-    
-    return md_acme_req_send(req);
+    req = md_acme_req_make(acme, "POST", url, on_init, on_json, on_res, on_err, baton);
+    return req? md_acme_req_send(req) : APR_ENOMEM;
 }
 
 apr_status_t md_acme_GET(md_acme_t *acme, const char *url,
@@ -477,18 +773,195 @@ apr_status_t md_acme_GET(md_acme_t *acme, const char *url,
 {
     md_acme_req_t *req;
     
-    assert(url);
-    assert(on_json || on_res);
+    req = md_acme_req_make(acme, "GET", url, on_init, on_json, on_res, on_err, baton);
+    return req? md_acme_req_send(req) : APR_ENOMEM;
+}
+
+/**************************************************************************************************/
+/* sending several requests in parallel */
+
+typedef enum {
+    MULTI_QUEUED,
+    MULTI_SENT,
+    MULTI_DONE
+} multi_state_t;
+
+typedef struct {
+    md_acme_req_t *req;
+    apr_status_t rv;
+    multi_state_t state;
+} multi_slot_t;
+
+typedef struct {
+    md_acme_t *acme;
+    multi_slot_t *slots;
+    int nslots;
+} multi_ctx_t;
+
+static void multi_slot_done(multi_slot_t *slot, apr_status_t rv)
+{
+    slot->rv = md_acme_req_done(slot->req, rv);
+    slot->state = MULTI_DONE;
+}
+
+static apr_status_t multi_on_response(const md_http_response_t *res, void *data)
+{
+    multi_slot_t *slot = data;
+    md_acme_req_t *req = slot->req;
+    int ok = (res->status >= 200 && res->status < 300);
+    apr_status_t rv;
+    
+    rv = on_response(res, req);
+    if (APR_EAGAIN == rv && !ok) {
+        /* request is still alive, e.g. on a bad nonce. Queue it again
+         * so that it gets signed anew. */
+        if (req->max_retries > 0) {
+            --req->max_retries;
+            slot->state = MULTI_QUEUED;
+        }
+        else {
+            multi_slot_done(slot, rv);
+        }
+    }
+    else {
+        /* on_response() has already finished the request */
+        slot->rv = rv;
+        slot->state = MULTI_DONE;
+    }
+    return rv;
+}
+
+static apr_status_t multi_on_status(const md_http_request_t *hreq, apr_status_t status, void *data)
+{
+    multi_slot_t *slot = data;
+    
+    (void)hreq;
+    if (MULTI_SENT == slot->state) {
+        /* request failed before a response arrived */
+        multi_slot_done(slot, (APR_SUCCESS == status)? APR_EGENERAL : status);
+    }
+    return APR_SUCCESS;
+}
 
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, acme->p, "add acme GET: %s", url);
-    req = md_acme_req_create(acme, "GET", url);
-    req->on_init = on_init;
-    req->on_json = on_json;
-    req->on_res = on_res;
-    req->on_err = on_err;
-    req->baton = baton;
+static apr_status_t multi_next_req(md_http_request_t **preq, void *baton, 
+                                   md_http_t *http, int in_flight)
+{
+    multi_ctx_t *ctx = baton;
+    multi_slot_t *slot;
+    md_http_request_t *hreq;
+    md_data_t *body;
+    md_acme_req_t *req;
+    apr_status_t rv;
+    int i;
+    
+    if (in_flight >= ctx->acme->max_parallel) return APR_ENOENT;
+    
+    for (i = 0; i < ctx->nslots; ++i) {
+        slot = &ctx->slots[i];
+        if (MULTI_QUEUED != slot->state) continue;
+        
+        req = slot->req;
+        hreq = NULL;
+        /* The nonce is taken from the pool when the request is signed here. Each 
+         * request in flight carries its own, responses add new ones to the pool. */
+        if (APR_SUCCESS != (rv = req_check_limits(req))) goto next;
+        rv = req_prepare(req, &body);
+        if (APR_SUCCESS != rv) goto next;
+        
+        if (!strcmp("GET", req->method)) {
+            rv = md_http_GET_create(&hreq, http, req->url, NULL);
+        }
+        else if (!strcmp("POST", req->method)) {
+            rv = md_http_POSTd_create(&hreq, http, req->url, NULL, "application/jose+json", body);
+        }
+        else if (!strcmp("HEAD", req->method)) {
+            rv = md_http_HEAD_create(&hreq, http, req->url, NULL);
+        }
+        else {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, req->p, 
+                          "HTTP method %s against: %s", req->method, req->url);
+            rv = APR_ENOTIMPL;
+        }
+next:
+        if (APR_SUCCESS != rv) {
+            multi_slot_done(slot, rv);
+            continue;
+        }
+        md_http_set_on_response_cb(hreq, multi_on_response, slot);
+        md_http_set_on_status_cb(hreq, multi_on_status, slot);
+        slot->state = MULTI_SENT;
+        *preq = hreq;
+        return APR_SUCCESS;
+    }
+    return APR_ENOENT;
+}
+
+apr_status_t md_acme_multi_perform(md_acme_t *acme, apr_array_header_t *reqs, 
+                                   apr_status_t *rvs)
+{
+    multi_ctx_t ctx;
+    md_result_t *result;
+    apr_pool_t *ptemp;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    const char *method;
+    int i, nsigned;
+    
+    if (reqs->nelts <= 0) return APR_SUCCESS;
+    
+    if (acme->max_parallel <= 1 || reqs->nelts == 1) {
+        for (i = 0; i < reqs->nelts; ++i) {
+            rv2 = md_acme_req_send(APR_ARRAY_IDX(reqs, i, md_acme_req_t*));
+            if (rvs) rvs[i] = rv2;
+            if (APR_SUCCESS == rv) rv = rv2;
+        }
+        return rv;
+    }
+    
+    rv = apr_pool_create(&ptemp, acme->p);
+    if (APR_SUCCESS != rv) goto leave;
+    
+    ctx.acme = acme;
+    ctx.nslots = reqs->nelts;
+    ctx.slots = apr_pcalloc(ptemp, (apr_size_t)ctx.nslots * sizeof(multi_slot_t));
+    for (i = 0; i < ctx.nslots; ++i) {
+        ctx.slots[i].req = APR_ARRAY_IDX(reqs, i, md_acme_req_t*);
+        ctx.slots[i].state = MULTI_QUEUED;
+    }
+    
+    md_result_reset(acme->last);
+    /* Need to know the server and have our http instance before going parallel */
+    if (acme->version == MD_ACME_VERSION_UNKNOWN) {
+        result = md_result_make(ptemp, APR_SUCCESS);
+        rv = md_acme_setup(acme, result);
+    }
+    if (APR_SUCCESS == rv) {
+        /* Get nonces for the first round of signed requests in one go. Should that 
+         * fail, requests fetch their own. */
+        for (i = 0, nsigned = 0; i < ctx.nslots; ++i) {
+            method = ctx.slots[i].req->method;
+            if (MD_ACME_VERSION_MAJOR(acme->version) > 1 
+                || (strcmp("GET", method) && strcmp("HEAD", method))) ++nsigned;
+        }
+        nonces_prefetch(acme, (nsigned < acme->max_parallel)? nsigned : acme->max_parallel);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, 
+                      "sending %d requests, max %d in parallel", 
+                      ctx.nslots, acme->max_parallel);
+        rv = md_http_multi_perform(acme->http, multi_next_req, &ctx);
+    }
     
-    return md_acme_req_send(req);
+    for (i = 0; i < ctx.nslots; ++i) {
+        if (MULTI_DONE != ctx.slots[i].state) {
+            multi_slot_done(&ctx.slots[i], (APR_SUCCESS == rv)? APR_EGENERAL : rv);
+        }
+    }
+    /* report the first failed request, if there is any */
+    for (i = 0; i < ctx.nslots; ++i) {
+        if (rvs) rvs[i] = ctx.slots[i].rv;
+        if (APR_SUCCESS != ctx.slots[i].rv && APR_SUCCESS == rv) rv = ctx.slots[i].rv;
+    }
+    apr_pool_destroy(ptemp);
+leave:
+    return rv;
 }
 
 void md_acme_report_result(md_acme_t *acme, apr_status_t rv, struct md_result_t *result)
@@ -569,7 +1042,7 @@ apr_status_t md_acme_use_acct(md_acme_t *acme, md_store_t *store,
             acme->acct_id = apr_pstrdup(p, acct_id);
             acme->acct = acct;
             acme->acct_key = pkey;
-            rv = md_acme_acct_validate(acme, store, p);
+            rv = md_acme_acct_check(acme, store, p);
         }
         else {
             /* account is from a nother server or, more likely, from another
@@ -644,6 +1117,9 @@ apr_status_t md_acme_create(md_acme_t **pacme, apr_pool_t *p, const char *url,
                                     base_product, MOD_MD_VERSION);
     acme->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
     acme->max_retries = 3;
+    acme->max_parallel = 5;
+    acme->nonces = apr_array_make(p, MD_ACME_NONCES_MAX, sizeof(const char*));
+    acme->dir_max_age = MD_ACME_DIR_MAX_AGE;
     
     if (APR_SUCCESS != (rv = apr_uri_parse(p, url, &uri_parsed))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "parsing ACME uri: %s", url);
@@ -664,6 +1140,147 @@ typedef struct {
     md_result_t *result;
 } update_dir_ctx;
 
+static apr_status_t dir_from_json(md_acme_t *acme, md_json_t *json, md_result_t *result);
+
+/**************************************************************************************************/
+/* directory cache */
+
+static const char *dir_cache_name(md_acme_t *acme, apr_pool_t *p)
+{
+    md_data_t data;
+    const char *hex;
+    
+    MD_DATA_SET_STR(&data, acme->url);
+    if (APR_SUCCESS != md_crypt_sha256_digest_hex(&hex, p, &data)) return NULL;
+    /* does not match the pattern of account names in the same group */
+    return apr_psprintf(p, "DIR-%s-%.16s", acme->sname, hex);
+}
+
+/* How long the CA allows its directory to be kept: 0 for not at all and -1 
+ * when it does not say. CAs send "max-age=0, no-cache" so that browsers 
+ * check for changes. We detect changes by failing requests, so that is
+ * taken as saying nothing. */
+static apr_interval_time_t dir_cache_max_age(apr_table_t *headers, apr_pool_t *p)
+{
+    const char *cc, *s;
+    char *lcc, *c;
+    apr_int64_t n;
+    
+    if (!headers || !(cc = apr_table_get(headers, "Cache-Control"))) return -1;
+    lcc = apr_pstrdup(p, cc);
+    for (c = lcc; *c; ++c) *c = (char)apr_tolower(*c);
+    if (strstr(lcc, "no-store") || strstr(lcc, "private")) return 0;
+    if ((s = strstr(lcc, "max-age="))) {
+        n = apr_atoi64(s + sizeof("max-age=") - 1);
+        if (n > 0) return apr_time_from_sec(n);
+    }
+    return -1;
+}
+
+static void dir_cache_save(md_acme_t *acme, md_json_t *json, apr_table_t *headers, 
+                           apr_pool_t *p)
+{
+    md_json_t *jcache;
+    apr_interval_time_t max_age, cc_max_age;
+    const char *name;
+    apr_status_t rv;
+    
+    max_age = acme->dir_max_age;
+    cc_max_age = dir_cache_max_age(headers, p);
+    if (cc_max_age == 0) goto leave;
+    if (cc_max_age > 0 && cc_max_age < max_age) max_age = cc_max_age;
+    if (!(name = dir_cache_name(acme, p))) goto leave;
+    
+    jcache = md_json_create(p);
+    md_json_sets(acme->url, jcache, MD_KEY_URL, NULL);
+    md_json_set_time(apr_time_now() + max_age, jcache, MD_KEY_UNTIL, NULL);
+    md_json_setj(json, jcache, MD_KEY_DIRECTORY, NULL);
+    rv = md_store_save(acme->store, p, MD_SG_ACCOUNTS, name, MD_FN_ACME_DIR, 
+                       MD_SV_JSON, jcache, 0);
+    md_log_perror(MD_LOG_MARK, (APR_SUCCESS == rv)? MD_LOG_DEBUG : MD_LOG_WARNING, rv, p, 
+                  "caching directory of %s for %s", acme->url, 
+                  md_duration_print(p, max_age));
+leave:
+    return;
+}
+
+static apr_status_t dir_cache_load(md_acme_t *acme)
+{
+    md_json_t *jcache, *json;
+    md_result_t *result;
+    apr_pool_t *ptemp;
+    const char *name, *url;
+    apr_time_t until, now;
+    apr_status_t rv;
+    
+    rv = apr_pool_create(&ptemp, acme->p);
+    if (APR_SUCCESS != rv) return rv;
+    
+    rv = APR_ENOENT;
+    if (!(name = dir_cache_name(acme, ptemp))) goto leave;
+    if (APR_SUCCESS != md_store_load_json(acme->store, MD_SG_ACCOUNTS, name, MD_FN_ACME_DIR, 
+                                          &jcache, ptemp)) goto leave;
+    url = md_json_gets(jcache, MD_KEY_URL, NULL);
+    if (!url || strcmp(url, acme->url)) goto leave;
+    /* a cache written with a longer max age than configured now is expired as well */
+    now = apr_time_now();
+    until = md_json_get_time(jcache, MD_KEY_UNTIL, NULL);
+    if (until <= now || until > now + acme->dir_max_age) goto leave;
+    if (!(json = md_json_getj(jcache, MD_KEY_DIRECTORY, NULL))) goto leave;
+    
+    result = md_result_make(ptemp, APR_SUCCESS);
+    rv = dir_from_json(acme, json, result);
+    if (APR_SUCCESS != rv) {
+        acme->version = MD_ACME_VERSION_UNKNOWN;
+        goto leave;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "using cached directory of %s, "
+                  "valid for %s", acme->url, md_duration_print(ptemp, until - now));
+leave:
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+void md_acme_set_dir_cache(md_acme_t *acme, md_store_t *store, apr_interval_time_t max_age)
+{
+    acme->store = store;
+    acme->dir_max_age = max_age;
+}
+
+void md_acme_dir_invalidate(md_acme_t *acme)
+{
+    const char *name;
+    
+    if (acme->store && (name = dir_cache_name(acme, acme->p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, 
+                      "directory of %s may have changed, removing cached copy", acme->url);
+        md_store_remove(acme->store, MD_SG_ACCOUNTS, name, MD_FN_ACME_DIR, acme->p, 1);
+    }
+}
+
+/* If the CA answers a request to one of its directory urls with "not there",
+ * the directory has probably changed. */ 
+static void dir_check_changed(md_acme_t *acme, const char *url, int status)
+{
+    int changed = 0;
+    
+    if (status != 404 && status != 405) return;
+    if (MD_ACME_VERSION_MAJOR(acme->version) > 1) {
+        changed = (acme->api.v2.new_account && !strcmp(url, acme->api.v2.new_account))
+            || (acme->api.v2.new_order && !strcmp(url, acme->api.v2.new_order))
+            || (acme->api.v2.revoke_cert && !strcmp(url, acme->api.v2.revoke_cert))
+            || (acme->api.v2.key_change && !strcmp(url, acme->api.v2.key_change))
+            || (acme->api.v2.new_nonce && !strcmp(url, acme->api.v2.new_nonce));
+    }
+    else if (MD_ACME_VERSION_MAJOR(acme->version) == 1) {
+        changed = (acme->api.v1.new_authz && !strcmp(url, acme->api.v1.new_authz))
+            || (acme->api.v1.new_cert && !strcmp(url, acme->api.v1.new_cert))
+            || (acme->api.v1.new_reg && !strcmp(url, acme->api.v1.new_reg))
+            || (acme->api.v1.revoke_cert && !strcmp(url, acme->api.v1.revoke_cert));
+    }
+    if (changed) md_acme_dir_invalidate(acme);
+}
+
 static apr_status_t update_directory(const md_http_response_t *res, void *data)
 {
     md_http_request_t *req = res->req;
@@ -704,6 +1321,19 @@ static apr_status_t update_directory(const md_http_response_t *res, void *data)
                       "response: %s", s ? s : "<failed to serialize!>");
     }
     
+    rv = dir_from_json(acme, json, result);
+    if (APR_SUCCESS == rv && acme->store && acme->dir_max_age > 0) {
+        dir_cache_save(acme, json, res->headers, req->pool);
+    }
+leave:
+    return rv;
+}
+
+static apr_status_t dir_from_json(md_acme_t *acme, md_json_t *json, md_result_t *result)
+{
+    apr_status_t rv = APR_SUCCESS;
+    const char *s;
+    
     /* What have we got? */
     if ((s = md_json_dups(acme->p, json, "new-authz", NULL))) {
         acme->api.v1.new_authz = s;
@@ -743,7 +1373,6 @@ static apr_status_t update_directory(const md_http_response_t *res, void *data)
         md_result_log(result, MD_LOG_WARNING);
         rv = result->status;
     }
-leave:
     return rv;
 }
 
@@ -762,10 +1391,15 @@ apr_status_t md_acme_setup(md_acme_t *acme, md_result_t *result)
     /* TODO: maybe this should be configurable. Let's take some reasonable 
      * defaults for now that protect our client */
     md_http_set_response_limit(acme->http, 1024*1024);
+    md_http_set_http2(acme->http, 1);
     md_http_set_timeout_default(acme->http, apr_time_from_sec(10 * 60));
     md_http_set_connect_timeout_default(acme->http, apr_time_from_sec(30));
     md_http_set_stalling_default(acme->http, 10, apr_time_from_sec(30));
     
+    if (acme->store && acme->dir_max_age > 0 && APR_SUCCESS == dir_cache_load(acme)) {
+        return APR_SUCCESS;
+    }
+    
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, acme->p, "get directory from %s", acme->url);
     
     ctx.acme = acme;
@@ -24,6 +24,7 @@ struct apr_hash_t;
 struct md_http_t;
 struct md_json_t;
 struct md_pkey_t;
+struct md_pkey_spec_t;
 struct md_t;
 struct md_acme_acct_t;
 struct md_acmev2_acct_t;
@@ -41,6 +42,49 @@ struct md_result_t;
 
 #define MD_ACME_VERSION_MAJOR(i)    (((i)&0xFF0000) >> 16)
 
+/* Max number of unused nonces an md_acme_t keeps */
+#define MD_ACME_NONCES_MAX          16
+
+/* Default for how long the directory of a CA is cached in the store */
+#define MD_ACME_DIR_MAX_AGE         apr_time_from_sec(MD_SECS_PER_DAY)
+
+#define MD_FN_ACME_DIR              "directory.json"
+
+/* Default request rate per second and burst size we allow us per CA */
+#define MD_ACME_CA_RATE             10
+#define MD_ACME_CA_BURST            20
+/* Longest time a Retry-After of one request holds back everyone else at the CA */
+#define MD_ACME_CA_BLOCK_MAX        apr_time_from_sec(MD_SECS_PER_HOUR)
+
+/**
+ * Request limits per ACME CA, shared by all md_acme_t instances that are given
+ * the same md_acme_limits_t, e.g. all MDs renewed in a process. Each CA has a
+ * token bucket for the rate of requests and remembers until when it asked us,
+ * via Retry-After, to stay away. Thread safe.
+ */
+typedef struct md_acme_limits_t md_acme_limits_t;
+
+apr_status_t md_acme_limits_create(md_acme_limits_t **plimits, apr_pool_t *p,
+                                   int rate, int burst);
+
+/**
+ * Take a token for sending a request to the CA, waiting for one when the
+ * bucket is empty.
+ * @return APR_EAGAIN and the time to try again if the CA is not to be contacted now
+ */
+apr_status_t md_acme_limits_acquire(md_acme_limits_t *limits, const char *ca_url,
+                                    apr_time_t *pretry_at);
+
+/**
+ * Do not send requests to the CA before the given time.
+ */
+void md_acme_limits_block(md_acme_limits_t *limits, const char *ca_url, apr_time_t until);
+
+/**
+ * Time until which requests to the CA are held back, or 0.
+ */
+apr_time_t md_acme_limits_blocked_until(md_acme_limits_t *limits, const char *ca_url);
+
 typedef enum {
     MD_ACME_S_UNKNOWN,              /* MD has not been analysed yet */
     MD_ACME_S_REGISTERED,           /* MD is registered at CA, but not more */
@@ -100,7 +144,7 @@ struct md_acme_t {
     
     const char *acct_id;            /* local storage id account was loaded from or NULL */
     struct md_acme_acct_t *acct;    /* account at ACME server to use for requests */
-    struct md_pkey_t *acct_key;     /* private RSA key belonging to account */
+    struct md_pkey_t *acct_key;     /* private key belonging to account */
     
     int version;                    /* as detected from the server */
     union {
@@ -127,9 +171,15 @@ struct md_acme_t {
     md_acme_post_fn *post_new_account_fn;
     
     struct md_http_t *http;
+    struct md_store_t *store;       /* where the directory is cached or NULL */
+    apr_interval_time_t acct_check_interval; /* min time between account validations */
+    struct md_pkey_spec_t *acct_pkey_spec;   /* keys of new accounts, NULL for RSA default */
+    apr_interval_time_t dir_max_age; /* max time a cached directory is used */
     
-    const char *nonce;
+    md_acme_limits_t *limits;       /* request limits shared per CA or NULL */
+    struct apr_array_header_t *nonces; /* unused nonces, most recent last */
     int max_retries;
+    int max_parallel;               /* max requests in flight in md_acme_multi_perform() */
     struct md_result_t *last;      /* result of last request */
 };
 
@@ -160,6 +210,20 @@ apr_status_t md_acme_setup(md_acme_t *acme, struct md_result_t *result);
 
 void md_acme_report_result(md_acme_t *acme, apr_status_t rv, struct md_result_t *result);
 
+/**
+ * Have md_acme_setup() take the directory of the CA from store while it is younger than
+ * max_age, or younger than what the CA allows in its Cache-Control header. A fetched
+ * directory is saved to the store. A max_age of 0 disables the cache.
+ */
+void md_acme_set_dir_cache(md_acme_t *acme, struct md_store_t *store, 
+                           apr_interval_time_t max_age);
+
+/**
+ * Remove the cached directory of the CA, so that the next md_acme_setup() fetches it.
+ * This happens when the CA answers 404 or 405 on one of the directory urls.
+ */
+void md_acme_dir_invalidate(md_acme_t *acme);
+
 /**************************************************************************************************/
 /* account handling */
 
@@ -277,6 +341,36 @@ apr_status_t md_acme_POST(md_acme_t *acme, const char *url,
                           md_acme_req_err_cb *on_err,
                           void *baton);
 
+/**
+ * Create a request for sending it later with md_acme_multi_perform(). The request
+ * is prepared, e.g. signed with a nonce, only when it is sent.
+ * Callbacks are as in md_acme_POST(). A GET becomes a POST-as-GET on ACMEv2.
+ * 
+ * @return the request or NULL on allocation failure
+ */
+md_acme_req_t *md_acme_req_make(md_acme_t *acme, const char *method, const char *url,
+                                md_acme_req_init_cb *on_init,
+                                md_acme_req_json_cb *on_json,
+                                md_acme_req_res_cb *on_res,
+                                md_acme_req_err_cb *on_err,
+                                void *baton);
+
+/**
+ * Send all requests in reqs (md_acme_req_t*), at most acme->max_parallel of them
+ * at the same time. Each request gets its own nonce when it is being signed, so
+ * no nonce is ever used twice, and requests failing on a bad nonce are signed
+ * again and requeued.
+ * 
+ * All requests are done afterwards and may no longer be used. 
+ * 
+ * @param acme        the ACME server to talk to
+ * @param reqs        array of md_acme_req_t* made by md_acme_req_make()
+ * @param rvs         if not NULL, receives the status of each request
+ * @return APR_SUCCESS if all requests succeeded, the first failure otherwise
+ */
+apr_status_t md_acme_multi_perform(md_acme_t *acme, struct apr_array_header_t *reqs,
+                                   apr_status_t *rvs);
+
 /**
  * Retrieve a JSON resource from the ACME server 
  */
@@ -167,6 +167,181 @@ out:
     return rv;
 }
 
+/**************************************************************************************************/
+/* account index */
+
+/* The index lists all accounts with their CA url, contacts and when they were last
+ * validated at the CA. It saves looking at all accounts when searching one and 
+ * talking to the CA each time an account is used. The accounts themselves 
+ * remain the authority, an index entry not matching its account is dropped. */
+
+typedef struct {
+    const char *id;
+    const char *ca_url;
+    const char *url;
+    apr_array_header_t *contacts;
+    int valid;
+    apr_time_t validated;
+} acct_idx_entry_t;
+
+static apr_status_t idx_entry_from_json(void **pvalue, md_json_t *json, apr_pool_t *p, 
+                                        void *baton)
+{
+    acct_idx_entry_t *e;
+    
+    (void)baton;
+    *pvalue = NULL;
+    e = apr_pcalloc(p, sizeof(*e));
+    e->id = md_json_dups(p, json, MD_KEY_ID, NULL);
+    e->ca_url = md_json_dups(p, json, MD_KEY_CA_URL, NULL);
+    if (!e->id || !e->ca_url) return APR_ENOENT;
+    e->url = md_json_dups(p, json, MD_KEY_URL, NULL);
+    e->contacts = apr_array_make(p, 3, sizeof(const char*));
+    md_json_dupsa(e->contacts, p, json, MD_KEY_CONTACT, NULL);
+    e->valid = md_json_getb(json, MD_KEY_VALID, NULL);
+    e->validated = md_json_get_time(json, MD_KEY_VALIDATED, NULL);
+    *pvalue = e;
+    return APR_SUCCESS;
+}
+
+static apr_status_t idx_entry_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    acct_idx_entry_t *e = value;
+    
+    (void)p;
+    (void)baton;
+    if (!e->id) return APR_ENOENT; /* dropped */
+    md_json_sets(e->id, json, MD_KEY_ID, NULL);
+    md_json_sets(e->ca_url, json, MD_KEY_CA_URL, NULL);
+    if (e->url) md_json_sets(e->url, json, MD_KEY_URL, NULL);
+    if (e->contacts) md_json_setsa(e->contacts, json, MD_KEY_CONTACT, NULL);
+    md_json_setb(e->valid, json, MD_KEY_VALID, NULL);
+    if (e->validated > 0) md_json_set_time(e->validated, json, MD_KEY_VALIDATED, NULL);
+    return APR_SUCCESS;
+}
+
+static void idx_entry_set(acct_idx_entry_t *e, const char *id, md_acme_acct_t *acct, 
+                          apr_pool_t *p)
+{
+    e->id = apr_pstrdup(p, id);
+    e->ca_url = apr_pstrdup(p, acct->ca_url);
+    e->url = acct->url? apr_pstrdup(p, acct->url) : NULL;
+    e->contacts = acct->contacts? apr_array_copy(p, acct->contacts) : NULL;
+    e->valid = (MD_ACME_ACCT_ST_VALID == acct->status);
+}
+
+static int idx_collect(void *baton, const char *name, const char *aspect,
+                       md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    apr_array_header_t *entries = baton;
+    md_acme_acct_t *acct;
+    acct_idx_entry_t *e;
+    
+    (void)aspect;
+    if (MD_SV_JSON == vtype 
+        && APR_SUCCESS == md_acme_acct_from_json(&acct, value, ptemp)) {
+        e = apr_pcalloc(entries->pool, sizeof(*e));
+        idx_entry_set(e, name, acct, entries->pool);
+        APR_ARRAY_PUSH(entries, acct_idx_entry_t*) = e;
+    }
+    return 1;
+}
+
+static apr_status_t idx_save(md_store_t *store, apr_array_header_t *entries, apr_pool_t *p)
+{
+    md_json_t *json;
+    
+    json = md_json_create(p);
+    md_json_seta(entries, idx_entry_to_json, NULL, json, MD_KEY_ACCOUNTS, NULL);
+    return md_store_save(store, p, MD_SG_ACCOUNTS, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, 
+                         MD_SV_JSON, json, 0);
+}
+
+/* Load the index, creating it from the accounts in the store if there is none. */
+static apr_status_t idx_load(apr_array_header_t **pentries, md_store_t *store, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    md_json_t *json;
+    apr_status_t rv;
+    
+    entries = apr_array_make(p, 5, sizeof(acct_idx_entry_t*));
+    rv = md_store_load_json(store, MD_SG_ACCOUNTS, MD_ACCT_INDEX_NAME, MD_FN_ACCT_INDEX, 
+                            &json, p);
+    if (APR_SUCCESS == rv) {
+        rv = md_json_geta(entries, idx_entry_from_json, NULL, json, MD_KEY_ACCOUNTS, NULL);
+        if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "creating account index");
+        rv = md_store_iter(idx_collect, entries, store, p, MD_SG_ACCOUNTS, "*", 
+                           MD_FN_ACCOUNT, MD_SV_JSON);
+        if (APR_SUCCESS == rv) idx_save(store, entries, p);
+    }
+    *pentries = (APR_SUCCESS == rv)? entries : NULL;
+    return rv;
+}
+
+static acct_idx_entry_t *idx_get(apr_array_header_t *entries, const char *id)
+{
+    acct_idx_entry_t *e;
+    int i;
+    
+    for (i = 0; i < entries->nelts; ++i) {
+        e = APR_ARRAY_IDX(entries, i, acct_idx_entry_t*);
+        if (e->id && !strcmp(id, e->id)) return e;
+    }
+    return NULL;
+}
+
+/* Update the index entry of account id. With acct NULL, only set the 
+ * validation time. */
+static void idx_update(md_store_t *store, apr_pool_t *p, const char *id, 
+                       md_acme_acct_t *acct, apr_time_t validated)
+{
+    apr_array_header_t *entries;
+    acct_idx_entry_t *e;
+    
+    if (APR_SUCCESS != idx_load(&entries, store, p)) return;
+    if (!(e = idx_get(entries, id))) {
+        if (!acct) return;
+        e = apr_pcalloc(p, sizeof(*e));
+        APR_ARRAY_PUSH(entries, acct_idx_entry_t*) = e;
+    }
+    if (acct) idx_entry_set(e, id, acct, p);
+    if (validated > 0) e->validated = validated;
+    idx_save(store, entries, p);
+}
+
+static int idx_check_due(md_acme_t *acme, apr_time_t validated)
+{
+    apr_time_t now = apr_time_now();
+    
+    return (acme->acct_check_interval <= 0 || validated <= 0 || validated > now
+            || (now - validated) >= acme->acct_check_interval);
+}
+
+apr_status_t md_acme_acct_check(md_acme_t *acme, md_store_t *store, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    acct_idx_entry_t *e;
+    apr_status_t rv;
+    
+    if (!acme->acct) return APR_EINVAL;
+    if (acme->acct_id && acme->acct_check_interval > 0
+        && APR_SUCCESS == idx_load(&entries, store, p)
+        && (e = idx_get(entries, acme->acct_id)) && e->valid 
+        && !idx_check_due(acme, e->validated)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "account %s was validated %s ago", 
+                      acme->acct_id, md_duration_print(p, apr_time_now() - e->validated));
+        return APR_SUCCESS;
+    }
+    rv = md_acme_acct_validate(acme, store, p);
+    if (APR_SUCCESS == rv && acme->acct_id) {
+        idx_update(store, p, acme->acct_id, NULL, apr_time_now());
+    }
+    return rv;
+}
+
 apr_status_t md_acme_acct_save(md_store_t *store, apr_pool_t *p, md_acme_t *acme, 
                                const char **pid, md_acme_acct_t *acct, md_pkey_t *acct_key)
 {
@@ -190,6 +365,9 @@ apr_status_t md_acme_acct_save(md_store_t *store, apr_pool_t *p, md_acme_t *acme
         if (pid) *pid = id;
         rv = md_store_save(store, p, MD_SG_ACCOUNTS, id, MD_FN_ACCT_KEY, MD_SV_PKEY, acct_key, 0);
     }
+    if (APR_SUCCESS == rv && acct->ca_url) {
+        idx_update(store, p, id, acct, 0);
+    }
     return rv;
 }
 
@@ -320,15 +498,75 @@ static apr_status_t acct_find_and_verify(md_store_t *store, md_store_group_t gro
     return rv;
 }
 
-apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store)
+/* Find a valid account for the CA via the index, preferring ones with the given
+ * contacts. Accounts validated within acme->acct_check_interval are not validated
+ * again. */
+static apr_status_t acct_find_indexed(md_acme_t *acme, md_store_t *store, 
+                                      apr_array_header_t *contacts, apr_pool_t *p)
 {
+    apr_array_header_t *entries;
+    acct_idx_entry_t *e;
+    md_acme_acct_t *acct;
+    md_pkey_t *pkey;
     apr_status_t rv;
-    
-    while (APR_EAGAIN == (rv = acct_find_and_verify(store, MD_SG_ACCOUNTS, 
-                                                    mk_acct_pattern(acme->p, acme), 
-                                                    acme, acme->p))) {
-        /* nop */
+    int i, pass, dirty = 0;
+    
+    if (APR_SUCCESS != (rv = idx_load(&entries, store, p))) goto leave;
+    
+    rv = APR_ENOENT;
+    for (pass = (contacts && contacts->nelts)? 0 : 1; pass < 2; ++pass) {
+        for (i = 0; i < entries->nelts; ++i) {
+            e = APR_ARRAY_IDX(entries, i, acct_idx_entry_t*);
+            if (!e->id || !e->valid || strcmp(acme->url, e->ca_url)) continue;
+            if (!pass && (!e->contacts || !md_array_str_eq(contacts, e->contacts, 0))) continue;
+            
+            if (APR_SUCCESS != md_acme_acct_load(&acct, &pkey, store, MD_SG_ACCOUNTS, 
+                                                 e->id, acme->p)
+                || MD_ACME_ACCT_ST_VALID != acct->status
+                || !acct->ca_url || strcmp(acme->url, acct->ca_url)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                              "account %s does not match its index entry", e->id);
+                e->id = NULL;
+                dirty = 1;
+                continue;
+            }
+            
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "found account %s for %s", 
+                          e->id, acme->url);
+            acme->acct_id = apr_pstrdup(acme->p, e->id);
+            acme->acct = acct;
+            acme->acct_key = pkey;
+            if (!idx_check_due(acme, e->validated)) {
+                rv = APR_SUCCESS;
+                goto leave;
+            }
+            rv = md_acme_acct_validate(acme, NULL, p);
+            if (APR_SUCCESS == rv) {
+                e->validated = apr_time_now();
+                dirty = 1;
+                goto leave;
+            }
+            acme->acct_id = NULL;
+            acme->acct = NULL;
+            acme->acct_key = NULL;
+            if (!APR_STATUS_IS_ENOENT(rv)) goto leave;
+            /* CA no longer knows the account, look for another */
+            e->valid = 0;
+            dirty = 1;
+            rv = APR_ENOENT;
+        }
     }
+leave:
+    if (dirty) idx_save(store, entries, p);
+    return rv;
+}
+
+apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store, 
+                               apr_array_header_t *contacts)
+{
+    apr_status_t rv;
+    
+    rv = acct_find_indexed(acme, store, contacts, acme->p);
     
     if (APR_STATUS_IS_ENOENT(rv)) {
         /* No suitable account found in MD_SG_ACCOUNTS. Maybe a new account
@@ -585,8 +823,13 @@ apr_status_t md_acme_acct_register(md_acme_t *acme, md_store_t *store, apr_pool_
     
     /* If we still have no key, generate a new one */
     if (!acme->acct_key) {
-        spec.type = MD_PKEY_TYPE_RSA;
-        spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
+        if (acme->acct_pkey_spec) {
+            spec = *acme->acct_pkey_spec;
+        }
+        else {
+            spec.type = MD_PKEY_TYPE_RSA;
+            spec.params.rsa.bits = MD_ACME_ACCT_PKEY_BITS;
+        }
         
         if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, acme->p, &spec))) goto out;
         acme->acct_key = pkey;
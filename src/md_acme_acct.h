@@ -49,6 +49,11 @@ struct md_acme_acct_t {
 
 #define MD_FN_ACCOUNT           "account.json"
 #define MD_FN_ACCT_KEY          "account.pem"
+#define MD_FN_ACCT_INDEX        "index.json"
+#define MD_ACCT_INDEX_NAME      "INDEX"
+
+/* Default for how long a validated account is used without asking the CA again */
+#define MD_ACME_ACCT_CHECK_DEF  apr_time_from_sec(MD_SECS_PER_DAY)
 
 /* ACME account private keys are always RSA and have that many bits. Since accounts
  * are expected to live long, better err on the safe side. */
@@ -74,6 +79,12 @@ apr_status_t md_acme_acct_update(md_acme_t *acme);
  */
 apr_status_t md_acme_acct_validate(md_acme_t *acme, md_store_t *store, apr_pool_t *p);
 
+/**
+ * Validate the current account like md_acme_acct_validate(), unless the account
+ * index in store says this was done less than acme->acct_check_interval ago.
+ */
+apr_status_t md_acme_acct_check(md_acme_t *acme, md_store_t *store, apr_pool_t *p);
+
 /**
  * Agree to the given Terms-of-Service url for the current account.
  */
@@ -102,9 +113,11 @@ const char *md_acme_get_agreement(md_acme_t *acme);
 
 /** 
  * Find an existing account in the local store. On APR_SUCCESS, the acme
- * instance will have a current, validated account to use.
+ * instance will have a current, validated account to use. An account with
+ * the given contacts is preferred, if there are any.
  */ 
-apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store);
+apr_status_t md_acme_find_acct(md_acme_t *acme, md_store_t *store, 
+                               apr_array_header_t *contacts);
 
 /**
  * Find the account id for a given account url. 
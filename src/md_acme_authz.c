@@ -162,28 +162,25 @@ static int copy_challenge_error(void *baton, size_t index, md_json_t *json)
     return 1;
 }
 
-apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+static void authz_reset(md_acme_authz_t *authz)
+{
+    authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
+    authz->error_type = authz->error_detail = NULL;
+    authz->error_subproblems = NULL;
+}
+
+/* Update the authz from the JSON retrieved from the server with status rv. */
+static apr_status_t authz_update_from(md_acme_authz_t *authz, md_json_t *json, 
+                                      apr_status_t rv, apr_pool_t *p)
 {
-    md_json_t *json;
     const char *s, *err;
     md_log_level_t log_level;
-    apr_status_t rv;
     error_ctx_t ctx;
     
-    assert(acme);
-    assert(acme->http);
-    assert(authz);
-    assert(authz->url);
-
-    authz->state = MD_ACME_AUTHZ_S_UNKNOWN;
-    json = NULL;
-    authz->error_type = authz->error_detail = NULL;
-    authz->error_subproblems = NULL;
     err = "unable to parse response";
     log_level = MD_LOG_ERR;
     
-    if (APR_SUCCESS == (rv = md_acme_get_json(&json, acme, authz->url, p))
-        && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
+    if (APR_SUCCESS == rv && json && (s = md_json_gets(json, MD_KEY_STATUS, NULL))) {
             
         authz->domain = md_json_gets(json, MD_KEY_IDENTIFIER, MD_KEY_VALUE, NULL); 
         authz->resource = json;
@@ -220,6 +217,84 @@ apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_p
     return rv;
 }
 
+apr_status_t md_acme_authz_update(md_acme_authz_t *authz, md_acme_t *acme, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_status_t rv;
+    
+    assert(acme);
+    assert(acme->http);
+    assert(authz);
+    assert(authz->url);
+
+    authz_reset(authz);
+    json = NULL;
+    rv = md_acme_get_json(&json, acme, authz->url, p);
+    return authz_update_from(authz, json, rv, p);
+}
+
+typedef struct {
+    apr_pool_t *p;
+    md_json_t *json;
+} authz_json_ctx;
+
+static apr_status_t on_authz_json(md_acme_t *acme, apr_pool_t *p, const apr_table_t *hdrs, 
+                                  md_json_t *body, void *baton)
+{
+    authz_json_ctx *ctx = baton;
+    
+    (void)acme;
+    (void)p;
+    (void)hdrs;
+    ctx->json = md_json_clone(ctx->p, body);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_acme_authz_retrieve_all(md_acme_t *acme, apr_pool_t *p, 
+                                        apr_array_header_t *urls, 
+                                        md_acme_authz_t **authzs, apr_status_t *rvs)
+{
+    apr_array_header_t *reqs;
+    authz_json_ctx *ctxs;
+    md_acme_authz_t *authz;
+    md_acme_req_t *req;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    if (urls->nelts <= 0) goto leave;
+    
+    for (i = 0; i < urls->nelts; ++i) {
+        authzs[i] = NULL;
+        rvs[i] = APR_ENOMEM;
+    }
+    reqs = apr_array_make(p, urls->nelts, sizeof(md_acme_req_t*));
+    ctxs = apr_pcalloc(p, (apr_size_t)urls->nelts * sizeof(*ctxs));
+    for (i = 0; i < urls->nelts; ++i) {
+        ctxs[i].p = p;
+        req = md_acme_req_make(acme, "GET", APR_ARRAY_IDX(urls, i, const char*), 
+                               NULL, on_authz_json, NULL, NULL, &ctxs[i]);
+        if (!req) {
+            rv = APR_ENOMEM;
+            goto leave;
+        }
+        APR_ARRAY_PUSH(reqs, md_acme_req_t*) = req;
+    }
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "retrieving %d authz resources", urls->nelts);
+    md_acme_multi_perform(acme, reqs, rvs);
+    
+    for (i = 0; i < urls->nelts; ++i) {
+        authz = apr_pcalloc(p, sizeof(*authz));
+        authz->url = apr_pstrdup(p, APR_ARRAY_IDX(urls, i, const char*));
+        authz_reset(authz);
+        rvs[i] = authz_update_from(authz, ctxs[i].json, rvs[i], p);
+        authzs[i] = (APR_SUCCESS == rvs[i])? authz : NULL;
+        if (APR_SUCCESS == rv) rv = rvs[i];
+    }
+leave:
+    return rv;
+}
+
 /**************************************************************************************************/
 /* response to a challenge */
 
@@ -271,6 +346,24 @@ static apr_status_t authz_http_set(md_acme_t *acme, apr_pool_t *p, const apr_tab
     return APR_SUCCESS;
 }
 
+/* Tell the ACME server that the challenge is ready for verification. With pnotify given,
+ * the request is only made and passed to the caller for sending. */
+static apr_status_t cha_notify(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
+                               md_acme_t *acme, apr_pool_t *p, md_acme_req_t **pnotify)
+{
+    authz_req_ctx *ctx;
+    
+    ctx = apr_pcalloc(p, sizeof(*ctx));
+    authz_req_ctx_init(ctx, acme, NULL, authz, p);
+    ctx->challenge = cha;
+    if (!pnotify) {
+        return md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, ctx);
+    }
+    *pnotify = md_acme_req_make(acme, "POST", cha->uri, on_init_authz_resp, 
+                                authz_http_set, NULL, NULL, ctx);
+    return *pnotify? APR_SUCCESS : APR_ENOMEM;
+}
+
 static apr_status_t setup_key_authz(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
                                     md_acme_t *acme, apr_pool_t *p, int *pchanged)
 {
@@ -298,19 +391,33 @@ static apr_status_t setup_key_authz(md_acme_authz_cha_t *cha, md_acme_authz_t *a
     return rv;
 }
 
+typedef struct {
+    md_acme_authz_cha_t *cha;
+    md_acme_authz_t *authz;
+    const char *token;
+} batch_item_t;
+
+struct md_acme_cha_batch_t {
+    apr_pool_t *p;
+    const char *dns01_cmd;             /* command if dns-01 is batched, otherwise NULL */
+    apr_array_header_t *dns01;         /* batch_item_t of deferred dns-01 setups */
+};
+
 static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz, 
                                       md_acme_t *acme, md_store_t *store, 
                                       md_pkey_spec_t *key_spec, 
                                       apr_array_header_t *acme_tls_1_domains, 
-                                      apr_table_t *env, apr_pool_t *p)
+                                      apr_table_t *env, apr_pool_t *p, 
+                                      md_acme_req_t **pnotify, md_acme_cha_batch_t *batch)
 {
     const char *data;
     apr_status_t rv;
-    int notify_server;
+    int notify_server, created;
     
     (void)key_spec;
     (void)env;
     (void)acme_tls_1_domains;
+    (void)batch;
     if (APR_SUCCESS != (rv = setup_key_authz(cha, authz, acme, p, &notify_server))) {
         goto out;
     }
@@ -318,19 +425,19 @@ static apr_status_t cha_http_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t
     rv = md_store_load(store, MD_SG_CHALLENGES, authz->domain, MD_FN_HTTP01,
                        MD_SV_TEXT, (void**)&data, p);
     if ((APR_SUCCESS == rv && strcmp(cha->key_authz, data)) || APR_STATUS_IS_ENOENT(rv)) {
+        created = APR_STATUS_IS_ENOENT(rv);
         rv = md_store_save(store, p, MD_SG_CHALLENGES, authz->domain, MD_FN_HTTP01,
                            MD_SV_TEXT, (void*)cha->key_authz, 0);
+        if (APR_SUCCESS == rv && created) {
+            md_store_journal_add(store, p, MD_SG_CHALLENGES, authz->domain, MD_FN_HTTP01);
+        }
         notify_server = 1;
     }
     
     if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
-
         /* challenge is setup or was changed from previous data, tell ACME server
          * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+        rv = cha_notify(cha, authz, acme, p, pnotify);
     }
 out:
     return rv;
@@ -340,16 +447,18 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
                                           md_acme_t *acme, md_store_t *store, 
                                           md_pkey_spec_t *key_spec,  
                                           apr_array_header_t *acme_tls_1_domains, 
-                                          apr_table_t *env, apr_pool_t *p)
+                                          apr_table_t *env, apr_pool_t *p, 
+                                          md_acme_req_t **pnotify, md_acme_cha_batch_t *batch)
 {
     md_cert_t *cha_cert;
     md_pkey_t *cha_key;
     const char *acme_id, *token;
     apr_status_t rv;
-    int notify_server;
+    int notify_server, created;
     md_data_t data;
     
     (void)env;
+    (void)batch;
     if (md_array_str_index(acme_tls_1_domains, authz->domain, 0, 0) < 0) {
         rv = APR_ENOTIMPL;
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
@@ -365,6 +474,7 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
     if ((APR_SUCCESS == rv && !md_cert_covers_domain(cha_cert, authz->domain)) 
         || APR_STATUS_IS_ENOENT(rv)) {
         
+        created = APR_STATUS_IS_ENOENT(rv);
         if (APR_SUCCESS != (rv = md_pkey_gen(&cha_key, p, key_spec))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: create tls-alpn-01 challenge key",
                           authz->domain);
@@ -396,17 +506,17 @@ static apr_status_t cha_tls_alpn_01_setup(md_acme_authz_cha_t *cha, md_acme_auth
             rv = md_store_save(store, p, MD_SG_CHALLENGES, authz->domain, MD_FN_TLSALPN01_CERT,
                                MD_SV_CERT, (void*)cha_cert, 0);
         }
+        if (APR_SUCCESS == rv && created) {
+            md_store_journal_add(store, p, MD_SG_CHALLENGES, authz->domain, 
+                                 MD_FN_TLSALPN01_CERT);
+        }
         notify_server = 1;
     }
     
     if (APR_SUCCESS == rv && notify_server) {
-        authz_req_ctx ctx;
-
         /* challenge is setup or was changed from previous data, tell ACME server
          * so it may (re)try verification */        
-        authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-        ctx.challenge = cha;
-        rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+        rv = cha_notify(cha, authz, acme, p, pnotify);
     }
 out:    
     return rv;
@@ -416,14 +526,14 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
                                      md_acme_t *acme, md_store_t *store, 
                                      md_pkey_spec_t *key_spec, 
                                      apr_array_header_t *acme_tls_1_domains, 
-                                     apr_table_t *env, apr_pool_t *p)
+                                     apr_table_t *env, apr_pool_t *p, 
+                                     md_acme_req_t **pnotify, md_acme_cha_batch_t *batch)
 {
     const char *token;
     const char * const *argv;
     const char *cmdline, *dns01_cmd;
     apr_status_t rv;
     int exit_code, notify_server;
-    authz_req_ctx ctx;
     md_data_t data;
     
     (void)store;
@@ -450,6 +560,18 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
         goto out;
     }
 
+    if (batch && batch->dns01_cmd) {
+        /* set up together with the other dns-01 challenges of the order
+         * in md_acme_cha_batch_run() */
+        batch_item_t *item = apr_array_push(batch->dns01);
+        item->cha = cha;
+        item->authz = authz;
+        item->token = token;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: dns-01 setup deferred to batch",
+                      authz->domain);
+        goto out;
+    }
+    
     cmdline = apr_psprintf(p, "%s setup %s %s", dns01_cmd, authz->domain, token); 
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                   "%s: dns-01 setup command: %s", authz->domain, cmdline);
@@ -468,9 +590,7 @@ static apr_status_t cha_dns_01_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *
     
     /* challenge is setup, tell ACME server so it may (re)try verification */        
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: dns-01 setup succeeded", authz->domain);
-    authz_req_ctx_init(&ctx, acme, NULL, authz, p);
-    ctx.challenge = cha;
-    rv = md_acme_POST(acme, cha->uri, on_init_authz_resp, authz_http_set, NULL, NULL, &ctx);
+    rv = cha_notify(cha, authz, acme, p, pnotify);
     
 out:    
     return rv;
@@ -504,6 +624,90 @@ out:
     return rv;
 }
 
+md_acme_cha_batch_t *md_acme_cha_batch_make(apr_table_t *env, apr_pool_t *p)
+{
+    md_acme_cha_batch_t *batch;
+    const char *s;
+    
+    batch = apr_pcalloc(p, sizeof(*batch));
+    batch->p = p;
+    if ((s = apr_table_get(env, MD_KEY_CMD_DNS01_BATCH)) && !apr_strnatcasecmp("on", s)) {
+        batch->dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
+    }
+    batch->dns01 = apr_array_make(p, 5, sizeof(batch_item_t));
+    return batch;
+}
+
+static apr_status_t dns01_exec_all(const char *dns01_cmd, const char *action, 
+                                   apr_array_header_t *args, apr_pool_t *p)
+{
+    const char * const *cmd_argv;
+    apr_array_header_t *argv;
+    char **tokens;
+    apr_status_t rv;
+    int i, exit_code;
+    
+    apr_tokenize_to_argv(dns01_cmd, &tokens, p);
+    argv = apr_array_make(p, args->nelts + 5, sizeof(const char*));
+    for (i = 0; tokens[i]; ++i) {
+        APR_ARRAY_PUSH(argv, const char*) = tokens[i];
+    }
+    APR_ARRAY_PUSH(argv, const char*) = action;
+    apr_array_cat(argv, args);
+    APR_ARRAY_PUSH(argv, const char*) = NULL;
+    cmd_argv = (const char * const *)argv->elts;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "dns-01 %s command for %d args: %s", 
+                  action, args->nelts, dns01_cmd);
+    if (APR_SUCCESS != (rv = md_util_exec(p, cmd_argv[0], cmd_argv, &exit_code))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "dns-01 %s command failed to execute", action);
+    }
+    else if (exit_code) {
+        rv = APR_EGENERAL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, p, 
+                      "dns-01 %s command returns %d", action, exit_code);
+    }
+    return rv;
+}
+
+apr_status_t md_acme_cha_batch_run(md_acme_cha_batch_t *batch, md_acme_t *acme,
+                                   apr_array_header_t *notifies, md_result_t *result)
+{
+    apr_array_header_t *args;
+    batch_item_t *item;
+    md_acme_req_t *notify;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    if (!batch || !batch->dns01->nelts) goto leave;
+    
+    args = apr_array_make(batch->p, 2 * batch->dns01->nelts, sizeof(const char*));
+    for (i = 0; i < batch->dns01->nelts; ++i) {
+        item = &APR_ARRAY_IDX(batch->dns01, i, batch_item_t);
+        APR_ARRAY_PUSH(args, const char*) = item->authz->domain;
+        APR_ARRAY_PUSH(args, const char*) = item->token;
+    }
+    md_result_activity_printf(result, "Setting up %d dns-01 challenges", batch->dns01->nelts);
+    if (APR_SUCCESS != (rv = dns01_exec_all(batch->dns01_cmd, "setup-all", args, batch->p))) {
+        md_result_printf(result, rv, "dns-01 setup command failed for %d domains", 
+                         batch->dns01->nelts);
+        goto leave;
+    }
+    
+    /* all challenges are set up, tell ACME server so it may (re)try verification */        
+    for (i = 0; i < batch->dns01->nelts; ++i) {
+        item = &APR_ARRAY_IDX(batch->dns01, i, batch_item_t);
+        notify = NULL;
+        rv = cha_notify(item->cha, item->authz, acme, batch->p, notifies? &notify : NULL);
+        if (APR_SUCCESS != rv) goto leave;
+        if (notify) APR_ARRAY_PUSH(notifies, md_acme_req_t*) = notify;
+    }
+leave:
+    if (batch) apr_array_clear(batch->dns01);
+    return rv;
+}
+
 static apr_status_t cha_teardown_dir(md_store_t *store, const char *domain, 
                                      apr_table_t *env, apr_pool_t *p)
 {
@@ -515,7 +719,8 @@ typedef apr_status_t cha_setup(md_acme_authz_cha_t *cha, md_acme_authz_t *authz,
                                md_acme_t *acme, md_store_t *store, 
                                md_pkey_spec_t *key_spec, 
                                apr_array_header_t *acme_tls_1_domains, 
-                               apr_table_t *env, apr_pool_t *p);
+                               apr_table_t *env, apr_pool_t *p, 
+                               md_acme_req_t **pnotify, md_acme_cha_batch_t *batch);
                                
 typedef apr_status_t cha_teardown(md_store_t *store, const char *domain, 
                                   apr_table_t *env, apr_pool_t *p);
@@ -568,6 +773,7 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
                                    apr_array_header_t *challenges, md_pkey_spec_t *key_spec,
                                    apr_array_header_t *acme_tls_1_domains, 
                                    apr_table_t *env, apr_pool_t *p, const char **psetup_token,
+                                   md_acme_req_t **pnotify, md_acme_cha_batch_t *batch,
                                    md_result_t *result)
 {
     apr_status_t rv;
@@ -581,6 +787,7 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
 
     fctx.p = p;
     fctx.accepted = NULL;
+    if (pnotify) *pnotify = NULL;
     
     /* Look in the order challenge types are defined:
      * - if they are offered by the CA, try to set it up
@@ -604,7 +811,7 @@ apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, md_acme_t *acme, md_s
                     md_result_activity_printf(result, "Setting up challenge '%s' for domain %s", 
                                               fctx.accepted->type, authz->domain);
                     rv = CHA_TYPES[i].setup(fctx.accepted, authz, acme, store, key_spec, 
-                                            acme_tls_1_domains, env, p);
+                                            acme_tls_1_domains, env, p, pnotify, batch);
                     if (APR_SUCCESS == rv) {
                         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
                                       "%s: set up challenge '%s'", 
@@ -648,6 +855,35 @@ out:
     return rv;
 }
 
+apr_status_t md_acme_authz_teardown_all(struct md_store_t *store, apr_array_header_t *tokens,
+                                        apr_table_t *env, apr_pool_t *p)
+{
+    apr_array_header_t *domains;
+    const char *token, *s, *dns01_cmd = NULL;
+    apr_size_t plen;
+    int i;
+    
+    if ((s = apr_table_get(env, MD_KEY_CMD_DNS01_BATCH)) && !apr_strnatcasecmp("on", s)) {
+        dns01_cmd = apr_table_get(env, MD_KEY_CMD_DNS01);
+    }
+    domains = apr_array_make(p, tokens->nelts > 0? tokens->nelts : 1, sizeof(const char*));
+    plen = strlen(MD_AUTHZ_TYPE_DNS01);
+    for (i = 0; i < tokens->nelts; ++i) {
+        if (!(token = APR_ARRAY_IDX(tokens, i, const char*))) continue;
+        if (dns01_cmd && !strncmp(token, MD_AUTHZ_TYPE_DNS01, plen) 
+            && token[plen] == ':') {
+            APR_ARRAY_PUSH(domains, const char*) = token + plen + 1;
+        }
+        else {
+            md_acme_authz_teardown(store, token, env, p);
+        }
+    }
+    if (domains->nelts > 0) {
+        dns01_exec_all(dns01_cmd, "teardown-all", domains, p);
+    }
+    return APR_SUCCESS;
+}
+
 apr_status_t md_acme_authz_teardown(struct md_store_t *store, 
                                     const char *token, apr_table_t *env, apr_pool_t *p)
 {
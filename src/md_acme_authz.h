@@ -72,15 +72,59 @@ apr_status_t md_acme_authz_retrieve(md_acme_t *acme, apr_pool_t *p, const char *
                                     md_acme_authz_t **pauthz);
 apr_status_t md_acme_authz_update(md_acme_authz_t *authz, struct md_acme_t *acme, apr_pool_t *p);
 
+/**
+ * Retrieve the authz resources at all urls, with up to acme->max_parallel requests
+ * in flight. authzs and rvs need room for urls->nelts entries and receive the
+ * authz (or NULL) and the status for each url.
+ * @return APR_SUCCESS if all were retrieved, the first failure otherwise
+ */
+apr_status_t md_acme_authz_retrieve_all(struct md_acme_t *acme, apr_pool_t *p, 
+                                        struct apr_array_header_t *urls, 
+                                        md_acme_authz_t **authzs, apr_status_t *rvs);
+
+/**
+ * Challenges of an order that are set up together. With "cmd-dns-01-batch" set
+ * to "on" in the environment, the dns-01 command is run once for all domains 
+ * with "setup-all domain1 token1 domain2 token2 ..." instead of once per domain.
+ */
+typedef struct md_acme_cha_batch_t md_acme_cha_batch_t;
+
+md_acme_cha_batch_t *md_acme_cha_batch_make(struct apr_table_t *env, apr_pool_t *p);
+
+/**
+ * Set up the challenges deferred to the batch. On success, the requests that
+ * notify the server of them are added to notifies or, if that is NULL, sent
+ * right away.
+ */
+apr_status_t md_acme_cha_batch_run(md_acme_cha_batch_t *batch, struct md_acme_t *acme,
+                                   apr_array_header_t *notifies, struct md_result_t *result);
+
+/**
+ * Set up a challenge for the authz. If pnotify is not NULL and the server needs to
+ * be told the challenge is ready, the request for this is returned there, to be
+ * sent by the caller, e.g. together with the ones for other authzs. Otherwise
+ * the server is notified right away. If batch is not NULL, the challenge may be
+ * deferred to md_acme_cha_batch_run().
+ */
 apr_status_t md_acme_authz_respond(md_acme_authz_t *authz, struct md_acme_t *acme, 
                                    struct md_store_t *store, apr_array_header_t *challenges, 
                                    struct md_pkey_spec_t *key_spec,
                                    apr_array_header_t *acme_tls_1_domains, 
                                    struct apr_table_t *env,
                                    apr_pool_t *p, const char **setup_token,
+                                   struct md_acme_req_t **pnotify,
+                                   md_acme_cha_batch_t *batch,
                                    struct md_result_t *result);
 
 apr_status_t md_acme_authz_teardown(struct md_store_t *store, const char *setup_token, 
                                     struct apr_table_t *env, apr_pool_t *p);
 
+/**
+ * Tear down all challenges of the setup tokens, dns-01 ones with a single
+ * "teardown-all domain1 domain2 ..." command when batched.
+ */
+apr_status_t md_acme_authz_teardown_all(struct md_store_t *store, 
+                                        apr_array_header_t *setup_tokens, 
+                                        struct apr_table_t *env, apr_pool_t *p);
+
 #endif /* md_acme_authz_h */
@@ -27,6 +27,7 @@
 #include "md_crypt.h"
 #include "md_json.h"
 #include "md_jws.h"
+#include "md_keypool.h"
 #include "md_http.h"
 #include "md_log.h"
 #include "md_result.h"
@@ -115,7 +116,7 @@ apr_status_t md_acme_drive_set_acct(md_proto_driver_t *d, md_result_t *result)
         /* Find a local account for server, store at MD */ 
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: looking at existing accounts",
                       d->proto->protocol);
-        if (APR_SUCCESS == (rv = md_acme_find_acct(ad->acme, d->store))) {
+        if (APR_SUCCESS == (rv = md_acme_find_acct(ad->acme, d->store, md->contacts))) {
             md->ca_account = md_acme_acct_id_get(ad->acme);
             update_md = 1;
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: using account %s (id=%s)",
@@ -349,7 +350,9 @@ apr_status_t md_acme_drive_setup_certificate(md_proto_driver_t *d, md_result_t *
     
     rv = md_pkey_load(d->store, MD_SG_STAGING, d->md->name, &privkey, d->p);
     if (APR_STATUS_IS_ENOENT(rv)) {
-        if (APR_SUCCESS == (rv = md_pkey_gen(&privkey, d->p, d->md->pkey_spec))) {
+        if ((d->keypool && APR_SUCCESS == (rv = md_keypool_take(&privkey, d->keypool,
+                                                                 d->md->pkey_spec, d->p)))
+            || APR_SUCCESS == (rv = md_pkey_gen(&privkey, d->p, d->md->pkey_spec))) {
             rv = md_pkey_save(d->store, d->p, MD_SG_STAGING, d->md->name, privkey, 1);
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, d->p, "%s: generate privkey", d->md->name);
@@ -440,7 +443,7 @@ static apr_status_t get_chain(void *baton, int attempt)
     return rv;
 }
 
-static apr_status_t ad_chain_retrieve(md_proto_driver_t *d)
+static apr_status_t ad_chain_retrieve(md_proto_driver_t *d, md_result_t *result)
 {
     md_acme_driver_t *ad = d->baton;
     apr_status_t rv;
@@ -469,7 +472,14 @@ static apr_status_t ad_chain_retrieve(md_proto_driver_t *d)
             goto out;
         }
         
-        if (APR_SUCCESS != (rv = md_acme_drive_cert_poll(d, 0))) {
+        if (d->nonblocking) {
+            rv = md_acme_order_try(ad->order, get_cert, d, ad->cert_poll_timeout, 1, result);
+            if (APR_STATUS_IS_EAGAIN(rv)) {
+                md_acme_order_save(d->store, d->p, MD_SG_STAGING, d->md->name, ad->order, 0);
+            }
+            if (APR_SUCCESS != rv) goto out;
+        }
+        else if (APR_SUCCESS != (rv = md_acme_drive_cert_poll(d, 0))) {
             goto out;
         }
     }
@@ -592,6 +602,8 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
     apr_time_t now;
     apr_array_header_t *staged_certs;
     char ts[APR_RFC822_DATE_LEN];
+    const char *s;
+    apr_interval_time_t dir_max_age;
     int first = 0;
     
     if (md_log_is_level(d->p, MD_LOG_DEBUG)) {
@@ -602,6 +614,7 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
 
     /* When not explicitly told to reset, we check the existing data. If
      * it is incomplete or old, we trigger the reset for a clean start. */
+    md_result_phase_start(result, "staging");
     if (!reset_staging) {
         md_result_activity_setn(result, "Checking staging area");
         rv = md_load(d->store, MD_SG_STAGING, d->md->name, &ad->md, d->p);
@@ -658,6 +671,7 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
     }
     
     /* Need to renew */
+    md_result_phase_start(result, "setup");
     md_result_activity_printf(result, "Contacting ACME server for %s at %s", 
                               d->md->name, d->md->ca_url);
     if (APR_SUCCESS != (rv = md_acme_create(&ad->acme, d->p, d->md->ca_url, d->proxy_url))) {
@@ -665,6 +679,35 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
         md_result_log(result, MD_LOG_ERR);
         goto out;
     } 
+    if ((s = apr_table_get(d->env, MD_KEY_AUTHZ_PARALLEL))) {
+        ad->acme->max_parallel = (int)apr_atoi64(s);
+    }
+    dir_max_age = MD_ACME_DIR_MAX_AGE;
+    if ((s = apr_table_get(d->env, MD_KEY_DIR_MAX_AGE))) {
+        md_duration_parse(&dir_max_age, s, "h");
+    }
+    md_acme_set_dir_cache(ad->acme, d->store, dir_max_age);
+    ad->acme->limits = d->ca_limits;
+    ad->acme->acct_check_interval = MD_ACME_ACCT_CHECK_DEF;
+    if (d->md->pkey_spec) {
+        /* New accounts get EC keys when the MD uses them. ES256 is the one
+         * signature every ACME CA needs to support, also for Ed25519 MDs. */
+        switch (d->md->pkey_spec->type) {
+            case MD_PKEY_TYPE_EC:
+                ad->acme->acct_pkey_spec = d->md->pkey_spec;
+                break;
+            case MD_PKEY_TYPE_ED25519:
+                ad->acme->acct_pkey_spec = apr_pcalloc(d->p, sizeof(md_pkey_spec_t));
+                ad->acme->acct_pkey_spec->type = MD_PKEY_TYPE_EC;
+                ad->acme->acct_pkey_spec->params.ec.curve = MD_PKEY_EC_CURVE_DEF;
+                break;
+            default:
+                break;
+        }
+    }
+    if ((s = apr_table_get(d->env, MD_KEY_ACCT_CHECK))) {
+        md_duration_parse(&ad->acme->acct_check_interval, s, "h");
+    }
     if (APR_SUCCESS != (rv = md_acme_setup(ad->acme, result))) {
         md_result_log(result, MD_LOG_ERR);
         goto out;
@@ -715,11 +758,15 @@ static apr_status_t acme_renew(md_proto_driver_t *d, md_result_t *result)
     }
     
     if (md_array_is_empty(ad->certs) || ad->next_up_link) {
+        md_result_phase_start(result, "chain");
         md_result_activity_printf(result, "Retrieving certificate chain for %s", d->md->name);
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, 
                       "%s: retrieving certificate chain", d->md->name);
-        rv = ad_chain_retrieve(d);
-        if (APR_SUCCESS != rv) {
+        rv = ad_chain_retrieve(d, result);
+        if (APR_STATUS_IS_EAGAIN(rv) && d->nonblocking) {
+            goto out;
+        }
+        else if (APR_SUCCESS != rv) {
             md_result_printf(result, rv, "Unable to retrieve certificate chain.");
             goto out;
         }
@@ -801,9 +848,19 @@ out:
 
 static apr_status_t acme_driver_renew(md_proto_driver_t *d, md_result_t *result)
 {
+    md_acme_driver_t *ad = d->baton;
     apr_status_t rv;
 
     rv = acme_renew(d, result);
+    md_result_phase_end(result);
+    if (APR_SUCCESS != result->status && ad->acme && ad->acme->limits) {
+        /* when the CA wants a break, the job does not run before that */
+        apr_time_t until = md_acme_limits_blocked_until(ad->acme->limits, ad->acme->url);
+        if (until > result->ready_at) md_result_delay_set(result, until);
+    }
+    if (ad->acme && ad->acme->http) {
+        md_result_timings_set(result, md_http_timings_to_json(ad->acme->http, NULL, d->p));
+    }
     md_result_log(result, MD_LOG_DEBUG);
     return rv;
 }
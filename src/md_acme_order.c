@@ -57,6 +57,8 @@ md_acme_order_t *md_acme_order_create(apr_pool_t *p)
 /* order conversion */
 
 #define MD_KEY_CHALLENGE_SETUPS   "challenge-setups"
+#define MD_KEY_WAIT_START         "wait-start"
+#define MD_KEY_WAITS              "waits"
 
 static md_acme_order_st order_st_from_str(const char *s) 
 {
@@ -114,6 +116,10 @@ md_json_t *md_acme_order_to_json(md_acme_order_t *order, apr_pool_t *p)
     if (order->certificate) {
         md_json_sets(order->certificate, json, MD_KEY_CERTIFICATE, NULL);
     }
+    if (order->wait_start) {
+        md_json_set_time(order->wait_start, json, MD_KEY_WAIT_START, NULL);
+        md_json_setl(order->waits, json, MD_KEY_WAITS, NULL);
+    }
     return json;
 }
 
@@ -142,6 +148,11 @@ md_acme_order_t *md_acme_order_from_json(md_json_t *json, apr_pool_t *p)
     md_acme_order_t *order = md_acme_order_create(p);
 
     order_update_from_json(order, json, p);
+    /* not part of the server's order resource, only of our persisted one */
+    if (md_json_has_key(json, MD_KEY_WAIT_START, NULL)) {
+        order->wait_start = md_json_get_time(json, MD_KEY_WAIT_START, NULL);
+        order->waits = (int)md_json_getl(json, MD_KEY_WAITS, NULL);
+    }
     return order;
 }
 
@@ -175,6 +186,39 @@ static apr_status_t add_setup_token(md_acme_order_t *order, const char *token)
     return APR_SUCCESS;
 }
 
+static int is_cha_processing(void *baton, size_t index, md_json_t *json)
+{
+    int *pprocessing = baton;
+    const char *status = md_json_gets(json, MD_KEY_STATUS, NULL);
+    
+    (void)index;
+    if (status && !strcmp("processing", status)) {
+        *pprocessing = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* If a challenge of the pending authz has been set up for this order before, by a 
+ * run that got APR_EAGAIN waiting for the CA, or is being validated. */
+static int authz_is_set_up(md_acme_order_t *order, md_acme_authz_t *authz, apr_pool_t *p)
+{
+    const char *suffix = apr_pstrcat(p, ":", authz->domain, NULL);
+    const char *token;
+    apr_size_t slen = strlen(suffix), tlen;
+    int i, processing = 0;
+    
+    for (i = 0; i < order->challenge_setups->nelts; ++i) {
+        token = APR_ARRAY_IDX(order->challenge_setups, i, const char*);
+        tlen = strlen(token);
+        if (tlen > slen && !strcmp(token + tlen - slen, suffix)) return 1;
+    }
+    if (authz->resource) {
+        md_json_itera(is_cha_processing, &processing, authz->resource, MD_KEY_CHALLENGES, NULL);
+    }
+    return processing;
+}
+
 /**************************************************************************************************/
 /* persistence */
 
@@ -241,9 +285,9 @@ static apr_status_t p_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_li
             if (setup_token) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                               "order teardown setup %s", setup_token);
-                md_acme_authz_teardown(store, setup_token, env, p);
             }
         }
+        md_acme_authz_teardown_all(store, order->challenge_setups, env, p);
     }
     return md_store_remove(store, group, md_name, MD_FN_ORDER, ptemp, 1);
 }
@@ -347,6 +391,44 @@ apr_status_t md_acme_order_update(md_acme_order_t *order, md_acme_t *acme,
     return rv;
 }
 
+apr_status_t md_acme_order_try(md_acme_order_t *order, md_util_try_fn *fn, void *baton, 
+                               apr_interval_time_t timeout, int nonblocking,
+                               md_result_t *result)
+{
+    apr_interval_time_t delay;
+    apr_time_t now;
+    apr_status_t rv;
+    
+    if (!nonblocking) {
+        return md_util_try(fn, baton, 0, timeout, 0, 0, 1);
+    }
+
+    rv = fn(baton, order->waits);
+    now = apr_time_now();
+    if (!APR_STATUS_IS_EAGAIN(rv)) {
+        order->wait_start = 0;
+        order->waits = 0;
+    }
+    else if (order->wait_start && now - order->wait_start > timeout) {
+        rv = APR_TIMEUP;
+        md_result_printf(result, rv, "CA did not progress within %s", 
+                         md_duration_print(result->p, timeout));
+        order->wait_start = 0;
+        order->waits = 0;
+    }
+    else {
+        /* same back off as md_util_try(), but starting at a second */
+        if (!order->wait_start) order->wait_start = now;
+        delay = apr_time_from_sec(1) << (order->waits < 4? order->waits : 4);
+        if (delay > apr_time_from_sec(10)) delay = apr_time_from_sec(10);
+        ++order->waits;
+        md_result_printf(result, rv, "waiting on the CA, checking again in %s", 
+                         md_duration_print(result->p, delay));
+        md_result_delay_set(result, now + delay);
+    }
+    return rv;
+}
+
 static apr_status_t await_ready(void *baton, int attempt)
 {
     order_ctx_t *ctx = baton;
@@ -373,7 +455,7 @@ out:
 
 apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme, 
                                        const md_t *md, apr_interval_time_t timeout, 
-                                       md_result_t *result, apr_pool_t *p)
+                                       int nonblocking, md_result_t *result, apr_pool_t *p)
 {
     order_ctx_t ctx;
     apr_status_t rv;
@@ -382,7 +464,7 @@ apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme,
     ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL, result);
 
     md_result_activity_setn(result, "Waiting for order to become ready");
-    rv = md_util_try(await_ready, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_acme_order_try(order, await_ready, &ctx, timeout, nonblocking, result);
     md_result_log(result, MD_LOG_DEBUG);
     return rv;
 }
@@ -411,7 +493,7 @@ out:
 
 apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme, 
                                        const md_t *md, apr_interval_time_t timeout, 
-                                       md_result_t *result, apr_pool_t *p)
+                                       int nonblocking, md_result_t *result, apr_pool_t *p)
 {
     order_ctx_t ctx;
     apr_status_t rv;
@@ -420,7 +502,7 @@ apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme,
     ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL, result);
 
     md_result_activity_setn(result, "Waiting for finalized order to become valid");
-    rv = md_util_try(await_valid, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_acme_order_try(order, await_valid, &ctx, timeout, nonblocking, result);
     md_result_log(result, MD_LOG_DEBUG);
     return rv;
 }
@@ -434,19 +516,32 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                                             apr_table_t *env, md_result_t *result, 
                                             apr_pool_t *p)
 {
-    apr_status_t rv = APR_SUCCESS;
-    md_acme_authz_t *authz;
+    apr_status_t rv = APR_SUCCESS, rv2, *rvs;
+    md_acme_authz_t *authz, **authzs;
+    md_acme_req_t *notify;
+    md_acme_cha_batch_t *batch;
+    apr_array_header_t *notifies;
     const char *url, *setup_token;
-    int i;
+    int i, n;
     
     md_result_activity_printf(result, "Starting challenges for domains");
-    for (i = 0; i < order->authz_urls->nelts; ++i) {
+    n = order->authz_urls->nelts;
+    authzs = apr_pcalloc(p, (apr_size_t)(n > 0? n : 1) * sizeof(*authzs));
+    rvs = apr_pcalloc(p, (apr_size_t)(n > 0? n : 1) * sizeof(*rvs));
+    notifies = apr_array_make(p, n > 0? n : 1, sizeof(md_acme_req_t*));
+    batch = md_acme_cha_batch_make(env, p);
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: check %d AUTHZ", md->name, n);
+    md_result_phase_start(result, "authz");
+    md_acme_authz_retrieve_all(acme, p, order->authz_urls, authzs, rvs);
+    md_result_phase_start(result, "challenges");
+    
+    for (i = 0; i < n; ++i) {
         url = APR_ARRAY_IDX(order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check AUTHZ at %s", md->name, url);
-        
-        if (APR_SUCCESS != (rv = md_acme_authz_retrieve(acme, p, url, &authz))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: check authz for %s",
-                          md->name, authz->domain);
+        authz = authzs[i];
+        if (APR_SUCCESS != (rv = rvs[i])) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: check authz at %s",
+                          md->name, url);
             goto leave;
         }
 
@@ -455,14 +550,21 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                 break;
                 
             case MD_ACME_AUTHZ_S_PENDING:
+                if (authz_is_set_up(order, authz, p)) {
+                    /* the CA has it, setting it up again runs commands and POSTs anew */
+                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                                  "%s: challenge for %s already set up", md->name, authz->domain);
+                    break;
+                }
                 rv = md_acme_authz_respond(authz, acme, store, challenge_types, 
                                            md->pkey_spec, md->acme_tls_1_domains,
-                                           env, p, &setup_token, result);
+                                           env, p, &setup_token, &notify, batch, result);
                 if (APR_SUCCESS != rv) {
                     goto leave;
                 }
                 add_setup_token(order, setup_token);
                 md_acme_order_save(store, p, MD_SG_STAGING, md->name, order, 0);
+                if (notify) APR_ARRAY_PUSH(notifies, md_acme_req_t*) = notify;
                 break;
                 
             case MD_ACME_AUTHZ_S_INVALID:
@@ -480,7 +582,18 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
                 goto leave;
         }
     }
-leave:    
+leave:
+    /* Challenges that have been set up are announced to the server all together,
+     * also when a later one failed, as we would have done one by one. Batched
+     * dns-01 challenges are set up first, with one command for all. */
+    rv2 = md_acme_cha_batch_run(batch, acme, notifies, result);
+    if (APR_SUCCESS == rv) rv = rv2;
+    if (notifies->nelts > 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: notify server of %d challenges", 
+                      md->name, notifies->nelts);
+        rv2 = md_acme_multi_perform(acme, notifies, NULL);
+        if (APR_SUCCESS == rv) rv = rv2;
+    }
     return rv;
 }
 
@@ -488,16 +601,22 @@ static apr_status_t check_challenges(void *baton, int attempt)
 {
     order_ctx_t *ctx = baton;
     const char *url;
-    md_acme_authz_t *authz;
-    apr_status_t rv = APR_SUCCESS;
-    int i;
+    md_acme_authz_t *authz, **authzs;
+    apr_status_t rv = APR_SUCCESS, *rvs;
+    int i, n;
     
-    for (i = 0; i < ctx->order->authz_urls->nelts; ++i) {
+    n = ctx->order->authz_urls->nelts;
+    if (n <= 0) goto leave;
+    authzs = apr_pcalloc(ctx->p, (apr_size_t)n * sizeof(*authzs));
+    rvs = apr_pcalloc(ctx->p, (apr_size_t)n * sizeof(*rvs));
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, "%s: check %d AUTHZ (attempt %d)", 
+                  ctx->name, n, attempt);
+    md_acme_authz_retrieve_all(ctx->acme, ctx->p, ctx->order->authz_urls, authzs, rvs);
+    
+    for (i = 0; i < n; ++i) {
         url = APR_ARRAY_IDX(ctx->order->authz_urls, i, const char*);
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->p, "%s: check AUTHZ at %s (attempt %d)", 
-                      ctx->name, url, attempt);
-        
-        rv = md_acme_authz_retrieve(ctx->acme, ctx->p, url, &authz);
+        authz = authzs[i];
+        rv = rvs[i];
         if (APR_SUCCESS == rv) {
             switch (authz->state) {
                 case MD_ACME_AUTHZ_S_VALID:
@@ -529,8 +648,8 @@ static apr_status_t check_challenges(void *baton, int attempt)
             }
         }
         else {
-            md_result_printf(ctx->result, rv, "authorization retrieval failed for domain %s", 
-                             authz->domain);
+            md_result_printf(ctx->result, rv, "authorization retrieval failed at %s", url);
+            goto leave;
         }
     }
 leave:
@@ -539,7 +658,7 @@ leave:
 
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
                                           const md_t *md, apr_interval_time_t timeout, 
-                                          md_result_t *result, apr_pool_t *p)
+                                          int nonblocking, md_result_t *result, apr_pool_t *p)
 {
     order_ctx_t ctx;
     apr_status_t rv;
@@ -547,7 +666,7 @@ apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acm
     ORDER_CTX_INIT(&ctx, p, order, acme, md->name, NULL, result);
     
     md_result_activity_printf(result, "Monitoring challenge status for %s", md->name);
-    rv = md_util_try(check_challenges, &ctx, 0, timeout, 0, 0, 1);
+    rv = md_acme_order_try(order, check_challenges, &ctx, timeout, nonblocking, result);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: checked authorizations", md->name);
     return rv;
 }
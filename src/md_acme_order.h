@@ -38,6 +38,8 @@ struct md_acme_order_t {
     struct md_json_t *json;
     const char *finalize;
     const char *certificate;
+    apr_time_t wait_start;      /* when we started waiting on the CA, 0 if not waiting */
+    int waits;                  /* number of times checked on the CA while waiting */
 };
 
 #define MD_FN_ORDER             "order.json"
@@ -72,7 +74,18 @@ apr_status_t md_acme_order_start_challenges(md_acme_order_t *order, md_acme_t *a
 
 apr_status_t md_acme_order_monitor_authzs(md_acme_order_t *order, md_acme_t *acme, 
                                           const md_t *md, apr_interval_time_t timeout,
-                                          struct md_result_t *result, apr_pool_t *p);
+                                          int nonblocking, struct md_result_t *result, 
+                                          apr_pool_t *p);
+
+/**
+ * Call fn until it no longer returns APR_EAGAIN, for at most timeout. When nonblocking,
+ * fn is called only once. If it needs to be called again, APR_EAGAIN is returned and
+ * result->ready_at is set to the time for this. The order keeps the start of the
+ * waiting, so that the timeout applies over all calls until it is saved again.
+ */
+apr_status_t md_acme_order_try(md_acme_order_t *order, md_util_try_fn *fn, void *baton, 
+                               apr_interval_time_t timeout, int nonblocking,
+                               struct md_result_t *result);
 
 /* ACMEv2 only ************************************************************************************/
 
@@ -84,9 +97,11 @@ apr_status_t md_acme_order_update(md_acme_order_t *order, md_acme_t *acme,
 
 apr_status_t md_acme_order_await_ready(md_acme_order_t *order, md_acme_t *acme, 
                                        const md_t *md, apr_interval_time_t timeout, 
-                                       struct md_result_t *result, apr_pool_t *p);
+                                       int nonblocking, struct md_result_t *result, 
+                                       apr_pool_t *p);
 apr_status_t md_acme_order_await_valid(md_acme_order_t *order, md_acme_t *acme, 
                                        const md_t *md, apr_interval_time_t timeout, 
-                                       struct md_result_t *result, apr_pool_t *p);
+                                       int nonblocking, struct md_result_t *result, 
+                                       apr_pool_t *p);
 
 #endif /* md_acme_order_h */
@@ -142,6 +142,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: (ACMEv1) need certificate", d->md->name);
     
     /* Chose (or create) and ACME account to use */
+    md_result_phase_start(result, "account");
     if (APR_SUCCESS != (rv = md_acme_drive_set_acct(d, result))) goto leave;
     
     /* Check that the account agreed to the terms-of-service, otherwise
@@ -169,6 +170,7 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
     
     if (!md_array_is_empty(ad->certs)) goto leave;
     
+    md_result_phase_start(result, "order");
     rv = ad_setup_order(d, result);
     if (APR_SUCCESS != rv) goto leave;
     
@@ -176,10 +178,12 @@ apr_status_t md_acmev1_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
                                         d->store, d->md, d->env, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
+    md_result_phase_start(result, "validation");
     rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
-                                      ad->authz_monitor_timeout, result, d->p);
+                                      ad->authz_monitor_timeout, 0, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
+    md_result_phase_start(result, "finalize");
     rv = md_acme_drive_setup_certificate(d, result);
 
 leave:    
@@ -98,6 +98,7 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: (ACMEv2) need certificate", d->md->name);
     
     /* Chose (or create) and ACME account to use */
+    md_result_phase_start(result, "account");
     rv = md_acme_drive_set_acct(d, result);
     if (APR_SUCCESS != rv) goto leave;
 
@@ -114,7 +115,12 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
      *   * VALID: retrieve certificate
      *   * COMPLETE: all done, return success
      *   * INVALID and otherwise: fail renewal, delete local order
+     * 
+     * When non-blocking, waiting on the CA returns APR_EAGAIN after the order has
+     * been saved. Running again resumes with the loaded order at the step its
+     * state and the state of its authorizations are in.
      */
+    md_result_phase_start(result, "order");
     if (APR_SUCCESS != (rv = ad_setup_order(d, result))) {
         goto leave;
     }
@@ -138,27 +144,36 @@ apr_status_t md_acmev2_drive_renew(md_acme_driver_t *ad, md_proto_driver_t *d, m
                                         d->store, d->md, d->env, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
-    rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md,
-                                      ad->authz_monitor_timeout, result, d->p);
+    md_result_phase_start(result, "validation");
+    rv = md_acme_order_monitor_authzs(ad->order, ad->acme, d->md, ad->authz_monitor_timeout, 
+                                      d->nonblocking, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
-    rv = md_acme_order_await_ready(ad->order, ad->acme, d->md, 
-                                   ad->authz_monitor_timeout, result, d->p);
+    rv = md_acme_order_await_ready(ad->order, ad->acme, d->md, ad->authz_monitor_timeout, 
+                                   d->nonblocking, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
-    rv = md_acme_drive_setup_certificate(d, result);
-    if (APR_SUCCESS != rv) goto leave;
-    
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: finalized order", d->md->name);
+    /* A resumed order may have been finalized in an earlier run already */
+    if (MD_ACME_ORDER_ST_READY == ad->order->status) {
+        md_result_phase_start(result, "finalize");
+        rv = md_acme_drive_setup_certificate(d, result);
+        if (APR_SUCCESS != rv) goto leave;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, d->p, "%s: finalized order", d->md->name);
+    }
     
-    rv = md_acme_order_await_valid(ad->order, ad->acme, d->md, 
-                                   ad->authz_monitor_timeout, result, d->p);
+    md_result_phase_start(result, "cert-poll");
+    rv = md_acme_order_await_valid(ad->order, ad->acme, d->md, ad->authz_monitor_timeout, 
+                                   d->nonblocking, result, d->p);
     if (APR_SUCCESS != rv) goto leave;
     
     if (ad->order->certificate) goto leave;
     md_result_set(result, APR_EINVAL, "Order valid, but certifiate url is missing.");
 
 leave:    
+    if (APR_STATUS_IS_EAGAIN(rv) && ad->order) {
+        /* remember how long we have been waiting */
+        md_acme_order_save(d->store, d->p, MD_SG_STAGING, d->md->name, ad->order, 0);
+    }
     md_result_log(result, MD_LOG_DEBUG);
     return result->status;
 }
@@ -203,6 +203,7 @@ static apr_status_t cmd_process(md_cmd_ctx *ctx, const md_cmd_t *cmd)
                     ctx->ca_url, ctx->base_dir);
             return rv;
         }
+        md_acme_set_dir_cache(ctx->acme, ctx->store, MD_ACME_DIR_MAX_AGE);
         rv = md_acme_setup(ctx->acme, result);
         if (rv != APR_SUCCESS) {
             md_result_log(result, MD_LOG_ERR);
@@ -352,11 +353,13 @@ static apr_status_t main_opts(md_cmd_ctx *ctx, int option, const char *optarg)
             if (active_level > 0) {
                 --active_level;
             }
+            md_log_set_level(active_level);
             break;
         case 'v':
             if (active_level < MD_LOG_TRACE8) {
                 ++active_level;
             }
+            md_log_set_level(active_level);
             break;
         case 'V':
             md_cmd_ctx_set_option(ctx, "version", "1");
@@ -374,6 +377,7 @@ static const md_cmd_t *MainSubCmds[] = {
     &MD_AcmeCmd,
     &MD_RegAddCmd,
     &MD_RegUpdateCmd, 
+    &MD_RegBulkCmd,
     &MD_RegDriveCmd,
     &MD_RegListCmd,
     &MD_StoreCmd,
@@ -423,6 +427,7 @@ int main(int argc, const char *const *argv)
     
     memset(&ctx, 0, sizeof(ctx));
     md_log_set(log_is_level, log_print, NULL);
+    md_log_set_level(active_level);
     
     apr_allocator_create(&allocator);
     rv = apr_pool_create_ex(&p, NULL, pool_abort, allocator);
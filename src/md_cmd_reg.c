@@ -17,10 +17,12 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_buckets.h>
 #include <apr_getopt.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_proc.h>
 
 #include "md.h"
 #include "md_json.h"
@@ -242,6 +244,237 @@ md_cmd_t MD_RegUpdateCmd = {
     "'contacts' or 'agreement'"
 };
 
+/**************************************************************************************************/
+/* command: bulk */
+
+static apr_status_t bulk_read_line(const char **pline, apr_file_t *f, apr_pool_t *p)
+{
+    char buffer[8 * 1024];
+    const char *line = NULL;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    /* lines may be longer than the buffer, e.g. for mds with many domains */
+    while (APR_SUCCESS == (rv = apr_file_gets(buffer, sizeof(buffer), f))) {
+        line = line? apr_pstrcat(p, line, buffer, NULL) : apr_pstrdup(p, buffer);
+        len = strlen(buffer);
+        if (len > 0 && buffer[len-1] == '\n') break;
+    }
+    if (APR_EOF == rv && line) rv = APR_SUCCESS;
+    *pline = line;
+    return rv;
+}
+
+static void bulk_read_contacts(apr_array_header_t *contacts, md_json_t *json, apr_pool_t *p)
+{
+    apr_array_header_t *values = apr_array_make(p, 5, sizeof(const char *));
+    int i;
+    
+    md_json_getsa(values, json, MD_KEY_CONTACTS, NULL);
+    for (i = 0; i < values->nelts; ++i) {
+        APR_ARRAY_PUSH(contacts, const char *) = 
+            md_util_schemify(p, APR_ARRAY_IDX(values, i, const char *), "mailto");
+    }
+}
+
+static apr_status_t bulk_add(md_cmd_ctx *ctx, md_result_t *result, md_json_t *json, 
+                             const char *name, apr_array_header_t *domains, apr_pool_t *p)
+{
+    md_t *md;
+    const char *s;
+    
+    if (apr_is_empty_array(domains)) {
+        md_result_printf(result, APR_EINVAL, "add needs at least 1 domain name");
+        return result->status;
+    }
+    md = md_create(p, domains);
+    if (name) md->name = name;
+    bulk_read_contacts(md->contacts, json, p);
+    s = md_json_gets(json, MD_KEY_CA, MD_KEY_URL, NULL);
+    md->ca_url = s? s : ctx->ca_url;
+    s = md_json_gets(json, MD_KEY_CA, MD_KEY_PROTO, NULL);
+    md->ca_proto = s? s : "ACME";
+    md->ca_account = md_json_gets(json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
+    md->ca_agreement = md_json_gets(json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
+    
+    md_result_set(result, md_reg_add(ctx->reg, md, p), NULL);
+    return result->status;
+}
+
+static apr_status_t bulk_update(md_cmd_ctx *ctx, md_result_t *result, md_json_t *json, 
+                                const char *name, apr_array_header_t *domains, apr_pool_t *p)
+{
+    const md_t *md;
+    md_t *nmd;
+    const char *s;
+    int fields = 0;
+    
+    if (!name) {
+        md_result_printf(result, APR_EINVAL, "update needs md name");
+        return result->status;
+    }
+    if (NULL == (md = md_reg_get(ctx->reg, name, p))) {
+        md_result_printf(result, APR_ENOENT, "%s: not found", name);
+        return result->status;
+    }
+    
+    nmd = md_copy(p, md);
+    if (md_json_has_key(json, MD_KEY_DOMAINS, NULL)) {
+        if (apr_is_empty_array(domains)) {
+            md_result_printf(result, APR_EINVAL, "update domains needs at least 1 domain name");
+            return result->status;
+        }
+        nmd->domains = md_array_str_compact(p, domains, 0);
+        fields |= MD_UPD_DOMAINS;
+    }
+    if (md_json_has_key(json, MD_KEY_CONTACTS, NULL)) {
+        nmd->contacts = apr_array_make(p, 5, sizeof(const char *));
+        bulk_read_contacts(nmd->contacts, json, p);
+        fields |= MD_UPD_CONTACTS;
+    }
+    if (NULL != (s = md_json_gets(json, MD_KEY_CA, MD_KEY_URL, NULL))) {
+        nmd->ca_url = s;
+        fields |= MD_UPD_CA_URL;
+    }
+    if (NULL != (s = md_json_gets(json, MD_KEY_CA, MD_KEY_PROTO, NULL))) {
+        nmd->ca_proto = s;
+        fields |= MD_UPD_CA_PROTO;
+    }
+    if (NULL != (s = md_json_gets(json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL))) {
+        nmd->ca_account = s;
+        fields |= MD_UPD_CA_ACCOUNT;
+    }
+    if (NULL != (s = md_json_gets(json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL))) {
+        nmd->ca_agreement = s;
+        fields |= MD_UPD_AGREEMENT;
+    }
+    
+    if (!fields) {
+        md_result_set(result, APR_SUCCESS, "no changes necessary");
+    }
+    else {
+        md_result_set(result, md_reg_update(ctx->reg, p, name, nmd, fields, 1), NULL);
+    }
+    return result->status;
+}
+
+static apr_status_t bulk_apply(md_cmd_ctx *ctx, md_json_t *out, const char *line, apr_pool_t *p)
+{
+    md_result_t *result;
+    md_json_t *json;
+    apr_array_header_t *domains;
+    const char *op, *name;
+    const md_t *md;
+    
+    result = md_result_make(p, APR_SUCCESS);
+    if (APR_SUCCESS != md_json_readd(&json, p, line, strlen(line))) {
+        md_result_printf(result, APR_EINVAL, "not a JSON object");
+        goto leave;
+    }
+    
+    op = md_json_gets(json, "op", NULL);
+    name = md_json_gets(json, MD_KEY_NAME, NULL);
+    domains = apr_array_make(p, 5, sizeof(const char *));
+    md_json_dupsa(domains, p, json, MD_KEY_DOMAINS, NULL);
+    
+    if (!op || !strcmp("add", op)) {
+        if (!name && !apr_is_empty_array(domains)) {
+            name = APR_ARRAY_IDX(domains, 0, const char *);
+        }
+        op = "add";
+        bulk_add(ctx, result, json, name, domains, p);
+    }
+    else if (!strcmp("update", op)) {
+        bulk_update(ctx, result, json, name, domains, p);
+    }
+    else {
+        md_result_printf(result, APR_ENOTIMPL, "unknown op: %s", op);
+    }
+
+    md_json_sets(op, out, "op", NULL);
+    if (name) {
+        md_json_sets(name, out, MD_KEY_NAME, NULL);
+        if (APR_SUCCESS == result->status && (md = md_reg_get(ctx->reg, name, p))) {
+            md_json_setj(md_to_json(md, p), out, "md", NULL);
+        }
+    }
+leave:
+    md_json_setj(md_result_to_json(result, p), out, "result", NULL);
+    return result->status;
+}
+
+static apr_status_t cmd_reg_bulk(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    apr_file_t *f;
+    apr_pool_t *ptemp;
+    md_json_t *out;
+    const char *path = "-", *line, *s;
+    apr_status_t rv, rv2 = APR_SUCCESS;
+    int lineno = 0, count = 0, failed = 0;
+    
+    if (ctx->argc > 1) {
+        return usage(cmd, "takes at most one file name");
+    }
+    if (ctx->argc > 0) path = ctx->argv[0];
+    
+    if (!strcmp("-", path)) {
+        rv = apr_file_open_stdin(&f, ctx->p);
+    }
+    else {
+        rv = apr_file_open(&f, path, APR_FOPEN_READ|APR_FOPEN_BUFFERED, APR_OS_DEFAULT, ctx->p);
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "open %s", path);
+        return rv;
+    }
+    
+    /* Read the domains of all mds once, not again for each line */
+    if (APR_SUCCESS != (rv = md_reg_bulk_begin(ctx->reg, ctx->p))) goto leave;
+    
+    apr_pool_create(&ptemp, ctx->p);
+    while (APR_SUCCESS == (rv = bulk_read_line(&line, f, ptemp))) {
+        ++lineno;
+        for (s = line; *s && apr_isspace(*s); ++s);
+        if (!*s || *s == '#') goto next; /* skip empty lines and comments */
+        
+        out = md_json_create(ptemp);
+        md_json_setl(lineno, out, "line", NULL);
+        ++count;
+        if (APR_SUCCESS != bulk_apply(ctx, out, line, ptemp)) {
+            ++failed;
+        }
+        if (ctx->json_out) {
+            md_json_addj(out, ctx->json_out, "output", NULL);
+        }
+        else {
+            fprintf(stdout, "%s\n", md_json_writep(out, ptemp, MD_JSON_FMT_COMPACT));
+        }
+next:
+        apr_pool_clear(ptemp);
+    }
+    fflush(stdout);
+    apr_pool_destroy(ptemp);
+    if (APR_EOF == rv) rv = APR_SUCCESS;
+    md_reg_bulk_end(ctx->reg);
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, "bulk: %d mds, %d failed", count, failed);
+    if (APR_SUCCESS == rv && failed) rv = APR_EGENERAL;
+leave:
+    if (f && strcmp("-", path)) rv2 = apr_file_close(f);
+    return (APR_SUCCESS != rv)? rv : rv2;
+}
+
+md_cmd_t MD_RegBulkCmd = {
+    "bulk", MD_CTX_REG, 
+    NULL, cmd_reg_bulk, MD_NoOptions, NULL,
+    "bulk [file]",
+    "add or update managed domains, one JSON object per line, read from the file or stdin. "
+    "The objects have the properties 'op' ('add', the default, or 'update'), 'name', "
+    "'domains', 'contacts' and 'ca' with 'url', 'proto', 'account' or 'agreement'. "
+    "For each line, a JSON object with the result is written to stdout, or added to "
+    "the output with -j."
+};
+
 /**************************************************************************************************/
 /* command: drive */
 
@@ -286,9 +519,250 @@ out:
     return rv;
 }
 
+/* Driving several mds in parallel: the workers only renew, which is where
+ * the time goes, talking to the CA and waiting for validations. Assessing 
+ * the mds and loading the staged results stay in the main thread, as they 
+ * change the registry. Each worker allocates from a pool with its own
+ * allocator, the results are copied back after all workers are done. */
+typedef struct {
+    md_t *md;
+    md_result_t *result;
+    md_result_t *wresult;       /* result in the pool of the worker renewing it */
+    apr_status_t rv;
+    int renew;                  /* md is to be renewed */
+    apr_time_t started;
+    apr_time_t finished;
+} drive_item_t;
+
+typedef struct {
+    md_cmd_ctx *ctx;
+    drive_item_t *items;
+    int nitems;
+    volatile apr_uint32_t next;     /* index of the next item to look at */
+} drive_jobs_t;
+
+typedef struct {
+    drive_jobs_t *jobs;
+    apr_pool_t *p;                  /* the worker's own pool */
+} drive_worker_t;
+
+static void drive_item_renew(md_cmd_ctx *ctx, drive_item_t *item, 
+                             md_result_t *result, apr_pool_t *p)
+{
+    item->started = apr_time_now();
+    item->rv = md_reg_renew(ctx->reg, item->md, ctx->env, 
+                            md_cmd_ctx_has_option(ctx, "reset"), result, p);
+    item->finished = apr_time_now();
+}
+
+static void drive_jobs_run(drive_jobs_t *jobs, apr_pool_t *p)
+{
+    drive_item_t *item;
+    apr_uint32_t i;
+    
+    while ((i = apr_atomic_inc32(&jobs->next)) < (apr_uint32_t)jobs->nitems) {
+        item = &jobs->items[i];
+        if (item->renew) {
+            item->wresult = md_result_md_make(p, item->md->name);
+            drive_item_renew(jobs->ctx, item, item->wresult, p);
+        }
+    }
+}
+
+#if APR_HAS_THREADS
+static apr_status_t drive_worker_pool(apr_pool_t **pp, apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    /* ctx->p has an allocator without mutex, workers must not allocate from it */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) return rv;
+    apr_allocator_max_free_set(allocator, 1);
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(pp, parent, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *pp);
+    apr_pool_tag(*pp, "md_cmd_drive");
+    return APR_SUCCESS;
+}
+#endif
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC drive_worker(apr_thread_t *thread, void *data)
+{
+    drive_worker_t *worker = data;
+    
+    drive_jobs_run(worker->jobs, worker->p); 
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+static void drive_results_collect(drive_jobs_t *jobs)
+{
+    drive_item_t *item;
+    int i;
+    
+    /* copy the results out of the worker pools, into the pool of the item */
+    for (i = 0; i < jobs->nitems; ++i) {
+        item = &jobs->items[i];
+        if (item->wresult) {
+            md_result_dup(item->result, item->wresult);
+            item->wresult = NULL;
+        }
+    }
+}
+
+static void drive_item_report(md_cmd_ctx *ctx, drive_item_t *item)
+{
+    md_json_t *json;
+    apr_time_t duration = item->finished - item->started;
+    
+    if (ctx->json_out) {
+        json = md_json_create(ctx->p);
+        md_json_sets(item->md->name, json, MD_KEY_NAME, NULL);
+        md_json_setj(md_result_to_json(item->result, ctx->p), json, "result", NULL);
+        md_json_setb(item->renew, json, MD_KEY_RENEW, NULL);
+        md_json_setl((long)apr_time_as_msec(duration), json, "msecs", NULL);
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    else {
+        fprintf(stdout, "md: %s [%s] %s (%.1f s)\n", item->md->name, 
+                (APR_SUCCESS == item->rv)? "ok" : "failed", 
+                item->result->detail? item->result->detail : "", 
+                (double)duration / APR_USEC_PER_SEC);
+    }
+}
+
+static apr_status_t drive_parallel(md_cmd_ctx *ctx, apr_array_header_t *mdlist, int threads)
+{
+    drive_jobs_t jobs;
+    drive_item_t *item;
+    md_log_level_t level;
+    apr_time_t start;
+    apr_status_t rv = APR_SUCCESS;
+    int i, force, first, nrenew = 0, nfailed = 0;
+#if APR_HAS_THREADS
+    apr_thread_t **workers;
+    drive_worker_t *wctxs;
+    apr_status_t trv;
+    int started = 0;
+#endif
+    
+    start = apr_time_now();
+    force = md_cmd_ctx_has_option(ctx, "force");
+    memset(&jobs, 0, sizeof(jobs));
+    jobs.ctx = ctx;
+    jobs.nitems = mdlist->nelts;
+    jobs.items = apr_pcalloc(ctx->p, sizeof(drive_item_t) * (apr_size_t)mdlist->nelts);
+    
+    /* Renewing looks at the current certificates. Load them all now, so that the 
+     * workers only read the registry's cache and never add to it. */
+    md_reg_preload_pubcerts(ctx->reg, mdlist, 1, ctx->p);
+    
+    for (i = 0, first = -1; i < mdlist->nelts; ++i) {
+        item = &jobs.items[i];
+        item->md = APR_ARRAY_IDX(mdlist, i, md_t*);
+        item->result = md_result_md_make(ctx->p, item->md->name);
+        item->started = item->finished = apr_time_now();
+        if (item->md->state == MD_S_ERROR) {
+            md_result_printf(item->result, APR_EGENERAL, "in error state. Please check the "
+                             "server logs or run this command in very verbose form and check "
+                             "the output.");
+            item->rv = item->result->status;
+        }
+        else if (!force && !md_reg_should_renew(ctx->reg, item->md, ctx->p)) {
+            md_result_printf(item->result, APR_SUCCESS, "complete.");
+        }
+        else {
+            item->renew = 1;
+            ++nrenew;
+            if (first < 0) first = i;
+        }
+    }
+    
+    /* Mds without an ACME account get a new one. Drive the first alone, so that 
+     * the others find and use its account instead of each creating their own. */
+    if (first >= 0) {
+        drive_item_renew(ctx, &jobs.items[first], jobs.items[first].result, ctx->p);
+        jobs.items[first].renew = 0;
+        --nrenew;
+    }
+    
+    if (threads > nrenew) threads = nrenew;
+#if APR_HAS_THREADS
+    if (threads > 1) {
+        workers = apr_pcalloc(ctx->p, sizeof(apr_thread_t*) * (apr_size_t)threads);
+        wctxs = apr_pcalloc(ctx->p, sizeof(drive_worker_t) * (apr_size_t)threads);
+        for (i = 0; i < threads; ++i) {
+            wctxs[i].jobs = &jobs;
+            if (APR_SUCCESS != (rv = drive_worker_pool(&wctxs[i].p, ctx->p))) break;
+            /* the thread's pool is destroyed by the thread itself, keep it off ctx->p */
+            if (APR_SUCCESS != (rv = apr_thread_create(&workers[i], NULL, drive_worker, 
+                                                       &wctxs[i], wctxs[i].p))) {
+                apr_pool_destroy(wctxs[i].p);
+                break;
+            }
+            ++started;
+        }
+        if (APR_SUCCESS != rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ctx->p, 
+                          "drive: started %d of %d threads", started, threads);
+            rv = APR_SUCCESS;
+        }
+        if (started < 1) drive_jobs_run(&jobs, ctx->p);
+        for (i = 0; i < started; ++i) {
+            apr_thread_join(&trv, workers[i]);
+        }
+        drive_results_collect(&jobs);
+        for (i = 0; i < started; ++i) {
+            apr_pool_destroy(wctxs[i].p);
+        }
+    }
+    else
+#endif
+    drive_jobs_run(&jobs, ctx->p);
+    drive_results_collect(&jobs);
+    if (first >= 0) jobs.items[first].renew = 1;
+    
+    for (i = 0; i < jobs.nitems; ++i) {
+        item = &jobs.items[i];
+        level = MD_LOG_TRACE1;
+        if (item->renew) {
+            if (APR_SUCCESS == item->rv) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, "%s: loading", 
+                              item->md->name);
+                item->rv = md_reg_load_staging(ctx->reg, item->md, ctx->env, 
+                                               item->result, ctx->p);
+            }
+            level = MD_LOG_INFO;
+        }
+        if (APR_SUCCESS != item->rv) {
+            ++nfailed;
+            if (APR_SUCCESS == rv) rv = item->rv;
+            level = MD_LOG_INFO;
+        }
+        md_result_log(item->result, level);
+        drive_item_report(ctx, item);
+    }
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, rv, ctx->p, 
+                  "drive: %d mds, %d renewed, %d failed in %.1f s", jobs.nitems, 
+                  nrenew + (first >= 0), nfailed, 
+                  (double)(apr_time_now() - start) / APR_USEC_PER_SEC);
+    if (!ctx->json_out) {
+        fprintf(stdout, "drive: %d mds, %d renewed, %d failed in %.1f s\n", jobs.nitems, 
+                nrenew + (first >= 0), nfailed, 
+                (double)(apr_time_now() - start) / APR_USEC_PER_SEC);
+    }
+    return rv;
+}
+
 static apr_status_t cmd_reg_drive(md_cmd_ctx *ctx, const md_cmd_t *cmd)
 {
     apr_array_header_t *mdlist = apr_array_make(ctx->p, 5, sizeof(md_t *));
+    const char *s;
     md_t *md;
     apr_status_t rv;
     int i;
@@ -310,6 +784,10 @@ static apr_status_t cmd_reg_drive(md_cmd_ctx *ctx, const md_cmd_t *cmd)
         qsort(mdlist->elts, (size_t)mdlist->nelts, sizeof(md_t *), md_name_cmp);
     }   
     
+    if (NULL != (s = md_cmd_ctx_get_option(ctx, "jobs"))) {
+        return drive_parallel(ctx, mdlist, (int)apr_atoi64(s));
+    }
+    
     rv = APR_SUCCESS;
     for (i = 0; i < mdlist->nelts; ++i) {
         md = APR_ARRAY_IDX(mdlist, i, md_t*);
@@ -333,6 +811,13 @@ static apr_status_t cmd_reg_drive_opts(md_cmd_ctx *ctx, int option, const char *
         case 'r':
             md_cmd_ctx_set_option(ctx, "reset", "1");
             break;
+        case 'J':
+            if (apr_atoi64(optarg) < 1) {
+                fprintf(stderr, "jobs must be a positive number: %s\n", optarg);
+                return APR_EINVAL;
+            }
+            md_cmd_ctx_set_option(ctx, "jobs", optarg);
+            break;
         default:
             return APR_EINVAL;
     }
@@ -343,6 +828,8 @@ static apr_getopt_option_t DriveOptions [] = {
     { "challenge",'c', 1, "which challenge type to use"},
     { "force",    'f', 0, "force driving the managed domain, even when it seems valid"},
     { "reset",    'r', 0, "reset any staging data for the managed domain"},
+    { "jobs",     'J', 1, "drive this many managed domains in parallel and report all "
+                          "results with timings at the end"},
     { NULL , 0, 0, NULL }
 };
 
@@ -18,6 +18,7 @@
 
 extern md_cmd_t MD_RegAddCmd;
 extern md_cmd_t MD_RegUpdateCmd;
+extern md_cmd_t MD_RegBulkCmd;
 extern md_cmd_t MD_RegDriveCmd;
 extern md_cmd_t MD_RegListCmd;
 
@@ -213,6 +213,49 @@ static md_cmd_t UpdateCmd = {
     "update the managed domain <name> in the store"
 };
 
+/**************************************************************************************************/
+/* command: store show */
+
+static apr_status_t cmd_show(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    unsigned int group;
+    md_json_t *json;
+    const char *out;
+    apr_status_t rv;
+    
+    if (ctx->argc != 3) {
+        return usage(cmd, "needs group, name and aspect");
+    }
+    for (group = MD_SG_NONE; group < MD_SG_COUNT; ++group) {
+        if (!strcmp(ctx->argv[0], md_store_group_name(group))) break;
+    }
+    if (group >= MD_SG_COUNT) {
+        fprintf(stderr, "unknown store group: %s\n", ctx->argv[0]);
+        return APR_EINVAL;
+    }
+    
+    rv = md_store_load_json(ctx->store, (md_store_group_t)group, ctx->argv[1], ctx->argv[2], &json, ctx->p);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "loading %s/%s/%s", 
+                      ctx->argv[0], ctx->argv[1], ctx->argv[2]);
+        return rv;
+    }
+    if (ctx->json_out) {
+        md_json_addj(json, ctx->json_out, "output", NULL);
+    }
+    else if (NULL != (out = md_json_writep(json, ctx->p, MD_JSON_FMT_INDENT))) {
+        fprintf(stdout, "%s\n", out);
+    }
+    return rv;
+}
+
+static md_cmd_t ShowCmd = {
+    "show", MD_CTX_STORE, 
+    NULL, cmd_show, MD_NoOptions, NULL,
+    "show group name aspect",
+    "print the JSON value stored for a name, e.g. 'show staging example.org job.json'"
+};
+
 /**************************************************************************************************/
 /* command: store */
 
@@ -221,6 +264,7 @@ static const md_cmd_t *StoreSubCmds[] = {
     &RemoveCmd,
     &ListCmd,
     &UpdateCmd,
+    &ShowCmd,
     NULL
 };
 
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
 #include <apr_time.h>
@@ -31,9 +32,31 @@
 #include "md_util.h"
 
 
+static int dns_names_valid(const md_t *md)
+{
+    return md->dns_names && md->dns_names_of == md->domains 
+        && md->dns_names->nelts == md->domains->nelts;
+}
+
 int md_contains(const md_t *md, const char *domain, int case_sensitive)
 {
-   return md_array_str_index(md->domains, domain, 0, case_sensitive) >= 0;
+    if (!case_sensitive && dns_names_valid(md)) {
+        return md_dns_names_index(md->dns_names, domain) >= 0;
+    }
+    return md_array_str_index(md->domains, domain, 0, case_sensitive) >= 0;
+}
+
+void md_update_dns_names(md_t *md, apr_pool_t *p)
+{
+    if (!md->domains) return;
+    if (md->dns_names && md->dns_names_of == md->domains 
+        && md->dns_names->nelts <= md->domains->nelts) {
+        md_dns_names_add(md->dns_names, md->domains, md->dns_names->nelts, p);
+    }
+    else {
+        md->dns_names = md_dns_names_make(p, md->domains);
+    }
+    md->dns_names_of = md->domains;
 }
 
 const char *md_common_name(const md_t *md1, const md_t *md2)
@@ -180,6 +203,215 @@ md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md)
     return NULL;
 }
 
+/**************************************************************************************************/
+/* index */
+
+struct md_index_t {
+    apr_array_header_t *mds;        /* the indexed mds, in their order */
+    apr_hash_t *by_name;            /* name -> first md_t* of that name */
+    apr_hash_t *by_domain;          /* lower case domain -> array of int, positions in mds */
+};
+
+/* Longest DNS name we look up without allocating, longer ones are not
+ * valid DNS names, but are looked up the slow way nevertheless. */
+#define MD_INDEX_KEY_MAX    256
+
+static const char *index_key(char *buf, apr_size_t len, const char *domain)
+{
+    apr_size_t i;
+    
+    for (i = 0; domain[i]; ++i) {
+        if (i + 1 >= len) return NULL;
+        buf[i] = (char)apr_tolower(domain[i]);
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+md_index_t *md_index_make(apr_pool_t *p, apr_array_header_t *mds)
+{
+    md_index_t *idx;
+    apr_array_header_t *list;
+    const char *domain, *key;
+    md_t *md;
+    int i, j;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->mds = mds;
+    idx->by_name = apr_hash_make(p);
+    idx->by_domain = apr_hash_make(p);
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, md_t*);
+        if (!apr_hash_get(idx->by_name, md->name, APR_HASH_KEY_STRING)) {
+            apr_hash_set(idx->by_name, md->name, APR_HASH_KEY_STRING, md);
+        }
+        for (j = 0; j < md->domains->nelts; ++j) {
+            domain = APR_ARRAY_IDX(md->domains, j, const char*);
+            key = md_util_str_tolower(apr_pstrdup(p, domain));
+            list = apr_hash_get(idx->by_domain, key, APR_HASH_KEY_STRING);
+            if (!list) {
+                list = apr_array_make(p, 1, sizeof(int));
+                apr_hash_set(idx->by_domain, key, APR_HASH_KEY_STRING, list);
+            }
+            if (list->nelts == 0 || APR_ARRAY_IDX(list, list->nelts-1, int) != i) {
+                APR_ARRAY_PUSH(list, int) = i;
+            }
+        }
+    }
+    return idx;
+}
+
+md_t *md_index_get_by_name(const md_index_t *idx, const char *name)
+{
+    return apr_hash_get(idx->by_name, name, APR_HASH_KEY_STRING);
+}
+
+static apr_array_header_t *index_get_list(const md_index_t *idx, const char *domain, int *pslow)
+{
+    char buf[MD_INDEX_KEY_MAX];
+    const char *key;
+    
+    *pslow = 0;
+    if (!(key = index_key(buf, sizeof(buf), domain))) {
+        *pslow = 1;
+        return NULL;
+    }
+    return apr_hash_get(idx->by_domain, key, APR_HASH_KEY_STRING);
+}
+
+md_t *md_index_get_by_domain(const md_index_t *idx, const char *domain)
+{
+    apr_array_header_t *list;
+    int slow;
+    
+    list = index_get_list(idx, domain, &slow);
+    if (slow) return md_get_by_domain(idx->mds, domain);
+    return list? APR_ARRAY_IDX(idx->mds, APR_ARRAY_IDX(list, 0, int), md_t*) : NULL;
+}
+
+md_t *md_index_get_by_dns_overlap(const md_index_t *idx, const md_t *md, 
+                                  const char **pdomain)
+{
+    apr_array_header_t *list;
+    const char *domain;
+    md_t *o, *found = NULL;
+    int i, j, pos, found_pos = -1, slow;
+    
+    /* The first md in mds order that shares any domain with md. */
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        list = index_get_list(idx, domain, &slow);
+        if (slow) {
+            found = md_get_by_dns_overlap(idx->mds, md);
+            if (pdomain) *pdomain = md_common_name(md, found);
+            return found;
+        }
+        if (!list) continue;
+        for (j = 0; j < list->nelts; ++j) {
+            pos = APR_ARRAY_IDX(list, j, int);
+            if (found_pos >= 0 && pos >= found_pos) break;
+            o = APR_ARRAY_IDX(idx->mds, pos, md_t*);
+            if (strcmp(o->name, md->name)) {
+                found_pos = pos;
+                found = o;
+                break;
+            }
+        }
+    }
+    if (found && pdomain) *pdomain = md_common_name(md, found);
+    return found;
+}
+
+typedef struct {
+    int pos;
+    apr_size_t hits;
+} index_hits_t;
+
+static int is_excluded(apr_hash_t *excluded, const md_t *md)
+{
+    return excluded && apr_hash_get(excluded, md->name, APR_HASH_KEY_STRING) != NULL;
+}
+
+static md_t *get_closest_slow(const md_index_t *idx, const md_t *md, apr_hash_t *excluded)
+{
+    md_t *candidate = NULL, *m;
+    apr_size_t cand_n, n;
+    int i;
+    
+    for (i = 0; i < idx->mds->nelts; ++i) {
+        m = APR_ARRAY_IDX(idx->mds, i, md_t *);
+        if (!is_excluded(excluded, m) && md_contains_domains(m, md)) return m;
+    }
+    cand_n = 0;
+    for (i = 0; i < idx->mds->nelts; ++i) {
+        m = APR_ARRAY_IDX(idx->mds, i, md_t *);
+        if (is_excluded(excluded, m)) continue;
+        n = md_common_name_count(md, m);
+        if (n > cand_n) {
+            candidate = m;
+            cand_n = n;
+        }
+    }
+    return candidate;
+}
+
+md_t *md_index_get_closest(const md_index_t *idx, const md_t *md, 
+                           apr_hash_t *excluded, apr_pool_t *p)
+{
+    apr_hash_t *hits, *seen;
+    apr_array_header_t *list;
+    index_hits_t *h, *full = NULL, *most = NULL;
+    const char *domain, *key;
+    apr_size_t nkeys = 0;
+    md_t *m;
+    int i, j, slow;
+    
+    m = md_index_get_by_name(idx, md->name);
+    if (m && !is_excluded(excluded, m)) return m;
+    
+    /* Count for each md how many of our domains it has, looking only at
+     * the mds that have at least one. */
+    hits = apr_hash_make(p);
+    seen = apr_hash_make(p);
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        list = index_get_list(idx, domain, &slow);
+        if (slow) return get_closest_slow(idx, md, excluded);
+        key = md_util_str_tolower(apr_pstrdup(p, domain));
+        if (apr_hash_get(seen, key, APR_HASH_KEY_STRING)) continue;
+        apr_hash_set(seen, key, APR_HASH_KEY_STRING, key);
+        ++nkeys;
+        if (!list) continue;
+        for (j = 0; j < list->nelts; ++j) {
+            h = apr_hash_get(hits, &APR_ARRAY_IDX(list, j, int), sizeof(int));
+            if (!h) {
+                m = APR_ARRAY_IDX(idx->mds, APR_ARRAY_IDX(list, j, int), md_t*);
+                if (is_excluded(excluded, m)) continue;
+                h = apr_pcalloc(p, sizeof(*h));
+                h->pos = APR_ARRAY_IDX(list, j, int);
+                apr_hash_set(hits, &h->pos, sizeof(h->pos), h);
+            }
+            ++h->hits;
+        }
+    }
+    /* An md having all our domains wins, otherwise the one with most, the
+     * first in order on ties. */
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        list = index_get_list(idx, domain, &slow);
+        if (!list) continue;
+        for (j = 0; j < list->nelts; ++j) {
+            h = apr_hash_get(hits, &APR_ARRAY_IDX(list, j, int), sizeof(int));
+            if (!h) continue;
+            if (h->hits == nkeys && (!full || h->pos < full->pos)) full = h;
+            if (!most || h->hits > most->hits 
+                || (h->hits == most->hits && h->pos < most->pos)) most = h;
+        }
+    }
+    h = full? full : most;
+    return h? APR_ARRAY_IDX(idx->mds, h->pos, md_t*) : NULL;
+}
+
 md_t *md_create(apr_pool_t *p, apr_array_header_t *domains)
 {
     md_t *md;
@@ -202,6 +434,10 @@ md_t *md_copy(apr_pool_t *p, const md_t *src)
     if (md) {
         memcpy(md, src, sizeof(*md));
         md->domains = apr_array_copy(p, src->domains);
+        if (dns_names_valid(src)) {
+            md->dns_names = apr_array_copy(p, src->dns_names);
+            md->dns_names_of = md->domains;
+        }
         md->contacts = apr_array_copy(p, src->contacts);
         if (src->ca_challenges) {
             md->ca_challenges = apr_array_copy(p, src->ca_challenges);
@@ -294,26 +530,41 @@ md_json_t *md_to_json(const md_t *md, apr_pool_t *p)
     return NULL;
 }
 
+static const md_json_field_t md_fields[] = {
+    MD_JSON_FIELD(MD_KEY_NAME, MD_JSON_FIELD_DUPS, md_t, name),
+    MD_JSON_FIELD(MD_KEY_RENEW_MODE, MD_JSON_FIELD_INT, md_t, renew_mode),
+    MD_JSON_FIELD(MD_KEY_TRANSITIVE, MD_JSON_FIELD_INT, md_t, transitive),
+    MD_JSON_FIELD(MD_KEY_MUST_STAPLE, MD_JSON_FIELD_BOOL, md_t, must_staple),
+    MD_JSON_FIELD(MD_KEY_CERT_FILE, MD_JSON_FIELD_DUPS, md_t, cert_file),
+    MD_JSON_FIELD(MD_KEY_PKEY_FILE, MD_JSON_FIELD_DUPS, md_t, pkey_file),
+    MD_JSON_FIELD(MD_KEY_STAPLING, MD_JSON_FIELD_BOOL, md_t, stapling),
+};
+
+static const char * const md_ca_path[] = { MD_KEY_CA, NULL };
+
+static const md_json_field_t md_ca_fields[] = {
+    MD_JSON_FIELD(MD_KEY_ACCOUNT, MD_JSON_FIELD_DUPS, md_t, ca_account),
+    MD_JSON_FIELD(MD_KEY_PROTO, MD_JSON_FIELD_DUPS, md_t, ca_proto),
+    MD_JSON_FIELD(MD_KEY_URL, MD_JSON_FIELD_DUPS, md_t, ca_url),
+    MD_JSON_FIELD(MD_KEY_AGREEMENT, MD_JSON_FIELD_DUPS, md_t, ca_agreement),
+};
+
 md_t *md_from_json(md_json_t *json, apr_pool_t *p)
 {
     const char *s;
     md_t *md = md_create_empty(p);
     if (md) {
-        md->name = md_json_dups(p, json, MD_KEY_NAME, NULL);            
+        md_json_get_fields(md, md_fields, sizeof(md_fields)/sizeof(md_fields[0]), json, NULL, p);
+        md_json_get_fields(md, md_ca_fields, sizeof(md_ca_fields)/sizeof(md_ca_fields[0]),
+                           json, md_ca_path, p);
         md_json_dupsa(md->domains, p, json, MD_KEY_DOMAINS, NULL);
         md_json_dupsa(md->contacts, p, json, MD_KEY_CONTACTS, NULL);
-        md->ca_account = md_json_dups(p, json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
-        md->ca_proto = md_json_dups(p, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
-        md->ca_url = md_json_dups(p, json, MD_KEY_CA, MD_KEY_URL, NULL);
-        md->ca_agreement = md_json_dups(p, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
         if (md_json_has_key(json, MD_KEY_PKEY, MD_KEY_TYPE, NULL)) {
             md->pkey_spec = md_pkey_spec_from_json(md_json_getj(json, MD_KEY_PKEY, NULL), p);
         }
         md->state = (md_state_t)md_json_getl(json, MD_KEY_STATE, NULL);
         if (MD_S_EXPIRED_DEPRECATED == md->state) md->state = MD_S_COMPLETE;
-        md->renew_mode = (int)md_json_getl(json, MD_KEY_RENEW_MODE, NULL);
         md->domains = md_array_str_compact(p, md->domains, 0);
-        md->transitive = (int)md_json_getl(json, MD_KEY_TRANSITIVE, NULL);
         s = md_json_gets(json, MD_KEY_RENEW_WINDOW, NULL);
         md_timeslice_parse(&md->renew_window, p, s, MD_TIME_LIFE_NORM);
         s = md_json_gets(json, MD_KEY_WARN_WINDOW, NULL);
@@ -330,13 +581,7 @@ md_t *md_from_json(md_json_t *json, apr_pool_t *p)
         else if (s && !strcmp(MD_KEY_PERMANENT, s)) {
             md->require_https = MD_REQUIRE_PERMANENT;
         }
-        md->must_staple = (int)md_json_getb(json, MD_KEY_MUST_STAPLE, NULL);
         md_json_dupsa(md->acme_tls_1_domains, p, json, MD_KEY_PROTO, MD_KEY_ACME_TLS_1, NULL);
-            
-        md->cert_file = md_json_dups(p, json, MD_KEY_CERT_FILE, NULL); 
-        md->pkey_file = md_json_dups(p, json, MD_KEY_PKEY_FILE, NULL); 
-        md->stapling = (int)md_json_getb(json, MD_KEY_STAPLING, NULL);
-        
         return md;
     }
     return NULL;
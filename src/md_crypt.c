@@ -21,8 +21,12 @@
 #include <apr_lib.h>
 #include <apr_buckets.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
@@ -68,11 +72,19 @@
 #include <openssl/ct.h>
 #endif
 
+#if !defined(LIBRESSL_VERSION_NUMBER) && (OPENSSL_VERSION_NUMBER >= 0x10101000L)
+/* Ed25519 keys and one-shot signing are available since OpenSSL v1.1.1 */
+#define MD_HAVE_ED25519 1
+#else
+#define MD_HAVE_ED25519 0
+#endif
+
 static int initialized;
 
 struct md_pkey_t {
     apr_pool_t *pool;
     EVP_PKEY   *pkey;
+    md_pkey_jwk_t *jwk;     /* public JWK, once computed */
 };
 
 #ifdef MD_HAVE_ARC4RANDOM
@@ -262,6 +274,66 @@ apr_time_t md_asn1_generalized_time_get(void *ASN1_GENERALIZEDTIME)
 /**************************************************************************************************/
 /* private keys */
 
+typedef struct {
+    const char *name;          /* JWA name of the curve */
+    const char *sec_name;      /* SEC 2 name of the curve */
+    int nid;
+    const char *jws_alg;
+    const EVP_MD *(*digest)(void);
+    apr_size_t coord_len;      /* bytes in a coordinate and in half the signature */
+} ec_curve_t;
+
+static const ec_curve_t ec_curves[] = {
+    { "P-256", "secp256r1", NID_X9_62_prime256v1, "ES256", EVP_sha256, 32 },
+    { "P-384", "secp384r1", NID_secp384r1,        "ES384", EVP_sha384, 48 },
+};
+
+static const ec_curve_t *ec_curve_get(const char *name)
+{
+    apr_size_t i;
+    
+    for (i = 0; i < sizeof(ec_curves)/sizeof(ec_curves[0]); ++i) {
+        if (!apr_strnatcasecmp(name, ec_curves[i].name) 
+            || !apr_strnatcasecmp(name, ec_curves[i].sec_name)) {
+            return &ec_curves[i];
+        }
+    }
+    /* the name OpenSSL uses for P-256 */
+    if (!apr_strnatcasecmp(name, "prime256v1")) return &ec_curves[0];
+    return NULL;
+}
+
+static const ec_curve_t *ec_curve_get_nid(int nid)
+{
+    apr_size_t i;
+    
+    for (i = 0; i < sizeof(ec_curves)/sizeof(ec_curves[0]); ++i) {
+        if (nid == ec_curves[i].nid) return &ec_curves[i];
+    }
+    return NULL;
+}
+
+const char *md_pkey_ec_curve_name(const char *name)
+{
+    const ec_curve_t *curve = name? ec_curve_get(name) : NULL;
+    return curve? curve->name : NULL;
+}
+
+int md_pkey_spec_is_supported(const md_pkey_spec_t *spec)
+{
+    switch (spec? spec->type : MD_PKEY_TYPE_DEFAULT) {
+        case MD_PKEY_TYPE_DEFAULT:
+        case MD_PKEY_TYPE_RSA:
+            return 1;
+        case MD_PKEY_TYPE_EC:
+            return !spec->params.ec.curve || ec_curve_get(spec->params.ec.curve) != NULL;
+        case MD_PKEY_TYPE_ED25519:
+            return MD_HAVE_ED25519;
+        default:
+            return 0;
+    }
+}
+
 md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
@@ -276,6 +348,14 @@ md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p)
                     md_json_setl((long)spec->params.rsa.bits, json, MD_KEY_BITS, NULL);
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                md_json_sets("EC", json, MD_KEY_TYPE, NULL);
+                md_json_sets(spec->params.ec.curve? spec->params.ec.curve : MD_PKEY_EC_CURVE_DEF,
+                             json, MD_KEY_CURVE, NULL);
+                break;
+            case MD_PKEY_TYPE_ED25519:
+                md_json_sets("Ed25519", json, MD_KEY_TYPE, NULL);
+                break;
             default:
                 md_json_sets("Unsupported", json, MD_KEY_TYPE, NULL);
                 break;
@@ -305,6 +385,15 @@ md_pkey_spec_t *md_pkey_spec_from_json(struct md_json_t *json, apr_pool_t *p)
                 spec->params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
             }
         }
+        else if (!apr_strnatcasecmp("EC", s)) {
+            spec->type = MD_PKEY_TYPE_EC;
+            s = md_json_gets(json, MD_KEY_CURVE, NULL);
+            spec->params.ec.curve = s? md_pkey_ec_curve_name(s) : NULL;
+            if (!spec->params.ec.curve) spec->params.ec.curve = MD_PKEY_EC_CURVE_DEF;
+        }
+        else if (!apr_strnatcasecmp("Ed25519", s)) {
+            spec->type = MD_PKEY_TYPE_ED25519;
+        }
     }
     return spec;
 }
@@ -323,6 +412,14 @@ int md_pkey_spec_eq(md_pkey_spec_t *spec1, md_pkey_spec_t *spec2)
                     return 1;
                 }
                 break;
+            case MD_PKEY_TYPE_EC:
+                if (spec1->params.ec.curve && spec2->params.ec.curve
+                    && !strcmp(spec1->params.ec.curve, spec2->params.ec.curve)) {
+                    return 1;
+                }
+                break;
+            case MD_PKEY_TYPE_ED25519:
+                return 1;
         }
     }
     return 0;
@@ -444,13 +541,56 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
     apr_status_t rv;
     
     if (APR_SUCCESS == (rv = pkey_to_buffer(&buffer, pkey, p, pass_phrase, pass_len))) {
-        return md_util_freplace(fname, perms, p, fwrite_buffer, &buffer); 
+        return md_util_freplace(fname, perms, MD_UTIL_SYNC_FULL, p, fwrite_buffer, &buffer); 
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "save pkey %s (%s pass phrase, len=%d)",
                   fname, pass_len > 0? "with" : "without", (int)pass_len); 
     return rv;
 }
 
+apr_status_t md_pkey_to_pem(md_data_t *buffer, md_pkey_t *pkey, apr_pool_t *p, 
+                            const char *pass_phrase, apr_size_t pass_len)
+{
+    return pkey_to_buffer(buffer, pkey, p, pass_phrase, pass_len);
+}
+
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, 
+                              const char *pem, apr_size_t pem_len,
+                              const char *pass_phrase, apr_size_t pass_len)
+{
+    apr_status_t rv = APR_EINVAL;
+    md_pkey_t *pkey = NULL;
+    BIO *bf;
+    passwd_ctx ctx;
+    
+    if (pem_len > INT_MAX) goto leave;
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)pem_len))) {
+        rv = APR_ENOMEM;
+        goto leave;
+    }
+    ctx.pass_phrase = pass_phrase;
+    ctx.pass_len = (int)pass_len;
+    
+    pkey = make_pkey(p);
+    ERR_clear_error();
+    pkey->pkey = PEM_read_bio_PrivateKey(bf, NULL, pem_passwd, &ctx);
+    BIO_free(bf);
+    
+    if (pkey->pkey != NULL) {
+        rv = APR_SUCCESS;
+        apr_pool_cleanup_register(p, pkey, pkey_cleanup, apr_pool_cleanup_null);
+    }
+    else {
+        unsigned long err = ERR_get_error();
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "error reading pkey: %s (pass phrase was %snull)",
+                      ERR_error_string(err, NULL), pass_phrase? "not " : ""); 
+    }
+leave:
+    *ppkey = (APR_SUCCESS == rv)? pkey : NULL;
+    return rv;
+}
+
 static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
 {
     EVP_PKEY_CTX *ctx = NULL;
@@ -476,6 +616,68 @@ static apr_status_t gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, unsigned int bits)
     return rv;
 }
 
+static apr_status_t gen_ec(md_pkey_t **ppkey, apr_pool_t *p, const char *curve_name)
+{
+    const ec_curve_t *curve;
+    EC_KEY *eckey = NULL;
+    apr_status_t rv = APR_EGENERAL;
+    
+    *ppkey = NULL;
+    if (!(curve = ec_curve_get(curve_name? curve_name : MD_PKEY_EC_CURVE_DEF))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "unsupported EC curve %s", curve_name);
+        return APR_ENOTIMPL;
+    }
+    *ppkey = make_pkey(p);
+    if ((eckey = EC_KEY_new_by_curve_name(curve->nid))) {
+        /* certificates need to carry the name of the curve, not its parameters */
+        EC_KEY_set_asn1_flag(eckey, OPENSSL_EC_NAMED_CURVE);
+        if (EC_KEY_generate_key(eckey)
+            && ((*ppkey)->pkey = EVP_PKEY_new())
+            && EVP_PKEY_assign_EC_KEY((*ppkey)->pkey, eckey)) {
+            eckey = NULL; /* owned by pkey now */
+            rv = APR_SUCCESS;
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "error generate pkey EC %s", curve->name); 
+        if ((*ppkey)->pkey) EVP_PKEY_free((*ppkey)->pkey);
+        *ppkey = NULL;
+    }
+    if (eckey) EC_KEY_free(eckey);
+    return rv;
+}
+
+static apr_status_t gen_ed25519(md_pkey_t **ppkey, apr_pool_t *p)
+{
+#if MD_HAVE_ED25519
+    EVP_PKEY_CTX *ctx = NULL;
+    apr_status_t rv;
+    
+    *ppkey = make_pkey(p);
+    ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+    if (ctx 
+        && EVP_PKEY_keygen_init(ctx) >= 0
+        && EVP_PKEY_keygen(ctx, &(*ppkey)->pkey) >= 0) {
+        rv = APR_SUCCESS;
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, "error generate pkey Ed25519"); 
+        *ppkey = NULL;
+        rv = APR_EGENERAL;
+    }
+    
+    if (ctx != NULL) {
+        EVP_PKEY_CTX_free(ctx);
+    }
+    return rv;
+#else
+    *ppkey = NULL;
+    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, APR_ENOTIMPL, p, 
+                  "Ed25519 keys are not supported by this SSL library"); 
+    return APR_ENOTIMPL;
+#endif
+}
+
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec)
 {
     md_pkey_type_t ptype = spec? spec->type : MD_PKEY_TYPE_DEFAULT;
@@ -484,6 +686,10 @@ apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec)
             return gen_rsa(ppkey, p, MD_PKEY_RSA_BITS_DEF);
         case MD_PKEY_TYPE_RSA:
             return gen_rsa(ppkey, p, spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            return gen_ec(ppkey, p, spec->params.ec.curve);
+        case MD_PKEY_TYPE_ED25519:
+            return gen_ed25519(ppkey, p);
         default:
             return APR_ENOTIMPL;
     }
@@ -507,6 +713,14 @@ static void RSA_get0_key(const RSA *r,
         *d = r->d;
 }
 
+static void ECDSA_SIG_get0(const ECDSA_SIG *sig, const BIGNUM **pr, const BIGNUM **ps)
+{
+    if (pr != NULL)
+        *pr = sig->r;
+    if (ps != NULL)
+        *ps = sig->s;
+}
+
 #endif
 
 static const char *bn64(const BIGNUM *b, apr_pool_t *p) 
@@ -527,25 +741,229 @@ static const char *bn64(const BIGNUM *b, apr_pool_t *p)
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *e;
+    const char *e64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, NULL, &e, NULL);
-    return bn64(e, p);
+    e64 = bn64(e, p);
+    RSA_free(rsa);
+    return e64;
 }
 
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p)
 {
     const BIGNUM *n;
+    const char *n64;
     RSA *rsa = EVP_PKEY_get1_RSA(pkey->pkey);
     
     if (!rsa) {
         return NULL;
     }
     RSA_get0_key(rsa, &n, NULL, NULL);
-    return bn64(n, p);
+    n64 = bn64(n, p);
+    RSA_free(rsa);
+    return n64;
+}
+
+static apr_status_t bn_pad(unsigned char *buf, apr_size_t len, const BIGNUM *b)
+{
+    apr_size_t blen = (apr_size_t)BN_num_bytes(b);
+    
+    if (blen > len) return APR_EINVAL;
+    memset(buf, 0, len - blen);
+    BN_bn2bin(b, buf + (len - blen));
+    return APR_SUCCESS;
+}
+
+static const char *bn64_pad(const BIGNUM *b, apr_size_t len, apr_pool_t *p) 
+{
+    md_data_t buffer;
+
+    buffer.len = len;
+    buffer.data = apr_pcalloc(p, buffer.len);
+    if (APR_SUCCESS != bn_pad((unsigned char *)buffer.data, len, b)) return NULL; 
+    return md_util_base64url_encode(&buffer, p);
+}
+
+md_pkey_type_t md_pkey_get_type(md_pkey_t *pkey)
+{
+    switch (EVP_PKEY_base_id(pkey->pkey)) {
+        case EVP_PKEY_EC:
+            return MD_PKEY_TYPE_EC;
+#if MD_HAVE_ED25519
+        case EVP_PKEY_ED25519:
+            return MD_PKEY_TYPE_ED25519;
+#endif
+        default:
+            return MD_PKEY_TYPE_RSA;
+    }
+}
+
+static const ec_curve_t *pkey_ec_curve(md_pkey_t *pkey)
+{
+    const ec_curve_t *curve = NULL;
+    EC_KEY *eckey;
+    
+    if ((eckey = EVP_PKEY_get1_EC_KEY(pkey->pkey))) {
+        curve = ec_curve_get_nid(EC_GROUP_get_curve_name(EC_KEY_get0_group(eckey)));
+        EC_KEY_free(eckey);
+    }
+    return curve;
+}
+
+const char *md_pkey_get_ec_curve(md_pkey_t *pkey)
+{
+    const ec_curve_t *curve = pkey_ec_curve(pkey);
+    return curve? curve->name : NULL;
+}
+
+apr_status_t md_pkey_get_ec_xy64(const char **px64, const char **py64, 
+                                 md_pkey_t *pkey, apr_pool_t *p)
+{
+    const ec_curve_t *curve;
+    EC_KEY *eckey = NULL;
+    BIGNUM *x = NULL, *y = NULL;
+    apr_status_t rv = APR_EINVAL;
+    
+    *px64 = *py64 = NULL;
+    if (!(curve = pkey_ec_curve(pkey)) || !(eckey = EVP_PKEY_get1_EC_KEY(pkey->pkey))) goto leave;
+    if (!(x = BN_new()) || !(y = BN_new())) {
+        rv = APR_ENOMEM; goto leave;
+    }
+    if (EC_POINT_get_affine_coordinates_GFp(EC_KEY_get0_group(eckey), 
+                                            EC_KEY_get0_public_key(eckey), x, y, NULL)
+        && (*px64 = bn64_pad(x, curve->coord_len, p))
+        && (*py64 = bn64_pad(y, curve->coord_len, p))) {
+        rv = APR_SUCCESS;
+    }
+leave:
+    if (x) BN_free(x);
+    if (y) BN_free(y);
+    if (eckey) EC_KEY_free(eckey);
+    return rv;
+}
+
+const char *md_pkey_get_ed25519_x64(md_pkey_t *pkey, apr_pool_t *p)
+{
+#if MD_HAVE_ED25519
+    md_data_t buffer;
+    size_t len = 0;
+    
+    if (EVP_PKEY_ED25519 != EVP_PKEY_base_id(pkey->pkey)
+        || !EVP_PKEY_get_raw_public_key(pkey->pkey, NULL, &len)) {
+        return NULL;
+    }
+    buffer.len = len;
+    buffer.data = apr_pcalloc(p, buffer.len);
+    if (!EVP_PKEY_get_raw_public_key(pkey->pkey, (unsigned char *)buffer.data, &len)) {
+        return NULL;
+    }
+    return md_util_base64url_encode(&buffer, p);
+#else
+    (void)pkey;
+    (void)p;
+    return NULL;
+#endif
+}
+
+const char *md_pkey_get_jws_alg(md_pkey_t *pkey)
+{
+    const ec_curve_t *curve;
+    
+    switch (md_pkey_get_type(pkey)) {
+        case MD_PKEY_TYPE_EC:
+            curve = pkey_ec_curve(pkey);
+            return curve? curve->jws_alg : NULL;
+        case MD_PKEY_TYPE_ED25519:
+            return "EdDSA";
+        default:
+            return "RS256";
+    }
+}
+
+const md_pkey_jwk_t *md_pkey_get_jwk(md_pkey_t *pkey)
+{
+    md_pkey_jwk_t *jwk;
+    apr_pool_t *p = pkey->pool;
+    const char *s;
+    md_data_t data;
+    
+    if (pkey->jwk) return pkey->jwk;
+    
+    jwk = apr_pcalloc(p, sizeof(*jwk));
+    switch (md_pkey_get_type(pkey)) {
+        case MD_PKEY_TYPE_EC:
+            jwk->kty = "EC";
+            jwk->crv = md_pkey_get_ec_curve(pkey);
+            if (!jwk->crv || APR_SUCCESS != md_pkey_get_ec_xy64(&jwk->x, &jwk->y, pkey, p)) {
+                return NULL;
+            }
+            /* whitespace and order is relevant, since we hand out a digest of this */
+            s = apr_psprintf(p, "{\"crv\":\"%s\",\"kty\":\"%s\",\"x\":\"%s\",\"y\":\"%s\"}", 
+                             jwk->crv, jwk->kty, jwk->x, jwk->y);
+            break;
+        case MD_PKEY_TYPE_ED25519:
+            jwk->kty = "OKP";
+            jwk->crv = "Ed25519";
+            if (!(jwk->x = md_pkey_get_ed25519_x64(pkey, p))) return NULL;
+            s = apr_psprintf(p, "{\"crv\":\"%s\",\"kty\":\"%s\",\"x\":\"%s\"}", 
+                             jwk->crv, jwk->kty, jwk->x);
+            break;
+        default:
+            jwk->kty = "RSA";
+            jwk->e = md_pkey_get_rsa_e64(pkey, p);
+            jwk->n = md_pkey_get_rsa_n64(pkey, p);
+            if (!jwk->e || !jwk->n) return NULL;
+            s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"%s\",\"n\":\"%s\"}", 
+                             jwk->e, jwk->kty, jwk->n);
+            break;
+    }
+    MD_DATA_SET_STR(&data, s);
+    if (APR_SUCCESS != md_crypt_sha256_digest64(&jwk->thumb64, p, &data)) return NULL;
+    pkey->jwk = jwk;
+    return jwk;
+}
+
+/* The digest to sign with the key, NULL for keys that sign the message itself. */
+static const EVP_MD *pkey_get_MD(md_pkey_t *pkey)
+{
+    const ec_curve_t *curve;
+    
+    switch (md_pkey_get_type(pkey)) {
+        case MD_PKEY_TYPE_EC:
+            curve = pkey_ec_curve(pkey);
+            return curve? curve->digest() : EVP_sha256();
+        case MD_PKEY_TYPE_ED25519:
+            return NULL;
+        default:
+            return EVP_sha256();
+    }
+}
+
+/* ECDSA signatures are DER encoded by OpenSSL, JWS wants R and S concatenated. */
+static apr_status_t ecdsa_sig_to_jws(md_data_t *buffer, md_pkey_t *pkey, apr_pool_t *p)
+{
+    const unsigned char *der = (const unsigned char *)buffer->data;
+    const ec_curve_t *curve;
+    const BIGNUM *r, *s;
+    ECDSA_SIG *sig = NULL;
+    unsigned char *rs;
+    apr_status_t rv = APR_EGENERAL;
+    
+    if (!(curve = pkey_ec_curve(pkey))
+        || !(sig = d2i_ECDSA_SIG(NULL, &der, (long)buffer->len))) goto leave;
+    ECDSA_SIG_get0(sig, &r, &s);
+    rs = apr_pcalloc(p, 2 * curve->coord_len);
+    if (APR_SUCCESS != (rv = bn_pad(rs, curve->coord_len, r))
+        || APR_SUCCESS != (rv = bn_pad(rs + curve->coord_len, curve->coord_len, s))) goto leave;
+    buffer->data = (const char *)rs;
+    buffer->len = 2 * curve->coord_len;
+leave:
+    if (sig) ECDSA_SIG_free(sig);
+    return rv;
 }
 
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
@@ -553,7 +971,8 @@ apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *
 {
     EVP_MD_CTX *ctx = NULL;
     md_data_t buffer;
-    unsigned int blen;
+    size_t blen;
+    const EVP_MD *md;
     const char *sign64 = NULL;
     apr_status_t rv = APR_ENOMEM;
     
@@ -563,17 +982,34 @@ apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *
         ctx = EVP_MD_CTX_create();
         if (ctx) {
             rv = APR_ENOTIMPL;
-            if (EVP_SignInit_ex(ctx, EVP_sha256(), NULL)) {
+            md = pkey_get_MD(pkey);
+            if (EVP_DigestSignInit(ctx, NULL, md, NULL, pkey->pkey)) {
                 rv = APR_EGENERAL;
-                if (EVP_SignUpdate(ctx, d, dlen)) {
-                    if (EVP_SignFinal(ctx, (unsigned char*)buffer.data, &blen, pkey->pkey)) {
-                        buffer.len = blen;
-                        sign64 = md_util_base64url_encode(&buffer, p);
-                        if (sign64) {
-                            rv = APR_SUCCESS;
-                        }
+                blen = buffer.len;
+#if MD_HAVE_ED25519
+                if (!md) {
+                    /* Ed25519 signs the message itself, in one go */
+                    if (EVP_DigestSign(ctx, (unsigned char*)buffer.data, &blen,
+                                       (const unsigned char*)d, dlen)) {
+                        rv = APR_SUCCESS;
+                    }
+                }
+                else
+#endif
+                if (EVP_DigestSignUpdate(ctx, d, dlen)
+                    && EVP_DigestSignFinal(ctx, (unsigned char*)buffer.data, &blen)) {
+                    rv = APR_SUCCESS;
+                }
+                if (APR_SUCCESS == rv) {
+                    buffer.len = blen;
+                    if (MD_PKEY_TYPE_EC == md_pkey_get_type(pkey)) {
+                        rv = ecdsa_sig_to_jws(&buffer, pkey, p);
                     }
                 }
+                if (APR_SUCCESS == rv) {
+                    sign64 = md_util_base64url_encode(&buffer, p);
+                    if (!sign64) rv = APR_EGENERAL;
+                }
             }
         }
         
@@ -658,6 +1094,10 @@ struct md_cert_t {
     apr_pool_t *pool;
     X509 *x509;
     apr_array_header_t *alt_names;
+    apr_hash_t *alt_set;            /* alt_names in lower case, once needed */
+    int times_set;                  /* != 0 when not_before/not_after are */
+    apr_time_t not_before;
+    apr_time_t not_after;
 };
 
 static apr_status_t cert_cleanup(void *data)
@@ -678,13 +1118,191 @@ md_cert_t *md_cert_wrap(apr_pool_t *p, void *x509)
     return cert;
 }
 
+static void cert_times_init(md_cert_t *cert)
+{
+    cert->not_before = md_asn1_time_get(X509_get_notBefore(cert->x509));
+    cert->not_after = md_asn1_time_get(X509_get_notAfter(cert->x509));
+    cert->times_set = 1;
+}
+
 md_cert_t *md_cert_make(apr_pool_t *p, void *x509) 
 {
     md_cert_t *cert = md_cert_wrap(p, x509);
     apr_pool_cleanup_register(p, cert, cert_cleanup, apr_pool_cleanup_null);
+    /* Made certificates may be shared among threads, set their times right away.
+     * For wrapped ones, this happens when needed. */
+    if (x509) cert_times_init(cert);
     return cert;
 }
 
+static void x509_up_ref(X509 *x509)
+{
+#if MD_USE_OPENSSL_PRE_1_1_API
+    CRYPTO_add(&x509->references, 1, CRYPTO_LOCK_X509);
+#else
+    X509_up_ref(x509);
+#endif
+}
+
+md_cert_t *md_cert_dup(apr_pool_t *p, const md_cert_t *cert)
+{
+    x509_up_ref(cert->x509);
+    return md_cert_make(p, cert->x509);
+}
+
+/**************************************************************************************************/
+/* shared certificates */
+
+/* Parsed certificates by their DER encoding. Certificates with the same contents
+ * share one X509, the cache and each md_cert_t holding a reference. Entries are 
+ * added at runtime by several threads, the keys are allocated from a pool with
+ * an allocator of its own, used only with the mutex held. The cache starts anew
+ * when it has MD_CERT_CACHE_MAX entries and with each server generation. */
+#define MD_CERT_CACHE_MAX   1024
+
+typedef struct {
+    apr_pool_t *p;
+    apr_hash_t *by_der;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} cert_cache_t;
+
+static cert_cache_t *cert_cache;
+
+/* Drop all entries, md_cert_t instances keep their own references. */
+static void cert_cache_reset(cert_cache_t *cache)
+{
+    apr_hash_index_t *hi;
+    void *val;
+    
+    for (hi = apr_hash_first(NULL, cache->by_der); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        X509_free(val);
+    }
+    apr_pool_clear(cache->p);
+    cache->by_der = apr_hash_make(cache->p);
+}
+
+static apr_status_t cert_cache_cleanup(void *data)
+{
+    cert_cache_t *cache = data;
+    
+    if (cert_cache == cache) cert_cache = NULL;
+    cert_cache_reset(cache);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_cert_cache_init(apr_pool_t *p)
+{
+    cert_cache_t *cache;
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+    apr_allocator_max_free_set(allocator, 1);
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&cache->p, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto leave;
+    }
+    apr_allocator_owner_set(allocator, cache->p);
+    apr_pool_tag(cache->p, "md_cert_cache");
+    cache->by_der = apr_hash_make(cache->p);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+#endif
+    /* before cache->p is destroyed with the other subpools of p */
+    apr_pool_pre_cleanup_register(p, cache, cert_cache_cleanup);
+    cert_cache = cache;
+leave:
+    return rv;
+}
+
+static X509 *cert_cache_get(cert_cache_t *cache, const unsigned char *der, long der_len)
+{
+    X509 *x509;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    x509 = apr_hash_get(cache->by_der, der, (apr_ssize_t)der_len);
+    if (x509) x509_up_ref(x509);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+    return x509;
+}
+
+/* Add x509 for der, unless another thread was faster. Returns the cached instance with
+ * a reference for the caller, the passed one is consumed. */
+static X509 *cert_cache_add(cert_cache_t *cache, const unsigned char *der, long der_len,
+                            X509 *x509)
+{
+    X509 *other;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+    other = apr_hash_get(cache->by_der, der, (apr_ssize_t)der_len);
+    if (other) {
+        X509_free(x509);
+        x509 = other;
+    }
+    else {
+        if (apr_hash_count(cache->by_der) >= MD_CERT_CACHE_MAX) cert_cache_reset(cache);
+        apr_hash_set(cache->by_der, apr_pmemdup(cache->p, der, (apr_size_t)der_len), 
+                     (apr_ssize_t)der_len, x509);
+    }
+    x509_up_ref(x509);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+    return x509;
+}
+
+static X509 *cert_from_der(const unsigned char *der, long der_len)
+{
+    cert_cache_t *cache = cert_cache;
+    const unsigned char *bf = der;
+    X509 *x509;
+    
+    if (!cache) return d2i_X509(NULL, &bf, der_len);
+    if (NULL != (x509 = cert_cache_get(cache, der, der_len))) return x509;
+    if (NULL == (x509 = d2i_X509(NULL, &bf, der_len))) return NULL;
+    return cert_cache_add(cache, der, der_len, x509);
+}
+
+/* Read the next certificate as PEM_read_bio_X509() does, sharing it when cached. */
+static X509 *cert_read_pem_bio(BIO *bf)
+{
+    unsigned char *der = NULL;
+    char *name = NULL;
+    long der_len;
+    X509 *x509 = NULL;
+    
+    if (!cert_cache) return PEM_read_bio_X509(bf, NULL, NULL, NULL);
+    if (PEM_bytes_read_bio(&der, &der_len, &name, PEM_STRING_X509, bf, NULL, NULL)) {
+        x509 = cert_from_der(der, der_len);
+        OPENSSL_free(der);
+        OPENSSL_free(name);
+    }
+    return x509;
+}
+
+static X509 *cert_read_pem_fp(FILE *f)
+{
+    BIO *bf;
+    X509 *x509;
+    
+    if (!cert_cache) return PEM_read_X509(f, NULL, NULL, NULL);
+    if (NULL == (bf = BIO_new_fp(f, BIO_NOCLOSE))) return NULL;
+    x509 = cert_read_pem_bio(bf);
+    BIO_free(bf);
+    return x509;
+}
+
 void *md_cert_get_X509(const md_cert_t *cert)
 {
     return cert->x509;
@@ -708,50 +1326,93 @@ const char *md_cert_get_serial_number(const md_cert_t *cert, apr_pool_t *p)
 
 int md_cert_is_valid_now(const md_cert_t *cert)
 {
-    return ((X509_cmp_current_time(X509_get_notBefore(cert->x509)) < 0)
-            && (X509_cmp_current_time(X509_get_notAfter(cert->x509)) > 0));
+    apr_time_t now = apr_time_now();
+    return md_cert_get_not_before(cert) < now && md_cert_get_not_after(cert) > now;
 }
 
 int md_cert_has_expired(const md_cert_t *cert)
 {
-    return (X509_cmp_current_time(X509_get_notAfter(cert->x509)) <= 0);
+    return md_cert_get_not_after(cert) <= apr_time_now();
 }
 
 apr_time_t md_cert_get_not_after(const md_cert_t *cert)
 {
-    return md_asn1_time_get(X509_get_notAfter(cert->x509));
+    if (!cert->times_set) cert_times_init((md_cert_t*)cert);
+    return cert->not_after;
 }
 
 apr_time_t md_cert_get_not_before(const md_cert_t *cert)
 {
-    return md_asn1_time_get(X509_get_notBefore(cert->x509));
+    if (!cert->times_set) cert_times_init((md_cert_t*)cert);
+    return cert->not_before;
+}
+
+static apr_hash_t *cert_alt_set(md_cert_t *cert)
+{
+    const char *name;
+    int i;
+    
+    if (!cert->alt_set) {
+        if (!cert->alt_names) {
+            md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
+        }
+        if (cert->alt_names) {
+            cert->alt_set = apr_hash_make(cert->pool);
+            for (i = 0; i < cert->alt_names->nelts; ++i) {
+                name = APR_ARRAY_IDX(cert->alt_names, i, const char*);
+                apr_hash_set(cert->alt_set, md_util_str_tolower(apr_pstrdup(cert->pool, name)),
+                             APR_HASH_KEY_STRING, name);
+            }
+        }
+    }
+    return cert->alt_set;
+}
+
+/* Is name in the alt names of cert, ignoring case, and with wildcards if asked for */
+static int cert_alt_set_has(md_cert_t *cert, apr_hash_t *alt_set, const char *name, 
+                            int wildcards)
+{
+    char lc[256], *s;
+    apr_size_t len = strlen(name);
+    
+    if (len >= sizeof(lc)) {
+        /* longer than any DNS name, do it the slow way */
+        return wildcards? md_dns_domains_match(cert->alt_names, name) 
+            : md_array_str_index(cert->alt_names, name, 0, 0) >= 0;
+    }
+    memcpy(lc, name, len + 1);
+    md_util_str_tolower(lc);
+    if (apr_hash_get(alt_set, lc, (apr_ssize_t)len)) return 1;
+    if (wildcards && NULL != (s = strchr(lc, '.')) && s > lc) {
+        /* "*.example.org" for "www.example.org" */
+        *(--s) = '*';
+        return apr_hash_get(alt_set, s, (apr_ssize_t)(len - (apr_size_t)(s - lc))) != NULL;
+    }
+    return 0;
 }
 
 int md_cert_covers_domain(md_cert_t *cert, const char *domain_name)
 {
-    apr_array_header_t *alt_names;
+    apr_hash_t *alt_set;
 
-    md_cert_get_alt_names(&alt_names, cert, cert->pool);
-    if (alt_names) {
-        return md_array_str_index(alt_names, domain_name, 0, 0) >= 0;
+    if (NULL != (alt_set = cert_alt_set(cert))) {
+        return cert_alt_set_has(cert, alt_set, domain_name, 0);
     }
     return 0;
 }
 
 int md_cert_covers_md(md_cert_t *cert, const md_t *md)
 {
+    apr_hash_t *alt_set;
     const char *name;
     int i;
     
-    if (!cert->alt_names) {
-        md_cert_get_alt_names(&cert->alt_names, cert, cert->pool);
-    }
-    if (cert->alt_names) {
+    if (NULL != (alt_set = cert_alt_set(cert))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, cert->pool, "cert has %d alt names",
                       cert->alt_names->nelts); 
         for (i = 0; i < md->domains->nelts; ++i) {
             name = APR_ARRAY_IDX(md->domains, i, const char *);
-            if (!md_dns_domains_match(cert->alt_names, name)) {
+            if (!cert_alt_set_has(cert, alt_set, name, 1)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, cert->pool, 
                               "md domain %s not covered by cert", name);
                 return 0;
@@ -836,7 +1497,7 @@ apr_status_t md_cert_fload(md_cert_t **pcert, apr_pool_t *p, const char *fname)
     rv = md_util_fopen(&f, fname, "r");
     if (rv == APR_SUCCESS) {
     
-        x509 = PEM_read_X509(f, NULL, NULL, NULL);
+        x509 = cert_read_pem_fp(f);
         rv = fclose(f);
         if (x509 != NULL) {
             cert =  md_cert_make(p, x509);
@@ -883,7 +1544,7 @@ apr_status_t md_cert_fsave(md_cert_t *cert, apr_pool_t *p,
     apr_status_t rv;
     
     if (APR_SUCCESS == (rv = cert_to_buffer(&buffer, cert, p))) {
-        return md_util_freplace(fname, perms, p, fwrite_buffer, &buffer); 
+        return md_util_freplace(fname, perms, MD_UTIL_SYNC_FULL, p, fwrite_buffer, &buffer); 
     }
     return rv;
 }
@@ -940,7 +1601,7 @@ static int md_cert_read_pem(BIO *bf, apr_pool_t *p, md_cert_t **pcert)
     apr_status_t rv;
     
     ERR_clear_error();
-    x509 = PEM_read_bio_X509(bf, NULL, NULL, NULL);
+    x509 = cert_read_pem_bio(bf);
     if (x509 == NULL) {
         rv = APR_ENOENT;
         goto out;
@@ -953,6 +1614,20 @@ out:
     return rv;
 }
 
+apr_status_t md_cert_from_pem(md_cert_t **pcert, apr_pool_t *p, 
+                              const char *pem, apr_size_t pem_len)
+{
+    BIO *bf;
+    apr_status_t rv;
+    
+    *pcert = NULL;
+    if (pem_len > INT_MAX) return APR_EINVAL;
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)pem_len))) return APR_ENOMEM;
+    rv = md_cert_read_pem(bf, p, pcert);
+    BIO_free(bf);
+    return (APR_ENOENT == rv)? APR_EINVAL : rv;
+}
+
 apr_status_t md_cert_read_http(md_cert_t **pcert, apr_pool_t *p, 
                                const md_http_response_t *res)
 {
@@ -993,46 +1668,144 @@ out:
     return rv;
 }
 
+#define PEM_END_MARK        "-----END "
+
+struct md_cert_chain_reader_t {
+    apr_pool_t *p;
+    apr_array_header_t *chain;
+    char *buf;                         /* incomplete PEM data, NUL terminated */
+    apr_size_t len;
+    apr_size_t size;
+    apr_size_t scanned;                /* no end mark before this offset in buf */
+    int added;
+    apr_status_t rv;
+};
+
+static apr_status_t reader_cleanup(void *data)
+{
+    md_cert_chain_reader_t *reader = data;
+    
+    if (reader->buf) {
+        free(reader->buf);
+        reader->buf = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+md_cert_chain_reader_t *md_cert_chain_reader_make(apr_array_header_t *chain, apr_pool_t *p)
+{
+    md_cert_chain_reader_t *reader;
+    
+    reader = apr_pcalloc(p, sizeof(*reader));
+    reader->p = p;
+    reader->chain = chain;
+    apr_pool_cleanup_register(p, reader, reader_cleanup, apr_pool_cleanup_null);
+    return reader;
+}
+
+static apr_status_t reader_parse(md_cert_chain_reader_t *reader, apr_size_t len)
+{
+    md_cert_t *cert;
+    BIO *bf;
+    apr_status_t rv;
+    
+    if (NULL == (bf = BIO_new_mem_buf(reader->buf, (int)len))) return APR_ENOMEM;
+    while (APR_SUCCESS == (rv = md_cert_read_pem(bf, reader->p, &cert))) {
+        APR_ARRAY_PUSH(reader->chain, md_cert_t *) = cert;
+        reader->added = 1;
+    }
+    BIO_free(bf);
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+apr_status_t md_cert_chain_reader_feed(md_cert_chain_reader_t *reader, 
+                                       const char *data, apr_size_t len)
+{
+    char *nbuf, *end, *eol;
+    apr_size_t nsize, done;
+    
+    if (APR_SUCCESS != reader->rv || !len) return reader->rv;
+    if (reader->len + len + 1 > reader->size) {
+        nsize = reader->size? reader->size : 4096;
+        while (nsize < reader->len + len + 1) nsize *= 2;
+        if (nsize > 1024*1024 || !(nbuf = realloc(reader->buf, nsize))) {
+            /* certs usually are <2k each */
+            return reader->rv = APR_EINVAL;
+        }
+        reader->buf = nbuf;
+        reader->size = nsize;
+    }
+    memcpy(reader->buf + reader->len, data, len);
+    reader->len += len;
+    reader->buf[reader->len] = '\0';
+    
+    /* parse everything up to the line end after the last complete end mark */
+    done = 0;
+    end = reader->buf + reader->scanned;
+    while ((end = strstr(end, PEM_END_MARK))) {
+        if (!(eol = strchr(end + sizeof(PEM_END_MARK) - 1, '\n'))) break;
+        done = (apr_size_t)(eol + 1 - reader->buf);
+        end = eol + 1;
+    }
+    if (end) {
+        /* an end mark whose line is not complete yet */
+        reader->scanned = (apr_size_t)(end - reader->buf);
+    }
+    else {
+        /* an end mark may start in the last bytes we have */
+        reader->scanned = (reader->len >= sizeof(PEM_END_MARK))? 
+                          reader->len - sizeof(PEM_END_MARK) + 1 : 0;
+    }
+    if (done) {
+        if (APR_SUCCESS != (reader->rv = reader_parse(reader, done))) return reader->rv;
+        memmove(reader->buf, reader->buf + done, reader->len - done + 1);
+        reader->len -= done;
+        reader->scanned = (reader->scanned > done)? reader->scanned - done : 0;
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_cert_chain_reader_finish(md_cert_chain_reader_t *reader)
+{
+    if (APR_SUCCESS == reader->rv && reader->len > 0) {
+        /* the last certificate may lack a final line end */
+        reader->rv = reader_parse(reader, reader->len);
+        reader->len = 0;
+    }
+    reader_cleanup(reader);
+    if (APR_SUCCESS == reader->rv && !reader->added) return APR_ENOENT;
+    return reader->rv;
+}
+
 apr_status_t md_cert_chain_read_http(struct apr_array_header_t *chain,
                                      apr_pool_t *p, const struct md_http_response_t *res)
 {
-    const char *ct;
-    apr_off_t blen;
+    const char *ct, *data;
     apr_size_t data_len;
-    char *data;
-    BIO *bf = NULL;
+    apr_bucket *b;
     apr_status_t rv;
     
-    if (APR_SUCCESS != (rv = apr_brigade_length(res->body, 1, &blen))) goto out;
-    if (blen > 1024*1024) { /* certs usually are <2k each */
-        rv = APR_EINVAL;
-        goto out;
-    }
-    
-    data_len = (apr_size_t)blen;
     ct = apr_table_get(res->headers, "Content-Type");
     if (!res->body || !ct) {
         rv = APR_ENOENT;
         goto out;
     }
     else if (!strcmp("application/pem-certificate-chain", ct)) {
-        if (APR_SUCCESS == (rv = apr_brigade_pflatten(res->body, &data, &data_len, res->req->pool))) {
-            int added = 0;
-            md_cert_t *cert;
-            
-            if (NULL == (bf = BIO_new_mem_buf(data, (int)data_len))) {
-                rv = APR_ENOMEM;
-                goto out;
-            }
-            
-            while (APR_SUCCESS == (rv = md_cert_read_pem(bf, p, &cert))) {
-                APR_ARRAY_PUSH(chain, md_cert_t *) = cert;
-                added = 1;
-            }
-            if (APR_ENOENT == rv && added) {
-                rv = APR_SUCCESS;
+        md_cert_chain_reader_t *reader = md_cert_chain_reader_make(chain, p);
+        
+        /* parse the buckets as they are, without flattening the body */
+        rv = APR_SUCCESS;
+        for (b = APR_BRIGADE_FIRST(res->body); 
+             APR_SUCCESS == rv && b != APR_BRIGADE_SENTINEL(res->body);
+             b = APR_BUCKET_NEXT(b)) {
+            if (APR_BUCKET_IS_METADATA(b)) continue;
+            if (APR_SUCCESS == (rv = apr_bucket_read(b, &data, &data_len, APR_BLOCK_READ))) {
+                rv = md_cert_chain_reader_feed(reader, data, data_len);
             }
         }
+        if (APR_SUCCESS == rv) {
+            rv = md_cert_chain_reader_finish(reader);
+        }
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, "cert parsed");
     }
     else if (!strcmp("application/pkix-cert", ct)) {
@@ -1049,7 +1822,6 @@ apr_status_t md_cert_chain_read_http(struct apr_array_header_t *chain,
         goto out;
     }
 out:
-    if (bf) BIO_free(bf);
     return rv;
 }
 
@@ -1072,7 +1844,7 @@ apr_status_t md_chain_fappend(struct apr_array_header_t *certs, apr_pool_t *p, c
     rv = md_util_fopen(&f, fname, "r");
     if (rv == APR_SUCCESS) {
         ERR_clear_error();
-        while (NULL != (x509 = PEM_read_X509(f, NULL, NULL, NULL))) {
+        while (NULL != (x509 = cert_read_pem_fp(f))) {
             cert = md_cert_make(p, x509);
             APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
         }
@@ -1149,6 +1921,145 @@ apr_status_t md_chain_fsave(apr_array_header_t *certs, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_chain_to_pem(md_data_t *buffer, apr_array_header_t *certs, apr_pool_t *p)
+{
+    BIO *bio = BIO_new(BIO_s_mem());
+    const md_cert_t *cert;
+    int i;
+    
+    if (!bio) {
+        return APR_ENOMEM;
+    }
+
+    buffer->data = NULL;
+    buffer->len = 0;
+    ERR_clear_error();
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        assert(cert->x509);
+        PEM_write_bio_X509(bio, cert->x509);
+        if (ERR_get_error() > 0) {
+            BIO_free(bio);
+            return APR_EINVAL;
+        }
+    }
+
+    i = BIO_pending(bio);
+    if (i > 0) {
+        buffer->data = apr_palloc(p, (apr_size_t)i);
+        i = BIO_read(bio, (char*)buffer->data, i);
+        buffer->len = (apr_size_t)i;
+    }
+    BIO_free(bio);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_chain_from_pem(apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *pem, apr_size_t pem_len)
+{
+    apr_array_header_t *certs;
+    md_cert_t *cert;
+    BIO *bf = NULL;
+    unsigned long err;
+    apr_status_t rv;
+
+    certs = apr_array_make(p, 5, sizeof(md_cert_t *));
+    if (pem_len == 0) {
+        rv = APR_SUCCESS;
+        goto leave;
+    }
+    if (pem_len > INT_MAX) {
+        rv = APR_EINVAL;
+        goto leave;
+    }
+    if (NULL == (bf = BIO_new_mem_buf(pem, (int)pem_len))) {
+        rv = APR_ENOMEM;
+        goto leave;
+    }
+    while (APR_SUCCESS == (rv = md_cert_read_pem(bf, p, &cert))) {
+        APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+    }
+    rv = APR_SUCCESS;
+    if (0 < (err = ERR_get_error())
+        && !(ERR_GET_LIB(err) == ERR_LIB_PEM && ERR_GET_REASON(err) == PEM_R_NO_START_LINE)) {
+        rv = APR_EINVAL;
+    }
+leave:
+    if (bf) BIO_free(bf);
+    *pcerts = (APR_SUCCESS == rv)? certs : NULL;
+    return rv;
+}
+
+/* In DER format, each certificate of a chain is preceded by its length in 4 bytes, 
+ * most significant first. */
+#define MD_DER_LEN_SIZE     4
+
+apr_status_t md_chain_to_der(md_data_t *buffer, apr_array_header_t *certs, apr_pool_t *p)
+{
+    const md_cert_t *cert;
+    unsigned char *der, *b;
+    apr_size_t len = 0;
+    int i, der_len;
+    
+    buffer->data = NULL;
+    buffer->len = 0;
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        assert(cert->x509);
+        if ((der_len = i2d_X509(cert->x509, NULL)) <= 0) return APR_EINVAL;
+        len += MD_DER_LEN_SIZE + (apr_size_t)der_len;
+    }
+    if (len == 0) return APR_SUCCESS;
+    
+    b = der = apr_palloc(p, len);
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        der_len = i2d_X509(cert->x509, NULL);
+        b[0] = (unsigned char)(der_len >> 24);
+        b[1] = (unsigned char)(der_len >> 16);
+        b[2] = (unsigned char)(der_len >> 8);
+        b[3] = (unsigned char)der_len;
+        b += MD_DER_LEN_SIZE;
+        /* advances b by what it writes */
+        if (i2d_X509(cert->x509, &b) != der_len) return APR_EINVAL;
+    }
+    buffer->data = (const char *)der;
+    buffer->len = len;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_chain_from_der(apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *data, apr_size_t len)
+{
+    apr_array_header_t *certs;
+    const unsigned char *b = (const unsigned char *)data, *end = b + len;
+    apr_size_t der_len;
+    X509 *x509;
+    apr_status_t rv = APR_SUCCESS;
+
+    certs = apr_array_make(p, 5, sizeof(md_cert_t *));
+    while (b < end) {
+        if ((apr_size_t)(end - b) < MD_DER_LEN_SIZE) {
+            rv = APR_EINVAL;
+            goto leave;
+        }
+        der_len = ((apr_size_t)b[0] << 24) | ((apr_size_t)b[1] << 16) 
+                  | ((apr_size_t)b[2] << 8) | (apr_size_t)b[3];
+        b += MD_DER_LEN_SIZE;
+        if (der_len == 0 || der_len > (apr_size_t)(end - b) || der_len > INT_MAX
+            || NULL == (x509 = cert_from_der(b, (long)der_len))) {
+            rv = APR_EINVAL;
+            goto leave;
+        }
+        APR_ARRAY_PUSH(certs, md_cert_t *) = md_cert_make(p, x509);
+        b += der_len;
+    }
+    if (certs->nelts == 0) rv = APR_EINVAL;
+leave:
+    *pcerts = (APR_SUCCESS == rv)? certs : NULL;
+    return rv;
+}
+
 /**************************************************************************************************/
 /* certificate signing requests */
 
@@ -1306,7 +2217,7 @@ apr_status_t md_cert_req_create(const char **pcsr_der_64, const char *name,
         rv = APR_EGENERAL; goto out;
     }
     /* sign, der encode and base64url encode */
-    if (!X509_REQ_sign(csr, pkey->pkey, EVP_sha256())) {
+    if (!X509_REQ_sign(csr, pkey->pkey, pkey_get_MD(pkey))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: sign csr", name);
         rv = APR_EGENERAL; goto out;
     }
@@ -1423,7 +2334,7 @@ apr_status_t md_cert_self_sign(md_cert_t **pcert, const char *cn,
     }
 
     /* sign with same key */
-    if (!X509_sign(x, pkey->pkey, EVP_sha256())) {
+    if (!X509_sign(x, pkey->pkey, pkey_get_MD(pkey))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: sign x509", cn);
         rv = APR_EGENERAL; goto out;
     }
@@ -1475,7 +2386,7 @@ apr_status_t md_cert_make_tls_alpn_01(md_cert_t **pcert, const char *domain,
     }
 
     /* sign with same key */
-    if (!X509_sign(x, pkey->pkey, EVP_sha256())) {
+    if (!X509_sign(x, pkey->pkey, pkey_get_MD(pkey))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: sign x509", domain);
         rv = APR_EGENERAL; goto out;
     }
@@ -51,19 +51,28 @@ typedef struct md_pkey_t md_pkey_t;
 typedef enum {
     MD_PKEY_TYPE_DEFAULT,
     MD_PKEY_TYPE_RSA,
+    MD_PKEY_TYPE_EC,
+    MD_PKEY_TYPE_ED25519,
 } md_pkey_type_t;
 
 typedef struct md_pkey_rsa_spec_t {
     apr_uint32_t bits;
 } md_pkey_rsa_spec_t;
 
+typedef struct md_pkey_ec_spec_t {
+    const char *curve;       /* JWA name of the curve, "P-256" or "P-384" */
+} md_pkey_ec_spec_t;
+
 typedef struct md_pkey_spec_t {
     md_pkey_type_t type;
     union {
         md_pkey_rsa_spec_t rsa;
+        md_pkey_ec_spec_t ec;
     } params;
 } md_pkey_spec_t;
 
+#define MD_PKEY_EC_CURVE_DEF    "P-256"
+
 apr_status_t md_crypt_init(apr_pool_t *pool);
 
 apr_status_t md_pkey_gen(md_pkey_t **ppkey, apr_pool_t *p, md_pkey_spec_t *spec);
@@ -72,6 +81,56 @@ void md_pkey_free(md_pkey_t *pkey);
 const char *md_pkey_get_rsa_e64(md_pkey_t *pkey, apr_pool_t *p);
 const char *md_pkey_get_rsa_n64(md_pkey_t *pkey, apr_pool_t *p);
 
+/**
+ * Get the type of the key, RSA, EC or ED25519.
+ */
+md_pkey_type_t md_pkey_get_type(md_pkey_t *pkey);
+
+/**
+ * Get the curve name of an EC key and the base64url encoded coordinates of
+ * its public point, padded to the size of the curve's field (RFC 7518, ch. 6.2.1).
+ */
+const char *md_pkey_get_ec_curve(md_pkey_t *pkey);
+apr_status_t md_pkey_get_ec_xy64(const char **px64, const char **py64, 
+                                 md_pkey_t *pkey, apr_pool_t *p);
+
+/**
+ * Get the base64url encoded public key of an Ed25519 key (RFC 8037).
+ */
+const char *md_pkey_get_ed25519_x64(md_pkey_t *pkey, apr_pool_t *p);
+
+/**
+ * The public JSON Web Key (RFC 7517) of a key. Members not used by the key
+ * type are NULL. 
+ */
+typedef struct md_pkey_jwk_t {
+    const char *crv;
+    const char *e;
+    const char *kty;
+    const char *n;
+    const char *x;
+    const char *y;
+    const char *thumb64;     /* base64url SHA-256 thumbprint (RFC 7638) */
+} md_pkey_jwk_t;
+
+/**
+ * Get the JSON Web Key and its thumbprint. They are computed once and kept
+ * with the key, allocated from the key's pool.
+ * @return the JWK or NULL if the key can not be represented as one
+ */
+const md_pkey_jwk_t *md_pkey_get_jwk(md_pkey_t *pkey);
+
+/**
+ * Check if a key specification is supported by the SSL library we run with.
+ */
+int md_pkey_spec_is_supported(const md_pkey_spec_t *spec);
+
+/**
+ * Check the name of an EC curve and return its JWA name, e.g. "P-256" for
+ * "secp256r1", or NULL if the curve is not supported.
+ */
+const char *md_pkey_ec_curve_name(const char *name);
+
 apr_status_t md_pkey_fload(md_pkey_t **ppkey, apr_pool_t *p, 
                            const char *pass_phrase, apr_size_t pass_len,
                            const char *fname);
@@ -79,9 +138,29 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
                            const char *pass_phrase, apr_size_t pass_len, 
                            const char *fname, apr_fileperms_t perms);
 
+/**
+ * Serialize the key in PEM format into buffer, encrypted when a pass phrase
+ * is given. Used by stores that do not keep values in files.
+ */
+apr_status_t md_pkey_to_pem(struct md_data_t *buffer, md_pkey_t *pkey, apr_pool_t *p, 
+                            const char *pass_phrase, apr_size_t pass_len);
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, 
+                              const char *pem, apr_size_t pem_len,
+                              const char *pass_phrase, apr_size_t pass_len);
+
+/**
+ * Sign the data with the key and return the base64url encoded signature in the
+ * form JWS uses (RFC 7518): SHA-256 with RSA, SHA-256/SHA-384 with ECDSA on 
+ * P-256/P-384 as R || S and plain Ed25519.
+ */
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen);
 
+/**
+ * Get the JWS "alg" name of the signatures that md_crypt_sign64() makes with the key.
+ */
+const char *md_pkey_get_jws_alg(md_pkey_t *pkey);
+
 void *md_pkey_get_EVP_PKEY(struct md_pkey_t *pkey);
 
 struct md_json_t *md_pkey_spec_to_json(const md_pkey_spec_t *spec, apr_pool_t *p);
@@ -111,9 +190,26 @@ md_cert_t *md_cert_make(apr_pool_t *p, void *x509);
  */
 md_cert_t *md_cert_wrap(apr_pool_t *p, void *x509);
 
+/**
+ * Get another holder of the same x509 certificate, with a reference of its
+ * own that is released when pool p is destroyed.
+ */
+md_cert_t *md_cert_dup(apr_pool_t *p, const md_cert_t *cert);
+
+/**
+ * Share parsed certificates among all loads of the same contents in this process,
+ * until pool p is destroyed. Such certificates must not be modified.
+ */
+apr_status_t md_cert_cache_init(apr_pool_t *p);
+
 void *md_cert_get_X509(const md_cert_t *cert);
 
 apr_status_t md_cert_fload(md_cert_t **pcert, apr_pool_t *p, const char *fname);
+/**
+ * Read the first certificate in PEM format from the data, without copying it.
+ */
+apr_status_t md_cert_from_pem(md_cert_t **pcert, apr_pool_t *p, 
+                              const char *pem, apr_size_t pem_len);
 apr_status_t md_cert_fsave(md_cert_t *cert, apr_pool_t *p, 
                            const char *fname, apr_fileperms_t perms);
 
@@ -134,6 +230,21 @@ apr_status_t md_cert_read_http(md_cert_t **pcert, apr_pool_t *pool,
 apr_status_t md_cert_chain_read_http(struct apr_array_header_t *chain,
                                      apr_pool_t *pool, const struct md_http_response_t *res);
 
+/**
+ * Parses a PEM certificate chain that arrives in pieces, e.g. from a http response.
+ * Each certificate is read as soon as it is complete, only an incomplete one
+ * is kept between calls.
+ */
+typedef struct md_cert_chain_reader_t md_cert_chain_reader_t;
+
+md_cert_chain_reader_t *md_cert_chain_reader_make(struct apr_array_header_t *chain, 
+                                                  apr_pool_t *p);
+/** Add the next piece of PEM data, complete certificates are added to the chain. */
+apr_status_t md_cert_chain_reader_feed(md_cert_chain_reader_t *reader, 
+                                       const char *data, apr_size_t len);
+/** @return APR_ENOENT if no certificate was found at all */
+apr_status_t md_cert_chain_reader_finish(md_cert_chain_reader_t *reader);
+
 md_cert_state_t md_cert_state_get(const md_cert_t *cert);
 int md_cert_is_valid_now(const md_cert_t *cert);
 int md_cert_has_expired(const md_cert_t *cert);
@@ -161,6 +272,25 @@ apr_status_t md_chain_fsave(struct apr_array_header_t *certs,
 apr_status_t md_chain_fappend(struct apr_array_header_t *certs, 
                               apr_pool_t *p, const char *fname);
 
+/**
+ * Serialize the certificates in PEM format into buffer, or read them back.
+ * Reading data without any certificate gives an empty array.
+ */
+apr_status_t md_chain_to_pem(struct md_data_t *buffer, struct apr_array_header_t *certs, 
+                             apr_pool_t *p);
+apr_status_t md_chain_from_pem(struct apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *pem, apr_size_t pem_len);
+
+/**
+ * Serialize the certificates in DER format, each prefixed with its length in 
+ * 4 bytes, most significant first, or read them back. Reading checks that the 
+ * lengths cover the data exactly.
+ */
+apr_status_t md_chain_to_der(struct md_data_t *buffer, struct apr_array_header_t *certs, 
+                             apr_pool_t *p);
+apr_status_t md_chain_from_der(struct apr_array_header_t **pcerts, apr_pool_t *p, 
+                               const char *data, apr_size_t len);
+
 apr_status_t md_cert_req_create(const char **pcsr_der_64, const char *name,
                                 apr_array_header_t *domains, int must_staple, 
                                 md_pkey_t *pkey, apr_pool_t *p);
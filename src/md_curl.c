@@ -15,12 +15,16 @@
  */
  
 #include <assert.h>
+#include <stdlib.h>
 
 #include <curl/curl.h>
 
 #include <apr_lib.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_poll.h>
+#include <apr_portable.h>
+#include <apr_thread_mutex.h>
 
 #include "md_http.h"
 #include "md_log.h"
@@ -50,12 +54,40 @@ static apr_status_t curl_status(unsigned int curl_code)
     }
 }
 
+/* Number of idle easy handles kept for reuse per md_http_t instance. The requests 
+ * of one ACME order are done one after the other, a few cover the multi case. */
+#define MD_CURL_MAX_IDLE    8
+
+/* What we keep per md_http_t instance: a share for DNS lookups, TLS sessions and
+ * connections and the easy handles of finished requests. The instance is only used
+ * by one thread at a time, so its own share needs no locking. When the instance
+ * belongs to md_http_clients_t, it uses their share instead, which does. That one
+ * has no connections, libcurl does not support sharing them between threads that
+ * run at the same time. The idle easy handles keep them per instance. */
+typedef struct {
+    CURLSH *share;
+    int own_share;
+    CURL *idle[MD_CURL_MAX_IDLE];
+    int nidle;
+} md_curl_conns_t;
+
+/* The share of md_http_clients_t, used by several threads. */
+typedef struct {
+    CURLSH *share;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+#endif
+} md_curl_shared_t;
+
 typedef struct {
     CURL *curl;
     CURLM *curlm;
+    md_curl_conns_t *conns;
     struct curl_slist *req_hdrs;
     md_http_response_t *response;
+    apr_off_t body_len;                /* response body bytes received */
     apr_status_t rv;
+    int status_known;
     int status_fired;
 } md_curl_internals_t;
 
@@ -104,17 +136,26 @@ static size_t resp_data_cb(void *data, size_t len, size_t nmemb, void *baton)
 {
     md_curl_internals_t *internals = baton;
     md_http_response_t *res = internals->response;
+    md_http_request_t *req = res->req;
     size_t blen = len * nmemb;
     apr_status_t rv;
+    long l;
     
-    if (res->body) {
-        if (res->req->resp_limit) {
-            apr_off_t body_len = 0;
-            apr_brigade_length(res->body, 0, &body_len);
-            if (body_len + (apr_off_t)blen > res->req->resp_limit) {
-                return 0; /* signal curl failure */
+    if (req->resp_limit && internals->body_len + (apr_off_t)blen > req->resp_limit) {
+        return 0; /* signal curl failure */
+    }
+    internals->body_len += (apr_off_t)blen;
+    if (req->cb.on_data) {
+        if (!internals->status_known) {
+            internals->status_known = 1;
+            if (CURLE_OK == curl_easy_getinfo(internals->curl, CURLINFO_RESPONSE_CODE, &l)) {
+                res->status = (int)l;
             }
         }
+        rv = req->cb.on_data(res, (const char *)data, blen, req->cb.on_data_data);
+        return (APR_SUCCESS == rv)? blen : 0;
+    }
+    if (res->body) {
         rv = apr_brigade_write(res->body, NULL, NULL, (const char *)data, blen);
         if (rv != APR_SUCCESS) {
             /* returning anything != blen will make CURL fail this */
@@ -239,19 +280,159 @@ static int curl_debug_log(CURL *curl, curl_infotype type, char *data, size_t siz
     return 0;
 }
 
+static CURLSH *share_create(int connections)
+{
+    CURLSH *share;
+    
+    if ((share = curl_share_init())) {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        /* sharing the connection cache came in 7.57.0 */
+        if (connections) curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#else
+        (void)connections;
+#endif
+    }
+    return share;
+}
+
+#if APR_HAS_THREADS
+static void shared_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *baton)
+{
+    md_curl_shared_t *shared = baton;
+    
+    (void)curl; (void)access;
+    if (data < CURL_LOCK_DATA_LAST && shared->locks[data]) {
+        apr_thread_mutex_lock(shared->locks[data]);
+    }
+}
+
+static void shared_unlock(CURL *curl, curl_lock_data data, void *baton)
+{
+    md_curl_shared_t *shared = baton;
+    
+    (void)curl;
+    if (data < CURL_LOCK_DATA_LAST && shared->locks[data]) {
+        apr_thread_mutex_unlock(shared->locks[data]);
+    }
+}
+#endif
+
+static apr_status_t shared_cleanup(void *data)
+{
+    md_curl_shared_t *shared = data;
+    
+    if (shared->share) curl_share_cleanup(shared->share);
+    shared->share = NULL;
+    return APR_SUCCESS;
+}
+
+static void *shared_create(apr_pool_t *p)
+{
+    md_curl_shared_t *shared;
+#if APR_HAS_THREADS
+    int i;
+#endif
+    
+    shared = apr_pcalloc(p, sizeof(*shared));
+#if APR_HAS_THREADS
+    for (i = 0; i < CURL_LOCK_DATA_LAST; ++i) {
+        if (APR_SUCCESS != apr_thread_mutex_create(&shared->locks[i], 
+                                                   APR_THREAD_MUTEX_DEFAULT, p)) {
+            /* without locking, we cannot share between threads */
+            return shared;
+        }
+    }
+#endif
+    if ((shared->share = share_create(0))) {
+#if APR_HAS_THREADS
+        curl_share_setopt(shared->share, CURLSHOPT_LOCKFUNC, shared_lock);
+        curl_share_setopt(shared->share, CURLSHOPT_UNLOCKFUNC, shared_unlock);
+        curl_share_setopt(shared->share, CURLSHOPT_USERDATA, shared);
+#endif
+        apr_pool_cleanup_register(p, shared, shared_cleanup, apr_pool_cleanup_null);
+    }
+    return shared;
+}
+
+static apr_status_t conns_cleanup(void *data)
+{
+    md_curl_conns_t *conns = data;
+    
+    while (conns->nidle > 0) {
+        curl_easy_cleanup(conns->idle[--conns->nidle]);
+    }
+    if (conns->share && conns->own_share) curl_share_cleanup(conns->share);
+    free(conns);
+    return APR_SUCCESS;
+}
+
+static md_curl_conns_t *conns_get(md_http_t *http)
+{
+    md_curl_conns_t *conns;
+    md_http_clients_t *clients;
+    md_curl_shared_t *shared;
+    
+    if (!(conns = md_http_get_impl_data(http))) {
+        if (!(conns = calloc(1, sizeof(*conns)))) return NULL;
+        if ((clients = md_http_get_clients(http))) {
+            shared = md_http_clients_get_impl_data(clients, shared_create);
+            conns->share = shared? shared->share : NULL;
+        }
+        else {
+            conns->share = share_create(1);
+            conns->own_share = 1;
+        }
+        md_http_set_impl_data(http, conns, conns_cleanup);
+    }
+    return conns;
+}
+
+static CURL *conns_easy_get(md_curl_conns_t *conns)
+{
+    CURL *curl;
+    
+    if (conns && conns->nidle > 0) {
+        /* keeps the connections, DNS and TLS session caches of the handle */
+        curl = conns->idle[--conns->nidle];
+        curl_easy_reset(curl);
+    }
+    else if (!(curl = curl_easy_init())) {
+        return NULL;
+    }
+    if (conns && conns->share) {
+        curl_easy_setopt(curl, CURLOPT_SHARE, conns->share);
+    }
+    return curl;
+}
+
+static void conns_easy_put(md_curl_conns_t *conns, CURL *curl)
+{
+    if (conns && conns->nidle < MD_CURL_MAX_IDLE) {
+        conns->idle[conns->nidle++] = curl;
+    }
+    else {
+        curl_easy_cleanup(curl);
+    }
+}
+
 static apr_status_t internals_setup(md_http_request_t *req)
 {
     md_curl_internals_t *internals;
+    md_curl_conns_t *conns;
     CURL *curl;
     apr_status_t rv = APR_SUCCESS;
     
-    curl = curl_easy_init();
+    conns = conns_get(req->http);
+    curl = conns_easy_get(conns);
     if (!curl) {
         rv = APR_EGENERAL;
         goto leave;
     }
     internals = apr_pcalloc(req->pool, sizeof(*internals));
     internals->curl = curl;
+    internals->conns = conns;
         
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
@@ -266,6 +447,7 @@ static apr_status_t internals_setup(md_http_request_t *req)
     internals->response->headers = apr_table_make(req->pool, 5);
     internals->response->body = apr_brigade_create(req->pool, req->bucket_alloc);
     
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (void*)req);
     curl_easy_setopt(curl, CURLOPT_URL, req->url);
     if (!apr_strnatcasecmp("GET", req->method)) {
         /* nop */
@@ -299,7 +481,20 @@ static apr_status_t internals_setup(md_http_request_t *req)
         curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)req->body_len);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)req->body_len);
     }
+    if (req->body_data) {
+        /* curl sends this directly, without copying it via req_data_cb() */
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body_data->data);
+    }
     
+    if (req->http2) {
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        /* HTTP/2 when the server agrees via ALPN, HTTP/1.1 otherwise. Fails
+         * and keeps the default when libcurl has no HTTP/2 support. */
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        /* wait for a connection that may multiplex instead of opening another */
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
+    }
     if (req->user_agent) {
         curl_easy_setopt(curl, CURLOPT_USERAGENT, req->user_agent);
     }
@@ -333,6 +528,62 @@ leave:
     return rv;
 }
 
+static apr_interval_time_t curl_time(CURL *curl, int what)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00
+    curl_off_t usec = 0;
+    CURLINFO info;
+    
+    switch (what) {
+        case 0: info = CURLINFO_NAMELOOKUP_TIME_T; break;
+        case 1: info = CURLINFO_CONNECT_TIME_T; break;
+        case 2: info = CURLINFO_APPCONNECT_TIME_T; break;
+        case 3: info = CURLINFO_STARTTRANSFER_TIME_T; break;
+        default: info = CURLINFO_TOTAL_TIME_T; break;
+    }
+    if (CURLE_OK != curl_easy_getinfo(curl, info, &usec)) return 0;
+    return (apr_interval_time_t)usec;
+#else
+    double secs = 0;
+    CURLINFO info;
+    
+    switch (what) {
+        case 0: info = CURLINFO_NAMELOOKUP_TIME; break;
+        case 1: info = CURLINFO_CONNECT_TIME; break;
+        case 2: info = CURLINFO_APPCONNECT_TIME; break;
+        case 3: info = CURLINFO_STARTTRANSFER_TIME; break;
+        default: info = CURLINFO_TOTAL_TIME; break;
+    }
+    if (CURLE_OK != curl_easy_getinfo(curl, info, &secs)) return 0;
+    return (apr_interval_time_t)(secs * APR_USEC_PER_SEC);
+#endif
+}
+
+static void update_timing(md_http_request_t *req)
+{
+    md_curl_internals_t *internals = req->internals;
+    md_http_timing_t *t = &internals->response->timing;
+    apr_interval_time_t dns, conn, tls, start;
+    
+    /* curl gives the time from the start of the request to the end of each phase */
+    dns = curl_time(internals->curl, 0);
+    conn = curl_time(internals->curl, 1);
+    tls = curl_time(internals->curl, 2);
+    start = curl_time(internals->curl, 3);
+    t->total = curl_time(internals->curl, 4);
+    t->dns = dns;
+    t->connect = (conn > dns)? conn - dns : 0;
+    t->tls = (tls > conn)? tls - conn : 0;
+    if (tls < conn) tls = conn;
+    t->first_byte = (start > tls)? start - tls : 0;
+    md_http_timing_add(req->http, internals->response);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, req->pool, 
+                  "req[%d]: timing dns=%ldms connect=%ldms tls=%ldms first-byte=%ldms "
+                  "total=%ldms", req->id, (long)apr_time_as_msec(t->dns), 
+                  (long)apr_time_as_msec(t->connect), (long)apr_time_as_msec(t->tls),
+                  (long)apr_time_as_msec(t->first_byte), (long)apr_time_as_msec(t->total));
+}
+
 static apr_status_t update_status(md_http_request_t *req)
 {
     md_curl_internals_t *internals = req->internals;
@@ -344,6 +595,7 @@ static apr_status_t update_status(md_http_request_t *req)
         if (APR_SUCCESS == rv) {
             internals->response->status = (int)l;
         }
+        update_timing(req);
     }
     return rv;
 }
@@ -373,7 +625,6 @@ static apr_status_t md_curl_perform(md_http_request_t *req)
     apr_status_t rv = APR_SUCCESS;
     CURLcode curle;
     md_curl_internals_t *internals;
-    long l;
 
     if (APR_SUCCESS != (rv = internals_setup(req))) goto leave;
     internals = req->internals;
@@ -387,10 +638,7 @@ static apr_status_t md_curl_perform(md_http_request_t *req)
         goto leave;
     }
     
-    rv = curl_status(curl_easy_getinfo(internals->curl, CURLINFO_RESPONSE_CODE, &l));
-    if (APR_SUCCESS == rv) {
-        internals->response->status = (int)l;
-    }
+    rv = update_status(req);
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, req->pool, "request <-- %d", 
                   internals->response->status);
     
@@ -405,20 +653,16 @@ leave:
     return rv;
 }
 
-static md_http_request_t *find_curl_request(apr_array_header_t *requests, CURL *curl)
+static md_http_request_t *find_curl_request(CURL *curl)
 {
-    md_http_request_t *req;
-    md_curl_internals_t *internals;
-    int i;
+    md_http_request_t *req = NULL;
+    char *data = NULL;
     
-    for (i = 0; i < requests->nelts; ++i) {
-        req = APR_ARRAY_IDX(requests, i, md_http_request_t*);
-        internals = req->internals;
-        if (internals && internals->curl == curl) {
-            return req;
-        }
+    /* set via CURLOPT_PRIVATE in internals_setup() */
+    if (CURLE_OK == curl_easy_getinfo(curl, CURLINFO_PRIVATE, &data)) {
+        req = (md_http_request_t*)(void*)data;
     }
-    return NULL;
+    return req;
 }
 
 static void add_to_curlm(md_http_request_t *req, CURLM *curlm)
@@ -440,30 +684,173 @@ static void remove_from_curlm(md_http_request_t *req, CURLM *curlm)
         internals->curlm = NULL;
     }
 }
+
+/* Maximum number of sockets curl may have open during a multi perform. */
+#define MD_CURL_POLLSET_SIZE    256
+/* Longest we wait for activity before asking for more requests again */
+#define MD_CURL_POLL_MAX        apr_time_from_sec(1)
+
+typedef struct poll_sock_t poll_sock_t;
+struct poll_sock_t {
+    poll_sock_t *next;                 /* in the free list */
+    apr_pollfd_t pfd;
+};
+
+typedef struct {
+    apr_pool_t *p;
+    CURLM *curlm;
+    apr_pollset_t *pollset;
+    poll_sock_t *free_socks;
+    apr_time_t timer_at;               /* when curl wants to be called, 0 if not */
+    apr_status_t rv;
+} poll_ctx_t;
+
+static int sock_cb(CURL *curl, curl_socket_t s, int what, void *baton, void *sockp)
+{
+    poll_ctx_t *ctx = baton;
+    poll_sock_t *ps = sockp;
+    apr_os_sock_t fd = s;
+    apr_status_t rv;
     
+    (void)curl;
+    if (ps) {
+        apr_pollset_remove(ctx->pollset, &ps->pfd);
+    }
+    if (CURL_POLL_REMOVE == what) {
+        if (ps) {
+            curl_multi_assign(ctx->curlm, s, NULL);
+            ps->next = ctx->free_socks;
+            ctx->free_socks = ps;
+        }
+        return 0;
+    }
+    
+    if (!ps) {
+        if (ctx->free_socks) {
+            ps = ctx->free_socks;
+            ctx->free_socks = ps->next;
+        }
+        else {
+            ps = apr_pcalloc(ctx->p, sizeof(*ps));
+            ps->pfd.p = ctx->p;
+            ps->pfd.desc_type = APR_POLL_SOCKET;
+        }
+        ps->pfd.client_data = (void*)(apr_intptr_t)s;
+        /* reuses the apr_socket_t of a freed entry */
+        if (APR_SUCCESS != (rv = apr_os_sock_put(&ps->pfd.desc.s, &fd, ctx->p))) {
+            ctx->rv = rv;
+            return -1;
+        }
+        curl_multi_assign(ctx->curlm, s, ps);
+    }
+    ps->pfd.reqevents = 0;
+    if (what & CURL_POLL_IN) ps->pfd.reqevents |= APR_POLLIN;
+    if (what & CURL_POLL_OUT) ps->pfd.reqevents |= APR_POLLOUT;
+    if (APR_SUCCESS != (rv = apr_pollset_add(ctx->pollset, &ps->pfd))) {
+        ctx->rv = rv;
+        return -1;
+    }
+    return 0;
+}
+
+static int timer_cb(CURLM *curlm, long timeout_ms, void *baton)
+{
+    poll_ctx_t *ctx = baton;
+    
+    (void)curlm;
+    ctx->timer_at = (timeout_ms < 0)? 0 : apr_time_now() + apr_time_from_msec(timeout_ms);
+    return 0;
+}
+
+static apr_status_t poll_once(poll_ctx_t *ctx, int *prunning)
+{
+    const apr_pollfd_t *descs;
+    apr_interval_time_t wait;
+    apr_int32_t i, ndesc = 0;
+    apr_time_t now;
+    CURLMcode mc = CURLM_OK;
+    apr_status_t rv;
+    int ev;
+    
+    wait = MD_CURL_POLL_MAX;
+    if (ctx->timer_at) {
+        now = apr_time_now();
+        wait = (ctx->timer_at > now)? ctx->timer_at - now : 0;
+        if (wait > MD_CURL_POLL_MAX) wait = MD_CURL_POLL_MAX;
+    }
+    rv = apr_pollset_poll(ctx->pollset, wait, &ndesc, &descs);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_TIMEUP(rv) && !APR_STATUS_IS_EINTR(rv)) {
+        return rv;
+    }
+    for (i = 0; APR_SUCCESS == rv && i < ndesc && CURLM_OK == mc; ++i) {
+        ev = 0;
+        if (descs[i].rtnevents & APR_POLLIN) ev |= CURL_CSELECT_IN;
+        if (descs[i].rtnevents & APR_POLLOUT) ev |= CURL_CSELECT_OUT;
+        if (descs[i].rtnevents & (APR_POLLERR|APR_POLLHUP|APR_POLLNVAL)) ev |= CURL_CSELECT_ERR;
+        mc = curl_multi_socket_action(ctx->curlm, 
+                                      (curl_socket_t)(apr_intptr_t)descs[i].client_data, 
+                                      ev, prunning);
+    }
+    if (CURLM_OK == mc && ctx->timer_at && ctx->timer_at <= apr_time_now()) {
+        ctx->timer_at = 0;
+        mc = curl_multi_socket_action(ctx->curlm, CURL_SOCKET_TIMEOUT, 0, prunning);
+    }
+    if (CURLM_OK != mc) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ctx->p, 
+                      "multi_perform failed(%d): %s", mc, curl_multi_strerror(mc));
+        return APR_ECONNABORTED;
+    }
+    return ctx->rv;
+}
+
 static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                                           md_http_next_req *nextreq, void *baton)
 {
     md_http_request_t *req;
-    CURLM *curlm = NULL;
-    CURLMcode mc;
+    poll_ctx_t ctx;
+    apr_pool_t *ptemp = NULL;
     struct CURLMsg *curlmsg;
-    apr_array_header_t *requests;
-    int i, running, numfds, slowdown, msgcount;
+    apr_array_header_t *requests, *pending;
+    int i, running, msgcount;
     apr_status_t rv;
     
+    memset(&ctx, 0, sizeof(ctx));
     requests = apr_array_make(p, 10, sizeof(md_http_request_t*));
-    curlm = curl_multi_init();
-    if (!curlm) {
+    /* requests set up, but waiting for a slot of the http clients */
+    pending = apr_array_make(p, 10, sizeof(md_http_request_t*));
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) goto leave;
+    ctx.p = ptemp;
+    if (APR_SUCCESS != (rv = apr_pollset_create(&ctx.pollset, MD_CURL_POLLSET_SIZE, 
+                                                ptemp, 0))) {
+        goto leave;
+    }
+    ctx.curlm = curl_multi_init();
+    if (!ctx.curlm) {
         rv = APR_ENOMEM;
         goto leave;
     }
+    curl_multi_setopt(ctx.curlm, CURLMOPT_SOCKETFUNCTION, sock_cb);
+    curl_multi_setopt(ctx.curlm, CURLMOPT_SOCKETDATA, &ctx);
+    curl_multi_setopt(ctx.curlm, CURLMOPT_TIMERFUNCTION, timer_cb);
+    curl_multi_setopt(ctx.curlm, CURLMOPT_TIMERDATA, &ctx);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    if (md_http_get_http2(http)) {
+        curl_multi_setopt(ctx.curlm, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+    }
+#endif
     
-    running = 1;
-    slowdown = 0;
+    running = 0;
     while(1) {
-        while (1) {
-            /* fetch as many requests as nextreq gives us */
+        /* send the pending ones, in order, as slots become available */
+        while (pending->nelts > 0) {
+            req = APR_ARRAY_IDX(pending, 0, md_http_request_t*);
+            if (APR_SUCCESS != md_http_req_acquire(req, 0)) break;
+            md_array_remove_at(pending, 0);
+            add_to_curlm(req, ctx.curlm);
+        }
+        
+        while (!pending->nelts) {
+            /* fetch as many requests as nextreq gives us, while we get slots for them */
             rv = nextreq(&req, baton, http, requests->nelts);
             
             if (APR_SUCCESS == rv) {
@@ -474,16 +861,22 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                 }
                 else {
                     APR_ARRAY_PUSH(requests, md_http_request_t*) = req;
-                    add_to_curlm(req, curlm);
+                    if (APR_SUCCESS == md_http_req_acquire(req, 0)) {
+                        add_to_curlm(req, ctx.curlm);
+                    }
+                    else {
+                        APR_ARRAY_PUSH(pending, md_http_request_t*) = req;
+                    }
                     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, 
-                                  "multi_perform[%d reqs]: added request", requests->nelts);
+                                  "multi_perform[%d reqs]: added request%s", requests->nelts,
+                                  pending->nelts? ", waiting for a slot" : "");
                 }
                 continue;
             }
             else if (APR_STATUS_IS_ENOENT(rv)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
                               "multi_perform[%d reqs]: no more requests", requests->nelts);
-                if (!running) {
+                if (!requests->nelts) {
                     goto leave;
                 }
                 break;
@@ -495,39 +888,26 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
             }
         }
     
-        mc = curl_multi_perform(curlm, &running);
-        if (CURLM_OK == mc) {
-            mc = curl_multi_wait(curlm, NULL, 0, 1000, &numfds);
-            if (numfds) slowdown = 0;
-        }
-        if (CURLM_OK != mc) {
-            rv = APR_ECONNABORTED;
+        /* wait for activity on the sockets curl told us about or its next timeout */
+        if (APR_SUCCESS != (rv = poll_once(&ctx, &running))) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
-                          "multi_perform[%d reqs] failed(%d): %s", 
-                          requests->nelts, mc, curl_multi_strerror(mc));
+                          "multi_perform[%d reqs]: poll failed", requests->nelts);
             goto leave;
         }
-        if (!numfds) {
-            /* no activity on any connection, timeout */
-            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
-                          "multi_perform[%d reqs]: slowdown %d", requests->nelts, slowdown);
-            if (slowdown) apr_sleep(apr_time_from_msec(100));
-            ++slowdown;
-        }
 
         /* process status messages, e.g. that a request is done */
         while (1) {
-            curlmsg = curl_multi_info_read(curlm, &msgcount);
+            curlmsg = curl_multi_info_read(ctx.curlm, &msgcount);
             if (!curlmsg) break;
             if (curlmsg->msg == CURLMSG_DONE) {
-                req = find_curl_request(requests, curlmsg->easy_handle);
+                req = find_curl_request(curlmsg->easy_handle);
                 if (req) {
                     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, 
                                   "multi_perform[%d reqs]: req[%d] done", 
                                   requests->nelts, req->id);
                     update_status(req);
                     fire_status(req, curl_status(curlmsg->data.result));
-                    remove_from_curlm(req, curlm);
+                    remove_from_curlm(req, ctx.curlm);
                     md_array_remove(requests, req);
                     md_http_req_destroy(req);
                 }
@@ -538,7 +918,8 @@ static apr_status_t md_curl_multi_perform(md_http_t *http, apr_pool_t *p,
                 }
             }
         }
-        assert(running == requests->nelts);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, 
+                      "multi_perform[%d reqs]: %d running", requests->nelts, running);
     };
 
 leave:
@@ -547,10 +928,11 @@ leave:
     for (i = 0; i < requests->nelts; ++i) {
         req = APR_ARRAY_IDX(requests, i, md_http_request_t*);
         fire_status(req, APR_SUCCESS);
-        remove_from_curlm(req, curlm);
+        remove_from_curlm(req, ctx.curlm);
         md_http_req_destroy(req);
     }
-    if (curlm) curl_multi_cleanup(curlm);
+    if (ctx.curlm) curl_multi_cleanup(ctx.curlm);
+    if (ptemp) apr_pool_destroy(ptemp);
     return rv;
 }
 
@@ -568,7 +950,7 @@ static void md_curl_req_cleanup(md_http_request_t *req)
 {
     md_curl_internals_t *internals = req->internals;
     if (internals) {
-        if (internals->curl) curl_easy_cleanup(internals->curl);
+        if (internals->curl) conns_easy_put(internals->conns, internals->curl);
         if (internals->req_hdrs) curl_slist_free_all(internals->req_hdrs);
         req->internals = NULL;
     }
@@ -15,11 +15,19 @@
  */
  
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
 
 #include <apr_lib.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
+#include <apr_hash.h>
+#include <apr_uri.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
 
+#include "md.h"
+#include "md_json.h"
 #include "md_http.h"
 #include "md_log.h"
 #include "md_util.h"
@@ -33,10 +41,51 @@ struct md_http_t {
     const char *user_agent;
     const char *proxy_url;
     md_http_timeouts_t timeout;
+    int http2;
+    void *impl_data;
+    apr_hash_t *timings;               /* endpoint -> md_http_timing_stats_t* */
+    md_http_clients_t *clients;
 };
 
+typedef struct {
+    const char *endpoint;
+    int in_flight;
+    apr_int64_t requests;
+    apr_int64_t waits;
+} clients_host_t;
+
+struct md_http_clients_t {
+    apr_pool_t *p;
+    int max_conns;
+    int max_host_conns;
+    int in_flight;
+    int max_in_flight;                 /* most requests in flight at once so far */
+    apr_int64_t requests;
+    apr_int64_t waits;                 /* requests that had to wait for a slot */
+    apr_hash_t *hosts;                 /* endpoint -> clients_host_t* */
+    void *impl_data;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+};
+
+/* How long a waiting request sleeps at most before it checks again */
+#define MD_HTTP_CLIENTS_WAIT        apr_time_from_msec(500)
+
+/* The timings of the last requests to an endpoint we keep */
+#define MD_HTTP_TIMING_SAMPLES      256
+
+typedef struct {
+    const char *endpoint;
+    apr_int64_t count;                 /* of all requests */
+    int nsamples;
+    md_http_timing_t samples[MD_HTTP_TIMING_SAMPLES];
+} md_http_timing_stats_t;
+
 static md_http_impl_t *cur_impl;
 static int cur_init_done;
+static md_http_clients_t *cur_clients;
 
 void md_http_use_implementation(md_http_impl_t *impl)
 {
@@ -71,6 +120,7 @@ apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_a
     http->impl = cur_impl;
     http->user_agent = apr_pstrdup(p, user_agent);
     http->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
+    http->clients = cur_clients;
     http->bucket_alloc = apr_bucket_alloc_create(p);
     if (!http->bucket_alloc) {
         return APR_EGENERAL;
@@ -79,11 +129,275 @@ apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_a
     return APR_SUCCESS;
 }
 
+static const char *url_endpoint(const char *url, apr_pool_t *p)
+{
+    apr_uri_t uri;
+    
+    if (APR_SUCCESS != apr_uri_parse(p, url, &uri) || !uri.hostname) return url;
+    return apr_psprintf(p, "%s://%s:%u", uri.scheme? uri.scheme : "http", uri.hostname,
+                        uri.port? uri.port : apr_uri_port_of_scheme(uri.scheme));
+}
+
+/**************************************************************************************************/
+/* clients shared in a process */
+
+static void clients_lock(md_http_clients_t *clients)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(clients->mutex);
+#else
+    (void)clients;
+#endif
+}
+
+static void clients_unlock(md_http_clients_t *clients)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(clients->mutex);
+#else
+    (void)clients;
+#endif
+}
+
+apr_status_t md_http_clients_create(md_http_clients_t **pclients, apr_pool_t *p,
+                                    int max_conns, int max_host_conns)
+{
+    md_http_clients_t *clients;
+    apr_status_t rv = APR_SUCCESS;
+    
+    clients = apr_pcalloc(p, sizeof(*clients));
+    clients->p = p;
+    clients->max_conns = max_conns;
+    clients->max_host_conns = max_host_conns;
+    clients->hosts = apr_hash_make(p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&clients->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&clients->cond, p))) {
+        goto leave;
+    }
+leave:
+#endif
+    *pclients = (APR_SUCCESS == rv)? clients : NULL;
+    return rv;
+}
+
+void md_http_use_clients(md_http_clients_t *clients)
+{
+    cur_clients = clients;
+}
+
+md_http_clients_t *md_http_get_clients(md_http_t *http)
+{
+    return http->clients;
+}
+
+void *md_http_clients_get_impl_data(md_http_clients_t *clients, 
+                                    md_http_clients_data_create *create)
+{
+    void *data;
+    
+    clients_lock(clients);
+    if (!clients->impl_data && create) clients->impl_data = create(clients->p);
+    data = clients->impl_data;
+    clients_unlock(clients);
+    return data;
+}
+
+apr_status_t md_http_req_acquire(md_http_request_t *req, int wait)
+{
+    md_http_clients_t *clients = req->http->clients;
+    clients_host_t *host;
+    const char *endpoint;
+    int waited = 0;
+    
+    if (!clients || req->client_slot) return APR_SUCCESS;
+    endpoint = url_endpoint(req->url, req->pool);
+    clients_lock(clients);
+    if (!(host = apr_hash_get(clients->hosts, endpoint, APR_HASH_KEY_STRING))) {
+        host = apr_pcalloc(clients->p, sizeof(*host));
+        host->endpoint = apr_pstrdup(clients->p, endpoint);
+        apr_hash_set(clients->hosts, host->endpoint, APR_HASH_KEY_STRING, host);
+    }
+    while ((clients->max_conns > 0 && clients->in_flight >= clients->max_conns)
+           || (clients->max_host_conns > 0 && host->in_flight >= clients->max_host_conns)) {
+        if (!wait) {
+            clients_unlock(clients);
+            return APR_EAGAIN;
+        }
+        if (!waited) {
+            waited = 1;
+            ++clients->waits;
+            ++host->waits;
+        }
+#if APR_HAS_THREADS
+        apr_thread_cond_timedwait(clients->cond, clients->mutex, MD_HTTP_CLIENTS_WAIT);
+#else
+        /* without threads, nothing frees a slot while we wait */
+        break;
+#endif
+    }
+    ++clients->in_flight;
+    ++clients->requests;
+    if (clients->in_flight > clients->max_in_flight) clients->max_in_flight = clients->in_flight;
+    ++host->in_flight;
+    ++host->requests;
+    req->client_slot = host;
+    clients_unlock(clients);
+    return APR_SUCCESS;
+}
+
+static void req_release(md_http_request_t *req)
+{
+    md_http_clients_t *clients = req->http->clients;
+    clients_host_t *host = req->client_slot;
+    
+    if (!clients || !host) return;
+    clients_lock(clients);
+    --clients->in_flight;
+    --host->in_flight;
+    req->client_slot = NULL;
+#if APR_HAS_THREADS
+    apr_thread_cond_broadcast(clients->cond);
+#endif
+    clients_unlock(clients);
+}
+
+md_json_t *md_http_clients_stats_json(md_http_clients_t *clients, apr_pool_t *p)
+{
+    md_json_t *json, *jhost;
+    clients_host_t *host;
+    apr_hash_index_t *hi;
+    void *val;
+    
+    json = md_json_create(p);
+    clients_lock(clients);
+    md_json_setl(clients->max_conns, json, MD_KEY_MAX_CONNS, NULL);
+    md_json_setl(clients->max_host_conns, json, MD_KEY_MAX_HOST_CONNS, NULL);
+    md_json_setl(clients->in_flight, json, MD_KEY_IN_FLIGHT, NULL);
+    md_json_setl(clients->max_in_flight, json, MD_KEY_MAX_IN_FLIGHT, NULL);
+    md_json_setl((long)clients->requests, json, MD_KEY_REQUESTS, NULL);
+    md_json_setl((long)clients->waits, json, MD_KEY_WAITS, NULL);
+    for (hi = apr_hash_first(p, clients->hosts); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        host = val;
+        jhost = md_json_create(p);
+        md_json_sets(host->endpoint, jhost, MD_KEY_ENDPOINT, NULL);
+        md_json_setl(host->in_flight, jhost, MD_KEY_IN_FLIGHT, NULL);
+        md_json_setl((long)host->requests, jhost, MD_KEY_REQUESTS, NULL);
+        md_json_setl((long)host->waits, jhost, MD_KEY_WAITS, NULL);
+        md_json_addj(jhost, json, MD_KEY_HOSTS, NULL);
+    }
+    clients_unlock(clients);
+    return json;
+}
+
+void md_http_set_impl_data(md_http_t *http, void *data, apr_status_t (*cleanup)(void *data))
+{
+    http->impl_data = data;
+    if (data && cleanup) {
+        apr_pool_cleanup_register(http->pool, data, cleanup, apr_pool_cleanup_null);
+    }
+}
+
+void *md_http_get_impl_data(md_http_t *http)
+{
+    return http->impl_data;
+}
+
+void md_http_timing_add(md_http_t *http, const md_http_response_t *res)
+{
+    md_http_timing_stats_t *stats;
+    const char *endpoint;
+    
+    if (!http->timings) http->timings = apr_hash_make(http->pool);
+    endpoint = url_endpoint(res->req->url, res->req->pool);
+    stats = apr_hash_get(http->timings, endpoint, APR_HASH_KEY_STRING);
+    if (!stats) {
+        stats = apr_pcalloc(http->pool, sizeof(*stats));
+        stats->endpoint = apr_pstrdup(http->pool, endpoint);
+        apr_hash_set(http->timings, stats->endpoint, APR_HASH_KEY_STRING, stats);
+    }
+    /* keep the latest samples, replacing the oldest */
+    stats->samples[stats->count % MD_HTTP_TIMING_SAMPLES] = res->timing;
+    ++stats->count;
+    if (stats->nsamples < MD_HTTP_TIMING_SAMPLES) ++stats->nsamples;
+}
+
+static int itime_cmp(const void *a, const void *b)
+{
+    apr_interval_time_t t1 = *(const apr_interval_time_t*)a;
+    apr_interval_time_t t2 = *(const apr_interval_time_t*)b;
+    return (t1 < t2)? -1 : ((t1 > t2)? 1 : 0);
+}
+
+static void phase_to_json(md_json_t *json, const md_http_timing_stats_t *stats, 
+                          apr_size_t offset, apr_interval_time_t *vals, const char *key)
+{
+    int i, n = stats->nsamples;
+    
+    for (i = 0; i < n; ++i) {
+        vals[i] = *(const apr_interval_time_t*)((const char*)&stats->samples[i] + offset);
+    }
+    qsort(vals, (size_t)n, sizeof(vals[0]), itime_cmp);
+    md_json_setl((long)apr_time_as_msec(vals[(n - 1) / 2]), json, key, MD_KEY_P50, NULL);
+    md_json_setl((long)apr_time_as_msec(vals[((n - 1) * 99) / 100]), json, key, MD_KEY_P99, NULL);
+}
+
+static md_json_t *stats_to_json(const md_http_timing_stats_t *stats, apr_pool_t *p)
+{
+    apr_interval_time_t vals[MD_HTTP_TIMING_SAMPLES];
+    md_json_t *json;
+    
+    json = md_json_create(p);
+    md_json_sets(stats->endpoint, json, MD_KEY_ENDPOINT, NULL);
+    md_json_setl((long)stats->count, json, MD_KEY_REQUESTS, NULL);
+    phase_to_json(json, stats, offsetof(md_http_timing_t, dns), vals, MD_KEY_DNS);
+    phase_to_json(json, stats, offsetof(md_http_timing_t, connect), vals, MD_KEY_CONNECT);
+    phase_to_json(json, stats, offsetof(md_http_timing_t, tls), vals, MD_KEY_TLS);
+    phase_to_json(json, stats, offsetof(md_http_timing_t, first_byte), vals, MD_KEY_FIRST_BYTE);
+    phase_to_json(json, stats, offsetof(md_http_timing_t, total), vals, MD_KEY_TOTAL);
+    return json;
+}
+
+md_json_t *md_http_timings_to_json(md_http_t *http, const char *url, apr_pool_t *p)
+{
+    md_http_timing_stats_t *stats;
+    apr_hash_index_t *hi;
+    md_json_t *json;
+    void *val;
+    
+    if (!http->timings) return NULL;
+    json = md_json_create(p);
+    if (url) {
+        stats = apr_hash_get(http->timings, url_endpoint(url, p), APR_HASH_KEY_STRING);
+        if (!stats) return NULL;
+        md_json_addj(stats_to_json(stats, p), json, MD_KEY_TIMINGS, NULL);
+    }
+    else {
+        for (hi = apr_hash_first(p, http->timings); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, NULL, NULL, &val);
+            md_json_addj(stats_to_json(val, p), json, MD_KEY_TIMINGS, NULL);
+        }
+    }
+    return md_json_getj(json, MD_KEY_TIMINGS, NULL);
+}
+
 void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit)
 {
     http->resp_limit = resp_limit;
 }
 
+void md_http_set_http2(md_http_t *http, int on)
+{
+    http->http2 = on;
+}
+
+int md_http_get_http2(md_http_t *http)
+{
+    return http->http2;
+}
+
 void md_http_set_timeout_default(md_http_t *http, apr_time_t timeout)
 {
     http->timeout.overall = timeout;
@@ -143,18 +457,18 @@ static apr_status_t req_set_body(md_http_request_t *req, const char *content_typ
 static apr_status_t req_set_body_data(md_http_request_t *req, const char *content_type,
                                       const md_data_t *body)
 {
-    apr_bucket_brigade *bbody = NULL;
+    md_data_t *data;
     apr_status_t rv;
     
-    if (body && body->len > 0) {
-        bbody = apr_brigade_create(req->pool, req->http->bucket_alloc);
-        rv = apr_brigade_write(bbody, NULL, NULL, body->data, body->len);
-        if (rv != APR_SUCCESS) {
-            md_http_req_destroy(req);
-            return rv;
-        }
+    rv = req_set_body(req, content_type, NULL, 0, 0);
+    if (APR_SUCCESS == rv && body && body->len > 0) {
+        /* the bytes are sent from where they are, the caller keeps them */
+        data = apr_palloc(req->pool, sizeof(*data));
+        *data = *body;
+        req->body_data = data;
+        req->body_len = (apr_off_t)body->len;
     }
-    return req_set_body(req, content_type, bbody, body? (apr_off_t)body->len : 0, 0);
+    return rv;
 }
 
 static apr_status_t req_create(md_http_request_t **preq, md_http_t *http, 
@@ -182,12 +496,14 @@ static apr_status_t req_create(md_http_request_t **preq, md_http_t *http,
     req->user_agent = http->user_agent;
     req->proxy_url = http->proxy_url;
     req->timeout = http->timeout;
+    req->http2 = http->http2;
     *preq = req;
     return rv;
 }
 
 void md_http_req_destroy(md_http_request_t *req) 
 {
+    req_release(req);
     if (req->internals) {
         req->http->impl->req_cleanup(req);
         req->internals = NULL;
@@ -207,8 +523,15 @@ void md_http_set_on_response_cb(md_http_request_t *req, md_http_response_cb *cb,
     req->cb.on_response_data = baton;
 }
 
+void md_http_set_on_data_cb(md_http_request_t *req, md_http_data_cb *cb, void *baton)
+{
+    req->cb.on_data = cb;
+    req->cb.on_data_data = baton;
+}
+
 apr_status_t md_http_perform(md_http_request_t *req)
 {
+    md_http_req_acquire(req, 1);
     return req->http->impl->perform(req);
 }
 
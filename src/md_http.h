@@ -21,9 +21,20 @@ struct apr_table_t;
 struct apr_bucket_brigade;
 struct apr_bucket_alloc_t;
 struct md_data_t;
+struct md_json_t;
 
 typedef struct md_http_t md_http_t;
 
+/**
+ * Clients shared by all md_http_t instances of a process that use it: one
+ * connection, DNS and TLS session cache and limits on the requests in flight,
+ * overall and per endpoint (scheme, host and port). Thread safe.
+ */
+typedef struct md_http_clients_t md_http_clients_t;
+
+#define MD_HTTP_CONNS_DEF           32
+#define MD_HTTP_HOST_CONNS_DEF      8
+
 typedef struct md_http_request_t md_http_request_t;
 typedef struct md_http_response_t md_http_response_t;
 
@@ -39,12 +50,22 @@ typedef apr_status_t md_http_status_cb(const md_http_request_t *req, apr_status_
  */
 typedef apr_status_t md_http_response_cb(const md_http_response_t *res, void *data);
 
+/**
+ * Callback for the body of a response, invoked with each chunk as it arrives. The
+ * status and headers of the response are available. Returning anything but
+ * APR_SUCCESS aborts the request.
+ */
+typedef apr_status_t md_http_data_cb(const md_http_response_t *res, 
+                                     const char *data, apr_size_t len, void *baton);
+
 typedef struct md_http_callbacks_t md_http_callbacks_t;
 struct md_http_callbacks_t {
     md_http_status_cb *on_status;
     void *on_status_data;
     md_http_response_cb *on_response;
     void *on_response_data;
+    md_http_data_cb *on_data;
+    void *on_data_data;
 };
 
 typedef struct md_http_timeouts_t md_http_timeouts_t;
@@ -66,23 +87,57 @@ struct md_http_request_t {
     const char *proxy_url;
     apr_table_t *headers;
     struct apr_bucket_brigade *body;
+    const struct md_data_t *body_data; /* body sent as is, not copied, or NULL */
     apr_off_t body_len;
     apr_off_t resp_limit;
     md_http_timeouts_t timeout;
     md_http_callbacks_t cb;
+    int http2;
+    void *client_slot;                 /* the endpoint this counts against, see clients */
     void *internals;
 };
 
+/* How long the phases of a request took. A reused connection has no dns, 
+ * connect or tls time. */
+typedef struct md_http_timing_t md_http_timing_t;
+struct md_http_timing_t {
+    apr_interval_time_t dns;           /* resolving the host name */
+    apr_interval_time_t connect;       /* TCP connect */
+    apr_interval_time_t tls;           /* TLS handshake */
+    apr_interval_time_t first_byte;    /* from sending the request to the first response byte */
+    apr_interval_time_t total;         /* the whole request */
+};
+
 struct md_http_response_t {
     md_http_request_t *req;
     int status;
     apr_table_t *headers;
     struct apr_bucket_brigade *body;
+    md_http_timing_t timing;
 };
 
 apr_status_t md_http_create(md_http_t **phttp, apr_pool_t *p, const char *user_agent,
                             const char *proxy_url);
 
+/**
+ * Create the clients for the process. 
+ * @param max_conns      max requests in flight overall, 0 for unlimited
+ * @param max_host_conns max requests in flight per endpoint, 0 for unlimited
+ */
+apr_status_t md_http_clients_create(md_http_clients_t **pclients, apr_pool_t *p,
+                                    int max_conns, int max_host_conns);
+
+/**
+ * Have all md_http_t instances created from now on use these clients, or none if NULL.
+ */
+void md_http_use_clients(md_http_clients_t *clients);
+
+/**
+ * Statistics of the clients: limits, requests in flight, the number of requests
+ * done and of those that had to wait for others, overall and per endpoint.
+ */
+struct md_json_t *md_http_clients_stats_json(md_http_clients_t *clients, apr_pool_t *p);
+
 void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit);
 
 /**
@@ -91,6 +146,14 @@ void md_http_set_response_limit(md_http_t *http, apr_off_t resp_limit);
  * be sufficiently large.
  * Set to 0 the have no timeout for this.
  */
+/**
+ * Prefer HTTP/2 for https: urls. Parallel requests to the same host are then sent
+ * as streams over one connection. Servers that do not offer HTTP/2 are talked to
+ * in HTTP/1.1 as before, as is the case when the implementation does not support it.
+ */
+void md_http_set_http2(md_http_t *http, int on);
+int md_http_get_http2(md_http_t *http);
+
 void md_http_set_timeout_default(md_http_t *http, apr_time_t timeout);
 void md_http_set_timeout(md_http_request_t *req, apr_time_t timeout);
 
@@ -133,6 +196,13 @@ void md_http_set_on_status_cb(md_http_request_t *req, md_http_status_cb *cb, voi
  */
 void md_http_set_on_response_cb(md_http_request_t *req, md_http_response_cb *cb, void *baton);
 
+/**
+ * Hand the response body to cb in chunks instead of collecting it in the body
+ * brigade of the response. The response callback is still invoked at the end,
+ * with an empty body.
+ */
+void md_http_set_on_data_cb(md_http_request_t *req, md_http_data_cb *cb, void *baton);
+
 /**
  * Create a GET reqest.
  * @param preq      the created request after success
@@ -174,7 +244,8 @@ apr_status_t md_http_POST_create(md_http_request_t **preq, md_http_t *http, cons
  * @param url       the url to GET
  * @param headers   request headers
  * @param content_type the content_type of the body or NULL
- * @param body      the body of the request or NULL
+ * @param body      the body of the request or NULL. Its data is not copied and
+ *                  needs to stay valid until the request's response arrived.
  */
 apr_status_t md_http_POSTd_create(md_http_request_t **preq, md_http_t *http, const char *url, 
                                   struct apr_table_t *headers, const char *content_type, 
@@ -219,6 +290,15 @@ typedef apr_status_t md_http_next_req(md_http_request_t **preq, void *baton,
 apr_status_t md_http_multi_perform(md_http_t *http, md_http_next_req *nextreq, void *baton);
 
 /**************************************************************************************************/
+/**
+ * Timings of the requests done via http so far, as JSON array with one object
+ * per endpoint (scheme, host and port), giving the number of requests and the
+ * median and 99th percentile of each phase in milliseconds.
+ * @param url  only give the endpoint of this url or, if NULL, all of them
+ * @return NULL if there are no timings
+ */
+struct md_json_t *md_http_timings_to_json(md_http_t *http, const char *url, apr_pool_t *p);
+
 /* interface to implementation */
 
 typedef apr_status_t md_http_init_cb(void);
@@ -237,6 +317,36 @@ struct md_http_impl_t {
 
 void md_http_use_implementation(md_http_impl_t *impl);
 
+/**
+ * Data an implementation keeps with a md_http_t instance, e.g. connections to reuse
+ * for later requests. The cleanup, if given, is run when the pool the instance was
+ * created from is destroyed.
+ */
+void md_http_set_impl_data(md_http_t *http, void *data, apr_status_t (*cleanup)(void *data));
+
+/**
+ * The clients an instance belongs to or NULL. An implementation keeps its shared
+ * data with them, created on first use. Creation is serialized and the data is
+ * allocated from p, which lives as long as the clients.
+ */
+md_http_clients_t *md_http_get_clients(md_http_t *http);
+typedef void *md_http_clients_data_create(apr_pool_t *p);
+void *md_http_clients_get_impl_data(md_http_clients_t *clients, 
+                                    md_http_clients_data_create *create);
+
+/**
+ * Take a slot for sending the request. Without clients, this always succeeds.
+ * The slot is given back when the request is destroyed.
+ * @param wait  wait for a slot if none is available, otherwise return APR_EAGAIN
+ */
+apr_status_t md_http_req_acquire(md_http_request_t *req, int wait);
+
+/**
+ * Record the timing of a finished response, called by an implementation.
+ */
+void md_http_timing_add(md_http_t *http, const md_http_response_t *res);
+void *md_http_get_impl_data(md_http_t *http);
+
 
 
 #endif /* md_http_h */
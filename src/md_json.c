@@ -832,6 +832,32 @@ int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...)
     return 1;
 }
 
+int md_json_iterkey(md_json_iterkey_cb *cb, void *baton, md_json_t *json, ...)
+{
+    json_t *j;
+    va_list ap;
+    const char *key;
+    json_t *val;
+    md_json_t wrap;
+    
+    va_start(ap, json);
+    j = jselect(json, ap);
+    va_end(ap);
+    
+    if (!j || !json_is_object(j)) {
+        return 0;
+    }
+        
+    wrap.p = json->p;
+    json_object_foreach(j, key, val) {
+        wrap.j = val;
+        if (!cb(baton, key, &wrap)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**************************************************************************************************/
 /* array strings */
 
@@ -914,6 +940,73 @@ apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...)
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* compiled paths */
+
+static json_t *jselect_path(const md_json_t *json, const char * const *path)
+{
+    json_t *j = json->j;
+    
+    while (path && *path && j) {
+        j = json_object_get(j, *path++);
+    }
+    return j;
+}
+
+const char *md_json_path_gets(const md_json_t *json, const char * const *path)
+{
+    json_t *j = jselect_path(json, path);
+    return (j && json_is_string(j))? json_string_value(j) : NULL;
+}
+
+const char *md_json_path_dups(apr_pool_t *p, const md_json_t *json, const char * const *path)
+{
+    const char *s = md_json_path_gets(json, path);
+    return s? apr_pstrdup(p, s) : NULL;
+}
+
+long md_json_path_getl(const md_json_t *json, const char * const *path)
+{
+    json_t *j = jselect_path(json, path);
+    return (long)((j && json_is_number(j))? json_integer_value(j) : 0L);
+}
+
+int md_json_path_getb(const md_json_t *json, const char * const *path)
+{
+    json_t *j = jselect_path(json, path);
+    return j? json_is_true(j) : 0;
+}
+
+void md_json_get_fields(void *dest, const md_json_field_t *fields, apr_size_t nfields,
+                        const md_json_t *json, const char * const *path, apr_pool_t *p)
+{
+    json_t *obj, *j;
+    char *member;
+    apr_size_t i;
+    
+    obj = jselect_path(json, path);
+    if (obj && !json_is_object(obj)) obj = NULL;
+    for (i = 0; i < nfields; ++i) {
+        j = obj? json_object_get(obj, fields[i].key) : NULL;
+        member = (char*)dest + fields[i].offset;
+        switch (fields[i].type) {
+            case MD_JSON_FIELD_DUPS:
+                *(const char**)member = (j && json_is_string(j))? 
+                    apr_pstrdup(p, json_string_value(j)) : NULL;
+                break;
+            case MD_JSON_FIELD_INT:
+                *(int*)member = (int)((j && json_is_number(j))? json_integer_value(j) : 0L);
+                break;
+            case MD_JSON_FIELD_LONG:
+                *(long*)member = (long)((j && json_is_number(j))? json_integer_value(j) : 0L);
+                break;
+            case MD_JSON_FIELD_BOOL:
+                *(int*)member = j? json_is_true(j) : 0;
+                break;
+        }
+    }
+}
+
 /**************************************************************************************************/
 /* formatting, parsing */
 
@@ -986,6 +1079,190 @@ const char *md_json_writep(const md_json_t *json, apr_pool_t *p, md_json_fmt_t f
     }
 }
 
+/**************************************************************************************************/
+/* streaming output */
+
+#define MD_JSON_WRITER_DEPTH    32
+
+struct md_json_writer_t {
+    apr_bucket_brigade *bb;
+    md_json_fmt_t fmt;
+    md_json_writer_flush_cb *flush;
+    void *baton;
+    int depth;
+    int count[MD_JSON_WRITER_DEPTH];   /* values written so far at each depth */
+    apr_status_t rv;                   /* the first error */
+};
+
+md_json_writer_t *md_json_writer_create(apr_bucket_brigade *bb, md_json_fmt_t fmt,
+                                        md_json_writer_flush_cb *flush, void *baton,
+                                        apr_pool_t *p)
+{
+    md_json_writer_t *w;
+    
+    w = apr_pcalloc(p, sizeof(*w));
+    w->bb = bb;
+    w->fmt = fmt;
+    w->flush = flush;
+    w->baton = baton;
+    return w;
+}
+
+static void jw_write(md_json_writer_t *w, const char *s, apr_size_t len)
+{
+    if (APR_SUCCESS == w->rv && len > 0) {
+        w->rv = apr_brigade_write(w->bb, NULL, NULL, s, len);
+    }
+}
+
+static void jw_newline(md_json_writer_t *w)
+{
+    static const char spaces[] = "                                ";
+    int n;
+    
+    if (MD_JSON_FMT_INDENT != w->fmt) return;
+    jw_write(w, "\n", 1);
+    for (n = 2 * w->depth; n > 0; n -= (int)sizeof(spaces) - 1) {
+        jw_write(w, spaces, (apr_size_t)((n < (int)sizeof(spaces) - 1)? n : (int)sizeof(spaces) - 1));
+    }
+}
+
+static void jw_string(md_json_writer_t *w, const char *s)
+{
+    const char *start;
+    char esc[8];
+    
+    jw_write(w, "\"", 1);
+    for (start = s; *s; ++s) {
+        if ((unsigned char)*s >= 0x20 && *s != '"' && *s != '\\') continue;
+        jw_write(w, start, (apr_size_t)(s - start));
+        switch (*s) {
+            case '"':  jw_write(w, "\\\"", 2); break;
+            case '\\': jw_write(w, "\\\\", 2); break;
+            case '\n': jw_write(w, "\\n", 2); break;
+            case '\r': jw_write(w, "\\r", 2); break;
+            case '\t': jw_write(w, "\\t", 2); break;
+            default:
+                apr_snprintf(esc, sizeof(esc), "\\u%04x", (unsigned int)(unsigned char)*s);
+                jw_write(w, esc, 6);
+                break;
+        }
+        start = s + 1;
+    }
+    jw_write(w, start, (apr_size_t)(s - start));
+    jw_write(w, "\"", 1);
+}
+
+/* Start a value, with the separator from the one before and the key, if any */
+static void jw_key(md_json_writer_t *w, const char *key)
+{
+    if (w->depth > 0) {
+        if (w->count[w->depth]++ > 0) jw_write(w, ",", 1);
+        jw_newline(w);
+    }
+    if (key) {
+        jw_string(w, key);
+        jw_write(w, (MD_JSON_FMT_INDENT == w->fmt)? ": " : ":", 
+                 (MD_JSON_FMT_INDENT == w->fmt)? 2 : 1);
+    }
+}
+
+static apr_status_t jw_begin(md_json_writer_t *w, const char *key, const char *open)
+{
+    if (APR_SUCCESS != w->rv) return w->rv;
+    if (w->depth + 1 >= MD_JSON_WRITER_DEPTH) return w->rv = APR_EINVAL;
+    jw_key(w, key);
+    jw_write(w, open, 1);
+    w->count[++w->depth] = 0;
+    return w->rv;
+}
+
+static apr_status_t jw_end(md_json_writer_t *w, const char *close)
+{
+    if (APR_SUCCESS != w->rv) return w->rv;
+    if (w->depth <= 0) return w->rv = APR_EINVAL;
+    if (w->count[w->depth--] > 0) jw_newline(w);
+    jw_write(w, close, 1);
+    return w->rv;
+}
+
+apr_status_t md_json_writer_begin_object(md_json_writer_t *w, const char *key)
+{
+    return jw_begin(w, key, "{");
+}
+
+apr_status_t md_json_writer_end_object(md_json_writer_t *w)
+{
+    return jw_end(w, "}");
+}
+
+apr_status_t md_json_writer_begin_array(md_json_writer_t *w, const char *key)
+{
+    return jw_begin(w, key, "[");
+}
+
+apr_status_t md_json_writer_end_array(md_json_writer_t *w)
+{
+    return jw_end(w, "]");
+}
+
+apr_status_t md_json_writer_sets(md_json_writer_t *w, const char *key, const char *value)
+{
+    if (APR_SUCCESS != w->rv) return w->rv;
+    jw_key(w, key);
+    if (value) jw_string(w, value);
+    else jw_write(w, "null", 4);
+    return w->rv;
+}
+
+apr_status_t md_json_writer_setl(md_json_writer_t *w, const char *key, long value)
+{
+    char buffer[32];
+    
+    if (APR_SUCCESS != w->rv) return w->rv;
+    jw_key(w, key);
+    apr_snprintf(buffer, sizeof(buffer), "%ld", value);
+    jw_write(w, buffer, strlen(buffer));
+    return w->rv;
+}
+
+apr_status_t md_json_writer_setb(md_json_writer_t *w, const char *key, int value)
+{
+    if (APR_SUCCESS != w->rv) return w->rv;
+    jw_key(w, key);
+    if (value) jw_write(w, "true", 4);
+    else jw_write(w, "false", 5);
+    return w->rv;
+}
+
+apr_status_t md_json_writer_setj(md_json_writer_t *w, const char *key, const md_json_t *value)
+{
+    if (APR_SUCCESS != w->rv) return w->rv;
+    jw_key(w, key);
+    if (!value) {
+        jw_write(w, "null", 4);
+    }
+    else if (APR_SUCCESS == w->rv
+             && json_dump_callback(value->j, dump_cb, w->bb, 
+                                   fmt_to_flags(w->fmt) | JSON_ENCODE_ANY)) {
+        w->rv = APR_EGENERAL;
+    }
+    return w->rv;
+}
+
+apr_status_t md_json_writer_flush(md_json_writer_t *w, int force)
+{
+    apr_off_t len = 0;
+    
+    if (APR_SUCCESS != w->rv || !w->flush) return w->rv;
+    if (!force) {
+        apr_brigade_length(w->bb, 0, &len);
+        if (len < MD_JSON_WRITER_FLUSH_SIZE) return w->rv;
+    }
+    w->rv = w->flush(w->baton, w->bb);
+    return w->rv;
+}
+
 apr_status_t md_json_writef(const md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt, apr_file_t *f)
 {
     apr_status_t rv;
@@ -1036,7 +1313,7 @@ apr_status_t md_json_freplace(const md_json_t *json, apr_pool_t *p, md_json_fmt_
     ctx.json = json;
     ctx.fmt = fmt;
     ctx.fname = fpath;
-    return md_util_freplace(fpath, perms, p, write_json, &ctx);
+    return md_util_freplace(fpath, perms, MD_UTIL_SYNC_NONE, p, write_json, &ctx);
 }
 
 apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data, size_t data_len)
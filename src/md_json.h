@@ -18,6 +18,7 @@
 #define mod_md_md_json_h
 
 #include <apr_file_io.h>
+#include <apr_general.h>
 
 struct apr_bucket_brigade;
 struct apr_file_t;
@@ -113,6 +114,10 @@ apr_status_t md_json_seta(apr_array_header_t *a, md_json_to_cb *cb,
 typedef int md_json_itera_cb(void *baton, size_t index, md_json_t *json);
 int md_json_itera(md_json_itera_cb *cb, void *baton, md_json_t *json, ...);
 
+/* Called on each object member, aborts iteration when returning 0 */
+typedef int md_json_iterkey_cb(void *baton, const char *key, md_json_t *json);
+int md_json_iterkey(md_json_iterkey_cb *cb, void *baton, md_json_t *json, ...);
+
 /* Manipulating Object String values */
 apr_status_t md_json_gets_dict(apr_table_t *dict, const md_json_t *json, ...);
 apr_status_t md_json_sets_dict(apr_table_t *dict, md_json_t *json, ...);
@@ -122,6 +127,40 @@ apr_status_t md_json_getsa(apr_array_header_t *a, const md_json_t *json, ...);
 apr_status_t md_json_dupsa(apr_array_header_t *a, apr_pool_t *p, md_json_t *json, ...);
 apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...);
 
+/* Getting values by a compiled path, a NULL-terminated array of keys that is set
+ * up once, e.g. as a static const array, instead of passing keys on each call.
+ * A NULL path selects json itself. Values are the same as with the
+ * varargs getters. */
+const char *md_json_path_gets(const md_json_t *json, const char * const *path);
+const char *md_json_path_dups(apr_pool_t *p, const md_json_t *json, const char * const *path);
+long md_json_path_getl(const md_json_t *json, const char * const *path);
+int md_json_path_getb(const md_json_t *json, const char * const *path);
+
+/* Getting several members of an object into a C struct at once */
+typedef enum {
+    MD_JSON_FIELD_DUPS,         /* const char *, copied into the pool */
+    MD_JSON_FIELD_INT,          /* int, from an integer as md_json_getl() */
+    MD_JSON_FIELD_LONG,         /* long, from an integer as md_json_getl() */
+    MD_JSON_FIELD_BOOL,         /* int, as md_json_getb() */
+} md_json_field_type_t;
+
+typedef struct {
+    const char *key;
+    md_json_field_type_t type;
+    apr_size_t offset;          /* of the member in the struct */
+} md_json_field_t;
+
+#define MD_JSON_FIELD(key, type, stype, member)    { key, type, APR_OFFSETOF(stype, member) }
+
+/**
+ * Set the members described by fields in dest from the object at path in json.
+ * The path is selected once, each field is a single lookup in the object. Members
+ * whose key is missing or has another type are set to NULL or 0, as the single
+ * getters return.
+ */
+void md_json_get_fields(void *dest, const md_json_field_t *fields, apr_size_t nfields,
+                        const md_json_t *json, const char * const *path, apr_pool_t *p);
+
 /* serialization & parsing */
 apr_status_t md_json_writeb(const md_json_t *json, md_json_fmt_t fmt, struct apr_bucket_brigade *bb);
 const char *md_json_writep(const md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt);
@@ -132,6 +171,44 @@ apr_status_t md_json_fcreatex(const md_json_t *json, apr_pool_t *p, md_json_fmt_
 apr_status_t md_json_freplace(const md_json_t *json, apr_pool_t *p, md_json_fmt_t fmt, 
                               const char *fpath, apr_fileperms_t perms);
 
+/* streaming output */
+
+/**
+ * Writes JSON into a brigade as values are given, without building a md_json_t 
+ * first. Keys are given for members of objects and are NULL for array elements
+ * and the top level value. Errors are kept, calls after the first error do nothing
+ * and return it.
+ */
+typedef struct md_json_writer_t md_json_writer_t;
+
+/**
+ * Called to pass on what has been written so far. The brigade is to be emptied.
+ */
+typedef apr_status_t md_json_writer_flush_cb(void *baton, struct apr_bucket_brigade *bb);
+
+/* How much data md_json_writer_flush() collects before the callback is invoked */
+#define MD_JSON_WRITER_FLUSH_SIZE   (64 * 1024)
+
+md_json_writer_t *md_json_writer_create(struct apr_bucket_brigade *bb, md_json_fmt_t fmt,
+                                        md_json_writer_flush_cb *flush, void *baton,
+                                        apr_pool_t *p);
+
+apr_status_t md_json_writer_begin_object(md_json_writer_t *w, const char *key);
+apr_status_t md_json_writer_end_object(md_json_writer_t *w);
+apr_status_t md_json_writer_begin_array(md_json_writer_t *w, const char *key);
+apr_status_t md_json_writer_end_array(md_json_writer_t *w);
+apr_status_t md_json_writer_sets(md_json_writer_t *w, const char *key, const char *value);
+apr_status_t md_json_writer_setl(md_json_writer_t *w, const char *key, long value);
+apr_status_t md_json_writer_setb(md_json_writer_t *w, const char *key, int value);
+apr_status_t md_json_writer_setj(md_json_writer_t *w, const char *key, const md_json_t *value);
+
+/**
+ * Invoke the flush callback, when given, if MD_JSON_WRITER_FLUSH_SIZE bytes are
+ * collected or always when force is != 0. Producers call this between values, 
+ * at points where they hold no locks.
+ */
+apr_status_t md_json_writer_flush(md_json_writer_t *w, int force);
+
 apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, struct apr_bucket_brigade *bb);
 apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data, size_t data_len);
 apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *pool, const char *fpath);
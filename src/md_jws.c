@@ -36,32 +36,40 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
                          struct md_pkey_t *pkey, const char *key_id)
 {
     md_json_t *msg, *jprotected;
-    const char *prot64, *pay64, *sign64, *sign, *prot;
+    const char *prot64, *pay64, *sign64, *sign, *prot = NULL;
     apr_status_t rv = APR_SUCCESS;
     md_data_t data;
+    const md_pkey_jwk_t *jwk;
 
     *pmsg = NULL;
     
     msg = md_json_create(p);
 
     jprotected = md_json_create(p);
-    md_json_sets("RS256", jprotected, "alg", NULL);
+    md_json_sets(md_pkey_get_jws_alg(pkey), jprotected, "alg", NULL);
     if (key_id) {
         md_json_sets(key_id, jprotected, "kid", NULL);
     }
-    else {
-        md_json_sets(md_pkey_get_rsa_e64(pkey, p), jprotected, "jwk", "e", NULL);
-        md_json_sets("RSA", jprotected, "jwk", "kty", NULL);
-        md_json_sets(md_pkey_get_rsa_n64(pkey, p), jprotected, "jwk", "n", NULL);
+    else if ((jwk = md_pkey_get_jwk(pkey))) {
+        if (jwk->crv) md_json_sets(jwk->crv, jprotected, "jwk", "crv", NULL);
+        if (jwk->e) md_json_sets(jwk->e, jprotected, "jwk", "e", NULL);
+        md_json_sets(jwk->kty, jprotected, "jwk", "kty", NULL);
+        if (jwk->n) md_json_sets(jwk->n, jprotected, "jwk", "n", NULL);
+        if (jwk->x) md_json_sets(jwk->x, jprotected, "jwk", "x", NULL);
+        if (jwk->y) md_json_sets(jwk->y, jprotected, "jwk", "y", NULL);
     }
-    apr_table_do(header_set, jprotected, protected, NULL);
-    prot = md_json_writep(jprotected, p, MD_JSON_FMT_COMPACT);
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, "protected: %s",
-                  prot ? prot : "<failed to serialize!>");
-
-    if (!prot) {
+    else {
         rv = APR_EINVAL;
     }
+    if (rv == APR_SUCCESS) {
+        apr_table_do(header_set, jprotected, protected, NULL);
+        prot = md_json_writep(jprotected, p, MD_JSON_FMT_COMPACT);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, p, "protected: %s",
+                      prot ? prot : "<failed to serialize!>");
+        if (!prot) {
+            rv = APR_EINVAL;
+        }
+    }
     
     if (rv == APR_SUCCESS) {
         data.data = prot;
@@ -92,19 +100,13 @@ apr_status_t md_jws_sign(md_json_t **pmsg, apr_pool_t *p,
 
 apr_status_t md_jws_pkey_thumb(const char **pthumb, apr_pool_t *p, struct md_pkey_t *pkey)
 {
-    const char *e64, *n64, *s;
-    md_data_t data;
-    apr_status_t rv;
+    const md_pkey_jwk_t *jwk;
     
-    e64 = md_pkey_get_rsa_e64(pkey, p);
-    n64 = md_pkey_get_rsa_n64(pkey, p);
-    if (!e64 || !n64) {
+    /* computed once per key, the key authorization of every challenge needs it */
+    if (!(jwk = md_pkey_get_jwk(pkey))) {
+        *pthumb = NULL;
         return APR_EINVAL;
     }
-
-    /* whitespace and order is relevant, since we hand out a digest of this */
-    s = apr_psprintf(p, "{\"e\":\"%s\",\"kty\":\"RSA\",\"n\":\"%s\"}", e64, n64);
-    MD_DATA_SET_STR(&data, s);
-    rv = md_crypt_sha256_digest64(pthumb, p, &data);
-    return rv;
+    *pthumb = apr_pstrdup(p, jwk->thumb64);
+    return APR_SUCCESS;
 }
@@ -0,0 +1,308 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_util.h"
+#include "md_keypool.h"
+
+/* Names of keys that a taker has claimed, but not yet loaded. */
+#define MD_KEYPOOL_TAKEN        MD_KEYPOOL_PREFIX "taken-"
+
+typedef struct {
+    const char *tag;                   /* short form of the spec used in names */
+    md_pkey_spec_t spec;
+    apr_array_header_t *names;         /* names of the keys at hand, last one is taken first */
+} keypool_entry_t;
+
+struct md_keypool_t {
+    apr_pool_t *p;
+    apr_pool_t *pnames;                /* names of the keys, recreated on sync */
+    md_store_t *store;
+    int size;
+    apr_hash_t *entries;               /* tag -> keypool_entry_t* */
+    unsigned int serial;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+static void kp_lock(md_keypool_t *kp)
+{
+#if APR_HAS_THREADS
+    if (kp->mutex) apr_thread_mutex_lock(kp->mutex);
+#else
+    (void)kp;
+#endif
+}
+
+static void kp_unlock(md_keypool_t *kp)
+{
+#if APR_HAS_THREADS
+    if (kp->mutex) apr_thread_mutex_unlock(kp->mutex);
+#else
+    (void)kp;
+#endif
+}
+
+static const char *spec_tag(const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    md_pkey_type_t ptype = spec? spec->type : MD_PKEY_TYPE_DEFAULT;
+    char *tag, *s, *d;
+    
+    switch (ptype) {
+        case MD_PKEY_TYPE_DEFAULT:
+            /* generates the same keys as RSA with default bits */
+            return apr_psprintf(p, "rsa%d", MD_PKEY_RSA_BITS_DEF);
+        case MD_PKEY_TYPE_RSA:
+            return apr_psprintf(p, "rsa%u", (unsigned int)spec->params.rsa.bits);
+        case MD_PKEY_TYPE_EC:
+            /* "P-256" -> "ecp256" */
+            tag = apr_pstrcat(p, "ec", spec->params.ec.curve? 
+                              spec->params.ec.curve : MD_PKEY_EC_CURVE_DEF, NULL);
+            for (s = d = tag; *s; ++s) {
+                if (*s != '-') *d++ = (char)apr_tolower(*s);
+            }
+            *d = '\0';
+            return tag;
+        case MD_PKEY_TYPE_ED25519:
+            return "ed25519";
+        default:
+            return NULL;
+    }
+}
+
+apr_status_t md_keypool_create(md_keypool_t **pkeypool, apr_pool_t *p,
+                               md_store_t *store, int size)
+{
+    md_keypool_t *kp;
+    apr_allocator_t *allocator;
+    apr_pool_t *kpp;
+    apr_status_t rv;
+
+    *pkeypool = NULL;
+    /* The pool is used by the watchdog and renewal threads, it gets its own allocator */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+    apr_allocator_max_free_set(allocator, 1);
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&kpp, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto leave;
+    }
+    apr_allocator_owner_set(allocator, kpp);
+    apr_pool_tag(kpp, "md_keypool");
+
+    kp = apr_pcalloc(kpp, sizeof(*kp));
+    kp->p = kpp;
+    kp->store = store;
+    kp->size = size;
+    kp->entries = apr_hash_make(kpp);
+    if (APR_SUCCESS != (rv = apr_pool_create(&kp->pnames, kpp))) goto leave;
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&kp->mutex,
+                                                     APR_THREAD_MUTEX_DEFAULT, kpp))) {
+        goto leave;
+    }
+#endif
+    *pkeypool = kp;
+leave:
+    return rv;
+}
+
+void md_keypool_add_spec(md_keypool_t *kp, const md_pkey_spec_t *spec)
+{
+    keypool_entry_t *e;
+    const char *tag;
+
+    kp_lock(kp);
+    if ((tag = spec_tag(spec, kp->p)) && !apr_hash_get(kp->entries, tag, APR_HASH_KEY_STRING)) {
+        e = apr_pcalloc(kp->p, sizeof(*e));
+        e->tag = tag;
+        if (spec) {
+            e->spec = *spec;
+        }
+        else {
+            e->spec.type = MD_PKEY_TYPE_DEFAULT;
+        }
+        e->names = apr_array_make(kp->pnames, kp->size, sizeof(const char*));
+        apr_hash_set(kp->entries, tag, APR_HASH_KEY_STRING, e);
+    }
+    kp_unlock(kp);
+}
+
+typedef struct {
+    md_keypool_t *kp;
+    apr_array_header_t *stale;
+} sync_ctx_t;
+
+static int sync_name(void *baton, const char *name, const char *aspect,
+                     md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    sync_ctx_t *ctx = baton;
+    keypool_entry_t *e = NULL;
+    const char *tag, *end;
+
+    (void)aspect; (void)vtype; (void)value; (void)ptemp;
+    tag = name + strlen(MD_KEYPOOL_PREFIX);
+    if ((end = strrchr(tag, '-')) && end > tag) {
+        e = apr_hash_get(ctx->kp->entries, tag, (apr_ssize_t)(end - tag));
+    }
+    if (e && e->names->nelts < ctx->kp->size) {
+        APR_ARRAY_PUSH(e->names, const char*) = apr_pstrdup(ctx->kp->pnames, name);
+    }
+    else {
+        /* claims that were never finished, keys for specs no longer configured
+         * or more keys than we keep. */
+        APR_ARRAY_PUSH(ctx->stale, const char*) = apr_pstrdup(ctx->stale->pool, name);
+    }
+    return 1;
+}
+
+apr_status_t md_keypool_sync(md_keypool_t *kp)
+{
+    sync_ctx_t ctx;
+    apr_hash_index_t *hi;
+    keypool_entry_t *e;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    void *val;
+    int i;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, kp->p))) return rv;
+    ctx.kp = kp;
+    ctx.stale = apr_array_make(ptemp, 5, sizeof(const char*));
+
+    kp_lock(kp);
+    apr_pool_clear(kp->pnames);
+    for (hi = apr_hash_first(ptemp, kp->entries); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        e = val;
+        e->names = apr_array_make(kp->pnames, kp->size, sizeof(const char*));
+    }
+    rv = md_store_iter_names(sync_name, &ctx, kp->store, ptemp, MD_SG_STAGING,
+                             MD_KEYPOOL_PREFIX "*");
+    kp_unlock(kp);
+    if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+
+    for (i = 0; i < ctx.stale->nelts; ++i) {
+        md_store_purge(kp->store, ptemp, MD_SG_STAGING, APR_ARRAY_IDX(ctx.stale, i, const char*));
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "keypool: synced, %d keys missing, "
+                  "%d stale entries removed", md_keypool_missing(kp), ctx.stale->nelts);
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+apr_status_t md_keypool_take(md_pkey_t **ppkey, md_keypool_t *kp,
+                             const md_pkey_spec_t *spec, apr_pool_t *p)
+{
+    keypool_entry_t *e;
+    const char *tag, *name, *claimed;
+    apr_status_t rv;
+
+    *ppkey = NULL;
+    if (!(tag = spec_tag(spec, p))) return APR_ENOENT;
+    for (;;) {
+        name = NULL;
+        kp_lock(kp);
+        e = apr_hash_get(kp->entries, tag, APR_HASH_KEY_STRING);
+        if (e && e->names->nelts > 0) {
+            name = apr_pstrdup(p, *(const char**)apr_array_pop(e->names));
+        }
+        kp_unlock(kp);
+        if (!name) return APR_ENOENT;
+
+        /* The key may have been taken by another process, after we indexed it. Only
+         * the one that renames its directory gets it. */
+        if (!md_store_get_modified(kp->store, MD_SG_STAGING, name, MD_FN_PRIVKEY, p)) continue;
+        claimed = apr_pstrcat(p, MD_KEYPOOL_TAKEN, name + strlen(MD_KEYPOOL_PREFIX), NULL);
+        if (APR_SUCCESS != md_store_rename(kp->store, p, MD_SG_STAGING, name, claimed)) continue;
+
+        rv = md_pkey_load(kp->store, MD_SG_STAGING, claimed, ppkey, p);
+        md_store_purge(kp->store, p, MD_SG_STAGING, claimed);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "keypool: took %s key %s", tag, name);
+        if (APR_SUCCESS == rv) return rv;
+    }
+}
+
+apr_status_t md_keypool_fill(md_keypool_t *kp, int max_gen, apr_pool_t *p)
+{
+    apr_hash_index_t *hi;
+    keypool_entry_t *e;
+    md_pkey_t *pkey;
+    apr_pool_t *ptemp;
+    const char *name;
+    void *val;
+    apr_status_t rv = APR_SUCCESS;
+    int gen = 0, missing;
+
+    for (hi = apr_hash_first(p, kp->entries); hi && gen < max_gen; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        e = val;
+        for (;;) {
+            kp_lock(kp);
+            missing = kp->size - e->names->nelts;
+            kp_unlock(kp);
+            if (missing <= 0 || gen >= max_gen) break;
+
+            if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) goto leave;
+            name = apr_psprintf(ptemp, "%s%s-%" APR_TIME_T_FMT "%04x", MD_KEYPOOL_PREFIX,
+                                e->tag, apr_time_now(), (kp->serial++ & 0xffffu));
+            ++gen;
+            if (APR_SUCCESS == (rv = md_pkey_gen(&pkey, ptemp, &e->spec))) {
+                rv = md_pkey_save(kp->store, ptemp, MD_SG_STAGING, name, pkey, 1);
+                md_pkey_free(pkey);
+            }
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "keypool: generated %s", name);
+            if (APR_SUCCESS == rv) {
+                kp_lock(kp);
+                APR_ARRAY_PUSH(e->names, const char*) = apr_pstrdup(kp->pnames, name);
+                kp_unlock(kp);
+            }
+            apr_pool_destroy(ptemp);
+            if (APR_SUCCESS != rv) goto leave;
+        }
+    }
+    if (md_keypool_missing(kp) > 0) rv = APR_EAGAIN;
+leave:
+    return rv;
+}
+
+int md_keypool_missing(md_keypool_t *kp)
+{
+    apr_hash_index_t *hi;
+    keypool_entry_t *e;
+    void *val;
+    int missing = 0;
+
+    kp_lock(kp);
+    for (hi = apr_hash_first(NULL, kp->entries); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        e = val;
+        if (e->names->nelts < kp->size) missing += kp->size - e->names->nelts;
+    }
+    kp_unlock(kp);
+    return missing;
+}
@@ -0,0 +1,77 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_keypool_h
+#define mod_md_md_keypool_h
+
+struct md_pkey_t;
+struct md_pkey_spec_t;
+struct md_store_t;
+
+/* Prefix of the names in group STAGING that hold pooled keys. */
+#define MD_KEYPOOL_PREFIX       "_keypool-"
+
+/**
+ * A pool of pre-generated private keys, kept in group STAGING of a store.
+ * Each key lives under its own name "_keypool-<spec>-<id>", so that it is
+ * claimed by a single rename and a key is never handed out twice, even
+ * when several processes take from the same store.
+ *
+ * The available names are indexed in memory per key specification, so taking
+ * a key does not need to look through the store. The index is protected by
+ * a mutex and the pool may be used from several threads.
+ */
+typedef struct md_keypool_t md_keypool_t;
+
+/**
+ * Create a pool that keeps up to size keys for each added key specification
+ * in the store. Keys already in the store are indexed by md_keypool_sync().
+ */
+apr_status_t md_keypool_create(md_keypool_t **pkeypool, apr_pool_t *p,
+                               struct md_store_t *store, int size);
+
+/**
+ * Keep keys for the given specification in the pool. Specifications of key types
+ * that cannot be pooled are ignored.
+ */
+void md_keypool_add_spec(md_keypool_t *keypool, const struct md_pkey_spec_t *spec);
+
+/**
+ * Index the keys in the store again, e.g. when another process may have added
+ * or taken keys since the pool was created.
+ */
+apr_status_t md_keypool_sync(md_keypool_t *keypool);
+
+/**
+ * Take a key for the specification out of the pool and allocate it from p.
+ * @return APR_ENOENT if the pool has no such key at hand
+ */
+apr_status_t md_keypool_take(struct md_pkey_t **ppkey, md_keypool_t *keypool,
+                             const struct md_pkey_spec_t *spec, apr_pool_t *p);
+
+/**
+ * Generate at most max_gen keys for specifications that have less than
+ * the pool size at hand.
+ * @return APR_EAGAIN if keys are still missing afterwards
+ */
+apr_status_t md_keypool_fill(md_keypool_t *keypool, int max_gen, apr_pool_t *p);
+
+/**
+ * Number of keys that are missing in the pool.
+ */
+int md_keypool_missing(md_keypool_t *keypool);
+
+#endif /* mod_md_md_keypool_h */
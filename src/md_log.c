@@ -50,6 +50,8 @@ static md_log_print_cb *log_printv;
 static md_log_level_cb *log_level;
 static void *log_baton;
 
+md_log_level_t md_log_level_max = MD_LOG_TRACE8;
+
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton)
 {
     log_printv = print_cb;
@@ -57,16 +59,21 @@ void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *bato
     log_baton = baton;
 }
 
+void md_log_set_level(md_log_level_t max_level)
+{
+    md_log_level_max = max_level;
+}
+
 int md_log_is_level(apr_pool_t *p, md_log_level_t level)
 {
-    if (!log_level) {
+    if (!log_level || !MD_LOG_ENABLED(level)) {
         return 0;
     }
     return log_level(log_baton, p, level);
 }
 
-void md_log_perror(const char *file, int line, md_log_level_t level, 
-                   apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
+void md_log_perror_(const char *file, int line, md_log_level_t level, 
+                    apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
 {
     va_list ap;
 
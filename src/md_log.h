@@ -38,14 +38,36 @@ typedef enum {
 
 #define MD_LOG_MARK     __FILE__,__LINE__
 
+/* The highest level compiled in, logging above it is left out of the code. 
+ * Configuring --disable-trace-logging sets it to MD_LOG_DEBUG. */
+#ifndef MD_LOG_MAX_LEVEL
+#define MD_LOG_MAX_LEVEL        MD_LOG_TRACE8
+#endif
+
+/* The highest level logging is enabled for at runtime, see md_log_set_level() */
+extern md_log_level_t md_log_level_max;
+
+/**
+ * Check, without calling a function, if logging at the level may happen. Arguments 
+ * of md_log_perror() are only evaluated then, use this to guard preparations that 
+ * are only needed for logging.
+ */
+#define MD_LOG_ENABLED(level) \
+    ((level) <= MD_LOG_MAX_LEVEL && (level) <= md_log_level_max)
+
 const char *md_log_level_name(md_log_level_t level);
 
 int md_log_is_level(apr_pool_t *p, md_log_level_t level);
 
-void md_log_perror(const char *file, int line, md_log_level_t level, 
-                   apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
+void md_log_perror_(const char *file, int line, md_log_level_t level, 
+                    apr_status_t rv, apr_pool_t *p, const char *fmt, ...)
                                 __attribute__((format(printf,6,7)));
 
+#define md_log_perror(mark, level, ...) \
+    do { \
+        if (MD_LOG_ENABLED(level)) md_log_perror_(mark, level, __VA_ARGS__); \
+    } while (0)
+
 typedef int md_log_level_cb(void *baton, apr_pool_t *p, md_log_level_t level);
 
 typedef void md_log_print_cb(const char *file, int line, md_log_level_t level, 
@@ -53,4 +75,11 @@ typedef void md_log_print_cb(const char *file, int line, md_log_level_t level,
 
 void md_log_set(md_log_level_cb *level_cb, md_log_print_cb *print_cb, void *baton);
 
+/**
+ * Set the highest level that the level callback enables, so that logging above 
+ * it is skipped before any arguments are evaluated. Call again when the level 
+ * changes. Until set, all levels are passed to the callback.
+ */
+void md_log_set_level(md_log_level_t max_level);
+
 #endif /* md_log_h */
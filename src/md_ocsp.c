@@ -19,8 +19,10 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_buckets.h>
 #include <apr_hash.h>
+#include <apr_shm.h>
 #include <apr_time.h>
 #include <apr_date.h>
 #include <apr_strings.h>
@@ -52,7 +54,54 @@
 #include "md_ocsp.h"
 
 #define MD_OCSP_ID_LENGTH   SHA_DIGEST_LENGTH
+
+typedef struct md_ocsp_status_t md_ocsp_status_t; 
+typedef struct md_ocsp_resp_t md_ocsp_resp_t;
+struct md_ocsp_resp_t {
+    volatile apr_uint32_t refs; /* 1 while published in ostat + 1 for each reader */
+    md_ocsp_cert_stat_t stat;
+    md_data_t der;              /* DER bytes, allocated right behind the struct */
+    md_timeperiod_t valid;
+    md_ocsp_status_t *ostat;    /* where it was published, set when retired */
+    int quiet;                  /* no reader of ostat has been between load and ref since */
+    md_ocsp_resp_t *next;       /* next in list of retired responses */
+};
+
+/* Max length of a DER response kept in the shared table. Larger responses
+ * are only available from the store. */
+#define MD_OCSP_SHM_DER_MAX  (4 * 1024)
+
+/* Number of buckets in the lookup histograms, bucket i counts durations
+ * below 2^i microseconds, the last one everything longer. */
+#define MD_OCSP_HIST_BUCKETS 16
+
+/* A slot in the shared response table. Slots are assigned in the parent
+ * process before any child is forked, so all children agree on which slot
+ * belongs to which certificate. Only the watchdog writes to a slot. Readers
+ * check the certificate id and MD name hash before they use one. */
+typedef struct md_ocsp_shm_slot_t md_ocsp_shm_slot_t;
+struct md_ocsp_shm_slot_t {
+    char id[MD_OCSP_ID_LENGTH]; /* the certificate id this slot belongs to */
+    apr_uint32_t md_hash;       /* hash of the MD name this slot belongs to */
+    volatile apr_uint32_t gen;  /* even when stable, odd while being written */
+    apr_uint32_t stat;          /* md_ocsp_cert_stat_t */
+    apr_uint32_t der_len;       /* 0 when no response or too large for the slot */
+    apr_time_t mtime;
+    md_timeperiod_t valid;
+    /* DER bytes follow */
+};
    
+/* Counters of stapling lookups in this process, updated lock-free by handshakes */
+typedef struct {
+    volatile apr_uint32_t calls;       /* lookups for a stapled certificate */
+    volatile apr_uint32_t hits;        /* lookups that found a response */
+    volatile apr_uint32_t misses;      /* lookups without a response */
+    volatile apr_uint32_t store_reads; /* lookups that checked the store */
+    volatile apr_uint32_t lock_waits;  /* lookups that had to wait on the mutex */
+    volatile apr_uint32_t latency[MD_OCSP_HIST_BUCKETS];   /* lookup durations */
+    volatile apr_uint32_t lock_wait[MD_OCSP_HIST_BUCKETS]; /* mutex wait durations */
+} md_ocsp_stats_t;
+
 struct md_ocsp_reg_t {
     apr_pool_t *p;
     md_store_t *store;
@@ -63,25 +112,59 @@ struct md_ocsp_reg_t {
     md_timeslice_t renew_window;
     md_job_notify_cb *notify;
     void *notify_ctx;
+    md_ocsp_resp_t *retired;   /* replaced responses, protected by mutex */
+    apr_shm_t *shm;            /* shared response table or NULL */
+    apr_size_t shm_slot_size;
+    apr_uint32_t gen;          /* distinguishes registries of config reloads */
+    int batch_max;             /* max number of certificates in a single OCSP request */
+    md_ocsp_spread_t renew_spread; /* how renewals are placed in the renew window */
+    int use_get;               /* use RFC 5019 GET requests where possible */
+    int max_parallel;          /* max parallel requests to all responders */
+    int max_parallel_responder;/* max parallel requests to a single responder */
+    apr_array_header_t *schedule; /* md_ocsp_status_t* as min-heap on next_run */
+    apr_array_header_t *ostats;   /* md_ocsp_status_t* in the order added, see ostat_attach() */
+    apr_hash_t *responders;    /* md_ocsp_responder_t* by url */
+    apr_array_header_t *responder_list;
+    md_ocsp_stats_t stats;     /* handshake lookups in this process */
+    const char *lease_holder;  /* name in leases on updates of a shared store */
+    apr_interval_time_t lease_ttl; /* duration of such leases, 0 when not shared */
+};
+
+/* An OCSP responder we talk to. The number of parallel requests we send it
+ * adapts to how it copes: it grows by one after a window of successful,
+ * timely requests and is halved on failures. */
+typedef struct md_ocsp_responder_t md_ocsp_responder_t;
+struct md_ocsp_responder_t {
+    const char *url;
+    int limit;                   /* current max of parallel requests */
+    int in_flight;               /* requests currently in progress */
+    int successes;               /* successful requests since the last change of limit */
+    apr_interval_time_t latency; /* smoothed duration of successful requests */
+    apr_array_header_t *todos;   /* updates due in the current renew run */
+    int batch_max;               /* certificates per request, 0 for reg->batch_max */
 };
 
-typedef struct md_ocsp_status_t md_ocsp_status_t; 
 struct md_ocsp_status_t {
     md_data_t id;
     const char *hexid;
     const char *hex_sha256;
     OCSP_CERTID *certid;
     const char *responder_url;
+    md_ocsp_responder_t *responder;
     
     apr_time_t next_run;      /* when the responder shall be asked again */
+    int heap_idx;             /* position in reg->schedule or -1 */
+    int ref_idx;              /* position in reg->ostats */
+    char etag[128];           /* ETag of the last response from the responder via GET */
+    char last_modified[64];   /* Last-Modified of the last response via GET */
     int errors;               /* consecutive failed attempts */
 
-    md_ocsp_cert_stat_t resp_stat;
-    md_data_t resp_der;
-    md_timeperiod_t resp_valid;
+    /* The current response, immutable once published. Readers acquire
+     * it without locking, writers replace it while holding reg->mutex. */
+    md_ocsp_resp_t * volatile resp;
+    volatile apr_uint32_t acquiring; /* readers between loading resp and taking a ref */
     
-    md_data_t req_der;
-    OCSP_REQUEST *ocsp_req;
+    const char *batch_key;    /* responder and issuer, certs with same key can share requests */
     md_ocsp_reg_t *reg;
 
     const char *md_name;
@@ -89,6 +172,11 @@ struct md_ocsp_status_t {
     
     apr_time_t resp_mtime;
     apr_time_t resp_last_check;
+    
+    md_ocsp_shm_slot_t *slot; /* our slot in the shared table or NULL */
+    apr_uint32_t md_hash;     /* hash of md_name, as set in our slot */
+    apr_uint32_t slot_gen;    /* generation of the slot last seen */
+    int slot_has_resp;        /* != 0 iff the last slot generation carried a response */
 };
 
 const char *md_ocsp_cert_stat_name(md_ocsp_cert_stat_t stat)
@@ -120,17 +208,163 @@ static apr_status_t init_cert_id(md_data_t *data, const md_cert_t *cert)
     return APR_SUCCESS;
 }
 
-static void ostat_req_cleanup(md_ocsp_status_t *ostat)
+/* The certificates mod_ssl hands us live as long as its SSL_CTX. We remember 
+ * their status instance in the X509 ex_data, so that handshakes do not need to 
+ * digest the certificate and look it up again.
+ * The ex_data is no pointer, but the generation of the registry and the position
+ * of the status in reg->ostats, so that OpenSSL has nothing to free and no callback
+ * into this module, which may be unloaded before the certificate is gone. The index
+ * and the generation counter are kept in the root pool, they outlive a reload of
+ * the module. */
+typedef struct {
+    int idx;                   /* the X509 ex_data index, -1 if none */
+    apr_uint32_t gen;          /* the last registry generation handed out */
+} md_ocsp_x509_refs_t;
+
+#define MD_OCSP_X509_REFS_KEY   "md_ocsp_x509_refs"
+#define MD_OCSP_REF_SHIFT       (sizeof(apr_uintptr_t) * 4)
+#define MD_OCSP_REF_MASK        ((((apr_uintptr_t)1) << MD_OCSP_REF_SHIFT) - 1)
+
+static md_ocsp_x509_refs_t *x509_refs;
+
+static md_ocsp_x509_refs_t *x509_refs_get(apr_pool_t *p)
+{
+    apr_pool_t *root, *parent;
+    void *data = NULL;
+    
+    if (!x509_refs) {
+        for (root = p; (parent = apr_pool_parent_get(root)); root = parent);
+        apr_pool_userdata_get(&data, MD_OCSP_X509_REFS_KEY, root);
+        if (!data) {
+            data = apr_pcalloc(root, sizeof(md_ocsp_x509_refs_t));
+            ((md_ocsp_x509_refs_t*)data)->idx = X509_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+            apr_pool_userdata_set(data, MD_OCSP_X509_REFS_KEY, apr_pool_cleanup_null, root);
+        }
+        x509_refs = data;
+    }
+    return x509_refs;
+}
+
+static void *x509_ref_make(md_ocsp_status_t *ostat)
+{
+    return (void*)(((((apr_uintptr_t)ostat->reg->gen) & MD_OCSP_REF_MASK) << MD_OCSP_REF_SHIFT)
+                   | (((apr_uintptr_t)ostat->ref_idx + 1) & MD_OCSP_REF_MASK));
+}
+
+static void ostat_attach(md_ocsp_status_t *ostat, const md_cert_t *cert)
+{
+    /* Called during post_config. no mutex protection needed */
+    if (!x509_refs || x509_refs->idx < 0) return;
+    /* beyond what the ref can hold, handshakes compute the id instead */
+    if ((apr_uintptr_t)ostat->ref_idx >= MD_OCSP_REF_MASK) return;
+    X509_set_ex_data(md_cert_get_X509(cert), x509_refs->idx, x509_ref_make(ostat));
+}
+
+static apr_status_t ostat_find(md_ocsp_status_t **postat, md_ocsp_reg_t *reg, 
+                               const md_cert_t *cert)
+{
+    char iddata[MD_OCSP_ID_LENGTH];
+    apr_uintptr_t ref;
+    md_data_t id;
+    apr_status_t rv;
+    int i;
+    
+    if (x509_refs && x509_refs->idx >= 0) {
+        ref = (apr_uintptr_t)X509_get_ex_data(md_cert_get_X509(cert), x509_refs->idx);
+        i = (int)(ref & MD_OCSP_REF_MASK) - 1;
+        if ((ref >> MD_OCSP_REF_SHIFT) == (((apr_uintptr_t)reg->gen) & MD_OCSP_REF_MASK)
+            && i >= 0 && i < reg->ostats->nelts) {
+            *postat = APR_ARRAY_IDX(reg->ostats, i, md_ocsp_status_t*);
+            return APR_SUCCESS;
+        }
+    }
+    /* not a certificate we primed, compute its id */
+    *postat = NULL;
+    id.data = iddata; id.len = sizeof(iddata);
+    rv = init_cert_id(&id, cert);
+    if (APR_SUCCESS != rv) goto leave;
+    
+    *postat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
+    if (!*postat) rv = APR_ENOENT;
+leave:
+    return rv;
+}
+
+static md_ocsp_resp_t *resp_create(md_ocsp_cert_stat_t stat, const md_data_t *der, 
+                                   const md_timeperiod_t *valid)
+{
+    md_ocsp_resp_t *resp;
+    
+    resp = OPENSSL_malloc(sizeof(*resp) + der->len);
+    if (!resp) return NULL;
+    memset(resp, 0, sizeof(*resp));
+    resp->refs = 1;
+    resp->stat = stat;
+    resp->valid = *valid;
+    if (der->len) {
+        memcpy((char*)(resp + 1), der->data, der->len);
+        resp->der.data = (const char*)(resp + 1);
+        resp->der.len = der->len;
+    }
+    return resp;
+}
+
+static md_ocsp_resp_t *resp_acquire(md_ocsp_status_t *ostat)
+{
+    md_ocsp_resp_t *resp;
+    
+    /* ostat->acquiring keeps a response that is replaced meanwhile from being freed 
+     * before its refs counts this reader, see resp_sweep() */
+    apr_atomic_inc32(&ostat->acquiring);
+    resp = apr_atomic_casptr((volatile void**)&ostat->resp, NULL, NULL);
+    if (resp) apr_atomic_inc32(&resp->refs);
+    apr_atomic_dec32(&ostat->acquiring);
+    return resp;
+}
+
+static void resp_release(md_ocsp_resp_t *resp)
+{
+    /* Never the last reference, a retired response is freed in resp_sweep() */
+    apr_atomic_dec32(&resp->refs);
+}
+
+static void resp_sweep(md_ocsp_reg_t *reg, int all)
 {
-    if (ostat->ocsp_req) {
-        OCSP_REQUEST_free(ostat->ocsp_req);
-        ostat->ocsp_req = NULL;
+    md_ocsp_resp_t *resp, **presp;
+    
+    /* called with reg->mutex held or when the registry goes away */
+    presp = &reg->retired;
+    while (*presp) {
+        resp = *presp;
+        /* A reader that loaded the pointer before it was replaced counts in
+         * ostat->acquiring until it has taken its ref. Once that is seen at 0
+         * after the replace, refs of the retired response only go down. */
+        if (!all && !resp->quiet && !apr_atomic_read32(&resp->ostat->acquiring)) {
+            resp->quiet = 1;
+        }
+        if (all || (resp->quiet && !apr_atomic_read32(&resp->refs))) {
+            *presp = resp->next;
+            OPENSSL_free(resp);
+        }
+        else {
+            presp = &resp->next;
+        }
     }
-    if (ostat->req_der.data) {
-        OPENSSL_free((void*)ostat->req_der.data);
-        ostat->req_der.data = NULL;
-        ostat->req_der.len = 0;
+}
+
+static void ostat_resp_replace(md_ocsp_status_t *ostat, md_ocsp_resp_t *nresp)
+{
+    md_ocsp_resp_t *oresp;
+    
+    /* called with reg->mutex held */
+    oresp = apr_atomic_xchgptr((volatile void**)&ostat->resp, nresp);
+    if (oresp) {
+        oresp->ostat = ostat;
+        oresp->next = ostat->reg->retired;
+        ostat->reg->retired = oresp;
+        apr_atomic_dec32(&oresp->refs);
     }
+    resp_sweep(ostat->reg, 0);
 }
 
 static int ostat_cleanup(void *ctx, const void *key, apr_ssize_t klen, const void *val)
@@ -141,62 +375,214 @@ static int ostat_cleanup(void *ctx, const void *key, apr_ssize_t klen, const voi
     (void)reg;
     (void)key;
     (void)klen;
-    ostat_req_cleanup(ostat);
     if (ostat->certid) {
         OCSP_CERTID_free(ostat->certid);
         ostat->certid = NULL;
     }
-    if (ostat->resp_der.data) {
-        OPENSSL_free((void*)ostat->resp_der.data);
-        ostat->resp_der.data = NULL;
-        ostat->resp_der.len = 0;
+    if (ostat->resp) {
+        OPENSSL_free(ostat->resp);
+        ostat->resp = NULL;
     }
     return 1;
 }
 
-static int ostat_should_renew(md_ocsp_status_t *ostat) 
+static int resp_should_renew(const md_ocsp_resp_t *resp, md_ocsp_reg_t *reg) 
 {
     md_timeperiod_t renewal;
     
-    renewal = md_timeperiod_slice_before_end(&ostat->resp_valid, &ostat->reg->renew_window);
+    renewal = md_timeperiod_slice_before_end(&resp->valid, &reg->renew_window);
     return md_timeperiod_has_started(&renewal, apr_time_now());
 }  
 
-static apr_status_t ostat_set(md_ocsp_status_t *ostat, md_ocsp_cert_stat_t stat,
-                              md_data_t *der, md_timeperiod_t *valid, apr_time_t mtime)
+/**************************************************************************************************/
+/* schedule of updates, a min-heap on next_run */
+
+#define SCHED_AT(reg, i)    APR_ARRAY_IDX((reg)->schedule, (i), md_ocsp_status_t*)
+
+static void sched_swap(md_ocsp_reg_t *reg, int i, int j)
 {
-    apr_status_t rv = APR_SUCCESS;
-    char *s = (char*)der->data;
+    md_ocsp_status_t *ostat = SCHED_AT(reg, i);
     
-    if (der->len) {
-        s = OPENSSL_malloc(der->len);
-        if (!s) {
-            rv = APR_ENOMEM;
-            goto leave;
-        }
-        memcpy((char*)s, der->data, der->len);
+    SCHED_AT(reg, i) = SCHED_AT(reg, j);
+    SCHED_AT(reg, i)->heap_idx = i;
+    SCHED_AT(reg, j) = ostat;
+    ostat->heap_idx = j;
+}
+
+static void sched_up(md_ocsp_reg_t *reg, int i)
+{
+    int parent;
+    
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (SCHED_AT(reg, parent)->next_run <= SCHED_AT(reg, i)->next_run) break;
+        sched_swap(reg, i, parent);
+        i = parent;
     }
- 
-    if (ostat->resp_der.data) {
-        OPENSSL_free((void*)ostat->resp_der.data);
-        ostat->resp_der.data = NULL;
-        ostat->resp_der.len = 0;
+}
+
+static void sched_down(md_ocsp_reg_t *reg, int i)
+{
+    int child, n = reg->schedule->nelts;
+    
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && SCHED_AT(reg, child + 1)->next_run < SCHED_AT(reg, child)->next_run) {
+            ++child;
+        }
+        if (SCHED_AT(reg, i)->next_run <= SCHED_AT(reg, child)->next_run) break;
+        sched_swap(reg, i, child);
+        i = child;
     }
+}
+
+static void sched_add(md_ocsp_reg_t *reg, md_ocsp_status_t *ostat)
+{
+    ostat->heap_idx = reg->schedule->nelts;
+    APR_ARRAY_PUSH(reg->schedule, md_ocsp_status_t*) = ostat;
+    sched_up(reg, ostat->heap_idx);
+}
+
+static void ostat_schedule(md_ocsp_status_t *ostat, apr_time_t next_run)
+{
+    apr_time_t old_run = ostat->next_run;
+    
+    /* called with reg->mutex held or during post_config */
+    ostat->next_run = next_run;
+    if (ostat->heap_idx < 0) return;
+    if (next_run < old_run) sched_up(ostat->reg, ostat->heap_idx);
+    else sched_down(ostat->reg, ostat->heap_idx);
+}
+
+static apr_time_t ostat_renew_at(md_ocsp_status_t *ostat, const md_timeperiod_t *valid)
+{
+    md_timeperiod_t renewal;
+    apr_interval_time_t spread;
+    apr_uint32_t r = 0;
     
-    ostat->resp_stat = stat;
-    ostat->resp_der.data = s;
-    ostat->resp_der.len = der->len;
-    ostat->resp_valid = *valid;
+    renewal = md_timeperiod_slice_before_end(valid, &ostat->reg->renew_window);
+    /* Spread over the first half of the renewal window, the other half is
+     * left for retries should the responder have problems. */
+    spread = md_timeperiod_length(&renewal) / 2;
+    if (spread <= 0) return renewal.start;
+    switch (ostat->reg->renew_spread) {
+        case MD_OCSP_SPREAD_RANDOM:
+            md_rand_bytes((unsigned char*)&r, sizeof(r), ostat->reg->p);
+            break;
+        case MD_OCSP_SPREAD_EVEN:
+            /* the cert id is a SHA1 hash, its bytes are evenly distributed */
+            memcpy(&r, ostat->id.data, sizeof(r));
+            break;
+        default:
+            return renewal.start;
+    }
+    return renewal.start + (apr_time_t)((double)spread * ((double)r / 4294967296.0));
+}
+
+static void ostat_set_resp(md_ocsp_status_t *ostat, md_ocsp_resp_t *resp, apr_time_t mtime)
+{
+    /* called with reg->mutex held */
+    ostat_resp_replace(ostat, resp);
     ostat->resp_mtime = mtime;
     
     ostat->errors = 0;
-    ostat->next_run = md_timeperiod_slice_before_end(
-        &ostat->resp_valid, &ostat->reg->renew_window).start;
+    ostat_schedule(ostat, ostat_renew_at(ostat, &resp->valid));
+}
+
+static apr_status_t ostat_set(md_ocsp_status_t *ostat, md_ocsp_cert_stat_t stat,
+                              md_data_t *der, md_timeperiod_t *valid, apr_time_t mtime)
+{
+    md_ocsp_resp_t *resp;
+    apr_status_t rv = APR_SUCCESS;
+    
+    /* called with reg->mutex held */
+    resp = resp_create(stat, der, valid);
+    if (!resp) {
+        rv = APR_ENOMEM;
+        goto leave;
+    }
+    ostat_set_resp(ostat, resp, mtime);
     
 leave:
     return rv;
 }
 
+static apr_uint32_t ostat_name_hash(const char *name)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    
+    return name? (apr_uint32_t)apr_hashfunc_default(name, &len) : 0;
+}
+
+static void ostat_shm_publish(md_ocsp_status_t *ostat, const md_ocsp_resp_t *resp, 
+                              apr_time_t mtime)
+{
+    md_ocsp_shm_slot_t *slot = ostat->slot;
+    apr_uint32_t gen;
+    
+    /* called with reg->mutex held in the watchdog or in the parent during post_config */
+    if (!slot) return;
+    gen = apr_atomic_read32(&slot->gen);
+    apr_atomic_set32(&slot->gen, gen + 1);
+    slot->stat = (apr_uint32_t)resp->stat;
+    slot->mtime = mtime;
+    slot->valid = resp->valid;
+    if (resp->der.len > 0 && resp->der.len <= MD_OCSP_SHM_DER_MAX) {
+        memcpy((char*)(slot + 1), resp->der.data, resp->der.len);
+        slot->der_len = (apr_uint32_t)resp->der.len;
+    }
+    else {
+        slot->der_len = 0;
+    }
+    apr_atomic_set32(&slot->gen, gen + 2);
+    ostat->slot_gen = gen + 2;
+    ostat->slot_has_resp = (slot->der_len > 0);
+}
+
+static void ostat_shm_import(md_ocsp_status_t *ostat)
+{
+    md_ocsp_shm_slot_t *slot = ostat->slot;
+    md_ocsp_resp_t *resp;
+    md_timeperiod_t valid;
+    md_data_t der;
+    apr_time_t mtime;
+    apr_uint32_t gen, stat;
+    int i;
+    
+    /* called with reg->mutex held. Copy the slot and check that the watchdog
+     * did not change it in the meantime, retry otherwise. */
+    for (i = 0; i < 100; ++i) {
+        gen = apr_atomic_read32(&slot->gen);
+        if (gen == ostat->slot_gen) return;
+        if (gen & 1) continue;
+        if (slot->md_hash != ostat->md_hash 
+            || memcmp(slot->id, ostat->id.data, MD_OCSP_ID_LENGTH)) {
+            /* not our slot, never use its response. Fall back to the store. */
+            ostat->slot_gen = gen;
+            ostat->slot_has_resp = 0;
+            return;
+        }
+        
+        stat = slot->stat;
+        mtime = slot->mtime;
+        valid = slot->valid;
+        der.data = (const char*)(slot + 1);
+        der.len = slot->der_len;
+        if (der.len > MD_OCSP_SHM_DER_MAX) continue;
+        resp = der.len? resp_create((md_ocsp_cert_stat_t)stat, &der, &valid) : NULL;
+        if (der.len && !resp) return;
+        if (apr_atomic_cas32(&slot->gen, 0, 0) != gen) {
+            if (resp) OPENSSL_free(resp);
+            continue;
+        }
+        
+        ostat->slot_gen = gen;
+        ostat->slot_has_resp = (resp != NULL);
+        /* without a response, we fall back to the store as before */
+        if (resp) ostat_set_resp(ostat, resp, mtime);
+        return;
+    }
+}
+
 static apr_status_t ostat_from_json(md_ocsp_cert_stat_t *pstat, 
                                     md_data_t *resp_der, md_timeperiod_t *resp_valid, 
                                     md_json_t *json, apr_pool_t *p)
@@ -260,19 +646,25 @@ leave:
 
 static apr_status_t ocsp_status_save(md_ocsp_cert_stat_t stat, const md_data_t *resp_der, 
                                      const md_timeperiod_t *resp_valid,
-                                     md_ocsp_status_t *ostat, apr_pool_t *ptemp)
+                                     md_ocsp_status_t *ostat, apr_time_t *pmtime,
+                                     apr_pool_t *ptemp)
 {
     md_store_t *store = ostat->reg->store;
     md_json_t *jprops;
-    apr_time_t mtime;
     apr_status_t rv;
     
+    /* called without reg->mutex, only reads the immutable names of ostat */
+    *pmtime = 0;
     jprops = md_json_create(ptemp);
     ostat_to_json(jprops, stat, resp_der, resp_valid, ptemp);
     rv = md_store_save_json(store, ptemp, MD_SG_OCSP, ostat->md_name, ostat->file_name, jprops, 0);
     if (APR_SUCCESS != rv) goto leave;
-    mtime = md_store_get_modified(store, MD_SG_OCSP, ostat->md_name, ostat->file_name, ptemp);
-    if (mtime) ostat->resp_mtime = mtime;
+    if (!ostat->resp_mtime) {
+        /* first one we store, let the cleanup know about it. An unlocked
+         * peek, a stale value only journals the file again. */
+        md_store_journal_add(store, ptemp, MD_SG_OCSP, ostat->md_name, ostat->file_name);
+    }
+    *pmtime = md_store_get_modified(store, MD_SG_OCSP, ostat->md_name, ostat->file_name, ptemp);
 leave:
     return rv;
 }
@@ -283,6 +675,7 @@ static apr_status_t ocsp_reg_cleanup(void *data)
     
     /* free all OpenSSL structures that we hold */
     apr_hash_do(ostat_cleanup, reg, reg->hash);
+    resp_sweep(reg, 1);
     return APR_SUCCESS;
 }
 
@@ -304,6 +697,21 @@ apr_status_t md_ocsp_reg_make(md_ocsp_reg_t **preg, apr_pool_t *p, md_store_t *s
     reg->proxy_url = proxy_url;
     reg->hash = apr_hash_make(p);
     reg->renew_window = *renew_window;
+    reg->retired = NULL;
+    reg->shm = NULL;
+    reg->gen = ++x509_refs_get(p)->gen;
+    reg->batch_max = 1;
+    reg->renew_spread = MD_OCSP_SPREAD_NONE;
+    reg->use_get = 0;
+    reg->lease_holder = NULL;
+    reg->lease_ttl = 0;
+    memset(&reg->stats, 0, sizeof(reg->stats));
+    reg->max_parallel = MD_OCSP_PARALLEL_DEF;
+    reg->max_parallel_responder = MD_OCSP_PARALLEL_RESPONDER_DEF;
+    reg->responders = apr_hash_make(p);
+    reg->schedule = apr_array_make(p, 100, sizeof(md_ocsp_status_t*));
+    reg->responder_list = apr_array_make(p, 5, sizeof(md_ocsp_responder_t*));
+    reg->ostats = apr_array_make(p, 100, sizeof(md_ocsp_status_t*));
     
     rv = apr_thread_mutex_create(&reg->mutex, APR_THREAD_MUTEX_NESTED, p);
     if (APR_SUCCESS != rv) goto leave;
@@ -314,6 +722,21 @@ leave:
     return rv;
 }
 
+static md_ocsp_responder_t *responder_get(md_ocsp_reg_t *reg, const char *url)
+{
+    md_ocsp_responder_t *responder;
+    
+    responder = apr_hash_get(reg->responders, url, APR_HASH_KEY_STRING);
+    if (!responder) {
+        responder = apr_pcalloc(reg->p, sizeof(*responder));
+        responder->url = url;
+        responder->limit = reg->max_parallel_responder;
+        apr_hash_set(reg->responders, url, APR_HASH_KEY_STRING, responder);
+        APR_ARRAY_PUSH(reg->responder_list, md_ocsp_responder_t*) = responder;
+    }
+    return responder;
+}
+
 apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issuer, const md_t *md)
 {
     char iddata[MD_OCSP_ID_LENGTH];
@@ -333,11 +756,16 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
     if (APR_SUCCESS != rv) goto leave;
     
     ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
-    if (ostat) goto leave; /* already seen it, cert is used in >1 server_rec */
+    if (ostat) {
+        /* already seen it, cert is used in >1 server_rec */
+        ostat_attach(ostat, cert);
+        goto leave; 
+    }
     
     ostat = apr_pcalloc(reg->p, sizeof(*ostat));
     md_data_assign_pcopy(&ostat->id, &id, reg->p);
     ostat->reg = reg;
+    ostat->heap_idx = -1;
     ostat->md_name = name;
     md_data_to_hex(&ostat->hexid, 0, reg->p, &ostat->id);
     ostat->file_name = apr_psprintf(reg->p, "ocsp-%s.json", ostat->hexid);
@@ -358,6 +786,7 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: ocsp responder found '%s'", name, s);
     ostat->responder_url = apr_pstrdup(reg->p, s);
+    ostat->responder = responder_get(reg, ostat->responder_url);
     X509_email_free(ssk);
 
     ostat->certid = OCSP_cert_to_id(NULL, md_cert_get_X509(cert), md_cert_get_X509(issuer));
@@ -368,6 +797,9 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
                       name, md_cert_get_serial_number(cert, reg->p));
         goto leave;
     }
+    rv = md_cert_to_sha256_fingerprint(&s, issuer, reg->p); 
+    if (APR_SUCCESS != rv) goto leave;
+    ostat->batch_key = apr_pstrcat(reg->p, ostat->responder_url, " ", s, NULL);
     
     /* See, if we have something in store */
     ocsp_status_refresh(ostat, reg->p);
@@ -375,130 +807,203 @@ apr_status_t md_ocsp_prime(md_ocsp_reg_t *reg, md_cert_t *cert, md_cert_t *issue
                   "md[%s]: adding ocsp info (responder=%s)", 
                   name, ostat->responder_url);
     apr_hash_set(reg->hash, ostat->id.data, (apr_ssize_t)ostat->id.len, ostat);
+    sched_add(reg, ostat);
+    ostat->ref_idx = reg->ostats->nelts;
+    APR_ARRAY_PUSH(reg->ostats, md_ocsp_status_t*) = ostat;
+    ostat_attach(ostat, cert);
     rv = APR_SUCCESS;
 leave:
     return rv;
 }
 
-apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
+static void stats_count(volatile apr_uint32_t *hist, apr_interval_time_t usecs)
+{
+    int i = 0;
+    
+    while (i < MD_OCSP_HIST_BUCKETS - 1 && usecs >= ((apr_interval_time_t)1 << i)) ++i;
+    apr_atomic_inc32(&hist[i]);
+}
+
+static void reg_lock(md_ocsp_reg_t *reg, md_ocsp_stats_t *stats)
+{
+    apr_time_t start;
+    
+    if (!stats) {
+        apr_thread_mutex_lock(reg->mutex);
+    }
+    else if (APR_SUCCESS != apr_thread_mutex_trylock(reg->mutex)) {
+        start = apr_time_now();
+        apr_thread_mutex_lock(reg->mutex);
+        apr_atomic_inc32(&stats->lock_waits);
+        stats_count(stats->lock_wait, apr_time_now() - start);
+    }
+}
+
+static md_ocsp_resp_t *ostat_get_resp(md_ocsp_status_t *ostat, apr_pool_t *p, 
+                                      md_ocsp_stats_t *stats)
+{
+    md_ocsp_resp_t *resp;
+    
+    if (ostat->slot && apr_atomic_read32(&ostat->slot->gen) != ostat->slot_gen) {
+        /* The watchdog published something new in the shared table */
+        reg_lock(ostat->reg, stats);
+        ostat_shm_import(ostat);
+        apr_thread_mutex_unlock(ostat->reg->mutex);
+    }
+    resp = resp_acquire(ostat);
+    if ((!resp || resp->der.len <= 0) && !ostat->slot_has_resp) {
+        /* No response known, check the store if our watchdog retrieved one 
+         * in the meantime. Only this needs the lock. */
+        if (resp) resp_release(resp);
+        reg_lock(ostat->reg, stats);
+        if (stats) apr_atomic_inc32(&stats->store_reads);
+        ocsp_status_refresh(ostat, p);
+        apr_thread_mutex_unlock(ostat->reg->mutex);
+        resp = resp_acquire(ostat);
+    }
+    return resp;
+}
+
+apr_status_t md_ocsp_staple_get(md_ocsp_staple_t **pstaple, 
+                                const unsigned char **pder, int *pderlen,
                                 md_ocsp_reg_t *reg, const md_cert_t *cert,
                                 apr_pool_t *p, const md_t *md)
 {
-    char iddata[MD_OCSP_ID_LENGTH];
     md_ocsp_status_t *ostat;
+    md_ocsp_resp_t *resp = NULL;
     const char *name;
+    apr_time_t start = apr_time_now();
     apr_status_t rv;
-    int locked = 0;
-    md_data_t id;
     
-    (void)p;
-    (void)md;
-    id.data = iddata; id.len = sizeof(iddata);
+    *pstaple = NULL;
     *pder = NULL;
     *pderlen = 0;
     name = md? md->name : MD_OTHER;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: OCSP, get_status", name);
-    rv = init_cert_id(&id, cert);
-    if (APR_SUCCESS != rv) goto leave;
+    rv = ostat_find(&ostat, reg, cert);
+    if (APR_SUCCESS != rv) return rv;
+    apr_atomic_inc32(&reg->stats.calls);
     
-    ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
-    if (!ostat) {
-        rv = APR_ENOENT;
+    /* While the ostat instance itself always exists, the response it holds
+     * may be replaced at any time. We hold a reference on the one we got. */
+    resp = ostat_get_resp(ostat, p, &reg->stats);
+    if (!resp || resp->der.len <= 0) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
+                      "md[%s]: OCSP, no response available", name);
+        apr_atomic_inc32(&reg->stats.misses);
         goto leave;
     }
-    
-    /* While the ostat instance itself always exists, the response data it holds
-     * may vary over time and we need locked access to make a copy. */
-    apr_thread_mutex_lock(reg->mutex);
-    locked = 1;
-    
-    if (ostat->resp_der.len <= 0) {
-        /* No response known, check store for new response. */
-        ocsp_status_refresh(ostat, p);
-        if (ostat->resp_der.len <= 0) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
-                          "md[%s]: OCSP, no response available", name);
-            goto leave;
-        }
-    }
     /* We have a response */
-    if (ostat_should_renew(ostat)) {
+    if (!ostat->slot_has_resp && resp_should_renew(resp, reg)) {
         /* But it is up for renewal. A watchdog should be busy with
          * retrieving a new one. In case of outages, this might take
          * a while, however. Pace the frequency of checks with the
          * urgency of a new response based on the remaining time. */
-        long secs = (long)apr_time_sec(md_timeperiod_remaining(&ostat->resp_valid, apr_time_now()));
+        long secs = (long)apr_time_sec(md_timeperiod_remaining(&resp->valid, apr_time_now()));
         apr_time_t waiting_time; 
         
         /* every hour, every minute, every second */
         waiting_time = ((secs >= MD_SECS_PER_DAY)?
                         apr_time_from_sec(60 * 60) : ((secs >= 60)? 
                         apr_time_from_sec(60) : apr_time_from_sec(1)));
+        /* unlocked peek, a stale value only leads to an extra check */
         if ((apr_time_now() - ostat->resp_last_check) >= waiting_time) {
-            ostat->resp_last_check = apr_time_now();
-            ocsp_status_refresh(ostat, p);
+            reg_lock(reg, &reg->stats);
+            if ((apr_time_now() - ostat->resp_last_check) >= waiting_time) {
+                ostat->resp_last_check = apr_time_now();
+                apr_atomic_inc32(&reg->stats.store_reads);
+                if (APR_SUCCESS == ocsp_status_refresh(ostat, p)) {
+                    resp_release(resp);
+                    resp = resp_acquire(ostat);
+                }
+            }
+            apr_thread_mutex_unlock(reg->mutex);
         }
     }
     
-    *pder = OPENSSL_malloc(ostat->resp_der.len);
+    *pder = (const unsigned char*)resp->der.data;
+    *pderlen = (int)resp->der.len;
+    *pstaple = resp;
+    resp = NULL;
+    apr_atomic_inc32(&reg->stats.hits);
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
+                  "md[%s]: OCSP, returning %d bytes of response", name, *pderlen);
+leave:
+    if (resp) resp_release(resp);
+    stats_count(reg->stats.latency, apr_time_now() - start);
+    return rv;
+}
+
+void md_ocsp_staple_release(md_ocsp_staple_t *staple)
+{
+    if (staple) resp_release(staple);
+}
+
+apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
+                                md_ocsp_reg_t *reg, const md_cert_t *cert,
+                                apr_pool_t *p, const md_t *md)
+{
+    md_ocsp_staple_t *staple;
+    const unsigned char *der;
+    int derlen;
+    apr_status_t rv;
+    
+    *pder = NULL;
+    *pderlen = 0;
+    rv = md_ocsp_staple_get(&staple, &der, &derlen, reg, cert, p, md);
+    if (APR_SUCCESS != rv || !staple) goto leave;
+    
+    *pder = OPENSSL_malloc((size_t)derlen);
     if (*pder == NULL) {
         rv = APR_ENOMEM;
         goto leave;
     }
-    memcpy(*pder, ostat->resp_der.data, ostat->resp_der.len);
-    *pderlen = (int)ostat->resp_der.len;
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
-                  "md[%s]: OCSP, returning %ld bytes of response", 
-                  name, (long)ostat->resp_der.len);
+    memcpy(*pder, der, (size_t)derlen);
+    *pderlen = derlen;
 leave:
-    if (locked) apr_thread_mutex_unlock(reg->mutex);
+    md_ocsp_staple_release(staple);
     return rv;
 }
 
 static void ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid, 
                           md_ocsp_reg_t *reg, md_ocsp_status_t *ostat, apr_pool_t *p)
 {
-    apr_thread_mutex_lock(reg->mutex);
-    if (ostat->resp_der.len <= 0) {
-        /* No resonse known, check the store if out watchdog retrieved one 
-         * in the meantime. */
-        ocsp_status_refresh(ostat, p);
+    md_ocsp_resp_t *resp;
+    
+    (void)reg;
+    resp = ostat_get_resp(ostat, p, NULL);
+    if (resp) {
+        *pvalid = resp->valid;
+        *pstat = resp->stat;
+        resp_release(resp);
+    }
+    else {
+        memset(pvalid, 0, sizeof(*pvalid));
+        *pstat = MD_OCSP_CERT_ST_UNKNOWN;
     }
-    *pvalid = ostat->resp_valid;
-    *pstat = ostat->resp_stat;
-    apr_thread_mutex_unlock(reg->mutex);
 }
 
 apr_status_t md_ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid,
                               md_ocsp_reg_t *reg, const md_cert_t *cert,
                               apr_pool_t *p, const md_t *md)
 {
-    char iddata[MD_OCSP_ID_LENGTH];
     md_ocsp_status_t *ostat;
     const char *name;
     apr_status_t rv;
     md_timeperiod_t valid;
     md_ocsp_cert_stat_t stat;
-    md_data_t id;
     
     (void)p;
     (void)md;
-    id.data = iddata; id.len = sizeof(iddata);
     name = md? md->name : MD_OTHER;
     memset(&valid, 0, sizeof(valid));
     stat = MD_OCSP_CERT_ST_UNKNOWN;
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, reg->p, 
                   "md[%s]: OCSP, get_status", name);
     
-    rv = init_cert_id(&id, cert);
+    rv = ostat_find(&ostat, reg, cert);
     if (APR_SUCCESS != rv) goto leave;
-    
-    ostat = apr_hash_get(reg->hash, id.data, (apr_ssize_t)id.len);
-    if (!ostat) {
-        rv = APR_ENOENT;
-        goto leave;
-    }
     ocsp_get_meta(&stat, &valid, reg, ostat, p);
 leave:
     *pstat = stat;
@@ -511,6 +1016,49 @@ apr_size_t md_ocsp_count(md_ocsp_reg_t *reg)
     return apr_hash_count(reg->hash);
 }
 
+apr_status_t md_ocsp_use_shm(md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    md_ocsp_status_t *ostat;
+    apr_hash_index_t *hi;
+    apr_size_t i, n;
+    char *base;
+    void *val;
+    apr_status_t rv = APR_SUCCESS;
+    
+    /* Called during post_config, after all certificates have been primed. no mutex 
+     * protection needed. The anonymous segment is inherited by all children. */
+    n = apr_hash_count(reg->hash);
+    if (!n || reg->shm) goto leave;
+    
+    reg->shm_slot_size = APR_ALIGN_DEFAULT(sizeof(md_ocsp_shm_slot_t) + MD_OCSP_SHM_DER_MAX);
+    rv = apr_shm_create(&reg->shm, n * reg->shm_slot_size, NULL, p);
+    if (APR_SUCCESS != rv) {
+        reg->shm = NULL;
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "OCSP, unable to create shared memory for %d responses", (int)n);
+        goto leave;
+    }
+    base = apr_shm_baseaddr_get(reg->shm);
+    memset(base, 0, n * reg->shm_slot_size);
+    
+    for (i = 0, hi = apr_hash_first(p, reg->hash); hi; hi = apr_hash_next(hi), ++i) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        ostat = val;
+        ostat->slot = (md_ocsp_shm_slot_t*)(base + i * reg->shm_slot_size);
+        memcpy(ostat->slot->id, ostat->id.data, MD_OCSP_ID_LENGTH);
+        ostat->md_hash = ostat_name_hash(ostat->md_name);
+        ostat->slot->md_hash = ostat->md_hash;
+        ostat->slot_gen = 0;
+        ostat->slot_has_resp = 0;
+        if (ostat->resp) ostat_shm_publish(ostat, ostat->resp, ostat->resp_mtime);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                  "OCSP, sharing %d responses in %ld bytes of shared memory", 
+                  (int)n, (long)(n * reg->shm_slot_size));
+leave:
+    return rv;
+}
+
 static const char *certid_as_hex(const OCSP_CERTID *certid, apr_pool_t *p)
 {
     md_data_t der;
@@ -593,77 +1141,159 @@ typedef struct {
     md_ocsp_status_t *ostat;
     md_result_t *result;
     md_job_t *job;
+    apr_status_t rv;          /* outcome for this certificate in its request */
+    int unchanged;            /* responder had no newer response than ours */
 } md_ocsp_update_t;
 
-static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
+/* One OCSP request to a responder, asking for the status of one or more
+ * certificates from the same issuer. */
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *updates; /* md_ocsp_update_t* */
+    OCSP_REQUEST *ocsp_req;
+    md_data_t req_der;
+    md_ocsp_reg_t *reg;
+    md_ocsp_responder_t *responder;
+    apr_time_t started;
+    int is_get;                  /* an RFC 5019 GET request, without nonce */
+    md_data_t resp_der;          /* response body as it arrives */
+    apr_size_t resp_size;        /* allocated size of resp_der */
+} md_ocsp_batch_t;
+
+/* OCSP responses are small, anything larger is not one we want */
+#define MD_OCSP_RESP_MAX            (64 * 1024)
+
+/* RFC 5019 says GET is to be used for requests less than 255 bytes in total */
+#define MD_OCSP_GET_URL_MAX         255
+/* When a responder has nothing new and gives no max-age, ask again after */
+#define MD_OCSP_UNCHANGED_RETRY     apr_time_from_sec(MD_SECS_PER_HOUR)
+
+static const char *ocsp_get_url(const char *responder_url, const md_data_t *req_der, 
+                                apr_pool_t *p)
 {
-    md_ocsp_update_t *update = baton;
-    md_ocsp_status_t *ostat = update->ostat;
-    md_http_request_t *req = resp->req;
-    OCSP_RESPONSE *ocsp_resp = NULL;
-    OCSP_BASICRESP *basic_resp = NULL;
-    OCSP_SINGLERESP *single_resp;
-    apr_status_t rv = APR_SUCCESS;
-    int n, breason = 0, bstatus;
-    ASN1_GENERALIZEDTIME *bup = NULL, *bnextup = NULL;
-    md_data_t der, new_der;
-    md_timeperiod_t valid;
-    md_ocsp_cert_stat_t nstat;
+    unsigned char *b64;
+    const char *sep;
+    char *url, *d;
+    const unsigned char *s;
+    apr_size_t len;
     
-    der.data = new_der.data = NULL;
-    der.len  = new_der.len = 0;
-
-    md_result_activity_printf(update->result, "status of certid %s, reading response", 
-                              ostat->hexid);
-    if (APR_SUCCESS != (rv = apr_brigade_pflatten(resp->body, (char**)&der.data, 
-                                                  &der.len, req->pool))) {
-        goto leave;
+    /* RFC 5019 2.1.1: the url encoding of the base64 encoding of the DER request */
+    b64 = apr_palloc(p, ((req_der->len + 2) / 3) * 4 + 1);
+    EVP_EncodeBlock(b64, (const unsigned char*)req_der->data, (int)req_der->len);
+    len = strlen(responder_url);
+    sep = (len && responder_url[len-1] == '/')? "" : "/";
+    url = d = apr_palloc(p, len + 1 + 3 * strlen((const char*)b64) + 1);
+    d = apr_cpystrn(d, responder_url, len + 1);
+    d = apr_cpystrn(d, sep, 2);
+    for (s = b64; *s; ++s) {
+        switch (*s) {
+            case '+': memcpy(d, "%2B", 3); d += 3; break;
+            case '/': memcpy(d, "%2F", 3); d += 3; break;
+            case '=': memcpy(d, "%3D", 3); d += 3; break;
+            default: *d++ = (char)*s; break;
+        }
     }
-    if (NULL == (ocsp_resp = d2i_OCSP_RESPONSE(NULL, (const unsigned char**)&der.data, 
-                                               (long)der.len))) {
-        rv = APR_EINVAL;
-        md_result_set(update->result, rv, "response body does not parse as OCSP response");
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
+    *d = '\0';
+    return ((apr_size_t)(d - url) <= MD_OCSP_GET_URL_MAX)? url : NULL;
+}
+
+static apr_interval_time_t resp_max_age(const md_http_response_t *resp)
+{
+    const char *s;
+    apr_int64_t secs;
+    
+    s = apr_table_get(resp->headers, "Cache-Control");
+    if (!s || !(s = strstr(s, "max-age"))) return -1;
+    s += strlen("max-age");
+    while (apr_isspace(*s)) ++s;
+    if (*s++ != '=') return -1;
+    while (apr_isspace(*s)) ++s;
+    secs = apr_atoi64(s);
+    return (secs > 0)? apr_time_from_sec(secs) : -1;
+}
+
+static void copy_header(char *buf, apr_size_t buflen, const md_http_response_t *resp, 
+                        const char *name)
+{
+    const char *s = apr_table_get(resp->headers, name);
+    
+    /* values not fitting our buffer are not remembered */
+    if (s && strlen(s) < buflen) apr_cpystrn(buf, s, buflen);
+    else buf[0] = '\0';
+}
+
+static void ostat_on_unchanged(md_ocsp_update_t *update, apr_interval_time_t max_age)
+{
+    md_ocsp_status_t *ostat = update->ostat;
+    md_ocsp_resp_t *cur;
+    md_timeperiod_t renewal;
+    apr_time_t now = apr_time_now(), limit = 0;
+    
+    /* Nothing new from the responder (or the cache in front of it). Ask again
+     * when max-age has passed, but not in too rapid succession. */
+    if (max_age < 0) max_age = MD_OCSP_UNCHANGED_RETRY;
+    if (max_age > apr_time_from_sec(MD_SECS_PER_DAY)) max_age = apr_time_from_sec(MD_SECS_PER_DAY);
+    /* Never later than the renewal of the response we have, as in ostat_set_resp().
+     * Inside the renew window, ask again before half of the remaining validity is gone. */
+    if ((cur = resp_acquire(ostat))) {
+        renewal = md_timeperiod_slice_before_end(&cur->valid, &ostat->reg->renew_window);
+        limit = renewal.start;
+        if (limit <= now && cur->valid.end > now) limit = now + (cur->valid.end - now) / 2;
+        resp_release(cur);
+        if (limit > now && now + max_age > limit) max_age = limit - now;
     }
-    /* got a response! but what does it say? */
-    n = OCSP_response_status(ocsp_resp);
-    if (OCSP_RESPONSE_STATUS_SUCCESSFUL != n) {
-        rv = APR_EINVAL;
-        md_result_printf(update->result, rv, "OCSP response status is, unsuccessfully, %d", n);
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
+    if (max_age < apr_time_from_sec(60)) max_age = apr_time_from_sec(60);
+    apr_thread_mutex_lock(ostat->reg->mutex);
+    ostat->errors = 0;
+    ostat_schedule(ostat, now + max_age);
+    apr_thread_mutex_unlock(ostat->reg->mutex);
+    update->unchanged = 1;
+    update->rv = APR_SUCCESS;
+    md_result_printf(update->result, APR_SUCCESS, "OCSP response unchanged, checking again in %s",
+                     md_duration_print(update->p, max_age));
+    md_result_log(update->result, MD_LOG_DEBUG);
+}
+
+static apr_status_t batch_cleanup(void *data)
+{
+    md_ocsp_batch_t *batch = data;
+    
+    if (batch->ocsp_req) {
+        OCSP_REQUEST_free(batch->ocsp_req);
+        batch->ocsp_req = NULL;
     }
-    basic_resp = OCSP_response_get1_basic(ocsp_resp);
-    if (!basic_resp) {
-        rv = APR_EINVAL;
-        md_result_set(update->result, rv, "OCSP response has no basicresponse");
-        md_result_log(update->result, MD_LOG_DEBUG);
-        goto leave;
+    if (batch->req_der.data) {
+        OPENSSL_free((void*)batch->req_der.data);
+        batch->req_der.data = NULL;
+        batch->req_der.len = 0;
     }
-    /* The notion of nonce enabled freshness in OCSP responses, e.g. that the response
-     * contains the signed nonce we sent to the responder, does not scale well. Responders
-     * like to return cached response bytes and therefore do not add a nonce to it.
-     * So, in reality, we can only detect a mismatch when present and otherwise have
-     * to accept it. */
-    switch ((n = OCSP_check_nonce(ostat->ocsp_req, basic_resp))) {
-        case 1:
-            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->pool, 
-                          "req[%d]: OCSP respoonse nonce does match", req->id);
-            break;
-        case 0:
-            rv = APR_EINVAL;
-            md_result_printf(update->result, rv, "OCSP nonce mismatch in response", n);
-            md_result_log(update->result, MD_LOG_WARNING);
-            goto leave;
-            
-        case -1:
-            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, 
-                          "req[%d]: OCSP respoonse did not return the nonce", req->id);
-            break;
-        default:
-            break;
+    return APR_SUCCESS;
+}
+
+static void batch_set_result(md_ocsp_batch_t *batch, apr_status_t rv, const char *msg, int level)
+{
+    md_ocsp_update_t *update;
+    int i;
+    
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        update->rv = rv;
+        md_result_set(update->result, rv, msg);
+        md_result_log(update->result, level);
     }
+}
+
+static apr_status_t ostat_on_single_resp(md_ocsp_update_t *update, OCSP_BASICRESP *basic_resp,
+                                         md_data_t *new_der, apr_pool_t *p)
+{
+    md_ocsp_status_t *ostat = update->ostat;
+    OCSP_SINGLERESP *single_resp;
+    apr_status_t rv = APR_SUCCESS;
+    int breason = 0, bstatus;
+    ASN1_GENERALIZEDTIME *bup = NULL, *bnextup = NULL;
+    md_timeperiod_t valid;
+    md_ocsp_cert_stat_t nstat;
+    apr_time_t mtime;
     
     if (!OCSP_resp_find_status(basic_resp, ostat->certid, &bstatus,
                                &breason, NULL, &bup, &bnextup)) {
@@ -671,12 +1301,11 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
         int i;
         
         rv = APR_EINVAL;
-        prefix = apr_psprintf(req->pool, "OCSP response, no matching status reported for  %s",
-                              certid_summary(ostat->certid, req->pool));
+        prefix = apr_psprintf(p, "OCSP response, no matching status reported for  %s",
+                              certid_summary(ostat->certid, p));
         for (i = 0; i < OCSP_resp_count(basic_resp); ++i) {
             single_resp = OCSP_resp_get0(basic_resp, i);
-            slist = apr_psprintf(req->pool, "%s%s%s", slist, sep, 
-                                 single_resp_summary(single_resp, req->pool));
+            slist = apr_psprintf(p, "%s%s%s", slist, sep, single_resp_summary(single_resp, p));
             sep = ", ";
         }
         md_result_printf(update->result, rv, "%s, status list [%s]", prefix, slist);
@@ -698,25 +1327,18 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
     
     /* Coming here, we have a response for our certid and it is either GOOD
      * or REVOKED. Both cases we want to remember and use in stapling. */
-    n = i2d_OCSP_RESPONSE(ocsp_resp, (unsigned char**)&new_der.data);
-    if (n <= 0) {
-        rv = APR_EGENERAL;
-        md_result_set(update->result, rv, "error DER encoding OCSP response");
-        md_result_log(update->result, MD_LOG_WARNING);
-        goto leave;
-    }
     nstat = (bstatus == V_OCSP_CERTSTATUS_GOOD)? MD_OCSP_CERT_ST_GOOD : MD_OCSP_CERT_ST_REVOKED;
-    new_der.len = (apr_size_t)n;
     valid.start = bup? md_asn1_generalized_time_get(bup) : apr_time_now();
     valid.end = md_asn1_generalized_time_get(bnextup);
     
-    /* First, update the instance with a copy */
+    /* First, save the original response, next update the instance with a copy.
+     * Handshakes take the mutex to refresh from the store or the shared table,
+     * so the store write is done before it is locked. */
+    rv = ocsp_status_save(nstat, new_der, &valid, ostat, &mtime, p); 
     apr_thread_mutex_lock(ostat->reg->mutex);
-    ostat_set(ostat, nstat, &new_der, &valid, apr_time_now());
+    ostat_set(ostat, nstat, new_der, &valid, mtime? mtime : apr_time_now());
+    if (ostat->resp) ostat_shm_publish(ostat, ostat->resp, ostat->resp_mtime);
     apr_thread_mutex_unlock(ostat->reg->mutex);
-    
-    /* Next, save the original response */
-    rv = ocsp_status_save(nstat, &new_der, &valid, ostat, req->pool); 
     if (APR_SUCCESS != rv) {
         md_result_set(update->result, rv, "error saving OCSP status");
         md_result_log(update->result, MD_LOG_ERR);
@@ -725,9 +1347,186 @@ static apr_status_t ostat_on_resp(const md_http_response_t *resp, void *baton)
     
     md_result_printf(update->result, rv, "certificate status is %s, status valid %s", 
                      (nstat == MD_OCSP_CERT_ST_GOOD)? "GOOD" : "REVOKED",
-                     md_timeperiod_print(req->pool, &ostat->resp_valid));
+                     md_timeperiod_print(p, &valid));
     md_result_log(update->result, MD_LOG_DEBUG);
 
+leave:
+    update->rv = rv;
+    return rv;
+}
+
+static apr_status_t batch_on_data(const md_http_response_t *resp, const char *data, 
+                                  apr_size_t len, void *baton)
+{
+    md_ocsp_batch_t *batch = baton;
+    const char *s;
+    char *buf;
+    apr_size_t size;
+    
+    if (batch->resp_der.len + len > MD_OCSP_RESP_MAX) return APR_EINVAL;
+    if (batch->resp_der.len + len > batch->resp_size) {
+        /* collect the DER in one buffer, sized by Content-Length when we have it */
+        size = batch->resp_size? batch->resp_size * 2 : 0;
+        if (!size && (s = apr_table_get(resp->headers, "Content-Length"))) {
+            size = (apr_size_t)apr_atoi64(s);
+        }
+        if (size < batch->resp_der.len + len) size = batch->resp_der.len + len;
+        if (size > MD_OCSP_RESP_MAX) size = MD_OCSP_RESP_MAX;
+        buf = apr_palloc(resp->req->pool, size);
+        if (batch->resp_der.len) memcpy(buf, batch->resp_der.data, batch->resp_der.len);
+        batch->resp_der.data = buf;
+        batch->resp_size = size;
+    }
+    memcpy((char*)batch->resp_der.data + batch->resp_der.len, data, len);
+    batch->resp_der.len += len;
+    return APR_SUCCESS;
+}
+
+static apr_status_t batch_on_resp(const md_http_response_t *resp, void *baton)
+{
+    md_ocsp_batch_t *batch = baton;
+    md_ocsp_update_t *update;
+    md_http_request_t *req = resp->req;
+    OCSP_RESPONSE *ocsp_resp = NULL;
+    OCSP_BASICRESP *basic_resp = NULL;
+    apr_status_t rv = APR_SUCCESS;
+    int i, n;
+    md_data_t der, new_der;
+    
+    der.data = new_der.data = NULL;
+    der.len  = new_der.len = 0;
+
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        md_result_activity_printf(update->result, "status of certid %s, reading response", 
+                                  update->ostat->hexid);
+    }
+    if (batch->is_get && 304 == resp->status) {
+        md_ocsp_status_t *ostat = APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*)->ostat;
+        md_ocsp_resp_t *cur = resp_acquire(ostat);
+        
+        if (!cur) {
+            /* we no longer have what the responder thinks we have */
+            ostat->etag[0] = ostat->last_modified[0] = '\0';
+            rv = APR_EINVAL;
+            batch_set_result(batch, rv, "OCSP responder answered 304, but we have no response", 
+                             MD_LOG_DEBUG);
+            goto leave;
+        }
+        resp_release(cur);
+        ostat_on_unchanged(APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*), 
+                           resp_max_age(resp));
+        goto leave;
+    }
+    if (200 != resp->status) {
+        rv = APR_EINVAL;
+        batch_set_result(batch, rv, apr_psprintf(req->pool, 
+                         "OCSP responder answered with HTTP status %d", resp->status), 
+                         MD_LOG_DEBUG);
+        goto leave;
+    }
+    der = batch->resp_der;
+    if (batch->is_get) {
+        md_ocsp_status_t *ostat = APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*)->ostat;
+        md_ocsp_resp_t *cur;
+        int same;
+        
+        copy_header(ostat->etag, sizeof(ostat->etag), resp, "ETag");
+        copy_header(ostat->last_modified, sizeof(ostat->last_modified), resp, "Last-Modified");
+        /* caches happily send us the response we already have */
+        cur = resp_acquire(ostat);
+        same = (cur && cur->der.len == der.len && !memcmp(cur->der.data, der.data, der.len));
+        if (cur) resp_release(cur);
+        if (same) {
+            ostat_on_unchanged(APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*), 
+                               resp_max_age(resp));
+            goto leave;
+        }
+    }
+    if (NULL == (ocsp_resp = d2i_OCSP_RESPONSE(NULL, (const unsigned char**)&der.data, 
+                                               (long)der.len))) {
+        rv = APR_EINVAL;
+        batch_set_result(batch, rv, "response body does not parse as OCSP response", MD_LOG_DEBUG);
+        goto leave;
+    }
+    /* got a response! but what does it say? */
+    n = OCSP_response_status(ocsp_resp);
+    if (OCSP_RESPONSE_STATUS_SUCCESSFUL != n) {
+        rv = APR_EINVAL;
+        batch_set_result(batch, rv, apr_psprintf(req->pool, 
+                         "OCSP response status is, unsuccessfully, %d", n), MD_LOG_DEBUG);
+        goto leave;
+    }
+    basic_resp = OCSP_response_get1_basic(ocsp_resp);
+    if (!basic_resp) {
+        rv = APR_EINVAL;
+        batch_set_result(batch, rv, "OCSP response has no basicresponse", MD_LOG_DEBUG);
+        goto leave;
+    }
+    /* The notion of nonce enabled freshness in OCSP responses, e.g. that the response
+     * contains the signed nonce we sent to the responder, does not scale well. Responders
+     * like to return cached response bytes and therefore do not add a nonce to it.
+     * So, in reality, we can only detect a mismatch when present and otherwise have
+     * to accept it. */
+    switch ((n = OCSP_check_nonce(batch->ocsp_req, basic_resp))) {
+        case 1:
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->pool, 
+                          "req[%d]: OCSP respoonse nonce does match", req->id);
+            break;
+        case 0:
+            rv = APR_EINVAL;
+            batch_set_result(batch, rv, "OCSP nonce mismatch in response", MD_LOG_WARNING);
+            goto leave;
+            
+        case -1:
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, req->pool, 
+                          "req[%d]: OCSP respoonse did not return the nonce", req->id);
+            break;
+        default:
+            break;
+    }
+    
+    /* All certificates in the request get the same response bytes to staple, 
+     * clients look for the single response matching their certificate. The 
+     * responder signs all single responses together, they cannot be split. */
+    n = i2d_OCSP_RESPONSE(ocsp_resp, (unsigned char**)&new_der.data);
+    if (n <= 0) {
+        rv = APR_EGENERAL;
+        batch_set_result(batch, rv, "error DER encoding OCSP response", MD_LOG_WARNING);
+        goto leave;
+    }
+    new_der.len = (apr_size_t)n;
+    
+    if (batch->updates->nelts > 1 && new_der.len > MD_OCSP_SHM_DER_MAX) {
+        /* Too large to staple (and to share between children) for all these
+         * certificates. Limit the batches of this responder to what fits and
+         * ask again right away. */
+        n = (int)((apr_size_t)batch->updates->nelts * MD_OCSP_SHM_DER_MAX / new_der.len);
+        batch->responder->batch_max = (n > 1)? n : 1;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, req->pool, 
+                      "req[%d]: OCSP response for %d certificates has %lu bytes, "
+                      "batching %d from now on", req->id, batch->updates->nelts, 
+                      (unsigned long)new_der.len, batch->responder->batch_max);
+        apr_thread_mutex_lock(batch->reg->mutex);
+        for (i = 0; i < batch->updates->nelts; ++i) {
+            update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+            ostat_schedule(update->ostat, apr_time_now());
+            update->unchanged = 1;
+            update->rv = APR_SUCCESS;
+            md_result_set(update->result, APR_SUCCESS, 
+                          "OCSP response too large, asking again in a smaller batch");
+        }
+        apr_thread_mutex_unlock(batch->reg->mutex);
+        goto leave;
+    }
+    
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        ostat_on_single_resp(update, basic_resp, &new_der, req->pool);
+    }
+    /* failures of single certificates are reported in their update */
+    rv = APR_SUCCESS;
+
 leave:
     if (new_der.data) OPENSSL_free((void*)new_der.data);
     if (basic_resp) OCSP_BASICRESP_free(basic_resp);
@@ -735,158 +1534,353 @@ leave:
     return rv;
 }
 
-static apr_status_t ostat_on_req_status(const md_http_request_t *req, apr_status_t status, 
-                                        void *baton)
+static void responder_adapt(md_ocsp_reg_t *reg, md_ocsp_responder_t *responder, 
+                            apr_status_t status, apr_interval_time_t duration)
 {
-    md_ocsp_update_t *update = baton;
-    md_ocsp_status_t *ostat = update->ostat;
-
-    (void)req;
-    md_job_end_run(update->job, update->result);
+    int limit = responder->limit;
+    
     if (APR_SUCCESS != status) {
-        ++ostat->errors;
-        ostat->next_run = apr_time_now() + md_job_delay_on_errors(ostat->errors); 
-        md_result_printf(update->result, status, "OCSP status update failed (%d. time)",  
-                         ostat->errors);
-        md_result_log(update->result, MD_LOG_DEBUG);
-        md_job_log_append(update->job, "ocsp-error", 
-                          update->result->problem, update->result->detail);
-        md_job_holler(update->job, "ocsp-errored");
-        goto leave;
+        /* back off hard, the responder might be overwhelmed or down */
+        responder->limit = (limit > 1)? limit / 2 : 1;
+        responder->successes = 0;
+    }
+    else {
+        if (responder->latency > 0 && duration > 2 * responder->latency && limit > 1) {
+            /* noticeably slower than usual, ease off a bit */
+            responder->limit = limit - 1;
+            responder->successes = 0;
+        }
+        else if (++responder->successes >= limit && limit < reg->max_parallel_responder) {
+            /* a full window of good requests, try one more */
+            responder->limit = limit + 1;
+            responder->successes = 0;
+        }
+        responder->latency = responder->latency? 
+            (7 * responder->latency + duration) / 8 : duration;
     }
-    md_job_notify(update->job, "ocsp-renewed", update->result);
+    if (responder->limit != limit) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, status, reg->p, 
+                      "OCSP responder %s: parallel requests %d -> %d (latency %ld ms)", 
+                      responder->url, limit, responder->limit, 
+                      (long)apr_time_as_msec(responder->latency));
+    }
+}
 
-leave:
-    md_job_save(update->job, update->result, update->p);
-    ostat_req_cleanup(ostat);
+static apr_status_t batch_on_req_status(const md_http_request_t *req, apr_status_t status, 
+                                        void *baton)
+{
+    md_ocsp_batch_t *batch = baton;
+    md_ocsp_update_t *update;
+    md_ocsp_status_t *ostat;
+    apr_status_t rv;
+    int i;
+
+    --batch->responder->in_flight;
+    responder_adapt(batch->reg, batch->responder, status, apr_time_now() - batch->started);
+    for (i = 0; i < batch->updates->nelts; ++i) {
+        update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        ostat = update->ostat;
+        rv = (APR_SUCCESS != status)? status : update->rv;
+        
+        md_result_timings_set(update->result, md_http_timings_to_json(req->http, 
+                              batch->responder->url, update->p));
+        md_job_end_run(update->job, update->result);
+        if (APR_SUCCESS != rv) {
+            apr_thread_mutex_lock(ostat->reg->mutex);
+            ++ostat->errors;
+            ostat_schedule(ostat, apr_time_now() + md_job_delay_on_errors(ostat->errors));
+            apr_thread_mutex_unlock(ostat->reg->mutex);
+            md_result_printf(update->result, rv, "OCSP status update failed (%d. time)",  
+                             ostat->errors);
+            md_result_log(update->result, MD_LOG_DEBUG);
+            md_job_log_append(update->job, "ocsp-error", 
+                              update->result->problem, update->result->detail);
+            md_job_holler(update->job, "ocsp-errored");
+        }
+        else if (!update->unchanged) {
+            md_job_notify(update->job, "ocsp-renewed", update->result);
+        }
+        md_job_save(update->job, update->result, update->p);
+    }
+    batch_cleanup(batch);
     return APR_SUCCESS;
 }
 
 typedef struct {
     md_ocsp_reg_t *reg;
-    apr_array_header_t *todos;
+    int todo_count;
+    int next_responder;
     apr_pool_t *ptemp;
     apr_time_t time;
     int max_parallel;
 } md_ocsp_todo_ctx_t;
 
+static md_ocsp_responder_t *next_responder(md_ocsp_todo_ctx_t *ctx)
+{
+    md_ocsp_responder_t *responder;
+    int i, n = ctx->reg->responder_list->nelts;
+    
+    /* round robin over all responders that have work and room for another request */
+    for (i = 0; i < n; ++i) {
+        responder = APR_ARRAY_IDX(ctx->reg->responder_list, 
+                                  (ctx->next_responder + i) % n, md_ocsp_responder_t*);
+        if (responder->todos && responder->todos->nelts > 0 
+            && responder->in_flight < responder->limit) {
+            ctx->next_responder = (ctx->next_responder + i + 1) % n;
+            return responder;
+        }
+    }
+    return NULL;
+}
+
 static apr_status_t next_todo(md_http_request_t **preq, void *baton, 
                               md_http_t *http, int in_flight)
 {
     md_ocsp_todo_ctx_t *ctx = baton;
     md_ocsp_update_t *update, **pupdate;    
+    md_ocsp_responder_t *responder;
+    md_ocsp_batch_t *batch = NULL;
     md_ocsp_status_t *ostat;
     OCSP_CERTID *certid = NULL;
     md_http_request_t *req = NULL;
     apr_status_t rv = APR_ENOENT;
     apr_table_t *headers;
-    int len;
+    apr_array_header_t *todos;
+    const char *url;
+    int i, len, batch_max;
     
-    if (in_flight < ctx->max_parallel) {
-        pupdate = apr_array_pop(ctx->todos);
-        if (pupdate) {
+    /* When all responders with work are busy, we return APR_ENOENT and
+     * get asked again once one of the running requests has finished. */
+    if (in_flight < ctx->max_parallel && (responder = next_responder(ctx))) {
+        todos = responder->todos;
+        batch_max = ctx->reg->batch_max;
+        if (responder->batch_max > 0 && responder->batch_max < batch_max) {
+            batch_max = responder->batch_max;
+        }
+        batch = apr_pcalloc(ctx->ptemp, sizeof(*batch));
+        batch->p = ctx->ptemp;
+        batch->reg = ctx->reg;
+        batch->responder = responder;
+        batch->updates = apr_array_make(batch->p, batch_max, sizeof(md_ocsp_update_t*));
+        apr_pool_cleanup_register(batch->p, batch, batch_cleanup, apr_pool_cleanup_null);
+        
+        /* todos are sorted by responder and issuer. Take as many with the
+         * same batch key from its end as a single request may carry. */
+        while (batch->updates->nelts < batch_max 
+               && (pupdate = apr_array_pop(todos))) {
             update = *pupdate;
+            if (batch->updates->nelts > 0 
+                && strcmp(update->ostat->batch_key, 
+                          APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*)->ostat->batch_key)) {
+                /* does not belong to this batch, push back */
+                APR_ARRAY_PUSH(todos, md_ocsp_update_t*) = update;
+                break;
+            }
+            APR_ARRAY_PUSH(batch->updates, md_ocsp_update_t*) = update;
+        }
+        
+        batch->ocsp_req = OCSP_REQUEST_new();
+        if (!batch->ocsp_req) goto leave;
+        for (i = 0; i < batch->updates->nelts; ++i) {
+            update = APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
             ostat = update->ostat;
             
             update->job = md_ocsp_job_make(ctx->reg, ostat->md_name, update->p);
             md_job_load(update->job);
             md_job_start_run(update->job, update->result, ctx->reg->store);
-             
-            if (!ostat->ocsp_req) {
-                ostat->ocsp_req = OCSP_REQUEST_new();
-                if (!ostat->ocsp_req) goto leave;
-                certid = OCSP_CERTID_dup(ostat->certid);
-                if (!certid) goto leave;
-                if (!OCSP_request_add0_id(ostat->ocsp_req, certid)) goto leave;
-                OCSP_request_add1_nonce(ostat->ocsp_req, 0, -1);
-                certid = NULL;
-            }
-            if (0 == ostat->req_der.len) {
-                len = i2d_OCSP_REQUEST(ostat->ocsp_req, (unsigned char**)&ostat->req_der.data);
-                if (len < 0) goto leave;
-                ostat->req_der.len = (apr_size_t)len;
-            }
+            
+            certid = OCSP_CERTID_dup(ostat->certid);
+            if (!certid) goto leave;
+            if (!OCSP_request_add0_id(batch->ocsp_req, certid)) goto leave;
+            certid = NULL;
             md_result_activity_printf(update->result, "status of certid %s, "
                                       "contacting %s", ostat->hexid, ostat->responder_url);
-            headers = apr_table_make(ctx->ptemp, 5);
+        }
+        /* RFC 5019 requests stay cacheable, which a nonce would prevent */
+        batch->is_get = (ctx->reg->use_get && batch->updates->nelts == 1);
+        if (!batch->is_get) OCSP_request_add1_nonce(batch->ocsp_req, 0, -1);
+        
+        len = i2d_OCSP_REQUEST(batch->ocsp_req, (unsigned char**)&batch->req_der.data);
+        if (len < 0) goto leave;
+        batch->req_der.len = (apr_size_t)len;
+        
+        headers = apr_table_make(ctx->ptemp, 5);
+        url = batch->is_get? ocsp_get_url(responder->url, &batch->req_der, ctx->ptemp) : NULL;
+        if (url) {
+            ostat = APR_ARRAY_IDX(batch->updates, 0, md_ocsp_update_t*)->ostat;
+            if (ostat->etag[0]) apr_table_set(headers, "If-None-Match", ostat->etag);
+            if (ostat->last_modified[0]) {
+                apr_table_set(headers, "If-Modified-Since", ostat->last_modified);
+            }
+            rv = md_http_GET_create(&req, http, url, headers);
+        }
+        else {
+            /* too large for GET, POST it, without a nonce if we meant to GET */
+            batch->is_get = 0;
             apr_table_set(headers, "Expect", "");
-            rv = md_http_POSTd_create(&req, http, ostat->responder_url, headers, 
-                                      "application/ocsp-request", &ostat->req_der);
-            if (APR_SUCCESS != rv) goto leave;
-            md_http_set_on_status_cb(req, ostat_on_req_status, update);
-            md_http_set_on_response_cb(req, ostat_on_resp, update);
-            rv = APR_SUCCESS;
+            rv = md_http_POSTd_create(&req, http, responder->url, headers, 
+                                      "application/ocsp-request", &batch->req_der);
         }
+        if (APR_SUCCESS != rv) goto leave;
+        md_http_set_on_status_cb(req, batch_on_req_status, batch);
+        md_http_set_on_response_cb(req, batch_on_resp, batch);
+        md_http_set_on_data_cb(req, batch_on_data, batch);
+        batch->resp_der.data = NULL;
+        batch->resp_der.len = batch->resp_size = 0;
+        ++responder->in_flight;
+        batch->started = apr_time_now();
+        rv = APR_SUCCESS;
     }
 leave:
+    if (APR_SUCCESS != rv && batch && batch->updates->nelts > 0) {
+        /* Put the updates back where they were, they are tried again when
+         * the next request finishes or in the next run. */
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ctx->ptemp, 
+                      "OCSP: unable to make request to %s for %d certificates", 
+                      batch->responder->url, batch->updates->nelts);
+        for (i = batch->updates->nelts - 1; i >= 0; --i) {
+            APR_ARRAY_PUSH(batch->responder->todos, md_ocsp_update_t*) = 
+                APR_ARRAY_IDX(batch->updates, i, md_ocsp_update_t*);
+        }
+        batch_cleanup(batch);
+        rv = APR_ENOENT;
+    }
     *preq = (APR_SUCCESS == rv)? req : NULL;
     if (certid) OCSP_CERTID_free(certid);
     return rv;
 }
 
-static int select_updates(void *baton, const void *key, apr_ssize_t klen, const void *val)
+static void select_updates(md_ocsp_todo_ctx_t *ctx, int i)
 {
-    md_ocsp_todo_ctx_t *ctx = baton;
-    md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
+    md_ocsp_status_t *ostat;
     md_ocsp_update_t *update;
     
-    (void)key;
-    (void)klen;
-    if (ostat->next_run <= ctx->time) {
-        update = apr_pcalloc(ctx->ptemp, sizeof(*update));
-        update->p = ctx->ptemp;
-        update->ostat = ostat;
-        update->result = md_result_md_make(update->p, ostat->md_name);
-        update->job = NULL;
-        APR_ARRAY_PUSH(ctx->todos, md_ocsp_update_t*) = update;
+    /* Visit the schedule top down, only subtrees where something is due */
+    if (i >= ctx->reg->schedule->nelts) return;
+    ostat = SCHED_AT(ctx->reg, i);
+    if (ostat->next_run > ctx->time) return;
+    
+    update = apr_pcalloc(ctx->ptemp, sizeof(*update));
+    update->p = ctx->ptemp;
+    update->ostat = ostat;
+    update->result = md_result_md_make(update->p, ostat->md_name);
+    update->job = NULL;
+    update->rv = APR_SUCCESS;
+    if (!ostat->responder->todos) {
+        ostat->responder->todos = apr_array_make(ctx->ptemp, 10, sizeof(md_ocsp_update_t*));
     }
-    return 1;
+    APR_ARRAY_PUSH(ostat->responder->todos, md_ocsp_update_t*) = update;
+    ++ctx->todo_count;
+    
+    select_updates(ctx, 2 * i + 1);
+    select_updates(ctx, 2 * i + 2);
 }
 
-static int select_next_run(void *baton, const void *key, apr_ssize_t klen, const void *val)
+static void drop_refreshed(md_ocsp_todo_ctx_t *ctx)
 {
-    md_ocsp_todo_ctx_t *ctx = baton;
-    md_ocsp_status_t *ostat = (md_ocsp_status_t *)val;
+    md_ocsp_responder_t *responder;
+    md_ocsp_update_t *update;
+    int i, j, n;
     
-    (void)key;
-    (void)klen;
-    if (ostat->next_run < ctx->time && ostat->next_run > apr_time_now()) {
-        ctx->time = ostat->next_run;
+    /* called with reg->mutex held. Servers sharing the store pick up what 
+     * the others retrieved, only updates still due remain. */
+    ctx->todo_count = 0;
+    for (i = 0; i < ctx->reg->responder_list->nelts; ++i) {
+        responder = APR_ARRAY_IDX(ctx->reg->responder_list, i, md_ocsp_responder_t*);
+        if (!responder->todos) continue;
+        for (j = n = 0; j < responder->todos->nelts; ++j) {
+            update = APR_ARRAY_IDX(responder->todos, j, md_ocsp_update_t*);
+            ocsp_status_refresh(update->ostat, ctx->ptemp);
+            if (update->ostat->next_run > ctx->time) continue;
+            APR_ARRAY_IDX(responder->todos, n++, md_ocsp_update_t*) = update;
+        }
+        responder->todos->nelts = n;
+        ctx->todo_count += n;
     }
-    return 1;
+}
+
+static int update_batch_cmp(const void *v1, const void *v2)
+{
+    return strcmp((*(md_ocsp_update_t**)v1)->ostat->batch_key, 
+                  (*(md_ocsp_update_t**)v2)->ostat->batch_key);
 }
 
 void md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, apr_time_t *pnext_run)
 {
     md_ocsp_todo_ctx_t ctx;
+    md_ocsp_responder_t *responder;
     md_http_t *http;
     apr_status_t rv = APR_SUCCESS;
+    int i, leased = 0;
     
     (void)p;
-    (void)pnext_run;
     
+    memset(&ctx, 0, sizeof(ctx));
     ctx.reg = reg;
     ctx.ptemp = ptemp;
-    ctx.todos = apr_array_make(ptemp, (int)md_ocsp_count(reg), sizeof(md_ocsp_status_t*));
-    ctx.max_parallel = 6; /* the magic number in HTTP */
+    ctx.max_parallel = reg->max_parallel;
+    for (i = 0; i < reg->responder_list->nelts; ++i) {
+        responder = APR_ARRAY_IDX(reg->responder_list, i, md_ocsp_responder_t*);
+        responder->todos = NULL;
+        responder->in_flight = 0;
+    }
     
     /* Create a list of update tasks that are needed now or in the next minute */
-    ctx.time = apr_time_now() + apr_time_from_sec(60);;
-    apr_hash_do(select_updates, &ctx, reg->hash);
+    ctx.time = apr_time_now() + apr_time_from_sec(60);
+    apr_thread_mutex_lock(reg->mutex);
+    select_updates(&ctx, 0);
+    apr_thread_mutex_unlock(reg->mutex);
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
-                  "OCSP status updates due: %d",  ctx.todos->nelts);
-    if (!ctx.todos->nelts) goto leave;
+                  "OCSP status updates due: %d",  ctx.todo_count);
+    if (!ctx.todo_count) goto leave;
+    if (reg->lease_ttl > 0) {
+        rv = md_store_lease(reg->store, ptemp, MD_SG_OCSP, NULL, 
+                            reg->lease_holder, reg->lease_ttl);
+        leased = (APR_SUCCESS == rv);
+        apr_thread_mutex_lock(reg->mutex);
+        drop_refreshed(&ctx);
+        apr_thread_mutex_unlock(reg->mutex);
+        if (APR_STATUS_IS_EBUSY(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                          "OCSP status updates are done by another server");
+            rv = APR_SUCCESS;
+            goto leave;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "OCSP status updates not done by others: %d",  ctx.todo_count);
+        rv = APR_SUCCESS;
+        if (!ctx.todo_count) goto leave;
+    }
+    if (reg->batch_max > 1) {
+        for (i = 0; i < reg->responder_list->nelts; ++i) {
+            responder = APR_ARRAY_IDX(reg->responder_list, i, md_ocsp_responder_t*);
+            if (!responder->todos) continue;
+            qsort(responder->todos->elts, (size_t)responder->todos->nelts, 
+                  sizeof(md_ocsp_update_t*), update_batch_cmp);
+        }
+    }
     
     rv = md_http_create(&http, ptemp, reg->user_agent, reg->proxy_url);
     if (APR_SUCCESS != rv) goto leave;
+    /* many requests to few responders, let them share a connection */
+    md_http_set_http2(http, 1);
     
     rv = md_http_multi_perform(http, next_todo, &ctx);
 
 leave:
+    if (leased) md_store_release(reg->store, ptemp, MD_SG_OCSP, NULL, reg->lease_holder);
     /* When do we need to run next? *pnext_run contains the planned schedule from
      * the watchdog. We can make that earlier if we need it. */
     ctx.time = *pnext_run;
-    apr_hash_do(select_next_run, &ctx, reg->hash);
+    apr_thread_mutex_lock(reg->mutex);
+    if (reg->schedule->nelts > 0) {
+        apr_time_t first = SCHED_AT(reg, 0)->next_run, now = apr_time_now();
+        
+        /* Anything still due was not handled in this run, retry in a minute */
+        if (first <= now) first = now + apr_time_from_sec(60);
+        if (first < ctx.time) ctx.time = first;
+    }
+    apr_thread_mutex_unlock(reg->mutex);
 
     /* sanity check and return */
     if (ctx.time < apr_time_now()) ctx.time = apr_time_now() + apr_time_from_sec(1);
@@ -895,14 +1889,71 @@ leave:
     if (APR_SUCCESS != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "ocsp_renew done");
     }
+    for (i = 0; i < reg->responder_list->nelts; ++i) {
+        /* todos were allocated from ptemp */
+        APR_ARRAY_IDX(reg->responder_list, i, md_ocsp_responder_t*)->todos = NULL;
+    }
     return;
 }
 
+typedef struct {
+    md_store_t *store;
+    apr_time_t timestamp;
+} ocsp_cleanup_ctx;
+
+static int ocsp_cleanup_journaled(void *baton, const char *name, const char *aspect, 
+                                  apr_time_t *ptime, apr_pool_t *ptemp)
+{
+    ocsp_cleanup_ctx *ctx = baton;
+    apr_time_t mtime;
+    
+    /* not stored before the timestamp, so not modified since either */
+    if (*ptime >= ctx->timestamp) return 1;
+    if (!aspect) return 0;
+    mtime = md_store_get_modified(ctx->store, MD_SG_OCSP, name, aspect, ptemp);
+    if (!mtime) return 0;
+    if (mtime < ctx->timestamp) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "ocsp/%s/%s: removing old response", 
+                      name, aspect);
+        return APR_SUCCESS != md_store_remove(ctx->store, MD_SG_OCSP, name, aspect, ptemp, 1);
+    }
+    /* still updated, look again when this update is as old */
+    *ptime = mtime;
+    return 1;
+}
+
+static int ocsp_cleanup_journal_start(void *baton, const char *name, const char *aspect, 
+                                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    ocsp_cleanup_ctx *ctx = baton;
+    
+    (void)vtype;
+    (void)value;
+    md_store_journal_add(ctx->store, ptemp, MD_SG_OCSP, name, aspect);
+    return 1;
+}
+
 apr_status_t md_ocsp_remove_responses_older_than(md_ocsp_reg_t *reg, apr_pool_t *p, 
                                                  apr_time_t timestamp)
 {
-    return md_store_remove_not_modified_since(reg->store, p, timestamp, 
-                                              MD_SG_OCSP, "*", "ocsp*.json");
+    ocsp_cleanup_ctx ctx;
+    apr_status_t rv;
+    
+    ctx.store = reg->store;
+    ctx.timestamp = timestamp;
+    /* Only responses in the journal may be old enough. Without one, e.g. in a store 
+     * from an earlier version, look at all and start it with those that remain. */
+    rv = md_store_journal_cleanup(reg->store, p, MD_SG_OCSP, ocsp_cleanup_journaled, &ctx);
+    if (APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_ENOTIMPL(rv)) {
+        rv = md_store_remove_not_modified_since(reg->store, p, timestamp, 
+                                                MD_SG_OCSP, "*", "ocsp*.json");
+        if (APR_SUCCESS == rv
+            && APR_SUCCESS == md_store_journal_add(reg->store, p, MD_SG_OCSP, NULL, NULL)) {
+            md_store_iter(ocsp_cleanup_journal_start, &ctx, reg->store, p, 
+                          MD_SG_OCSP, "*", "ocsp*.json", MD_SV_TEXT);
+        }
+    }
+    return rv;
 }
 
 typedef struct {
@@ -949,10 +2000,43 @@ void  md_ocsp_get_summary(md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p)
     *pjson = json;
 }
 
+static void add_histogram(md_json_t *json, const volatile apr_uint32_t *hist, 
+                          const char *key, apr_pool_t *p)
+{
+    md_json_t *jbucket;
+    int i;
+    
+    for (i = 0; i < MD_OCSP_HIST_BUCKETS; ++i) {
+        jbucket = md_json_create(p);
+        if (i < MD_OCSP_HIST_BUCKETS - 1) {
+            md_json_setl((long)1 << i, jbucket, MD_KEY_LE_USEC, NULL);
+        }
+        md_json_setl((long)apr_atomic_read32((volatile apr_uint32_t*)&hist[i]), 
+                     jbucket, MD_KEY_COUNT, NULL);
+        md_json_addj(jbucket, json, key, NULL);
+    }
+}
+
+void md_ocsp_get_stats(md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    md_ocsp_stats_t *stats = &reg->stats;
+    md_json_t *json;
+    
+    json = md_json_create(p);
+    md_json_setl((long)apr_atomic_read32(&stats->calls), json, MD_KEY_CALLS, NULL);
+    md_json_setl((long)apr_atomic_read32(&stats->hits), json, MD_KEY_HITS, NULL);
+    md_json_setl((long)apr_atomic_read32(&stats->misses), json, MD_KEY_MISSES, NULL);
+    md_json_setl((long)apr_atomic_read32(&stats->store_reads), json, MD_KEY_STORE_READS, NULL);
+    md_json_setl((long)apr_atomic_read32(&stats->lock_waits), json, MD_KEY_LOCK_WAITS, NULL);
+    add_histogram(json, stats->latency, MD_KEY_LATENCY, p);
+    add_histogram(json, stats->lock_wait, MD_KEY_LOCK_WAIT, p);
+    *pjson = json;
+}
+
 static apr_status_t job_loadj(md_json_t **pjson, const char *name, 
                               md_ocsp_reg_t *reg, apr_pool_t *p)
 {
-    return md_store_load_json(reg->store, MD_SG_OCSP, name, MD_FN_JOB, pjson, p);
+    return md_job_load_json(pjson, reg->store, MD_SG_OCSP, name, p);
 }
 
 typedef struct {
@@ -1009,27 +2093,91 @@ static int md_ostat_cmp(const void *v1, const void *v2)
     return n;
 }
 
-void md_ocsp_get_status_all(md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p)
+void md_ocsp_status_iter(md_ocsp_status_iter_cb *cb, void *baton, 
+                         md_ocsp_reg_t *reg, apr_pool_t *p)
 {
-    md_json_t *json;
     ocsp_status_ctx_t ctx;
     md_ocsp_status_t *ostat;
+    apr_pool_t *ptemp;
     int i;
     
     memset(&ctx, 0, sizeof(ctx));
     ctx.p = p;
     ctx.reg = reg;
     ctx.ostats = apr_array_make(p, (int)apr_hash_count(reg->hash), sizeof(md_ocsp_status_t*));
-    json = md_json_create(p);
     
     apr_hash_do(add_ostat, &ctx, reg->hash);
     qsort(ctx.ostats->elts, (size_t)ctx.ostats->nelts, sizeof(md_json_t*), md_ostat_cmp);
     
+    if (APR_SUCCESS != apr_pool_create(&ptemp, p)) return;
     for (i = 0; i < ctx.ostats->nelts; ++i) {
         ostat = APR_ARRAY_IDX(ctx.ostats, i, md_ocsp_status_t*);
-        md_json_addj(mk_jstat(ostat, reg, p), json, MD_KEY_OCSPS, NULL);
+        if (!cb(baton, (size_t)i, mk_jstat(ostat, reg, ptemp))) break;
+        apr_pool_clear(ptemp);
     }
-    *pjson = json;
+    apr_pool_destroy(ptemp);
+}
+
+typedef struct {
+    apr_pool_t *p;
+    md_json_t *json;
+} ocsp_collect_ctx_t;
+
+static int collect_jstat(void *baton, size_t index, md_json_t *jstat)
+{
+    ocsp_collect_ctx_t *ctx = baton;
+    
+    (void)index;
+    md_json_addj(md_json_clone(ctx->p, jstat), ctx->json, MD_KEY_OCSPS, NULL);
+    return 1;
+}
+
+void md_ocsp_get_status_all(md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p)
+{
+    ocsp_collect_ctx_t ctx;
+    
+    ctx.p = p;
+    ctx.json = md_json_create(p);
+    md_ocsp_status_iter(collect_jstat, &ctx, reg, p);
+    *pjson = ctx.json;
+}
+
+void md_ocsp_set_parallel(md_ocsp_reg_t *reg, int max_total, int max_per_responder)
+{
+    md_ocsp_responder_t *responder;
+    int i;
+    
+    reg->max_parallel = (max_total > 0)? max_total : MD_OCSP_PARALLEL_DEF;
+    reg->max_parallel_responder = (max_per_responder > 0)? 
+                                   max_per_responder : MD_OCSP_PARALLEL_RESPONDER_DEF;
+    if (reg->max_parallel_responder > reg->max_parallel) {
+        reg->max_parallel_responder = reg->max_parallel;
+    }
+    for (i = 0; i < reg->responder_list->nelts; ++i) {
+        responder = APR_ARRAY_IDX(reg->responder_list, i, md_ocsp_responder_t*);
+        responder->limit = reg->max_parallel_responder;
+    }
+}
+
+void md_ocsp_set_renew_spread(md_ocsp_reg_t *reg, md_ocsp_spread_t spread)
+{
+    reg->renew_spread = spread;
+}
+
+void md_ocsp_set_use_get(md_ocsp_reg_t *reg, int use_get)
+{
+    reg->use_get = use_get;
+}
+
+void md_ocsp_set_lease(md_ocsp_reg_t *reg, const char *holder, apr_interval_time_t ttl)
+{
+    reg->lease_holder = holder;
+    reg->lease_ttl = holder? ttl : 0;
+}
+
+void md_ocsp_set_batch_size(md_ocsp_reg_t *reg, int batch_max)
+{
+    reg->batch_max = (batch_max > 0)? batch_max : 1;
 }
 
 void md_ocsp_set_notify_cb(md_ocsp_reg_t *ocsp, md_job_notify_cb *cb, void *baton)
@@ -46,12 +46,36 @@ apr_status_t md_ocsp_get_status(unsigned char **pder, int *pderlen,
                                 md_ocsp_reg_t *reg, const md_cert_t *cert,
                                 apr_pool_t *p, const md_t *md);
 
+typedef struct md_ocsp_resp_t md_ocsp_staple_t;
+
+/**
+ * Borrow the current OCSP response for a certificate without copying it.
+ * The DER bytes stay valid and unchanged, even when a newer response arrives,
+ * until the staple is given back via md_ocsp_staple_release().
+ * When no response is available, *pstaple is NULL and APR_SUCCESS is returned.
+ */
+apr_status_t md_ocsp_staple_get(md_ocsp_staple_t **pstaple, 
+                                const unsigned char **pder, int *pderlen,
+                                md_ocsp_reg_t *reg, const md_cert_t *cert,
+                                apr_pool_t *p, const md_t *md);
+
+void md_ocsp_staple_release(md_ocsp_staple_t *staple);
+
 apr_status_t md_ocsp_get_meta(md_ocsp_cert_stat_t *pstat, md_timeperiod_t *pvalid,
                               md_ocsp_reg_t *reg, const md_cert_t *cert,
                               apr_pool_t *p, const md_t *md);
 
 apr_size_t md_ocsp_count(md_ocsp_reg_t *reg);
 
+/**
+ * Publish OCSP responses for all primed certificates in an anonymous shared
+ * memory table. The watchdog writes new responses into it and all other
+ * processes pick them up from there instead of reading the store.
+ * Needs to be called after all certificates have been primed and before
+ * child processes are created.
+ */
+apr_status_t md_ocsp_use_shm(md_ocsp_reg_t *reg, apr_pool_t *p);
+
 void md_ocsp_renew(md_ocsp_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, apr_time_t *pnext_run);
 
 apr_status_t md_ocsp_remove_responses_older_than(md_ocsp_reg_t *reg, apr_pool_t *p, 
@@ -60,6 +84,66 @@ apr_status_t md_ocsp_remove_responses_older_than(md_ocsp_reg_t *reg, apr_pool_t
 void md_ocsp_get_summary(struct md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p);
 void md_ocsp_get_status_all(struct md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p);
 
+/**
+ * Call cb with the status of each certificate, as listed by md_ocsp_get_status_all(),
+ * as long as it returns != 0. Each status is made from a pool of its own that is 
+ * cleared after the callback, so the memory needed does not grow with the number
+ * of certificates.
+ */
+typedef int md_ocsp_status_iter_cb(void *baton, size_t index, struct md_json_t *jstat);
+void md_ocsp_status_iter(md_ocsp_status_iter_cb *cb, void *baton, 
+                         md_ocsp_reg_t *reg, apr_pool_t *p);
+
+typedef enum {
+    MD_OCSP_SPREAD_NONE,        /* renew at the start of the renew window */
+    MD_OCSP_SPREAD_RANDOM,      /* renew at a random point in the first half of the window */
+    MD_OCSP_SPREAD_EVEN,        /* renew at a point derived from the certificate id */
+} md_ocsp_spread_t;
+
+/**
+ * Set how renewals of OCSP responses are placed inside the renew window. Spreading
+ * them avoids that all responses fetched together are also all renewed together.
+ */
+void md_ocsp_set_renew_spread(md_ocsp_reg_t *reg, md_ocsp_spread_t spread);
+
+#define MD_OCSP_PARALLEL_DEF               12
+#define MD_OCSP_PARALLEL_RESPONDER_DEF     6
+
+/**
+ * Set the max number of OCSP requests in progress at the same time, in total and
+ * for a single responder. The number of requests against a responder adapts to
+ * observed latency and errors, but never exceeds the configured max.
+ */
+void md_ocsp_set_parallel(md_ocsp_reg_t *reg, int max_total, int max_per_responder);
+
+/**
+ * Use RFC 5019 GET requests without nonce for single certificates, when the 
+ * request is small enough. Responses are then cacheable and revalidated
+ * with ETag/Last-Modified and Cache-Control max-age.
+ */
+void md_ocsp_set_use_get(md_ocsp_reg_t *reg, int use_get);
+
+/**
+ * Servers sharing a store take a lease of ttl as holder before they update
+ * OCSP responses, so that only one of them contacts the responders. The others
+ * use the responses it stores. A ttl of 0 disables this (the default).
+ */
+void md_ocsp_set_lease(md_ocsp_reg_t *reg, const char *holder, apr_interval_time_t ttl);
+
+#define MD_OCSP_BATCH_SIZE_MAX     100
+
+/**
+ * Set the max number of certificates, with the same responder and issuer, that
+ * are asked about in a single OCSP request. The default is 1.
+ */
+void md_ocsp_set_batch_size(md_ocsp_reg_t *reg, int batch_max);
+
+/**
+ * Get the counters and latency histograms of stapling lookups done by
+ * handshakes in this process.
+ */
+void md_ocsp_get_stats(struct md_json_t **pjson, md_ocsp_reg_t *reg, apr_pool_t *p);
+
 void md_ocsp_set_notify_cb(md_ocsp_reg_t *reg, md_job_notify_cb *cb, void *baton);
 struct md_job_t *md_ocsp_job_make(md_ocsp_reg_t *ocsp, const char *mdomain, apr_pool_t *p);
 
@@ -20,8 +20,10 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_proc.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -42,14 +44,21 @@ struct md_reg_t {
     struct md_store_t *store;
     struct apr_hash_t *protos;
     struct apr_hash_t *certs;
+    struct apr_hash_t *cred_files;
     int can_http;
     int can_https;
     const char *proxy_url;
     int domains_frozen;
     md_timeslice_t *renew_window;
     md_timeslice_t *warn_window;
+    int renew_spread;           /* percent of the renew window renewals are spread over */
     md_job_notify_cb *notify;
     void *notify_ctx;
+    int nonblocking;
+    struct md_keypool_t *keypool;
+    struct md_acme_limits_t *ca_limits;
+    apr_pool_t *bulk_pool;
+    apr_hash_t *bulk_domains;   /* lower case domain -> md name, in bulk mode */
 };
 
 /**************************************************************************************************/
@@ -87,6 +96,7 @@ apr_status_t md_reg_create(md_reg_t **preg, apr_pool_t *p, struct md_store_t *st
     reg->store = store;
     reg->protos = apr_hash_make(p);
     reg->certs = apr_hash_make(p);
+    reg->cred_files = apr_hash_make(p);
     reg->can_http = 1;
     reg->can_https = 1;
     reg->proxy_url = proxy_url? apr_pstrdup(p, proxy_url) : NULL;
@@ -94,7 +104,9 @@ apr_status_t md_reg_create(md_reg_t **preg, apr_pool_t *p, struct md_store_t *st
     md_timeslice_create(&reg->renew_window, p, MD_TIME_LIFE_NORM, MD_TIME_RENEW_WINDOW_DEF); 
     md_timeslice_create(&reg->warn_window, p, MD_TIME_LIFE_NORM, MD_TIME_WARN_WINDOW_DEF); 
     
-    if (APR_SUCCESS == (rv = md_acme_protos_add(reg->protos, p))) {
+    if (APR_SUCCESS == (rv = md_acme_protos_add(reg->protos, p))
+        && APR_SUCCESS == (rv = md_acme_limits_create(&reg->ca_limits, p, 
+                                                      MD_ACME_CA_RATE, MD_ACME_CA_BURST))) {
         rv = load_props(reg, p);
     }
     
@@ -107,6 +119,108 @@ struct md_store_t *md_reg_store_get(md_reg_t *reg)
     return reg->store;
 }
 
+/**************************************************************************************************/
+/* bulk mode */
+
+static void bulk_set_domains(md_reg_t *reg, const char *name, apr_array_header_t *domains)
+{
+    const char *domain, *key;
+    int i;
+    
+    if (!reg->bulk_domains) return;
+    name = apr_pstrdup(reg->bulk_pool, name);
+    for (i = 0; i < domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(domains, i, const char*);
+        key = md_util_str_tolower(apr_pstrdup(reg->bulk_pool, domain));
+        if (!apr_hash_get(reg->bulk_domains, key, APR_HASH_KEY_STRING)) {
+            apr_hash_set(reg->bulk_domains, key, APR_HASH_KEY_STRING, name);
+        }
+    }
+}
+
+static void bulk_unset_domains(md_reg_t *reg, const char *name, 
+                               apr_array_header_t *domains, apr_pool_t *p)
+{
+    const char *domain, *key, *owner;
+    int i;
+    
+    if (!reg->bulk_domains) return;
+    for (i = 0; i < domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(domains, i, const char*);
+        key = md_util_str_tolower(apr_pstrdup(p, domain));
+        owner = apr_hash_get(reg->bulk_domains, key, APR_HASH_KEY_STRING);
+        if (owner && !strcmp(name, owner)) {
+            apr_hash_set(reg->bulk_domains, key, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+static void bulk_forget(md_reg_t *reg, const char *name)
+{
+    apr_hash_index_t *hi;
+    const void *key;
+    void *owner;
+    
+    if (!reg->bulk_domains) return;
+    for (hi = apr_hash_first(NULL, reg->bulk_domains); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &owner);
+        if (!strcmp(name, owner)) {
+            /* removing the current entry while iterating is safe for apr hashes */
+            apr_hash_set(reg->bulk_domains, key, APR_HASH_KEY_STRING, NULL);
+        }
+    }
+}
+
+/* Same as md_reg_find_overlap(), but using the domains remembered in bulk mode */
+static const char *bulk_find_overlap(md_reg_t *reg, const md_t *md, const char **pdomain, 
+                                     apr_pool_t *p)
+{
+    const char *domain, *owner;
+    int i;
+    
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        owner = apr_hash_get(reg->bulk_domains, md_util_str_tolower(apr_pstrdup(p, domain)), 
+                             APR_HASH_KEY_STRING);
+        if (owner && strcmp(md->name, owner)) {
+            *pdomain = domain;
+            return owner;
+        }
+    }
+    return NULL;
+}
+
+static int bulk_add_md(void *baton, md_reg_t *reg, md_t *md)
+{
+    (void)baton;
+    bulk_set_domains(reg, md->name, md->domains);
+    return 1;
+}
+
+apr_status_t md_reg_bulk_begin(md_reg_t *reg, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    md_reg_bulk_end(reg);
+    if (APR_SUCCESS != (rv = apr_pool_create(&reg->bulk_pool, reg->p))) goto leave;
+    apr_pool_tag(reg->bulk_pool, "md_reg_bulk");
+    reg->bulk_domains = apr_hash_make(reg->bulk_pool);
+    md_reg_do(bulk_add_md, NULL, reg, p);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "bulk mode: %d domains in store", 
+                  (int)apr_hash_count(reg->bulk_domains));
+leave:
+    return rv;
+}
+
+void md_reg_bulk_end(md_reg_t *reg)
+{
+    if (reg->bulk_pool) {
+        apr_pool_destroy(reg->bulk_pool);
+        reg->bulk_pool = NULL;
+        reg->bulk_domains = NULL;
+    }
+}
+
 /**************************************************************************************************/
 /* checks */
 
@@ -117,7 +231,7 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
     
     if (MD_UPD_DOMAINS & fields) {
         const md_t *other;
-        const char *domain;
+        const char *domain, *other_name = NULL;
         int i;
         
         if (!md->domains || md->domains->nelts <= 0) {
@@ -135,10 +249,16 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
             }
         }
 
-        if (NULL != (other = md_reg_find_overlap(reg, md, &domain, p))) {
+        if (reg->bulk_domains) {
+            other_name = bulk_find_overlap(reg, md, &domain, p);
+        }
+        else if (NULL != (other = md_reg_find_overlap(reg, md, &domain, p))) {
+            other_name = other->name;
+        }
+        if (other_name) {
             md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p, 
                           "md %s shares domain '%s' with md %s", 
-                          md->name, domain, other->name);
+                          md->name, domain, other_name);
             return APR_EINVAL;
         }
     }
@@ -327,19 +447,33 @@ md_t *md_reg_find(md_reg_t *reg, const char *domain, apr_pool_t *p)
 
 typedef struct {
     const md_t *md_checked;
+    apr_hash_t *checked;            /* lower case domains of md_checked -> index + 1 */
     md_t *md;
     const char *s;
+    apr_pool_t *p;
 } find_overlap_ctx;
 
 static int find_overlap(void *baton, md_reg_t *reg, md_t *md)
 {
     find_overlap_ctx *ctx = baton;
-    const char *overlap;
+    const char *domain;
+    void *val;
+    int i, found = 0;
     
     (void)reg;
-    if ((overlap = md_common_name(ctx->md_checked, md))) {
+    /* Look up the domains of md instead of comparing all pairs. As md_common_name(),
+     * give the first domain in the order of md_checked. */
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        val = apr_hash_get(ctx->checked, md_util_str_tolower(apr_pstrdup(ctx->p, domain)),
+                           APR_HASH_KEY_STRING);
+        if (val && (!found || (int)(apr_intptr_t)val < found)) {
+            found = (int)(apr_intptr_t)val;
+        }
+    }
+    if (found) {
         ctx->md = md;
-        ctx->s = overlap;
+        ctx->s = APR_ARRAY_IDX(ctx->md_checked->domains, found - 1, const char*);
         return 0;
     }
     return 1;
@@ -348,10 +482,20 @@ static int find_overlap(void *baton, md_reg_t *reg, md_t *md)
 md_t *md_reg_find_overlap(md_reg_t *reg, const md_t *md, const char **pdomain, apr_pool_t *p)
 {
     find_overlap_ctx ctx;
+    const char *domain;
+    int i;
     
     ctx.md_checked = md;
     ctx.md = NULL;
     ctx.s = NULL;
+    ctx.p = p;
+    ctx.checked = apr_hash_make(p);
+    for (i = md->domains->nelts - 1; i >= 0; --i) {
+        /* going backwards, the first of duplicates remains */
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        apr_hash_set(ctx.checked, md_util_str_tolower(apr_pstrdup(p, domain)), 
+                     APR_HASH_KEY_STRING, (void*)(apr_intptr_t)(i + 1));
+    }
     
     reg_do(find_overlap, &ctx, reg, p, md->name);
     if (pdomain && ctx.s) {
@@ -380,7 +524,8 @@ static apr_status_t p_md_add(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     mine = md_clone(ptemp, md);
     if (do_check && APR_SUCCESS != (rv = check_values(reg, ptemp, md, MD_UPD_ALL))) goto leave;
     if (APR_SUCCESS != (rv = state_init(reg, ptemp, mine))) goto leave;
-    rv = md_save(reg->store, p, MD_SG_DOMAINS, mine, 1);
+    if (APR_SUCCESS != (rv = md_save(reg->store, p, MD_SG_DOMAINS, mine, 1))) goto leave;
+    bulk_set_domains(reg, mine->name, mine->domains);
 leave:
     return rv;
 }
@@ -492,6 +637,10 @@ static apr_status_t p_md_update(void *baton, apr_pool_t *p, apr_pool_t *ptemp, v
     }
     
     if (fields && APR_SUCCESS == (rv = md_save(reg->store, p, MD_SG_DOMAINS, nmd, 0))) {
+        if (MD_UPD_DOMAINS & fields) {
+            bulk_unset_domains(reg, name, md->domains, ptemp);
+            bulk_set_domains(reg, name, nmd->domains);
+        }
         rv = state_init(reg, ptemp, nmd);
     }
     return rv;
@@ -540,6 +689,10 @@ static apr_status_t pubcert_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
         rv = md_pubcert_load(reg->store, group, md->name, &certs, p);
     }
     if (APR_SUCCESS != rv) goto leave;
+    if (certs->nelts == 0) {
+        rv = APR_ENOENT;
+        goto leave;
+    }
             
     pubcert = apr_pcalloc(p, sizeof(*pubcert));
     pubcert->certs = certs;
@@ -586,18 +739,18 @@ leave:
     return rv;
 }
 
-apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile,
+typedef struct {
+    apr_status_t rv;
+    const char *keyfile;
+    const char *certfile;
+} cred_files_t;
+
+static apr_status_t get_cred_files(const char **pkeyfile, const char **pcertfile,
                                    md_reg_t *reg, md_store_group_t group, 
                                    const md_t *md, apr_pool_t *p)
 {
     apr_status_t rv;
     
-    if (md->cert_file) {
-        /* With fixed files configured, we use those without further checking them ourself */
-        *pcertfile = md->cert_file;
-        *pkeyfile = md->pkey_file;
-        return APR_SUCCESS;
-    }
     rv = md_store_get_fname(pkeyfile, reg->store, group, md->name, MD_FN_PRIVKEY, p);
     if (APR_SUCCESS != rv) return rv;
     if (!md_file_exists(*pkeyfile, p)) return APR_ENOENT;
@@ -607,33 +760,113 @@ apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile
     return APR_SUCCESS;
 }
 
+apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile,
+                                   md_reg_t *reg, md_store_group_t group, 
+                                   const md_t *md, apr_pool_t *p)
+{
+    cred_files_t *creds;
+    
+    if (md->cert_file) {
+        /* With fixed files configured, we use those without further checking them ourself */
+        *pcertfile = md->cert_file;
+        *pkeyfile = md->pkey_file;
+        return APR_SUCCESS;
+    }
+    if (MD_SG_DOMAINS != group) {
+        return get_cred_files(pkeyfile, pcertfile, reg, group, md, p);
+    }
+    
+    /* Many vhosts may share an MD and ask for its files repeatedly in the
+     * post config phases. Remember the outcome until staged data is activated. */
+    creds = apr_hash_get(reg->cred_files, md->name, (apr_ssize_t)strlen(md->name));
+    if (!creds) {
+        creds = apr_pcalloc(reg->p, sizeof(*creds));
+        creds->rv = get_cred_files(&creds->keyfile, &creds->certfile, reg, group, md, reg->p);
+        if (APR_SUCCESS != creds->rv && !APR_STATUS_IS_ENOENT(creds->rv)) {
+            return creds->rv;
+        }
+        apr_hash_set(reg->cred_files, apr_pstrdup(reg->p, md->name), APR_HASH_KEY_STRING, creds);
+    }
+    *pkeyfile = creds->keyfile;
+    *pcertfile = creds->certfile;
+    return creds->rv;
+}
+
+static apr_uint32_t name_hash(const char *name)
+{
+    apr_uint32_t h = 2166136261u;
+    
+    /* FNV-1a, stable across restarts and platforms */
+    for (; *name; ++name) {
+        h ^= (unsigned char)apr_tolower(*name);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static apr_time_t cert_renew_at(md_reg_t *reg, const md_t *md, const md_cert_t *cert, 
+                                apr_pool_t *p)
+{
+    md_timeperiod_t certlife, renewal, warn;
+    apr_interval_time_t spread;
+    
+    certlife.start = md_cert_get_not_before(cert);
+    certlife.end = md_cert_get_not_after(cert);
+
+    renewal = md_timeperiod_slice_before_end(&certlife, md->renew_window);
+    if (reg->renew_spread > 0) {
+        /* Certificates issued together would be renewed together. Move the start
+         * into the window by a part derived from the MD name, but never past
+         * the start of the warnings. */
+        spread = md_timeperiod_length(&renewal) / 100 * reg->renew_spread;
+        spread = (apr_interval_time_t)((double)spread 
+                                       * ((double)name_hash(md->name) / 4294967296.0));
+        if (md->warn_window) {
+            warn = md_timeperiod_slice_before_end(&certlife, md->warn_window);
+            if (renewal.start + spread > warn.start) {
+                spread = (warn.start > renewal.start)? warn.start - renewal.start : 0;
+            }
+        }
+        renewal.start += spread;
+    }
+    if (md_log_is_level(p, MD_LOG_TRACE1)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, p, 
+                      "md[%s]: cert-life[%s] renewal[%s]", md->name, 
+                      md_timeperiod_print(p, &certlife),
+                      md_timeperiod_print(p, &renewal));
+    }
+    return renewal.start;
+}
+
 apr_time_t md_reg_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p)
 {
     const md_pubcert_t *pub;
-    const md_cert_t *cert;
-    md_timeperiod_t certlife, renewal;
     apr_status_t rv;
     
     if (md->state == MD_S_INCOMPLETE) return apr_time_now();
     rv = md_reg_get_pubcert(&pub, reg, md, p);
     if (APR_STATUS_IS_ENOENT(rv)) return apr_time_now();
     if (APR_SUCCESS == rv) {
-        cert = APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*);
-        certlife.start = md_cert_get_not_before(cert);
-        certlife.end = md_cert_get_not_after(cert);
-
-        renewal = md_timeperiod_slice_before_end(&certlife, md->renew_window);
-        if (md_log_is_level(p, MD_LOG_TRACE1)) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, 0, p, 
-                          "md[%s]: cert-life[%s] renewal[%s]", md->name, 
-                          md_timeperiod_print(p, &certlife),
-                          md_timeperiod_print(p, &renewal));
-        }
-        return renewal.start;
+        return cert_renew_at(reg, md, APR_ARRAY_IDX(pub->certs, 0, const md_cert_t*), p);
     }
     return 0;
 }
 
+apr_time_t md_reg_store_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p)
+{
+    apr_array_header_t *certs;
+    
+    if (md->cert_file || md->state == MD_S_MISSING_INFORMATION) {
+        return md_reg_renew_at(reg, md, p);
+    }
+    /* not what we loaded at startup, but what is in the store right now */
+    if (APR_SUCCESS != md_pubcert_load(reg->store, MD_SG_DOMAINS, md->name, &certs, p)
+        || certs->nelts <= 0) {
+        return apr_time_now();
+    }
+    return cert_renew_at(reg, md, APR_ARRAY_IDX(certs, 0, const md_cert_t*), p);
+}
+
 int md_reg_should_renew(md_reg_t *reg, const md_t *md, apr_pool_t *p) 
 {
     apr_time_t renew_at;
@@ -690,45 +923,15 @@ apr_status_t md_reg_set_props(md_reg_t *reg, apr_pool_t *p, int can_http, int ca
     return APR_SUCCESS;
 }
 
-static md_t *find_closest_match(apr_array_header_t *mds, const md_t *md)
-{
-    md_t *candidate, *m;
-    apr_size_t cand_n, n;
-    int i;
-    
-    candidate = md_get_by_name(mds, md->name);
-    if (!candidate) {
-        /* try to find an instance that contains all domain names from md */ 
-        for (i = 0; i < mds->nelts; ++i) {
-            m = APR_ARRAY_IDX(mds, i, md_t *);
-            if (md_contains_domains(m, md)) {
-                return m;
-            }
-        }
-        /* no matching name and no md in the list has all domains.
-         * We consider that managed domain as closest match that contains at least one
-         * domain name from md, ONLY if there is no other one that also has.
-         */
-        cand_n = 0;
-        for (i = 0; i < mds->nelts; ++i) {
-            m = APR_ARRAY_IDX(mds, i, md_t *);
-            n = md_common_name_count(md, m);
-            if (n > cand_n) {
-                candidate = m;
-                cand_n = n;
-            }
-        }
-    }
-    return candidate;
-}
-
 typedef struct {
     apr_pool_t *p;
     apr_array_header_t *master_mds;
     apr_array_header_t *store_names;
+    apr_hash_t *assigned;          /* lowercase names of store MDs that are in master_mds */
     apr_array_header_t *maybe_new_mds;
     apr_array_header_t *new_mds;
     apr_array_header_t *unassigned_mds;
+    apr_hash_t *renamed;           /* names of unassigned MDs taken by a rename */
 } sync_ctx_v2;
 
 static int iter_add_name(void *baton, const char *dir, const char *name, 
@@ -760,9 +963,11 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
 {
     sync_ctx_v2 ctx;
     apr_status_t rv;
+    apr_hash_t *store_set;
+    md_index_t *unassigned;
     md_t *md, *oldmd;
-    const char *name;
-    int i, idx;
+    const char *name, *key;
+    int i;
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "sync MDs, start");
      
@@ -772,6 +977,8 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
     ctx.maybe_new_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
     ctx.new_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
     ctx.unassigned_mds = apr_array_make(p, master_mds->nelts, sizeof(md_t*));
+    ctx.assigned = apr_hash_make(p);
+    ctx.renamed = apr_hash_make(p);
     
     rv = md_store_iter_names(iter_add_name, &ctx, reg->store, p, MD_SG_DOMAINS, "*");
     if (APR_SUCCESS != rv) {
@@ -779,35 +986,48 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
         goto leave;
     }
     
-    /* Get all MDs that are not already present in store */
+    /* Get all MDs that are not already present in store. Names match regardless
+     * of case, as they always did. */
+    store_set = apr_hash_make(p);
+    for (i = 0; i < ctx.store_names->nelts; ++i) {
+        name = APR_ARRAY_IDX(ctx.store_names, i, const char*);
+        key = md_util_str_tolower(apr_pstrdup(p, name));
+        apr_hash_set(store_set, key, APR_HASH_KEY_STRING, name);
+    }
     for (i = 0; i < ctx.master_mds->nelts; ++i) {
         md = APR_ARRAY_IDX(ctx.master_mds, i, md_t*);
-        idx = md_array_str_index(ctx.store_names, md->name, 0, 1);
-        if (idx < 0) {
+        key = md_util_str_tolower(apr_pstrdup(p, md->name));
+        if (apr_hash_get(store_set, key, APR_HASH_KEY_STRING)) {
+            apr_hash_set(ctx.assigned, key, APR_HASH_KEY_STRING, md);
+        }
+        else {
             APR_ARRAY_PUSH(ctx.maybe_new_mds, md_t*) = md;
-            md_array_remove_at(ctx.store_names, idx);
         }
     }
     
     if (ctx.maybe_new_mds->nelts == 0) goto leave; /* none new */
-    if (ctx.store_names->nelts == 0) goto leave;   /* all new */
+    if (ctx.store_names->nelts <= (int)apr_hash_count(ctx.assigned)) goto leave; /* all new */
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                   "sync MDs, %d potentially new MDs detected, looking for renames among "
                   "the %d unassigned store domains", (int)ctx.maybe_new_mds->nelts,
-                  (int)ctx.store_names->nelts);
+                  ctx.store_names->nelts - (int)apr_hash_count(ctx.assigned));
     for (i = 0; i < ctx.store_names->nelts; ++i) {
         name = APR_ARRAY_IDX(ctx.store_names, i, const char*);
+        key = md_util_str_tolower(apr_pstrdup(p, name));
+        if (apr_hash_get(ctx.assigned, key, APR_HASH_KEY_STRING)) continue;
         if (APR_SUCCESS == md_load(reg->store, MD_SG_DOMAINS, name, &md, p)) {
             APR_ARRAY_PUSH(ctx.unassigned_mds, md_t*) = md;
         } 
     }
+    /* find renames by the domains the old and new MDs have in common */
+    unassigned = md_index_make(p, ctx.unassigned_mds);
     
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
                   "sync MDs, %d MDs maybe new, checking store", (int)ctx.maybe_new_mds->nelts);
     for (i = 0; i < ctx.maybe_new_mds->nelts; ++i) {
         md = APR_ARRAY_IDX(ctx.maybe_new_mds, i, md_t*);
-        oldmd = find_closest_match(ctx.unassigned_mds, md);
+        oldmd = md_index_get_closest(unassigned, md, ctx.renamed, p);
         if (oldmd) {
             /* found the rename, move the domains and possible staging directory */
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
@@ -819,7 +1039,7 @@ apr_status_t md_reg_sync_start(md_reg_t *reg, apr_array_header_t *master_mds, ap
                 /* ignore it? */
             }
             md_store_rename(reg->store, p, MD_SG_STAGING, oldmd->name, md->name);
-            md_array_remove(ctx.unassigned_mds, oldmd);
+            apr_hash_set(ctx.renamed, oldmd->name, APR_HASH_KEY_STRING, oldmd);
         }
         else {
             APR_ARRAY_PUSH(ctx.new_mds, md_t*) = md;
@@ -900,14 +1120,18 @@ leave:
 
 apr_status_t md_reg_remove(md_reg_t *reg, apr_pool_t *p, const char *name, int archive)
 {
+    apr_status_t rv;
+    
     if (reg->domains_frozen) return APR_EACCES; 
-    return md_store_move(reg->store, p, MD_SG_DOMAINS, MD_SG_ARCHIVE, name, archive);
+    rv = md_store_move(reg->store, p, MD_SG_DOMAINS, MD_SG_ARCHIVE, name, archive);
+    if (APR_SUCCESS == rv) bulk_forget(reg, name);
+    return rv;
 }
 
 typedef struct {
     md_reg_t *reg;
     apr_pool_t *p;
-    apr_array_header_t *mds;
+    apr_hash_t *used;           /* names of the MDs in use */
 } cleanup_challenge_ctx;
  
 static apr_status_t cleanup_challenge_inspector(void *baton, const char *dir, const char *name, 
@@ -915,18 +1139,12 @@ static apr_status_t cleanup_challenge_inspector(void *baton, const char *dir, co
                                                 apr_pool_t *ptemp)
 {
     cleanup_challenge_ctx *ctx = baton;
-    const md_t *md;
-    int i, used;
     apr_status_t rv;
     
     (void)value;
     (void)vtype;
     (void)dir;
-    for (used = 0, i = 0; i < ctx->mds->nelts && !used; ++i) {
-        md = APR_ARRAY_IDX(ctx->mds, i, const md_t *);
-        used = !strcmp(name, md->name);
-    }
-    if (!used) {
+    if (!apr_hash_get(ctx->used, name, APR_HASH_KEY_STRING)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, 
                       "challenges/%s: not in use, purging", name);
         rv = md_store_purge(ctx->reg->store, ctx->p, MD_SG_CHALLENGES, name);
@@ -935,21 +1153,61 @@ static apr_status_t cleanup_challenge_inspector(void *baton, const char *dir, co
                           "challenges/%s: unable to purge", name);
         }
     }
+    else {
+        /* start the journal with what is left */
+        md_store_journal_add(ctx->reg->store, ptemp, MD_SG_CHALLENGES, name, NULL);
+    }
     return APR_SUCCESS;
 }
 
+static int cleanup_challenge_journaled(void *baton, const char *name, const char *aspect, 
+                                       apr_time_t *ptime, apr_pool_t *ptemp)
+{
+    cleanup_challenge_ctx *ctx = baton;
+    apr_status_t rv;
+    
+    (void)ptime;
+    if (apr_hash_get(ctx->used, name, APR_HASH_KEY_STRING)) {
+        /* keep it while it is there, renewals purge their challenges when done */
+        return md_store_get_modified(ctx->reg->store, MD_SG_CHALLENGES, 
+                                     name, aspect, ptemp) > 0;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, 
+                  "challenges/%s: not in use, purging", name);
+    rv = md_store_purge(ctx->reg->store, ptemp, MD_SG_CHALLENGES, name);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                      "challenges/%s: unable to purge", name);
+        return 1;
+    }
+    return 0;
+}
+
 apr_status_t md_reg_cleanup_challenges(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, 
                                        apr_array_header_t *mds)
 {
     apr_status_t rv;
     cleanup_challenge_ctx ctx;
+    const md_t *md;
+    int i;
 
     (void)p;
     ctx.reg = reg;
     ctx.p = ptemp;
-    ctx.mds = mds;
-    rv = md_store_iter_names(cleanup_challenge_inspector, &ctx, reg->store, ptemp, 
-                             MD_SG_CHALLENGES, "*");
+    ctx.used = apr_hash_make(ptemp);
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        apr_hash_set(ctx.used, md->name, APR_HASH_KEY_STRING, md);
+    }
+    /* Only challenges created since the last cleanup are in the journal. Without 
+     * one, e.g. in a store from an earlier version, look at all and start it. */
+    rv = md_store_journal_cleanup(reg->store, ptemp, MD_SG_CHALLENGES, 
+                                  cleanup_challenge_journaled, &ctx);
+    if (APR_STATUS_IS_ENOENT(rv) || APR_STATUS_IS_ENOTIMPL(rv)) {
+        md_store_journal_add(reg->store, ptemp, MD_SG_CHALLENGES, NULL, NULL);
+        rv = md_store_iter_names(cleanup_challenge_inspector, &ctx, reg->store, ptemp, 
+                                 MD_SG_CHALLENGES, "*");
+    }
     return rv;
 }
 
@@ -987,6 +1245,9 @@ static apr_status_t run_init(void *baton, apr_pool_t *p, ...)
     driver->md = md;
     driver->can_http = reg->can_http;
     driver->can_https = reg->can_https;
+    driver->nonblocking = reg->nonblocking;
+    driver->keypool = reg->keypool;
+    driver->ca_limits = reg->ca_limits;
     
     s = apr_table_get(driver->env, MD_KEY_ACTIVATION_DELAY);
     if (!s || APR_SUCCESS != md_duration_parse(&driver->activation_delay, s, "d")) {
@@ -1105,6 +1366,7 @@ static apr_status_t run_load_staging(void *baton, apr_pool_t *p, apr_pool_t *pte
     if (APR_SUCCESS != rv) goto out;
     
     apr_hash_set(reg->certs, md->name, (apr_ssize_t)strlen(md->name), NULL);
+    apr_hash_set(reg->cred_files, md->name, (apr_ssize_t)strlen(md->name), NULL);
     md_result_activity_setn(result, "preloading staged to tmp");
     rv = driver->proto->preload(driver, MD_SG_TMP, result);
     if (APR_SUCCESS != rv) goto out;
@@ -1144,6 +1406,116 @@ apr_status_t md_reg_load_staging(md_reg_t *reg, const md_t *md, apr_table_t *env
     return md_util_pool_vdo(run_load_staging, reg, p, md, env, result, NULL);
 }
 
+typedef struct {
+    md_reg_t *reg;
+    apr_array_header_t *mds;
+    volatile apr_uint32_t next;     /* index of the next md to load */
+    const md_pubcert_t **pubcerts;  /* loaded certs, by md index */
+    apr_status_t *rvs;              /* load result, by md index */
+} preload_ctx;
+
+typedef struct {
+    preload_ctx *ctx;
+    apr_pool_t *p;                  /* the worker's own pool, lives as long as the registry */
+} preload_worker_ctx;
+
+static void preload_run(preload_ctx *ctx, apr_pool_t *p)
+{
+    const md_t *md;
+    apr_uint32_t i;
+    
+    while ((i = apr_atomic_inc32(&ctx->next)) < (apr_uint32_t)ctx->mds->nelts) {
+        if (APR_SUCCESS == ctx->rvs[i]) continue;
+        md = APR_ARRAY_IDX(ctx->mds, i, const md_t*);
+        ctx->rvs[i] = md_util_pool_vdo(pubcert_load, ctx->reg, p, &ctx->pubcerts[i], 
+                                       MD_SG_DOMAINS, md, NULL);
+    }
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC preload_worker(apr_thread_t *thread, void *data)
+{
+    preload_worker_ctx *wctx = data;
+    
+    preload_run(wctx->ctx, wctx->p); 
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+apr_status_t md_reg_preload_pubcerts(md_reg_t *reg, apr_array_header_t *mds, 
+                                     int threads, apr_pool_t *p)
+{
+    preload_ctx ctx;
+    const md_t *md;
+    const char *name;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+#if APR_HAS_THREADS
+    apr_thread_t **workers;
+    preload_worker_ctx *wctxs;
+    apr_status_t trv;
+    int started = 0;
+#endif
+    
+    if (reg->domains_frozen) return APR_EACCES;
+    if (mds->nelts <= 0) return APR_SUCCESS;
+    
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.reg = reg;
+    ctx.mds = mds;
+    ctx.pubcerts = apr_pcalloc(p, sizeof(md_pubcert_t*) * (apr_size_t)mds->nelts);
+    ctx.rvs = apr_pcalloc(p, sizeof(apr_status_t) * (apr_size_t)mds->nelts);
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t*);
+        /* APR_SUCCESS marks mds already in the cache */
+        ctx.rvs[i] = apr_hash_get(reg->certs, md->name, (apr_ssize_t)strlen(md->name))? 
+                     APR_SUCCESS : APR_EINCOMPLETE;
+    }
+    
+    if (threads > mds->nelts) threads = mds->nelts;
+#if APR_HAS_THREADS
+    workers = apr_pcalloc(p, sizeof(apr_thread_t*) * (apr_size_t)threads);
+    wctxs = apr_pcalloc(p, sizeof(preload_worker_ctx) * (apr_size_t)threads);
+    for (i = 0; i < threads; ++i) {
+        wctxs[i].ctx = &ctx;
+        if (APR_SUCCESS != (rv = apr_pool_create(&wctxs[i].p, reg->p))) break;
+        apr_pool_tag(wctxs[i].p, "md_reg_preload");
+        if (APR_SUCCESS != (rv = apr_thread_create(&workers[i], NULL, preload_worker, 
+                                                   &wctxs[i], p))) break;
+        ++started;
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "preload certificates: started %d of %d threads", started, threads);
+        rv = APR_SUCCESS;
+    }
+    if (started < 1) preload_run(&ctx, reg->p);
+    for (i = 0; i < started; ++i) {
+        apr_thread_join(&trv, workers[i]);
+    }
+#else
+    (void)threads;
+    preload_run(&ctx, reg->p);
+#endif
+
+    /* Merge in mds order, so the cache has the same content as when loaded serially */
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t*);
+        if (APR_SUCCESS == ctx.rvs[i] && !ctx.pubcerts[i]) continue; /* was cached */
+        name = apr_pstrdup(reg->p, md->name);
+        if (APR_SUCCESS == ctx.rvs[i]) {
+            apr_hash_set(reg->certs, name, (apr_ssize_t)strlen(name), ctx.pubcerts[i]);
+        }
+        else if (APR_STATUS_IS_ENOENT(ctx.rvs[i])) {
+            /* We cache it missing with an empty record */
+            apr_hash_set(reg->certs, name, (apr_ssize_t)strlen(name), 
+                         apr_pcalloc(reg->p, sizeof(md_pubcert_t)));
+        }
+    }
+    return rv;
+}
+
 apr_status_t md_reg_freeze_domains(md_reg_t *reg, apr_array_header_t *mds)
 {
     apr_status_t rv = APR_SUCCESS;
@@ -1179,6 +1551,26 @@ void md_reg_set_notify_cb(md_reg_t *reg, md_job_notify_cb *cb, void *baton)
     reg->notify_ctx = baton;
 }
 
+void md_reg_set_renew_spread(md_reg_t *reg, int percent)
+{
+    reg->renew_spread = (percent > 0)? ((percent > 50)? 50 : percent) : 0;
+}
+
+void md_reg_set_nonblocking(md_reg_t *reg, int nonblocking)
+{
+    reg->nonblocking = nonblocking;
+}
+
+void md_reg_set_keypool(md_reg_t *reg, struct md_keypool_t *keypool)
+{
+    reg->keypool = keypool;
+}
+
+struct md_keypool_t *md_reg_keypool_get(md_reg_t *reg)
+{
+    return reg->keypool;
+}
+
 md_job_t *md_reg_job_make(md_reg_t *reg, const char *mdomain, apr_pool_t *p)
 {
     md_job_t *job;
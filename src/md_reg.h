@@ -22,6 +22,8 @@ struct apr_array_header_t;
 struct md_pkey_t;
 struct md_cert_t;
 struct md_result_t;
+struct md_keypool_t;
+struct md_acme_limits_t;
 
 #include "md_store.h"
 
@@ -107,6 +109,19 @@ apr_status_t md_reg_update(md_reg_t *reg, apr_pool_t *p,
                            const char *name, const md_t *md, 
                            int fields, int check_consistency);
 
+/**
+ * Start a bulk of md_reg_add() and md_reg_update() calls. The domains of all
+ * managed domains in the store are read once and kept, so that the overlap checks 
+ * of each change do not read the whole store again. Changes made to the store
+ * other than through this registry are not seen until md_reg_bulk_end().
+ */
+apr_status_t md_reg_bulk_begin(md_reg_t *reg, apr_pool_t *p);
+
+/**
+ * End the bulk mode, if started, and free the remembered domains.
+ */
+void md_reg_bulk_end(md_reg_t *reg);
+
 /**
  * Get the chain of public certificates of the managed domain md, starting with the cert
  * of the domain and going up the issuers. Returns APR_ENOENT when not available. 
@@ -116,6 +131,7 @@ apr_status_t md_reg_get_pubcert(const md_pubcert_t **ppubcert, md_reg_t *reg,
 
 /**
  * Get the filenames of private key and pubcert of the MD - if they exist.
+ * For MD_SG_DOMAINS, the result is remembered in the registry.
  * @return APR_ENOENT if one or both do not exist.
  */
 apr_status_t md_reg_get_cred_files(const char **pkeyfile, const char **pcertfile,
@@ -159,6 +175,16 @@ apr_status_t md_reg_cleanup_challenges(md_reg_t *reg, apr_pool_t *p, apr_pool_t
  */
 apr_status_t md_reg_freeze_domains(md_reg_t *reg, apr_array_header_t *mds);
 
+/**
+ * Load the certificates of all given MDs into the registry cache, using up
+ * to `threads` threads for reading and parsing. Results are added in the order
+ * of mds, independent of which thread finished first. MDs that already have a
+ * cached certificate are skipped, failures are left for md_reg_get_pubcert() to 
+ * report.
+ */
+apr_status_t md_reg_preload_pubcerts(md_reg_t *reg, apr_array_header_t *mds, 
+                                     int threads, apr_pool_t *p);
+
 /**
  * Return if the certificate of the MD shoud be renewed. This includes reaching
  * the renewal window of an otherwise valid certificate. It return also !0 iff
@@ -172,6 +198,13 @@ int md_reg_should_renew(md_reg_t *reg, const md_t *md, apr_pool_t *p);
  */
 apr_time_t md_reg_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p);
 
+/**
+ * As md_reg_renew_at(), but for the certificate currently in the store. When
+ * servers share a store, another one may have renewed the MD and activated the
+ * new certificate after this server has started.
+ */
+apr_time_t md_reg_store_renew_at(md_reg_t *reg, const md_t *md, apr_pool_t *p);
+
 /**
  * Return if a warning should be issued about the certificate expiration. 
  * This applies the configured warn window to the remaining lifetime of the 
@@ -204,6 +237,9 @@ struct md_proto_driver_t {
     int can_http;
     int can_https;
     int reset;
+    int nonblocking;   /* return APR_EAGAIN instead of waiting on the CA */
+    struct md_keypool_t *keypool; /* pre-generated private keys or NULL */
+    struct md_acme_limits_t *ca_limits; /* request limits per CA, shared by all MDs */
     apr_interval_time_t activation_delay;
 };
 
@@ -233,7 +269,9 @@ apr_status_t md_reg_test_init(md_reg_t *reg, const md_t *md, struct apr_table_t
 /**
  * Obtain new credentials for the given managed domain in STAGING.
  *
- * @return APR_SUCCESS if new credentials have been staged successfully
+ * @return APR_SUCCESS if new credentials have been staged successfully,
+ *         APR_EAGAIN for a non-blocking registry, when the CA is still working
+ *         and the renewal should be resumed at result->ready_at.
  */
 apr_status_t md_reg_renew(md_reg_t *reg, const md_t *md, 
                           struct apr_table_t *env, int reset, 
@@ -255,6 +293,27 @@ void md_reg_set_renew_window_default(md_reg_t *reg, md_timeslice_t *renew_window
 void md_reg_set_warn_window_default(md_reg_t *reg, md_timeslice_t *warn_window);
 
 void md_reg_set_notify_cb(md_reg_t *reg, md_job_notify_cb *cb, void *baton);
+
+/**
+ * When non-blocking, renewals do not wait for the CA to validate challenges
+ * or issue certificates. They persist where they are and return APR_EAGAIN
+ * with the time to continue. Default is to wait.
+ */
+void md_reg_set_nonblocking(md_reg_t *reg, int nonblocking);
+
+/**
+ * Spread renewals over the first percent (at most 50) of the renew window, by an
+ * amount derived from the MD name. Renewals do not start later than warnings 
+ * about the expiry. 0 disables this, the default.
+ */
+void md_reg_set_renew_spread(md_reg_t *reg, int percent);
+
+/**
+ * Take new private keys for renewals from the given pool of pre-generated
+ * keys, when it has a matching one. NULL disables the use of a pool.
+ */
+void md_reg_set_keypool(md_reg_t *reg, struct md_keypool_t *keypool);
+struct md_keypool_t *md_reg_keypool_get(md_reg_t *reg);
 struct md_job_t *md_reg_job_make(md_reg_t *reg, const char *mdomain, apr_pool_t *p);
 
 #endif /* mod_md_md_reg_h */
@@ -141,6 +141,43 @@ void md_result_delay_set(md_result_t *result, apr_time_t ready_at)
     on_change(result);
 }
 
+void md_result_timings_set(md_result_t *result, const md_json_t *timings)
+{
+    result->timings = timings? md_json_clone(result->p, timings) : NULL;
+}
+
+static void phase_stop(md_result_t *result, apr_time_t now)
+{
+    long ms;
+    
+    if (!result->phase) return;
+    if (!result->phases) result->phases = md_json_create(result->p);
+    ms = (now > result->phase_start)? (long)apr_time_as_msec(now - result->phase_start) : 0;
+    ms += md_json_getl(result->phases, result->phase, NULL);
+    md_json_setl(ms, result->phases, result->phase, NULL);
+    result->phase = NULL;
+}
+
+void md_result_phase_start(md_result_t *result, const char *phase)
+{
+    apr_time_t now = apr_time_now();
+    
+    phase_stop(result, now);
+    result->phase = phase? apr_pstrdup(result->p, phase) : NULL;
+    result->phase_start = now;
+}
+
+void md_result_phase_end(md_result_t *result)
+{
+    phase_stop(result, apr_time_now());
+}
+
+void md_result_phases_clear(md_result_t *result)
+{
+    result->phases = NULL;
+    result->phase = NULL;
+}
+
 md_result_t*md_result_from_json(const struct md_json_t *json, apr_pool_t *p)
 {
     md_result_t *result;
@@ -154,6 +191,8 @@ md_result_t*md_result_from_json(const struct md_json_t *json, apr_pool_t *p)
     s = md_json_dups(p, json, MD_KEY_VALID_FROM, NULL);
     if (s && *s) result->ready_at = apr_date_parse_rfc(s);
     result->subproblems = md_json_dupj(p, json, MD_KEY_SUBPROBLEMS, NULL);
+    result->timings = md_json_dupj(p, json, MD_KEY_TIMINGS, NULL);
+    result->phases = md_json_dupj(p, json, MD_KEY_PHASES, NULL);
     return result;
 }
 
@@ -179,6 +218,12 @@ struct md_json_t *md_result_to_json(const md_result_t *result, apr_pool_t *p)
     if (result->subproblems) {
         md_json_setj(result->subproblems, json, MD_KEY_SUBPROBLEMS, NULL);
     }
+    if (result->timings) {
+        md_json_setj(result->timings, json, MD_KEY_TIMINGS, NULL);
+    }
+    if (result->phases) {
+        md_json_setj(result->phases, json, MD_KEY_PHASES, NULL);
+    }
     return json;
 }
 
@@ -211,6 +256,8 @@ void md_result_assign(md_result_t *dest, const md_result_t *src)
    dest->activity = src->activity;
    dest->ready_at = src->ready_at;
    dest->subproblems = src->subproblems;
+   dest->timings = src->timings;
+   dest->phases = src->phases;
 }
 
 void md_result_dup(md_result_t *dest, const md_result_t *src)
@@ -221,6 +268,8 @@ void md_result_dup(md_result_t *dest, const md_result_t *src)
    dest->activity = src->activity? apr_pstrdup(dest->p, src->activity) : NULL; 
    dest->ready_at = src->ready_at;
    dest->subproblems = src->subproblems? md_json_clone(dest->p, src->subproblems) : NULL;
+   dest->timings = src->timings? md_json_clone(dest->p, src->timings) : NULL;
+   dest->phases = src->phases? md_json_clone(dest->p, src->phases) : NULL;
    on_change(dest);
 }
 
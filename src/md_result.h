@@ -31,6 +31,10 @@ struct md_result_t {
     const char *problem;
     const char *detail;
     const struct md_json_t *subproblems;
+    const struct md_json_t *timings;   /* network timings per endpoint, see md_http */
+    struct md_json_t *phases;          /* milliseconds spent per phase of the run */
+    const char *phase;                 /* the phase timed at the moment or NULL */
+    apr_time_t phase_start;
     const char *activity;
     apr_time_t ready_at;
     md_result_change_cb *on_change;
@@ -57,6 +61,16 @@ void md_result_problem_printf(md_result_t *result, apr_status_t status,
 void md_result_printf(md_result_t *result, apr_status_t status, const char *fmt, ...);
 
 void md_result_delay_set(md_result_t *result, apr_time_t ready_at);
+void md_result_timings_set(md_result_t *result, const struct md_json_t *timings);
+
+/**
+ * Time the phases of a run. Starting a phase ends the one timed before. A phase
+ * entered more than once adds up its durations, in the order phases first started.
+ * Clearing forgets all phases, as is done when a job starts a new run.
+ */
+void md_result_phase_start(md_result_t *result, const char *phase);
+void md_result_phase_end(md_result_t *result);
+void md_result_phases_clear(md_result_t *result);
 
 md_result_t*md_result_from_json(const struct md_json_t *json, apr_pool_t *p);
 struct md_json_t *md_result_to_json(const md_result_t *result, apr_pool_t *p);
@@ -18,10 +18,14 @@
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_tables.h>
 #include <apr_time.h>
 #include <apr_date.h>
+#include <apr_shm.h>
+#include <apr_thread_mutex.h>
 
 #include "md_json.h"
 #include "md.h"
@@ -29,6 +33,7 @@
 #include "md_log.h"
 #include "md_ocsp.h"
 #include "md_store.h"
+#include "md_store_fs.h"
 #include "md_result.h"
 #include "md_reg.h"
 #include "md_util.h"
@@ -112,14 +117,30 @@ leave:
     return rv;
 }
 
+static apr_status_t log_load(md_json_t *jlog, md_store_t *store, md_store_group_t group, 
+                             const char *name, apr_size_t max, apr_pool_t *p);
+
 static apr_status_t job_loadj(md_json_t **pjson, md_store_group_t group, const char *name, 
                               struct md_reg_t *reg, int with_log, apr_pool_t *p)
 {
+    md_json_t *jlog;
     apr_status_t rv;
     
     md_store_t *store = md_reg_store_get(reg);
-    rv = md_store_load_json(store, group, name, MD_FN_JOB, pjson, p);
-    if (APR_SUCCESS == rv && !with_log) md_json_del(*pjson, MD_KEY_LOG, NULL);
+    rv = md_job_load_json(pjson, store, group, name, p);
+    if (APR_SUCCESS == rv) {
+        if (!with_log) {
+            md_json_del(*pjson, MD_KEY_LOG, NULL);
+        }
+        else {
+            /* entries not written to the ring yet come first, they are newer */
+            jlog = md_json_getj(*pjson, MD_KEY_LOG, NULL);
+            if (!jlog) jlog = md_json_create(p);
+            if (APR_SUCCESS == log_load(jlog, store, group, name, MD_JOB_LOG_MAX, p)) {
+                md_json_setj(jlog, *pjson, MD_KEY_LOG, NULL);
+            }
+        }
+    }
     return rv;
 }
 
@@ -208,6 +229,436 @@ apr_status_t md_status_get_json(md_json_t **pjson, apr_array_header_t *mds,
     return APR_SUCCESS;
 }
 
+apr_status_t md_status_write_json(md_json_writer_t *w, apr_array_header_t *mds, 
+                                  md_reg_t *reg, md_ocsp_reg_t *ocsp, apr_pool_t *p)
+{
+    md_json_t *mdj;
+    const md_t *md;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    int i;
+    
+    md_json_writer_sets(w, MD_KEY_VERSION, MOD_MD_VERSION);
+    if (APR_SUCCESS != (rv = md_json_writer_begin_array(w, MD_KEY_MDS))) goto leave;
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) goto leave;
+    for (i = 0; i < mds->nelts && APR_SUCCESS == rv; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        status_get_md_json(&mdj, md, reg, ocsp, 0, ptemp);
+        if (APR_SUCCESS == (rv = md_json_writer_setj(w, NULL, mdj))) {
+            rv = md_json_writer_flush(w, 0);
+        }
+        apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+    if (APR_SUCCESS == rv) rv = md_json_writer_end_array(w);
+leave:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* status cache */
+
+/* md_job_save() calls in this process */
+static volatile apr_uint32_t job_saves;
+
+/* The files the status of an MD is made from */
+#define MD_STATUS_STAMPS    4
+
+typedef struct {
+    const md_t *md;
+    md_json_t *mdj;                    /* from the pool of the document */
+    apr_time_t stamps[MD_STATUS_STAMPS]; /* modification times of the files */
+    apr_time_t expires;                /* when the status changes with time alone */
+    int states;                        /* MD_STATUS_SEL_* */
+    apr_time_t valid_until;            /* of the certificate, 0 if there is none */
+    apr_time_t renew_at;               /* 0 if not known */
+} status_entry_t;
+
+/* A version of the document. Callers of md_status_cache_get_json() share it with the
+ * cache, an update makes a new version and the old one goes when its last user does. */
+typedef struct {
+    apr_pool_t *p;                     /* document and entry JSON */
+    md_json_t *json;
+    int refs;                          /* 1 while current + 1 for each caller, cache locked */
+    md_status_cache_t *cache;
+} status_doc_t;
+
+struct md_status_cache_t {
+    apr_pool_t *p;
+    md_reg_t *reg;
+    md_ocsp_reg_t *ocsp;
+    int nentries;
+    status_entry_t *entries;           /* sorted by MD name */
+    status_doc_t *cur;                 /* replaced on update */
+    md_json_t *doc;                    /* the JSON of cur */
+    volatile apr_uint32_t generation;  /* incremented on invalidation */
+    apr_uint32_t doc_generation;
+    apr_uint32_t doc_saves;
+    apr_time_t checked_at;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+static int entry_name_cmp(const void *v1, const void *v2)
+{
+    return strcmp(((const status_entry_t*)v1)->md->name, ((const status_entry_t*)v2)->md->name);
+}
+
+apr_status_t md_status_cache_create(md_status_cache_t **pcache, apr_pool_t *p,
+                                    apr_array_header_t *mds, md_reg_t *reg, 
+                                    md_ocsp_reg_t *ocsp)
+{
+    md_status_cache_t *cache;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    cache->p = p;
+    cache->reg = reg;
+    cache->ocsp = ocsp;
+    cache->nentries = mds->nelts;
+    cache->entries = apr_pcalloc(p, (apr_size_t)(mds->nelts + 1) * sizeof(status_entry_t));
+    for (i = 0; i < mds->nelts; ++i) {
+        cache->entries[i].md = APR_ARRAY_IDX(mds, i, const md_t*);
+    }
+    qsort(cache->entries, (size_t)cache->nentries, sizeof(status_entry_t), entry_name_cmp);
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pcache = (APR_SUCCESS == rv)? cache : NULL;
+    return rv;
+}
+
+void md_status_cache_invalidate(md_status_cache_t *cache)
+{
+    if (cache) apr_atomic_inc32(&cache->generation);
+}
+
+static void status_stamps(apr_time_t *stamps, const md_t *md, md_store_t *store, apr_pool_t *p)
+{
+    stamps[0] = md_store_get_modified(store, MD_SG_DOMAINS, md->name, MD_FN_PUBCERT, p);
+    stamps[1] = md_store_get_modified(store, MD_SG_STAGING, md->name, MD_FN_PUBCERT, p);
+    stamps[2] = md_store_get_modified(store, MD_SG_STAGING, md->name, MD_FN_JOB, p);
+    stamps[3] = md->stapling? 
+                md_store_get_modified(store, MD_SG_OCSP, md->name, MD_FN_JOB, p) : 0;
+}
+
+static apr_time_t status_expires(md_json_t *mdj, apr_time_t now)
+{
+    apr_time_t expires, renew_at;
+    
+    /* OCSP responses in memory may be updated without anything written by us */
+    expires = now + MD_STATUS_CACHE_MAX_AGE;
+    if (!md_json_getb(mdj, MD_KEY_RENEW, NULL)
+        && md_json_has_key(mdj, MD_KEY_RENEW_AT, NULL)) {
+        renew_at = md_json_get_time(mdj, MD_KEY_RENEW_AT, NULL);
+        if (renew_at > now && renew_at < expires) expires = renew_at;
+    }
+    return expires;
+}
+
+static int status_states(const md_t *md, md_json_t *mdj)
+{
+    apr_status_t last;
+    int states = 0;
+    
+    /* the same as md_status_take_stock() counts */
+    switch (md->state) {
+        case MD_S_COMPLETE: states |= MD_STATUS_SEL_COMPLETE; /* fall through */
+        case MD_S_INCOMPLETE:
+            if (md_json_getb(mdj, MD_KEY_RENEW, NULL)) {
+                states |= MD_STATUS_SEL_RENEWING;
+                last = (apr_status_t)md_json_getl(mdj, MD_KEY_RENEWAL, MD_KEY_LAST, 
+                                                  MD_KEY_STATUS, NULL);
+                if (md_json_getl(mdj, MD_KEY_RENEWAL, MD_KEY_ERRORS, NULL) > 0
+                    || (APR_SUCCESS != last && !APR_STATUS_IS_EAGAIN(last))) {
+                    states |= MD_STATUS_SEL_ERRORED;
+                }
+                else if (md_json_getb(mdj, MD_KEY_RENEWAL, MD_KEY_FINISHED, NULL)) {
+                    states |= MD_STATUS_SEL_READY;
+                }
+            }
+            break;
+        default: 
+            states |= MD_STATUS_SEL_ERRORED; 
+            break;
+    }
+    return states;
+}
+
+/* Drop a reference to the document version, called with the lock held. */
+static void doc_release(status_doc_t *sdoc)
+{
+    if (--sdoc->refs <= 0) apr_pool_destroy(sdoc->p);
+}
+
+static apr_status_t cache_update(md_status_cache_t *cache, apr_time_t now, apr_pool_t *p)
+{
+    apr_time_t stamps[MD_STATUS_STAMPS];
+    status_entry_t *e;
+    md_json_t *doc, *mdj;
+    md_store_t *store;
+    status_doc_t *sdoc;
+    apr_pool_t *pdoc, *ptemp;
+    apr_status_t rv;
+    int i, updated = 0;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&pdoc, cache->p))) return rv;
+    apr_pool_tag(pdoc, "md_status_cache");
+    sdoc = apr_pcalloc(pdoc, sizeof(*sdoc));
+    sdoc->p = pdoc;
+    sdoc->cache = cache;
+    sdoc->refs = 1;
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        apr_pool_destroy(pdoc);
+        return rv;
+    }
+    cache->doc_generation = apr_atomic_read32(&cache->generation);
+    cache->doc_saves = apr_atomic_read32(&job_saves);
+    cache->checked_at = now;
+    
+    store = md_reg_store_get(cache->reg);
+    doc = md_json_create(pdoc);
+    md_json_sets(MOD_MD_VERSION, doc, MD_KEY_VERSION, NULL);
+    for (i = 0; i < cache->nentries; ++i) {
+        e = &cache->entries[i];
+        status_stamps(stamps, e->md, store, ptemp);
+        if (e->mdj && now < e->expires && !memcmp(stamps, e->stamps, sizeof(stamps))) {
+            /* shares the unchanged values with the old document */
+            mdj = md_json_copy(pdoc, e->mdj);
+        }
+        else {
+            status_get_md_json(&mdj, e->md, cache->reg, cache->ocsp, 0, ptemp);
+            mdj = md_json_copy(pdoc, mdj);
+            memcpy(e->stamps, stamps, sizeof(stamps));
+            e->expires = status_expires(mdj, now);
+            e->states = status_states(e->md, mdj);
+            e->valid_until = md_json_get_time(mdj, MD_KEY_CERT, MD_KEY_VALID, MD_KEY_UNTIL, NULL);
+            e->renew_at = md_json_get_time(mdj, MD_KEY_RENEW_AT, NULL);
+            ++updated;
+        }
+        e->mdj = mdj;
+        md_json_addj(mdj, doc, MD_KEY_MDS, NULL);
+        apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+    
+    /* a version callers still use stays, the new one shares its unchanged values */
+    if (cache->cur) doc_release(cache->cur);
+    sdoc->json = doc;
+    cache->cur = sdoc;
+    cache->doc = doc;
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "status cache: %d of %d MDs updated", 
+                  updated, cache->nentries);
+    return APR_SUCCESS;
+}
+
+static void cache_lock(md_status_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+static void cache_unlock(md_status_cache_t *cache)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#else
+    (void)cache;
+#endif
+}
+
+/* Update the document if changes may have happened, called with the lock held. */
+static apr_status_t cache_check(md_status_cache_t *cache, apr_pool_t *p)
+{
+    apr_time_t now = apr_time_now();
+    
+    if (!cache->doc 
+        || cache->doc_generation != apr_atomic_read32(&cache->generation)
+        || cache->doc_saves != apr_atomic_read32(&job_saves)
+        || now - cache->checked_at >= MD_STATUS_CACHE_CHECK
+        || now < cache->checked_at) {
+        return cache_update(cache, now, p);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t doc_release_cb(void *data)
+{
+    status_doc_t *sdoc = data;
+    md_status_cache_t *cache = sdoc->cache;
+    
+    cache_lock(cache);
+    doc_release(sdoc);
+    cache_unlock(cache);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_status_cache_get_json(md_json_t **pjson, md_status_cache_t *cache, 
+                                      apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    *pjson = NULL;
+    cache_lock(cache);
+    rv = cache_check(cache, p);
+    if (cache->cur) {
+        /* The wrapper is made in p, callers allocate from the pool of the JSON they 
+         * hold and the pool of the document is not to be touched outside the lock.
+         * It is released first, cleanups run last registered first. */
+        ++cache->cur->refs;
+        apr_pool_cleanup_register(p, cache->cur, doc_release_cb, apr_pool_cleanup_null);
+        *pjson = md_json_dupj(p, cache->doc, NULL);
+    }
+    cache_unlock(cache);
+    return (*pjson)? APR_SUCCESS : rv;
+}
+
+apr_status_t md_status_cache_write_json(md_json_writer_t *w, md_status_cache_t *cache, 
+                                        apr_pool_t *p)
+{
+    apr_status_t rv;
+    int i, end;
+    
+    cache_lock(cache);
+    rv = cache_check(cache, p);
+    cache_unlock(cache);
+    if (APR_SUCCESS != rv && !cache->doc) return rv;
+    
+    md_json_writer_sets(w, MD_KEY_VERSION, MOD_MD_VERSION);
+    rv = md_json_writer_begin_array(w, MD_KEY_MDS);
+    for (i = 0; i < cache->nentries && APR_SUCCESS == rv; ) {
+        /* the entries are fixed, updates only replace their JSON */
+        cache_lock(cache);
+        for (end = i + MD_STATUS_WRITE_BATCH; i < end && i < cache->nentries; ++i) {
+            if (cache->entries[i].mdj 
+                && APR_SUCCESS != (rv = md_json_writer_setj(w, NULL, cache->entries[i].mdj))) {
+                break;
+            }
+        }
+        cache_unlock(cache);
+        if (APR_SUCCESS == rv) rv = md_json_writer_flush(w, 0);
+    }
+    if (APR_SUCCESS == rv) rv = md_json_writer_end_array(w);
+    return rv;
+}
+
+apr_status_t md_status_cache_iter(md_status_cache_iter_cb *cb, void *baton,
+                                  md_status_cache_t *cache, apr_pool_t *p)
+{
+    apr_status_t rv;
+    int i;
+    
+    cache_lock(cache);
+    if (APR_SUCCESS != (rv = cache_check(cache, p)) && !cache->doc) goto leave;
+    rv = APR_SUCCESS;
+    for (i = 0; i < cache->nentries; ++i) {
+        if (cache->entries[i].mdj 
+            && !cb(baton, cache->entries[i].md, cache->entries[i].states, 
+                   cache->entries[i].mdj)) break;
+    }
+leave:
+    cache_unlock(cache);
+    return rv;
+}
+
+static int entry_valid_until_cmp(const void *v1, const void *v2)
+{
+    const status_entry_t *e1 = *(const status_entry_t**)v1, *e2 = *(const status_entry_t**)v2;
+    
+    if (e1->valid_until != e2->valid_until) return (e1->valid_until < e2->valid_until)? -1 : 1;
+    return strcmp(e1->md->name, e2->md->name);
+}
+
+static int entry_renew_at_cmp(const void *v1, const void *v2)
+{
+    const status_entry_t *e1 = *(const status_entry_t**)v1, *e2 = *(const status_entry_t**)v2;
+    
+    if (e1->renew_at != e2->renew_at) return (e1->renew_at < e2->renew_at)? -1 : 1;
+    return strcmp(e1->md->name, e2->md->name);
+}
+
+apr_status_t md_status_cache_query(md_json_t **pjson, md_status_cache_t *cache, 
+                                   const md_status_query_t *query, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_array_header_t *selected, *page;
+    status_entry_t *e, *tmp;
+    apr_time_t expire_before = 0;
+    apr_size_t plen = 0;
+    apr_status_t rv;
+    int i, lo, hi, mid, end;
+    
+    *pjson = NULL;
+    cache_lock(cache);
+    if (APR_SUCCESS != (rv = cache_check(cache, p)) && !cache->doc) goto leave;
+    rv = APR_SUCCESS;
+    
+    /* entries are sorted by name, all with the prefix are in one range */
+    lo = 0;
+    if (query->prefix && *query->prefix) {
+        plen = strlen(query->prefix);
+        hi = cache->nentries;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (strcmp(cache->entries[mid].md->name, query->prefix) < 0) lo = mid + 1;
+            else hi = mid;
+        }
+    }
+    if (query->expires_within > 0) expire_before = apr_time_now() + query->expires_within;
+    
+    selected = apr_array_make(p, 100, sizeof(status_entry_t*));
+    for (i = lo; i < cache->nentries; ++i) {
+        e = &cache->entries[i];
+        if (plen && strncmp(e->md->name, query->prefix, plen)) break;
+        if (query->states && !(e->states & query->states)) continue;
+        if (expire_before && (!e->valid_until || e->valid_until > expire_before)) continue;
+        APR_ARRAY_PUSH(selected, status_entry_t*) = e;
+    }
+    switch (query->sort) {
+        case MD_STATUS_SORT_VALID_UNTIL:
+            qsort(selected->elts, (size_t)selected->nelts, sizeof(status_entry_t*), 
+                  entry_valid_until_cmp);
+            break;
+        case MD_STATUS_SORT_RENEW_AT:
+            qsort(selected->elts, (size_t)selected->nelts, sizeof(status_entry_t*), 
+                  entry_renew_at_cmp);
+            break;
+        default:
+            break;
+    }
+    if (query->descending) {
+        for (lo = 0, hi = selected->nelts - 1; lo < hi; ++lo, --hi) {
+            tmp = APR_ARRAY_IDX(selected, lo, status_entry_t*);
+            APR_ARRAY_IDX(selected, lo, status_entry_t*) = APR_ARRAY_IDX(selected, hi, status_entry_t*);
+            APR_ARRAY_IDX(selected, hi, status_entry_t*) = tmp;
+        }
+    }
+    
+    json = md_json_create(p);
+    md_json_sets(MOD_MD_VERSION, json, MD_KEY_VERSION, NULL);
+    md_json_setl(selected->nelts, json, MD_KEY_TOTAL, NULL);
+    md_json_setl(query->offset, json, MD_KEY_OFFSET, NULL);
+    md_json_setl(query->limit, json, MD_KEY_LIMIT, NULL);
+    page = apr_array_make(p, (query->limit > 0)? query->limit : 100, sizeof(md_json_t*));
+    end = (query->limit > 0 && query->limit < selected->nelts - query->offset)? 
+          query->offset + query->limit : selected->nelts;
+    for (i = (query->offset > 0)? query->offset : 0; i < end; ++i) {
+        e = APR_ARRAY_IDX(selected, i, status_entry_t*);
+        APR_ARRAY_PUSH(page, md_json_t*) = e->mdj;
+    }
+    /* copies the MDs on the page, an empty array if there are none */
+    md_json_seta(page, md_json_clone_to, NULL, json, MD_KEY_MDS, NULL);
+    *pjson = json;
+leave:
+    cache_unlock(cache);
+    return rv;
+}
+
 /**************************************************************************************************/
 /* drive job persistence */
 
@@ -219,7 +670,7 @@ md_job_t *md_job_make(apr_pool_t *p, md_store_t *store,
     job->mdomain = apr_pstrdup(p, name);
     job->store = store;
     job->p = p;
-    job->max_log = 128;
+    job->max_log = MD_JOB_LOG_MAX;
     return job;
 }
 
@@ -228,21 +679,26 @@ void md_job_set_group(md_job_t *job, md_store_group_t group)
     job->group = group;
 }
 
+static const md_json_field_t job_fields[] = {
+    MD_JSON_FIELD(MD_KEY_FINISHED, MD_JSON_FIELD_BOOL, md_job_t, finished),
+    MD_JSON_FIELD(MD_KEY_NOTIFIED, MD_JSON_FIELD_BOOL, md_job_t, notified),
+    MD_JSON_FIELD(MD_KEY_ERRORS, MD_JSON_FIELD_INT, md_job_t, error_runs),
+};
+
 static void md_job_from_json(md_job_t *job, md_json_t *json, apr_pool_t *p)
 {
     const char *s;
     
     /* not good, this is malloced from a temp pool */
     /*job->mdomain = md_json_gets(json, MD_KEY_NAME, NULL);*/
-    job->finished = md_json_getb(json, MD_KEY_FINISHED, NULL);
-    job->notified = md_json_getb(json, MD_KEY_NOTIFIED, NULL);
+    md_json_get_fields(job, job_fields, sizeof(job_fields)/sizeof(job_fields[0]), json, NULL, p);
     s = md_json_dups(p, json, MD_KEY_NEXT_RUN, NULL);
     if (s && *s) job->next_run = apr_date_parse_rfc(s);
     s = md_json_dups(p, json, MD_KEY_LAST_RUN, NULL);
     if (s && *s) job->last_run = apr_date_parse_rfc(s);
     s = md_json_dups(p, json, MD_KEY_VALID_FROM, NULL);
     if (s && *s) job->valid_from = apr_date_parse_rfc(s);
-    job->error_runs = (int)md_json_getl(json, MD_KEY_ERRORS, NULL);
+    job->last_duration = apr_time_from_msec(md_json_getl(json, MD_KEY_LAST_DURATION, NULL));
     if (md_json_has_key(json, MD_KEY_LAST, NULL)) {
         job->last_result = md_result_from_json(md_json_getcj(json, MD_KEY_LAST, NULL), p);
     }
@@ -270,6 +726,9 @@ static void job_to_json(md_json_t *json, const md_job_t *job,
         md_json_sets(ts, json, MD_KEY_VALID_FROM, NULL);
     }
     md_json_setl(job->error_runs, json, MD_KEY_ERRORS, NULL);
+    if (job->last_duration > 0) {
+        md_json_setl((long)apr_time_as_msec(job->last_duration), json, MD_KEY_LAST_DURATION, NULL);
+    }
     if (!result) result = job->last_result;
     if (result) {
         md_json_setj(md_result_to_json(result, p), json, MD_KEY_LAST, NULL);
@@ -282,41 +741,525 @@ apr_status_t md_job_load(md_job_t *job)
     md_json_t *jprops;
     apr_status_t rv;
     
-    rv = md_store_load_json(job->store, job->group, job->mdomain, MD_FN_JOB, &jprops, job->p);
+    rv = md_job_load_json(&jprops, job->store, job->group, job->mdomain, job->p);
     if (APR_SUCCESS == rv) {
         md_job_from_json(job, jprops, job->p);
     }
     return rv;
 }
 
+static int wb_has_pending(md_store_group_t group, const char *name, apr_pool_t *p);
+
+apr_status_t md_job_refresh(md_job_t *job)
+{
+    apr_pool_t *ptemp;
+    apr_time_t mtime;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, job->p))) return rv;
+    if (wb_has_pending(job->group, job->mdomain, ptemp)) goto leave;
+    mtime = md_store_get_modified(job->store, job->group, job->mdomain, MD_FN_JOB, ptemp);
+    if (mtime && mtime == job->file_mtime) goto leave;
+    if (APR_SUCCESS == (rv = md_job_load(job))) {
+        job->file_mtime = mtime;
+    }
+leave:
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+/**************************************************************************************************/
+/* job write behind */
+
+typedef struct {
+    apr_pool_t *p;                     /* of the entry, destroyed once written */
+    md_store_t *store;
+    md_store_group_t group;
+    const char *name;
+    md_json_t *jprops;
+} job_pending_t;
+
+static apr_pool_t *wb_pool;
+static apr_hash_t *wb_pending;         /* "<group>/<name>" -> job_pending_t*, NULL if disabled */
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *wb_mutex;
+#endif
+
+static void wb_lock(void)
+{
+#if APR_HAS_THREADS
+    if (wb_mutex) apr_thread_mutex_lock(wb_mutex);
+#endif
+}
+
+static void wb_unlock(void)
+{
+#if APR_HAS_THREADS
+    if (wb_mutex) apr_thread_mutex_unlock(wb_mutex);
+#endif
+}
+
+static const char *wb_key(md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    return apr_psprintf(p, "%d/%s", (int)group, name);
+}
+
+/* Forget the state kept for a job, called with the lock held. */
+static void wb_drop(md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    job_pending_t *pe;
+    const char *key;
+    
+    if (!wb_pending) return;
+    key = wb_key(group, name, p);
+    if ((pe = apr_hash_get(wb_pending, key, APR_HASH_KEY_STRING))) {
+        apr_hash_set(wb_pending, key, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(pe->p);
+    }
+}
+
+apr_status_t md_job_write_behind_start(apr_pool_t *p)
+{
+    apr_allocator_t *allocator;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *amutex;
+#endif
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (!wb_pool) {
+        /* Renew workers and the flusher make and destroy entries in wb_pool. It gets an
+         * allocator of its own, with a mutex, as the one of p may have none. */
+        if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+        apr_allocator_max_free_set(allocator, 1);
+        if (APR_SUCCESS != (rv = apr_pool_create_ex(&wb_pool, p, NULL, allocator))) {
+            apr_allocator_destroy(allocator);
+            goto leave;
+        }
+        apr_allocator_owner_set(allocator, wb_pool);
+        apr_pool_tag(wb_pool, "md_job_write_behind");
+#if APR_HAS_THREADS
+        if (APR_SUCCESS != (rv = apr_thread_mutex_create(&amutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                         wb_pool))
+            || APR_SUCCESS != (rv = apr_thread_mutex_create(&wb_mutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                            wb_pool))) {
+            apr_pool_destroy(wb_pool);
+            wb_pool = NULL;
+            wb_mutex = NULL;
+            goto leave;
+        }
+        apr_allocator_mutex_set(allocator, amutex);
+#endif
+    }
+    wb_lock();
+    if (!wb_pending) wb_pending = apr_hash_make(wb_pool);
+    wb_unlock();
+leave:
+    return rv;
+}
+
+void md_job_write_behind_stop(apr_pool_t *p)
+{
+    md_job_write_behind_flush(p);
+    wb_lock();
+    wb_pending = NULL;
+    wb_unlock();
+}
+
+apr_status_t md_job_write_behind_flush(apr_pool_t *p)
+{
+    apr_hash_index_t *hi;
+    job_pending_t *pe;
+    const void *key;
+    void *val;
+    apr_status_t rv = APR_SUCCESS, rv2;
+    int n = 0;
+    
+    wb_lock();
+    if (wb_pending) {
+        for (hi = apr_hash_first(p, wb_pending); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, &key, NULL, &val);
+            pe = val;
+            rv2 = md_store_save_json(pe->store, p, pe->group, pe->name, MD_FN_JOB, pe->jprops, 0);
+            if (APR_SUCCESS != rv2) rv = rv2;
+            apr_hash_set(wb_pending, key, APR_HASH_KEY_STRING, NULL);
+            apr_pool_destroy(pe->p);
+            ++n;
+        }
+    }
+    wb_unlock();
+    if (n > 0) {
+        apr_atomic_inc32(&job_saves);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, p, "job write behind: %d saved", n);
+    }
+    return rv;
+}
+
+apr_status_t md_job_save_later(md_job_t *job, md_result_t *result, apr_pool_t *p)
+{
+    job_pending_t *pe;
+    md_json_t *jprops;
+    apr_pool_t *ptemp, *pp;
+    const char *key;
+    apr_status_t rv;
+    
+    if (!wb_pending) return APR_ENOTIMPL;
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) return rv;
+    jprops = md_json_create(ptemp);
+    job_to_json(jprops, job, result, ptemp);
+    
+    wb_lock();
+    if (!wb_pending) {
+        rv = APR_ENOTIMPL;
+        goto leave;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&pp, wb_pool))) goto leave;
+    pe = apr_pcalloc(pp, sizeof(*pe));
+    pe->p = pp;
+    pe->store = job->store;
+    pe->group = job->group;
+    pe->name = apr_pstrdup(pp, job->mdomain);
+    /* a copy of its own, the job goes on changing */
+    pe->jprops = md_json_clone(pp, jprops);
+    key = wb_key(job->group, job->mdomain, pp);
+    wb_drop(job->group, job->mdomain, ptemp);
+    apr_hash_set(wb_pending, key, APR_HASH_KEY_STRING, pe);
+leave:
+    wb_unlock();
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+static int wb_has_pending(md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    int pending = 0;
+    
+    wb_lock();
+    if (wb_pending) {
+        pending = (apr_hash_get(wb_pending, wb_key(group, name, p), APR_HASH_KEY_STRING) != NULL);
+    }
+    wb_unlock();
+    return pending;
+}
+
+apr_status_t md_job_load_json(md_json_t **pjson, md_store_t *store, 
+                              md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    job_pending_t *pe = NULL;
+    
+    wb_lock();
+    if (wb_pending) {
+        pe = apr_hash_get(wb_pending, wb_key(group, name, p), APR_HASH_KEY_STRING);
+        if (pe) *pjson = md_json_clone(p, pe->jprops);
+    }
+    wb_unlock();
+    if (pe) return APR_SUCCESS;
+    return md_store_load_json(store, group, name, MD_FN_JOB, pjson, p);
+}
+
+/**************************************************************************************************/
+/* job log ring */
+
+typedef struct {
+    apr_uint32_t seq;
+    const char *text;                  /* the entry, 0-terminated at the padding */
+    apr_size_t len;
+} log_slot_t;
+
+/* A slot is "%08x " seq, the JSON of the entry, space padding and a newline */
+#define LOG_SLOT_HEAD       9
+#define LOG_SLOT_TEXT_MAX   (MD_JOB_LOG_SLOT - LOG_SLOT_HEAD - 1)
+
+static int log_slot_cmp(const void *v1, const void *v2)
+{
+    const log_slot_t *s1 = v1, *s2 = v2;
+    
+    /* newest first */
+    if (s1->seq == s2->seq) return 0;
+    return (s1->seq > s2->seq)? -1 : 1;
+}
+
+static int log_slot_parse(log_slot_t *slot, char *s)
+{
+    char *end;
+    int i, c;
+    
+    slot->seq = 0;
+    for (i = 0; i < LOG_SLOT_HEAD - 1; ++i) {
+        c = s[i];
+        if (c >= '0' && c <= '9') slot->seq = (slot->seq << 4) + (apr_uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') slot->seq = (slot->seq << 4) + (apr_uint32_t)(c - 'a' + 10);
+        else return 0;
+    }
+    if (s[LOG_SLOT_HEAD - 1] != ' ') return 0;
+    end = s + MD_JOB_LOG_SLOT - 1;
+    while (end > s + LOG_SLOT_HEAD && end[-1] == ' ') --end;
+    *end = '\0';
+    slot->text = s + LOG_SLOT_HEAD;
+    slot->len = (apr_size_t)(end - slot->text);
+    return slot->len > 0;
+}
+
+/* Read the slots from the locked ring file f, newest first. */
+static apr_status_t log_scan(apr_array_header_t **pslots, apr_file_t *f, 
+                             apr_size_t max, apr_pool_t *p)
+{
+    apr_array_header_t *slots;
+    char *buf, *s;
+    apr_size_t len;
+    log_slot_t slot;
+    apr_status_t rv;
+    
+    *pslots = NULL;
+    len = max * MD_JOB_LOG_SLOT;
+    buf = apr_palloc(p, len);
+    rv = apr_file_read_full(f, buf, len, &len);
+    if (APR_EOF == rv) rv = APR_SUCCESS;
+    if (APR_SUCCESS != rv) goto leave;
+    
+    slots = apr_array_make(p, (int)(len / MD_JOB_LOG_SLOT) + 1, sizeof(log_slot_t));
+    for (s = buf; s + MD_JOB_LOG_SLOT <= buf + len; s += MD_JOB_LOG_SLOT) {
+        /* slots not written completely are skipped */
+        if (log_slot_parse(&slot, s)) APR_ARRAY_PUSH(slots, log_slot_t) = slot;
+    }
+    qsort(slots->elts, (size_t)slots->nelts, sizeof(log_slot_t), log_slot_cmp);
+    *pslots = slots;
+leave:
+    return rv;
+}
+
+/* Read the slots in the ring of a job, newest first. */
+static apr_status_t log_read(apr_array_header_t **pslots, md_store_t *store, 
+                             md_store_group_t group, const char *name, 
+                             apr_size_t max, apr_pool_t *p)
+{
+    apr_file_t *f;
+    const char *fname;
+    apr_status_t rv;
+    
+    *pslots = NULL;
+    rv = md_store_get_fname(&fname, store, group, name, MD_FN_JOB_LOG, p);
+    if (APR_SUCCESS != rv) goto leave;
+    rv = apr_file_open(&f, fname, APR_FOPEN_READ|APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+    if (APR_SUCCESS == (rv = apr_file_lock(f, APR_FLOCK_SHARED))) {
+        rv = log_scan(pslots, f, max, p);
+        apr_file_unlock(f);
+    }
+    apr_file_close(f);
+leave:
+    return rv;
+}
+
+/* Add the entries in the ring of a job to jlog, newest first. */
+static apr_status_t log_load(md_json_t *jlog, md_store_t *store, md_store_group_t group, 
+                             const char *name, apr_size_t max, apr_pool_t *p)
+{
+    apr_array_header_t *slots;
+    md_json_t *entry;
+    log_slot_t *slot;
+    apr_status_t rv;
+    int i;
+    
+    if (APR_SUCCESS != (rv = log_read(&slots, store, group, name, max, p))) goto leave;
+    for (i = 0; i < slots->nelts; ++i) {
+        slot = &APR_ARRAY_IDX(slots, i, log_slot_t);
+        if (APR_SUCCESS == md_json_readd(&entry, p, slot->text, slot->len)) {
+            md_json_addj(entry, jlog, MD_KEY_ENTRIES, NULL);
+        }
+    }
+leave:
+    return rv;
+}
+
+/* The entry as it fits into a slot, with its detail shortened if needed. */
+static const char *log_slot_text(md_json_t *entry, apr_pool_t *p)
+{
+    const char *s, *detail;
+    apr_size_t len, dlen, cut;
+    
+    s = md_json_writep(entry, p, MD_JSON_FMT_COMPACT);
+    while (s && (len = strlen(s)) > LOG_SLOT_TEXT_MAX) {
+        detail = md_json_gets(entry, MD_KEY_DETAIL, NULL);
+        if (!detail || !*detail) return NULL;
+        dlen = strlen(detail);
+        cut = len - LOG_SLOT_TEXT_MAX + 3;
+        if (dlen > cut) {
+            dlen -= cut;
+            /* do not end inside an UTF-8 sequence */
+            while (dlen > 0 && (detail[dlen] & 0xC0) == 0x80) --dlen;
+            detail = apr_pstrcat(p, apr_pstrndup(p, detail, dlen), "...", NULL);
+        }
+        else {
+            detail = "";
+        }
+        md_json_sets(detail, entry, MD_KEY_DETAIL, NULL);
+        s = md_json_writep(entry, p, MD_JSON_FMT_COMPACT);
+    }
+    return s;
+}
+
+static apr_status_t log_write(md_job_t *job, md_json_t *entry, apr_pool_t *p)
+{
+    apr_array_header_t *slots;
+    apr_file_t *f;
+    const char *fname, *text;
+    char buf[MD_JOB_LOG_SLOT];
+    apr_uint32_t seq;
+    apr_off_t offset;
+    apr_status_t rv;
+    
+    rv = md_store_get_fname(&fname, job->store, job->group, job->mdomain, MD_FN_JOB_LOG, p);
+    if (APR_SUCCESS != rv) goto leave;
+    /* entries that cannot be made to fit are dropped */
+    if (!(text = log_slot_text(entry, p))) goto leave;
+    
+    /* Writers in all processes continue after the newest slot in the file. The file 
+     * lock keeps other processes out, the write behind lock other threads. */
+    wb_lock();
+    rv = apr_file_open(&f, fname, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE
+                       |APR_FOPEN_BINARY, MD_FPROT_F_UALL_GREAD, p);
+    if (APR_SUCCESS != rv) goto unlock;
+    if (APR_SUCCESS != (rv = apr_file_lock(f, APR_FLOCK_EXCLUSIVE))) goto close;
+    if (APR_SUCCESS != (rv = log_scan(&slots, f, job->max_log, p))) goto close;
+    seq = (slots->nelts > 0)? APR_ARRAY_IDX(slots, 0, log_slot_t).seq + 1 : 0;
+    
+    memset(buf, ' ', sizeof(buf));
+    apr_snprintf(buf, LOG_SLOT_HEAD + 1, "%08x ", (unsigned int)seq);
+    memcpy(buf + LOG_SLOT_HEAD, text, strlen(text));
+    buf[MD_JOB_LOG_SLOT - 1] = '\n';
+    
+    offset = (apr_off_t)(seq % job->max_log) * MD_JOB_LOG_SLOT;
+    if (APR_SUCCESS == (rv = apr_file_seek(f, APR_SET, &offset))) {
+        rv = apr_file_write_full(f, buf, sizeof(buf), NULL);
+    }
+close:
+    apr_file_close(f);
+unlock:
+    wb_unlock();
+leave:
+    return rv;
+}
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *entries;
+} log_collect_ctx;
+
+static int collect_log_entry(void *baton, size_t index, md_json_t *entry)
+{
+    log_collect_ctx *ctx = baton;
+    
+    (void)index;
+    APR_ARRAY_PUSH(ctx->entries, md_json_t*) = md_json_clone(ctx->p, entry);
+    return 1;
+}
+
+/* Write the entries the ring could not take before, oldest first. */
+static void log_flush(md_job_t *job, apr_pool_t *p)
+{
+    log_collect_ctx ctx;
+    int i;
+    
+    if (!job->log) return;
+    ctx.p = p;
+    ctx.entries = apr_array_make(p, 5, sizeof(md_json_t*));
+    md_json_itera(collect_log_entry, &ctx, job->log, MD_KEY_ENTRIES, NULL);
+    for (i = ctx.entries->nelts - 1; i >= 0; --i) {
+        if (APR_SUCCESS != log_write(job, APR_ARRAY_IDX(ctx.entries, i, md_json_t*), p)) break;
+    }
+    if (i < 0) {
+        job->log = NULL;
+    }
+    else {
+        md_json_limita((size_t)i + 1, job->log, MD_KEY_ENTRIES, NULL);
+    }
+}
+
 apr_status_t md_job_save(md_job_t *job, md_result_t *result, apr_pool_t *p)
 {
     md_json_t *jprops;
     apr_status_t rv;
     
+    log_flush(job, p);
     jprops = md_json_create(p);
     job_to_json(jprops, job, result, p);
+    /* writes of job.json in this process do not overlap */
+    wb_lock();
+    wb_drop(job->group, job->mdomain, p);
     rv = md_store_save_json(job->store, p, job->group, job->mdomain, MD_FN_JOB, jprops, 0);
-    if (APR_SUCCESS == rv) job->dirty = 0;
+    wb_unlock();
+    if (APR_SUCCESS == rv) {
+        job->dirty = 0;
+        job->file_mtime = md_store_get_modified(job->store, job->group, job->mdomain, 
+                                                MD_FN_JOB, p);
+        /* the job directory exists now */
+        if (job->log) log_flush(job, p);
+    }
+    apr_atomic_inc32(&job_saves);
     return rv;
 }
 
-void md_job_log_append(md_job_t *job, const char *type, 
-                       const char *status, const char *detail)
+static md_json_t *log_entry_make(const char *type, const char *status, 
+                                 const char *detail, apr_pool_t *p)
 {
     md_json_t *entry;
     char ts[APR_RFC822_DATE_LEN];
     
-    entry = md_json_create(job->p);
+    entry = md_json_create(p);
     apr_rfc822_date(ts, apr_time_now());
     md_json_sets(ts, entry, MD_KEY_WHEN, NULL);
     md_json_sets(type, entry, MD_KEY_TYPE, NULL);
     if (status) md_json_sets(status, entry, MD_KEY_STATUS, NULL);
     if (detail) md_json_sets(detail, entry, MD_KEY_DETAIL, NULL);
-    if (!job->log) job->log = md_json_create(job->p);
-    md_json_insertj(entry, 0, job->log, MD_KEY_ENTRIES, NULL);
-    md_json_limita(job->max_log, job->log, MD_KEY_ENTRIES, NULL);
-    job->dirty = 1;
+    return entry;
+}
+
+apr_status_t md_job_log_add(md_store_t *store, md_store_group_t group, const char *name,
+                            const char *type, const char *status, const char *detail,
+                            apr_pool_t *p)
+{
+    md_job_t *job;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) return rv;
+    job = md_job_make(ptemp, store, group, name);
+    rv = log_write(job, log_entry_make(type, status, detail, ptemp), ptemp);
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+void md_job_log_append(md_job_t *job, const char *type, 
+                       const char *status, const char *detail)
+{
+    md_json_t *entry;
+    apr_pool_t *ptemp;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (APR_SUCCESS != apr_pool_create(&ptemp, job->p)) return;
+    entry = log_entry_make(type, status, detail, ptemp);
+    
+    /* keep the order, entries waiting for the ring go first */
+    log_flush(job, ptemp);
+    if (job->log || APR_SUCCESS != (rv = log_write(job, entry, ptemp))) {
+        if (!job->log) {
+            if (APR_STATUS_IS_ENOTIMPL(rv)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, 
+                              "%s: store has no job log ring, log is kept in %s", 
+                              job->mdomain, MD_FN_JOB);
+            }
+            else {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, 
+                              "%s: writing job log ring, log is kept in %s for now", 
+                              job->mdomain, MD_FN_JOB);
+            }
+            job->log = md_json_create(job->p);
+        }
+        md_json_insertj(md_json_clone(job->p, entry), 0, job->log, MD_KEY_ENTRIES, NULL);
+        md_json_limita(job->max_log, job->log, MD_KEY_ENTRIES, NULL);
+        job->dirty = 1;
+    }
+    apr_pool_destroy(ptemp);
 }
 
 typedef struct {
@@ -326,14 +1269,18 @@ typedef struct {
     size_t index;
 } log_find_ctx;
 
+static int is_log_type(md_json_t *entry, const char *type)
+{
+    const char *etype = md_json_gets(entry, MD_KEY_TYPE, NULL);
+    return etype == type || (etype && type && !strcmp(etype, type));
+}
+
 static int find_first_log_entry(void *baton, size_t index, md_json_t *entry)
 {
     log_find_ctx *ctx = baton;
-    const char *etype;
     
-    etype = md_json_gets(entry, MD_KEY_TYPE, NULL);
-    if (etype == ctx->type || (etype && ctx->type && !strcmp(etype, ctx->type))) {
-        ctx->entry = entry;
+    if (is_log_type(entry, ctx->type)) {
+        ctx->entry = md_json_clone(ctx->job->p, entry);
         ctx->index = index;
         return 0;
     }
@@ -344,11 +1291,36 @@ md_json_t *md_job_log_get_latest(md_job_t *job, const char *type)
 
 {
     log_find_ctx ctx;
+    apr_array_header_t *slots;
+    md_json_t *entry;
+    apr_pool_t *ptemp;
+    log_slot_t *slot;
+    const char *needle = NULL;
+    int i;
 
     memset(&ctx, 0, sizeof(ctx));
     ctx.job = job;
     ctx.type = type;
     if (job->log) md_json_itera(find_first_log_entry, &ctx, job->log, MD_KEY_ENTRIES, NULL);
+    if (ctx.entry || !job->store) return ctx.entry;
+    
+    if (APR_SUCCESS != apr_pool_create(&ptemp, job->p)) return NULL;
+    if (APR_SUCCESS == log_read(&slots, job->store, job->group, job->mdomain, 
+                                job->max_log, ptemp)) {
+        /* only entries that may be of the type are parsed */
+        if (type && !strpbrk(type, "\"\\/")) {
+            needle = apr_psprintf(ptemp, "\"%s\":\"%s\"", MD_KEY_TYPE, type);
+        }
+        for (i = 0; i < slots->nelts && !ctx.entry; ++i) {
+            slot = &APR_ARRAY_IDX(slots, i, log_slot_t);
+            if (needle && !strstr(slot->text, needle)) continue;
+            if (APR_SUCCESS == md_json_readd(&entry, ptemp, slot->text, slot->len)
+                && is_log_type(entry, type)) {
+                ctx.entry = md_json_clone(job->p, entry);
+            }
+        }
+    }
+    apr_pool_destroy(ptemp);
     return ctx.entry;
 }
 
@@ -365,12 +1337,25 @@ apr_time_t md_job_log_get_time_of_latest(md_job_t *job, const char *type)
     return 0;
 }
 
+/* Whether a renewal job counts as errored or ready, given its last result */
+static int job_states(const md_job_t *job, const md_result_t *result)
+{
+    if (job->error_runs > 0 
+        || (result && result->status != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(result->status))) {
+        return MD_STATUS_SEL_ERRORED;
+    }
+    else if (job->finished) {
+        return MD_STATUS_SEL_READY;
+    }
+    return 0;
+}
+
 void  md_status_take_stock(md_json_t **pjson, apr_array_header_t *mds, 
                            md_reg_t *reg, apr_pool_t *p)
 {
     const md_t *md;
     md_job_t *job;
-    int i, complete, renewing, errored, ready, total;
+    int i, complete, renewing, errored, ready, total, states;
     md_json_t *json;
 
     json = md_json_create(p);
@@ -385,13 +1370,9 @@ void  md_status_take_stock(md_json_t **pjson, apr_array_header_t *mds,
                     ++renewing;
                     job = md_reg_job_make(reg, md->name, p);
                     if (APR_SUCCESS == md_job_load(job)) {
-                        if (job->error_runs > 0 
-                            || (job->last_result && job->last_result->status != APR_SUCCESS)) {
-                            ++errored;
-                        }
-                        else if (job->finished) {
-                            ++ready;
-                        }
+                        states = job_states(job, job->last_result);
+                        if (states & MD_STATUS_SEL_ERRORED) ++errored;
+                        else if (states & MD_STATUS_SEL_READY) ++ready;
                     }
                 }
                 break;
@@ -406,6 +1387,138 @@ void  md_status_take_stock(md_json_t **pjson, apr_array_header_t *mds,
     *pjson = json;
 }
 
+/**************************************************************************************************/
+/* status stock */
+
+/* What lives in shared memory, followed by one slot per MD */
+typedef struct {
+    volatile apr_uint32_t errored;
+    volatile apr_uint32_t ready;
+} stock_shm_t;
+
+struct md_status_stock_t {
+    apr_shm_t *shm;
+    stock_shm_t *counts;
+    apr_hash_t *slots;                 /* MD name -> volatile apr_uint32_t* in shm */
+    int total;
+    int complete;
+    int bad_state;                     /* MDs neither complete nor incomplete, errored */
+    apr_time_t *renew_ats;             /* sorted, of MDs that may renew */
+    int nrenew_ats;
+};
+
+static md_status_stock_t *cur_stock;
+
+static int time_cmp(const void *v1, const void *v2)
+{
+    apr_time_t t1 = *(const apr_time_t*)v1, t2 = *(const apr_time_t*)v2;
+    return (t1 < t2)? -1 : ((t1 > t2)? 1 : 0);
+}
+
+static void stock_set(md_status_stock_t *stock, volatile apr_uint32_t *slot, int states)
+{
+    apr_uint32_t old;
+    
+    states &= (MD_STATUS_SEL_ERRORED|MD_STATUS_SEL_READY);
+    old = apr_atomic_xchg32(slot, (apr_uint32_t)states);
+    if ((old ^ (apr_uint32_t)states) & MD_STATUS_SEL_ERRORED) {
+        if (states & MD_STATUS_SEL_ERRORED) apr_atomic_inc32(&stock->counts->errored);
+        else apr_atomic_dec32(&stock->counts->errored);
+    }
+    if ((old ^ (apr_uint32_t)states) & MD_STATUS_SEL_READY) {
+        if (states & MD_STATUS_SEL_READY) apr_atomic_inc32(&stock->counts->ready);
+        else apr_atomic_dec32(&stock->counts->ready);
+    }
+}
+
+apr_status_t md_status_stock_create(md_status_stock_t **pstock, apr_pool_t *p,
+                                    apr_array_header_t *mds, md_reg_t *reg)
+{
+    md_status_stock_t *stock;
+    volatile apr_uint32_t *slots;
+    const md_t *md;
+    md_job_t *job;
+    apr_pool_t *ptemp;
+    apr_time_t renew_at, now;
+    apr_status_t rv;
+    int i;
+    
+    *pstock = NULL;
+    stock = apr_pcalloc(p, sizeof(*stock));
+    rv = apr_shm_create(&stock->shm, sizeof(stock_shm_t) 
+                        + (apr_size_t)mds->nelts * sizeof(apr_uint32_t), NULL, p);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                      "status, unable to create shared memory for %d MDs", mds->nelts);
+        return rv;
+    }
+    stock->counts = apr_shm_baseaddr_get(stock->shm);
+    memset(stock->counts, 0, apr_shm_size_get(stock->shm));
+    slots = (volatile apr_uint32_t*)(stock->counts + 1);
+    stock->slots = apr_hash_make(p);
+    stock->renew_ats = apr_pcalloc(p, (apr_size_t)(mds->nelts + 1) * sizeof(apr_time_t));
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) return rv;
+    
+    now = apr_time_now();
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        apr_hash_set(stock->slots, md->name, APR_HASH_KEY_STRING, (void*)&slots[i]);
+        ++stock->total;
+        switch (md->state) {
+            case MD_S_COMPLETE: ++stock->complete; /* fall through */
+            case MD_S_INCOMPLETE:
+                /* certificates change only on restart, and so do these times */
+                if (!(renew_at = md_reg_renew_at(reg, md, ptemp))) break;
+                stock->renew_ats[stock->nrenew_ats++] = renew_at;
+                if (renew_at <= now) {
+                    job = md_reg_job_make(reg, md->name, ptemp);
+                    if (APR_SUCCESS == md_job_load(job)) {
+                        stock_set(stock, &slots[i], job_states(job, job->last_result));
+                    }
+                }
+                break;
+            default: 
+                ++stock->bad_state; 
+                break;
+        }
+        apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+    qsort(stock->renew_ats, (size_t)stock->nrenew_ats, sizeof(apr_time_t), time_cmp);
+    *pstock = stock;
+    return APR_SUCCESS;
+}
+
+void md_status_stock_use(md_status_stock_t *stock)
+{
+    cur_stock = stock;
+}
+
+void md_status_stock_get(md_json_t **pjson, md_status_stock_t *stock, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_time_t now = apr_time_now();
+    int lo = 0, hi = stock->nrenew_ats, mid;
+    
+    /* the number of MDs whose renewal time has come */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (stock->renew_ats[mid] <= now) lo = mid + 1;
+        else hi = mid;
+    }
+    json = md_json_create(p);
+    md_json_setl(stock->total, json, MD_KEY_TOTAL, NULL);
+    md_json_setl(stock->complete, json, MD_KEY_COMPLETE, NULL);
+    md_json_setl(lo, json, MD_KEY_RENEWING, NULL);
+    md_json_setl(stock->bad_state + (long)apr_atomic_read32(&stock->counts->errored), 
+                 json, MD_KEY_ERRORED, NULL);
+    md_json_setl((long)apr_atomic_read32(&stock->counts->ready), json, MD_KEY_READY, NULL);
+    *pjson = json;
+}
+
+/**************************************************************************************************/
+/* job observation */
+
 typedef struct {
     apr_pool_t *p;
     md_job_t *job;
@@ -439,7 +1552,9 @@ static void job_result_update(md_result_t *result, void *data)
             }
             md_job_log_append(ctx->job, "progress", NULL, msg);
 
-            if (ctx->store && apr_time_as_msec(now - ctx->last_save) > 500) {
+            if (ctx->store 
+                && APR_STATUS_IS_ENOTIMPL(md_job_save_later(ctx->job, result, ctx->p))
+                && apr_time_as_msec(now - ctx->last_save) > 500) {
                 md_job_save(ctx->job, result, ctx->p);
                 ctx->last_save = now;
             }
@@ -473,6 +1588,7 @@ void md_job_start_run(md_job_t *job, md_result_t *result, md_store_t *store)
 {
     job->fatal_error = 0;
     job->last_run = apr_time_now();
+    md_result_phases_clear(result);
     job_observation_start(job, result, store);
     md_job_log_append(job, "starting", NULL, NULL);
 }
@@ -491,8 +1607,76 @@ apr_time_t md_job_delay_on_errors(int err_count)
     return delay;
 }
 
+typedef struct {
+    apr_pool_t *p;
+    const char *s;
+} timings_ctx;
+
+static const char *phase_summary(md_json_t *json, const char *key, apr_pool_t *p)
+{
+    return apr_psprintf(p, " %s %ld/%ld", key, md_json_getl(json, key, MD_KEY_P50, NULL),
+                        md_json_getl(json, key, MD_KEY_P99, NULL));
+}
+
+static int add_timing_summary(void *baton, size_t index, md_json_t *json)
+{
+    timings_ctx *ctx = baton;
+    
+    ctx->s = apr_psprintf(ctx->p, "%s%s%s: %ld requests, p50/p99 ms%s%s%s%s%s", 
+                          ctx->s, index? "; " : "", md_json_gets(json, MD_KEY_ENDPOINT, NULL),
+                          md_json_getl(json, MD_KEY_REQUESTS, NULL),
+                          phase_summary(json, MD_KEY_DNS, ctx->p),
+                          phase_summary(json, MD_KEY_CONNECT, ctx->p),
+                          phase_summary(json, MD_KEY_TLS, ctx->p),
+                          phase_summary(json, MD_KEY_FIRST_BYTE, ctx->p),
+                          phase_summary(json, MD_KEY_TOTAL, ctx->p));
+    return 1;
+}
+
+const char *md_status_timings_summary(const md_json_t *timings, apr_pool_t *p)
+{
+    timings_ctx ctx;
+    
+    if (!timings) return NULL;
+    ctx.p = p;
+    ctx.s = "";
+    md_json_itera(add_timing_summary, &ctx, (md_json_t*)timings, NULL);
+    return *ctx.s? ctx.s : NULL;
+}
+
+static int add_phase_summary(void *baton, const char *key, md_json_t *json)
+{
+    timings_ctx *ctx = baton;
+    long ms = md_json_getl(json, NULL);
+    
+    ctx->s = apr_psprintf(ctx->p, "%s%s%s %ld.%03lds", ctx->s, *ctx->s? ", " : "", 
+                          key, ms / 1000, ms % 1000);
+    return 1;
+}
+
+const char *md_status_phases_summary(const md_json_t *phases, apr_pool_t *p)
+{
+    timings_ctx ctx;
+    
+    if (!phases) return NULL;
+    ctx.p = p;
+    ctx.s = "";
+    md_json_iterkey(add_phase_summary, &ctx, (md_json_t*)phases, NULL);
+    return *ctx.s? ctx.s : NULL;
+}
+
 void md_job_end_run(md_job_t *job, md_result_t *result)
 {
+    const char *timings;
+    
+    if (job->last_run > 0) job->last_duration = apr_time_now() - job->last_run;
+    md_result_phase_end(result);
+    if (NULL != (timings = md_status_phases_summary(result->phases, job->p))) {
+        md_job_log_append(job, "phases", NULL, timings);
+    }
+    if (NULL != (timings = md_status_timings_summary(result->timings, job->p))) {
+        md_job_log_append(job, "timings", NULL, timings);
+    }
     if (APR_SUCCESS == result->status) {
         job->finished = 1;
         job->valid_from = result->ready_at;
@@ -500,10 +1684,21 @@ void md_job_end_run(md_job_t *job, md_result_t *result)
         job->dirty = 1;
         md_job_log_append(job, "finished", NULL, NULL);
     }
+    else if (APR_STATUS_IS_EAGAIN(result->status)) {
+        job->dirty = 1;
+        job->next_run = result->ready_at;
+    }
     else {
         ++job->error_runs;
         job->dirty = 1;
         job->next_run = apr_time_now() + md_job_delay_on_errors(job->error_runs);
+        /* e.g. the CA told us with Retry-After when to come back */
+        if (result->ready_at > job->next_run) job->next_run = result->ready_at;
+    }
+    if (cur_stock && MD_SG_STAGING == job->group) {
+        volatile apr_uint32_t *slot = apr_hash_get(cur_stock->slots, job->mdomain, 
+                                                   APR_HASH_KEY_STRING);
+        if (slot) stock_set(cur_stock, slot, job_states(job, result));
     }
     job_observation_end(job);
 }
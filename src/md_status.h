@@ -18,6 +18,7 @@
 #define md_status_h
 
 struct md_json_t;
+struct md_json_writer_t;
 struct md_reg_t;
 struct md_result_t;
 struct md_ocsp_reg_t;
@@ -38,6 +39,100 @@ apr_status_t md_status_get_json(struct md_json_t **pjson, apr_array_header_t *md
                                 struct md_reg_t *reg, struct md_ocsp_reg_t *ocsp,
                                 apr_pool_t *p);
 
+/**
+ * Write the members of md_status_get_json() into the object the writer is in. 
+ * The status of each MD is made in a pool of its own and written before the next
+ * one is looked at.
+ */
+apr_status_t md_status_write_json(struct md_json_writer_t *w, apr_array_header_t *mds, 
+                                  struct md_reg_t *reg, struct md_ocsp_reg_t *ocsp,
+                                  apr_pool_t *p);
+
+/**
+ * A cache of the status of all MDs, as given by md_status_get_json(). Only the
+ * MDs whose files changed are loaded again: changes are noticed by
+ * md_status_cache_invalidate(), by md_job_save() in this process and by
+ * the modification times of the files, which are checked at most every
+ * MD_STATUS_CACHE_CHECK for changes made by other processes.
+ */
+typedef struct md_status_cache_t md_status_cache_t;
+
+#define MD_STATUS_CACHE_CHECK       apr_time_from_sec(5)
+#define MD_STATUS_CACHE_MAX_AGE     apr_time_from_sec(300)
+
+/**
+ * Create the cache for the given MDs, which must not change for its lifetime.
+ */
+apr_status_t md_status_cache_create(md_status_cache_t **pcache, apr_pool_t *p,
+                                    apr_array_header_t *mds, struct md_reg_t *reg, 
+                                    struct md_ocsp_reg_t *ocsp);
+
+/**
+ * Have the next lookup check all MDs for changes.
+ */
+void md_status_cache_invalidate(md_status_cache_t *cache);
+
+/**
+ * Get the status of all MDs, sorted by name, valid for the lifetime of p. The wrapper
+ * is allocated from p, the values are shared with the cache and other callers and 
+ * must not be changed. Updates of the cache make a new document, the one returned 
+ * stays as it is.
+ */
+apr_status_t md_status_cache_get_json(struct md_json_t **pjson, md_status_cache_t *cache, 
+                                      apr_pool_t *p);
+
+/**
+ * Write the members of md_status_cache_get_json() into the object the writer is in,
+ * without copying the document. The cache is locked for MD_STATUS_WRITE_BATCH
+ * MDs at a time and the writer is flushed in between.
+ */
+#define MD_STATUS_WRITE_BATCH       100
+
+apr_status_t md_status_cache_write_json(struct md_json_writer_t *w, md_status_cache_t *cache, 
+                                        apr_pool_t *p);
+
+/**
+ * Call cb for the status of each MD, sorted by name, as long as it returns != 0.
+ * states has the MD_STATUS_SEL_* of the MD. The JSON belongs to the cache and is
+ * only valid during the callback. 
+ */
+typedef int md_status_cache_iter_cb(void *baton, const md_t *md, int states, 
+                                    struct md_json_t *mdj);
+apr_status_t md_status_cache_iter(md_status_cache_iter_cb *cb, void *baton,
+                                  md_status_cache_t *cache, apr_pool_t *p);
+
+/* States of an MD a query may select, as counted by md_status_take_stock() */
+#define MD_STATUS_SEL_COMPLETE      0x01
+#define MD_STATUS_SEL_RENEWING      0x02
+#define MD_STATUS_SEL_ERRORED       0x04
+#define MD_STATUS_SEL_READY         0x08
+
+typedef enum {
+    MD_STATUS_SORT_NAME,
+    MD_STATUS_SORT_VALID_UNTIL,        /* expiry of the certificate */
+    MD_STATUS_SORT_RENEW_AT,
+} md_status_sort_t;
+
+typedef struct md_status_query_t md_status_query_t;
+struct md_status_query_t {
+    int states;                        /* MD_STATUS_SEL_* of which an MD has one, 0 for all */
+    const char *prefix;                /* the start of MD names or NULL */
+    apr_interval_time_t expires_within;/* MDs whose certificate expires before, 0 for all */
+    md_status_sort_t sort;
+    int descending;
+    int offset;
+    int limit;                         /* max number of MDs returned, 0 for all */
+};
+
+/**
+ * Get the status of the MDs selected by the query, allocated from p. Selection and
+ * sorting use values the cache keeps per MD, only the MDs returned are copied.
+ * The JSON carries the MDs in MD_KEY_MDS, the number of all selected MDs in
+ * MD_KEY_TOTAL and the MD_KEY_OFFSET and MD_KEY_LIMIT used.
+ */
+apr_status_t md_status_cache_query(struct md_json_t **pjson, md_status_cache_t *cache, 
+                                   const md_status_query_t *query, apr_pool_t *p);
+
 /**
  * Take stock of all MDs given for a short overview. The JSON returned
  * will carry intergers for MD_KEY_COMPLETE, MD_KEY_RENEWING, 
@@ -46,9 +141,56 @@ apr_status_t md_status_get_json(struct md_json_t **pjson, apr_array_header_t *md
 void  md_status_take_stock(struct md_json_t **pjson, apr_array_header_t *mds, 
                            struct md_reg_t *reg, apr_pool_t *p);
 
+/**
+ * The counts of md_status_take_stock(), kept up to date without loading jobs.
+ * What changes with time alone, whether an MD is due for renewal, is counted from
+ * the sorted renewal times of the MDs. Errored and ready jobs are counted in
+ * shared memory, inherited by all children and updated by md_job_end_run() of
+ * the renewal jobs when the stock is in use.
+ */
+typedef struct md_status_stock_t md_status_stock_t;
+
+/**
+ * Create the stock for the MDs, which must not change for its lifetime. Loads the
+ * jobs of MDs due for renewal once. To be called before child processes are created.
+ */
+apr_status_t md_status_stock_create(md_status_stock_t **pstock, apr_pool_t *p,
+                                    apr_array_header_t *mds, struct md_reg_t *reg);
+
+/**
+ * Have md_job_end_run() update this stock, or none if NULL.
+ */
+void md_status_stock_use(md_status_stock_t *stock);
+
+/**
+ * Get the counts like md_status_take_stock() does.
+ */
+void md_status_stock_get(struct md_json_t **pjson, md_status_stock_t *stock, apr_pool_t *p);
+
+/**
+ * Give the network timings of a result (see md_http_timings_to_json()) as line
+ * of text with median and 99th percentile per endpoint, or NULL if there are none.
+ */
+const char *md_status_timings_summary(const struct md_json_t *timings, apr_pool_t *p);
+
+/**
+ * Give the phases of a result (see md_result_phase_start()) as line of text with
+ * the seconds spent in each, or NULL if there are none.
+ */
+const char *md_status_phases_summary(const struct md_json_t *phases, apr_pool_t *p);
+
 
 typedef struct md_job_t md_job_t;
 
+/**
+ * The log of a job is kept in MD_FN_JOB_LOG next to its MD_FN_JOB, as a ring of 
+ * MD_JOB_LOG_MAX slots of MD_JOB_LOG_SLOT bytes. Each slot holds a sequence number
+ * and one entry, appending writes a single slot after the newest one in the file.
+ * Stores that have no files for it keep the log in MD_FN_JOB instead.
+ */
+#define MD_JOB_LOG_MAX          128
+#define MD_JOB_LOG_SLOT         512
+
 struct md_job_t {
     md_store_group_t group;/* group where job is persisted */
     const char *mdomain;   /* Name of the MD this job is about */
@@ -56,16 +198,18 @@ struct md_job_t {
     apr_pool_t *p;     
     apr_time_t next_run;   /* Time this job wants to be processed next */
     apr_time_t last_run;   /* Time this job ran last (or 0) */
+    apr_interval_time_t last_duration; /* How long the last run took (or 0) */
     struct md_result_t *last_result; /* Result from last run */
     int finished;          /* true iff the job finished successfully */
     int notified;          /* true iff notifications were handled successfully */
     apr_time_t valid_from; /* at which time the finished job results become valid, 0 if immediate */
     int error_runs;        /* Number of errored runs of an unfinished job */
     int fatal_error;       /* a fatal error is remedied by retrying */
-    md_json_t *log;        /* array of log objects with minimum fields
-                              MD_KEY_WHEN (timestamp) and MD_KEY_TYPE (string) */
+    md_json_t *log;        /* log objects with minimum fields MD_KEY_WHEN (timestamp)
+                              and MD_KEY_TYPE (string), not yet written to the ring */
     apr_size_t max_log;    /* max number of log entries, new ones replace oldest */
     int dirty;
+    apr_time_t file_mtime; /* modification time of the job file as last loaded/saved */
     struct md_result_t *observing;
     
     md_job_notify_cb *notify;
@@ -86,13 +230,48 @@ void md_job_set_group(md_job_t *job, md_store_group_t group);
  */
 apr_status_t md_job_load(md_job_t *job);
 
+/**
+ * As md_job_load(), but only if the job file has changed since the job was
+ * last loaded or saved. A job with changes held for write behind is current.
+ */
+apr_status_t md_job_refresh(md_job_t *job);
+
 /**
  * Update storage from job in <group>/job->mdomain.
  */
 apr_status_t md_job_save(md_job_t *job, struct md_result_t *result, apr_pool_t *p);
 
 /**
- * Append to the job's log. Timestamp is automatically added.
+ * Load the properties of a job as saved in <group>/name, or as saved later
+ * by md_job_save_later() in this process.
+ */
+apr_status_t md_job_load_json(struct md_json_t **pjson, md_store_t *store, 
+                              md_store_group_t group, const char *name, apr_pool_t *p);
+
+/**
+ * Changes of a job during a run are written behind, when enabled in the
+ * process that drives the jobs. md_job_save_later() keeps the state of a job
+ * in memory, replacing the one not written yet, and md_job_write_behind_flush()
+ * writes all of them. md_job_save() writes at once and drops the state kept
+ * for the job.
+ */
+#define MD_JOB_SAVE_INTERVAL_DEF    apr_time_from_sec(5)
+
+apr_status_t md_job_write_behind_start(apr_pool_t *p);
+/* Disable write behind, after writing what is kept. */
+void md_job_write_behind_stop(apr_pool_t *p);
+apr_status_t md_job_write_behind_flush(apr_pool_t *p);
+
+/**
+ * Save the job when write behind is flushed next. 
+ * @return APR_ENOTIMPL if write behind is not enabled
+ */
+apr_status_t md_job_save_later(md_job_t *job, struct md_result_t *result, apr_pool_t *p);
+
+/**
+ * Append to the job's log. Timestamp is automatically added. The entry is 
+ * written to the ring at once, or when the job is saved, if the job has no
+ * directory in the store yet. Details too long for a slot are shortened.
  * @param type          type of log entry
  * @param status        status of entry (maybe NULL)
  * @param detail        description of what happened
@@ -101,7 +280,17 @@ void md_job_log_append(md_job_t *job, const char *type,
                        const char *status, const char *detail);
 
 /**
- * Retrieve the lastest log entry of a certain type.
+ * Append to the ring of the job stored in <group>/name, for callers that have no
+ * md_job_t at hand, e.g. when a notification has been delivered by another thread.
+ * @return APR_ENOTIMPL if the store keeps no ring for the group
+ */
+apr_status_t md_job_log_add(md_store_t *store, md_store_group_t group, const char *name,
+                            const char *type, const char *status, const char *detail,
+                            apr_pool_t *p);
+
+/**
+ * Retrieve the lastest log entry of a certain type. Only the entries newer than
+ * the one found are parsed.
  */
 md_json_t *md_job_log_get_latest(md_job_t *job, const char *type);
 
@@ -112,6 +301,10 @@ md_json_t *md_job_log_get_latest(md_job_t *job, const char *type);
 apr_time_t md_job_log_get_time_of_latest(md_job_t *job, const char *type);
 
 void md_job_start_run(md_job_t *job, struct md_result_t *result, md_store_t *store);
+/**
+ * End a run of the job. A result of APR_EAGAIN is no error, the job wants
+ * to continue at result->ready_at.
+ */
 void md_job_end_run(md_job_t *job, struct md_result_t *result);
 void md_job_retry_at(md_job_t *job, apr_time_t later);
 
@@ -56,6 +56,8 @@ static const char *GROUP_NAME[] = {
     "archive",
     "tmp",
     "ocsp",
+    "leases",
+    "journal",
     NULL
 };
 
@@ -162,6 +164,34 @@ apr_status_t md_store_remove_not_modified_since(md_store_t *store, apr_pool_t *p
     return store->remove_nms(store, p, modified, group, name, aspect);
 }
 
+apr_status_t md_store_lease(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                            const char *name, const char *holder, apr_interval_time_t ttl)
+{
+    if (!store->lease) return APR_ENOTIMPL;
+    return store->lease(store, p, group, name, holder, ttl);
+}
+
+apr_status_t md_store_release(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                              const char *name, const char *holder)
+{
+    if (!store->release) return APR_ENOTIMPL;
+    return store->release(store, p, group, name, holder);
+}
+
+apr_status_t md_store_journal_add(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                  const char *name, const char *aspect)
+{
+    if (!store->journal_add) return APR_ENOTIMPL;
+    return store->journal_add(store, p, group, name, aspect);
+}
+
+apr_status_t md_store_journal_cleanup(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                      md_store_journal_inspect *inspect, void *baton)
+{
+    if (!store->journal_cleanup) return APR_ENOTIMPL;
+    return store->journal_cleanup(store, p, group, inspect, baton);
+}
+
 apr_status_t md_store_rename(md_store_t *store, apr_pool_t *p,
                              md_store_group_t group, const char *name, const char *to)
 {
@@ -269,6 +299,29 @@ apr_status_t md_pkey_save(md_store_t *store, apr_pool_t *p, md_store_group_t gro
 apr_status_t md_pubcert_load(md_store_t *store, md_store_group_t group, const char *name, 
                              struct apr_array_header_t **ppubcert, apr_pool_t *p)
 {
+    apr_time_t pem_mtime, der_mtime;
+    apr_status_t rv;
+    
+    /* The DER sidecar is written after the PEM. When it is older, the PEM
+     * was replaced by other means and is the one to believe. */
+    pem_mtime = md_store_get_modified(store, group, name, MD_FN_PUBCERT, p);
+    der_mtime = md_store_get_modified(store, group, name, MD_FN_PUBCERT_DER, p);
+    if (pem_mtime && der_mtime >= pem_mtime) {
+        rv = md_store_load(store, group, name, MD_FN_PUBCERT_DER, MD_SV_DER_CHAIN, 
+                           (void**)ppubcert, p);
+        if (APR_SUCCESS == rv) return rv;
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "%s: DER sidecar for pubcert not usable, loading PEM", name);
+        rv = md_store_load(store, group, name, MD_FN_PUBCERT, MD_SV_CHAIN, (void**)ppubcert, p);
+        if (APR_SUCCESS == rv 
+            && APR_SUCCESS != md_store_save(store, p, group, name, MD_FN_PUBCERT_DER, 
+                                            MD_SV_DER_CHAIN, *ppubcert, 0)) {
+            /* the next load falls back to the PEM again, that is all */
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                          "%s: DER sidecar for pubcert not rewritten", name);
+        }
+        return rv;
+    }
     return md_store_load(store, group, name, MD_FN_PUBCERT, MD_SV_CHAIN, (void**)ppubcert, p);
 }
 
@@ -276,7 +329,18 @@ apr_status_t md_pubcert_save(md_store_t *store, apr_pool_t *p,
                              md_store_group_t group, const char *name, 
                              struct apr_array_header_t *pubcert, int create)
 {
-    return md_store_save(store, p, group, name, MD_FN_PUBCERT, MD_SV_CHAIN, pubcert, create);
+    apr_status_t rv;
+    
+    rv = md_store_save(store, p, group, name, MD_FN_PUBCERT, MD_SV_CHAIN, pubcert, create);
+    if (APR_SUCCESS == rv 
+        && APR_SUCCESS != md_store_save(store, p, group, name, MD_FN_PUBCERT_DER, 
+                                        MD_SV_DER_CHAIN, pubcert, 0)) {
+        /* loads fall back to the PEM, do not leave an old sidecar behind */
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, 
+                      "%s: no DER sidecar for pubcert written", name);
+        md_store_remove(store, group, name, MD_FN_PUBCERT_DER, p, 1);
+    }
+    return rv;
 }
 
 typedef struct {
@@ -55,6 +55,8 @@ typedef enum {
     MD_SV_PKEY,         /* PEM private key, value is (md_pkey_t*) */
     MD_SV_CHAIN,        /* list of PEM x509 certificates, value is 
                            (apr_array_header_t*) of (md_cert*) */
+    MD_SV_DER_CHAIN,    /* list of length prefixed DER x509 certificates, value is 
+                           (apr_array_header_t*) of (md_cert*) */
 } md_store_vtype_t;
 
 /** Store storage groups */
@@ -67,18 +69,24 @@ typedef enum {
     MD_SG_ARCHIVE,      /* Archived live sets of a domain */
     MD_SG_TMP,          /* temporary domain storage */
     MD_SG_OCSP,         /* OCSP stapling related domain data */
+    MD_SG_LEASES,       /* leases of servers sharing the store, see md_store_lease() */
+    MD_SG_JOURNAL,      /* cleanup journals of groups, see md_store_journal_add() */
     MD_SG_COUNT,        /* number of storage groups, used in setups */
 } md_store_group_t;
 
 #define MD_FN_MD                "md.json"
 #define MD_FN_JOB               "job.json"
+#define MD_FN_JOB_LOG           "job-log.ring"
 #define MD_FN_PRIVKEY           "privkey.pem"
 #define MD_FN_PUBCERT           "pubcert.pem"
+#define MD_FN_PUBCERT_DER       "pubcert.der"
 #define MD_FN_CERT              "cert.pem"
 #define MD_FN_HTTPD_JSON        "httpd.json"
 
 #define MD_FN_FALLBACK_PKEY     "fallback-privkey.pem"
 #define MD_FN_FALLBACK_CERT     "fallback-cert.pem"
+#define MD_FN_FALLBACK_SHARED_PKEY "fallback-shared-privkey.pem"
+#define MD_FN_FALLBACK_SHARED_CERT "fallback-shared-cert.pem"
 
 /**
  * Load the JSON value at key "group/name/aspect", allocated from pool p.
@@ -197,6 +205,51 @@ apr_status_t md_store_iter_names(md_store_inspect *inspect, void *baton, md_stor
 apr_time_t md_store_get_modified(md_store_t *store, md_store_group_t group,  
                                  const char *name, const char *aspect, apr_pool_t *p);
 
+/**
+ * Take or renew the lease on "group/name" for holder, lasting ttl from now. Servers
+ * sharing a store use this, so that only one of them works on the item, e.g. the
+ * renewal of a MD in STAGING. Renewing a lease extends it, an expired lease of 
+ * another holder is taken over. name may be NULL for the whole group.
+ * @return APR_SUCCESS when holder has the lease, APR_EBUSY when another holder 
+ *         has it, APR_ENOTIMPL if the store does not support leases.
+ */
+apr_status_t md_store_lease(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                            const char *name, const char *holder, apr_interval_time_t ttl);
+
+/**
+ * Give up the lease on "group/name", if holder has it.
+ */
+apr_status_t md_store_release(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                              const char *name, const char *holder);
+
+/**
+ * Record in the cleanup journal of the group that "group/name/aspect" has been
+ * created, so that cleanups look at the journaled items instead of all in the group.
+ * aspect may be NULL for everything of the name. With a NULL name, only an empty
+ * journal is created, e.g. after a cleanup that had to look at all items.
+ * @return APR_ENOTIMPL if the store does not keep journals.
+ */
+apr_status_t md_store_journal_add(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                  const char *name, const char *aspect);
+
+/**
+ * Inspect callback for the entries of a cleanup journal. *ptime is the time the
+ * entry was made and may be changed to put off its next inspection. Return 0 to 
+ * drop the entry, e.g. because the item is gone, or != 0 to keep it.
+ */
+typedef int md_store_journal_inspect(void *baton, const char *name, const char *aspect, 
+                                     apr_time_t *ptime, apr_pool_t *ptemp);
+
+/**
+ * Call inspect for each entry in the cleanup journal of the group, oldest first, 
+ * and keep the entries it does not drop.
+ * @return APR_ENOENT if the group has no journal, e.g. when the store comes from an
+ *         older version, APR_ENOTIMPL if the store does not keep journals. In both 
+ *         cases, the caller needs to look at all items in the group.
+ */
+apr_status_t md_store_journal_cleanup(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                      md_store_journal_inspect *inspect, void *baton);
+
 
 
 /**************************************************************************************************/
@@ -275,6 +328,23 @@ typedef apr_status_t md_store_remove_nms_cb(md_store_t *store, apr_pool_t *p,
                                             apr_time_t modified, md_store_group_t group, 
                                             const char *name, const char *aspect);
 
+typedef apr_status_t md_store_lease_cb(md_store_t *store, apr_pool_t *p, 
+                                       md_store_group_t group, const char *name, 
+                                       const char *holder, apr_interval_time_t ttl);
+
+typedef apr_status_t md_store_release_cb(md_store_t *store, apr_pool_t *p, 
+                                         md_store_group_t group, const char *name, 
+                                         const char *holder);
+
+typedef apr_status_t md_store_journal_add_cb(md_store_t *store, apr_pool_t *p, 
+                                             md_store_group_t group, const char *name, 
+                                             const char *aspect);
+
+typedef apr_status_t md_store_journal_cleanup_cb(md_store_t *store, apr_pool_t *p, 
+                                                 md_store_group_t group, 
+                                                 md_store_journal_inspect *inspect,
+                                                 void *baton);
+
 struct md_store_t {
     md_store_save_cb *save;
     md_store_load_cb *load;
@@ -288,6 +358,10 @@ struct md_store_t {
     md_store_is_newer_cb *is_newer;
     md_store_get_modified_cb *get_modified;
     md_store_remove_nms_cb *remove_nms;
+    md_store_lease_cb *lease;              /* optional */
+    md_store_release_cb *release;          /* optional */
+    md_store_journal_add_cb *journal_add;  /* optional */
+    md_store_journal_cleanup_cb *journal_cleanup; /* optional */
 };
 
 
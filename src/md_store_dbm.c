@@ -0,0 +1,837 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_dbm.h>
+#include <apr_file_io.h>
+#include <apr_fnmatch.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_dbm.h"
+#include "md_util.h"
+
+/**************************************************************************************************/
+/* apr_dbm based implementation of md_store_t */
+
+/* The groups CHALLENGES and OCSP hold one or more small values for every domain,
+ * none of which is ever needed as a file. They are kept in a single database
+ * with keys "group/name/aspect". Each value starts with its modification time
+ * in a line of its own, followed by the data as it would be in a file.
+ *
+ * Every operation opens the database under a lock file, shared for reading and
+ * exclusive for writing. Changes by other processes are therefore seen at once
+ * and operations on several keys, like a purge, are atomic to all readers. */
+
+typedef struct md_store_dbm_t md_store_dbm_t;
+struct md_store_dbm_t {
+    md_store_t s;
+
+    md_store_t *files;              /* store for all other groups */
+    const char *type;               /* apr_dbm type of the database */
+    const char *path;               /* path of the database */
+    const char *lock_path;          /* file locked against other processes */
+    apr_thread_mutex_t *mutex;      /* locked against other threads */
+};
+
+#define DBM_STORE(store)    (md_store_dbm_t*)(((char*)store)-offsetof(md_store_dbm_t, s))
+#define DBM_PERMS           MD_FPROT_F_UALL_GREAD
+
+static int in_db(md_store_group_t group)
+{
+    return group == MD_SG_CHALLENGES || group == MD_SG_OCSP;
+}
+
+/**************************************************************************************************/
+/* database access */
+
+typedef struct {
+    md_store_dbm_t *s_db;
+    apr_dbm_t *db;
+    apr_file_t *lock;
+    int locked;
+} db_ctx_t;
+
+static void db_end(db_ctx_t *ctx)
+{
+    if (ctx->db) {
+        apr_dbm_close(ctx->db);
+        ctx->db = NULL;
+    }
+    if (ctx->lock) {
+        apr_file_unlock(ctx->lock);
+        apr_file_close(ctx->lock);
+        ctx->lock = NULL;
+    }
+    if (ctx->locked) {
+        apr_thread_mutex_unlock(ctx->s_db->mutex);
+        ctx->locked = 0;
+    }
+}
+
+static apr_status_t db_begin(db_ctx_t *ctx, md_store_dbm_t *s_db, int write, apr_pool_t *p)
+{
+    apr_status_t rv;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->s_db = s_db;
+    if (APR_SUCCESS != (rv = apr_thread_mutex_lock(s_db->mutex))) goto leave;
+    ctx->locked = 1;
+
+    rv = apr_file_open(&ctx->lock, s_db->lock_path,
+                       APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE, DBM_PERMS, p);
+    if (APR_SUCCESS != rv) goto leave;
+    rv = apr_file_lock(ctx->lock, write? APR_FLOCK_EXCLUSIVE : APR_FLOCK_SHARED);
+    if (APR_SUCCESS != rv) goto leave;
+
+    rv = apr_dbm_open_ex(&ctx->db, s_db->type, s_db->path,
+                         write? APR_DBM_RWCREATE : APR_DBM_READONLY, DBM_PERMS, p);
+leave:
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "open %s database %s",
+                      s_db->type, s_db->path);
+        db_end(ctx);
+    }
+    return rv;
+}
+
+static apr_datum_t mk_key(md_store_group_t group, const char *name, const char *aspect,
+                          apr_pool_t *p)
+{
+    apr_datum_t key;
+
+    key.dptr = apr_pstrcat(p, md_store_group_name(group), "/", name, "/", aspect, NULL);
+    key.dsize = strlen(key.dptr);
+    return key;
+}
+
+/* Get the value at key, data is copied to p and 0-terminated. */
+static apr_status_t db_fetch(char **pdata, apr_size_t *plen, apr_time_t *pmtime,
+                             db_ctx_t *ctx, apr_datum_t key, apr_pool_t *p)
+{
+    apr_datum_t val;
+    const char *nl;
+    char *end;
+    apr_status_t rv;
+
+    memset(&val, 0, sizeof(val));
+    if (APR_SUCCESS != (rv = apr_dbm_fetch(ctx->db, key, &val))) goto leave;
+    if (!val.dptr) {
+        rv = APR_ENOENT;
+        goto leave;
+    }
+    if (NULL == (nl = memchr(val.dptr, '\n', val.dsize))) {
+        rv = APR_EINVAL;
+        goto leave;
+    }
+    if (pmtime) {
+        *pmtime = (apr_time_t)apr_strtoi64(
+            apr_pstrmemdup(p, val.dptr, (apr_size_t)(nl - val.dptr)), &end, 10);
+    }
+    ++nl;
+    if (pdata) {
+        *plen = val.dsize - (apr_size_t)(nl - val.dptr);
+        *pdata = apr_pstrmemdup(p, nl, *plen);
+    }
+leave:
+    return rv;
+}
+
+static apr_status_t val_encode(apr_datum_t *val, md_store_dbm_t *s_db, md_store_group_t group,
+                               md_store_vtype_t vtype, void *value, apr_pool_t *p)
+{
+    md_data_t data;
+    apr_array_header_t *chain;
+    const char *pass, *header;
+    apr_size_t pass_len, hlen;
+    apr_status_t rv = APR_SUCCESS;
+
+    switch (vtype) {
+        case MD_SV_TEXT:
+            data.data = value;
+            data.len = strlen(data.data);
+            break;
+        case MD_SV_JSON:
+            /* never read by humans in here, no need to indent */
+            if (NULL == (data.data = md_json_writep(value, p, MD_JSON_FMT_COMPACT))) {
+                return APR_EINVAL;
+            }
+            data.len = strlen(data.data);
+            break;
+        case MD_SV_CERT:
+            chain = apr_array_make(p, 1, sizeof(md_cert_t *));
+            APR_ARRAY_PUSH(chain, md_cert_t *) = value;
+            rv = md_chain_to_pem(&data, chain, p);
+            break;
+        case MD_SV_PKEY:
+            md_store_fs_get_pass(&pass, &pass_len, s_db->files, group);
+            rv = md_pkey_to_pem(&data, value, p, pass, pass_len);
+            break;
+        case MD_SV_CHAIN:
+            rv = md_chain_to_pem(&data, value, p);
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    if (APR_SUCCESS != rv) return rv;
+
+    header = apr_psprintf(p, "%" APR_TIME_T_FMT "\n", apr_time_now());
+    hlen = strlen(header);
+    val->dsize = hlen + data.len;
+    val->dptr = apr_palloc(p, val->dsize);
+    memcpy(val->dptr, header, hlen);
+    if (data.len > 0) {
+        memcpy(val->dptr + hlen, data.data, data.len);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t val_decode(void **pvalue, md_store_dbm_t *s_db, md_store_group_t group,
+                               md_store_vtype_t vtype, char *data, apr_size_t len,
+                               apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    const char *pass;
+    apr_size_t pass_len;
+    apr_status_t rv;
+
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pvalue = data;
+            rv = APR_SUCCESS;
+            break;
+        case MD_SV_JSON:
+            rv = md_json_readd((md_json_t **)pvalue, p, data, len);
+            break;
+        case MD_SV_CERT:
+            if (APR_SUCCESS == (rv = md_chain_from_pem(&chain, p, data, len))) {
+                if (chain->nelts > 0) {
+                    *pvalue = APR_ARRAY_IDX(chain, 0, md_cert_t *);
+                }
+                else {
+                    rv = APR_EINVAL;
+                }
+            }
+            break;
+        case MD_SV_PKEY:
+            md_store_fs_get_pass(&pass, &pass_len, s_db->files, group);
+            rv = md_pkey_from_pem((md_pkey_t **)pvalue, p, data, len, pass, pass_len);
+            break;
+        case MD_SV_CHAIN:
+            rv = md_chain_from_pem((apr_array_header_t **)pvalue, p, data, len);
+            break;
+        default:
+            rv = APR_ENOTIMPL;
+            break;
+    }
+    return rv;
+}
+
+typedef struct {
+    apr_datum_t key;
+    const char *name;
+    const char *aspect;
+    char *data;
+    apr_size_t len;
+    apr_time_t mtime;
+} db_entry_t;
+
+static int entry_cmp(const void *v1, const void *v2)
+{
+    const db_entry_t *e1 = v1, *e2 = v2;
+    return strcmp(e1->key.dptr, e2->key.dptr);
+}
+
+/* Collect the entries of group whose name and aspect match the patterns (NULL
+ * matches all), ordered by key. With fetch set, their values are loaded as well. */
+static apr_status_t db_collect(apr_array_header_t **pentries, db_ctx_t *ctx,
+                               md_store_group_t group, const char *pattern,
+                               const char *aspect, int fetch, apr_pool_t *p)
+{
+    apr_array_header_t *entries;
+    apr_datum_t key;
+    const char *prefix, *slash;
+    char *rest;
+    db_entry_t *e;
+    apr_size_t plen;
+    int i;
+    apr_status_t rv;
+
+    entries = apr_array_make(p, 10, sizeof(db_entry_t));
+    prefix = apr_pstrcat(p, md_store_group_name(group), "/", NULL);
+    plen = strlen(prefix);
+
+    /* Values are fetched in a second pass, some dbm types do not like that
+     * to happen while walking the keys. */
+    rv = apr_dbm_firstkey(ctx->db, &key);
+    while (APR_SUCCESS == rv && key.dptr) {
+        if (key.dsize > plen && !memcmp(key.dptr, prefix, plen)) {
+            rest = apr_pstrmemdup(p, key.dptr + plen, key.dsize - plen);
+            if (NULL != (slash = strchr(rest, '/'))) {
+                rest[slash - rest] = '\0';
+                if ((!pattern || APR_SUCCESS == apr_fnmatch(pattern, rest, 0))
+                    && (!aspect || APR_SUCCESS == apr_fnmatch(aspect, slash + 1, 0))) {
+                    e = (db_entry_t *)apr_array_push(entries);
+                    memset(e, 0, sizeof(*e));
+                    e->key.dptr = apr_pstrmemdup(p, key.dptr, key.dsize);
+                    e->key.dsize = key.dsize;
+                    e->name = rest;
+                    e->aspect = slash + 1;
+                }
+            }
+        }
+        rv = apr_dbm_nextkey(ctx->db, &key);
+    }
+    if (APR_SUCCESS != rv) goto leave;
+
+    for (i = 0; fetch && i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, db_entry_t);
+        rv = db_fetch(&e->data, &e->len, &e->mtime, ctx, e->key, p);
+        if (APR_SUCCESS != rv) goto leave;
+    }
+    qsort(entries->elts, (size_t)entries->nelts, sizeof(db_entry_t), entry_cmp);
+leave:
+    *pentries = (APR_SUCCESS == rv)? entries : NULL;
+    return rv;
+}
+
+/* Give all keys below "group/from/" to "to_group/to/". Existing keys there are
+ * removed first. Names are compared literally, they may contain wildcards. */
+static apr_status_t db_rekey(db_ctx_t *ctx, md_store_group_t from_group, const char *from,
+                             md_store_group_t to_group, const char *to, apr_pool_t *p)
+{
+    apr_array_header_t *src, *dest;
+    apr_datum_t val;
+    db_entry_t *e;
+    int i;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = db_collect(&src, ctx, from_group, NULL, NULL, 0, p))
+        || APR_SUCCESS != (rv = db_collect(&dest, ctx, to_group, NULL, NULL, 0, p))) {
+        goto leave;
+    }
+    for (i = 0; i < dest->nelts; ++i) {
+        e = &APR_ARRAY_IDX(dest, i, db_entry_t);
+        if (strcmp(to, e->name)) continue;
+        if (APR_SUCCESS != (rv = apr_dbm_delete(ctx->db, e->key))) goto leave;
+    }
+    for (i = 0; i < src->nelts; ++i) {
+        e = &APR_ARRAY_IDX(src, i, db_entry_t);
+        if (strcmp(from, e->name)) continue;
+        memset(&val, 0, sizeof(val));
+        if (APR_SUCCESS != (rv = apr_dbm_fetch(ctx->db, e->key, &val))) goto leave;
+        if (!val.dptr) continue;
+        val.dptr = apr_pmemdup(p, val.dptr, val.dsize);
+        if (APR_SUCCESS != (rv = apr_dbm_store(ctx->db, mk_key(to_group, to, e->aspect, p), val))
+            || APR_SUCCESS != (rv = apr_dbm_delete(ctx->db, e->key))) {
+            goto leave;
+        }
+    }
+leave:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* store callbacks */
+
+static apr_status_t pdb_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_dbm_t *s_db = baton;
+    const char *name, *aspect;
+    md_store_vtype_t vtype;
+    md_store_group_t group;
+    void **pvalue;
+    db_ctx_t ctx;
+    char *data;
+    apr_size_t len;
+    apr_status_t rv;
+
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+    vtype = (md_store_vtype_t)va_arg(ap, int);
+    pvalue= va_arg(ap, void **);
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 0, ptemp))) goto leave;
+    rv = db_fetch(&data, &len, NULL, &ctx, mk_key(group, name, aspect, ptemp), p);
+    db_end(&ctx);
+
+    if (APR_SUCCESS == rv && pvalue) {
+        rv = val_decode(pvalue, s_db, group, vtype, data, len, p);
+    }
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp,
+                  "loading type %d from %s/%s/%s", vtype, md_store_group_name(group),
+                  name, aspect);
+    return rv;
+}
+
+static apr_status_t db_load(md_store_t *store, md_store_group_t group,
+                            const char *name, const char *aspect,
+                            md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+
+    if (!in_db(group)) {
+        return s_db->files->load(s_db->files, group, name, aspect, vtype, pvalue, p);
+    }
+    return md_util_pool_vdo(pdb_load, s_db, p, group, name, aspect, vtype, pvalue, NULL);
+}
+
+static apr_status_t pdb_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_dbm_t *s_db = baton;
+    const char *name, *aspect;
+    md_store_vtype_t vtype;
+    md_store_group_t group;
+    apr_datum_t key, val;
+    void *value;
+    int create;
+    db_ctx_t ctx;
+    apr_status_t rv;
+
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char*);
+    vtype = (md_store_vtype_t)va_arg(ap, int);
+    value = va_arg(ap, void *);
+    create = va_arg(ap, int);
+
+    if (APR_SUCCESS != (rv = val_encode(&val, s_db, group, vtype, value, ptemp))) goto leave;
+    key = mk_key(group, name, aspect, ptemp);
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 1, ptemp))) goto leave;
+    if (create && apr_dbm_exists(ctx.db, key)) {
+        rv = APR_EEXIST;
+    }
+    else {
+        rv = apr_dbm_store(ctx.db, key, val);
+    }
+    db_end(&ctx);
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp, "storing in %s",
+                  apr_pstrcat(ptemp, md_store_group_name(group), "/", name, "/", aspect, NULL));
+    return rv;
+}
+
+static apr_status_t db_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                            const char *name, const char *aspect,
+                            md_store_vtype_t vtype, void *value, int create)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+
+    if (!in_db(group)) {
+        return s_db->files->save(s_db->files, p, group, name, aspect, vtype, value, create);
+    }
+    return md_util_pool_vdo(pdb_save, s_db, p, group, name, aspect,
+                            vtype, value, create, NULL);
+}
+
+static apr_status_t pdb_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_dbm_t *s_db = baton;
+    const char *name, *aspect;
+    md_store_group_t group;
+    apr_datum_t key;
+    int force;
+    db_ctx_t ctx;
+    apr_status_t rv;
+
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char *);
+    force = va_arg(ap, int);
+
+    key = mk_key(group, name, aspect, ptemp);
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 1, ptemp))) goto leave;
+    if (apr_dbm_exists(ctx.db, key)) {
+        rv = apr_dbm_delete(ctx.db, key);
+    }
+    else if (!force) {
+        rv = APR_ENOENT;
+    }
+    db_end(&ctx);
+leave:
+    return rv;
+}
+
+static apr_status_t db_remove(md_store_t *store, md_store_group_t group,
+                              const char *name, const char *aspect,
+                              apr_pool_t *p, int force)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+
+    if (!in_db(group)) {
+        return s_db->files->remove(s_db->files, group, name, aspect, p, force);
+    }
+    return md_util_pool_vdo(pdb_remove, s_db, p, group, name, aspect, force, NULL);
+}
+
+static apr_status_t pdb_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_dbm_t *s_db = baton;
+    const char *name;
+    md_store_group_t group;
+    apr_array_header_t *entries;
+    db_entry_t *e;
+    db_ctx_t ctx;
+    int i;
+    apr_status_t rv;
+
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 1, ptemp))) goto leave;
+    rv = db_collect(&entries, &ctx, group, NULL, NULL, 0, ptemp);
+    for (i = 0; APR_SUCCESS == rv && i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, db_entry_t);
+        if (!strcmp(name, e->name)) {
+            rv = apr_dbm_delete(ctx.db, e->key);
+        }
+    }
+    db_end(&ctx);
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "purge %s/%s",
+                  md_store_group_name(group), name);
+    return APR_SUCCESS;
+}
+
+static apr_status_t db_purge(md_store_t *store, apr_pool_t *p,
+                             md_store_group_t group, const char *name)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+
+    if (!in_db(group)) {
+        return s_db->files->purge(s_db->files, p, group, name);
+    }
+    return md_util_pool_vdo(pdb_purge, s_db, p, group, name, NULL);
+}
+
+static apr_status_t db_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                               apr_pool_t *p, md_store_group_t group, const char *pattern,
+                               const char *aspect, md_store_vtype_t vtype)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_array_header_t *entries;
+    db_entry_t *e;
+    db_ctx_t ctx;
+    void *value;
+    int i;
+    apr_status_t rv;
+
+    if (!in_db(group)) {
+        return s_db->files->iterate(inspect, baton, s_db->files, p, group,
+                                    pattern, aspect, vtype);
+    }
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 0, p))) goto leave;
+    rv = db_collect(&entries, &ctx, group, pattern, aspect, 1, p);
+    db_end(&ctx);
+    if (APR_SUCCESS != rv) goto leave;
+
+    /* The database is closed again, inspectors may change the store. */
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, db_entry_t);
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "inspecting value at: %s", e->key.dptr);
+        if (APR_SUCCESS != (rv = val_decode(&value, s_db, group, vtype, e->data, e->len, p))) {
+            goto leave;
+        }
+        if (!inspect(baton, e->name, e->aspect, vtype, value, p)) break;
+    }
+leave:
+    return rv;
+}
+
+static apr_status_t db_iterate_names(md_store_inspect *inspect, void *baton, md_store_t *store,
+                                     apr_pool_t *p, md_store_group_t group, const char *pattern)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_array_header_t *entries;
+    const char *last = NULL;
+    db_entry_t *e;
+    db_ctx_t ctx;
+    int i;
+    apr_status_t rv;
+
+    if (!in_db(group)) {
+        return s_db->files->iterate_names(inspect, baton, s_db->files, p, group, pattern);
+    }
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 0, p))) goto leave;
+    rv = db_collect(&entries, &ctx, group, pattern, NULL, 0, p);
+    db_end(&ctx);
+    if (APR_SUCCESS != rv) goto leave;
+
+    /* ordered by key, all aspects of a name are next to each other. As with
+     * files, the inspector returns a status and anything but success stops. */
+    for (i = 0; i < entries->nelts && APR_SUCCESS == rv; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, db_entry_t);
+        if (last && !strcmp(last, e->name)) continue;
+        last = e->name;
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "inspecting name: %s/%s",
+                      md_store_group_name(group), e->name);
+        rv = (apr_status_t)inspect(baton, md_store_group_name(group), e->name, 0, NULL, p);
+    }
+leave:
+    return rv;
+}
+
+static apr_status_t db_remove_nms(md_store_t *store, apr_pool_t *p,
+                                  apr_time_t modified, md_store_group_t group,
+                                  const char *name, const char *aspect)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_array_header_t *entries;
+    db_entry_t *e;
+    db_ctx_t ctx;
+    int i;
+    apr_status_t rv;
+
+    if (!in_db(group)) {
+        return s_db->files->remove_nms(s_db->files, p, modified, group, name, aspect);
+    }
+
+    if (APR_SUCCESS != (rv = db_begin(&ctx, s_db, 1, p))) goto leave;
+    rv = db_collect(&entries, &ctx, group, name, aspect, 1, p);
+    for (i = 0; APR_SUCCESS == rv && i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, db_entry_t);
+        if (e->mtime < modified) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "remove_nms: %s", e->key.dptr);
+            rv = apr_dbm_delete(ctx.db, e->key);
+        }
+    }
+    db_end(&ctx);
+leave:
+    return rv;
+}
+
+static apr_status_t db_lease(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                             const char *name, const char *holder, apr_interval_time_t ttl)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    /* leases need exclusive file creation, which the dbm does not offer */
+    return md_store_lease(s_db->files, p, group, name, holder, ttl);
+}
+
+static apr_status_t db_release(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                               const char *name, const char *holder)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    return md_store_release(s_db->files, p, group, name, holder);
+}
+
+static apr_status_t db_journal_add(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                   const char *name, const char *aspect)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    /* journals are appended to by many writers, they stay in files */
+    return md_store_journal_add(s_db->files, p, group, name, aspect);
+}
+
+static apr_status_t db_journal_cleanup(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                       md_store_journal_inspect *inspect, void *baton)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    return md_store_journal_cleanup(s_db->files, p, group, inspect, baton);
+}
+
+static apr_status_t db_move(md_store_t *store, apr_pool_t *p,
+                            md_store_group_t from, md_store_group_t to,
+                            const char *name, int archive)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    db_ctx_t ctx;
+    apr_status_t rv;
+
+    if (!in_db(from) && !in_db(to)) {
+        return s_db->files->move(s_db->files, p, from, to, name, archive);
+    }
+    if (from == to || !in_db(from) || !in_db(to) || archive) {
+        /* archives are directories, nothing in the database moves there */
+        return APR_ENOTIMPL;
+    }
+
+    if (APR_SUCCESS == (rv = db_begin(&ctx, s_db, 1, p))) {
+        rv = db_rekey(&ctx, from, name, to, name, p);
+        db_end(&ctx);
+    }
+    return rv;
+}
+
+static apr_status_t db_rename(md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *from, const char *to)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    db_ctx_t ctx;
+    apr_status_t rv;
+
+    if (!in_db(group)) {
+        return s_db->files->rename(s_db->files, p, group, from, to);
+    }
+
+    if (APR_SUCCESS == (rv = db_begin(&ctx, s_db, 1, p))) {
+        rv = db_rekey(&ctx, group, from, group, to, p);
+        db_end(&ctx);
+    }
+    return rv;
+}
+
+static apr_status_t db_get_fname(const char **pfname,
+                                 md_store_t *store, md_store_group_t group,
+                                 const char *name, const char *aspect,
+                                 apr_pool_t *p)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+
+    if (in_db(group) && name) {
+        /* values in the database have no file */
+        *pfname = NULL;
+        return APR_ENOTIMPL;
+    }
+    return s_db->files->get_fname(pfname, s_db->files, group, name, aspect, p);
+}
+
+static apr_time_t db_get_modified(md_store_t *store, md_store_group_t group,
+                                  const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_time_t mtime = 0;
+    apr_pool_t *ptemp;
+    db_ctx_t ctx;
+
+    if (!in_db(group)) {
+        return s_db->files->get_modified(s_db->files, group, name, aspect, p);
+    }
+    if (APR_SUCCESS != apr_pool_create(&ptemp, p)) return 0;
+    if (APR_SUCCESS == db_begin(&ctx, s_db, 0, ptemp)) {
+        if (APR_SUCCESS != db_fetch(NULL, NULL, &mtime, &ctx,
+                                    mk_key(group, name, aspect, ptemp), ptemp)) {
+            mtime = 0;
+        }
+        db_end(&ctx);
+    }
+    apr_pool_destroy(ptemp);
+    return mtime;
+}
+
+static int db_is_newer(md_store_t *store, md_store_group_t group1, md_store_group_t group2,
+                       const char *name, const char *aspect, apr_pool_t *p)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_time_t mtime1, mtime2;
+
+    if (!in_db(group1) && !in_db(group2)) {
+        return s_db->files->is_newer(s_db->files, group1, group2, name, aspect, p);
+    }
+    mtime1 = db_get_modified(store, group1, name, aspect, p);
+    mtime2 = db_get_modified(store, group2, name, aspect, p);
+    return mtime1 && mtime2 && mtime1 > mtime2;
+}
+
+/**************************************************************************************************/
+/* setup */
+
+apr_status_t md_store_dbm_check_type(const char *type, apr_pool_t *p)
+{
+    const char *used1, *used2;
+
+    if (!strcmp("sdbm", type) || !strcmp("default", type)) {
+        return APR_ENOTIMPL;
+    }
+    return apr_dbm_get_usednames_ex(p, type, "md_store", &used1, &used2);
+}
+
+apr_status_t md_store_dbm_init(md_store_t **pstore, apr_pool_t *p, md_store_t *files,
+                               const char *type, const char *path)
+{
+    md_store_dbm_t *s_db;
+    db_ctx_t ctx;
+    apr_status_t rv;
+
+    s_db = apr_pcalloc(p, sizeof(*s_db));
+
+    s_db->s.load = db_load;
+    s_db->s.save = db_save;
+    s_db->s.remove = db_remove;
+    s_db->s.move = db_move;
+    s_db->s.rename = db_rename;
+    s_db->s.purge = db_purge;
+    s_db->s.iterate = db_iterate;
+    s_db->s.iterate_names = db_iterate_names;
+    s_db->s.get_fname = db_get_fname;
+    s_db->s.is_newer = db_is_newer;
+    s_db->s.get_modified = db_get_modified;
+    s_db->s.remove_nms = db_remove_nms;
+    s_db->s.lease = db_lease;
+    s_db->s.release = db_release;
+    s_db->s.journal_add = db_journal_add;
+    s_db->s.journal_cleanup = db_journal_cleanup;
+
+    s_db->files = files;
+    s_db->type = apr_pstrdup(p, type);
+    s_db->path = apr_pstrdup(p, path);
+    s_db->lock_path = apr_pstrcat(p, path, ".lock", NULL);
+
+    if (APR_SUCCESS != (rv = md_store_dbm_check_type(type, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "dbm type '%s' not available", type);
+        goto leave;
+    }
+    rv = apr_thread_mutex_create(&s_db->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+
+    /* create the database, readers will find it */
+    if (APR_SUCCESS == (rv = db_begin(&ctx, s_db, 1, p))) {
+        db_end(&ctx);
+    }
+leave:
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init %s store at %s", type, path);
+    }
+    *pstore = (rv == APR_SUCCESS)? &(s_db->s) : NULL;
+    return rv;
+}
+
+apr_status_t md_store_dbm_get_fnames(apr_array_header_t **pfnames,
+                                     md_store_t *store, apr_pool_t *p)
+{
+    md_store_dbm_t *s_db = DBM_STORE(store);
+    apr_array_header_t *fnames;
+    const char *used1 = NULL, *used2 = NULL;
+    apr_status_t rv;
+
+    fnames = apr_array_make(p, 3, sizeof(const char *));
+    APR_ARRAY_PUSH(fnames, const char *) = s_db->lock_path;
+    if (APR_SUCCESS == (rv = apr_dbm_get_usednames_ex(p, s_db->type, s_db->path,
+                                                      &used1, &used2))) {
+        if (used1) APR_ARRAY_PUSH(fnames, const char *) = used1;
+        if (used2) APR_ARRAY_PUSH(fnames, const char *) = used2;
+    }
+    *pfnames = (APR_SUCCESS == rv)? fnames : NULL;
+    return rv;
+}
@@ -0,0 +1,48 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_store_dbm_h
+#define mod_md_md_store_dbm_h
+
+struct apr_array_header_t;
+struct md_store_t;
+
+/**
+ * Check if type names an apr_dbm implementation usable for a store. "sdbm" is
+ * not, as it limits the size of the values far below what OCSP responses need.
+ */
+apr_status_t md_store_dbm_check_type(const char *type, apr_pool_t *p);
+
+/**
+ * Create a store that keeps the values of groups CHALLENGES and OCSP as keys
+ * in a single database of the given apr_dbm type ("lmdb", "db", "gdbm") at
+ * path. All other groups are passed to the files store, since their
+ * certificates and keys are handed to the SSL module by file name.
+ *
+ * The files store needs to live as long as the created one.
+ */
+apr_status_t md_store_dbm_init(struct md_store_t **pstore, apr_pool_t *p,
+                               struct md_store_t *files, const char *type,
+                               const char *path);
+
+/**
+ * Get the names of all files used by the database store, so that their ownership
+ * can be given to the user the children run as.
+ */
+apr_status_t md_store_dbm_get_fnames(struct apr_array_header_t **pfnames, 
+                                     struct md_store_t *store, apr_pool_t *p);
+
+#endif /* mod_md_md_store_dbm_h */
@@ -24,7 +24,9 @@
 #include <apr_file_io.h>
 #include <apr_fnmatch.h>
 #include <apr_hash.h>
+#include <apr_mmap.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -60,6 +62,16 @@ struct md_store_fs_t {
     
     int port_80;
     int port_443;
+    
+    apr_pool_t *cache_p;            /* pool for cache keys and entries */
+    apr_thread_mutex_t *cache_mutex;
+    apr_hash_t *cache;              /* fpath -> fs_cache_entry_t, NULL if not enabled */
+    
+    apr_pool_t *names_p;            /* pool for the name indices */
+    apr_thread_mutex_t *names_mutex;
+    struct fs_names_t *names;       /* name index per group, NULL if not enabled */
+    
+    apr_array_header_t *compact_aspects; /* patterns of JSON aspects written compact */
 };
 
 #define FS_STORE(store)     (md_store_fs_t*)(((char*)store)-offsetof(md_store_fs_t, s))
@@ -101,6 +113,15 @@ static int fs_is_newer(md_store_t *store, md_store_group_t group1, md_store_grou
 static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,  
                                   const char *name, const char *aspect, apr_pool_t *p);
 
+static apr_status_t fs_lease(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                             const char *name, const char *holder, apr_interval_time_t ttl);
+static apr_status_t fs_release(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                               const char *name, const char *holder);
+static apr_status_t fs_journal_add(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                   const char *name, const char *aspect);
+static apr_status_t fs_journal_cleanup(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                       md_store_journal_inspect *inspect, void *baton);
+
 static apr_status_t init_store_file(md_store_fs_t *s_fs, const char *fname, 
                                     apr_pool_t *p, apr_pool_t *ptemp)
 {
@@ -255,6 +276,7 @@ static apr_status_t setup_store_file(void *baton, apr_pool_t *p, apr_pool_t *pte
     apr_status_t rv;
 
     (void)ap;
+    s_fs->plain_pkey[MD_SG_NONE] = 1;    /* shared fallback key, read by mod_ssl */
     s_fs->plain_pkey[MD_SG_DOMAINS] = 1;
     s_fs->plain_pkey[MD_SG_TMP] = 1;
     
@@ -292,6 +314,10 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     s_fs->s.is_newer = fs_is_newer;
     s_fs->s.get_modified = fs_get_modified;
     s_fs->s.remove_nms = fs_remove_nms;
+    s_fs->s.lease = fs_lease;
+    s_fs->s.release = fs_release;
+    s_fs->s.journal_add = fs_journal_add;
+    s_fs->s.journal_cleanup = fs_journal_cleanup;
     
     /* by default, everything is only readable by the current user */ 
     s_fs->def_perms.dir = MD_FPROT_D_UONLY;
@@ -309,6 +335,12 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     /* OCSP data is readable by all, no secrets involved */ 
     s_fs->group_perms[MD_SG_OCSP].dir = MD_FPROT_D_UALL_WREAD;
     s_fs->group_perms[MD_SG_OCSP].file = MD_FPROT_F_UALL_WREAD;
+    /* leases only carry the name of the holding server */ 
+    s_fs->group_perms[MD_SG_LEASES].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_LEASES].file = MD_FPROT_F_UALL_WREAD;
+    /* journals only list names of challenges and OCSP responses */ 
+    s_fs->group_perms[MD_SG_JOURNAL].dir = MD_FPROT_D_UALL_WREAD;
+    s_fs->group_perms[MD_SG_JOURNAL].file = MD_FPROT_F_UALL_WREAD;
 
     s_fs->base = apr_pstrdup(p, path);
     
@@ -361,6 +393,29 @@ apr_status_t md_store_fs_set_event_cb(struct md_store_t *store, md_store_fs_cb *
     return APR_SUCCESS;
 }
 
+apr_status_t md_store_fs_set_compact_json(md_store_t *store, apr_array_header_t *aspects)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    s_fs->compact_aspects = aspects;
+    return APR_SUCCESS;
+}
+
+static md_json_fmt_t json_fmt(md_store_fs_t *s_fs, const char *aspect)
+{
+    int i;
+    
+    if (s_fs->compact_aspects) {
+        for (i = 0; i < s_fs->compact_aspects->nelts; ++i) {
+            if (APR_SUCCESS == apr_fnmatch(APR_ARRAY_IDX(s_fs->compact_aspects, i, const char*), 
+                                           aspect, 0)) {
+                return MD_JSON_FMT_COMPACT;
+            }
+        }
+    }
+    return MD_JSON_FMT_INDENT;
+}
+
 static const perms_t *gperms(md_store_fs_t *s_fs, md_store_group_t group)
 {
     if (group >= (sizeof(s_fs->group_perms)/sizeof(s_fs->group_perms[0]))
@@ -408,6 +463,410 @@ static void get_pass(const char **ppass, apr_size_t *plen,
     }
 }
  
+void md_store_fs_get_pass(const char **ppass, apr_size_t *plen, 
+                          md_store_t *store, md_store_group_t group)
+{
+    get_pass(ppass, plen, FS_STORE(store), group);
+}
+
+/**************************************************************************************************/
+/* read cache */
+
+typedef struct {
+    apr_pool_t *p;                  /* the entry's own pool, destroyed when replaced */
+    md_store_vtype_t vtype;
+    apr_time_t mtime;
+    apr_off_t size;
+    apr_ino_t inode;
+    void *value;
+} fs_cache_entry_t;
+
+#define FS_CACHE_FINFO      (APR_FINFO_MTIME|APR_FINFO_SIZE|APR_FINFO_INODE)
+
+apr_status_t md_store_fs_enable_cache(md_store_t *store, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_status_t rv;
+    
+    if (s_fs->cache) return APR_SUCCESS;
+    if (APR_SUCCESS != (rv = apr_pool_create(&s_fs->cache_p, p))) goto leave;
+    apr_pool_tag(s_fs->cache_p, "md_store_fs_cache");
+    rv = apr_thread_mutex_create(&s_fs->cache_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+    s_fs->cache = apr_hash_make(s_fs->cache_p);
+leave:
+    return rv;
+}
+
+static int fs_cache_type(md_store_vtype_t vtype)
+{
+    switch (vtype) {
+        case MD_SV_TEXT:
+        case MD_SV_JSON:
+        case MD_SV_CERT:
+        case MD_SV_CHAIN:
+        case MD_SV_DER_CHAIN:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Copy a value to pool p, as far as the type needs it. Certificates are 
+ * immutable and shared, each holder having its own reference. */
+static void *fs_cache_copy(md_store_vtype_t vtype, void *value, apr_pool_t *p)
+{
+    apr_array_header_t *chain, *certs;
+    int i;
+    
+    switch (vtype) {
+        case MD_SV_TEXT:
+            return apr_pstrdup(p, value);
+        case MD_SV_JSON:
+            return md_json_clone(p, value);
+        case MD_SV_CERT:
+            return md_cert_dup(p, value);
+        case MD_SV_CHAIN:
+        case MD_SV_DER_CHAIN:
+            chain = value;
+            certs = apr_array_make(p, chain->nelts, sizeof(md_cert_t *));
+            for (i = 0; i < chain->nelts; ++i) {
+                APR_ARRAY_PUSH(certs, md_cert_t *) = 
+                    md_cert_dup(p, APR_ARRAY_IDX(chain, i, const md_cert_t *));
+            }
+            return certs;
+        default:
+            return NULL;
+    }
+}
+
+static int fs_cache_get(void **pvalue, md_store_fs_t *s_fs, const char *fpath, 
+                        md_store_vtype_t vtype, const apr_finfo_t *finfo, apr_pool_t *p)
+{
+    fs_cache_entry_t *e;
+    int hit = 0;
+    
+    apr_thread_mutex_lock(s_fs->cache_mutex);
+    e = apr_hash_get(s_fs->cache, fpath, APR_HASH_KEY_STRING);
+    if (e && e->vtype == vtype && e->mtime == finfo->mtime 
+        && e->size == finfo->size && e->inode == finfo->inode) {
+        *pvalue = fs_cache_copy(vtype, e->value, p);
+        hit = 1;
+    }
+    apr_thread_mutex_unlock(s_fs->cache_mutex);
+    return hit;
+}
+
+static void fs_cache_put(md_store_fs_t *s_fs, const char *fpath, md_store_vtype_t vtype, 
+                         void *value, const apr_finfo_t *finfo)
+{
+    fs_cache_entry_t *e, *old;
+    apr_pool_t *ep;
+    
+    apr_thread_mutex_lock(s_fs->cache_mutex);
+    if (APR_SUCCESS == apr_pool_create(&ep, s_fs->cache_p)) {
+        e = apr_pcalloc(ep, sizeof(*e));
+        e->p = ep;
+        e->vtype = vtype;
+        e->mtime = finfo->mtime;
+        e->size = finfo->size;
+        e->inode = finfo->inode;
+        e->value = fs_cache_copy(vtype, value, ep);
+        
+        old = apr_hash_get(s_fs->cache, fpath, APR_HASH_KEY_STRING);
+        if (old) {
+            /* the key stays, it lives in the cache pool */
+            apr_hash_set(s_fs->cache, fpath, APR_HASH_KEY_STRING, e);
+            apr_pool_destroy(old->p);
+        }
+        else {
+            apr_hash_set(s_fs->cache, apr_pstrdup(s_fs->cache_p, fpath), APR_HASH_KEY_STRING, e);
+        }
+    }
+    apr_thread_mutex_unlock(s_fs->cache_mutex);
+}
+
+static void fs_cache_update(md_store_fs_t *s_fs, const char *fpath, md_store_vtype_t vtype, 
+                            void *value, apr_pool_t *ptemp)
+{
+    apr_finfo_t finfo;
+    
+    if (s_fs->cache && fs_cache_type(vtype)
+        && APR_SUCCESS == apr_stat(&finfo, fpath, FS_CACHE_FINFO, ptemp)) {
+        fs_cache_put(s_fs, fpath, vtype, value, &finfo);
+    }
+}
+
+/**************************************************************************************************/
+/* name index */
+
+/* The names in a group are the directories below the group's directory. They
+ * are kept sorted, so that a pattern with a literal prefix, like "example.org*",
+ * only looks at the names starting with it. 
+ *
+ * Saving, purging, moving and renaming update the index of this process. Changes 
+ * made by other processes are detected by the modification time of the group
+ * directory, which changes whenever a name is added or removed there. */
+typedef struct fs_names_t fs_names_t;
+struct fs_names_t {
+    apr_pool_t *p;                  /* pool of the names, replaced on rebuild */
+    apr_array_header_t *names;      /* sorted (const char*) names */
+    apr_time_t mtime;               /* of the group directory, names are in sync with */
+    int valid;
+};
+
+apr_status_t md_store_fs_enable_name_index(md_store_t *store, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_status_t rv;
+    
+    if (s_fs->names) return APR_SUCCESS;
+    if (APR_SUCCESS != (rv = apr_pool_create(&s_fs->names_p, p))) goto leave;
+    apr_pool_tag(s_fs->names_p, "md_store_fs_names");
+    rv = apr_thread_mutex_create(&s_fs->names_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (APR_SUCCESS != rv) goto leave;
+    s_fs->names = apr_pcalloc(p, MD_SG_COUNT * sizeof(fs_names_t));
+leave:
+    return rv;
+}
+
+static int names_cmp(const void *v1, const void *v2)
+{
+    return strcmp(*(const char * const *)v1, *(const char * const *)v2);
+}
+
+/* index of the first name not less than s */
+static int names_lower_bound(apr_array_header_t *names, const char *s)
+{
+    int lo = 0, hi = names->nelts, mid;
+    
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(APR_ARRAY_IDX(names, mid, const char *), s) < 0) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static apr_status_t names_build(fs_names_t *idx, md_store_fs_t *s_fs, const char *gdir, 
+                                apr_pool_t *ptemp)
+{
+    apr_pool_t *np;
+    apr_array_header_t *names;
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    const char *fpath;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&np, s_fs->names_p))) return rv;
+    names = apr_array_make(np, 100, sizeof(const char *));
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, gdir, ptemp))) goto leave;
+    while (APR_SUCCESS == (rv = apr_dir_read(&finfo, APR_FINFO_TYPE, d))) {
+        if (!strcmp(".", finfo.name) || !strcmp("..", finfo.name)) continue;
+        if (APR_LNK == finfo.filetype 
+            && APR_SUCCESS == md_util_path_merge(&fpath, ptemp, gdir, finfo.name, NULL)
+            && APR_SUCCESS == md_util_is_dir(fpath, ptemp)) {
+            finfo.filetype = APR_DIR;
+        }
+        if (APR_DIR == finfo.filetype) {
+            APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(np, finfo.name);
+        }
+    }
+    apr_dir_close(d);
+    if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+    
+leave:
+    if (APR_SUCCESS == rv) {
+        qsort(names->elts, (size_t)names->nelts, sizeof(const char *), names_cmp);
+        if (idx->p) apr_pool_destroy(idx->p);
+        idx->p = np;
+        idx->names = names;
+    }
+    else {
+        apr_pool_destroy(np);
+    }
+    return rv;
+}
+
+/* Get the names in group matching pattern, copied to p. Rebuilds the index when
+ * the group directory changed since it was last in sync. */
+static apr_status_t names_get(apr_array_header_t **pnames, md_store_fs_t *s_fs, 
+                              md_store_group_t group, const char *pattern, apr_pool_t *p)
+{
+    fs_names_t *idx = &s_fs->names[group];
+    apr_array_header_t *names;
+    const char *gdir, *name;
+    apr_finfo_t finfo;
+    apr_size_t plen;
+    int i;
+    apr_status_t rv;
+    
+    names = apr_array_make(p, 10, sizeof(const char *));
+    if (APR_SUCCESS != (rv = fs_get_dname(&gdir, &s_fs->s, group, NULL, p))) goto leave;
+    
+    apr_thread_mutex_lock(s_fs->names_mutex);
+    rv = apr_stat(&finfo, gdir, APR_FINFO_MTIME, p);
+    if (APR_SUCCESS != rv) {
+        /* no directory, no names */
+        idx->valid = 0;
+        apr_thread_mutex_unlock(s_fs->names_mutex);
+        if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+        goto leave;
+    }
+    if (!idx->valid || idx->mtime != finfo.mtime) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "building name index of %s", gdir);
+        idx->valid = 0;
+        if (APR_SUCCESS == (rv = names_build(idx, s_fs, gdir, p))) {
+            idx->mtime = finfo.mtime;
+            idx->valid = 1;
+        }
+    }
+    if (APR_SUCCESS == rv) {
+        /* the part of pattern before any special character is the range to scan */
+        plen = strcspn(pattern, "*?[\\");
+        i = plen? names_lower_bound(idx->names, apr_pstrmemdup(p, pattern, plen)) : 0;
+        for (; i < idx->names->nelts; ++i) {
+            name = APR_ARRAY_IDX(idx->names, i, const char *);
+            if (plen && strncmp(name, pattern, plen)) break;
+            if (APR_SUCCESS == apr_fnmatch(pattern, name, 0)) {
+                APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(p, name);
+            }
+        }
+    }
+    apr_thread_mutex_unlock(s_fs->names_mutex);
+leave:
+    *pnames = (APR_SUCCESS == rv)? names : NULL;
+    return rv;
+}
+
+/* Record a name added to and/or removed from group by this process. A change by
+ * another process in the short time since the index was last checked is only 
+ * noticed with the next change of the directory. */
+static void names_update(md_store_fs_t *s_fs, md_store_group_t group, 
+                         const char *added, const char *removed, apr_pool_t *ptemp)
+{
+    fs_names_t *idx;
+    const char *gdir;
+    apr_finfo_t finfo;
+    int i;
+    
+    if (!s_fs->names || group >= MD_SG_COUNT || MD_SG_NONE == group) return;
+    idx = &s_fs->names[group];
+    
+    apr_thread_mutex_lock(s_fs->names_mutex);
+    if (!idx->valid) goto leave;
+    if (APR_SUCCESS != fs_get_dname(&gdir, &s_fs->s, group, NULL, ptemp)
+        || APR_SUCCESS != apr_stat(&finfo, gdir, APR_FINFO_MTIME, ptemp)) {
+        idx->valid = 0;
+        goto leave;
+    }
+    if (removed) {
+        i = names_lower_bound(idx->names, removed);
+        if (i < idx->names->nelts && !strcmp(removed, APR_ARRAY_IDX(idx->names, i, const char*))) {
+            memmove(idx->names->elts + ((apr_size_t)i * sizeof(const char *)), 
+                    idx->names->elts + ((apr_size_t)(i+1) * sizeof(const char *)),
+                    (apr_size_t)(idx->names->nelts - i - 1) * sizeof(const char *));
+            --idx->names->nelts;
+        }
+    }
+    if (added) {
+        i = names_lower_bound(idx->names, added);
+        if (i >= idx->names->nelts || strcmp(added, APR_ARRAY_IDX(idx->names, i, const char*))) {
+            apr_array_push(idx->names);
+            memmove(idx->names->elts + ((apr_size_t)(i+1) * sizeof(const char *)), 
+                    idx->names->elts + ((apr_size_t)i * sizeof(const char *)),
+                    (apr_size_t)(idx->names->nelts - i - 1) * sizeof(const char *));
+            APR_ARRAY_IDX(idx->names, i, const char *) = apr_pstrdup(idx->p, added);
+        }
+    }
+    idx->mtime = finfo.mtime;
+leave:
+    apr_thread_mutex_unlock(s_fs->names_mutex);
+}
+
+/**************************************************************************************************/
+/* file loading */
+
+/* Files of at least this size are mapped into memory for parsing, smaller ones
+ * are read, as setting up a mapping costs more than copying a few pages. */
+#define FS_MMAP_MIN         (16 * 1024)
+
+static apr_status_t fs_mem_parse(void **pvalue, const char *fpath, md_store_vtype_t vtype,
+                                 const char *data, apr_size_t len, apr_pool_t *p)
+{
+    apr_status_t rv;
+    
+    switch (vtype) {
+        case MD_SV_JSON:
+            rv = md_json_readd((md_json_t **)pvalue, p, data, len);
+            if (APR_SUCCESS != rv) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "failed to load JSON file %s", fpath);
+            }
+            break;
+        case MD_SV_CERT:
+            rv = md_cert_from_pem((md_cert_t **)pvalue, p, data, len);
+            break;
+        case MD_SV_CHAIN:
+            rv = md_chain_from_pem((apr_array_header_t **)pvalue, p, data, len);
+            if (APR_SUCCESS == rv && len >= 1024
+                && ((apr_array_header_t *)*pvalue)->nelts == 0) {
+                /* same as md_chain_fappend(): no longer acceptable as empty chain */
+                rv = APR_EINVAL;
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, 
+                              "no certificates in non-empty chain %s", fpath);
+            }
+            break;
+        case MD_SV_DER_CHAIN:
+            rv = md_chain_from_der((apr_array_header_t **)pvalue, p, data, len);
+            if (APR_SUCCESS != rv) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "malformed DER chain %s", fpath);
+            }
+            break;
+        default:
+            rv = APR_ENOTIMPL;
+            break;
+    }
+    return rv;
+}
+
+/* Parse the file contents from memory, mapped for larger files. */
+static apr_status_t fs_mem_load(void **pvalue, const char *fpath, md_store_vtype_t vtype, 
+                                apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_file_t *f;
+    apr_finfo_t finfo;
+    apr_size_t len;
+    char *buffer;
+    apr_status_t rv;
+#if APR_HAS_MMAP
+    apr_mmap_t *mm;
+#endif
+    
+    if (APR_SUCCESS != (rv = apr_file_open(&f, fpath, APR_FOPEN_READ, 0, ptemp))) return rv;
+    if (APR_SUCCESS != (rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f))) goto leave;
+    len = (apr_size_t)finfo.size;
+#if APR_HAS_MMAP
+    if (len >= FS_MMAP_MIN
+        && APR_SUCCESS == apr_mmap_create(&mm, f, 0, len, APR_MMAP_READ, ptemp)) {
+        rv = fs_mem_parse(pvalue, fpath, vtype, mm->mm, len, p);
+        apr_mmap_delete(mm);
+        goto leave;
+    }
+#endif
+    buffer = apr_palloc(ptemp, len + 1);
+    rv = apr_file_read_full(f, buffer, len, &len);
+    if (APR_SUCCESS == rv || APR_STATUS_IS_EOF(rv)) {
+        rv = fs_mem_parse(pvalue, fpath, vtype, buffer, len, p);
+    }
+leave:
+    apr_file_close(f);
+    return rv;
+}
+
 static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpath, 
                              md_store_group_t group, md_store_vtype_t vtype, 
                              apr_pool_t *p, apr_pool_t *ptemp)
@@ -415,6 +874,25 @@ static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpa
     apr_status_t rv;
     const char *pass;
     apr_size_t pass_len;
+    apr_finfo_t finfo;
+    int cached = 0;
+    
+    if (pvalue != NULL && s_fs->cache && fs_cache_type(vtype)) {
+        /* Stat before reading: should the file change in between, the 
+         * entry will not match the next time. */
+        rv = apr_stat(&finfo, fpath, FS_CACHE_FINFO, ptemp);
+        if (APR_SUCCESS == rv) {
+            if (fs_cache_get(pvalue, s_fs, fpath, vtype, &finfo, p)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, ptemp, 
+                              "cached type %d from %s", vtype, fpath);
+                return APR_SUCCESS;
+            }
+            cached = 1;
+        }
+        else if (!APR_STATUS_IS_INCOMPLETE(rv)) {
+            return rv;
+        }
+    }
     
     if (pvalue != NULL) {
         switch (vtype) {
@@ -422,24 +900,24 @@ static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpa
                 rv = md_text_fread8k((const char **)pvalue, p, fpath);
                 break;
             case MD_SV_JSON:
-                rv = md_json_readf((md_json_t **)pvalue, p, fpath);
-                break;
             case MD_SV_CERT:
-                rv = md_cert_fload((md_cert_t **)pvalue, p, fpath);
+            case MD_SV_CHAIN:
+            case MD_SV_DER_CHAIN:
+                rv = fs_mem_load(pvalue, fpath, vtype, p, ptemp);
                 break;
             case MD_SV_PKEY:
                 get_pass(&pass, &pass_len, s_fs, group);
                 rv = md_pkey_fload((md_pkey_t **)pvalue, p, pass, pass_len, fpath);
                 break;
-            case MD_SV_CHAIN:
-                rv = md_chain_fload((apr_array_header_t **)pvalue, p, fpath);
-                break;
             default:
                 rv = APR_ENOTIMPL;
                 break;
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp, 
                       "loading type %d from %s", vtype, fpath);
+        if (APR_SUCCESS == rv && cached) {
+            fs_cache_put(s_fs, fpath, vtype, *pvalue, &finfo);
+        }
     }
     else { /* check for existence only */
         rv = md_util_is_file(fpath, p);
@@ -491,6 +969,7 @@ static apr_status_t mk_group_dir(const char **pdir, md_store_fs_t *s_fs,
     if (MD_OK(fs_get_dname(pdir, &s_fs->s, group, name, p)) && (MD_SG_NONE != group)) {
         if (  !MD_OK(md_util_is_dir(*pdir, p))
             && MD_OK(apr_dir_make_recursive(*pdir, perms->dir, p))) {
+            if (name) names_update(s_fs, group, name, NULL, p);
             rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, *pdir, APR_DIR, p);
         }
         
@@ -585,6 +1064,15 @@ static apr_time_t fs_get_modified(md_store_t *store, md_store_group_t group,
     return 0;
 }
  
+static apr_status_t write_data(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    md_data_t *data = baton;
+    apr_size_t len = data->len;
+    
+    (void)p;
+    return apr_file_write_full(f, data->data, len, &len);
+}
+
 static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
@@ -597,6 +1085,7 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     const perms_t *perms;
     const char *pass;
     apr_size_t pass_len;
+    md_data_t data;
     
     group = (md_store_group_t)va_arg(ap, int);
     name = va_arg(ap, const char*);
@@ -618,9 +1107,9 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                       : md_text_freplace(fpath, perms->file, p, value));
                 break;
             case MD_SV_JSON:
-                rv = (create? md_json_fcreatex((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                rv = (create? md_json_fcreatex((md_json_t *)value, p, json_fmt(s_fs, aspect), 
                                                fpath, perms->file)
-                      : md_json_freplace((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                      : md_json_freplace((md_json_t *)value, p, json_fmt(s_fs, aspect), 
                                          fpath, perms->file));
                 break;
             case MD_SV_CERT:
@@ -636,10 +1125,17 @@ static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
             case MD_SV_CHAIN:
                 rv = md_chain_fsave((apr_array_header_t*)value, ptemp, fpath, perms->file);
                 break;
+            case MD_SV_DER_CHAIN:
+                if (APR_SUCCESS == (rv = md_chain_to_der(&data, value, ptemp))) {
+                    rv = md_util_freplace(fpath, perms->file, MD_UTIL_SYNC_FULL, ptemp, 
+                                          write_data, &data);
+                }
+                break;
             default:
                 return APR_ENOTIMPL;
         }
         if (APR_SUCCESS == rv) {
+            fs_cache_update(s_fs, fpath, vtype, value, ptemp);
             rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, fpath, APR_REG, p);
         }
     }
@@ -724,6 +1220,7 @@ static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     if (MD_OK(md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))) {
         /* Remove all files in dir, there should be no sub-dirs */
         rv = md_util_rm_recursive(dir, ptemp, 1);
+        names_update(s_fs, group, NULL, name, ptemp);
     }
     md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "purge %s/%s (%s)", groupname, name, dir);
     return APR_SUCCESS;
@@ -793,6 +1290,51 @@ static apr_status_t insp_dir(void *baton, apr_pool_t *p, apr_pool_t *ptemp,
     return rv;
 }
 
+static apr_status_t insp_name(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                              const char *dir, const char *name, apr_filetype_e ftype)
+{
+    inspect_ctx *ctx = baton;
+    
+    (void)ftype;
+    (void)p;
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting name at: %s/%s", dir, name);
+    return ctx->inspect(ctx->baton, dir, name, 0, NULL, ptemp);
+}
+
+/* Iterate over the names from the index instead of reading the group directory. 
+ * With an aspect that is no pattern, its file is loaded directly. */
+static apr_status_t iterate_indexed(inspect_ctx *ctx, int values, apr_pool_t *p)
+{
+    apr_array_header_t *names;
+    const char *gdir, *dir;
+    apr_pool_t *ptemp;
+    int i;
+    apr_status_t rv;
+    
+    if (   APR_SUCCESS != (rv = names_get(&names, ctx->s_fs, ctx->group, ctx->pattern, p))
+        || APR_SUCCESS != (rv = fs_get_dname(&gdir, &ctx->s_fs->s, ctx->group, NULL, p))
+        || APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        goto leave;
+    }
+    for (i = 0; i < names->nelts && APR_SUCCESS == rv; ++i) {
+        ctx->dirname = APR_ARRAY_IDX(names, i, const char *);
+        if (!values) {
+            rv = insp_name(ctx, p, ptemp, gdir, ctx->dirname, APR_DIR);
+        }
+        else if (apr_fnmatch_test(ctx->aspect)) {
+            rv = insp_dir(ctx, p, ptemp, gdir, ctx->dirname, APR_DIR);
+        }
+        else if (APR_SUCCESS == (rv = md_util_path_merge(&dir, ptemp, gdir, 
+                                                         ctx->dirname, NULL))) {
+            rv = insp(ctx, p, ptemp, dir, ctx->aspect, APR_REG);
+        }
+        apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+leave:
+    return rv;
+}
+
 static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_t *store, 
                                apr_pool_t *p, md_store_group_t group, const char *pattern, 
                                const char *aspect, md_store_vtype_t vtype)
@@ -810,22 +1352,14 @@ static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_
     ctx.baton = baton;
     groupname = md_store_group_name(group);
 
+    if (ctx.s_fs->names) {
+        return iterate_indexed(&ctx, 1, p);
+    }
     rv = md_util_files_do(insp_dir, &ctx, p, ctx.s_fs->base, groupname, pattern, NULL);
     
     return rv;
 }
 
-static apr_status_t insp_name(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
-                              const char *dir, const char *name, apr_filetype_e ftype)
-{
-    inspect_ctx *ctx = baton;
-    
-    (void)ftype;
-    (void)p;
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting name at: %s/%s", dir, name);
-    return ctx->inspect(ctx->baton, dir, name, 0, NULL, ptemp);
-}
-
 static apr_status_t fs_iterate_names(md_store_inspect *inspect, void *baton, md_store_t *store, 
                                      apr_pool_t *p, md_store_group_t group, const char *pattern)
 {
@@ -840,6 +1374,9 @@ static apr_status_t fs_iterate_names(md_store_inspect *inspect, void *baton, md_
     ctx.baton = baton;
     groupname = md_store_group_name(group);
 
+    if (ctx.s_fs->names) {
+        return iterate_indexed(&ctx, 0, p);
+    }
     rv = md_util_files_do(insp_name, &ctx, p, ctx.s_fs->base, groupname, pattern, NULL);
     
     return rv;
@@ -1008,6 +1545,9 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
             apr_file_rename(narch_dir, to_dir, ptemp);
             goto out;
         }
+        names_update(s_fs, MD_SG_ARCHIVE, apr_psprintf(ptemp, "%s.%d", name, n), NULL, ptemp);
+        names_update(s_fs, from, NULL, name, ptemp);
+        names_update(s_fs, to, name, NULL, ptemp);
         if (MD_OK(dispatch(s_fs, MD_S_FS_EV_MOVED, to, to_dir, APR_DIR, ptemp))) {
             rv = dispatch(s_fs, MD_S_FS_EV_MOVED, MD_SG_ARCHIVE, narch_dir, APR_DIR, ptemp);
         }
@@ -1018,6 +1558,8 @@ static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
                           from_dir, to_dir);
             goto out;
         }
+        names_update(s_fs, from, NULL, name, ptemp);
+        names_update(s_fs, to, name, NULL, ptemp);
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "target is no dir: %s", to_dir);
@@ -1060,6 +1602,7 @@ static apr_status_t pfs_rename(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va
                       from_dir, to_dir);
         goto out;
     }
+    names_update(s_fs, group, to, from, ptemp);
 out:
     return rv;
 }
@@ -1070,3 +1613,387 @@ static apr_status_t fs_rename(md_store_t *store, apr_pool_t *p,
     md_store_fs_t *s_fs = FS_STORE(store);
     return md_util_pool_vdo(pfs_rename, s_fs, p, group, from, to, NULL);
 }
+
+/**************************************************************************************************/
+/* leases */
+
+/* A lease is a small JSON file in the LEASES group, named after the group and item
+ * it is on. It is created exclusively, which is atomic on local file systems and
+ * on NFSv3 and later, so only one of the servers sharing a store succeeds. It
+ * records the holder and until when the lease lasts. Expired leases are taken 
+ * over by renaming them out of the way first, so that only one contender removes
+ * the stale file. */
+
+static apr_status_t lease_fname(const char **pfname, md_store_fs_t *s_fs, 
+                                md_store_group_t group, const char *name, apr_pool_t *p)
+{
+    const char *dir, *fname;
+    apr_status_t rv;
+    
+    if (MD_OK(mk_group_dir(&dir, s_fs, MD_SG_LEASES, NULL, p))) {
+        fname = name? apr_psprintf(p, "%s.%s.json", md_store_group_name(group), name)
+                    : apr_psprintf(p, "%s.json", md_store_group_name(group));
+        rv = md_util_path_merge(pfname, p, dir, fname, NULL);
+    }
+    return rv;
+}
+
+static apr_status_t lease_read(const char **pholder, apr_time_t *puntil, const char *fpath, 
+                               apr_interval_time_t ttl, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_finfo_t info;
+    apr_status_t rv;
+    
+    *pholder = NULL;
+    *puntil = 0;
+    if (MD_OK(md_json_readf(&json, p, fpath))) {
+        *pholder = md_json_gets(json, MD_KEY_HOLDER, NULL);
+        *puntil = md_json_get_time(json, MD_KEY_UNTIL, NULL);
+    }
+    else if (MD_OK(apr_stat(&info, fpath, APR_FINFO_MTIME, p))) {
+        /* file exists, but is not (yet) readable, e.g. while its creator is
+         * still writing. Give it its full ttl from its last modification. */
+        *puntil = info.mtime + ttl;
+    }
+    return rv;
+}
+
+static apr_status_t pfs_lease(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *name, *holder, *fpath, *stale, *cur_holder;
+    md_store_group_t group;
+    apr_interval_time_t ttl;
+    apr_time_t now, until;
+    md_json_t *json;
+    apr_status_t rv;
+    int i;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    holder = va_arg(ap, const char*);
+    ttl = va_arg(ap, apr_interval_time_t);
+    
+    if (!MD_OK(lease_fname(&fpath, s_fs, group, name, ptemp))) goto leave;
+    
+    now = apr_time_now();
+    json = md_json_create(ptemp);
+    md_json_sets(holder, json, MD_KEY_HOLDER, NULL);
+    md_json_set_time(now + ttl, json, MD_KEY_UNTIL, NULL);
+    
+    for (i = 0; i < 2; ++i) {
+        rv = md_json_fcreatex(json, ptemp, MD_JSON_FMT_COMPACT, fpath, 
+                              gperms(s_fs, MD_SG_LEASES)->file);
+        if (!APR_STATUS_IS_EEXIST(rv)) goto leave;
+        
+        if (!MD_OK(lease_read(&cur_holder, &until, fpath, ttl, ptemp))) {
+            /* vanished in between, try again */
+            if (APR_STATUS_IS_ENOENT(rv)) continue;
+            goto leave;
+        }
+        if (cur_holder && !strcmp(holder, cur_holder)) {
+            /* ours, extend it */
+            rv = md_json_freplace(json, ptemp, MD_JSON_FMT_COMPACT, fpath, 
+                                  gperms(s_fs, MD_SG_LEASES)->file);
+            goto leave;
+        }
+        if (until > now) {
+            rv = APR_EBUSY;
+            goto leave;
+        }
+        
+        /* expired, move it out of the way under a name only we use. Should another
+         * contender have replaced it with a fresh lease in the meantime, we put that 
+         * one back. */
+        stale = apr_psprintf(ptemp, "%s.%s.expired", fpath, holder);
+        if (!MD_OK(apr_file_rename(fpath, stale, ptemp))) {
+            if (APR_STATUS_IS_ENOENT(rv)) continue;
+            goto leave;
+        }
+        if (APR_SUCCESS == lease_read(&cur_holder, &until, stale, ttl, ptemp) 
+            && until > now) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, 
+                          "lease %s just taken by %s", fpath, cur_holder? cur_holder : "?");
+            apr_file_rename(stale, fpath, ptemp);
+            rv = APR_EBUSY;
+            goto leave;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, 
+                      "taking over expired lease %s of %s", fpath, cur_holder? cur_holder : "?");
+        apr_file_remove(stale, ptemp);
+    }
+    /* lost every race */
+    rv = APR_EBUSY;
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE2, rv, ptemp, "lease %s/%s for %s", 
+                  md_store_group_name(group), name? name : "", holder);
+    return rv;
+}
+
+static apr_status_t fs_lease(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                             const char *name, const char *holder, apr_interval_time_t ttl)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_lease, s_fs, p, group, name, holder, ttl, NULL);
+}
+
+static apr_status_t pfs_release(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *name, *holder, *fpath, *cur_holder;
+    md_store_group_t group;
+    apr_time_t until;
+    apr_status_t rv;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    holder = va_arg(ap, const char*);
+    
+    if (MD_OK(lease_fname(&fpath, s_fs, group, name, ptemp))
+        && MD_OK(lease_read(&cur_holder, &until, fpath, 0, ptemp))
+        && cur_holder && !strcmp(holder, cur_holder)) {
+        rv = apr_file_remove(fpath, ptemp);
+    }
+    if (APR_STATUS_IS_ENOENT(rv)) rv = APR_SUCCESS;
+    return rv;
+}
+
+static apr_status_t fs_release(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                               const char *name, const char *holder)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_release, s_fs, p, group, name, holder, NULL);
+}
+
+/**************************************************************************************************/
+/* cleanup journals */
+
+/* The cleanup journal of a group is a text file in the JOURNAL group, named after
+ * the group, with a line "<time> <name> <aspect>" for each item created. Lines are
+ * only appended, which the OS does atomically for writes this small, so the threads
+ * and processes creating items need no lock among each other. A cleanup first renames
+ * the file aside, so that lines appended meanwhile go to a new one. It reads all lines
+ * aside, merges duplicates and appends the entries it keeps to the new file. An aside
+ * file left by a crash is read by the next cleanup. */
+
+#define FS_JOURNAL_NO_ASPECT    "-"
+#define FS_JOURNAL_ASIDE        ".cleanup"
+
+typedef struct {
+    const char *name;
+    const char *aspect;
+    apr_time_t time;
+} journal_entry_t;
+
+typedef struct {
+    apr_array_header_t *entries;
+} journal_write_ctx;
+
+static apr_status_t journal_fname(const char **pfname, md_store_fs_t *s_fs, 
+                                  md_store_group_t group, apr_pool_t *p)
+{
+    const char *dir, *fname;
+    apr_status_t rv;
+    
+    if (MD_OK(mk_group_dir(&dir, s_fs, MD_SG_JOURNAL, NULL, p))) {
+        fname = apr_psprintf(p, "%s.log", md_store_group_name(group));
+        rv = md_util_path_merge(pfname, p, dir, fname, NULL);
+    }
+    return rv;
+}
+
+static int journal_valid(const char *s)
+{
+    return s && *s && !strpbrk(s, " \t\r\n");
+}
+
+static apr_status_t pfs_journal_add(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *name, *aspect, *fpath, *line;
+    md_store_group_t group;
+    apr_file_t *f;
+    int created;
+    apr_status_t rv;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char*);
+    
+    if ((name && !journal_valid(name)) || (aspect && !journal_valid(aspect))) {
+        rv = APR_EINVAL;
+        goto leave;
+    }
+    if (!MD_OK(journal_fname(&fpath, s_fs, group, ptemp))) goto leave;
+    created = !md_file_exists(fpath, ptemp);
+    if (!MD_OK(apr_file_open(&f, fpath, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_APPEND, 
+                             gperms(s_fs, MD_SG_JOURNAL)->file, ptemp))) goto leave;
+    if (name) {
+        line = apr_psprintf(ptemp, "%" APR_TIME_T_FMT " %s %s\n", apr_time_now(), 
+                            name, aspect? aspect : FS_JOURNAL_NO_ASPECT);
+        rv = apr_file_write_full(f, line, strlen(line), NULL);
+    }
+    apr_file_close(f);
+    if (APR_SUCCESS == rv && created) {
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_JOURNAL, fpath, APR_REG, ptemp);
+    }
+leave:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp, "journal %s: add %s/%s", 
+                  md_store_group_name(group), name? name : "", aspect? aspect : "");
+    return rv;
+}
+
+static apr_status_t fs_journal_add(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                   const char *name, const char *aspect)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_journal_add, s_fs, p, group, name, aspect, NULL);
+}
+
+/* Add the lines of the journal at fpath to entries, known has the entries by key */
+static apr_status_t journal_read(apr_array_header_t *entries, apr_hash_t *known, int *pmerged, 
+                                 const char *fpath, apr_pool_t *p)
+{
+    journal_entry_t *e;
+    apr_file_t *f;
+    char line[1024], *tok, *last;
+    const char *key, *name, *aspect;
+    apr_time_t t;
+    int idx;
+    apr_status_t rv;
+    
+    if (!MD_OK(apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_BUFFERED, 0, p))) goto leave;
+    while (APR_SUCCESS == (rv = apr_file_gets(line, sizeof(line), f))) {
+        if (!(tok = apr_strtok(line, " \t\r\n", &last))) continue;
+        t = (apr_time_t)apr_atoi64(tok);
+        name = apr_strtok(NULL, " \t\r\n", &last);
+        aspect = apr_strtok(NULL, " \t\r\n", &last);
+        if (t <= 0 || !name || !aspect) {
+            /* e.g. cut short by a crash, the item is still in the group */
+            *pmerged = 1;
+            continue;
+        }
+        key = apr_pstrcat(p, name, " ", aspect, NULL);
+        if ((idx = (int)(apr_size_t)apr_hash_get(known, key, APR_HASH_KEY_STRING)) > 0) {
+            e = &APR_ARRAY_IDX(entries, idx - 1, journal_entry_t);
+            if (t > e->time) e->time = t;
+            *pmerged = 1;
+            continue;
+        }
+        e = apr_array_push(entries);
+        e->name = apr_pstrdup(p, name);
+        e->aspect = strcmp(FS_JOURNAL_NO_ASPECT, aspect)? apr_pstrdup(p, aspect) : NULL;
+        e->time = t;
+        /* by position + 1, the array moves when it grows */
+        apr_hash_set(known, key, APR_HASH_KEY_STRING, (void*)(apr_size_t)entries->nelts);
+    }
+    if (APR_STATUS_IS_EOF(rv)) rv = APR_SUCCESS;
+    apr_file_close(f);
+leave:
+    return rv;
+}
+
+static apr_status_t journal_write(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    journal_write_ctx *ctx = baton;
+    journal_entry_t *e;
+    const char *line;
+    int i;
+    apr_status_t rv = APR_SUCCESS;
+    
+    for (i = 0; i < ctx->entries->nelts && APR_SUCCESS == rv; ++i) {
+        e = &APR_ARRAY_IDX(ctx->entries, i, journal_entry_t);
+        line = apr_psprintf(p, "%" APR_TIME_T_FMT " %s %s\n", e->time, 
+                            e->name, e->aspect? e->aspect : FS_JOURNAL_NO_ASPECT);
+        rv = apr_file_write_full(f, line, strlen(line), NULL);
+    }
+    return rv;
+}
+
+static apr_status_t pfs_journal_cleanup(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    md_store_group_t group;
+    md_store_journal_inspect *inspect;
+    void *inspect_baton;
+    apr_array_header_t *entries, *kept;
+    apr_hash_t *known;
+    journal_write_ctx ctx;
+    journal_entry_t *e;
+    const char *fpath, *aside;
+    apr_pool_t *pentry;
+    apr_file_t *f;
+    apr_time_t t;
+    int i, changed = 0, created;
+    apr_status_t rv;
+    
+    (void)p;
+    group = (md_store_group_t)va_arg(ap, int);
+    inspect = va_arg(ap, md_store_journal_inspect*);
+    inspect_baton = va_arg(ap, void*);
+    
+    entries = apr_array_make(ptemp, 100, sizeof(journal_entry_t));
+    known = apr_hash_make(ptemp);
+    if (!MD_OK(journal_fname(&fpath, s_fs, group, ptemp))) goto leave;
+    aside = apr_pstrcat(ptemp, fpath, FS_JOURNAL_ASIDE, NULL);
+    /* left by an earlier cleanup that did not finish, it is replaced below */
+    rv = journal_read(entries, known, &changed, aside, ptemp);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto leave;
+    /* lines appended from now on go to a new file, none get lost */
+    rv = apr_file_rename(fpath, aside, ptemp);
+    if (APR_SUCCESS == rv) {
+        rv = journal_read(entries, known, &changed, aside, ptemp);
+    }
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto leave;
+    if (entries->nelts == 0 && APR_STATUS_IS_ENOENT(rv)) {
+        rv = APR_SUCCESS;
+        goto leave;
+    }
+    if (!MD_OK(apr_pool_create(&pentry, ptemp))) goto leave;
+    
+    kept = apr_array_make(ptemp, entries->nelts, sizeof(journal_entry_t));
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, journal_entry_t);
+        t = e->time;
+        if (inspect(inspect_baton, e->name, e->aspect, &t, pentry)) {
+            if (t != e->time) changed = 1;
+            e->time = t;
+            APR_ARRAY_PUSH(kept, journal_entry_t) = *e;
+        }
+        else {
+            changed = 1;
+        }
+        apr_pool_clear(pentry);
+    }
+    apr_pool_destroy(pentry);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "journal %s: kept %d of %d entries%s", 
+                  md_store_group_name(group), kept->nelts, entries->nelts, 
+                  changed? ", merged" : "");
+    
+    /* appended like any other line, next to those added while we inspected */
+    ctx.entries = kept;
+    created = !md_file_exists(fpath, ptemp);
+    if (!MD_OK(apr_file_open(&f, fpath, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_APPEND, 
+                             gperms(s_fs, MD_SG_JOURNAL)->file, ptemp))) goto leave;
+    rv = journal_write(&ctx, f, ptemp);
+    apr_file_close(f);
+    if (APR_SUCCESS != rv) goto leave;
+    apr_file_remove(aside, ptemp);
+    if (created) {
+        /* appended to by the workers */
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_JOURNAL, fpath, APR_REG, ptemp);
+    }
+leave:
+    return rv;
+}
+
+static apr_status_t fs_journal_cleanup(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                                       md_store_journal_inspect *inspect, void *baton)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_journal_cleanup, s_fs, p, group, inspect, baton, NULL);
+}
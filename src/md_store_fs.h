@@ -17,6 +17,7 @@
 #ifndef mod_md_md_store_fs_h
 #define mod_md_md_store_fs_h
 
+struct apr_array_header_t;
 struct md_store_t;
 
 /** 
@@ -62,4 +63,34 @@ typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
                                     
 apr_status_t md_store_fs_set_event_cb(struct md_store_t *store, md_store_fs_cb *cb, void *baton);
 
+/**
+ * Keep text, JSON, certificate and chain values read from or written to the
+ * store in memory. Before a value is used again, the file is checked for
+ * changes in modification time, size and inode. Certificates are shared, 
+ * all other values are copied for the caller. Private keys are never cached.
+ */
+apr_status_t md_store_fs_enable_cache(struct md_store_t *store, apr_pool_t *p);
+
+/**
+ * Keep a sorted index of the names in each group, so that iterations no longer
+ * read the directories. The index is updated by changes made through this store
+ * and rebuilt when the modification time of a group directory changes.
+ */
+apr_status_t md_store_fs_enable_name_index(struct md_store_t *store, apr_pool_t *p);
+
+/**
+ * Write the JSON values of aspects matching one of the (const char*) patterns
+ * without indentation. Meant for files only the module reads, which are rewritten 
+ * often. Files are read in either format.
+ */
+apr_status_t md_store_fs_set_compact_json(struct md_store_t *store, 
+                                          struct apr_array_header_t *aspects);
+
+/**
+ * Get the pass phrase that private keys in group are protected with. NULL when
+ * keys in this group are stored in plain.
+ */
+void md_store_fs_get_pass(const char **ppass, apr_size_t *plen, 
+                          struct md_store_t *store, md_store_group_t group);
+
 #endif /* mod_md_md_store_fs_h */
@@ -15,6 +15,7 @@
  */
  
 #include <assert.h>
+#include <signal.h>
 #include <stdio.h>
 
 #include <apr_lib.h>
@@ -22,9 +23,14 @@
 #include <apr_portable.h>
 #include <apr_file_info.h>
 #include <apr_fnmatch.h>
+#include <apr_hash.h>
 #include <apr_tables.h>
 #include <apr_uri.h>
 
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>         /* fsync */
+#endif
+
 #include "md.h"
 #include "md_log.h"
 #include "md_util.h"
@@ -370,39 +376,68 @@ apr_status_t md_util_path_merge(const char **ppath, apr_pool_t *p, ...)
     return rv;
 }
 
-apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
-                              md_util_file_cb *write_cb, void *baton)
+static apr_status_t file_sync(apr_file_t *f)
 {
-    apr_status_t rv = APR_EEXIST;
-    apr_file_t *f;
-    const char *tmp;
-    int i, max;
+    apr_os_file_t fd;
+    apr_status_t rv;
     
-    tmp = apr_psprintf(p, "%s.tmp", fpath);
-    i = 0; max = 20;
-creat:
-    while (i < max && APR_EEXIST == (rv = md_util_fcreatex(&f, tmp, perms, p))) {
-        ++i;
-        apr_sleep(apr_time_from_msec(50));
-    } 
-    if (APR_EEXIST == rv 
-        && APR_SUCCESS == (rv = apr_file_remove(tmp, p))
-        && max <= 20) {
-        max *= 2;
-        goto creat;
+    if (APR_SUCCESS != (rv = apr_file_flush(f))
+        || APR_SUCCESS != (rv = apr_os_file_get(&fd, f))) {
+        return rv;
     }
+#ifdef WIN32
+    return FlushFileBuffers(fd)? APR_SUCCESS : apr_get_os_error();
+#else
+    return fsync(fd)? apr_get_os_error() : APR_SUCCESS;
+#endif
+}
+
+static void dir_sync(const char *fpath, apr_pool_t *p)
+{
+#ifndef WIN32
+    /* Make the rename itself durable. Not all filesystems support syncing
+     * a directory, there is nothing to be done about that. */
+    const char *slash, *dir;
+    apr_file_t *d;
     
-    if (APR_SUCCESS == rv) {
-        rv = write_cb(baton, f, p);
-        apr_file_close(f);
-        
-        if (APR_SUCCESS == rv) {
-            rv = apr_file_rename(tmp, fpath, p);
-            if (APR_SUCCESS != rv) {
-                apr_file_remove(tmp, p);
-            }
-        }
+    slash = strrchr(fpath, '/');
+    dir = slash? apr_pstrndup(p, fpath, (apr_size_t)(slash - fpath)) : ".";
+    if (!*dir) dir = "/";
+    if (APR_SUCCESS == apr_file_open(&d, dir, APR_FOPEN_READ, APR_OS_DEFAULT, p)) {
+        file_sync(d);
+        apr_file_close(d);
+    }
+#else
+    (void)fpath;
+    (void)p;
+#endif
+}
+
+apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, md_util_sync_t sync, 
+                              apr_pool_t *p, md_util_file_cb *write_cb, void *baton)
+{
+    apr_status_t rv;
+    apr_file_t *f;
+    char *tmp;
+    
+    tmp = apr_psprintf(p, "%s.tmpXXXXXX", fpath);
+    rv = apr_file_mktemp(&f, tmp, (APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_EXCL), p);
+    if (APR_SUCCESS != rv) goto leave;
+    
+    /* The temporary file is created with restricted permissions, set the ones we want */
+    rv = apr_file_perms_set(tmp, perms);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) rv = APR_SUCCESS;
+    if (APR_SUCCESS == rv) rv = write_cb(baton, f, p);
+    if (APR_SUCCESS == rv && MD_UTIL_SYNC_FULL == sync) rv = file_sync(f);
+    apr_file_close(f);
+    
+    if (APR_SUCCESS == rv) rv = apr_file_rename(tmp, fpath, p);
+    if (APR_SUCCESS != rv) {
+        apr_file_remove(tmp, p);
+        goto leave;
     }
+    if (MD_UTIL_SYNC_FULL == sync) dir_sync(fpath, p);
+leave:
     return rv;
 }                            
 
@@ -461,7 +496,7 @@ apr_status_t md_text_fcreatex(const char *fpath, apr_fileperms_t perms,
 apr_status_t md_text_freplace(const char *fpath, apr_fileperms_t perms, 
                               apr_pool_t *p, const char *text)
 {
-    return md_util_freplace(fpath, perms, p, write_text, (void*)text);
+    return md_util_freplace(fpath, perms, MD_UTIL_SYNC_NONE, p, write_text, (void*)text);
 }
 
 typedef struct {
@@ -748,33 +783,102 @@ apr_status_t md_util_ftree_remove(const char *path, apr_pool_t *p)
 
 /* DNS name checks ********************************************************************************/
 
+#define DNS_C_ALNUM     0x01
+#define DNS_C_HYPHEN    0x02
+#define DNS_C_DOT       0x04
+
+#define AN DNS_C_ALNUM
+#define HY DNS_C_HYPHEN
+#define DT DNS_C_DOT
+/* character classes of pure ASCII domain names */
+static const unsigned char DNS_CLASS[256] = {
+/*   0   1   2   3   4   5   6   7   8   9   a   b   c   d   e   f        */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* 0 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* 1 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, HY, DT,  0, /* 2 */
+    AN, AN, AN, AN, AN, AN, AN, AN, AN, AN,  0,  0,  0,  0,  0,  0, /* 3 */
+     0, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, /* 4 */
+    AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN,  0,  0,  0,  0,  0, /* 5 */
+     0, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, /* 6 */
+    AN, AN, AN, AN, AN, AN, AN, AN, AN, AN, AN,  0,  0,  0,  0,  0, /* 7 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* 8 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* 9 */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* a */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* b */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* c */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* d */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, /* e */
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0  /* f */
+};
+#undef AN
+#undef HY
+#undef DT
+
+/* ASCII lower case of all bytes */
+static const unsigned char DNS_LOWER[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+/* Compare len bytes of a name in lower case with any other */
+static int dns_lc_eq(const char *lc, const char *s, apr_size_t len)
+{
+    const unsigned char *l = (const unsigned char *)lc, *u = (const unsigned char *)s;
+    apr_size_t i;
+    
+    for (i = 0; i < len; ++i) {
+        if (l[i] != DNS_LOWER[u[i]]) return 0;
+    }
+    return 1;
+}
+
+static int dns_case_eq(const char *s1, const char *s2, apr_size_t len)
+{
+    const unsigned char *u1 = (const unsigned char *)s1, *u2 = (const unsigned char *)s2;
+    apr_size_t i;
+    
+    for (i = 0; i < len; ++i) {
+        if (DNS_LOWER[u1[i]] != DNS_LOWER[u2[i]]) return 0;
+    }
+    return 1;
+}
+
 int md_dns_is_name(apr_pool_t *p, const char *hostname, int need_fqdn)
 {
-    char c, last = 0;
-    const char *cp = hostname;
+    const unsigned char *cp = (const unsigned char *)hostname;
+    unsigned char c, cclass, last = 0;
     int dots = 0;
     
     /* Since we use the names in certificates, we need pure ASCII domain names
      * and IDN need to be converted to unicode. */
     while ((c = *cp++)) {
-        switch (c) {
-            case '.':
-                if (last == '.') {
-                    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "dns name with ..: %s", 
-                                  hostname);
-                    return 0;
-                }
-                ++dots;
-                break;
-            case '-':
-                break;
-            default:
-                if (!apr_isalnum(c)) {
-                    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "dns invalid char %c: %s", 
-                                  c, hostname);
-                    return 0;
-                }
-                break;
+        cclass = DNS_CLASS[c];
+        if (!cclass) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "dns invalid char %c: %s", 
+                          c, hostname);
+            return 0;
+        }
+        if (cclass == DNS_C_DOT) {
+            if (last == '.') {
+                md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, p, "dns name with ..: %s", 
+                              hostname);
+                return 0;
+            }
+            ++dots;
         }
         last = c;
     }
@@ -797,12 +901,79 @@ int md_dns_is_wildcard(apr_pool_t *p, const char *domain)
 
 int md_dns_matches(const char *pattern, const char *domain)
 {
+    apr_size_t plen = strlen(pattern), dlen = strlen(domain);
     const char *s;
     
-    if (!apr_strnatcasecmp(pattern, domain)) return 1;
+    if (plen == dlen && dns_case_eq(pattern, domain, dlen)) return 1;
     if (pattern[0] == '*' && pattern[1] == '.') {
-        s = strchr(domain, '.');
-        if (s && !apr_strnatcasecmp(pattern+1, s)) return 1;
+        s = memchr(domain, '.', dlen);
+        if (s && plen - 1 == dlen - (apr_size_t)(s - domain) 
+            && dns_case_eq(pattern + 1, s, plen - 1)) return 1;
+    }
+    return 0;
+}
+
+void md_dns_name_init(md_dns_name_t *dn, const char *name, apr_pool_t *p)
+{
+    char *lc;
+    apr_size_t i;
+    
+    dn->len = strlen(name);
+    lc = apr_palloc(p, dn->len + 1);
+    for (i = 0; i <= dn->len; ++i) {
+        lc[i] = (char)DNS_LOWER[(unsigned char)name[i]];
+    }
+    dn->name = lc;
+    dn->wildcard = (lc[0] == '*' && lc[1] == '.');
+}
+
+void md_dns_names_add(apr_array_header_t *dns_names, const apr_array_header_t *names, 
+                      int start, apr_pool_t *p)
+{
+    int i;
+    
+    for (i = start; i < names->nelts; ++i) {
+        md_dns_name_init(apr_array_push(dns_names), APR_ARRAY_IDX(names, i, const char*), p);
+    }
+}
+
+apr_array_header_t *md_dns_names_make(apr_pool_t *p, const apr_array_header_t *names)
+{
+    apr_array_header_t *dns_names;
+    
+    dns_names = apr_array_make(p, names->nelts, sizeof(md_dns_name_t));
+    md_dns_names_add(dns_names, names, 0, p);
+    return dns_names;
+}
+
+int md_dns_names_index(const apr_array_header_t *dns_names, const char *name)
+{
+    const md_dns_name_t *dn;
+    apr_size_t len = strlen(name);
+    int i;
+    
+    for (i = 0; i < dns_names->nelts; ++i) {
+        dn = &APR_ARRAY_IDX(dns_names, i, md_dns_name_t);
+        if (dn->len == len && dns_lc_eq(dn->name, name, len)) return i;
+    }
+    return -1;
+}
+
+int md_dns_names_match(const apr_array_header_t *dns_names, const char *name)
+{
+    const md_dns_name_t *dn;
+    apr_size_t len = strlen(name), plen = 0;
+    const char *s;
+    int i;
+    
+    s = memchr(name, '.', len);
+    if (s) plen = len - (apr_size_t)(s - name) + 1; /* length of '*' + s */
+    for (i = 0; i < dns_names->nelts; ++i) {
+        dn = &APR_ARRAY_IDX(dns_names, i, md_dns_name_t);
+        if (dn->len == len && dns_lc_eq(dn->name, name, len)) return 1;
+        if (dn->wildcard && s && dn->len == plen && dns_lc_eq(dn->name + 1, s, plen - 1)) {
+            return 1;
+        }
     }
     return 0;
 }
@@ -810,35 +981,47 @@ int md_dns_matches(const char *pattern, const char *domain)
 apr_array_header_t *md_dns_make_minimal(apr_pool_t *p, apr_array_header_t *domains)
 {
     apr_array_header_t *minimal;
-    const char *domain, *pattern;
-    int i, j, duplicate;
+    apr_hash_t *names, *wild_min, *wild_last;
+    const char *domain, *suffix;
+    char *lc;
+    void *last;
+    int i, wildcard;
     
+    /* Instead of matching all pairs, look up the names in lower case and
+     * the part behind the first '.' for wildcards:
+     * - names: all names in minimal
+     * - wild_min: the suffixes of wildcards in minimal
+     * - wild_last: the suffixes of all wildcards, with the index of the last one */
     minimal = apr_array_make(p, domains->nelts, sizeof(const char *));
+    names = apr_hash_make(p);
+    wild_min = apr_hash_make(p);
+    wild_last = apr_hash_make(p);
+    for (i = 0; i < domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(domains, i, const char*);
+        if (md_dns_is_wildcard(p, domain)) {
+            lc = md_util_str_tolower(apr_pstrdup(p, domain + 1));
+            apr_hash_set(wild_last, lc, APR_HASH_KEY_STRING, (void*)(apr_intptr_t)(i + 1));
+        }
+    }
+    
     for (i = 0; i < domains->nelts; ++i) {
         domain = APR_ARRAY_IDX(domains, i, const char*);
-        duplicate = 0;
+        lc = md_util_str_tolower(apr_pstrdup(p, domain));
+        suffix = strchr(lc, '.');
+        
         /* is it matched in minimal already? */
-        for (j = 0; j < minimal->nelts; ++j) {
-            pattern = APR_ARRAY_IDX(minimal, j, const char*);
-            if (md_dns_matches(pattern, domain)) {
-                duplicate = 1;
-                break;
-            }
+        if (apr_hash_get(names, lc, APR_HASH_KEY_STRING)) continue;
+        if (suffix && apr_hash_get(wild_min, suffix, APR_HASH_KEY_STRING)) continue;
+        wildcard = md_dns_is_wildcard(p, domain);
+        if (!wildcard && suffix) {
+            /* plain name, will we see a wildcard that replaces it? */
+            last = apr_hash_get(wild_last, suffix, APR_HASH_KEY_STRING);
+            if (last && (apr_intptr_t)last > i + 1) continue;
         }
-        if (!duplicate) {
-            if (!md_dns_is_wildcard(p, domain)) {
-                /* plain name, will we see a wildcard that replaces it? */
-                for (j = i+1; j < domains->nelts; ++j) {
-                    pattern = APR_ARRAY_IDX(domains, j, const char*);
-                    if (md_dns_is_wildcard(p, pattern) && md_dns_matches(pattern, domain)) {
-                        duplicate = 1;
-                        break;
-                    }
-                }
-            }
-            if (!duplicate) {
-                APR_ARRAY_PUSH(minimal, const char *) = domain; 
-            }
+        APR_ARRAY_PUSH(minimal, const char *) = domain;
+        apr_hash_set(names, lc, APR_HASH_KEY_STRING, domain);
+        if (lc[0] == '*' && lc[1] == '.') {
+            apr_hash_set(wild_min, lc + 1, APR_HASH_KEY_STRING, domain);
         }
     }
     return minimal;
@@ -1010,31 +1193,83 @@ apr_status_t md_util_try(md_util_try_fn *fn, void *baton, int ignore_errs,
 
 apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
                           int *exit_code)
+{
+    return md_util_exec_timed(p, cmd, argv, NULL, 0, exit_code);
+}
+
+#ifdef SIGKILL
+#define MD_EXEC_KILL_SIG    SIGKILL
+#else
+#define MD_EXEC_KILL_SIG    SIGTERM
+#endif
+
+apr_status_t md_util_exec_timed(apr_pool_t *p, const char *cmd, const char * const *argv,
+                                apr_file_t *input, apr_interval_time_t timeout, 
+                                int *exit_code)
 {
     apr_status_t rv;
     apr_procattr_t *procattr;
     apr_proc_t *proc;
     apr_exit_why_e ewhy;
+    apr_time_t deadline = 0;
+    apr_interval_time_t nap = apr_time_from_msec(10);
     char buffer[1024];
     
     *exit_code = 0;
     if (!(proc = apr_pcalloc(p, sizeof(*proc)))) {
         return APR_ENOMEM;
     }
+    if (timeout > 0) deadline = apr_time_now() + timeout;
+    /* With a timeout, our end of the stderr pipe does not block, so that reads 
+     * wait at most until the deadline. */
     if (   APR_SUCCESS == (rv = apr_procattr_create(&procattr, p))
-        && APR_SUCCESS == (rv = apr_procattr_io_set(procattr, APR_NO_FILE, 
-                                                    APR_NO_PIPE, APR_FULL_BLOCK))
+        && APR_SUCCESS == (rv = apr_procattr_io_set(procattr, 
+                                                    input? APR_NO_PIPE : APR_NO_FILE, APR_NO_PIPE, 
+                                                    deadline? APR_CHILD_BLOCK : APR_FULL_BLOCK))
+        && (!input || APR_SUCCESS == (rv = apr_procattr_child_in_set(procattr, input, NULL)))
         && APR_SUCCESS == (rv = apr_procattr_cmdtype_set(procattr, APR_PROGRAM))
         && APR_SUCCESS == (rv = apr_proc_create(proc, cmd, argv, NULL, procattr, p))) {
         
         /* read stderr and log on INFO for possible fault analysis. */
-        while(APR_SUCCESS == (rv = apr_file_gets(buffer, sizeof(buffer)-1, proc->err))) {
+        while (1) {
+            if (deadline) {
+                if (apr_time_now() >= deadline) {
+                    rv = APR_TIMEUP;
+                    break;
+                }
+                apr_file_pipe_timeout_set(proc->err, deadline - apr_time_now());
+            }
+            if (APR_SUCCESS != (rv = apr_file_gets(buffer, sizeof(buffer)-1, proc->err))) break;
             md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, p, "cmd(%s) stderr: %s", cmd, buffer);
         }
-        if (!APR_STATUS_IS_EOF(rv)) goto out;
+        if (!APR_STATUS_IS_EOF(rv) && !APR_STATUS_IS_TIMEUP(rv)) goto out;
         apr_file_close(proc->err);
         
-        if (APR_CHILD_DONE == (rv = apr_proc_wait(proc, exit_code, &ewhy, APR_WAIT))) {
+        if (deadline) {
+            /* the command may keep running after closing stderr */
+            while (!APR_STATUS_IS_TIMEUP(rv) 
+                   && APR_CHILD_NOTDONE == (rv = apr_proc_wait(proc, exit_code, &ewhy, 
+                                                               APR_NOWAIT))) {
+                if (apr_time_now() >= deadline) {
+                    rv = APR_TIMEUP;
+                    break;
+                }
+                apr_sleep(nap);
+                if (nap < apr_time_from_msec(500)) nap *= 2;
+            }
+            if (APR_STATUS_IS_TIMEUP(rv)) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                              "cmd(%s) did not finish in time, killing it", cmd);
+                apr_proc_kill(proc, MD_EXEC_KILL_SIG);
+                apr_proc_wait(proc, exit_code, &ewhy, APR_WAIT);
+                rv = APR_TIMEUP;
+                goto out;
+            }
+        }
+        else {
+            rv = apr_proc_wait(proc, exit_code, &ewhy, APR_WAIT);
+        }
+        if (APR_CHILD_DONE == rv) {
             /* let's not dwell on exit stati, but core should signal something's bad */
             if (*exit_code > 127 || APR_PROC_SIGNAL_CORE == ewhy) {
                 return APR_EINCOMPLETE;
@@ -1080,7 +1315,329 @@ static const unsigned char BASE64URL_CHARS[] = {
 };
 
 #define BASE64URL_CHAR(x)    BASE64URL_CHARS[ (unsigned int)(x) & 0x3fu ]
-   
+
+/* vector kernels *********************************************************************************/
+
+/* The kernels process as many full blocks as the data has, for the scalar loops to
+ * continue with the rest. Encoders return the number of input bytes consumed, a
+ * multiple of 3. Decoders return the number of characters consumed, a multiple of 4,
+ * stopping before a block with a character outside the alphabet. They write up to
+ * 8 zeroed bytes beyond the decoded data, for which the caller has room. */
+
+#if !defined(MD_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define MD_B64_X86
+#include <immintrin.h>
+
+__attribute__((target("ssse3")))
+static __m128i b64enc_ssse3_chars(__m128i in)
+{
+    __m128i t0, t1, t2, t3, idx, res;
+    
+    /* spread 12 bytes to 16 lanes, each 32 bit word holding 3 bytes */
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    idx = _mm_or_si128(t1, t3);
+    /* 0: 26-51, 1-10: 52-61, 11: 62, 12: 63, 13: 0-25 */
+    res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), 
+                                          _mm_set1_epi8(13)));
+    res = _mm_shuffle_epi8(_mm_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62,
+                                         '_'-63, 'A', 0, 0), res);
+    return _mm_add_epi8(res, idx);
+}
+
+__attribute__((target("ssse3")))
+static int b64dec_ssse3_values(__m128i *pvals, __m128i in)
+{
+    __m128i m, shift, valid;
+    
+    m = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A'-1)), 
+                      _mm_cmpgt_epi8(_mm_set1_epi8('Z'+1), in));
+    valid = m;
+    shift = _mm_and_si128(m, _mm_set1_epi8(-65));
+    m = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a'-1)), 
+                      _mm_cmpgt_epi8(_mm_set1_epi8('z'+1), in));
+    valid = _mm_or_si128(valid, m);
+    shift = _mm_or_si128(shift, _mm_and_si128(m, _mm_set1_epi8(-71)));
+    m = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0'-1)), 
+                      _mm_cmpgt_epi8(_mm_set1_epi8('9'+1), in));
+    valid = _mm_or_si128(valid, m);
+    shift = _mm_or_si128(shift, _mm_and_si128(m, _mm_set1_epi8(4)));
+    m = _mm_cmpeq_epi8(in, _mm_set1_epi8('-'));
+    valid = _mm_or_si128(valid, m);
+    shift = _mm_or_si128(shift, _mm_and_si128(m, _mm_set1_epi8(62-'-')));
+    m = _mm_cmpeq_epi8(in, _mm_set1_epi8('_'));
+    valid = _mm_or_si128(valid, m);
+    shift = _mm_or_si128(shift, _mm_and_si128(m, _mm_set1_epi8(63-'_')));
+    if (_mm_movemask_epi8(valid) != 0xffff) return 0;
+    *pvals = _mm_add_epi8(in, shift);
+    return 1;
+}
+
+__attribute__((target("ssse3")))
+static __m128i b64dec_ssse3_bytes(__m128i vals)
+{
+    vals = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+    vals = _mm_madd_epi16(vals, _mm_set1_epi32(0x00011000));
+    return _mm_shuffle_epi8(vals, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 
+                                                -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static apr_size_t b64enc_ssse3(unsigned char *p, const unsigned char *data, apr_size_t len)
+{
+    apr_size_t i;
+    
+    /* loads 16 bytes to encode 12 */
+    for (i = 0; i + 16 <= len; i += 12, p += 16) {
+        _mm_storeu_si128((__m128i*)p, 
+                         b64enc_ssse3_chars(_mm_loadu_si128((const __m128i*)(data + i))));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static apr_size_t b64dec_ssse3(unsigned char *d, const unsigned char *e, apr_size_t len)
+{
+    __m128i vals;
+    apr_size_t i;
+    
+    for (i = 0; i + 16 <= len; i += 16, d += 12) {
+        if (!b64dec_ssse3_values(&vals, _mm_loadu_si128((const __m128i*)(e + i)))) break;
+        _mm_storeu_si128((__m128i*)d, b64dec_ssse3_bytes(vals));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t b64enc_avx2(unsigned char *p, const unsigned char *data, apr_size_t len)
+{
+    const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                          1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i lut = _mm256_setr_epi8('a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62,
+                                         '_'-63, 'A', 0, 0,
+                                         'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52,
+                                         '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '-'-62,
+                                         '_'-63, 'A', 0, 0);
+    __m256i in, t0, t1, t2, t3, idx, res;
+    apr_size_t i;
+    
+    /* two lanes of 12 bytes each, the second load reads 4 bytes beyond */
+    for (i = 0; i + 28 <= len; i += 24, p += 32) {
+        in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + i))),
+            _mm_loadu_si128((const __m128i*)(data + i + 12)), 1);
+        in = _mm256_shuffle_epi8(in, shuf);
+        t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        idx = _mm256_or_si256(t1, t3);
+        res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+        res = _mm256_or_si256(res, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx), 
+                                                    _mm256_set1_epi8(13)));
+        res = _mm256_add_epi8(_mm256_shuffle_epi8(lut, res), idx);
+        _mm256_storeu_si256((__m256i*)p, res);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static apr_size_t b64dec_avx2(unsigned char *d, const unsigned char *e, apr_size_t len)
+{
+    __m256i in, m, shift, valid, vals;
+    apr_size_t i;
+    
+    for (i = 0; i + 32 <= len; i += 32, d += 24) {
+        in = _mm256_loadu_si256((const __m256i*)(e + i));
+        m = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A'-1)), 
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('Z'+1), in));
+        valid = m;
+        shift = _mm256_and_si256(m, _mm256_set1_epi8(-65));
+        m = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a'-1)), 
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('z'+1), in));
+        valid = _mm256_or_si256(valid, m);
+        shift = _mm256_or_si256(shift, _mm256_and_si256(m, _mm256_set1_epi8(-71)));
+        m = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0'-1)), 
+                             _mm256_cmpgt_epi8(_mm256_set1_epi8('9'+1), in));
+        valid = _mm256_or_si256(valid, m);
+        shift = _mm256_or_si256(shift, _mm256_and_si256(m, _mm256_set1_epi8(4)));
+        m = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('-'));
+        valid = _mm256_or_si256(valid, m);
+        shift = _mm256_or_si256(shift, _mm256_and_si256(m, _mm256_set1_epi8(62-'-')));
+        m = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('_'));
+        valid = _mm256_or_si256(valid, m);
+        shift = _mm256_or_si256(shift, _mm256_and_si256(m, _mm256_set1_epi8(63-'_')));
+        if (_mm256_movemask_epi8(valid) != -1) break;
+        vals = _mm256_add_epi8(in, shift);
+        vals = _mm256_maddubs_epi16(vals, _mm256_set1_epi32(0x01400140));
+        vals = _mm256_madd_epi16(vals, _mm256_set1_epi32(0x00011000));
+        vals = _mm256_shuffle_epi8(vals, _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        /* 24 bytes in a row, followed by zeros */
+        vals = _mm256_permutevar8x32_epi32(vals, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i*)d, vals);
+    }
+    return i;
+}
+
+#elif !defined(MD_NO_SIMD) && defined(__aarch64__)
+#define MD_B64_NEON
+#include <arm_neon.h>
+
+static apr_size_t b64enc_neon(unsigned char *p, const unsigned char *data, apr_size_t len)
+{
+    uint8x16x4_t lut, out;
+    uint8x16x3_t in;
+    const uint8x16_t m6 = vdupq_n_u8(0x3f);
+    apr_size_t i;
+    
+    lut.val[0] = vld1q_u8(BASE64URL_CHARS);
+    lut.val[1] = vld1q_u8(BASE64URL_CHARS + 16);
+    lut.val[2] = vld1q_u8(BASE64URL_CHARS + 32);
+    lut.val[3] = vld1q_u8(BASE64URL_CHARS + 48);
+    for (i = 0; i + 48 <= len; i += 48, p += 64) {
+        in = vld3q_u8(data + i);
+        out.val[0] = vshrq_n_u8(in.val[0], 2);
+        out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4), vshrq_n_u8(in.val[1], 4)), m6);
+        out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2), vshrq_n_u8(in.val[2], 6)), m6);
+        out.val[3] = vandq_u8(in.val[2], m6);
+        out.val[0] = vqtbl4q_u8(lut, out.val[0]);
+        out.val[1] = vqtbl4q_u8(lut, out.val[1]);
+        out.val[2] = vqtbl4q_u8(lut, out.val[2]);
+        out.val[3] = vqtbl4q_u8(lut, out.val[3]);
+        vst4q_u8(p, out);
+    }
+    return i;
+}
+
+static uint8x16_t b64dec_neon_values(uint8x16_t in, uint8x16_t *pvalid)
+{
+    uint8x16_t m, shift, valid;
+    
+    m = vandq_u8(vcgeq_u8(in, vdupq_n_u8('A')), vcleq_u8(in, vdupq_n_u8('Z')));
+    valid = m;
+    shift = vandq_u8(m, vdupq_n_u8((uint8_t)-65));
+    m = vandq_u8(vcgeq_u8(in, vdupq_n_u8('a')), vcleq_u8(in, vdupq_n_u8('z')));
+    valid = vorrq_u8(valid, m);
+    shift = vorrq_u8(shift, vandq_u8(m, vdupq_n_u8((uint8_t)-71)));
+    m = vandq_u8(vcgeq_u8(in, vdupq_n_u8('0')), vcleq_u8(in, vdupq_n_u8('9')));
+    valid = vorrq_u8(valid, m);
+    shift = vorrq_u8(shift, vandq_u8(m, vdupq_n_u8(4)));
+    m = vceqq_u8(in, vdupq_n_u8('-'));
+    valid = vorrq_u8(valid, m);
+    shift = vorrq_u8(shift, vandq_u8(m, vdupq_n_u8(62-'-')));
+    m = vceqq_u8(in, vdupq_n_u8('_'));
+    valid = vorrq_u8(valid, m);
+    shift = vorrq_u8(shift, vandq_u8(m, vdupq_n_u8((uint8_t)(63-'_'))));
+    *pvalid = vandq_u8(*pvalid, valid);
+    return vaddq_u8(in, shift);
+}
+
+static apr_size_t b64dec_neon(unsigned char *d, const unsigned char *e, apr_size_t len)
+{
+    uint8x16x4_t in;
+    uint8x16x3_t out;
+    uint8x16_t valid;
+    apr_size_t i;
+    
+    for (i = 0; i + 64 <= len; i += 64, d += 48) {
+        in = vld4q_u8(e + i);
+        valid = vdupq_n_u8(0xff);
+        in.val[0] = b64dec_neon_values(in.val[0], &valid);
+        in.val[1] = b64dec_neon_values(in.val[1], &valid);
+        in.val[2] = b64dec_neon_values(in.val[2], &valid);
+        in.val[3] = b64dec_neon_values(in.val[3], &valid);
+        if (vminvq_u8(valid) != 0xff) break;
+        out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2), vshrq_n_u8(in.val[1], 4));
+        out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4), vshrq_n_u8(in.val[2], 2));
+        out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+        vst3q_u8(d, out);
+    }
+    return i;
+}
+#endif
+
+#define B64_SIMD_UNKNOWN    -1
+#define B64_SIMD_NONE       0
+#define B64_SIMD_SSSE3      1
+#define B64_SIMD_AVX2       2
+#define B64_SIMD_NEON       3
+
+static int b64_simd_enabled = 1;
+static int b64_simd = B64_SIMD_UNKNOWN;
+
+static int b64_simd_get(void)
+{
+    int simd = b64_simd;
+    
+    if (!b64_simd_enabled) return B64_SIMD_NONE;
+    if (B64_SIMD_UNKNOWN == simd) {
+        simd = B64_SIMD_NONE;
+#if defined(MD_B64_X86)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) simd = B64_SIMD_AVX2;
+        else if (__builtin_cpu_supports("ssse3")) simd = B64_SIMD_SSSE3;
+#elif defined(MD_B64_NEON)
+        simd = B64_SIMD_NEON;
+#endif
+        b64_simd = simd;
+    }
+    return simd;
+}
+
+int md_util_base64url_simd(int enabled)
+{
+    int prev = b64_simd_enabled;
+    b64_simd_enabled = enabled;
+    return prev;
+}
+
+static apr_size_t b64enc_simd(unsigned char *p, const unsigned char *data, apr_size_t len)
+{
+    switch (b64_simd_get()) {
+#if defined(MD_B64_X86)
+        case B64_SIMD_AVX2:
+            return b64enc_avx2(p, data, len);
+        case B64_SIMD_SSSE3:
+            return b64enc_ssse3(p, data, len);
+#elif defined(MD_B64_NEON)
+        case B64_SIMD_NEON:
+            return b64enc_neon(p, data, len);
+#endif
+        default:
+            (void)p; (void)data; (void)len;
+            return 0;
+    }
+}
+
+static apr_size_t b64dec_simd(unsigned char *d, const unsigned char *e, apr_size_t len)
+{
+    switch (b64_simd_get()) {
+#if defined(MD_B64_X86)
+        case B64_SIMD_AVX2:
+            return b64dec_avx2(d, e, len);
+        case B64_SIMD_SSSE3:
+            return b64dec_ssse3(d, e, len);
+#elif defined(MD_B64_NEON)
+        case B64_SIMD_NEON:
+            return b64dec_neon(d, e, len);
+#endif
+        default:
+            (void)d; (void)e; (void)len;
+            return 0;
+    }
+}
+
+/* scalar loops ***********************************************************************************/
+
 apr_size_t md_util_base64url_decode(md_data_t *decoded, const char *encoded, 
                                     apr_pool_t *pool)
 {
@@ -1088,17 +1645,23 @@ apr_size_t md_util_base64url_decode(md_data_t *decoded, const char *encoded,
     const unsigned char *p = e;
     unsigned char *d;
     unsigned int n;
+    apr_size_t slen;
     long len, mlen, remain, i;
     
+    /* room for what the kernels write beyond the decoded bytes */
+    slen = strlen(encoded);
+    decoded->data = apr_pcalloc(pool, slen + 1);
+    d = (unsigned char*)decoded->data;
+    i = (long)b64dec_simd(d, e, slen);
+    d += (i/4)*3;
+    
+    p = e + i;
     while (*p && BASE64URL_UINT6[ *p ] != N6) {
         ++p;
     }
     len = (int)(p - e);
     mlen = (len/4)*4;
-    decoded->data = apr_pcalloc(pool, (apr_size_t)len + 1);
     
-    i = 0;
-    d = (unsigned char*)decoded->data;
     for (; i < mlen; i += 4) {
         n = ((BASE64URL_UINT6[ e[i+0] ] << 18) +
              (BASE64URL_UINT6[ e[i+1] ] << 12) +
@@ -1139,7 +1702,9 @@ const char *md_util_base64url_encode(const md_data_t *data, apr_pool_t *pool)
     unsigned char *enc, *p = apr_pcalloc(pool, slen);
     
     enc = p;
-    for (i = 0; i < len-2; i+= 3) {
+    i = (int)b64enc_simd(p, udata, data->len);
+    p += (i/3)*4;
+    for (; i < len-2; i+= 3) {
         *p++ = BASE64URL_CHAR( (udata[i]   >> 2) );
         *p++ = BASE64URL_CHAR( (udata[i]   << 4) + (udata[i+1] >> 4) );
         *p++ = BASE64URL_CHAR( (udata[i+1] << 2) + (udata[i+2] >> 6) );
@@ -103,6 +103,15 @@ int md_array_str_add_missing(struct apr_array_header_t *dest,
 apr_status_t md_util_exec(apr_pool_t *p, const char *cmd, const char * const *argv,
                           int *exit_code);
 
+/**
+ * Execute a command as md_util_exec() does, with its stdin read from the given
+ * file, if not NULL. With a timeout > 0, the command is killed when it has 
+ * not finished in time and APR_TIMEUP is returned.
+ */
+apr_status_t md_util_exec_timed(apr_pool_t *p, const char *cmd, const char * const *argv,
+                                struct apr_file_t *input, apr_interval_time_t timeout, 
+                                int *exit_code);
+
 /**************************************************************************************************/
 /* dns name check */
 
@@ -142,6 +151,37 @@ struct apr_array_header_t *md_dns_make_minimal(apr_pool_t *p,
  */
 int md_dns_domains_match(const apr_array_header_t *domains, const char *name);
 
+/**
+ * A DNS name in lower case, with its length, for matching many times.
+ */
+typedef struct md_dns_name_t md_dns_name_t;
+struct md_dns_name_t {
+    const char *name;           /* name in lower case */
+    apr_size_t len;             /* strlen(name) */
+    int wildcard;               /* != 0 iff name starts with "*." */
+};
+
+void md_dns_name_init(md_dns_name_t *dn, const char *name, apr_pool_t *p);
+
+/**
+ * Make an array of md_dns_name_t from the names, or add names from index start on
+ * to such an array.
+ */
+apr_array_header_t *md_dns_names_make(apr_pool_t *p, const apr_array_header_t *names);
+void md_dns_names_add(apr_array_header_t *dns_names, const apr_array_header_t *names, 
+                      int start, apr_pool_t *p);
+
+/**
+ * Find the name, ignoring case, in the array of md_dns_name_t. No wildcard matching.
+ * @return index of name or -1 if not found
+ */
+int md_dns_names_index(const apr_array_header_t *dns_names, const char *name);
+
+/**
+ * Determine if the array of md_dns_name_t covers the name, as md_dns_domains_match().
+ */
+int md_dns_names_match(const apr_array_header_t *dns_names, const char *name);
+
 /**************************************************************************************************/
 /* file system related */
 
@@ -161,8 +201,18 @@ int md_file_exists(const char *fname, apr_pool_t *p);
 
 typedef apr_status_t md_util_file_cb(void *baton, struct apr_file_t *f, apr_pool_t *p);
 
-apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
-                              md_util_file_cb *write, void *baton);
+typedef enum {
+    MD_UTIL_SYNC_NONE,              /* leave flushing to the OS, a crash may lose the change */
+    MD_UTIL_SYNC_FULL,              /* sync the file before and its directory after the rename */
+} md_util_sync_t;
+
+/**
+ * Atomically replace the file at fpath with what write produces. The content is 
+ * written to a temporary file of a unique name, so concurrent writers do not wait 
+ * on each other, and is then renamed to fpath. The last writer wins.
+ */
+apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, md_util_sync_t sync, 
+                              apr_pool_t *p, md_util_file_cb *write, void *baton);
 
 /** 
  * Remove a file/directory and all files/directories contain up to max_level. If max_level == 0,
@@ -194,6 +244,11 @@ apr_status_t md_text_freplace(const char *fpath, apr_fileperms_t perms,
 /**************************************************************************************************/
 /* base64 url encodings */
 const char *md_util_base64url_encode(const md_data_t *data, apr_pool_t *pool);
+/**
+ * Enable or disable the vector implementations of the base64url functions, used on
+ * CPUs that have them. Gives the previous setting. Meant for tests and benchmarks.
+ */
+int md_util_base64url_simd(int enabled);
 apr_size_t md_util_base64url_decode(md_data_t *decoded, const char *encoded, 
                                     apr_pool_t *pool);
 
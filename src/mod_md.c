@@ -15,8 +15,12 @@
  */
  
 #include <assert.h>
+#include <apr_hash.h>
 #include <apr_optional.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #include <mpm_common.h>
 #include <httpd.h>
@@ -34,8 +38,10 @@
 #include "md_crypt.h"
 #include "md_http.h"
 #include "md_json.h"
+#include "md_keypool.h"
 #include "md_store.h"
 #include "md_store_fs.h"
+#include "md_store_dbm.h"
 #include "md_log.h"
 #include "md_ocsp.h"
 #include "md_result.h"
@@ -45,6 +51,7 @@
 #include "md_version.h"
 #include "md_acme.h"
 #include "md_acme_authz.h"
+#include "md_acme_order.h"
 
 #include "mod_md.h"
 #include "mod_md_config.h"
@@ -92,7 +99,6 @@ static void log_print(const char *file, int line, md_log_level_t level,
     if (log_is_level(baton, p, level)) {
         char buffer[LOG_BUF_LEN];
         
-        memset(buffer, 0, sizeof(buffer));
         apr_vsnprintf(buffer, LOG_BUF_LEN-1, fmt, ap);
         buffer[LOG_BUF_LEN-1] = '\0';
 
@@ -122,12 +128,19 @@ static apr_status_t cleanup_setups(void *dummy)
 {
     (void)dummy;
     log_server = NULL;
+    md_log_set_level(MD_LOG_INFO);
     return APR_SUCCESS;
 }
 
 static void init_setups(apr_pool_t *p, server_rec *base_server) 
 {
+    int level;
+    
     log_server = base_server;
+    /* what log_is_level() would answer, checked before the arguments are evaluated */
+    level = ap_get_server_module_loglevel(base_server, APLOG_MODULE_INDEX);
+    if (level > APLOG_MAX_LOGLEVEL) level = APLOG_MAX_LOGLEVEL;
+    md_log_set_level((md_log_level_t)(level > MD_LOG_TRACE8? MD_LOG_TRACE8 : level));
     apr_pool_cleanup_register(p, NULL, cleanup_setups, apr_pool_cleanup_null);
 }
 
@@ -148,6 +161,405 @@ static notify_rate notify_rates[] = {
     { "ocsp-errored", apr_time_from_sec(MD_SECS_PER_HOUR) }, /* once per hour */
 };
 
+/* With MDNotifyBatch, the watchdogs do not run the notification commands themselves.
+ * Notifications are queued and, once the batch window has passed, a dispatcher thread
+ * hands all of them to single runs of MDNotifyCmd and MDMessageCmd. These run in
+ * their own threads, at most mc->notify_max_cmds at a time and each for at most
+ * mc->notify_timeout. All pools are created and destroyed by the dispatcher, the other
+ * threads only allocate from pools given to them. */
+
+/* MD names given as arguments to one run of MDNotifyCmd */
+#define MD_NOTIFY_MAX_ARGS      256
+
+typedef struct md_notify_queue_t md_notify_queue_t;
+typedef struct md_notify_run_t md_notify_run_t;
+
+typedef struct {
+    const char *reason;
+    const char *mdomain;
+    apr_time_t when;
+    md_store_t *store;              /* where the job of the md is kept */
+    md_store_group_t group;
+} md_notify_event_t;
+
+struct md_notify_run_t {
+    md_notify_queue_t *queue;
+    apr_pool_t *p;                  /* everything of the run, destroyed after it */
+    const char *directive;          /* the command's directive, for logging */
+    const char * const *argv;
+    const char *input;              /* JSON list of the events, given on stdin */
+    md_notify_event_t *events;      /* copies, in pool p */
+    int nevents;
+    int record;                     /* a success is the last step in notifying the events */
+    apr_thread_t *thread;
+    int done;
+    md_notify_run_t *next;
+};
+
+struct md_notify_queue_t {
+    md_mod_conf_t *mc;
+    server_rec *s;
+    apr_pool_t *p;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *dispatcher;       /* started with the first notification */
+    apr_pool_t *batch_p;            /* the events of the current batch */
+    apr_array_header_t *events;     /* md_notify_event_t of the current batch */
+    apr_hash_t *seen;               /* "reason md" of the current batch */
+    apr_time_t due;                 /* when the current batch is delivered, 0 if empty */
+    md_notify_run_t *pending;       /* runs waiting for a free slot */
+    md_notify_run_t *started;       /* runs started and not yet joined */
+    int running;
+    int shutdown;
+};
+
+static apr_status_t notify_batch_reset(md_notify_queue_t *queue)
+{
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&queue->batch_p, queue->p))) return rv;
+    apr_pool_tag(queue->batch_p, "md_notify_batch");
+    queue->events = apr_array_make(queue->batch_p, 10, sizeof(md_notify_event_t));
+    queue->seen = apr_hash_make(queue->batch_p);
+    queue->due = 0;
+    return APR_SUCCESS;
+}
+
+/* Note the outcome in the logs of the jobs. Only delivered notifications count
+ * for the rate limits, like without batching. */
+static void notify_run_record(md_notify_run_t *run, apr_status_t rv, int exit_code)
+{
+    md_notify_event_t *ev;
+    const char *detail = NULL;
+    int i;
+    
+    if (APR_SUCCESS != rv) {
+        detail = apr_psprintf(run->p, "%s %s failed with exit code %d.", 
+                              run->directive, run->argv[0], exit_code);
+    }
+    else if (!run->record) {
+        return;
+    }
+    for (i = 0; i < run->nevents; ++i) {
+        ev = &run->events[i];
+        if (APR_SUCCESS == rv) {
+            md_job_log_add(ev->store, ev->group, ev->mdomain, 
+                           apr_pstrcat(run->p, "message-", ev->reason, NULL), NULL, NULL, run->p);
+        }
+        else if (!strcmp("MDNotifyCmd", run->directive)) {
+            md_job_log_add(ev->store, ev->group, ev->mdomain, "notify-error", 
+                           NULL, detail, run->p);
+        }
+        else {
+            md_job_log_add(ev->store, ev->group, ev->mdomain, "message-error", 
+                           ev->reason, detail, run->p);
+        }
+    }
+}
+
+static void * APR_THREAD_FUNC notify_run_exec(apr_thread_t *thread, void *data)
+{
+    md_notify_run_t *run = data;
+    md_notify_queue_t *queue = run->queue;
+    apr_file_t *f = NULL;
+    const char *tmp_dir, *fpath;
+    apr_size_t len;
+    int exit_code = 0;
+    apr_status_t rv;
+    
+    /* the events go into a file, so that the command cannot block us by not reading */
+    len = strlen(run->input);
+    if (APR_SUCCESS != (rv = apr_temp_dir_get(&tmp_dir, run->p))
+        || APR_SUCCESS != (rv = md_util_path_merge(&fpath, run->p, tmp_dir, 
+                                                   "md-notify-XXXXXX", NULL))
+        || APR_SUCCESS != (rv = apr_file_mktemp(&f, (char*)fpath, 
+                                                APR_FOPEN_CREATE|APR_FOPEN_READ|APR_FOPEN_WRITE
+                                                |APR_FOPEN_EXCL|APR_FOPEN_DELONCLOSE, run->p))
+        || APR_SUCCESS != (rv = apr_file_write_full(f, run->input, len, NULL))) {
+        goto leave;
+    }
+    else {
+        apr_off_t offset = 0;
+        if (APR_SUCCESS != (rv = apr_file_seek(f, APR_SET, &offset))) goto leave;
+    }
+    
+    rv = md_util_exec_timed(run->p, run->argv[0], run->argv, f, 
+                            queue->mc->notify_timeout, &exit_code);
+    if (APR_SUCCESS == rv && exit_code) rv = APR_EGENERAL;
+    
+leave:
+    if (f) apr_file_close(f);
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, queue->s, APLOGNO(10227) 
+                     "%s %s failed for %d notifications with exit code %d.", 
+                     run->directive, run->argv[0], run->nevents, exit_code);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, queue->s, 
+                     "%s %s ran for %d notifications", 
+                     run->directive, run->argv[0], run->nevents);
+    }
+    notify_run_record(run, rv, exit_code);
+    apr_thread_mutex_lock(queue->mutex);
+    run->done = 1;
+    --queue->running;
+    apr_thread_cond_broadcast(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Add a run for the command with the given arguments and events, call with mutex held */
+static void notify_run_add(md_notify_queue_t *queue, const char *directive, const char *cmd,
+                           apr_array_header_t *args, apr_array_header_t *events, 
+                           int start, int end, int record)
+{
+    md_notify_run_t *run, **pnext;
+    md_notify_event_t *ev;
+    apr_array_header_t *argv;
+    md_json_t *json, *jev;
+    char **tokens;
+    apr_pool_t *p;
+    int i;
+    
+    if (APR_SUCCESS != apr_pool_create(&p, queue->p)) return;
+    apr_pool_tag(p, "md_notify_run");
+    run = apr_pcalloc(p, sizeof(*run));
+    run->queue = queue;
+    run->p = p;
+    run->directive = directive;
+    run->nevents = end - start;
+    run->record = record;
+    run->events = apr_pcalloc(p, sizeof(md_notify_event_t) * (apr_size_t)(run->nevents + 1));
+    for (i = start; i < end; ++i) {
+        ev = &APR_ARRAY_IDX(events, i, md_notify_event_t);
+        run->events[i - start] = *ev;
+        run->events[i - start].reason = apr_pstrdup(p, ev->reason);
+        run->events[i - start].mdomain = apr_pstrdup(p, ev->mdomain);
+    }
+    
+    apr_tokenize_to_argv(cmd, &tokens, p);
+    argv = apr_array_make(p, args->nelts + 5, sizeof(const char*));
+    for (i = 0; tokens[i]; ++i) {
+        APR_ARRAY_PUSH(argv, const char*) = tokens[i];
+    }
+    for (i = 0; i < args->nelts; ++i) {
+        APR_ARRAY_PUSH(argv, const char*) = apr_pstrdup(p, APR_ARRAY_IDX(args, i, const char*));
+    }
+    APR_ARRAY_PUSH(argv, const char*) = NULL;
+    run->argv = (const char * const *)argv->elts;
+    
+    json = md_json_create(p);
+    for (i = start; i < end; ++i) {
+        ev = &APR_ARRAY_IDX(events, i, md_notify_event_t);
+        jev = md_json_create(p);
+        md_json_sets(ev->reason, jev, "reason", NULL);
+        md_json_sets(ev->mdomain, jev, MD_KEY_NAME, NULL);
+        md_json_set_time(ev->when, jev, "time", NULL);
+        md_json_addj(jev, json, "events", NULL);
+    }
+    run->input = md_json_writep(md_json_getj(json, "events", NULL), p, MD_JSON_FMT_COMPACT);
+    if (!run->input) run->input = "[]";
+    
+    for (pnext = &queue->pending; *pnext; pnext = &(*pnext)->next);
+    *pnext = run;
+}
+
+/* Turn the current batch into runs of the commands, call with mutex held */
+static void notify_batch_deliver(md_notify_queue_t *queue)
+{
+    md_mod_conf_t *mc = queue->mc;
+    apr_array_header_t *events, *renewed, *names;
+    md_notify_event_t *ev;
+    apr_pool_t *batch_p;
+    int i, start;
+    
+    events = queue->events;
+    batch_p = queue->batch_p;
+    if (APR_SUCCESS != notify_batch_reset(queue)) {
+        /* keep collecting in the old batch and try again later */
+        queue->batch_p = batch_p;
+        queue->events = events;
+        queue->due = apr_time_now() + mc->notify_batch;
+        return;
+    }
+    
+    if (mc->notify_cmd) {
+        renewed = apr_array_make(batch_p, events->nelts, sizeof(md_notify_event_t));
+        for (i = 0; i < events->nelts; ++i) {
+            ev = &APR_ARRAY_IDX(events, i, md_notify_event_t);
+            if (!strcmp("renewed", ev->reason)) APR_ARRAY_PUSH(renewed, md_notify_event_t) = *ev;
+        }
+        names = apr_array_make(batch_p, MD_NOTIFY_MAX_ARGS, sizeof(const char*));
+        for (start = 0; start < renewed->nelts; start += MD_NOTIFY_MAX_ARGS) {
+            apr_array_clear(names);
+            for (i = start; i < renewed->nelts && i < start + MD_NOTIFY_MAX_ARGS; ++i) {
+                APR_ARRAY_PUSH(names, const char*) = 
+                    APR_ARRAY_IDX(renewed, i, md_notify_event_t).mdomain;
+            }
+            notify_run_add(queue, "MDNotifyCmd", mc->notify_cmd, names, renewed, start, i,
+                           !mc->message_cmd);
+        }
+    }
+    if (mc->message_cmd && events->nelts > 0) {
+        names = apr_array_make(batch_p, 1, sizeof(const char*));
+        APR_ARRAY_PUSH(names, const char*) = "batch";
+        notify_run_add(queue, "MDMessageCmd", mc->message_cmd, names, events, 0, 
+                       events->nelts, 1);
+    }
+    apr_pool_destroy(batch_p);
+}
+
+/* Join finished runs and start pending ones, as slots are free. Call with mutex held */
+static void notify_runs_schedule(md_notify_queue_t *queue)
+{
+    md_notify_run_t *run, **prun;
+    apr_status_t rv, trv;
+    
+    for (prun = &queue->started; *prun; ) {
+        run = *prun;
+        if (run->done) {
+            *prun = run->next;
+            apr_thread_join(&trv, run->thread);
+            apr_pool_destroy(run->p);
+        }
+        else {
+            prun = &run->next;
+        }
+    }
+    while (queue->pending && queue->running < queue->mc->notify_max_cmds) {
+        run = queue->pending;
+        queue->pending = run->next;
+        rv = apr_thread_create(&run->thread, NULL, notify_run_exec, run, run->p);
+        if (APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, queue->s, APLOGNO(10228) 
+                         "%s: unable to start thread for %d notifications", 
+                         run->directive, run->nevents);
+            apr_pool_destroy(run->p);
+            continue;
+        }
+        ++queue->running;
+        run->next = queue->started;
+        queue->started = run;
+    }
+}
+
+static void * APR_THREAD_FUNC notify_dispatch(apr_thread_t *thread, void *data)
+{
+    md_notify_queue_t *queue = data;
+    apr_interval_time_t wait;
+    apr_time_t now;
+    
+    apr_thread_mutex_lock(queue->mutex);
+    while (1) {
+        now = apr_time_now();
+        if (queue->due && (queue->shutdown || now >= queue->due)) {
+            notify_batch_deliver(queue);
+        }
+        notify_runs_schedule(queue);
+        if (queue->shutdown && !queue->due && !queue->pending && !queue->started) break;
+        
+        /* Wake up for the next batch, or when a run finishes or notifications arrive */
+        wait = queue->due? queue->due - now : apr_time_from_sec(MD_SECS_PER_HOUR);
+        if (wait < apr_time_from_msec(10)) wait = apr_time_from_msec(10);
+        apr_thread_cond_timedwait(queue->cond, queue->mutex, wait);
+    }
+    apr_thread_mutex_unlock(queue->mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Deliver what has been queued and wait for the commands, they each have a timeout */
+static apr_status_t notify_queue_shutdown(void *data)
+{
+    md_notify_queue_t *queue = data;
+    apr_status_t trv;
+    
+    apr_thread_mutex_lock(queue->mutex);
+    queue->shutdown = 1;
+    apr_thread_cond_broadcast(queue->cond);
+    apr_thread_mutex_unlock(queue->mutex);
+    if (queue->dispatcher) {
+        apr_thread_join(&trv, queue->dispatcher);
+        queue->dispatcher = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t notify_queue_create(md_notify_queue_t **pqueue, md_mod_conf_t *mc, 
+                                        server_rec *s, apr_pool_t *p)
+{
+    md_notify_queue_t *queue;
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *amutex;
+    apr_status_t rv;
+    
+    queue = apr_pcalloc(p, sizeof(*queue));
+    queue->mc = mc;
+    queue->s = s;
+    /* The dispatcher and the run threads allocate from queue->p and the run pools
+     * below it at the same time. They get an allocator of their own, with a mutex. */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+    apr_allocator_max_free_set(allocator, 1);
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&queue->p, p, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        goto leave;
+    }
+    apr_allocator_owner_set(allocator, queue->p);
+    apr_pool_tag(queue->p, "md_notify_queue");
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&amutex, APR_THREAD_MUTEX_DEFAULT, 
+                                                     queue->p))) goto leave;
+    apr_allocator_mutex_set(allocator, amutex);
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&queue->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&queue->cond, p))
+        || APR_SUCCESS != (rv = notify_batch_reset(queue))) goto leave;
+    /* subpools are destroyed before normal cleanups run, the threads use them */
+    apr_pool_pre_cleanup_register(p, queue, notify_queue_shutdown);
+leave:
+    *pqueue = (APR_SUCCESS == rv)? queue : NULL;
+    return rv;
+}
+
+static apr_status_t notify_queue_add(md_notify_queue_t *queue, const char *reason, 
+                                     md_job_t *job)
+{
+    const char *mdomain = job->mdomain;
+    md_notify_event_t *ev;
+    const char *key;
+    apr_status_t rv = APR_SUCCESS;
+    
+    apr_thread_mutex_lock(queue->mutex);
+    if (queue->shutdown) {
+        rv = APR_EOF;
+        goto leave;
+    }
+    if (!queue->dispatcher) {
+        rv = apr_thread_create(&queue->dispatcher, NULL, notify_dispatch, queue, queue->p);
+        if (APR_SUCCESS != rv) {
+            queue->dispatcher = NULL;
+            goto leave;
+        }
+    }
+    key = apr_pstrcat(queue->batch_p, reason, " ", mdomain, NULL);
+    if (!apr_hash_get(queue->seen, key, APR_HASH_KEY_STRING)) {
+        apr_hash_set(queue->seen, key, APR_HASH_KEY_STRING, key);
+        ev = apr_array_push(queue->events);
+        ev->reason = apr_pstrdup(queue->batch_p, reason);
+        ev->mdomain = apr_pstrdup(queue->batch_p, mdomain);
+        ev->when = apr_time_now();
+        ev->store = job->store;
+        ev->group = job->group;
+    }
+    if (!queue->due) {
+        queue->due = apr_time_now() + queue->mc->notify_batch;
+        apr_thread_cond_broadcast(queue->cond);
+    }
+leave:
+    apr_thread_mutex_unlock(queue->mutex);
+    return rv;
+}
+
 static apr_status_t notify(md_job_t *job, const char *reason, 
                            md_result_t *result, apr_pool_t *p, void *baton)
 {
@@ -177,6 +589,23 @@ static apr_status_t notify(md_job_t *job, const char *reason,
         }
     }
     
+    if (mc->notify_queue 
+        && APR_SUCCESS == notify_queue_add(mc->notify_queue, reason, job)) {
+        if (!strcmp("renewed", reason)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_NOTICE, 0, p, APLOGNO(10231) 
+                         "The Managed Domain %s has been setup and changes "
+                         "will be activated on next (graceful) server restart, "
+                         "notifications follow with the next batch.", job->mdomain);
+        }
+        /* The delivery is noted by the thread running the command. Without a log
+         * ring for the job, it cannot do that and it is noted now. */
+        if (APR_STATUS_IS_ENOTIMPL(md_store_get_fname(&cmdline, job->store, job->group,
+                                                       job->mdomain, MD_FN_JOB_LOG, p))) {
+            md_job_log_append(job, log_msg_reason, NULL, NULL);
+        }
+        return APR_SUCCESS;
+    }
+    
     if (!strcmp("renewed", reason)) {
         if (mc->notify_cmd) {
             cmdline = apr_psprintf(p, "%s %s", mc->notify_cmd, job->mdomain); 
@@ -216,6 +645,223 @@ static apr_status_t notify(md_job_t *job, const char *reason,
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* challenge cache */
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L || (defined(LIBRESSL_VERSION_NUMBER) && \
+                                             LIBRESSL_VERSION_NUMBER < 0x2070000f)
+#define X509_up_ref(x)          CRYPTO_add(&(x)->references, 1, CRYPTO_LOCK_X509)
+#define EVP_PKEY_up_ref(k)      CRYPTO_add(&(k)->references, 1, CRYPTO_LOCK_EVP_PKEY)
+#endif
+
+/* Subject and lifetime of self-signed fallback certificates */
+#define MD_FALLBACK_CN          "Apache Managed Domain Fallback"
+#define MD_FALLBACK_VALID       apr_time_from_sec(14 * MD_SECS_PER_DAY)
+/* Name in the one fallback certificate all MDs use in common mode */
+#define MD_FALLBACK_COMMON_NAME "fallback.managed-domain.invalid"
+
+/* Max number of hostnames remembered, the cache starts anew when exceeded. Since
+ * unknown hostnames get remembered as well, this limits what clients can make us keep. */
+#define MD_CHALLENGE_CACHE_MAX     1024
+
+typedef struct md_challenge_cache_t md_challenge_cache_t;
+struct md_challenge_cache_t {
+    apr_pool_t *p;                     /* entries are allocated here */
+    apr_thread_mutex_t *mutex;
+    apr_hash_t *http01;                /* hostname -> md_http01_entry_t */
+    apr_hash_t *tls_alpn01;            /* servername -> md_tls_alpn01_entry_t */
+};
+
+typedef struct {
+    apr_status_t rv;                   /* APR_SUCCESS or ENOENT from the store */
+    apr_time_t mtime;                  /* modification time of the file, 0 if absent */
+    const char *data;                  /* challenge content on success */
+} md_http01_entry_t;
+
+typedef struct {
+    apr_status_t rv;                   /* APR_SUCCESS or ENOENT from the store */
+    apr_time_t mtime;                  /* modification time of the cert file, 0 if absent */
+    md_cert_t *cert;                   /* parsed challenge certificate on success */
+    md_pkey_t *pkey;                   /* parsed challenge key on success */
+} md_tls_alpn01_entry_t;
+
+static apr_status_t challenge_cache_create(md_challenge_cache_t **pcache, apr_pool_t *p)
+{
+    md_challenge_cache_t *cache;
+    apr_status_t rv;
+    
+    cache = apr_pcalloc(p, sizeof(*cache));
+    if (APR_SUCCESS != (rv = apr_pool_create(&cache->p, p))) goto leave;
+    apr_pool_tag(cache->p, "md_challenge_cache");
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&cache->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) goto leave;
+    cache->http01 = apr_hash_make(cache->p);
+    cache->tls_alpn01 = apr_hash_make(cache->p);
+leave:
+    *pcache = (APR_SUCCESS == rv)? cache : NULL;
+    return rv;
+}
+
+/* Drop all entries, call with the mutex held. Parsed certificates and keys
+ * are freed by the pool, connections using them hold their own references. */
+static void challenge_cache_reset(md_challenge_cache_t *cache)
+{
+    apr_pool_clear(cache->p);
+    cache->http01 = apr_hash_make(cache->p);
+    cache->tls_alpn01 = apr_hash_make(cache->p);
+}
+
+static void challenge_cache_clear(md_challenge_cache_t *cache)
+{
+    if (cache) {
+        apr_thread_mutex_lock(cache->mutex);
+        challenge_cache_reset(cache);
+        apr_thread_mutex_unlock(cache->mutex);
+    }
+}
+
+static void challenge_cache_make_room(md_challenge_cache_t *cache)
+{
+    if (apr_hash_count(cache->http01) + apr_hash_count(cache->tls_alpn01) 
+        >= MD_CHALLENGE_CACHE_MAX) {
+        challenge_cache_reset(cache);
+    }
+}
+
+/* Load the http-01 challenge for hostname, from memory when the file in the store
+ * has not changed. Other processes (the watchdog) write challenges, so a single
+ * stat of the file is what keeps children in sync. Answers of "no such challenge"
+ * are remembered as well. */
+static apr_status_t http01_cache_load(const char **pdata, md_challenge_cache_t *cache,
+                                      md_store_t *store, const char *hostname, 
+                                      apr_pool_t *p)
+{
+    md_http01_entry_t *e;
+    apr_time_t mtime;
+    const char *data = NULL;
+    apr_status_t rv;
+    
+    *pdata = NULL;
+    mtime = md_store_get_modified(store, MD_SG_CHALLENGES, hostname, MD_FN_HTTP01, p);
+    
+    apr_thread_mutex_lock(cache->mutex);
+    e = apr_hash_get(cache->http01, hostname, APR_HASH_KEY_STRING);
+    if (e && e->mtime == mtime) {
+        rv = e->rv;
+        if (e->data) *pdata = apr_pstrdup(p, e->data);
+        apr_thread_mutex_unlock(cache->mutex);
+        return rv;
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    
+    rv = md_store_load(store, MD_SG_CHALLENGES, hostname, 
+                       MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, p);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) goto leave;
+    
+    /* Remember with the mtime seen before loading. Should the file have 
+     * changed in between, the next lookup will see a different one. */
+    apr_thread_mutex_lock(cache->mutex);
+    challenge_cache_make_room(cache);
+    e = apr_pcalloc(cache->p, sizeof(*e));
+    e->rv = rv;
+    e->mtime = mtime;
+    e->data = data? apr_pstrdup(cache->p, data) : NULL;
+    apr_hash_set(cache->http01, apr_pstrdup(cache->p, hostname), APR_HASH_KEY_STRING, e);
+    apr_thread_mutex_unlock(cache->mutex);
+leave:
+    *pdata = data;
+    return rv;
+}
+
+static apr_status_t x509_free_cb(void *data)
+{
+    X509_free(data);
+    return APR_SUCCESS;
+}
+
+static apr_status_t pkey_free_cb(void *data)
+{
+    EVP_PKEY_free(data);
+    return APR_SUCCESS;
+}
+
+static apr_status_t pool_destroy_cb(void *data)
+{
+    apr_pool_destroy(data);
+    return APR_SUCCESS;
+}
+
+/* Get the tls-alpn-01 certificate and key for servername. The key is written 
+ * before the certificate, so the modification time of the certificate tells 
+ * when both need to be parsed again. The returned instances stay valid for 
+ * the lifetime of pool p. A certificate may be returned even when loading 
+ * the key failed. */
+static apr_status_t tls_alpn01_cache_load(X509 **pcert, EVP_PKEY **pkey, 
+                                          md_challenge_cache_t *cache, md_store_t *store, 
+                                          const char *servername, apr_pool_t *p)
+{
+    md_tls_alpn01_entry_t *e;
+    apr_pool_t *ptemp;
+    apr_time_t mtime;
+    md_cert_t *mdcert = NULL;
+    md_pkey_t *mdpkey = NULL;
+    apr_status_t rv;
+    
+    *pcert = NULL;
+    *pkey = NULL;
+    mtime = md_store_get_modified(store, MD_SG_CHALLENGES, servername, MD_FN_TLSALPN01_CERT, p);
+    
+    apr_thread_mutex_lock(cache->mutex);
+    e = apr_hash_get(cache->tls_alpn01, servername, APR_HASH_KEY_STRING);
+    if (!e || e->mtime != mtime) {
+        apr_thread_mutex_unlock(cache->mutex);
+        
+        /* Parse outside the lock into a pool of its own that becomes the entry's.
+         * It is not a child of p, as it may outlive the connection. */
+        if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, NULL))) return rv;
+        rv = md_store_load(store, MD_SG_CHALLENGES, servername, MD_FN_TLSALPN01_CERT, 
+                           MD_SV_CERT, (void**)&mdcert, ptemp);
+        if (APR_SUCCESS == rv) {
+            rv = md_store_load(store, MD_SG_CHALLENGES, servername, MD_FN_TLSALPN01_PKEY, 
+                               MD_SV_PKEY, (void**)&mdpkey, ptemp);
+        }
+        if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv)) {
+            apr_pool_destroy(ptemp);
+            return rv;
+        }
+        
+        apr_thread_mutex_lock(cache->mutex);
+        challenge_cache_make_room(cache);
+        e = apr_pcalloc(cache->p, sizeof(*e));
+        e->rv = rv;
+        e->mtime = mtime;
+        if (mdcert) {
+            /* keep the parsed instances for as long as the entry exists */
+            e->cert = mdcert;
+            e->pkey = (APR_SUCCESS == rv)? mdpkey : NULL;
+            apr_pool_cleanup_register(cache->p, ptemp, pool_destroy_cb, apr_pool_cleanup_null);
+        }
+        else {
+            apr_pool_destroy(ptemp);
+        }
+        apr_hash_set(cache->tls_alpn01, apr_pstrdup(cache->p, servername), 
+                     APR_HASH_KEY_STRING, e);
+    }
+    
+    /* the connection holds its own references, the entry may go away */
+    rv = e->rv;
+    if (e->cert && (*pcert = md_cert_get_X509(e->cert))) {
+        X509_up_ref(*pcert);
+        apr_pool_cleanup_register(p, *pcert, x509_free_cb, apr_pool_cleanup_null);
+    }
+    if (e->pkey && (*pkey = md_pkey_get_EVP_PKEY(e->pkey))) {
+        EVP_PKEY_up_ref(*pkey);
+        apr_pool_cleanup_register(p, *pkey, pkey_free_cb, apr_pool_cleanup_null);
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    return rv;
+}
+
 /**************************************************************************************************/
 /* store setup */
 
@@ -225,20 +871,42 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
                                     apr_pool_t *p)
 {
     server_rec *s = baton;
+    const md_srv_conf_t *sc;
     apr_status_t rv;
     
     (void)store;
     ap_log_error(APLOG_MARK, APLOG_TRACE3, 0, s, "store event=%d on %s %s (group %d)", 
                  ev, (ftype == APR_DIR)? "dir" : "file", fname, group);
+    
+    /* Challenges we write ourselves are visible at once, without waiting for
+     * a change in modification time. */
+    if (ftype == APR_REG && group == MD_SG_CHALLENGES) {
+        sc = ap_get_module_config(s->module_config, &md_module);
+        if (sc && sc->mc) challenge_cache_clear(sc->mc->challenge_cache);
+    }
+    /* Same for the status of MDs, other processes are noticed by file times */
+    switch (group) {
+        case MD_SG_DOMAINS:
+        case MD_SG_STAGING:
+        case MD_SG_OCSP:
+            sc = ap_get_module_config(s->module_config, &md_module);
+            if (sc && sc->mc) md_status_cache_invalidate(sc->mc->status_cache);
+            break;
+        default:
+            break;
+    }
                  
-    /* Directories in group CHALLENGES, STAGING and OCSP are written to 
-     * under a different user. Give her ownership. 
+    /* Directories in group CHALLENGES, STAGING, OCSP, LEASES and JOURNAL are written to 
+     * under a different user. Give her ownership. Same for the journal files, workers 
+     * append to them.
      */
     if (ftype == APR_DIR) {
         switch (group) {
             case MD_SG_CHALLENGES:
             case MD_SG_STAGING:
             case MD_SG_OCSP:
+            case MD_SG_LEASES:
+            case MD_SG_JOURNAL:
                 rv = md_make_worker_accessible(fname, p);
                 if (APR_ENOTIMPL != rv) {
                     return rv;
@@ -248,6 +916,12 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
                 break;
         }
     }
+    else if (ftype == APR_REG && group == MD_SG_JOURNAL) {
+        rv = md_make_worker_accessible(fname, p);
+        if (APR_ENOTIMPL != rv) {
+            return rv;
+        }
+    }
     return APR_SUCCESS;
 }
 
@@ -268,6 +942,7 @@ static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc,
                                 apr_pool_t *p, server_rec *s)
 {
     const char *base_dir;
+    apr_array_header_t *compact;
     apr_status_t rv;
     
     base_dir = ap_server_root_relative(p, mc->base_dir);
@@ -277,17 +952,62 @@ static apr_status_t setup_store(md_store_t **pstore, md_mod_conf_t *mc,
         goto leave;
     }
 
+    if (APR_SUCCESS != (rv = md_store_fs_enable_cache(*pstore, p))
+        || APR_SUCCESS != (rv = md_store_fs_enable_name_index(*pstore, p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10208) "setup store cache");
+        goto leave;
+    }
+    if (APR_SUCCESS != (rv = challenge_cache_create(&mc->challenge_cache, p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10207) "setup challenge cache");
+        goto leave;
+    }
     md_store_fs_set_event_cb(*pstore, store_file_ev, s);
+    
+    /* files only we read, some rewritten during each renewal. 'a2md store show' 
+     * prints them readable. */
+    compact = apr_array_make(p, 4, sizeof(const char *));
+    APR_ARRAY_PUSH(compact, const char *) = MD_FN_JOB;
+    APR_ARRAY_PUSH(compact, const char *) = MD_FN_ORDER;
+    APR_ARRAY_PUSH(compact, const char *) = MD_FN_HTTPD_JSON;
+    APR_ARRAY_PUSH(compact, const char *) = "ocsp-*.json";
+    md_store_fs_set_compact_json(*pstore, compact);
+    
     if (APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_CHALLENGES, p, s))
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_STAGING, p, s))
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_ACCOUNTS, p, s))
         || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_OCSP, p, s))
+        || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_LEASES, p, s))
+        || APR_SUCCESS != (rv = check_group_dir(*pstore, MD_SG_JOURNAL, p, s))
         ) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10047) 
                      "setup challenges directory");
         goto leave;
     }
     
+    if (mc->store_dbm_type) {
+        md_store_t *files = *pstore;
+        apr_array_header_t *fnames;
+        const char *path;
+        int i;
+        
+        path = apr_pstrcat(p, "md_store.", mc->store_dbm_type, NULL);
+        if (APR_SUCCESS != (rv = md_util_path_merge(&path, p, base_dir, path, NULL))
+            || APR_SUCCESS != (rv = md_store_dbm_init(pstore, p, files, 
+                                                      mc->store_dbm_type, path))
+            || APR_SUCCESS != (rv = md_store_dbm_get_fnames(&fnames, *pstore, p))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10209) 
+                         "setup %s database for store %s", mc->store_dbm_type, base_dir);
+            goto leave;
+        }
+        /* challenges and OCSP responses are written by the children */
+        for (i = 0; i < fnames->nelts; ++i) {
+            rv = md_make_worker_accessible(APR_ARRAY_IDX(fnames, i, const char *), p);
+            if (APR_SUCCESS != rv && APR_ENOTIMPL != rv 
+                && !APR_STATUS_IS_ENOENT(rv)) goto leave;
+        }
+        rv = APR_SUCCESS;
+    }
+    
 leave:
     return rv;
 }
@@ -324,7 +1044,7 @@ static void merge_srv_config(md_t *md, md_srv_conf_t *base_sc, apr_pool_t *p)
         md->transitive = md_config_geti(md->sc, MD_CONFIG_TRANSITIVE);
     }
     if (!md->ca_challenges && md->sc->ca_challenges) {
-        md->ca_challenges = apr_array_copy(p, md->sc->ca_challenges);
+        md->ca_challenges = md->sc->ca_challenges;
     }        
     if (!md->pkey_spec) {
         md->pkey_spec = md->sc->pkey_spec;
@@ -349,6 +1069,7 @@ static apr_status_t check_coverage(md_t *md, const char *domain, server_rec *s,
     }
     else if (md->transitive) {
         APR_ARRAY_PUSH(md->domains, const char*) = apr_pstrdup(p, domain);
+        md_update_dns_names(md, p);
         *pupdates |= MD_UPD_DOMAINS;
         return APR_SUCCESS;
     }
@@ -431,7 +1152,45 @@ set_and_leave:
     return md_reg_set_props(mc->reg, p, mc->can_http, mc->can_https); 
 }
 
-static server_rec *get_public_https_server(md_t *md, const char *domain, server_rec *base_server)
+/* The servers each MD is assigned to, in configuration order. Collected in one pass 
+ * over all servers, so that the checks per MD do not have to look at every server. */
+static apr_hash_t *assigned_servers_make(server_rec *base_server, apr_pool_t *p)
+{
+    apr_hash_t *by_md;
+    apr_array_header_t *servers;
+    md_srv_conf_t *sc;
+    server_rec *s;
+    md_t *md;
+    int i;
+    
+    by_md = apr_hash_make(p);
+    for (s = base_server; s; s = s->next) {
+        sc = md_config_get(s);
+        if (!sc || !sc->assigned) continue;
+        for (i = 0; i < sc->assigned->nelts; ++i) {
+            md = APR_ARRAY_IDX(sc->assigned, i, md_t*);
+            servers = apr_hash_get(by_md, &md, sizeof(md));
+            if (!servers) {
+                servers = apr_array_make(p, 2, sizeof(server_rec*));
+                apr_hash_set(by_md, apr_pmemdup(p, &md, sizeof(md)), sizeof(md), servers);
+            }
+            if (servers->nelts == 0 
+                || APR_ARRAY_IDX(servers, servers->nelts-1, server_rec*) != s) {
+                APR_ARRAY_PUSH(servers, server_rec*) = s;
+            }
+        }
+    }
+    return by_md;
+}
+
+static apr_array_header_t *assigned_servers_get(apr_hash_t *by_md, md_t *md, apr_pool_t *p)
+{
+    apr_array_header_t *servers = apr_hash_get(by_md, &md, sizeof(md));
+    return servers? servers : apr_array_make(p, 1, sizeof(server_rec*));
+}
+
+static server_rec *get_public_https_server(md_t *md, const char *domain, server_rec *base_server,
+                                           apr_array_header_t *servers)
 {
     md_srv_conf_t *sc;
     md_mod_conf_t *mc;
@@ -452,38 +1211,36 @@ static server_rec *get_public_https_server(md_t *md, const char *domain, server_
     if (!skip_port_check && !mc->can_https) return NULL;
 
     /* find an ssl server matching domain from MD */
-    for (s = base_server; s; s = s->next) {
+    for (i = 0; i < servers->nelts; ++i) {
+        s = APR_ARRAY_IDX(servers, i, server_rec*);
         sc = md_config_get(s);
-        if (!sc || !sc->is_ssl || !sc->assigned) continue;
+        if (!sc || !sc->is_ssl) continue;
         if (base_server == s && !mc->manage_base_server) continue;
         if (base_server != s && !skip_port_check && mc->local_443 > 0 && !uses_port(s, mc->local_443)) continue;
-        for (i = 0; i < sc->assigned->nelts; ++i) {
-            if (md == APR_ARRAY_IDX(sc->assigned, i, md_t*)) {
-                r.server = s;
-                if (ap_matches_request_vhost(&r, domain, s->port)) {
-                    return s;
-                }
-            }
+        r.server = s;
+        if (ap_matches_request_vhost(&r, domain, s->port)) {
+            return s;
         }
     }
     return NULL;
 }
 
-static apr_status_t auto_add_domains(md_t *md, server_rec *base_server, apr_pool_t *p)
+static apr_status_t auto_add_domains(md_t *md, server_rec *base_server, 
+                                     apr_array_header_t *servers, apr_pool_t *p)
 {
     md_srv_conf_t *sc;
     server_rec *s;
     apr_status_t rv = APR_SUCCESS;
-    int updates;
+    int i, updates;
     
     /* Ad all domain names used in SSL VirtualHosts, if not already there */
     ap_log_error(APLOG_MARK, APLOG_TRACE1, 0, base_server, 
                  "md[%s]: auto add domains", md->name);
     updates = 0;
-    for (s = base_server; s; s = s->next) {
+    for (i = 0; i < servers->nelts; ++i) {
+        s = APR_ARRAY_IDX(servers, i, server_rec*);
         sc = md_config_get(s);
-        if (!sc || !sc->is_ssl || !sc->assigned || sc->assigned->nelts != 1) continue;
-        if (md != APR_ARRAY_IDX(sc->assigned, 0, md_t*)) continue;
+        if (!sc || !sc->is_ssl || sc->assigned->nelts != 1) continue;
         if (APR_SUCCESS != (rv = md_cover_server(md, s, &updates, p))) {
             return rv;
         }
@@ -491,7 +1248,8 @@ static apr_status_t auto_add_domains(md_t *md, server_rec *base_server, apr_pool
     return rv;
 }
 
-static void init_acme_tls_1_domains(md_t *md, server_rec *base_server)
+static void init_acme_tls_1_domains(md_t *md, server_rec *base_server, 
+                                    apr_array_header_t *servers)
 {
     md_srv_conf_t *sc;
     md_mod_conf_t *mc;
@@ -507,7 +1265,7 @@ static void init_acme_tls_1_domains(md_t *md, server_rec *base_server)
     apr_array_clear(md->acme_tls_1_domains);
     for (i = 0; i < md->domains->nelts; ++i) {
         domain = APR_ARRAY_IDX(md->domains, i, const char*);
-        s = get_public_https_server(md, domain, base_server);
+        s = get_public_https_server(md, domain, base_server, servers);
         /* If we did not find a specific virtualhost for md and manage
          * the base_server, that one is inspected */
         if (NULL == s && mc->manage_base_server) s = base_server;
@@ -526,13 +1284,111 @@ static void init_acme_tls_1_domains(md_t *md, server_rec *base_server)
     }
 }
 
+/* Index of the server names, so that MDs are only matched against the servers
+ * that have one of their domains, or wildcard aliases that may match them. */
+typedef struct {
+    apr_array_header_t *servers;    /* server_rec* in configuration order */
+    apr_hash_t *by_name;            /* lower case name -> array of int server index */
+    apr_array_header_t *wild;       /* int index of servers with wildcard aliases */
+    int *marks;                     /* per server, the last MD it was a candidate for */
+    apr_array_header_t *candidates; /* int server indices for the current MD */
+    apr_pool_t *p;
+} srv_index_t;
+
+static void srv_index_add(srv_index_t *idx, const char *name, int i, apr_pool_t *p)
+{
+    apr_array_header_t *list;
+    char *lc;
+    
+    if (!name) return;
+    lc = md_util_str_tolower(apr_pstrdup(p, name));
+    list = apr_hash_get(idx->by_name, lc, APR_HASH_KEY_STRING);
+    if (!list) {
+        list = apr_array_make(p, 1, sizeof(int));
+        apr_hash_set(idx->by_name, lc, APR_HASH_KEY_STRING, list);
+    }
+    if (list->nelts == 0 || APR_ARRAY_IDX(list, list->nelts-1, int) != i) {
+        APR_ARRAY_PUSH(list, int) = i;
+    }
+}
+
+static srv_index_t *srv_index_make(server_rec *base_server, apr_pool_t *p)
+{
+    srv_index_t *idx;
+    server_rec *s;
+    server_addr_rec *sar;
+    int i, j;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->p = p;
+    idx->servers = apr_array_make(p, 100, sizeof(server_rec*));
+    idx->by_name = apr_hash_make(p);
+    idx->wild = apr_array_make(p, 5, sizeof(int));
+    idx->candidates = apr_array_make(p, 10, sizeof(int));
+    for (s = base_server; s; s = s->next) {
+        i = idx->servers->nelts;
+        APR_ARRAY_PUSH(idx->servers, server_rec*) = s;
+        /* the names ap_matches_request_vhost() compares with for the server's port */
+        for (sar = s->addrs; sar; sar = sar->next) {
+            if (sar->host_port == 0 || sar->host_port == s->port) {
+                srv_index_add(idx, sar->virthost, i, p);
+            }
+        }
+        srv_index_add(idx, s->server_hostname, i, p);
+        for (j = 0; s->names && j < s->names->nelts; ++j) {
+            srv_index_add(idx, APR_ARRAY_IDX(s->names, j, const char*), i, p);
+        }
+        if (s->wild_names && s->wild_names->nelts > 0) {
+            APR_ARRAY_PUSH(idx->wild, int) = i;
+        }
+    }
+    idx->marks = apr_pcalloc(p, sizeof(int) * (apr_size_t)(idx->servers->nelts + 1));
+    return idx;
+}
+
+static void srv_index_candidate(srv_index_t *idx, int i, int mark)
+{
+    if (idx->marks[i] != mark) {
+        idx->marks[i] = mark;
+        APR_ARRAY_PUSH(idx->candidates, int) = i;
+    }
+}
+
+static int int_cmp(const void *v1, const void *v2)
+{
+    int i1 = *(const int*)v1, i2 = *(const int*)v2;
+    return (i1 < i2)? -1 : ((i1 > i2)? 1 : 0);
+}
+
+/* Collect the indices of servers that may match the MD, in configuration order. */
+static void srv_index_candidates(srv_index_t *idx, const md_t *md, int mark, apr_pool_t *p)
+{
+    apr_array_header_t *list;
+    const char *domain;
+    int i, j;
+    
+    apr_array_clear(idx->candidates);
+    for (i = 0; i < md->domains->nelts; ++i) {
+        domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        list = apr_hash_get(idx->by_name, md_util_str_tolower(apr_pstrdup(p, domain)), 
+                            APR_HASH_KEY_STRING);
+        for (j = 0; list && j < list->nelts; ++j) {
+            srv_index_candidate(idx, APR_ARRAY_IDX(list, j, int), mark);
+        }
+    }
+    for (j = 0; j < idx->wild->nelts; ++j) {
+        srv_index_candidate(idx, APR_ARRAY_IDX(idx->wild, j, int), mark);
+    }
+    qsort(idx->candidates->elts, (size_t)idx->candidates->nelts, sizeof(int), int_cmp);
+}
+
 static apr_status_t link_md_to_servers(md_mod_conf_t *mc, md_t *md, server_rec *base_server, 
-                                       apr_pool_t *p)
+                                       srv_index_t *idx, int mark, apr_pool_t *p)
 {
     server_rec *s;
     request_rec r;
     md_srv_conf_t *sc;
-    int i;
+    int i, k;
     const char *domain, *uri;
     
     sc = md_config_get(base_server);
@@ -541,7 +1397,9 @@ static apr_status_t link_md_to_servers(md_mod_conf_t *mc, md_t *md, server_rec *
      * is an assigned MD not equal this one, the configuration is in error.
      */
     memset(&r, 0, sizeof(r));
-    for (s = base_server; s; s = s->next) {
+    srv_index_candidates(idx, md, mark, idx->p);
+    for (k = 0; k < idx->candidates->nelts; ++k) {
+        s = APR_ARRAY_IDX(idx->servers, APR_ARRAY_IDX(idx->candidates, k, int), server_rec*);
         if (!mc->manage_base_server && s == base_server) {
             /* we shall not assign ourselves to the base server */
             continue;
@@ -582,16 +1440,21 @@ static apr_status_t link_mds_to_servers(md_mod_conf_t *mc, server_rec *s, apr_po
 {
     int i;
     md_t *md;
+    srv_index_t *idx;
+    apr_pool_t *ptemp;
     apr_status_t rv = APR_SUCCESS;
     
     apr_array_clear(mc->unused_names);
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) return rv;
+    idx = srv_index_make(s, ptemp);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
-        if (APR_SUCCESS != (rv = link_md_to_servers(mc, md, s, p))) {
+        if (APR_SUCCESS != (rv = link_md_to_servers(mc, md, s, idx, i + 1, p))) {
             goto leave;
         }
     }
 leave:
+    apr_pool_destroy(ptemp);
     return rv;
 }
 
@@ -599,11 +1462,12 @@ static apr_status_t merge_mds_with_conf(md_mod_conf_t *mc, apr_pool_t *p,
                                         server_rec *base_server, int log_level)
 {
     md_srv_conf_t *base_conf;
+    md_index_t *idx;
     md_t *md, *omd;
     const char *domain;
     md_timeslice_t *ts;
     apr_status_t rv = APR_SUCCESS;
-    int i, j;
+    int i;
 
     /* The global module configuration 'mc' keeps a list of all configured MDomains
      * in the server. This list is collected during configuration processing and,
@@ -615,25 +1479,25 @@ static apr_status_t merge_mds_with_conf(md_mod_conf_t *mc, apr_pool_t *p,
     if (ts) md_reg_set_renew_window_default(mc->reg, ts);
     md_config_get_timespan(&ts, base_conf, MD_CONFIG_WARN_WINDOW);
     if (ts) md_reg_set_warn_window_default(mc->reg, ts);
+    md_reg_set_renew_spread(mc->reg, mc->renew_spread);
  
     /* Complete the properties of the MDs, now that we have the complete, merged
      * server configurations.
      */
+    idx = md_index_make(p, mc->mds);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
         merge_srv_config(md, base_conf, p);
-
-        /* Check that we have no overlap with the MDs already completed */
-        for (j = 0; j < i; ++j) {
-            omd = APR_ARRAY_IDX(mc->mds, j, md_t*);
-            if ((domain = md_common_name(md, omd)) != NULL) {
-                ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
-                             "two Managed Domains have an overlap in domain '%s'"
-                             ", first definition in %s(line %d), second in %s(line %d)",
-                             domain, md->defn_name, md->defn_line_number,
-                             omd->defn_name, omd->defn_line_number);
-                return APR_EINVAL;
-            }
+        md_update_dns_names(md, p);
+
+        /* Check that we have no overlap with any other MD */
+        if ((omd = md_index_get_by_dns_overlap(idx, md, &domain)) != NULL) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO(10038)
+                         "two Managed Domains have an overlap in domain '%s'"
+                         ", first definition in %s(line %d), second in %s(line %d)",
+                         domain, md->defn_name, md->defn_line_number,
+                         omd->defn_name, omd->defn_line_number);
+            return APR_EINVAL;
         }
         
         if (md->cert_file && !md->pkey_file) {
@@ -666,14 +1530,34 @@ static apr_status_t merge_mds_with_conf(md_mod_conf_t *mc, apr_pool_t *p,
 static void load_staged_data(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
 {
     apr_status_t rv;
+    md_store_t *store;
     md_t *md;
     md_result_t *result;
-    int i;
+    int i, leased;
     
+    store = md_reg_store_get(mc->reg);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t *);
+        leased = 0;
+        if (mc->store_lease > 0 
+            && md_store_get_modified(store, MD_SG_STAGING, md->name, MD_FN_PUBCERT, p)) {
+            /* Servers sharing the store may restart at the same time, one of them 
+             * activates the staged set, the others find it in DOMAINS. */
+            rv = md_store_lease(store, p, MD_SG_STAGING, md->name, 
+                                mc->store_lease_holder, mc->store_lease);
+            if (APR_STATUS_IS_EBUSY(rv)) {
+                ap_log_error( APLOG_MARK, APLOG_INFO, 0, s, APLOGNO(10225) 
+                             "%s: staged set is handled by another server", md->name);
+                continue;
+            }
+            leased = (APR_SUCCESS == rv);
+        }
         result = md_result_md_make(p, md->name);
-        if (APR_SUCCESS == (rv = md_reg_load_staging(mc->reg, md, mc->env, result, p))) {
+        rv = md_reg_load_staging(mc->reg, md, mc->env, result, p);
+        if (leased) {
+            md_store_release(store, p, MD_SG_STAGING, md->name, mc->store_lease_holder);
+        }
+        if (APR_SUCCESS == rv) {
             ap_log_error( APLOG_MARK, APLOG_INFO, rv, s, APLOGNO(10068) 
                          "%s: staged set activated", md->name);
         }
@@ -684,6 +1568,33 @@ static void load_staged_data(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
     }
 }
 
+static void setup_keypool(md_mod_conf_t *mc, server_rec *s, apr_pool_t *p)
+{
+    md_keypool_t *keypool;
+    md_pkey_spec_t spec;
+    apr_status_t rv;
+    md_t *md;
+    int i;
+    
+    if (mc->keypool_size <= 0) return;
+    if (APR_SUCCESS != (rv = md_keypool_create(&keypool, p, md_reg_store_get(mc->reg), 
+                                               mc->keypool_size))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10214) "setup private key pool");
+        return;
+    }
+    /* keys for fallback certificates and for the MDs we renew */
+    spec.type = MD_PKEY_TYPE_RSA;
+    spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+    md_keypool_add_spec(keypool, &spec);
+    for (i = 0; i < mc->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mc->mds, i, md_t *);
+        if (md_will_renew_cert(md)) md_keypool_add_spec(keypool, md->pkey_spec);
+    }
+    /* removes keys of types no longer in use */
+    md_keypool_sync(keypool);
+    md_reg_set_keypool(mc->reg, keypool);
+}
+
 static apr_status_t check_invalid_duplicates(server_rec *base_server)
 {
     server_rec *s;
@@ -707,26 +1618,17 @@ static apr_status_t check_invalid_duplicates(server_rec *base_server)
 }
 
 static apr_status_t check_usage(md_mod_conf_t *mc, md_t *md, server_rec *base_server, 
-                                apr_pool_t *p, apr_pool_t *ptemp)
+                                apr_array_header_t *servers, apr_pool_t *p)
 {
-    server_rec *s;
     md_srv_conf_t *sc;
     apr_status_t rv = APR_SUCCESS;
     int i, has_ssl;
-    apr_array_header_t *servers;
 
     (void)p;
-    servers = apr_array_make(ptemp, 5, sizeof(server_rec*));
     has_ssl = 0;
-    for (s = base_server; s; s = s->next) {
-        sc = md_config_get(s);
-        if (!sc || !sc->assigned) continue;
-        for (i = 0; i < sc->assigned->nelts; ++i) {
-            if (md == APR_ARRAY_IDX(sc->assigned, i, md_t*)) {
-                APR_ARRAY_PUSH(servers, server_rec*) = s;
-                if (sc->is_ssl) has_ssl = 1;
-            }
-        }
+    for (i = 0; i < servers->nelts && !has_ssl; ++i) {
+        sc = md_config_get(APR_ARRAY_IDX(servers, i, server_rec*));
+        if (sc && sc->is_ssl) has_ssl = 1;
     }
 
     if (!has_ssl && md->require_https > MD_REQUIRE_OFF) {
@@ -828,8 +1730,10 @@ static apr_status_t md_post_config_before_ssl(apr_pool_t *p, apr_pool_t *plog,
     (void)plog;
     init_setups(p, s);
     md_log_set(log_is_level, log_print, NULL);
+    /* certificates are parsed once for this generation of the configuration */
+    md_cert_cache_init(p);
 
-    md_config_post_config(s, p);
+    if (APR_SUCCESS != (rv = md_config_post_config(s, p))) goto leave;
     sc = md_config_get(s);
     mc = sc->mc;
     mc->dry_run = dry_run;
@@ -849,6 +1753,11 @@ static apr_status_t md_post_config_before_ssl(apr_pool_t *p, apr_pool_t *plog,
         goto leave;
     }
     md_ocsp_set_notify_cb(mc->ocsp, notify, mc);
+    md_ocsp_set_batch_size(mc->ocsp, mc->ocsp_batch_size);
+    md_ocsp_set_parallel(mc->ocsp, mc->ocsp_parallel, mc->ocsp_parallel_responder);
+    md_ocsp_set_renew_spread(mc->ocsp, (md_ocsp_spread_t)mc->ocsp_renew_spread);
+    md_ocsp_set_use_get(mc->ocsp, mc->ocsp_use_get);
+    md_ocsp_set_lease(mc->ocsp, mc->store_lease_holder, mc->store_lease);
     
     init_ssl();
 
@@ -885,6 +1794,7 @@ static apr_status_t md_post_config_before_ssl(apr_pool_t *p, apr_pool_t *plog,
     }
     /*5*/
     load_staged_data(mc, s, p);
+    if (!dry_run) setup_keypool(mc, s, p);
 leave:
     return rv;
 }
@@ -895,10 +1805,11 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
     md_srv_conf_t *sc;
     apr_status_t rv = APR_SUCCESS;
     md_mod_conf_t *mc;
+    apr_hash_t *assigned;
+    apr_array_header_t *servers;
     int watched, i;
     md_t *md;
 
-    (void)ptemp;
     (void)plog;
     sc = md_config_get(s);
 
@@ -910,15 +1821,22 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
     if (APR_SUCCESS != (rv = check_invalid_duplicates(s))) {
         goto leave;
     }
+    if (mc->cert_load_threads > 1) {
+        /* Read and parse all certificates in parallel, the checks below 
+         * then find them in the registry's cache. */
+        md_reg_preload_pubcerts(mc->reg, mc->mds, mc->cert_load_threads, ptemp);
+    }
     apr_array_clear(mc->unused_names);
+    assigned = assigned_servers_make(s, ptemp);
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t *);
+        servers = assigned_servers_get(assigned, md, ptemp);
 
-        if (APR_SUCCESS != (rv = auto_add_domains(md, s, p))) {
+        if (APR_SUCCESS != (rv = auto_add_domains(md, s, servers, p))) {
             goto leave;
         }
-        init_acme_tls_1_domains(md, s);
-        if (APR_SUCCESS != (rv = check_usage(mc, md, s, p, ptemp))) {
+        init_acme_tls_1_domains(md, s, servers);
+        if (APR_SUCCESS != (rv = check_usage(mc, md, s, servers, p))) {
             goto leave;
         }
         if (APR_SUCCESS != (rv = md_reg_sync_finish(mc->reg, md, p, ptemp))) {
@@ -935,6 +1853,26 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
     /* From here on, the domains in the registry are readonly 
      * and only staging/challenges may be manipulated */
     md_reg_freeze_domains(mc->reg, mc->mds);
+    mc->mds_index = md_index_make(p, mc->mds);
+    if (APR_SUCCESS != md_status_cache_create(&mc->status_cache, p, mc->mds, 
+                                              mc->reg, mc->ocsp)) {
+        mc->status_cache = NULL;
+    }
+    if (APR_SUCCESS == md_status_stock_create(&mc->status_stock, p, mc->mds, mc->reg)) {
+        md_status_stock_use(mc->status_stock);
+    }
+    
+    if (watched || (mc->ocsp && md_ocsp_count(mc->ocsp) > 0)) {
+        /* one set of connections and limits for renewals and OCSP updates */
+        if (APR_SUCCESS != (rv = md_http_clients_create(&mc->http_clients, p, 
+                                                        mc->http_max_conns,
+                                                        mc->http_max_host_conns))) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10216)
+                         "http clients not shared, watchdogs use separate connections");
+            rv = APR_SUCCESS;
+        }
+        md_http_use_clients(mc->http_clients);
+    }
     
     if (watched) {
         /*10*/
@@ -950,6 +1888,12 @@ static apr_status_t md_post_config_after_ssl(apr_pool_t *p, apr_pool_t *plog,
 
     if (!mc->ocsp || md_ocsp_count(mc->ocsp) == 0) goto leave;
     
+    if (mc->ocsp_shared_cache 
+        && APR_SUCCESS != (rv = md_ocsp_use_shm(mc->ocsp, p))) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, APLOGNO(10206)
+                     "OCSP shared cache not available, children read responses from the store");
+    }
+    
     md_http_use_implementation(md_curl_get_impl(p));
     rv = md_ocsp_start_watching(mc, s, p);
     
@@ -1014,8 +1958,8 @@ static int md_protocol_switch(conn_rec *c, request_rec *r, server_rec *s,
 /**************************************************************************************************/
 /* Access API to other httpd components */
 
-static apr_status_t setup_fallback_cert(md_store_t *store, const md_t *md, 
-                                        server_rec *s, apr_pool_t *p)
+static apr_status_t setup_fallback_cert(md_store_t *store, md_keypool_t *keypool,
+                                        const md_t *md, server_rec *s, apr_pool_t *p)
 {
     md_pkey_t *pkey;
     md_cert_t *cert;
@@ -1025,19 +1969,115 @@ static apr_status_t setup_fallback_cert(md_store_t *store, const md_t *md,
     spec.type = MD_PKEY_TYPE_RSA;
     spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
     
-    if (APR_SUCCESS != (rv = md_pkey_gen(&pkey, p, &spec))
-        || APR_SUCCESS != (rv = md_store_save(store, p, MD_SG_DOMAINS, md->name, 
+    if ((!keypool || APR_SUCCESS != md_keypool_take(&pkey, keypool, &spec, p))
+        && APR_SUCCESS != (rv = md_pkey_gen(&pkey, p, &spec))) {
+        goto leave;
+    }
+    if (APR_SUCCESS != (rv = md_store_save(store, p, MD_SG_DOMAINS, md->name, 
                                 MD_FN_FALLBACK_PKEY, MD_SV_PKEY, (void*)pkey, 0))
-        || APR_SUCCESS != (rv = md_cert_self_sign(&cert, "Apache Managed Domain Fallback", 
-                                    md->domains, pkey, apr_time_from_sec(14 * MD_SECS_PER_DAY), p))
+        || APR_SUCCESS != (rv = md_cert_self_sign(&cert, MD_FALLBACK_CN, 
+                                    md->domains, pkey, MD_FALLBACK_VALID, p))
         || APR_SUCCESS != (rv = md_store_save(store, p, MD_SG_DOMAINS, md->name, 
                                 MD_FN_FALLBACK_CERT, MD_SV_CERT, (void*)cert, 0))) {
+        goto leave;
+    }
+leave:
+    if (APR_SUCCESS != rv) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10174)
                      "%s: setup fallback certificate", md->name);
     }
     return rv;
 }
 
+/* Load the key shared by all fallback certificates or, when there is none yet,
+ * make one. An EC key is quick to generate, so this does not need the keypool. */
+static apr_status_t fallback_pkey_get(md_pkey_t **ppkey, md_mod_conf_t *mc, 
+                                      md_store_t *store, server_rec *s)
+{
+    apr_pool_t *p = apr_hash_pool_get(mc->fallbacks);
+    md_pkey_t *pkey = mc->fallback_pkey;
+    md_pkey_spec_t spec;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (pkey) goto leave;
+    rv = md_store_load(store, MD_SG_NONE, NULL, MD_FN_FALLBACK_SHARED_PKEY, 
+                       MD_SV_PKEY, (void**)&pkey, p);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        spec.type = MD_PKEY_TYPE_EC;
+        spec.params.ec.curve = MD_PKEY_EC_CURVE_DEF;
+        if (APR_SUCCESS == (rv = md_pkey_gen(&pkey, p, &spec))) {
+            rv = md_store_save(store, p, MD_SG_NONE, NULL, MD_FN_FALLBACK_SHARED_PKEY, 
+                               MD_SV_PKEY, (void*)pkey, 0);
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10218)
+                     "setup shared key for fallback certificates");
+        pkey = NULL;
+        goto leave;
+    }
+    mc->fallback_pkey = pkey;
+    mc->fallback_pkey_mtime = md_store_get_modified(store, MD_SG_NONE, NULL, 
+                                                    MD_FN_FALLBACK_SHARED_PKEY, p);
+leave:
+    *ppkey = pkey;
+    return rv;
+}
+
+/* Get the fallback files for md, making them if needed. With a shared key, the
+ * certificate is signed again when it is older than the key file. In common mode, 
+ * all MDs use one common certificate. */
+static apr_status_t get_fallback_files(const char **pkeyfile, const char **pcertfile,
+                                       md_mod_conf_t *mc, md_store_t *store, 
+                                       const md_t *md, server_rec *s, apr_pool_t *p)
+{
+    md_store_group_t group = MD_SG_DOMAINS;
+    const char *name = md->name;
+    apr_array_header_t *domains = md->domains;
+    md_pkey_t *pkey;
+    md_cert_t *cert;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (MD_FALLBACK_INDIVIDUAL == mc->fallback_mode) {
+        md_store_get_fname(pkeyfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_PKEY, p);
+        md_store_get_fname(pcertfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_CERT, p);
+        if (!apr_hash_get(mc->fallbacks, md->name, APR_HASH_KEY_STRING)
+            && (!md_file_exists(*pkeyfile, p) || !md_file_exists(*pcertfile, p))) { 
+            rv = setup_fallback_cert(store, md_reg_keypool_get(mc->reg), md, s, p);
+        }
+        goto leave;
+    }
+    
+    if (MD_FALLBACK_COMMON == mc->fallback_mode) {
+        group = MD_SG_NONE;
+        name = NULL;
+        domains = apr_array_make(p, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(domains, const char *) = MD_FALLBACK_COMMON_NAME;
+    }
+    md_store_get_fname(pkeyfile, store, MD_SG_NONE, NULL, MD_FN_FALLBACK_SHARED_PKEY, p);
+    md_store_get_fname(pcertfile, store, group, name, MD_FN_FALLBACK_SHARED_CERT, p);
+    if (apr_hash_get(mc->fallbacks, md->name, APR_HASH_KEY_STRING)) goto leave;
+    
+    if (APR_SUCCESS != (rv = fallback_pkey_get(&pkey, mc, store, s))) goto leave;
+    if (md_store_get_modified(store, group, name, MD_FN_FALLBACK_SHARED_CERT, p) 
+        < mc->fallback_pkey_mtime) {
+        if (APR_SUCCESS != (rv = md_cert_self_sign(&cert, MD_FALLBACK_CN, domains, 
+                                                   pkey, MD_FALLBACK_VALID, p))
+            || APR_SUCCESS != (rv = md_store_save(store, p, group, name, 
+                                MD_FN_FALLBACK_SHARED_CERT, MD_SV_CERT, (void*)cert, 0))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10219)
+                         "%s: setup fallback certificate", md->name);
+        }
+    }
+leave:
+    if (APR_SUCCESS == rv && !apr_hash_get(mc->fallbacks, md->name, APR_HASH_KEY_STRING)) {
+        /* vhosts sharing this MD need not check again in this generation */
+        apr_hash_set(mc->fallbacks, apr_pstrdup(apr_hash_pool_get(mc->fallbacks), md->name), 
+                     APR_HASH_KEY_STRING, md);
+    }
+    return rv;
+}
+
 static apr_status_t get_certificate(server_rec *s, apr_pool_t *p, int fallback,
                                     const char **pcertfile, const char **pkeyfile)
 {
@@ -1092,12 +2132,9 @@ static apr_status_t get_certificate(server_rec *s, apr_pool_t *p, int fallback,
             store = md_reg_store_get(reg);
             assert(store);    
             
-            md_store_get_fname(pkeyfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_PKEY, p);
-            md_store_get_fname(pcertfile, store, MD_SG_DOMAINS, md->name, MD_FN_FALLBACK_CERT, p);
-            if (!md_file_exists(*pkeyfile, p) || !md_file_exists(*pcertfile, p)) { 
-                if (APR_SUCCESS != (rv = setup_fallback_cert(store, md, s, p))) {
-                    return rv;
-                }
+            if (APR_SUCCESS != (rv = get_fallback_files(pkeyfile, pcertfile, sc->mc, 
+                                                        store, md, s, p))) {
+                return rv;
             }
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO(10116)  
                          "%s: providing fallback certificate for server %s", 
@@ -1183,12 +2220,21 @@ static int md_is_challenge(conn_rec *c, const char *servername,
             
             ap_log_cerror(APLOG_MARK, APLOG_TRACE1, 0, c, "%s: load certs/keys %s/%s",
                           servername, cert_name, pkey_name);
-            rv = md_store_load(store, MD_SG_CHALLENGES, servername, cert_name, 
-                               MD_SV_CERT, (void**)&mdcert, c->pool);
-            if (APR_SUCCESS == rv && (*pcert = md_cert_get_X509(mdcert))) {
-                rv = md_store_load(store, MD_SG_CHALLENGES, servername, pkey_name, 
-                                   MD_SV_PKEY, (void**)&mdpkey, c->pool);
-                if (APR_SUCCESS == rv && (*pkey = md_pkey_get_EVP_PKEY(mdpkey))) {
+            if (sc->mc->challenge_cache) {
+                rv = tls_alpn01_cache_load(pcert, pkey, sc->mc->challenge_cache, store, 
+                                           servername, c->pool);
+            }
+            else {
+                rv = md_store_load(store, MD_SG_CHALLENGES, servername, cert_name, 
+                                   MD_SV_CERT, (void**)&mdcert, c->pool);
+                if (APR_SUCCESS == rv && (*pcert = md_cert_get_X509(mdcert))) {
+                    rv = md_store_load(store, MD_SG_CHALLENGES, servername, pkey_name, 
+                                       MD_SV_PKEY, (void**)&mdpkey, c->pool);
+                    if (APR_SUCCESS == rv) *pkey = md_pkey_get_EVP_PKEY(mdpkey);
+                }
+            }
+            if (*pcert) {
+                if (APR_SUCCESS == rv && *pkey) {
                     ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, c, APLOGNO(10078)
                                   "%s: is a %s challenge host", servername, challenge);
                     return 1;
@@ -1239,15 +2285,22 @@ static int md_http_challenge_pr(request_rec *r)
             ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, 
                           "access inside /.well-known/acme-challenge for %s%s", 
                           r->hostname, r->parsed_uri.path);
-            md = md_get_by_domain(sc->mc->mds, r->hostname);
+            md = sc->mc->mds_index? md_index_get_by_domain(sc->mc->mds_index, r->hostname)
+                : md_get_by_domain(sc->mc->mds, r->hostname);
             name = r->parsed_uri.path + sizeof(ACME_CHALLENGE_PREFIX)-1;
             reg = sc && sc->mc? sc->mc->reg : NULL;
             
             if (strlen(name) && !ap_strchr_c(name, '/') && reg) {
                 md_store_t *store = md_reg_store_get(reg);
                 
-                rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
-                                   MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                if (sc->mc->challenge_cache) {
+                    rv = http01_cache_load(&data, sc->mc->challenge_cache, store, 
+                                           r->hostname, r->pool);
+                }
+                else {
+                    rv = md_store_load(store, MD_SG_CHALLENGES, r->hostname, 
+                                       MD_FN_HTTP01, MD_SV_TEXT, (void**)&data, r->pool);
+                }
                 ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, 
                               "loading challenge for %s (%s)", r->hostname, r->uri);
                 if (APR_SUCCESS == rv) {
@@ -1361,8 +2414,19 @@ declined:
  */
 static void md_child_init(apr_pool_t *pool, server_rec *s)
 {
-    (void)pool;
-    (void)s;
+    md_srv_conf_t *sc = md_config_get(s);
+    apr_status_t rv;
+    
+    /* Only children queue notifications, the parent runs them itself, e.g. for 
+     * 'installed' with the privileges it has at startup. */
+    if (sc && sc->mc && sc->mc->notify_batch > 0
+        && (sc->mc->notify_cmd || sc->mc->message_cmd)) {
+        rv = notify_queue_create(&sc->mc->notify_queue, sc->mc, s, pool);
+        if (APR_SUCCESS != rv) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10226) 
+                         "unable to setup batched notifications, running them one by one");
+        }
+    }
 }
 
 /* Install this module into the apache2 infrastructure.
@@ -1399,6 +2463,7 @@ static void md_hooks(apr_pool_t *pool)
     APR_OPTIONAL_HOOK(ap, status_hook, md_domains_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
     APR_OPTIONAL_HOOK(ap, status_hook, md_ocsp_status_hook, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(md_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(md_metrics_handler, NULL, NULL, APR_HOOK_MIDDLE);
 
 
 #ifndef SSL_CERT_HOOKS
@@ -1409,5 +2474,9 @@ static void md_hooks(apr_pool_t *pool)
     APR_OPTIONAL_HOOK(ssl, answer_challenge, md_answer_challenge, NULL, NULL, APR_HOOK_MIDDLE);
     APR_OPTIONAL_HOOK(ssl, init_stapling_status, md_ocsp_init_stapling_status, NULL, NULL, APR_HOOK_MIDDLE);
     APR_OPTIONAL_HOOK(ssl, get_stapling_status, md_ocsp_get_stapling_status, NULL, NULL, APR_HOOK_MIDDLE);
+    
+    /* For TLS modules that can staple a shared response without taking ownership */
+    APR_REGISTER_OPTIONAL_FN(md_borrow_stapling_status);
+    APR_REGISTER_OPTIONAL_FN(md_release_stapling_status);
 }
 
@@ -39,4 +39,20 @@ APR_DECLARE_OPTIONAL_FN(int,
                         md_is_challenge, (struct conn_rec *, const char *,
                                           X509 **pcert, EVP_PKEY **pkey));
 
+/**
+ * Borrow the OCSP response to staple for a certificate in the server. The
+ * response is shared with other connections and must not be modified. It
+ * stays valid until md_release_stapling_status() is called with *ptoken.
+ * 
+ * @return OK when *pder is set (it may be NULL if no response is available),
+ *         DECLINED if mod_md does not staple this certificate
+ */
+APR_DECLARE_OPTIONAL_FN(int, 
+                        md_borrow_stapling_status, (const unsigned char **pder, int *pderlen,
+                                                    void **ptoken, struct conn_rec *c, 
+                                                    struct server_rec *s, X509 *cert));
+
+APR_DECLARE_OPTIONAL_FN(void, 
+                        md_release_stapling_status, (void *token));
+
 #endif /* mod_md_mod_md_h */
@@ -17,6 +17,7 @@
 #include <assert.h>
 
 #include <apr_lib.h>
+#include <apr_network_io.h>
 #include <apr_strings.h>
 
 #include <httpd.h>
@@ -27,7 +28,11 @@
 
 #include "md.h"
 #include "md_crypt.h"
+#include "md_http.h"
 #include "md_log.h"
+#include "md_ocsp.h"
+#include "md_status.h"
+#include "md_store_dbm.h"
 #include "md_util.h"
 #include "mod_md_private.h"
 #include "mod_md_config.h"
@@ -81,6 +86,36 @@ static md_mod_conf_t defmc = {
     &def_ocsp_renew_window,    /* default time to renew ocsp responses */
     "crt.sh",                  /* default cert checker site name */
     "https://crt.sh?q=",       /* default cert checker site url */
+    0,                         /* ocsp shared cache */
+    1,                         /* ocsp batch size */
+    MD_OCSP_PARALLEL_DEF,      /* ocsp parallel requests */
+    MD_OCSP_PARALLEL_RESPONDER_DEF, /* ocsp parallel requests per responder */
+    MD_OCSP_SPREAD_NONE,       /* ocsp renew spread */
+    0,                         /* ocsp use GET */
+    NULL,                      /* challenge cache */
+    NULL,                      /* mds index */
+    1,                         /* cert load threads */
+    NULL,                      /* store dbm type */
+    1,                         /* renew parallel */
+    1,                         /* renew parallel per CA */
+    0,                         /* key pool size */
+    MD_HTTP_CONNS_DEF,         /* http max requests in flight */
+    MD_HTTP_HOST_CONNS_DEF,    /* http max requests in flight per host */
+    NULL,                      /* http clients */
+    NULL,                      /* status cache */
+    NULL,                      /* status stock */
+    MD_JOB_SAVE_INTERVAL_DEF,  /* job save interval */
+    MD_FALLBACK_INDIVIDUAL,    /* fallback mode */
+    NULL,                      /* fallback pkey */
+    0,                         /* fallback pkey mtime */
+    0,                         /* store lease */
+    NULL,                      /* store lease holder */
+    0,                         /* renew spread */
+    0,                         /* notify batch */
+    apr_time_from_sec(60),     /* notify timeout */
+    2,                         /* notify max cmds */
+    NULL,                      /* notify queue */
+    0,                         /* renew batch */
 };
 
 static md_timeslice_t def_renew_window = {
@@ -137,6 +172,7 @@ static md_mod_conf_t *md_mod_conf_get(apr_pool_t *pool, int create)
         mod_md_config->unused_names = apr_array_make(pool, 5, sizeof(const md_t *));
         mod_md_config->env = apr_table_make(pool, 10);
         mod_md_config->init_errors = apr_hash_make(pool);
+        mod_md_config->fallbacks = apr_hash_make(pool);
          
         apr_pool_cleanup_register(pool, NULL, cleanup_mod_config, apr_pool_cleanup_null);
     }
@@ -180,7 +216,7 @@ static void srv_conf_props_copy(md_srv_conf_t *to, const md_srv_conf_t *from)
     to->staple_others = from->staple_others;
 }
 
-static void srv_conf_props_apply(md_t *md, const md_srv_conf_t *from, apr_pool_t *p)
+static void srv_conf_props_apply(md_t *md, const md_srv_conf_t *from)
 {
     if (from->require_https != MD_REQUIRE_UNSET) md->require_https = from->require_https;
     if (from->transitive != DEF_VAL) md->transitive = from->transitive;
@@ -192,7 +228,7 @@ static void srv_conf_props_apply(md_t *md, const md_srv_conf_t *from, apr_pool_t
     if (from->ca_url) md->ca_url = from->ca_url;
     if (from->ca_proto) md->ca_proto = from->ca_proto;
     if (from->ca_agreement) md->ca_agreement = from->ca_agreement;
-    if (from->ca_challenges) md->ca_challenges = apr_array_copy(p, from->ca_challenges);
+    if (from->ca_challenges) md->ca_challenges = from->ca_challenges;
     if (from->stapling != DEF_VAL) md->stapling = from->stapling;
 }
 
@@ -231,8 +267,7 @@ static void *md_config_merge(apr_pool_t *pool, void *basev, void *addv)
     nsc->ca_url = add->ca_url? add->ca_url : base->ca_url;
     nsc->ca_proto = add->ca_proto? add->ca_proto : base->ca_proto;
     nsc->ca_agreement = add->ca_agreement? add->ca_agreement : base->ca_agreement;
-    nsc->ca_challenges = (add->ca_challenges? apr_array_copy(pool, add->ca_challenges) 
-                    : (base->ca_challenges? apr_array_copy(pool, base->ca_challenges) : NULL));
+    nsc->ca_challenges = add->ca_challenges? add->ca_challenges : base->ca_challenges;
     nsc->stapling = (add->stapling != DEF_VAL)? add->stapling : base->stapling;
     nsc->staple_others = (add->staple_others != DEF_VAL)? add->staple_others : base->staple_others;
     nsc->current = NULL;
@@ -379,7 +414,7 @@ static const char *md_config_sec_start(cmd_parms *cmd, void *mconfig, const char
     sc->current = md;
     
     if (NULL == (err = ap_walk_config(cmd->directive->first_child, cmd, cmd->context))) {
-        srv_conf_props_apply(md, sc, cmd->pool);
+        srv_conf_props_apply(md, sc);
         APR_ARRAY_PUSH(sc->mc->mds, const md_t *) = md;
     }
     
@@ -648,9 +683,24 @@ static const char *md_config_set_store_dir(cmd_parms *cmd, void *arg, const char
     md_srv_conf_t *sc = md_config_get(cmd->server);
     const char *err;
 
+    const char *sep, *type;
+    
     if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
         return err;
     }
+    /* "type:path" keeps challenges and OCSP data in a database of that type */
+    if ((sep = strchr(value, ':')) && sep - value > 1) {
+        type = apr_pstrndup(cmd->pool, value, (apr_size_t)(sep - value));
+        if (!strcmp("lmdb", type) || !strcmp("db", type) 
+            || !strcmp("gdbm", type) || !strcmp("ndbm", type)) {
+            if (APR_SUCCESS != md_store_dbm_check_type(type, cmd->pool)) {
+                return apr_psprintf(cmd->pool, "the database type '%s' is not "
+                                    "supported by this apr-util", type);
+            }
+            sc->mc->store_dbm_type = type;
+            value = sep + 1;
+        }
+    }
     sc->mc->base_dir = value;
     (void)arg;
     return NULL;
@@ -722,7 +772,7 @@ static const char *md_config_set_cha_tyes(cmd_parms *cmd, void *dc,
                                           int argc, char *const argv[])
 {
     md_srv_conf_t *config = md_config_get(cmd->server);
-    apr_array_header_t **pcha, *ca_challenges;
+    apr_array_header_t *ca_challenges;
     const char *err;
     int i;
 
@@ -730,18 +780,12 @@ static const char *md_config_set_cha_tyes(cmd_parms *cmd, void *dc,
     if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
         return err;
     }
-    pcha = &config->ca_challenges; 
-    
-    ca_challenges = *pcha;
-    if (ca_challenges) {
-        apr_array_clear(ca_challenges);
-    }
-    else {
-        *pcha = ca_challenges = apr_array_make(cmd->pool, 5, sizeof(const char *));
-    }
+    /* Always a new array, as merged server configs and MDs share the old one */
+    ca_challenges = apr_array_make(cmd->pool, argc, sizeof(const char *));
     for (i = 0; i < argc; ++i) {
         APR_ARRAY_PUSH(ca_challenges, const char *) = argv[i];
     }
+    config->ca_challenges = ca_challenges;
     
     return NULL;
 }
@@ -750,7 +794,8 @@ static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc,
                                        int argc, char *const argv[])
 {
     md_srv_conf_t *config = md_config_get(cmd->server);
-    const char *err, *ptype;
+    const char *err, *ptype, *curve;
+    md_pkey_spec_t spec;
     apr_int64_t bits;
     
     (void)dc;
@@ -796,6 +841,41 @@ static const char *md_config_set_pkeys(cmd_parms *cmd, void *dc,
         config->pkey_spec->params.rsa.bits = (unsigned int)bits;
         return NULL;
     }
+    else if (!apr_strnatcasecmp("EC", ptype)) {
+        if (argc == 1) {
+            curve = MD_PKEY_EC_CURVE_DEF;
+        }
+        else if (argc == 2) {
+            if (!(curve = md_pkey_ec_curve_name(argv[1]))) {
+                return apr_pstrcat(cmd->pool, "unsupported EC curve \"", argv[1], 
+                                   "\", use 'P-256' or 'P-384'", NULL);
+            }
+        }
+        else {
+            return "key type 'EC' has only one optional parameter, the curve name";
+        }
+
+        if (!config->pkey_spec) {
+            config->pkey_spec = apr_pcalloc(cmd->pool, sizeof(*config->pkey_spec));
+        }
+        config->pkey_spec->type = MD_PKEY_TYPE_EC;
+        config->pkey_spec->params.ec.curve = curve;
+        return NULL;
+    }
+    else if (!apr_strnatcasecmp("Ed25519", ptype)) {
+        if (argc > 1) {
+            return "type 'Ed25519' takes no parameter";
+        }
+        spec.type = MD_PKEY_TYPE_ED25519;
+        if (!md_pkey_spec_is_supported(&spec)) {
+            return "type 'Ed25519' is not supported by the SSL library in use";
+        }
+        if (!config->pkey_spec) {
+            config->pkey_spec = apr_pcalloc(cmd->pool, sizeof(*config->pkey_spec));
+        }
+        config->pkey_spec->type = MD_PKEY_TYPE_ED25519;
+        return NULL;
+    }
     return apr_pstrcat(cmd->pool, "unsupported private key type \"", ptype, "\"", NULL);
 }
 
@@ -838,6 +918,21 @@ static const char *md_config_set_dns01_cmd(cmd_parms *cmd, void *mconfig, const
     return NULL;
 }
 
+static const char *md_config_set_dns01_batch(cmd_parms *cmd, void *mconfig, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int batch;
+
+    (void)mconfig;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))
+        || (err = set_on_off(&batch, value, cmd->pool))) {
+        return err;
+    }
+    apr_table_set(sc->mc->env, MD_KEY_CMD_DNS01_BATCH, batch? "on" : "off");
+    return NULL;
+}
+
 static const char *md_config_set_cert_file(cmd_parms *cmd, void *mconfig, const char *arg)
 {
     md_srv_conf_t *sc = md_config_get(cmd->server);
@@ -918,6 +1013,165 @@ static const char *md_config_set_ocsp_renew_window(cmd_parms *cmd, void *dc, con
     return NULL;
 }
 
+static const char *md_config_set_ocsp_shared_cache(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    return set_on_off(&sc->mc->ocsp_shared_cache, value, cmd->pool);
+}
+
+static const char *md_config_set_ocsp_batch_size(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 1 || n > MD_OCSP_BATCH_SIZE_MAX) {
+        return apr_psprintf(cmd->pool, "MDStaplingBatchSize must be between 1 and %d", 
+                            MD_OCSP_BATCH_SIZE_MAX);
+    }
+    sc->mc->ocsp_batch_size = n;
+    return NULL;
+}
+
+static const char *md_config_set_cert_load_threads(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 1 || n > 64) {
+        return "MDCertificateLoadThreads must be between 1 and 64";
+    }
+    sc->mc->cert_load_threads = n;
+    return NULL;
+}
+
+static const char *md_config_set_ocsp_parallel(cmd_parms *cmd, void *dc, 
+                                               const char *total, const char *per_responder)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n, m;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    n = (int)apr_atoi64(total);
+    if (n < 1 || n > 1000) {
+        return "MDStaplingParallel total must be between 1 and 1000";
+    }
+    m = per_responder? (int)apr_atoi64(per_responder) : n;
+    if (m < 1 || m > n) {
+        return "MDStaplingParallel per responder must be between 1 and total";
+    }
+    sc->mc->ocsp_parallel = n;
+    sc->mc->ocsp_parallel_responder = m;
+    return NULL;
+}
+
+static const char *md_config_set_renew_parallel(cmd_parms *cmd, void *dc, 
+                                                const char *total, const char *per_ca)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n, m;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(total);
+    if (n < 1 || n > 64) {
+        return "MDRenewParallel total must be between 1 and 64";
+    }
+    m = per_ca? (int)apr_atoi64(per_ca) : n;
+    if (m < 1 || m > n) {
+        return "MDRenewParallel per CA must be between 1 and total";
+    }
+    sc->mc->renew_parallel = n;
+    sc->mc->renew_parallel_ca = m;
+    return NULL;
+}
+
+static const char *md_config_set_ocsp_renew_spread(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        sc->mc->ocsp_renew_spread = MD_OCSP_SPREAD_NONE;
+    }
+    else if (!apr_strnatcasecmp("random", value)) {
+        sc->mc->ocsp_renew_spread = MD_OCSP_SPREAD_RANDOM;
+    }
+    else if (!apr_strnatcasecmp("even", value)) {
+        sc->mc->ocsp_renew_spread = MD_OCSP_SPREAD_EVEN;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown '", value, 
+                           "', supported parameter values are 'off', 'random' and 'even'", NULL);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_fallback_mode(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("individual", value)) {
+        sc->mc->fallback_mode = MD_FALLBACK_INDIVIDUAL;
+    }
+    else if (!apr_strnatcasecmp("shared", value)) {
+        sc->mc->fallback_mode = MD_FALLBACK_SHARED;
+    }
+    else if (!apr_strnatcasecmp("common", value)) {
+        sc->mc->fallback_mode = MD_FALLBACK_COMMON;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown '", value, 
+                           "', supported parameter values are 'individual', 'shared' and 'common'", NULL);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_ocsp_use_get(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_ALL))) {
+        return err;
+    }
+    return set_on_off(&sc->mc->ocsp_use_get, value, cmd->pool);
+}
+
 static const char *md_config_set_cert_check(cmd_parms *cmd, void *dc, 
                                             const char *name, const char *url)
 {
@@ -950,6 +1204,224 @@ static const char *md_config_set_activation_delay(cmd_parms *cmd, void *mconfig,
     return NULL;
 }
 
+static const char *md_config_set_dir_max_age(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t max_age;
+
+    (void)mconfig;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", arg)) {
+        max_age = 0;
+    }
+    else if (md_duration_parse(&max_age, arg, "h") != APR_SUCCESS) {
+        return "unrecognized duration format";
+    }
+    apr_table_set(sc->mc->env, MD_KEY_DIR_MAX_AGE, md_duration_format(cmd->pool, max_age));
+    return NULL;
+}
+
+static const char *md_config_set_acct_check(cmd_parms *cmd, void *mconfig, const char *arg)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t interval;
+
+    (void)mconfig;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (md_duration_parse(&interval, arg, "h") != APR_SUCCESS) {
+        return "unrecognized duration format";
+    }
+    apr_table_set(sc->mc->env, MD_KEY_ACCT_CHECK, md_duration_format(cmd->pool, interval));
+    return NULL;
+}
+
+static const char *md_config_set_authz_parallel(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 1 || n > 64) {
+        return "MDAuthorizationParallel must be between 1 and 64";
+    }
+    apr_table_set(sc->mc->env, MD_KEY_AUTHZ_PARALLEL, apr_itoa(cmd->pool, n));
+    return NULL;
+}
+
+static const char *md_config_set_keypool(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 0 || n > 100) {
+        return "MDPrivateKeyPool must be between 0 and 100";
+    }
+    sc->mc->keypool_size = n;
+    return NULL;
+}
+
+static const char *md_config_set_http_limits(cmd_parms *cmd, void *dc, 
+                                             const char *total, const char *per_host)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    int n, m;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    n = (int)apr_atoi64(total);
+    if (n < 1 || n > 256) {
+        return "MDHttpClientLimits total must be between 1 and 256";
+    }
+    m = per_host? (int)apr_atoi64(per_host) : n;
+    if (m < 1 || m > n) {
+        return "MDHttpClientLimits per host must be between 1 and total";
+    }
+    sc->mc->http_max_conns = n;
+    sc->mc->http_max_host_conns = m;
+    return NULL;
+}
+
+static const char *md_config_set_job_save_interval(cmd_parms *cmd, void *dc, const char *arg)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t interval;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", arg)) {
+        interval = 0;
+    }
+    else if (md_duration_parse(&interval, arg, "s") != APR_SUCCESS || interval < 0) {
+        return "unrecognized duration format";
+    }
+    sc->mc->job_save_interval = interval;
+    return NULL;
+}
+
+static const char *md_config_set_renew_spread(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    char *end;
+    apr_int64_t n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        n = 0;
+    }
+    else {
+        n = apr_strtoi64(value, &end, 10);
+        if (end == value || strcmp("%", end) || n < 1 || n > 50) {
+            return "MDRenewSpread needs 'off' or a percentage between 1% and 50%";
+        }
+    }
+    sc->mc->renew_spread = (int)n;
+    return NULL;
+}
+
+static const char *md_config_set_renew_batch(cmd_parms *cmd, void *dc, const char *value)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t window;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        window = 0;
+    }
+    else if (md_duration_parse(&window, value, "h") != APR_SUCCESS || window < 0) {
+        return "unrecognized duration format";
+    }
+    sc->mc->renew_batch = window;
+    return NULL;
+}
+
+static const char *md_config_set_store_lease(cmd_parms *cmd, void *dc, 
+                                             const char *value, const char *holder)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t ttl;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        ttl = 0;
+    }
+    else if (md_duration_parse(&ttl, value, "s") != APR_SUCCESS || ttl < apr_time_from_sec(60)) {
+        return "MDStoreLease needs 'off' or a duration of at least 60 seconds";
+    }
+    sc->mc->store_lease = ttl;
+    sc->mc->store_lease_holder = holder;
+    return NULL;
+}
+
+static const char *md_config_set_notify_batch(cmd_parms *cmd, void *dc, const char *value,
+                                              const char *timeout, const char *max_cmds)
+{
+    md_srv_conf_t *sc = md_config_get(cmd->server);
+    const char *err;
+    apr_interval_time_t window, tout;
+    int n;
+
+    (void)dc;
+    if ((err = md_conf_check_location(cmd, MD_LOC_NOT_MD))) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("off", value)) {
+        window = 0;
+    }
+    else if (md_duration_parse(&window, value, "s") != APR_SUCCESS || window <= 0) {
+        return "MDNotifyBatch needs 'off' or a duration";
+    }
+    if (timeout) {
+        if (md_duration_parse(&tout, timeout, "s") != APR_SUCCESS || tout <= 0) {
+            return "MDNotifyBatch timeout needs to be a duration";
+        }
+        sc->mc->notify_timeout = tout;
+    }
+    if (max_cmds) {
+        n = (int)apr_atoi64(max_cmds);
+        if (n < 1) {
+            return "MDNotifyBatch needs a positive number of commands to run at once";
+        }
+        sc->mc->notify_max_cmds = n;
+    }
+    sc->mc->notify_batch = window;
+    return NULL;
+}
+
 const command_rec md_cmds[] = {
     AP_INIT_TAKE1("MDCertificateAuthority", md_config_set_ca, NULL, RSRC_CONF, 
                   "URL of CA issuing the certificates"),
@@ -998,6 +1470,8 @@ const command_rec md_cmds[] = {
                   "Allow managing of base server outside virtual hosts."),
     AP_INIT_RAW_ARGS("MDChallengeDns01", md_config_set_dns01_cmd, NULL, RSRC_CONF, 
                   "Set the command for setup/teardown of dns-01 challenges"),
+    AP_INIT_TAKE1("MDChallengeDns01Batch", md_config_set_dns01_batch, NULL, RSRC_CONF, 
+                  "Run the dns-01 command once for all domains of an order"),
     AP_INIT_TAKE1("MDCertificateFile", md_config_set_cert_file, NULL, RSRC_CONF, 
                   "set the static certificate (chain) file to use for this domain."),
     AP_INIT_TAKE1("MDCertificateKeyFile", md_config_set_key_file, NULL, RSRC_CONF, 
@@ -1018,10 +1492,50 @@ const command_rec md_cmds[] = {
                   "The amount of time to keep an OCSP response in the store."),
     AP_INIT_TAKE1("MDStaplingRenewWindow", md_config_set_ocsp_renew_window, NULL, RSRC_CONF, 
                   "Time length for renewal before OCSP responses expire (defaults to days)."),
+    AP_INIT_TAKE1("MDStaplingBatchSize", md_config_set_ocsp_batch_size, NULL, RSRC_CONF, 
+                  "Max number of certificates to ask an OCSP responder about in one request."),
+    AP_INIT_TAKE12("MDStaplingParallel", md_config_set_ocsp_parallel, NULL, RSRC_CONF, 
+                  "Max parallel OCSP requests, in total and optionally per responder."),
+    AP_INIT_TAKE1("MDStaplingRenewSpread", md_config_set_ocsp_renew_spread, NULL, RSRC_CONF, 
+                  "How to spread OCSP renewals in the renew window: off, random or even."),
+    AP_INIT_TAKE1("MDStaplingUseGET", md_config_set_ocsp_use_get, NULL, RSRC_CONF, 
+                  "On to use cacheable RFC 5019 GET requests towards OCSP responders."),
+    AP_INIT_TAKE1("MDStaplingSharedCache", md_config_set_ocsp_shared_cache, NULL, RSRC_CONF, 
+                  "On to share OCSP responses between all child processes in shared memory."),
     AP_INIT_TAKE2("MDCertificateCheck", md_config_set_cert_check, NULL, RSRC_CONF, 
                   "Set name and URL pattern for a certificate monitoring site."),
     AP_INIT_TAKE1("MDActivationDelay", md_config_set_activation_delay, NULL, RSRC_CONF, 
                   "How long to delay activation of new certificates"),
+    AP_INIT_TAKE1("MDCertificateLoadThreads", md_config_set_cert_load_threads, NULL, RSRC_CONF, 
+                  "Number of threads loading the certificates of all MDs at server start."),
+    AP_INIT_TAKE12("MDRenewParallel", md_config_set_renew_parallel, NULL, RSRC_CONF, 
+                  "Max MDs renewed in parallel, in total and optionally per CA."),
+    AP_INIT_TAKE1("MDAccountCheckInterval", md_config_set_acct_check, NULL, RSRC_CONF, 
+                  "How long an ACME account is used before it is validated at the CA again."),
+    AP_INIT_TAKE1("MDCADirectoryMaxAge", md_config_set_dir_max_age, NULL, RSRC_CONF, 
+                  "How long the directory of an ACME CA is cached in the store, or 'off'."),
+    AP_INIT_TAKE1("MDAuthorizationParallel", md_config_set_authz_parallel, NULL, RSRC_CONF, 
+                  "Max requests to an ACME CA in parallel for the authorizations of a domain."),
+    AP_INIT_TAKE1("MDPrivateKeyPool", md_config_set_keypool, NULL, RSRC_CONF, 
+                  "Number of pre-generated private keys kept for each key type in use."),
+    AP_INIT_TAKE12("MDHttpClientLimits", md_config_set_http_limits, NULL, RSRC_CONF, 
+                  "Max http requests of the watchdogs in flight, in total and optionally per host."),
+    AP_INIT_TAKE1("MDJobSaveInterval", md_config_set_job_save_interval, NULL, RSRC_CONF, 
+                  "How often changes of running jobs are written to the store, or 'off'."),
+    AP_INIT_TAKE1("MDFallbackCertificates", md_config_set_fallback_mode, NULL, RSRC_CONF, 
+                  "How fallback certificates are made: individual, shared or common."),
+    AP_INIT_TAKE1("MDRenewSpread", md_config_set_renew_spread, NULL, RSRC_CONF, 
+                  "Spread renewals over the first part of the renew window, or 'off'."),
+    AP_INIT_TAKE1("MDRenewBatch", md_config_set_renew_batch, NULL, RSRC_CONF, 
+                  "Renew certificates due within a duration together with one due now at "
+                  "the same CA, or 'off'."),
+    AP_INIT_TAKE12("MDStoreLease", md_config_set_store_lease, NULL, RSRC_CONF, 
+                  "How long a server holds a lease on renewals in a shared store, or 'off', "
+                  "and optionally its name."),
+    AP_INIT_TAKE123("MDNotifyBatch", md_config_set_notify_batch, NULL, RSRC_CONF, 
+                  "Collect notifications for a duration and run MDNotifyCmd/MDMessageCmd once "
+                  "for them, or 'off'. Optionally, the timeout of the commands and how many may "
+                  "run at once."),
 
     AP_INIT_TAKE1(NULL, NULL, NULL, RSRC_CONF, NULL)
 };
@@ -1045,6 +1559,17 @@ apr_status_t md_config_post_config(server_rec *s, apr_pool_t *p)
     }
 #endif
     
+    if (mc->store_lease > 0 && !mc->store_lease_holder) {
+        char *hostname = apr_pcalloc(p, APRMAXHOSTLEN + 1);
+        
+        if (APR_SUCCESS != apr_gethostname(hostname, APRMAXHOSTLEN + 1, p) || !*hostname) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, APLOGNO(10221)
+                         "MDStoreLease: unable to get the hostname, please configure "
+                         "a name for this server");
+            return APR_EGENERAL;
+        }
+        mc->store_lease_holder = hostname;
+    }
     return APR_SUCCESS;
 }
 
@@ -41,6 +41,12 @@ typedef enum {
     MD_CONFIG_STAPLE_OTHERS,
 } md_config_var_t;
 
+typedef enum {
+    MD_FALLBACK_INDIVIDUAL,             /* own key and certificate per MD, made at start */
+    MD_FALLBACK_SHARED,                 /* shared key, certificate per MD made at start */
+    MD_FALLBACK_COMMON,                 /* shared key and one certificate for all MDs */
+} md_fallback_mode_t;
+
 typedef struct md_mod_conf_t md_mod_conf_t;
 struct md_mod_conf_t {
     apr_array_header_t *mds;           /* all md_t* defined in the config, shared */
@@ -58,6 +64,7 @@ struct md_mod_conf_t {
     const char *hsts_header;           /* computed HTST header to use or NULL */
     apr_array_header_t *unused_names;  /* post config, names of all MDs not assigned to a vhost */
     struct apr_hash_t *init_errors;    /* init errors reported with MD name as key */
+    struct apr_hash_t *fallbacks;      /* names of MDs whose fallback files are known to exist */
 
     const char *notify_cmd;            /* notification command to execute on signup/renew */
     const char *message_cmd;           /* message command to execute on signup/renew/warnings */
@@ -69,6 +76,36 @@ struct md_mod_conf_t {
     md_timeslice_t *ocsp_renew_window; /* time before exp. that we start renewing ocsp resp. */
     const char *cert_check_name;       /* name of the linked certificate check site */
     const char *cert_check_url;        /* url "template for" checking a certificate */
+    int ocsp_shared_cache;             /* share OCSP responses between children via shm */
+    int ocsp_batch_size;               /* max certificates in a single OCSP request */
+    int ocsp_parallel;                 /* max parallel OCSP requests in total */
+    int ocsp_parallel_responder;       /* max parallel OCSP requests to one responder */
+    int ocsp_renew_spread;             /* md_ocsp_spread_t of OCSP renewals */
+    int ocsp_use_get;                  /* use RFC 5019 GET requests for OCSP */
+    struct md_challenge_cache_t *challenge_cache; /* challenges answered by this child */
+    md_index_t *mds_index;             /* lookup of mds by name/domain, once they are final */
+    int cert_load_threads;             /* threads loading certificates at startup */
+    const char *store_dbm_type;        /* apr_dbm type for challenges/ocsp or NULL */
+    int renew_parallel;                /* max MDs renewed in parallel in total */
+    int renew_parallel_ca;             /* max MDs renewed in parallel at one CA */
+    int keypool_size;                  /* pre-generated keys kept per key spec, 0 disables */
+    int http_max_conns;                /* max http requests in flight in total */
+    int http_max_host_conns;           /* max http requests in flight to one host */
+    struct md_http_clients_t *http_clients; /* shared by renewal and OCSP watchdogs */
+    struct md_status_cache_t *status_cache; /* status of all mds, for the status handlers */
+    struct md_status_stock_t *status_stock; /* counts of md states in shared memory */
+    apr_interval_time_t job_save_interval; /* job changes are written behind, 0 disables */
+    int fallback_mode;                 /* md_fallback_mode_t of fallback certificates */
+    struct md_pkey_t *fallback_pkey;   /* shared key of fallback certificates, post config */
+    apr_time_t fallback_pkey_mtime;    /* modification time of the shared key file */
+    apr_interval_time_t store_lease;   /* ttl of leases on renewals/updates, 0 disables */
+    const char *store_lease_holder;    /* name of this server in leases */
+    int renew_spread;                  /* percent of the renew window renewals are spread over */
+    apr_interval_time_t notify_batch;  /* window notifications are collected in, 0 disables */
+    apr_interval_time_t notify_timeout;/* max duration of a batched notification command */
+    int notify_max_cmds;               /* max batched notification commands running at once */
+    struct md_notify_queue_t *notify_queue; /* batched notifications, in the watchdog child */
+    apr_interval_time_t renew_batch;   /* renewals due this soon join one at the same CA, 0 disables */
 };
 
 typedef struct md_srv_conf_t {
@@ -87,7 +124,7 @@ typedef struct md_srv_conf_t {
     const char *ca_url;                /* url of CA certificate service */
     const char *ca_proto;              /* protocol used vs CA (e.g. ACME) */
     const char *ca_agreement;          /* accepted agreement uri between CA and user */ 
-    struct apr_array_header_t *ca_challenges; /* challenge types configured */
+    struct apr_array_header_t *ca_challenges; /* challenge types configured, never modified */
     
     int stapling;                      /* OCSP stapling enabled */
     int staple_others;                 /* Provide OCSP stapling for non-MD certificates */
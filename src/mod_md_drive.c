@@ -19,6 +19,9 @@
 #include <apr_hash.h>
 #include <apr_strings.h>
 #include <apr_date.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
 
 #include <httpd.h>
 #include <http_core.h>
@@ -33,6 +36,7 @@
 #include "md_crypt.h"
 #include "md_http.h"
 #include "md_json.h"
+#include "md_keypool.h"
 #include "md_status.h"
 #include "md_store.h"
 #include "md_store_fs.h"
@@ -55,10 +59,22 @@
 
 #define MD_RENEW_WATCHDOG_NAME   "_md_renew_"
 
+/* pause between watchdog runs that refill the key pool */
+#define MD_KEYPOOL_FILL_PAUSE    apr_time_from_sec(1)
+
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *wd_set_interval;
 
+/* A job in the schedule of the watchdog, due at 'at'. */
+typedef struct {
+    md_job_t *job;
+    const md_t *md;
+    apr_time_t at;
+    int heap_idx;          /* position in dctx->schedule */
+    apr_time_t renew_by;   /* renewing this early is ok in the current run, 0 when due */
+} drive_sched_t;
+
 struct md_renew_ctx_t {
     apr_pool_t *p;
     server_rec *s;
@@ -66,15 +82,32 @@ struct md_renew_ctx_t {
     ap_watchdog_t *watchdog;
     
     apr_array_header_t *jobs;
+    apr_array_header_t *entries;       /* drive_sched_t, one for each job */
+    apr_array_header_t *schedule;      /* drive_sched_t* as min-heap on 'at' */
+    apr_time_t regular_at;             /* next run for jobs without a next_run of their own */
+#if APR_HAS_THREADS
+    apr_thread_t *flusher;             /* writes job changes behind, see md_job_save_later() */
+    apr_pool_t *flush_pool;
+    apr_thread_mutex_t *flush_mutex;
+    apr_thread_cond_t *flush_cond;
+    int flush_stop;
+#endif
 };
 
-static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *ptemp)
+static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_time_t renew_by,
+                              apr_pool_t *ptemp)
 {
-    const md_t *md;
+    const md_t *md = NULL;
     md_result_t *result = NULL;
+    md_store_t *store;
+    apr_time_t renew_at, until;
     apr_status_t rv;
+    int leased = 0;
     
-    md_job_load(job);
+    /* A job joining a batch renews a certificate whose renew window starts at renew_by */
+    until = apr_time_now();
+    if (renew_by > until) until = renew_by;
+    md_job_refresh(job);
     /* Evaluate again on loaded value. Values will change when watchdog switches child process */
     if (apr_time_now() < job->next_run) return;
     
@@ -84,7 +117,8 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
         goto leave;
     }
     
-    md = md_get_by_name(dctx->mc->mds, job->mdomain);
+    md = dctx->mc->mds_index? md_index_get_by_name(dctx->mc->mds_index, job->mdomain)
+        : md_get_by_name(dctx->mc->mds, job->mdomain);
     AP_DEBUG_ASSERT(md);
 
     result = md_result_md_make(ptemp, md->name);
@@ -107,16 +141,52 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
         ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10052) 
                      "md(%s): state=%d, driving", job->mdomain, md->state);
 
-        if (!md_reg_should_renew(dctx->mc->reg, md, dctx->p)) {
+        renew_at = md_reg_renew_at(dctx->mc->reg, md, ptemp);
+        if (!renew_at || renew_at > until) {
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10053) 
                          "md(%s): no need to renew", job->mdomain);
             goto expiry;
         }
     
-        md_job_start_run(job, result, md_reg_store_get(dctx->mc->reg)); 
+        store = md_reg_store_get(dctx->mc->reg);
+        if (dctx->mc->store_lease > 0) {
+            /* Servers sharing the store take turns, the lease holder drives the renewal. 
+             * It is kept while the CA is working on it and renewed in the next run. */
+            rv = md_store_lease(store, ptemp, MD_SG_STAGING, md->name, 
+                                dctx->mc->store_lease_holder, dctx->mc->store_lease);
+            if (APR_STATUS_IS_EBUSY(rv)) {
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10222) 
+                             "md(%s): renewal is driven by another server", job->mdomain);
+                md_job_retry_at(job, apr_time_now() + dctx->mc->store_lease / 2);
+                goto leave;
+            }
+            else if (APR_SUCCESS != rv) {
+                ap_log_error( APLOG_MARK, APLOG_WARNING, rv, dctx->s, APLOGNO(10223) 
+                             "md(%s): unable to get a lease on the renewal, continuing "
+                             "without", job->mdomain);
+            }
+            leased = (APR_SUCCESS == rv);
+            
+            renew_at = md_reg_store_renew_at(dctx->mc->reg, md, ptemp);
+            if (renew_at > until) {
+                ap_log_error( APLOG_MARK, APLOG_NOTICE, 0, dctx->s, APLOGNO(10224) 
+                             "md(%s): has been renewed by another server, the new "
+                             "certificate is used after the next graceful restart", 
+                             job->mdomain);
+                md_job_retry_at(job, renew_at);
+                goto leave;
+            }
+        }
+        
+        md_job_start_run(job, result, store); 
         md_reg_renew(dctx->mc->reg, md, dctx->mc->env, 0, result, ptemp);
         md_job_end_run(job, result);
         
+        if (leased && !APR_STATUS_IS_EAGAIN(result->status)) {
+            md_store_release(store, ptemp, MD_SG_STAGING, md->name, dctx->mc->store_lease_holder);
+        }
+        leased = 0;
+        
         if (APR_SUCCESS == result->status) {
             /* Finished jobs might take a while before the results become valid.
              * If that is in the future, request to run then */
@@ -127,6 +197,12 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
             
             if (!job->notified) md_job_notify(job, "renewed", result);
         }
+        else if (APR_STATUS_IS_EAGAIN(result->status)) {
+            /* The CA is still working on it, we continue later where we left */
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10213) 
+                         "md(%s): %s", job->mdomain, result->detail);
+            goto leave;
+        }
         else {
             ap_log_error( APLOG_MARK, APLOG_ERR, result->status, dctx->s, APLOGNO(10056) 
                          "processing %s: %s", job->mdomain, result->detail);
@@ -140,7 +216,7 @@ static void process_drive_job(md_renew_ctx_t *dctx, md_job_t *job, apr_pool_t *p
     }
 
 expiry:
-    if (!job->finished && md_reg_should_warn(dctx->mc->reg, md, dctx->p)) {
+    if (!job->finished && md_reg_should_warn(dctx->mc->reg, md, ptemp)) {
         ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, dctx->s,
                      "md(%s): warn about expiration", md->name);
         md_job_start_run(job, result, md_reg_store_get(dctx->mc->reg));
@@ -151,6 +227,10 @@ expiry:
     }
 
 leave:
+    if (leased) {
+        md_store_release(md_reg_store_get(dctx->mc->reg), ptemp, MD_SG_STAGING, md->name, 
+                         dctx->mc->store_lease_holder);
+    }
     if (job->dirty && result) {
         rv = md_job_save(job, result, ptemp);
         ap_log_error(APLOG_MARK, APLOG_TRACE1, rv, dctx->s, "%s: saving job props", job->mdomain);
@@ -174,12 +254,378 @@ static apr_time_t next_run_default(void)
     return apr_time_now() + apr_time_from_sec(MD_SECS_PER_DAY / 2);
 }
 
+/**************************************************************************************************/
+/* schedule */
+
+/* The jobs are kept in a min-heap on the time they are due next, so that a run
+ * only looks at the jobs due and finds the time of the next run at the top. */
+#define SCHED_AT(dctx, i)    APR_ARRAY_IDX((dctx)->schedule, (i), drive_sched_t*)
+
+static void sched_swap(md_renew_ctx_t *dctx, int i, int j)
+{
+    drive_sched_t *e = SCHED_AT(dctx, i);
+    
+    SCHED_AT(dctx, i) = SCHED_AT(dctx, j);
+    SCHED_AT(dctx, i)->heap_idx = i;
+    SCHED_AT(dctx, j) = e;
+    e->heap_idx = j;
+}
+
+static void sched_up(md_renew_ctx_t *dctx, int i)
+{
+    int parent;
+    
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (SCHED_AT(dctx, parent)->at <= SCHED_AT(dctx, i)->at) break;
+        sched_swap(dctx, i, parent);
+        i = parent;
+    }
+}
+
+static void sched_down(md_renew_ctx_t *dctx, int i)
+{
+    int child, n = dctx->schedule->nelts;
+    
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && SCHED_AT(dctx, child + 1)->at < SCHED_AT(dctx, child)->at) {
+            ++child;
+        }
+        if (SCHED_AT(dctx, i)->at <= SCHED_AT(dctx, child)->at) break;
+        sched_swap(dctx, i, child);
+        i = child;
+    }
+}
+
+static apr_time_t sched_time(md_renew_ctx_t *dctx, drive_sched_t *e, apr_pool_t *ptemp)
+{
+    apr_time_t at, renew_at;
+    
+    if (e->job->next_run) return e->job->next_run;
+    at = dctx->regular_at;
+    /* A certificate entering its renewal window does not wait for the regular run */
+    if (e->md && md_will_renew_cert(e->md)) {
+        renew_at = md_reg_renew_at(dctx->mc->reg, e->md, ptemp);
+        if (renew_at > apr_time_now() && renew_at < at) at = renew_at;
+    }
+    return at;
+}
+
+static void sched_update(md_renew_ctx_t *dctx, drive_sched_t *e, apr_pool_t *ptemp)
+{
+    apr_time_t old_at = e->at;
+    
+    e->at = sched_time(dctx, e, ptemp);
+    if (e->at < old_at) sched_up(dctx, e->heap_idx);
+    else sched_down(dctx, e->heap_idx);
+}
+
+static void sched_build(md_renew_ctx_t *dctx, apr_pool_t *ptemp)
+{
+    drive_sched_t *e;
+    int i;
+    
+    /* Jobs may have changed in the store, e.g. by the watchdog of a 
+     * previous child process. */
+    apr_array_clear(dctx->schedule);
+    for (i = 0; i < dctx->entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(dctx->entries, i, drive_sched_t);
+        md_job_refresh(e->job);
+        e->at = sched_time(dctx, e, ptemp);
+        e->heap_idx = dctx->schedule->nelts;
+        APR_ARRAY_PUSH(dctx->schedule, drive_sched_t*) = e;
+        sched_up(dctx, e->heap_idx);
+    }
+}
+
+static void sched_collect(md_renew_ctx_t *dctx, int i, apr_time_t now, apr_array_header_t *due)
+{
+    drive_sched_t *e;
+    
+    /* Visit the schedule top down, only subtrees where something is due */
+    if (i >= dctx->schedule->nelts) return;
+    e = SCHED_AT(dctx, i);
+    if (e->at > now) return;
+    e->renew_by = 0;
+    APR_ARRAY_PUSH(due, drive_sched_t*) = e;
+    sched_collect(dctx, 2 * i + 1, now, due);
+    sched_collect(dctx, 2 * i + 2, now, due);
+}
+
+static void sched_batch(md_renew_ctx_t *dctx, apr_time_t now, apr_array_header_t *due, 
+                        apr_pool_t *ptemp)
+{
+    apr_hash_t *cas;
+    drive_sched_t *e;
+    apr_time_t until, renew_at;
+    int i, ndue;
+    
+    /* With MDRenewBatch, MDs whose renew window starts soon are renewed in the run
+     * that renews another MD at the same CA. Their orders are driven together, against
+     * a CA directory and account set up only once, instead of each in a run of its own. */
+    if (dctx->mc->renew_batch <= 0 || due->nelts <= 0) return;
+    cas = apr_hash_make(ptemp);
+    for (i = 0; i < due->nelts; ++i) {
+        e = APR_ARRAY_IDX(due, i, drive_sched_t*);
+        if (e->md && e->md->ca_url && md_will_renew_cert(e->md)
+            && md_reg_should_renew(dctx->mc->reg, e->md, ptemp)) {
+            apr_hash_set(cas, e->md->ca_url, APR_HASH_KEY_STRING, e->md->ca_url);
+        }
+    }
+    if (!apr_hash_count(cas)) return;
+    
+    until = now + dctx->mc->renew_batch;
+    ndue = due->nelts;
+    for (i = 0; i < dctx->entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(dctx->entries, i, drive_sched_t);
+        /* not the ones already due, retrying later or waiting for a restart */
+        if (e->at <= now || e->job->next_run || e->job->finished
+            || !e->md || !e->md->ca_url || !md_will_renew_cert(e->md)
+            || !apr_hash_get(cas, e->md->ca_url, APR_HASH_KEY_STRING)) continue;
+        renew_at = md_reg_renew_at(dctx->mc->reg, e->md, ptemp);
+        if (renew_at && renew_at <= until) {
+            e->renew_by = renew_at;
+            APR_ARRAY_PUSH(due, drive_sched_t*) = e;
+        }
+    }
+    if (due->nelts > ndue) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10229)
+                     "renewing %d mds ahead of time, together with others at the same CA",
+                     due->nelts - ndue);
+    }
+}
+
+/* Jobs due in a watchdog run, driven by a number of worker threads. Each job has its
+ * own pool and allocator, so that workers do not share any pool. */
+typedef struct {
+    md_job_t *job;
+    apr_time_t renew_by;
+    const char *ca;        /* url of the CA the job talks to, "" if none */
+    int leader;            /* runs before the other jobs at the same CA */
+    int started;
+} drive_item_t;
+
+typedef struct {
+    int running;           /* number of jobs being driven against the CA */
+    int leading;           /* != 0 while its leader has not finished */
+} drive_ca_t;
+
+typedef struct {
+    md_renew_ctx_t *dctx;
+    drive_item_t *items;
+    int nitems;
+    int next;              /* all items before this one have been started */
+    apr_hash_t *cas;       /* CA url -> drive_ca_t */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+} drive_batch_t;
+
+#if APR_HAS_THREADS
+static drive_item_t *batch_next(drive_batch_t *b)
+{
+    drive_item_t *item;
+    drive_ca_t *ca;
+    int i, open;
+    
+    /* Called with the mutex held. Waits while all remaining jobs talk to CAs
+     * that are already at their limit, or whose leader has not finished yet.
+     * Returns NULL when all have started. */
+    for (;;) {
+        while (b->next < b->nitems && b->items[b->next].started) ++b->next;
+        open = 0;
+        for (i = b->next; i < b->nitems; ++i) {
+            item = &b->items[i];
+            if (item->started) continue;
+            open = 1;
+            ca = apr_hash_get(b->cas, item->ca, APR_HASH_KEY_STRING);
+            if (ca->leading && !item->leader) continue;
+            if (ca->running < b->dctx->mc->renew_parallel_ca) {
+                ++ca->running;
+                item->started = 1;
+                return item;
+            }
+        }
+        if (!open) return NULL;
+        apr_thread_cond_wait(b->cond, b->mutex);
+    }
+}
+
+static void batch_run(drive_batch_t *b)
+{
+    drive_item_t *item;
+    drive_ca_t *ca;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    apr_thread_mutex_lock(b->mutex);
+    while ((item = batch_next(b))) {
+        apr_thread_mutex_unlock(b->mutex);
+        if (APR_SUCCESS == (rv = apr_pool_create(&ptemp, item->job->p))) {
+            apr_pool_tag(ptemp, "md_renew_job");
+            process_drive_job(b->dctx, item->job, item->renew_by, ptemp);
+            apr_pool_destroy(ptemp);
+        }
+        else {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, b->dctx->s, APLOGNO(10210) 
+                         "md(%s): create pool to drive job", item->job->mdomain);
+        }
+        apr_thread_mutex_lock(b->mutex);
+        ca = apr_hash_get(b->cas, item->ca, APR_HASH_KEY_STRING);
+        --ca->running;
+        if (item->leader) ca->leading = 0;
+        apr_thread_cond_broadcast(b->cond);
+    }
+    apr_thread_mutex_unlock(b->mutex);
+}
+
+static void * APR_THREAD_FUNC drive_worker(apr_thread_t *thread, void *data)
+{
+    batch_run(data);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t process_drive_jobs(md_renew_ctx_t *dctx, apr_array_header_t *due, 
+                                       apr_pool_t *ptemp)
+{
+    drive_batch_t b;
+    drive_item_t *item;
+    drive_sched_t *e;
+    drive_ca_t *ca;
+    apr_thread_t **workers;
+    apr_status_t rv, trv;
+    int i, threads, started = 0;
+    
+    memset(&b, 0, sizeof(b));
+    b.dctx = dctx;
+    b.nitems = due->nelts;
+    b.items = apr_pcalloc(ptemp, sizeof(drive_item_t) * (apr_size_t)b.nitems);
+    b.cas = apr_hash_make(ptemp);
+    for (i = 0; i < b.nitems; ++i) {
+        item = &b.items[i];
+        e = APR_ARRAY_IDX(due, i, drive_sched_t*);
+        item->job = e->job;
+        item->renew_by = e->renew_by;
+        item->ca = (e->md && e->md->ca_url)? e->md->ca_url : "";
+        /* all CAs exist before the workers start, they only change values */
+        if (!(ca = apr_hash_get(b.cas, item->ca, APR_HASH_KEY_STRING))) {
+            ca = apr_pcalloc(ptemp, sizeof(*ca));
+            apr_hash_set(b.cas, item->ca, APR_HASH_KEY_STRING, ca);
+            /* In a batch, the first job at a CA sets up the account and caches the
+             * directory in the store. The other jobs then only place their orders. */
+            if (dctx->mc->renew_batch > 0 && *item->ca) {
+                item->leader = ca->leading = 1;
+            }
+        }
+    }
+    
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&b.mutex, APR_THREAD_MUTEX_DEFAULT, ptemp))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&b.cond, ptemp))) {
+        return rv;
+    }
+    
+    threads = (dctx->mc->renew_parallel < b.nitems)? dctx->mc->renew_parallel : b.nitems;
+    workers = apr_pcalloc(ptemp, sizeof(apr_thread_t*) * (apr_size_t)threads);
+    for (i = 0; i < threads; ++i) {
+        if (APR_SUCCESS != (rv = apr_thread_create(&workers[i], NULL, drive_worker, &b, ptemp))) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, rv, dctx->s, APLOGNO(10211)
+                         "renew jobs: started %d of %d threads", started, threads);
+            break;
+        }
+        ++started;
+    }
+    if (started < 1) batch_run(&b);
+    for (i = 0; i < started; ++i) {
+        apr_thread_join(&trv, workers[i]);
+    }
+    return APR_SUCCESS;
+}
+#endif /* APR_HAS_THREADS */
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC flush_worker(apr_thread_t *thread, void *data)
+{
+    md_renew_ctx_t *dctx = data;
+    
+    apr_thread_mutex_lock(dctx->flush_mutex);
+    while (!dctx->flush_stop) {
+        apr_thread_cond_timedwait(dctx->flush_cond, dctx->flush_mutex, 
+                                  dctx->mc->job_save_interval);
+        apr_thread_mutex_unlock(dctx->flush_mutex);
+        md_job_write_behind_flush(dctx->flush_pool);
+        apr_pool_clear(dctx->flush_pool);
+        apr_thread_mutex_lock(dctx->flush_mutex);
+    }
+    apr_thread_mutex_unlock(dctx->flush_mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static void flusher_start(md_renew_ctx_t *dctx)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    if (dctx->flusher || dctx->mc->job_save_interval <= 0) return;
+    if (!dctx->flush_mutex) {
+        /* The flusher thread uses its pool while the watchdog thread uses dctx->p,
+         * so it needs an allocator of its own. */
+        if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) goto leave;
+        apr_allocator_max_free_set(allocator, 1);
+        if (APR_SUCCESS != (rv = apr_pool_create_ex(&dctx->flush_pool, dctx->p, NULL, allocator))) {
+            apr_allocator_destroy(allocator);
+            dctx->flush_pool = NULL;
+            goto leave;
+        }
+        apr_allocator_owner_set(allocator, dctx->flush_pool);
+        if (APR_SUCCESS != (rv = apr_thread_mutex_create(&dctx->flush_mutex, 
+                                                            APR_THREAD_MUTEX_DEFAULT, dctx->p))
+            || APR_SUCCESS != (rv = apr_thread_cond_create(&dctx->flush_cond, dctx->p))) {
+            goto leave;
+        }
+        apr_pool_tag(dctx->flush_pool, "md_job_flush");
+    }
+    if (APR_SUCCESS != (rv = md_job_write_behind_start(dctx->p))) goto leave;
+    dctx->flush_stop = 0;
+    if (APR_SUCCESS != (rv = apr_thread_create(&dctx->flusher, NULL, flush_worker, 
+                                               dctx, dctx->p))) {
+        dctx->flusher = NULL;
+        md_job_write_behind_stop(dctx->flush_pool);
+    }
+leave:
+    if (APR_SUCCESS != rv) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, dctx->s, APLOGNO(10217)
+                     "job changes are not written behind, saving them directly");
+    }
+}
+
+static void flusher_stop(md_renew_ctx_t *dctx)
+{
+    apr_status_t trv;
+    
+    if (!dctx->flusher) return;
+    apr_thread_mutex_lock(dctx->flush_mutex);
+    dctx->flush_stop = 1;
+    apr_thread_cond_signal(dctx->flush_cond);
+    apr_thread_mutex_unlock(dctx->flush_mutex);
+    apr_thread_join(&trv, dctx->flusher);
+    dctx->flusher = NULL;
+    md_job_write_behind_stop(dctx->flush_pool);
+    apr_pool_clear(dctx->flush_pool);
+}
+#endif /* APR_HAS_THREADS */
+
 static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
 {
     md_renew_ctx_t *dctx = baton;
-    md_job_t *job;
-    apr_time_t next_run, wait_time;
-    int i;
+    md_keypool_t *keypool;
+    apr_array_header_t *due;
+    drive_sched_t *e;
+    apr_time_t now, next_run, wait_time;
+    apr_status_t rv;
+    int i, ndue;
     
     /* mod_watchdog invoked us as a single thread inside the whole server (on this machine).
      * This might be a repeated run inside the same child (mod_watchdog keeps affinity as
@@ -189,26 +635,66 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         case AP_WATCHDOG_STATE_STARTING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10054)
                          "md watchdog start, auto drive %d mds", dctx->jobs->nelts);
+            /* a previous watchdog, maybe in another child, might have changed the pool */
+            if ((keypool = md_reg_keypool_get(dctx->mc->reg))) md_keypool_sync(keypool);
+            /* all jobs take part in the first run */
+            dctx->regular_at = apr_time_now();
+            sched_build(dctx, ptemp);
+#if APR_HAS_THREADS
+            flusher_start(dctx);
+#endif
             break;
             
         case AP_WATCHDOG_STATE_RUNNING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10055)
                          "md watchdog run, auto drive %d mds", dctx->jobs->nelts);
                          
-            /* Process all drive jobs. They will update their next_run property
-             * and we schedule ourself at the earliest of all. A job may specify 0
-             * as next_run to indicate that it wants to participate in the normal
-             * regular runs. */
+            /* Process the drive jobs that are due. They will update their next_run 
+             * property and we schedule ourself at the earliest of all. A job may 
+             * specify 0 as next_run to indicate that it wants to participate in the 
+             * normal regular runs, or in the run when its renewal window starts.
+             * With MDRenewParallel, due jobs of independent MDs are driven by
+             * several threads, each job being driven by only one of them. 
+             * With MDRenewBatch, jobs becoming due soon join in. */
+            now = apr_time_now();
+            if (now >= dctx->regular_at) dctx->regular_at = next_run_default();
+            due = apr_array_make(ptemp, 10, sizeof(drive_sched_t *));
+            sched_collect(dctx, 0, now, due);
+            sched_batch(dctx, now, due, ptemp);
+            ndue = due->nelts;
+            i = 0;
+#if APR_HAS_THREADS
+            if (dctx->mc->renew_parallel > 1 && due->nelts > 1 
+                && APR_SUCCESS == process_drive_jobs(dctx, due, ptemp)) {
+                i = due->nelts;
+            }
+#endif
+            for (; i < due->nelts; ++i) {
+                e = APR_ARRAY_IDX(due, i, drive_sched_t*);
+                process_drive_job(dctx, e->job, e->renew_by, ptemp);
+            }
+            
+            for (i = 0; i < due->nelts; ++i) {
+                sched_update(dctx, APR_ARRAY_IDX(due, i, drive_sched_t*), ptemp);
+            }
             next_run = next_run_default();
-            for (i = 0; i < dctx->jobs->nelts; ++i) {
-                job = APR_ARRAY_IDX(dctx->jobs, i, md_job_t *);
-                
-                if (apr_time_now() >= job->next_run) {
-                    process_drive_job(dctx, job, ptemp);
+            if (dctx->schedule->nelts > 0 && SCHED_AT(dctx, 0)->at < next_run) {
+                next_run = SCHED_AT(dctx, 0)->at;
+            }
+            
+            /* Refill the key pool when there was nothing else to do, one key
+             * per run, so that renewals becoming due are not delayed by it. */
+            keypool = md_reg_keypool_get(dctx->mc->reg);
+            if (keypool && md_keypool_missing(keypool) > 0) {
+                rv = ndue? APR_EAGAIN : md_keypool_fill(keypool, 1, ptemp);
+                if (APR_STATUS_IS_EAGAIN(rv)) {
+                    if (apr_time_now() + MD_KEYPOOL_FILL_PAUSE < next_run) {
+                        next_run = apr_time_now() + MD_KEYPOOL_FILL_PAUSE;
+                    }
                 }
-                
-                if (job->next_run && job->next_run < next_run) {
-                    next_run = job->next_run;
+                else if (APR_SUCCESS != rv) {
+                    ap_log_error(APLOG_MARK, APLOG_WARNING, rv, dctx->s, APLOGNO(10215)
+                                 "generating keys for the private key pool");
                 }
             }
 
@@ -223,6 +709,9 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
         case AP_WATCHDOG_STATE_STOPPING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, dctx->s, APLOGNO(10058)
                          "md watchdog stopping");
+#if APR_HAS_THREADS
+            flusher_stop(dctx);
+#endif
             break;
     }
     
@@ -233,10 +722,11 @@ apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_
 {
     apr_allocator_t *allocator;
     md_renew_ctx_t *dctx;
-    apr_pool_t *dctxp;
+    apr_pool_t *dctxp, *jobp;
     apr_status_t rv;
     md_t *md;
     md_job_t *job;
+    drive_sched_t *entry;
     int i;
     
     /* We use mod_watchdog to run a single thread in one of the child processes
@@ -287,17 +777,44 @@ apr_status_t md_renew_start_watching(md_mod_conf_t *mc, server_rec *s, apr_pool_
     dctx->s = s;
     dctx->mc = mc;
     
+    /* Renewals return to us while the CA validates challenges or issues the
+     * certificate, so that the other jobs are driven in the meantime. */
+    md_reg_set_nonblocking(mc->reg, 1);
+    
     dctx->jobs = apr_array_make(dctx->p, mc->mds->nelts, sizeof(md_job_t *));
+    dctx->entries = apr_array_make(dctx->p, mc->mds->nelts, sizeof(drive_sched_t));
+    dctx->schedule = apr_array_make(dctx->p, mc->mds->nelts, sizeof(drive_sched_t *));
     for (i = 0; i < mc->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(mc->mds, i, md_t*);
         if (!md || !md->watched) continue;
         
-        job = md_reg_job_make(mc->reg, md->name, p);
+        /* Each job gets its own allocator, so that it can be driven by any of
+         * the renew threads without locking. */
+        apr_allocator_create(&allocator);
+        apr_allocator_max_free_set(allocator, 1);
+        rv = apr_pool_create_ex(&jobp, dctx->p, NULL, allocator);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO(10212) 
+                         "md(%s): create drive job pool", md->name);
+            apr_allocator_destroy(allocator);
+            apr_pool_destroy(dctx->p);
+            return rv;
+        }
+        apr_allocator_owner_set(allocator, jobp);
+        apr_pool_tag(jobp, "md_renew_job");
+        
+        job = md_reg_job_make(mc->reg, md->name, jobp);
         APR_ARRAY_PUSH(dctx->jobs, md_job_t*) = job;
+        entry = (drive_sched_t*)apr_array_push(dctx->entries);
+        entry->job = job;
+        entry->md = md;
+        entry->at = 0;
+        entry->heap_idx = -1;
+        entry->renew_by = 0;
         ap_log_error( APLOG_MARK, APLOG_TRACE1, 0, dctx->s,  
                      "md(%s): state=%d, created drive job", md->name, md->state);
         
-        md_job_load(job);
+        md_job_refresh(job);
         if (job->error_runs) {
             /* Server has just restarted. If we encounter an MD job with errors
              * on a previous driving, we purge its STAGING area.
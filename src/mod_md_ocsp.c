@@ -62,7 +62,7 @@ apr_status_t md_ocsp_init_stapling_status(server_rec *s, apr_pool_t *p,
     sc = md_config_get(s);
     if (!staple_here(sc)) goto declined;
 
-    md = ((sc->assigned || sc->assigned->nelts == 1)?
+    md = ((sc->assigned && sc->assigned->nelts == 1)?
           APR_ARRAY_IDX(sc->assigned, 0, const md_t*) : NULL);
     rv = md_ocsp_prime(sc->mc->ocsp, md_cert_wrap(p, cert), 
                        md_cert_wrap(p, issuer), md);
@@ -75,6 +75,47 @@ declined:
     return DECLINED;
 }
 
+int md_borrow_stapling_status(const unsigned char **pder, int *pderlen, void **ptoken,
+                              conn_rec *c, server_rec *s, X509 *cert)
+{
+    md_srv_conf_t *sc;
+    const md_t *md;
+    md_ocsp_staple_t *staple;
+    apr_status_t rv;
+    
+    *ptoken = NULL;
+    sc = md_config_get(s);
+    if (!staple_here(sc)) goto declined;
+    
+    md = ((sc->assigned && sc->assigned->nelts == 1)?
+          APR_ARRAY_IDX(sc->assigned, 0, const md_t*) : NULL);
+    ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c, "borrow stapling for: %s", 
+                  md? md->name : s->server_hostname);
+    rv = md_ocsp_staple_get(&staple, pder, pderlen, sc->mc->ocsp, 
+                            md_cert_wrap(c->pool, cert), c->pool, md);
+    if (APR_SUCCESS != rv) {
+        /* the hook answers OK or DECLINED, never an apr status */
+        if (!APR_STATUS_IS_ENOENT(rv)) {
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, rv, c, APLOGNO(10230) 
+                          "borrow stapling for: %s", md? md->name : s->server_hostname);
+        }
+        md_ocsp_staple_release(staple);
+        *pder = NULL;
+        *pderlen = 0;
+        goto declined;
+    }
+    *ptoken = staple;
+    return OK;
+    
+declined:
+    return DECLINED;
+}
+
+void md_release_stapling_status(void *token)
+{
+    md_ocsp_staple_release(token);
+}
+
 apr_status_t md_ocsp_get_stapling_status(unsigned char **pder, int *pderlen, 
                                          conn_rec *c, server_rec *s, X509 *cert)
 {
@@ -85,7 +126,7 @@ apr_status_t md_ocsp_get_stapling_status(unsigned char **pder, int *pderlen,
     sc = md_config_get(s);
     if (!staple_here(sc)) goto declined;
     
-    md = ((sc->assigned || sc->assigned->nelts == 1)?
+    md = ((sc->assigned && sc->assigned->nelts == 1)?
           APR_ARRAY_IDX(sc->assigned, 0, const md_t*) : NULL);
     ap_log_cerror(APLOG_MARK, APLOG_TRACE2, 0, c, "get stapling for: %s", 
                   md? md->name : s->server_hostname);
@@ -23,6 +23,15 @@ apr_status_t md_ocsp_init_stapling_status(server_rec *s, apr_pool_t *p,
 
 apr_status_t md_ocsp_get_stapling_status(unsigned char **pder, int *pderlen, 
                                          conn_rec *c, server_rec *s, X509 *cert);
+
+/**
+ * Variant of md_ocsp_get_stapling_status() that hands out the shared response
+ * instead of a copy. Counterpart to md_release_stapling_status().
+ */
+int md_borrow_stapling_status(const unsigned char **pder, int *pderlen, void **ptoken,
+                              conn_rec *c, server_rec *s, X509 *cert);
+
+void md_release_stapling_status(void *token);
                           
 /**
  * Start watchdog for retrieving/updating ocsp status.
@@ -50,6 +50,19 @@
 #include "mod_md_drive.h"
 #include "mod_md_status.h"
 
+/* getpid for *NIX */
+#if APR_HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* getpid for Windows */
+#if APR_HAVE_PROCESS_H
+#include <process.h>
+#endif
+
 /**************************************************************************************************/
 /* Certificate status */
 
@@ -73,7 +86,8 @@ int md_http_cert_status(request_rec *r)
     /* We are looking for information about a staged certificate */
     sc = ap_get_module_config(r->server->module_config, &md_module);
     if (!sc || !sc->mc || !sc->mc->reg || !sc->mc->certificate_status_enabled) return DECLINED;
-    md = md_get_by_domain(sc->mc->mds, r->hostname);
+    md = sc->mc->mds_index? md_index_get_by_domain(sc->mc->mds_index, r->hostname)
+        : md_get_by_domain(sc->mc->mds, r->hostname);
     if (!md) return DECLINED;
 
     if (r->method_number != M_GET) {
@@ -335,7 +349,7 @@ static void print_job_summary(apr_bucket_brigade *bb, md_json_t *mdj, const char
     
     line = separator? separator : "";
 
-    if (rv != APR_SUCCESS) {
+    if (rv != APR_SUCCESS && !APR_STATUS_IS_EAGAIN(rv)) {
         s = md_json_gets(mdj, key, MD_KEY_LAST, MD_KEY_PROBLEM, NULL);
         line = apr_psprintf(bb->p, "%s Error[%s]: %s", line, 
                            apr_strerror(rv, buffer, sizeof(buffer)), s? s : "");
@@ -357,6 +371,19 @@ static void print_job_summary(apr_bucket_brigade *bb, md_json_t *mdj, const char
     
     apr_brigade_puts(bb, NULL, NULL, line);
 
+    s = md_status_timings_summary(md_json_getj(mdj, key, MD_KEY_LAST, MD_KEY_TIMINGS, NULL), 
+                                  bb->p);
+    if (s) {
+        apr_brigade_puts(bb, NULL, NULL, "\nTimings: ");
+        apr_brigade_puts(bb, NULL, NULL, ap_escape_html2(bb->p, s, 1));
+    }
+    s = md_status_phases_summary(md_json_getj(mdj, key, MD_KEY_LAST, MD_KEY_PHASES, NULL), 
+                                 bb->p);
+    if (s) {
+        apr_brigade_puts(bb, NULL, NULL, "\nPhases: ");
+        apr_brigade_puts(bb, NULL, NULL, ap_escape_html2(bb->p, s, 1));
+    }
+
     t = md_json_get_time(mdj, key, MD_KEY_NEXT_RUN, NULL);
     if (t > apr_time_now() && !finished) {
         print_time(bb, "\nNext run", t);
@@ -477,13 +504,25 @@ static int md_name_cmp(const void *v1, const void *v2)
     return strcmp((*(const md_t**)v1)->name, (*(const md_t**)v2)->name);
 }
 
+static void get_status_json(md_json_t **pjson, const md_mod_conf_t *mc, apr_pool_t *p)
+{
+    apr_array_header_t *mds;
+    
+    if (mc->status_cache 
+        && APR_SUCCESS == md_status_cache_get_json(pjson, mc->status_cache, p)) {
+        return;
+    }
+    mds = apr_array_copy(p, mc->mds);
+    qsort(mds->elts, (size_t)mds->nelts, sizeof(md_t *), md_name_cmp);
+    md_status_get_json(pjson, mds, mc->reg, mc->ocsp, p);
+}
+
 int md_domains_status_hook(request_rec *r, int flags)
 {
     const md_srv_conf_t *sc;
     const md_mod_conf_t *mc;
     int i, html;
     status_ctx ctx;
-    apr_array_header_t *mds;
     md_json_t *jstatus, *jstock;
     
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "server-status for managed domains, start");
@@ -498,14 +537,16 @@ int md_domains_status_hook(request_rec *r, int flags)
     ctx.bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     ctx.separator = " ";
 
-    mds = apr_array_copy(r->pool, mc->mds);
-    qsort(mds->elts, (size_t)mds->nelts, sizeof(md_t *), md_name_cmp);
-
     if (!html) {
         ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "no-html summary");
         apr_brigade_puts(ctx.bb, NULL, NULL, "Managed Certificates: ");
         if (mc->mds->nelts > 0) {
-            md_status_take_stock(&jstock, mds, mc->reg, r->pool);
+            if (mc->status_stock) {
+                md_status_stock_get(&jstock, mc->status_stock, r->pool);
+            }
+            else {
+                md_status_take_stock(&jstock, mc->mds, mc->reg, r->pool);
+            }
             ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "got JSON summary");
             apr_brigade_printf(ctx.bb, NULL, NULL, "total=%d, ok=%d renew=%d errored=%d ready=%d",
                                 (int)md_json_getl(jstock, MD_KEY_TOTAL, NULL), 
@@ -521,7 +562,7 @@ int md_domains_status_hook(request_rec *r, int flags)
     }
     else if (mc->mds->nelts > 0) {
         ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "html table");
-        md_status_get_json(&jstatus, mds, mc->reg, mc->ocsp, r->pool);
+        get_status_json(&jstatus, mc, r->pool);
         ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "got JSON status");
         apr_brigade_puts(ctx.bb, NULL, NULL, 
                          "<hr>\n<h3>Managed Certificates</h3>\n<table class='md_status'><thead><tr>\n");
@@ -532,6 +573,7 @@ int md_domains_status_hook(request_rec *r, int flags)
         md_json_itera(add_md_row, &ctx, jstatus, MD_KEY_MDS, NULL);
         apr_brigade_puts(ctx.bb, NULL, NULL, "</td></tr>\n</tbody>\n</table>\n");
     }
+    if (html) add_http_stats(&ctx, mc);
 
     ap_pass_brigade(r->output_filters, ctx.bb);
     apr_brigade_cleanup(ctx.bb);
@@ -574,13 +616,99 @@ static int add_ocsp_row(void *baton, apr_size_t index, md_json_t *mdj)
     return 1;
 }
 
+static int add_ocsp_bucket_header(void *baton, apr_size_t index, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    
+    (void)index;
+    if (md_json_has_key(json, MD_KEY_LE_USEC, NULL)) {
+        apr_brigade_printf(ctx->bb, NULL, NULL, "<th>&lt;%ld</th>", 
+                           md_json_getl(json, MD_KEY_LE_USEC, NULL));
+    }
+    else {
+        apr_brigade_puts(ctx->bb, NULL, NULL, "<th>longer</th>");
+    }
+    return 1;
+}
+
+static int add_ocsp_bucket(void *baton, apr_size_t index, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    
+    (void)index;
+    apr_brigade_printf(ctx->bb, NULL, NULL, "<td>%ld</td>", md_json_getl(json, MD_KEY_COUNT, NULL));
+    return 1;
+}
+
+static int add_http_host_row(void *baton, apr_size_t index, md_json_t *json)
+{
+    status_ctx *ctx = baton;
+    
+    (void)index;
+    apr_brigade_puts(ctx->bb, NULL, NULL, "<tr><td>");
+    apr_brigade_puts(ctx->bb, NULL, NULL, 
+                     ap_escape_html2(ctx->p, md_json_gets(json, MD_KEY_ENDPOINT, NULL), 1));
+    apr_brigade_printf(ctx->bb, NULL, NULL, "</td><td>%ld</td><td>%ld</td><td>%ld</td></tr>\n",
+                       md_json_getl(json, MD_KEY_IN_FLIGHT, NULL), 
+                       md_json_getl(json, MD_KEY_REQUESTS, NULL), 
+                       md_json_getl(json, MD_KEY_WAITS, NULL));
+    return 1;
+}
+
+static void add_http_stats(status_ctx *ctx, const md_mod_conf_t *mc)
+{
+    md_json_t *jstats;
+    
+    if (!mc->http_clients) return;
+    jstats = md_http_clients_stats_json(mc->http_clients, ctx->p);
+    apr_brigade_printf(ctx->bb, NULL, NULL, 
+                       "<p>HTTP clients in this child: in-flight=%ld (max %ld, limit %ld, "
+                       "per host %ld) requests=%ld waits=%ld</p>\n",
+                       md_json_getl(jstats, MD_KEY_IN_FLIGHT, NULL), 
+                       md_json_getl(jstats, MD_KEY_MAX_IN_FLIGHT, NULL), 
+                       md_json_getl(jstats, MD_KEY_MAX_CONNS, NULL), 
+                       md_json_getl(jstats, MD_KEY_MAX_HOST_CONNS, NULL), 
+                       md_json_getl(jstats, MD_KEY_REQUESTS, NULL), 
+                       md_json_getl(jstats, MD_KEY_WAITS, NULL));
+    if (md_json_has_key(jstats, MD_KEY_HOSTS, NULL)) {
+        apr_brigade_puts(ctx->bb, NULL, NULL, 
+                         "<table class='md_http_stats'><thead><tr><th>Host</th>"
+                         "<th>In flight</th><th>Requests</th><th>Waits</th></tr></thead><tbody>\n");
+        md_json_itera(add_http_host_row, ctx, jstats, MD_KEY_HOSTS, NULL);
+        apr_brigade_puts(ctx->bb, NULL, NULL, "</tbody>\n</table>\n");
+    }
+}
+
+static void add_ocsp_stats(status_ctx *ctx, const md_mod_conf_t *mc)
+{
+    md_json_t *jstats;
+    
+    md_ocsp_get_stats(&jstats, mc->ocsp, ctx->p);
+    apr_brigade_printf(ctx->bb, NULL, NULL, 
+                       "<p>Stapling lookups in this child: calls=%ld hits=%ld misses=%ld "
+                       "store-reads=%ld lock-waits=%ld</p>\n",
+                       md_json_getl(jstats, MD_KEY_CALLS, NULL), 
+                       md_json_getl(jstats, MD_KEY_HITS, NULL), 
+                       md_json_getl(jstats, MD_KEY_MISSES, NULL), 
+                       md_json_getl(jstats, MD_KEY_STORE_READS, NULL), 
+                       md_json_getl(jstats, MD_KEY_LOCK_WAITS, NULL));
+    apr_brigade_puts(ctx->bb, NULL, NULL, 
+                     "<table class='md_ocsp_stats'><thead><tr><th>usec</th>");
+    md_json_itera(add_ocsp_bucket_header, ctx, jstats, MD_KEY_LATENCY, NULL);
+    apr_brigade_puts(ctx->bb, NULL, NULL, "</tr></thead><tbody>\n<tr><td>lookup</td>");
+    md_json_itera(add_ocsp_bucket, ctx, jstats, MD_KEY_LATENCY, NULL);
+    apr_brigade_puts(ctx->bb, NULL, NULL, "</tr>\n<tr><td>lock wait</td>");
+    md_json_itera(add_ocsp_bucket, ctx, jstats, MD_KEY_LOCK_WAIT, NULL);
+    apr_brigade_puts(ctx->bb, NULL, NULL, "</tr>\n</tbody>\n</table>\n");
+}
+
 int md_ocsp_status_hook(request_rec *r, int flags)
 {
     const md_srv_conf_t *sc;
     const md_mod_conf_t *mc;
     int i, html;
     status_ctx ctx;
-    md_json_t *jstatus, *jstock;
+    md_json_t *jstock;
     
     ap_log_rerror(APLOG_MARK, APLOG_TRACE1, 0, r, "server-status for ocsp stapling, start");
     sc = ap_get_module_config(r->server->module_config, &md_module);
@@ -603,6 +731,14 @@ int md_ocsp_status_hook(request_rec *r, int flags)
                                 (int)md_json_getl(jstock, MD_KEY_GOOD, NULL), 
                                 (int)md_json_getl(jstock, MD_KEY_REVOKED, NULL), 
                                 (int)md_json_getl(jstock, MD_KEY_UNKNOWN, NULL));
+            md_ocsp_get_stats(&jstock, mc->ocsp, r->pool);
+            apr_brigade_printf(ctx.bb, NULL, NULL, "\nManaged Stapling Lookups: "
+                               "calls=%d hits=%d misses=%d store-reads=%d lock-waits=%d",
+                                (int)md_json_getl(jstock, MD_KEY_CALLS, NULL), 
+                                (int)md_json_getl(jstock, MD_KEY_HITS, NULL), 
+                                (int)md_json_getl(jstock, MD_KEY_MISSES, NULL), 
+                                (int)md_json_getl(jstock, MD_KEY_STORE_READS, NULL), 
+                                (int)md_json_getl(jstock, MD_KEY_LOCK_WAITS, NULL));
         } 
         else {
             apr_brigade_puts(ctx.bb, NULL, NULL, "[]"); 
@@ -610,15 +746,15 @@ int md_ocsp_status_hook(request_rec *r, int flags)
         apr_brigade_puts(ctx.bb, NULL, NULL, "\n"); 
     }
     else if (md_ocsp_count(mc->ocsp) > 0) {
-        md_ocsp_get_status_all(&jstatus, mc->ocsp, r->pool);
         apr_brigade_puts(ctx.bb, NULL, NULL, 
                          "<hr>\n<h3>Managed Staplings</h3>\n<table class='md_ocsp_status'><thead><tr>\n");
         for (i = 0; i < (int)(sizeof(ocsp_status_infos)/sizeof(ocsp_status_infos[0])); ++i) {
             si_add_header(&ctx, &ocsp_status_infos[i]);
         }
         apr_brigade_puts(ctx.bb, NULL, NULL, "</tr>\n</thead><tbody>");
-        md_json_itera(add_ocsp_row, &ctx, jstatus, MD_KEY_OCSPS, NULL);
+        md_ocsp_status_iter(add_ocsp_row, &ctx, mc->ocsp, r->pool);
         apr_brigade_puts(ctx.bb, NULL, NULL, "</td></tr>\n</tbody>\n</table>\n");
+        add_ocsp_stats(&ctx, mc);
     }
 
     ap_pass_brigade(r->output_filters, ctx.bb);
@@ -631,15 +767,151 @@ int md_ocsp_status_hook(request_rec *r, int flags)
 /**************************************************************************************************/
 /* Status handlers */
 
+static const char *parse_state(int *pstates, char *value)
+{
+    char *s, *last;
+    
+    for (s = apr_strtok(value, ",", &last); s; s = apr_strtok(NULL, ",", &last)) {
+        if (!strcmp("complete", s)) *pstates |= MD_STATUS_SEL_COMPLETE;
+        else if (!strcmp("renewing", s)) *pstates |= MD_STATUS_SEL_RENEWING;
+        else if (!strcmp("errored", s)) *pstates |= MD_STATUS_SEL_ERRORED;
+        else if (!strcmp("ready", s)) *pstates |= MD_STATUS_SEL_READY;
+        else return "unknown state";
+    }
+    return NULL;
+}
+
+static const char *parse_count(int *pn, const char *value)
+{
+    char *end;
+    apr_int64_t n;
+    
+    n = apr_strtoi64(value, &end, 10);
+    if (!*value || *end || n < 0 || n > APR_INT32_MAX) return "not a valid number";
+    *pn = (int)n;
+    return NULL;
+}
+
+/* Parse the query of a md-status request, e.g. 
+ * "state=renewing,errored&prefix=www.&expires=30d&sort=valid-until&limit=100" */
+static const char *parse_status_query(md_status_query_t *query, request_rec *r)
+{
+    char *args, *pair, *value, *last;
+    const char *err = NULL;
+    
+    memset(query, 0, sizeof(*query));
+    args = apr_pstrdup(r->pool, r->args);
+    for (pair = apr_strtok(args, "&", &last); pair && !err; 
+         pair = apr_strtok(NULL, "&", &last)) {
+        if (!(value = strchr(pair, '='))) return apr_psprintf(r->pool, "%s: no value", pair);
+        *value++ = '\0';
+        if (ap_unescape_url(value) != OK) return apr_psprintf(r->pool, "%s: bad value", pair);
+        
+        if (!strcmp("state", pair)) {
+            err = parse_state(&query->states, value);
+        }
+        else if (!strcmp("prefix", pair)) {
+            query->prefix = value;
+        }
+        else if (!strcmp("expires", pair)) {
+            if (APR_SUCCESS != md_duration_parse(&query->expires_within, value, "d")) {
+                err = "not a duration";
+            }
+        }
+        else if (!strcmp("sort", pair)) {
+            if (!strcmp("name", value)) query->sort = MD_STATUS_SORT_NAME;
+            else if (!strcmp("valid-until", value)) query->sort = MD_STATUS_SORT_VALID_UNTIL;
+            else if (!strcmp("renew-at", value)) query->sort = MD_STATUS_SORT_RENEW_AT;
+            else err = "unknown sort key";
+        }
+        else if (!strcmp("order", pair)) {
+            if (!strcmp("asc", value)) query->descending = 0;
+            else if (!strcmp("desc", value)) query->descending = 1;
+            else err = "must be 'asc' or 'desc'";
+        }
+        else if (!strcmp("offset", pair)) {
+            err = parse_count(&query->offset, value);
+        }
+        else if (!strcmp("limit", pair)) {
+            err = parse_count(&query->limit, value);
+        }
+        else {
+            err = "unknown parameter";
+        }
+        if (err) err = apr_psprintf(r->pool, "%s: %s", pair, err);
+    }
+    return err;
+}
+
+static apr_status_t query_status_json(md_json_t **pjson, const md_mod_conf_t *mc,
+                                      const md_status_query_t *query, apr_pool_t *p)
+{
+    md_status_cache_t *cache = mc->status_cache;
+    apr_status_t rv;
+    
+    /* without the cache of this child, use one for this request */
+    if (!cache && APR_SUCCESS != (rv = md_status_cache_create(&cache, p, mc->mds, 
+                                                              mc->reg, mc->ocsp))) {
+        return rv;
+    }
+    return md_status_cache_query(pjson, cache, query, p);
+}
+
+static apr_status_t pass_status(void *baton, apr_bucket_brigade *bb)
+{
+    request_rec *r = baton;
+    apr_status_t rv;
+    
+    rv = ap_pass_brigade(r->output_filters, bb);
+    apr_brigade_cleanup(bb);
+    return rv;
+}
+
+/* Write the status of all MDs as it is produced, without holding the whole document */
+static apr_status_t write_status_json(request_rec *r, const md_mod_conf_t *mc)
+{
+    md_json_writer_t *w;
+    md_json_t *jstats;
+    apr_array_header_t *mds;
+    apr_bucket_brigade *bb;
+    apr_status_t rv = APR_ENOENT;
+    
+    apr_table_set(r->headers_out, "Content-Type", "application/json"); 
+    bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    w = md_json_writer_create(bb, MD_JSON_FMT_INDENT, pass_status, r, r->pool);
+    md_json_writer_begin_object(w, NULL);
+    if (mc->status_cache) {
+        rv = md_status_cache_write_json(w, mc->status_cache, r->pool);
+    }
+    if (APR_SUCCESS != rv) {
+        mds = apr_array_copy(r->pool, mc->mds);
+        qsort(mds->elts, (size_t)mds->nelts, sizeof(md_t *), md_name_cmp);
+        rv = md_status_write_json(w, mds, mc->reg, mc->ocsp, r->pool);
+    }
+    if (APR_SUCCESS == rv && md_ocsp_count(mc->ocsp) > 0) {
+        md_ocsp_get_stats(&jstats, mc->ocsp, r->pool);
+        md_json_writer_begin_object(w, MD_KEY_OCSP);
+        md_json_writer_setj(w, MD_KEY_LOOKUPS, jstats);
+        md_json_writer_end_object(w);
+    }
+    if (APR_SUCCESS == rv && mc->http_clients) {
+        jstats = md_http_clients_stats_json(mc->http_clients, r->pool);
+        md_json_writer_setj(w, MD_KEY_HTTP_CLIENTS, jstats);
+    }
+    md_json_writer_end_object(w);
+    return md_json_writer_flush(w, 1);
+}
+
 int md_status_handler(request_rec *r)
 {
     const md_srv_conf_t *sc;
     const md_mod_conf_t *mc;
-    apr_array_header_t *mds;
     md_json_t *jstatus;
     apr_bucket_brigade *bb;
+    md_status_query_t query;
+    apr_status_t rv;
     const md_t *md;
-    const char *name;
+    const char *name, *err;
 
     if (strcmp(r->handler, "md-status")) {
         return DECLINED;
@@ -659,17 +931,31 @@ int md_status_handler(request_rec *r)
     md = NULL;
     if (r->path_info && r->path_info[0] == '/' && r->path_info[1] != '\0') {
         name = strrchr(r->path_info, '/') + 1;
-        md = md_get_by_name(mc->mds, name);
-        if (!md) md = md_get_by_domain(mc->mds, name);
+        if (mc->mds_index) {
+            md = md_index_get_by_name(mc->mds_index, name);
+            if (!md) md = md_index_get_by_domain(mc->mds_index, name);
+        }
+        else {
+            md = md_get_by_name(mc->mds, name);
+            if (!md) md = md_get_by_domain(mc->mds, name);
+        }
     }
     
     if (md) {
         md_status_get_md_json(&jstatus, md, mc->reg, mc->ocsp, r->pool);
     }
+    else if (r->args && *r->args) {
+        if ((err = parse_status_query(&query, r))) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "md-status query: %s", err);
+            return HTTP_BAD_REQUEST;
+        }
+        query_status_json(&jstatus, mc, &query, r->pool);
+    }
     else {
-        mds = apr_array_copy(r->pool, mc->mds);
-        qsort(mds->elts, (size_t)mds->nelts, sizeof(md_t *), md_name_cmp);
-        md_status_get_json(&jstatus, mds, mc->reg, mc->ocsp, r->pool);
+        if (APR_SUCCESS != (rv = write_status_json(r, mc))) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, rv, r, "md-status: writing status");
+        }
+        return DONE;
     }
 
     if (jstatus) {
@@ -684,3 +970,208 @@ int md_status_handler(request_rec *r)
     return DECLINED;
 }
 
+
+/**************************************************************************************************/
+/* Prometheus metrics */
+
+typedef struct {
+    apr_pool_t *p;
+    apr_bucket_brigade *bb;
+    apr_time_t now;
+    int pass;                          /* which metric the MDs are iterated for */
+} metrics_ctx;
+
+enum {
+    METRICS_EXPIRY,
+    METRICS_STATE,
+    METRICS_ERROR_RUNS,
+    METRICS_LAST_DURATION,
+    METRICS_OCSP_AGE,
+    METRICS_PASSES,
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metrics_infos[] = {
+    { "md_certificate_expiry_days", "gauge", 
+      "Days until the certificate of the domain expires." },
+    { "md_renewal_state", "gauge", 
+      "1 if the domain is in the state, as counted on the server status." },
+    { "md_renewal_error_runs", "gauge", 
+      "Failed renewal runs since the last success." },
+    { "md_renewal_last_duration_seconds", "gauge", 
+      "How long the last renewal run took." },
+    { "md_ocsp_response_age_seconds", "gauge", 
+      "Time since the stapled OCSP response was produced." },
+};
+
+static const char *metrics_label(apr_pool_t *p, const char *s)
+{
+    const char *c;
+    char *d, *buf;
+    
+    /* the text format escapes backslash, double-quote and line feed */
+    if (!strpbrk(s, "\\\"\n")) return s;
+    d = buf = apr_palloc(p, 2 * strlen(s) + 1);
+    for (c = s; *c; ++c) {
+        if (*c == '\n') {
+            *d++ = '\\';
+            *d++ = 'n';
+            continue;
+        }
+        if (*c == '\\' || *c == '"') *d++ = '\\';
+        *d++ = *c;
+    }
+    *d = '\0';
+    return buf;
+}
+
+static void metrics_header(metrics_ctx *ctx, int pass)
+{
+    apr_brigade_printf(ctx->bb, NULL, NULL, "# HELP %s %s\n# TYPE %s %s\n", 
+                       metrics_infos[pass].name, metrics_infos[pass].help,
+                       metrics_infos[pass].name, metrics_infos[pass].type);
+}
+
+static int metrics_md(void *baton, const md_t *md, int states, md_json_t *mdj)
+{
+    static const struct { int flag; const char *name; } state_names[] = {
+        { MD_STATUS_SEL_COMPLETE, "complete" },
+        { MD_STATUS_SEL_RENEWING, "renewing" },
+        { MD_STATUS_SEL_ERRORED, "errored" },
+        { MD_STATUS_SEL_READY, "ready" },
+    };
+    metrics_ctx *ctx = baton;
+    const char *name, *metric;
+    apr_time_t t;
+    int i;
+    
+    name = metrics_label(ctx->p, md->name);
+    metric = metrics_infos[ctx->pass].name;
+    switch (ctx->pass) {
+        case METRICS_EXPIRY:
+            t = md_json_get_time(mdj, MD_KEY_CERT, MD_KEY_VALID, MD_KEY_UNTIL, NULL);
+            if (t) {
+                apr_brigade_printf(ctx->bb, NULL, NULL, "%s{name=\"%s\"} %.3f\n", metric, name,
+                                   (double)(t - ctx->now) / (double)apr_time_from_sec(86400));
+            }
+            break;
+        case METRICS_STATE:
+            for (i = 0; i < (int)(sizeof(state_names)/sizeof(state_names[0])); ++i) {
+                apr_brigade_printf(ctx->bb, NULL, NULL, "%s{name=\"%s\",state=\"%s\"} %d\n", 
+                                   metric, name, state_names[i].name, 
+                                   (states & state_names[i].flag)? 1 : 0);
+            }
+            break;
+        case METRICS_ERROR_RUNS:
+            apr_brigade_printf(ctx->bb, NULL, NULL, "%s{name=\"%s\"} %ld\n", metric, name,
+                               md_json_getl(mdj, MD_KEY_RENEWAL, MD_KEY_ERRORS, NULL));
+            break;
+        case METRICS_LAST_DURATION:
+            if (md_json_has_key(mdj, MD_KEY_RENEWAL, MD_KEY_LAST_DURATION, NULL)) {
+                apr_brigade_printf(ctx->bb, NULL, NULL, "%s{name=\"%s\"} %.3f\n", metric, name,
+                                   (double)md_json_getl(mdj, MD_KEY_RENEWAL, 
+                                                        MD_KEY_LAST_DURATION, NULL) / 1000.0);
+            }
+            break;
+        case METRICS_OCSP_AGE:
+            t = md_json_get_time(mdj, MD_KEY_CERT, MD_KEY_OCSP, MD_KEY_VALID, MD_KEY_FROM, NULL);
+            if (t) {
+                apr_brigade_printf(ctx->bb, NULL, NULL, "%s{name=\"%s\"} %.3f\n", metric, name,
+                                   (double)(ctx->now - t) / (double)APR_USEC_PER_SEC);
+            }
+            break;
+        default:
+            break;
+    }
+    return 1;
+}
+
+/* Counters of the answering child. Scrapes reach different children, the pid label 
+ * keeps their series apart and a restarted child starts a new one. */
+static void metrics_counter(metrics_ctx *ctx, const char *name, const char *help, long value)
+{
+    apr_brigade_printf(ctx->bb, NULL, NULL, 
+                       "# HELP %s %s\n# TYPE %s counter\n%s{pid=\"%ld\"} %ld\n", 
+                       name, help, name, name, (long)getpid(), value);
+}
+
+int md_metrics_handler(request_rec *r)
+{
+    const md_srv_conf_t *sc;
+    const md_mod_conf_t *mc;
+    md_status_cache_t *cache;
+    md_json_t *jstats;
+    metrics_ctx ctx;
+    apr_status_t rv;
+
+    if (strcmp(r->handler, "md-metrics")) {
+        return DECLINED;
+    }
+
+    sc = ap_get_module_config(r->server->module_config, &md_module);
+    if (!sc) return DECLINED;
+    mc = sc->mc;
+    if (!mc) return DECLINED;
+
+    if (r->method_number != M_GET) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE2, 0, r, "md-metrics supports only GET");
+        return HTTP_NOT_IMPLEMENTED;
+    }
+    
+    /* without the cache of this child, use one for this request */
+    cache = mc->status_cache;
+    if (!cache && APR_SUCCESS != (rv = md_status_cache_create(&cache, r->pool, mc->mds,
+                                                              mc->reg, mc->ocsp))) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "md-metrics: creating status cache");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    
+    ctx.p = r->pool;
+    ctx.bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    ctx.now = apr_time_now();
+    apr_brigade_printf(ctx.bb, NULL, NULL, "# HELP md_managed_domains Number of managed "
+                       "domains.\n# TYPE md_managed_domains gauge\nmd_managed_domains %d\n",
+                       mc->mds->nelts);
+    for (ctx.pass = 0; ctx.pass < METRICS_PASSES; ++ctx.pass) {
+        metrics_header(&ctx, ctx.pass);
+        if (APR_SUCCESS != (rv = md_status_cache_iter(metrics_md, &ctx, cache, r->pool))) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, r, "md-metrics: getting status");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    if (mc->ocsp && md_ocsp_count(mc->ocsp) > 0) {
+        md_ocsp_get_stats(&jstats, mc->ocsp, r->pool);
+        metrics_counter(&ctx, "md_stapling_lookups_total", 
+                        "Stapling lookups by TLS handshakes in this child.",
+                        md_json_getl(jstats, MD_KEY_CALLS, NULL));
+        metrics_counter(&ctx, "md_stapling_hits_total", 
+                        "Stapling lookups in this child that found a response.",
+                        md_json_getl(jstats, MD_KEY_HITS, NULL));
+        metrics_counter(&ctx, "md_stapling_misses_total", 
+                        "Stapling lookups in this child that found no response.",
+                        md_json_getl(jstats, MD_KEY_MISSES, NULL));
+        metrics_counter(&ctx, "md_stapling_store_reads_total", 
+                        "Stapling lookups in this child that read the store.",
+                        md_json_getl(jstats, MD_KEY_STORE_READS, NULL));
+        metrics_counter(&ctx, "md_stapling_lock_waits_total", 
+                        "Stapling lookups in this child that waited for the lock.",
+                        md_json_getl(jstats, MD_KEY_LOCK_WAITS, NULL));
+    }
+    if (mc->http_clients) {
+        jstats = md_http_clients_stats_json(mc->http_clients, r->pool);
+        metrics_counter(&ctx, "md_http_requests_total", 
+                        "http requests of the watchdogs in this child.",
+                        md_json_getl(jstats, MD_KEY_REQUESTS, NULL));
+        metrics_counter(&ctx, "md_http_waits_total", 
+                        "http requests of the watchdogs in this child that waited for a slot.",
+                        md_json_getl(jstats, MD_KEY_WAITS, NULL));
+    }
+
+    apr_table_set(r->headers_out, "Content-Type", "text/plain; version=0.0.4"); 
+    ap_pass_brigade(r->output_filters, ctx.bb);
+    apr_brigade_cleanup(ctx.bb);
+    return DONE;
+}
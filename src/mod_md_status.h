@@ -23,5 +23,6 @@ int md_domains_status_hook(request_rec *r, int flags);
 int md_ocsp_status_hook(request_rec *r, int flags);
 
 int md_status_handler(request_rec *r);
+int md_metrics_handler(request_rec *r);
 
 #endif /* mod_md_md_status_h */
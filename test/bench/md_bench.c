@@ -0,0 +1,631 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the functions mod_md runs in TLS handshakes and requests.
+ *
+ * Each benchmark prints one JSON object per line on stdout, e.g.
+ *   {"bench":"dns.matches","case":"wildcard","n":0,"threads":1,
+ *    "iterations":4194304,"ns_per_op":21.3,"ops_per_sec":46948356}
+ * so that runs can be compared by scripts. "n" is the number of managed
+ * domains the measured function works on, where that applies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_general.h>
+#include <apr_getopt.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_ocsp.h"
+#include "md_reg.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_time.h"
+#include "md_util.h"
+
+/* ops between clears of the pool handed to a benchmark function */
+#define BENCH_CLEAR_EVERY       256
+
+typedef void bench_op_fn(void *baton, apr_pool_t *p);
+
+typedef struct {
+    apr_pool_t *p;
+    const char *dir;                   /* store directory, created if missing */
+    const char *filter;                /* only run benchmarks with this prefix */
+    int count;                         /* number of MDs in the lookup benchmarks */
+    int max_threads;
+    apr_interval_time_t min_time;      /* minimum duration of a measurement */
+    md_store_t *store;
+} bench_ctx_t;
+
+typedef struct {
+    bench_op_fn *op;
+    void *baton;
+    apr_int64_t iterations;
+} bench_run_t;
+
+static int log_is_level(void *baton, apr_pool_t *p, md_log_level_t level)
+{
+    (void)baton; (void)p;
+    return level <= MD_LOG_WARNING;
+}
+
+static void log_print(const char *file, int line, md_log_level_t level,
+                      apr_status_t rv, void *baton, apr_pool_t *p, const char *fmt, va_list ap)
+{
+    char buffer[8*1024];
+
+    (void)file; (void)line; (void)baton; (void)p;
+    apr_vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    fprintf(stderr, "[%s] %s (%d)\n", md_log_level_name(level), buffer, rv);
+}
+
+static int bench_wanted(bench_ctx_t *ctx, const char *name)
+{
+    return !ctx->filter || !strncmp(name, ctx->filter, strlen(ctx->filter));
+}
+
+static apr_int64_t run_loop(bench_op_fn *op, void *baton, apr_int64_t iterations)
+{
+    apr_pool_t *ptemp;
+    apr_time_t start;
+    apr_int64_t i;
+
+    apr_pool_create(&ptemp, NULL);
+    start = apr_time_now();
+    for (i = 0; i < iterations; ++i) {
+        op(baton, ptemp);
+        if ((i % BENCH_CLEAR_EVERY) == BENCH_CLEAR_EVERY - 1) apr_pool_clear(ptemp);
+    }
+    apr_pool_destroy(ptemp);
+    return (apr_int64_t)(apr_time_now() - start);
+}
+
+static void * APR_THREAD_FUNC run_worker(apr_thread_t *thread, void *data)
+{
+    bench_run_t *run = data;
+
+    run_loop(run->op, run->baton, run->iterations);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static void report(const char *name, const char *bcase, int n, int threads,
+                   apr_int64_t iterations, apr_int64_t usecs)
+{
+    double ns_per_op, ops_per_sec;
+
+    if (usecs <= 0) usecs = 1;
+    /* with several threads, ns_per_op is the time a single thread spends in one op */
+    ns_per_op = ((double)usecs * 1000.0 * threads) / (double)iterations;
+    ops_per_sec = ((double)iterations * 1000000.0) / (double)usecs;
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"n\":%d,\"threads\":%d,"
+           "\"iterations\":%" APR_INT64_T_FMT ",\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n",
+           name, bcase, n, threads, iterations, ns_per_op, ops_per_sec);
+    fflush(stdout);
+}
+
+/**
+ * Run op until the measurement takes at least min_time, doubling the number of
+ * iterations each round, then report the last round. With threads > 1, each thread
+ * runs the iterations that took min_time in a single thread.
+ */
+static void bench_measure(bench_ctx_t *ctx, const char *name, const char *bcase, int n,
+                          int threads, bench_op_fn *op, void *baton)
+{
+    apr_int64_t iterations = 1, usecs;
+    apr_thread_t **workers;
+    bench_run_t run;
+    apr_status_t rv;
+    apr_time_t start;
+    int i;
+
+    for (;;) {
+        usecs = run_loop(op, baton, iterations);
+        if (usecs >= ctx->min_time) break;
+        iterations *= 2;
+    }
+    if (threads <= 1) {
+        report(name, bcase, n, 1, iterations, usecs);
+        return;
+    }
+
+    run.op = op;
+    run.baton = baton;
+    run.iterations = iterations;
+    workers = apr_pcalloc(ctx->p, (apr_size_t)threads * sizeof(apr_thread_t*));
+    start = apr_time_now();
+    for (i = 0; i < threads; ++i) {
+        if (APR_SUCCESS != (rv = apr_thread_create(&workers[i], NULL, run_worker, &run, ctx->p))) {
+            fprintf(stderr, "%s: error %d creating thread\n", name, rv);
+            threads = i;
+            break;
+        }
+    }
+    for (i = 0; i < threads; ++i) {
+        apr_thread_join(&rv, workers[i]);
+    }
+    if (threads > 0) {
+        report(name, bcase, n, threads, iterations * threads,
+               (apr_int64_t)(apr_time_now() - start));
+    }
+}
+
+/**************************************************************************************************/
+/* test data */
+
+static md_t *make_md(apr_pool_t *p, int i, int ndomains)
+{
+    apr_array_header_t *domains;
+    md_t *md;
+    int j;
+
+    domains = apr_array_make(p, ndomains, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = apr_psprintf(p, "md%d.bench.example", i);
+    for (j = 1; j < ndomains; ++j) {
+        APR_ARRAY_PUSH(domains, const char*) = apr_psprintf(p, "www%d.md%d.bench.example", j, i);
+    }
+    md = md_create(p, domains);
+    md->ca_url = "https://acme.bench.example/directory";
+    md->ca_proto = "ACME";
+    md->contacts = apr_array_make(p, 1, sizeof(const char*));
+    APR_ARRAY_PUSH(md->contacts, const char*) = "mailto:admin@bench.example";
+    return md;
+}
+
+static apr_array_header_t *make_mds(apr_pool_t *p, int count)
+{
+    apr_array_header_t *mds;
+    int i;
+
+    mds = apr_array_make(p, count, sizeof(md_t*));
+    for (i = 0; i < count; ++i) {
+        APR_ARRAY_PUSH(mds, md_t*) = make_md(p, i, 3);
+    }
+    return mds;
+}
+
+/* A certificate with an OCSP responder URL, so that it can be primed for stapling. */
+static apr_status_t make_cert(md_cert_t **pcert, md_pkey_t **ppkey, apr_pool_t *p)
+{
+    md_pkey_spec_t spec;
+    apr_array_header_t *domains;
+    X509_EXTENSION *ext;
+    X509 *x;
+    apr_status_t rv;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.type = MD_PKEY_TYPE_EC;
+    spec.params.ec.curve = MD_PKEY_EC_CURVE_DEF;
+    if (APR_SUCCESS != (rv = md_pkey_gen(ppkey, p, &spec))) goto leave;
+
+    domains = apr_array_make(p, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = "bench.example";
+    APR_ARRAY_PUSH(domains, const char*) = "www.bench.example";
+    rv = md_cert_self_sign(pcert, "bench.example", domains, *ppkey,
+                           apr_time_from_sec(MD_SECS_PER_DAY), p);
+    if (APR_SUCCESS != rv) goto leave;
+
+    x = md_cert_get_X509(*pcert);
+    ext = X509V3_EXT_conf_nid(NULL, NULL, NID_info_access,
+                              (char*)"OCSP;URI:http://ocsp.bench.example/");
+    if (!ext || !X509_add_ext(x, ext, -1)
+        || !X509_sign(x, md_pkey_get_EVP_PKEY(*ppkey), EVP_sha256())) {
+        rv = APR_EGENERAL;
+    }
+    if (ext) X509_EXTENSION_free(ext);
+leave:
+    return rv;
+}
+
+/**************************************************************************************************/
+/* json */
+
+typedef struct {
+    md_json_t *json;
+    const char *text;
+    md_json_fmt_t fmt;
+} json_baton_t;
+
+static void op_json_readd(void *baton, apr_pool_t *p)
+{
+    json_baton_t *b = baton;
+    md_json_t *json;
+
+    md_json_readd(&json, p, b->text, strlen(b->text));
+}
+
+static void op_json_writep(void *baton, apr_pool_t *p)
+{
+    json_baton_t *b = baton;
+
+    md_json_writep(b->json, p, b->fmt);
+}
+
+static void bench_json(bench_ctx_t *ctx)
+{
+    json_baton_t b;
+
+    b.json = md_to_json(make_md(ctx->p, 0, 10), ctx->p);
+    b.fmt = MD_JSON_FMT_COMPACT;
+    b.text = md_json_writep(b.json, ctx->p, b.fmt);
+    if (bench_wanted(ctx, "json.readd")) {
+        bench_measure(ctx, "json.readd", "md", 0, 1, op_json_readd, &b);
+    }
+    if (bench_wanted(ctx, "json.writep")) {
+        bench_measure(ctx, "json.writep", "md-compact", 0, 1, op_json_writep, &b);
+        b.fmt = MD_JSON_FMT_INDENT;
+        bench_measure(ctx, "json.writep", "md-indent", 0, 1, op_json_writep, &b);
+    }
+}
+
+/**************************************************************************************************/
+/* base64url */
+
+typedef struct {
+    md_data_t data;
+    const char *encoded;
+} b64_baton_t;
+
+static void op_b64_encode(void *baton, apr_pool_t *p)
+{
+    b64_baton_t *b = baton;
+
+    md_util_base64url_encode(&b->data, p);
+}
+
+static void op_b64_decode(void *baton, apr_pool_t *p)
+{
+    b64_baton_t *b = baton;
+    md_data_t decoded;
+
+    md_util_base64url_decode(&decoded, b->encoded, p);
+}
+
+static void bench_base64url(bench_ctx_t *ctx)
+{
+    static const apr_size_t sizes[] = { 32, 256, 4096 };
+    b64_baton_t b;
+    char *buffer;
+    const char *bcase;
+    apr_size_t i, j;
+
+    for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        buffer = apr_palloc(ctx->p, sizes[i]);
+        for (j = 0; j < sizes[i]; ++j) {
+            buffer[j] = (char)(j * 7 + 3);
+        }
+        b.data.data = buffer;
+        b.data.len = sizes[i];
+        b.encoded = md_util_base64url_encode(&b.data, ctx->p);
+        bcase = apr_psprintf(ctx->p, "%d-bytes", (int)sizes[i]);
+        if (bench_wanted(ctx, "base64url.encode")) {
+            bench_measure(ctx, "base64url.encode", bcase, 0, 1, op_b64_encode, &b);
+        }
+        if (bench_wanted(ctx, "base64url.decode")) {
+            bench_measure(ctx, "base64url.decode", bcase, 0, 1, op_b64_decode, &b);
+        }
+    }
+}
+
+/**************************************************************************************************/
+/* dns name matching */
+
+typedef struct {
+    const char *pattern;
+    const char *domain;
+} dns_baton_t;
+
+static void op_dns_matches(void *baton, apr_pool_t *p)
+{
+    dns_baton_t *b = baton;
+
+    (void)p;
+    md_dns_matches(b->pattern, b->domain);
+}
+
+static void bench_dns(bench_ctx_t *ctx)
+{
+    static const char *cases[][3] = {
+        { "exact", "www.bench.example", "www.bench.example" },
+        { "case", "www.bench.example", "WWW.Bench.Example" },
+        { "wildcard", "*.bench.example", "www.bench.example" },
+        { "miss", "*.bench.example", "www.other.example" },
+    };
+    dns_baton_t b;
+    apr_size_t i;
+
+    if (!bench_wanted(ctx, "dns.matches")) return;
+    for (i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        b.pattern = cases[i][1];
+        b.domain = cases[i][2];
+        bench_measure(ctx, "dns.matches", cases[i][0], 0, 1, op_dns_matches, &b);
+    }
+}
+
+/**************************************************************************************************/
+/* md lookups */
+
+typedef struct {
+    apr_array_header_t *mds;
+    md_index_t *idx;
+    md_reg_t *reg;
+    const char *domain;
+} lookup_baton_t;
+
+static void op_get_by_domain(void *baton, apr_pool_t *p)
+{
+    lookup_baton_t *b = baton;
+
+    (void)p;
+    md_get_by_domain(b->mds, b->domain);
+}
+
+static void op_index_get_by_domain(void *baton, apr_pool_t *p)
+{
+    lookup_baton_t *b = baton;
+
+    (void)p;
+    md_index_get_by_domain(b->idx, b->domain);
+}
+
+static void op_reg_find(void *baton, apr_pool_t *p)
+{
+    lookup_baton_t *b = baton;
+
+    md_reg_find(b->reg, b->domain, p);
+}
+
+static void bench_lookup(bench_ctx_t *ctx)
+{
+    lookup_baton_t b;
+    apr_status_t rv;
+    int i;
+
+    b.mds = make_mds(ctx->p, ctx->count);
+    /* the last domain of the last md, the worst case for a linear search */
+    b.domain = apr_psprintf(ctx->p, "www2.md%d.bench.example", ctx->count - 1);
+    if (bench_wanted(ctx, "md.get_by_domain")) {
+        bench_measure(ctx, "md.get_by_domain", "last", ctx->count, 1, op_get_by_domain, &b);
+    }
+    if (bench_wanted(ctx, "md.index_get_by_domain")) {
+        b.idx = md_index_make(ctx->p, b.mds);
+        bench_measure(ctx, "md.index_get_by_domain", "last", ctx->count, 1,
+                      op_index_get_by_domain, &b);
+    }
+    if (bench_wanted(ctx, "md.reg_find")) {
+        /* as written by the module, without the overlap checks of md_reg_add() */
+        for (i = 0; i < b.mds->nelts; ++i) {
+            rv = md_save(ctx->store, ctx->p, MD_SG_DOMAINS, APR_ARRAY_IDX(b.mds, i, md_t*), 1);
+            if (APR_SUCCESS != rv) {
+                fprintf(stderr, "md.reg_find: error %d saving md %d\n", rv, i);
+                return;
+            }
+        }
+        if (APR_SUCCESS != (rv = md_reg_create(&b.reg, ctx->p, ctx->store, NULL))) {
+            fprintf(stderr, "md.reg_find: error %d creating registry\n", rv);
+            return;
+        }
+        bench_measure(ctx, "md.reg_find", "last", ctx->count, 1, op_reg_find, &b);
+    }
+}
+
+/**************************************************************************************************/
+/* store */
+
+typedef struct {
+    md_store_t *store;
+    const char *aspect;
+    md_store_vtype_t vtype;
+} store_baton_t;
+
+static void op_store_load(void *baton, apr_pool_t *p)
+{
+    store_baton_t *b = baton;
+    void *value;
+
+    md_store_load(b->store, MD_SG_DOMAINS, "bench.example", b->aspect, b->vtype, &value, p);
+}
+
+static void bench_store(bench_ctx_t *ctx, md_cert_t *cert, md_pkey_t *pkey)
+{
+    apr_array_header_t *chain;
+    store_baton_t b;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    if (!bench_wanted(ctx, "store.load")) return;
+    chain = apr_array_make(ctx->p, 3, sizeof(md_cert_t*));
+    for (i = 0; i < 3; ++i) {
+        APR_ARRAY_PUSH(chain, md_cert_t*) = cert;
+    }
+    if (APR_SUCCESS != (rv = md_store_save(ctx->store, ctx->p, MD_SG_DOMAINS, "bench.example",
+                                              "bench.txt", MD_SV_TEXT,
+                                              (void*)"just some text\n", 1))
+        || APR_SUCCESS != (rv = md_store_save(ctx->store, ctx->p, MD_SG_DOMAINS, "bench.example",
+                                              MD_FN_MD, MD_SV_JSON,
+                                              md_to_json(make_md(ctx->p, 0, 10), ctx->p), 0))
+        || APR_SUCCESS != (rv = md_store_save(ctx->store, ctx->p, MD_SG_DOMAINS, "bench.example",
+                                              MD_FN_CERT, MD_SV_CERT, cert, 0))
+        || APR_SUCCESS != (rv = md_store_save(ctx->store, ctx->p, MD_SG_DOMAINS, "bench.example",
+                                              MD_FN_PRIVKEY, MD_SV_PKEY, pkey, 0))
+        || APR_SUCCESS != (rv = md_store_save(ctx->store, ctx->p, MD_SG_DOMAINS, "bench.example",
+                                              MD_FN_PUBCERT, MD_SV_CHAIN, chain, 0))) {
+        fprintf(stderr, "store.load: error %d saving test data\n", rv);
+        return;
+    }
+
+    b.store = ctx->store;
+    b.aspect = "bench.txt"; b.vtype = MD_SV_TEXT;
+    bench_measure(ctx, "store.load", "text", 0, 1, op_store_load, &b);
+    b.aspect = MD_FN_MD; b.vtype = MD_SV_JSON;
+    bench_measure(ctx, "store.load", "json", 0, 1, op_store_load, &b);
+    b.aspect = MD_FN_CERT; b.vtype = MD_SV_CERT;
+    bench_measure(ctx, "store.load", "cert", 0, 1, op_store_load, &b);
+    b.aspect = MD_FN_PRIVKEY; b.vtype = MD_SV_PKEY;
+    bench_measure(ctx, "store.load", "pkey", 0, 1, op_store_load, &b);
+    b.aspect = MD_FN_PUBCERT; b.vtype = MD_SV_CHAIN;
+    bench_measure(ctx, "store.load", "chain", 0, 1, op_store_load, &b);
+}
+
+/**************************************************************************************************/
+/* ocsp */
+
+typedef struct {
+    md_ocsp_reg_t *reg;
+    md_cert_t *cert;
+} ocsp_baton_t;
+
+static void op_ocsp_get_status(void *baton, apr_pool_t *p)
+{
+    ocsp_baton_t *b = baton;
+    unsigned char *der;
+    int derlen;
+
+    md_ocsp_get_status(&der, &derlen, b->reg, b->cert, p, NULL);
+    if (der) OPENSSL_free(der);
+}
+
+static void bench_ocsp(bench_ctx_t *ctx, md_cert_t *cert)
+{
+    md_timeslice_t *renew_window;
+    ocsp_baton_t b;
+    apr_status_t rv;
+    int threads;
+
+    if (!bench_wanted(ctx, "ocsp.get_status")) return;
+    md_timeslice_create(&renew_window, ctx->p, MD_TIME_LIFE_NORM, MD_TIME_RENEW_WINDOW_DEF);
+    if (APR_SUCCESS != (rv = md_ocsp_reg_make(&b.reg, ctx->p, ctx->store, renew_window,
+                                              "md_bench", NULL))
+        || APR_SUCCESS != (rv = md_ocsp_prime(b.reg, cert, cert, NULL))) {
+        fprintf(stderr, "ocsp.get_status: error %d setting up OCSP\n", rv);
+        return;
+    }
+    /* no response was ever retrieved, this measures the lookup of the status */
+    b.cert = cert;
+    for (threads = 1; threads <= ctx->max_threads; threads *= 2) {
+        bench_measure(ctx, "ocsp.get_status", "no-response", 1, threads,
+                      op_ocsp_get_status, &b);
+    }
+}
+
+/**************************************************************************************************/
+/* main */
+
+static void usage(const char *msg)
+{
+    if (msg) fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: md_bench [options] [prefix]\n"
+            "  runs the benchmarks whose name starts with prefix, all by default\n"
+            "  -d dir       store directory to use, default 'bench-store'\n"
+            "  -n count     number of MDs for lookups, default 10000\n"
+            "  -t threads   maximum number of threads, default 8\n"
+            "  -m msec      minimum duration of a measurement, default 200\n");
+}
+
+int main(int argc, const char *const *argv)
+{
+    static const apr_getopt_option_t options[] = {
+        { "dir", 'd', 1, "store directory" },
+        { "count", 'n', 1, "number of MDs" },
+        { "threads", 't', 1, "maximum number of threads" },
+        { "msec", 'm', 1, "minimum duration of a measurement" },
+        { "help", 'h', 0, "print usage" },
+        { NULL, 0, 0, NULL },
+    };
+    bench_ctx_t ctx;
+    apr_getopt_t *os;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    const char *optarg;
+    apr_status_t rv;
+    int opt;
+
+    if (APR_SUCCESS != (rv = apr_app_initialize(&argc, &argv, NULL))) {
+        fprintf(stderr, "error initializing APR (error code %d)\n", (int) rv);
+        return 1;
+    }
+    atexit(apr_terminate);
+    md_log_set(log_is_level, log_print, NULL);
+    md_log_set_level(MD_LOG_WARNING);
+
+    memset(&ctx, 0, sizeof(ctx));
+    apr_pool_create(&ctx.p, NULL);
+    ctx.dir = "bench-store";
+    ctx.count = 10000;
+    ctx.max_threads = 8;
+    ctx.min_time = apr_time_from_msec(200);
+
+    apr_getopt_init(&os, ctx.p, argc, argv);
+    while (APR_SUCCESS == (rv = apr_getopt_long(os, options, &opt, &optarg))) {
+        switch (opt) {
+            case 'd':
+                ctx.dir = optarg;
+                break;
+            case 'n':
+                ctx.count = atoi(optarg);
+                break;
+            case 't':
+                ctx.max_threads = atoi(optarg);
+                break;
+            case 'm':
+                ctx.min_time = apr_time_from_msec(atoi(optarg));
+                break;
+            default:
+                usage(NULL);
+                return 2;
+        }
+    }
+    if (APR_EOF != rv) {
+        usage(NULL);
+        return 2;
+    }
+    if (ctx.count <= 0 || ctx.max_threads <= 0 || ctx.min_time <= 0) {
+        usage("count, threads and msec must be positive");
+        return 2;
+    }
+    if (os->ind < argc) ctx.filter = argv[os->ind];
+
+    if (APR_SUCCESS != (rv = md_crypt_init(ctx.p))
+        || APR_SUCCESS != (rv = md_store_fs_init(&ctx.store, ctx.p, ctx.dir))) {
+        fprintf(stderr, "error %d initializing store in %s\n", rv, ctx.dir);
+        return 1;
+    }
+    if (APR_SUCCESS != (rv = make_cert(&cert, &pkey, ctx.p))) {
+        fprintf(stderr, "error %d creating test certificate\n", rv);
+        return 1;
+    }
+
+    bench_json(&ctx);
+    bench_base64url(&ctx);
+    bench_dns(&ctx);
+    bench_lookup(&ctx);
+    bench_store(&ctx, cert, pkey);
+    bench_ocsp(&ctx, cert);
+    return 0;
+}
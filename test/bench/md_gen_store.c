@@ -0,0 +1,498 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Generates a store with many MDs, as a large installation has it after some
+ * time of operation, and the httpd configuration for it. Used to measure startup
+ * and restart times with startup_bench.py.
+ *
+ * Every MD has two domains. MDs cycle through these states:
+ *  - new:       only md.json, an errored renewal job in staging
+ *  - renewing:  certificate in its renewal window, a running job with a log
+ *  - ready:     valid certificate, a renewed one in staging, job finished
+ *  - expired:   certificate that has expired
+ *  - valid:     valid certificate (the majority)
+ * Certificates are issued by a generated CA and carry an OCSP responder URL.
+ * MDs with a valid certificate have an OCSP response and an OCSP job in the store.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <apr_general.h>
+#include <apr_getopt.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_result.h"
+#include "md_status.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_time.h"
+#include "md_util.h"
+
+#define GEN_OCSP_URL        "http://ocsp.gen.example/"
+
+typedef enum {
+    GEN_NEW,
+    GEN_RENEWING,
+    GEN_READY,
+    GEN_EXPIRED,
+    GEN_VALID,
+} gen_state_t;
+
+static const char *gen_state_names[] = {
+    "new", "renewing", "ready", "expired", "valid",
+};
+
+typedef struct {
+    apr_pool_t *p;
+    md_store_t *store;
+    const char *dir;
+    const char *conf_file;
+    const char *domain;                /* all MDs are in this domain */
+    int count;
+    int port;
+    int shared_key;                    /* use one key for all certificates */
+    md_pkey_spec_t spec;
+    md_pkey_t *ca_pkey;
+    md_cert_t *ca_cert;
+    md_pkey_t *pkey;                   /* shared key, if any */
+    unsigned long serial;
+    int counts[GEN_VALID+1];
+} gen_ctx_t;
+
+static int log_is_level(void *baton, apr_pool_t *p, md_log_level_t level)
+{
+    (void)baton; (void)p;
+    return level <= MD_LOG_WARNING;
+}
+
+static void log_print(const char *file, int line, md_log_level_t level,
+                      apr_status_t rv, void *baton, apr_pool_t *p, const char *fmt, va_list ap)
+{
+    char buffer[8*1024];
+
+    (void)file; (void)line; (void)baton; (void)p;
+    apr_vsnprintf(buffer, sizeof(buffer), fmt, ap);
+    fprintf(stderr, "[%s] %s (%d)\n", md_log_level_name(level), buffer, rv);
+}
+
+static gen_state_t gen_state(int i)
+{
+    switch (i % 20) {
+        case 3: return GEN_NEW;
+        case 7: case 17: return GEN_RENEWING;
+        case 11: return GEN_READY;
+        case 13: return GEN_EXPIRED;
+        default: return GEN_VALID;
+    }
+}
+
+static int add_ext(X509 *x, X509 *issuer, int nid, const char *value)
+{
+    X509V3_CTX v3ctx;
+    X509_EXTENSION *ext;
+    int ok;
+
+    X509V3_set_ctx(&v3ctx, issuer, x, NULL, NULL, 0);
+    if (!(ext = X509V3_EXT_conf_nid(NULL, &v3ctx, nid, (char*)value))) return 0;
+    ok = X509_add_ext(x, ext, -1);
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+/* Issue a certificate for the domains by our CA or, without CA, a self-signed one. */
+static apr_status_t issue_cert(md_cert_t **pcert, gen_ctx_t *ctx, apr_array_header_t *domains,
+                               md_pkey_t *pkey, apr_time_t not_before, apr_time_t not_after,
+                               apr_pool_t *p)
+{
+    X509 *x = NULL, *issuer;
+    X509_NAME *name = NULL;
+    EVP_PKEY *sign_key;
+    const char *alts;
+    int i, ok = 0;
+
+    if (!(x = X509_new()) || !(name = X509_NAME_new())) goto leave;
+    issuer = ctx->ca_cert? md_cert_get_X509(ctx->ca_cert) : x;
+    sign_key = md_pkey_get_EVP_PKEY(ctx->ca_pkey? ctx->ca_pkey : pkey);
+
+    if (!X509_set_version(x, 2L)
+        || !ASN1_INTEGER_set(X509_get_serialNumber(x), (long)++ctx->serial)
+        || !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                       (const unsigned char*)APR_ARRAY_IDX(domains, 0, const char*),
+                                       -1, -1, 0)
+        || !X509_set_subject_name(x, name)
+        || !X509_set_issuer_name(x, ctx->ca_cert? X509_get_subject_name(issuer) : name)
+        || !ASN1_TIME_set(X509_get_notBefore(x), (time_t)apr_time_sec(not_before))
+        || !ASN1_TIME_set(X509_get_notAfter(x), (time_t)apr_time_sec(not_after))
+        || !X509_set_pubkey(x, md_pkey_get_EVP_PKEY(pkey))) {
+        goto leave;
+    }
+    if (ctx->ca_cert) {
+        alts = "";
+        for (i = 0; i < domains->nelts; ++i) {
+            alts = apr_psprintf(p, "%s%sDNS:%s", alts, i? "," : "",
+                                APR_ARRAY_IDX(domains, i, const char*));
+        }
+        if (!add_ext(x, issuer, NID_basic_constraints, "critical,CA:FALSE")
+            || !add_ext(x, issuer, NID_key_usage, "critical,digitalSignature,keyEncipherment")
+            || !add_ext(x, issuer, NID_ext_key_usage, "serverAuth")
+            || !add_ext(x, issuer, NID_subject_alt_name, alts)
+            || !add_ext(x, issuer, NID_info_access, "OCSP;URI:" GEN_OCSP_URL)) {
+            goto leave;
+        }
+    }
+    else if (!add_ext(x, issuer, NID_basic_constraints, "critical,CA:TRUE")
+             || !add_ext(x, issuer, NID_key_usage, "critical,keyCertSign,cRLSign")) {
+        goto leave;
+    }
+    ok = X509_sign(x, sign_key, EVP_sha256()) > 0;
+leave:
+    if (name) X509_NAME_free(name);
+    if (!ok) {
+        if (x) X509_free(x);
+        *pcert = NULL;
+        return APR_EGENERAL;
+    }
+    *pcert = md_cert_make(p, x);
+    return APR_SUCCESS;
+}
+
+static apr_status_t save_cert(gen_ctx_t *ctx, md_store_group_t group, const char *name,
+                              apr_array_header_t *domains, apr_time_t not_before,
+                              apr_time_t not_after, md_cert_t **pcert, apr_pool_t *p)
+{
+    apr_array_header_t *pubcert;
+    md_pkey_t *pkey = ctx->pkey;
+    apr_status_t rv;
+
+    if (!pkey && APR_SUCCESS != (rv = md_pkey_gen(&pkey, p, &ctx->spec))) goto leave;
+    rv = issue_cert(pcert, ctx, domains, pkey, not_before, not_after, p);
+    if (APR_SUCCESS != rv) goto leave;
+    pubcert = apr_array_make(p, 2, sizeof(md_cert_t*));
+    APR_ARRAY_PUSH(pubcert, md_cert_t*) = *pcert;
+    APR_ARRAY_PUSH(pubcert, md_cert_t*) = ctx->ca_cert;
+    if (APR_SUCCESS != (rv = md_pkey_save(ctx->store, p, group, name, pkey, 1))) goto leave;
+    rv = md_pubcert_save(ctx->store, p, group, name, pubcert, 1);
+leave:
+    if (pkey && pkey != ctx->pkey) md_pkey_free(pkey);
+    return rv;
+}
+
+/* An OCSP response as the module keeps it. The DER is random bytes of the usual size,
+ * it is only parsed when handed to a client. */
+static apr_status_t save_ocsp(gen_ctx_t *ctx, const char *name, md_cert_t *cert, apr_pool_t *p)
+{
+    md_timeperiod_t valid;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen = 0;
+    md_data_t id, der;
+    const char *hexid;
+    char *buffer;
+    md_json_t *json;
+    md_job_t *job;
+    apr_status_t rv;
+    apr_size_t i;
+
+    if (X509_digest(md_cert_get_X509(cert), EVP_sha1(), digest, &dlen) != 1) return APR_EGENERAL;
+    id.data = (const char*)digest;
+    id.len = dlen;
+    if (APR_SUCCESS != (rv = md_data_to_hex(&hexid, 0, p, &id))) return rv;
+
+    der.len = 1500;
+    buffer = apr_palloc(p, der.len);
+    for (i = 0; i < der.len; ++i) buffer[i] = (char)rand();
+    der.data = buffer;
+    valid.start = apr_time_now() - apr_time_from_sec(MD_SECS_PER_DAY);
+    valid.end = valid.start + apr_time_from_sec(7 * MD_SECS_PER_DAY);
+
+    json = md_json_create(p);
+    md_json_sets(md_util_base64url_encode(&der, p), json, MD_KEY_RESPONSE, NULL);
+    md_json_sets("good", json, MD_KEY_STATUS, NULL);
+    md_json_set_timeperiod(&valid, json, MD_KEY_VALID, NULL);
+    rv = md_store_save_json(ctx->store, p, MD_SG_OCSP, name,
+                            apr_psprintf(p, "ocsp-%s.json", hexid), json, 1);
+    if (APR_SUCCESS != rv) return rv;
+
+    job = md_job_make(p, ctx->store, MD_SG_OCSP, name);
+    job->last_run = valid.start;
+    job->next_run = valid.start + apr_time_from_sec(4 * MD_SECS_PER_DAY);
+    job->finished = 1;
+    md_job_log_append(job, "ocsp-renewed", NULL, NULL);
+    return md_job_save(job, NULL, p);
+}
+
+static apr_status_t save_job(gen_ctx_t *ctx, const char *name, gen_state_t state, apr_pool_t *p)
+{
+    md_result_t *result;
+    md_job_t *job;
+    apr_time_t now = apr_time_now();
+    int i;
+
+    job = md_job_make(p, ctx->store, MD_SG_STAGING, name);
+    result = md_result_make(p, APR_SUCCESS);
+    switch (state) {
+        case GEN_NEW:
+            job->last_run = now - apr_time_from_sec(MD_SECS_PER_HOUR);
+            job->next_run = now + apr_time_from_sec(MD_SECS_PER_HOUR);
+            job->error_runs = 3;
+            md_result_problem_set(result, APR_EGENERAL, "urn:ietf:params:acme:error:dns",
+                                  "DNS problem: NXDOMAIN looking up A", NULL);
+            for (i = 0; i < job->error_runs; ++i) {
+                md_job_log_append(job, "starting", NULL, NULL);
+                md_job_log_append(job, "error", result->problem, result->detail);
+            }
+            break;
+        case GEN_RENEWING:
+            job->last_run = now - apr_time_from_sec(60);
+            md_result_set(result, APR_EAGAIN, "Waiting for challenge validation");
+            md_job_log_append(job, "starting", NULL, NULL);
+            for (i = 0; i < 10; ++i) {
+                md_job_log_append(job, "progress", NULL, "challenge validation pending");
+            }
+            break;
+        case GEN_READY:
+            job->last_run = now - apr_time_from_sec(MD_SECS_PER_HOUR);
+            job->finished = 1;
+            job->valid_from = now + apr_time_from_sec(MD_SECS_PER_HOUR);
+            md_result_set(result, APR_SUCCESS, "The certificate has been renewed");
+            md_job_log_append(job, "starting", NULL, NULL);
+            md_job_log_append(job, "finished", NULL, NULL);
+            break;
+        default:
+            return APR_SUCCESS;
+    }
+    return md_job_save(job, result, p);
+}
+
+static apr_status_t gen_md(gen_ctx_t *ctx, int i, apr_pool_t *p)
+{
+    apr_array_header_t *domains;
+    gen_state_t state = gen_state(i);
+    md_cert_t *cert = NULL, *renewed;
+    apr_time_t now = apr_time_now(), not_before, not_after;
+    md_t *md;
+    apr_status_t rv;
+
+    domains = apr_array_make(p, 2, sizeof(const char*));
+    APR_ARRAY_PUSH(domains, const char*) = apr_psprintf(p, "md%d.%s", i, ctx->domain);
+    APR_ARRAY_PUSH(domains, const char*) = apr_psprintf(p, "www.md%d.%s", i, ctx->domain);
+    md = md_create(p, domains);
+    md->ca_proto = "ACME";
+    md->ca_url = "https://acme.gen.example/directory";
+    md->ca_account = "ACME-gen-0000";
+    md->state = (state == GEN_NEW)? MD_S_INCOMPLETE : MD_S_COMPLETE;
+
+    if (APR_SUCCESS != (rv = md_save(ctx->store, p, MD_SG_DOMAINS, md, 1))) goto leave;
+    if (state != GEN_NEW) {
+        switch (state) {
+            case GEN_RENEWING:
+                not_after = now + apr_time_from_sec(10 * MD_SECS_PER_DAY);
+                break;
+            case GEN_EXPIRED:
+                not_after = now - apr_time_from_sec(2 * MD_SECS_PER_DAY);
+                break;
+            default:
+                not_after = now + apr_time_from_sec((long)(40 + i % 50) * MD_SECS_PER_DAY);
+                break;
+        }
+        not_before = not_after - apr_time_from_sec(90 * MD_SECS_PER_DAY);
+        rv = save_cert(ctx, MD_SG_DOMAINS, md->name, domains, not_before, not_after, &cert, p);
+        if (APR_SUCCESS != rv) goto leave;
+    }
+    if (state == GEN_READY) {
+        if (APR_SUCCESS != (rv = md_save(ctx->store, p, MD_SG_STAGING, md, 1))) goto leave;
+        rv = save_cert(ctx, MD_SG_STAGING, md->name, domains, now,
+                       now + apr_time_from_sec(90 * MD_SECS_PER_DAY), &renewed, p);
+        if (APR_SUCCESS != rv) goto leave;
+    }
+    if (cert && state != GEN_EXPIRED) {
+        if (APR_SUCCESS != (rv = save_ocsp(ctx, md->name, cert, p))) goto leave;
+    }
+    rv = save_job(ctx, md->name, state, p);
+    ctx->counts[state]++;
+leave:
+    if (APR_SUCCESS != rv) {
+        fprintf(stderr, "error %d generating md %s\n", rv, md->name);
+    }
+    return rv;
+}
+
+static apr_status_t write_conf(gen_ctx_t *ctx)
+{
+    apr_file_t *f;
+    apr_status_t rv;
+    int i;
+
+    rv = apr_file_open(&f, ctx->conf_file, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_TRUNCATE
+                       |APR_FOPEN_BUFFERED, APR_FPROT_OS_DEFAULT, ctx->p);
+    if (APR_SUCCESS != rv) return rv;
+    apr_file_printf(f, "# generated by md_gen_store, %d MDs\n"
+                    "MDStoreDir \"%s\"\n"
+                    "MDCertificateAuthority https://acme.gen.example/directory\n"
+                    "MDCertificateAgreement accepted\n"
+                    "MDRenewMode manual\n\n", ctx->count, ctx->dir);
+    for (i = 0; i < ctx->count; ++i) {
+        apr_file_printf(f, "MDomain md%d.%s www.md%d.%s\n"
+                        "<VirtualHost *:%d>\n"
+                        "    ServerName md%d.%s\n"
+                        "    ServerAlias www.md%d.%s\n"
+                        "    SSLEngine on\n"
+                        "</VirtualHost>\n",
+                        i, ctx->domain, i, ctx->domain, ctx->port,
+                        i, ctx->domain, i, ctx->domain);
+    }
+    return apr_file_close(f);
+}
+
+static void usage(const char *msg)
+{
+    if (msg) fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "usage: md_gen_store [options] store-dir\n"
+            "  -n count     number of MDs, default 20000\n"
+            "  -c file      write the httpd configuration for the MDs to file\n"
+            "  -p port      port of the generated virtual hosts, default 443\n"
+            "  -D domain    domain the names of the MDs are in, default 'gen.example'\n"
+            "  -k type      key type of certificates, 'rsa' or 'ec' (default)\n"
+            "  -s           use a single key for all certificates\n");
+}
+
+int main(int argc, const char *const *argv)
+{
+    static const apr_getopt_option_t options[] = {
+        { "count", 'n', 1, "number of MDs" },
+        { "conf", 'c', 1, "httpd configuration file" },
+        { "port", 'p', 1, "port of virtual hosts" },
+        { "domain", 'D', 1, "domain of the MDs" },
+        { "key", 'k', 1, "key type" },
+        { "shared-key", 's', 0, "single key for all certificates" },
+        { "help", 'h', 0, "print usage" },
+        { NULL, 0, 0, NULL },
+    };
+    gen_ctx_t ctx;
+    apr_array_header_t *names;
+    apr_getopt_t *os;
+    apr_pool_t *ptemp;
+    const char *optarg;
+    apr_time_t start;
+    apr_status_t rv;
+    int opt, i;
+
+    if (APR_SUCCESS != (rv = apr_app_initialize(&argc, &argv, NULL))) {
+        fprintf(stderr, "error initializing APR (error code %d)\n", (int) rv);
+        return 1;
+    }
+    atexit(apr_terminate);
+    md_log_set(log_is_level, log_print, NULL);
+    md_log_set_level(MD_LOG_WARNING);
+
+    memset(&ctx, 0, sizeof(ctx));
+    apr_pool_create(&ctx.p, NULL);
+    ctx.count = 20000;
+    ctx.port = 443;
+    ctx.domain = "gen.example";
+    ctx.spec.type = MD_PKEY_TYPE_EC;
+    ctx.spec.params.ec.curve = MD_PKEY_EC_CURVE_DEF;
+
+    apr_getopt_init(&os, ctx.p, argc, argv);
+    while (APR_SUCCESS == (rv = apr_getopt_long(os, options, &opt, &optarg))) {
+        switch (opt) {
+            case 'n':
+                ctx.count = atoi(optarg);
+                break;
+            case 'c':
+                ctx.conf_file = optarg;
+                break;
+            case 'p':
+                ctx.port = atoi(optarg);
+                break;
+            case 'D':
+                ctx.domain = optarg;
+                break;
+            case 'k':
+                if (!strcmp("rsa", optarg)) {
+                    ctx.spec.type = MD_PKEY_TYPE_RSA;
+                    ctx.spec.params.rsa.bits = MD_PKEY_RSA_BITS_DEF;
+                }
+                else if (strcmp("ec", optarg)) {
+                    usage("key type must be 'rsa' or 'ec'");
+                    return 2;
+                }
+                break;
+            case 's':
+                ctx.shared_key = 1;
+                break;
+            default:
+                usage(NULL);
+                return 2;
+        }
+    }
+    if (APR_EOF != rv || os->ind + 1 != argc) {
+        usage(NULL);
+        return 2;
+    }
+    if (ctx.count <= 0 || ctx.port <= 0) {
+        usage("count and port must be positive");
+        return 2;
+    }
+    ctx.dir = argv[os->ind];
+
+    if (APR_SUCCESS != (rv = md_crypt_init(ctx.p))
+        || APR_SUCCESS != (rv = md_store_fs_init(&ctx.store, ctx.p, ctx.dir))) {
+        fprintf(stderr, "error %d initializing store in %s\n", rv, ctx.dir);
+        return 1;
+    }
+
+    names = apr_array_make(ctx.p, 1, sizeof(const char*));
+    APR_ARRAY_PUSH(names, const char*) = "Generated Test CA";
+    if (APR_SUCCESS != (rv = md_pkey_gen(&ctx.ca_pkey, ctx.p, &ctx.spec))
+        || APR_SUCCESS != (rv = issue_cert(&ctx.ca_cert, &ctx, names, ctx.ca_pkey,
+                                           apr_time_now() - apr_time_from_sec(MD_SECS_PER_DAY),
+                                           apr_time_now()
+                                           + apr_time_from_sec(3650 * MD_SECS_PER_DAY), ctx.p))
+        || (ctx.shared_key && APR_SUCCESS != (rv = md_pkey_gen(&ctx.pkey, ctx.p, &ctx.spec)))) {
+        fprintf(stderr, "error %d creating CA\n", rv);
+        return 1;
+    }
+
+    start = apr_time_now();
+    apr_pool_create(&ptemp, ctx.p);
+    for (i = 0; i < ctx.count; ++i) {
+        if (APR_SUCCESS != (rv = gen_md(&ctx, i, ptemp))) return 1;
+        apr_pool_clear(ptemp);
+    }
+    if (ctx.conf_file && APR_SUCCESS != (rv = write_conf(&ctx))) {
+        fprintf(stderr, "error %d writing %s\n", rv, ctx.conf_file);
+        return 1;
+    }
+    fprintf(stderr, "generated %d MDs in %s in %d seconds:", ctx.count, ctx.dir,
+            (int)apr_time_sec(apr_time_now() - start));
+    for (i = 0; i <= GEN_VALID; ++i) {
+        fprintf(stderr, " %s=%d", gen_state_names[i], ctx.counts[i]);
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
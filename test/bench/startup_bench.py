@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+#
+# Measures how long httpd takes to load a configuration, to start and to
+# gracefully restart, together with the peak memory of its processes. Meant to
+# be used with a store and configuration generated by md_gen_store:
+#
+#   bench/md_gen_store -n 20000 -c gen/md-gen.conf gen/md-gen-store
+#   bench/startup_bench.py -f /path/to/httpd.conf -r 5
+#
+# where httpd.conf loads mod_ssl and mod_md, listens on the port given to
+# md_gen_store and includes gen/md-gen.conf. Each measurement is printed as one
+# JSON object per line, like the results of md_bench.
+#
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import time
+
+READY = "resuming normal operations"
+
+
+def run_cfg(apachectl, conf):
+    p = subprocess.run([apachectl, "-f", conf, "-t", "-D", "DUMP_RUN_CFG"],
+                       capture_output=True, text=True)
+    cfg = {}
+    for line in p.stdout.splitlines():
+        m = re.match(r'^(Main ErrorLog|PidFile):\s*"?([^"]+)"?', line)
+        if m:
+            cfg[m.group(1)] = m.group(2)
+    return cfg
+
+
+def ready_count(error_log):
+    if not os.path.isfile(error_log):
+        return 0
+    with open(error_log, errors="replace") as fd:
+        return fd.read().count(READY)
+
+
+def wait_ready(error_log, count, timeout):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        if ready_count(error_log) > count:
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def proc_kb(pid, field):
+    try:
+        with open("/proc/%d/status" % pid) as fd:
+            for line in fd:
+                if line.startswith(field + ":"):
+                    return int(line.split()[1])
+    except (OSError, ValueError):
+        pass
+    return 0
+
+
+def children(ppid):
+    pids = []
+    for name in os.listdir("/proc"):
+        if not name.isdigit():
+            continue
+        try:
+            with open("/proc/%s/stat" % name) as fd:
+                # the command may contain spaces, fields after it are fixed
+                fields = fd.read().rsplit(")", 1)[1].split()
+            if int(fields[1]) == ppid:
+                pids.append(int(name))
+        except (OSError, IndexError, ValueError):
+            pass
+    return pids
+
+
+def memory(pid_file):
+    mem = {"parent_hwm_kb": 0, "parent_rss_kb": 0, "child_hwm_kb": 0, "children": 0}
+    try:
+        with open(pid_file) as fd:
+            pid = int(fd.read().strip())
+    except (OSError, ValueError):
+        return mem
+    mem["parent_hwm_kb"] = proc_kb(pid, "VmHWM")
+    mem["parent_rss_kb"] = proc_kb(pid, "VmRSS")
+    for child in children(pid):
+        mem["children"] += 1
+        mem["child_hwm_kb"] = max(mem["child_hwm_kb"], proc_kb(child, "VmHWM"))
+    return mem
+
+
+def report(name, secs, **kwargs):
+    res = {"bench": name, "secs": round(secs, 3)}
+    res.update(kwargs)
+    print(json.dumps(res))
+    sys.stdout.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="httpd startup/restart benchmark")
+    parser.add_argument("-f", "--conf", required=True, help="httpd configuration file")
+    parser.add_argument("-a", "--apachectl", default="apachectl", help="apachectl to use")
+    parser.add_argument("-r", "--restarts", type=int, default=3,
+                        help="number of graceful restarts to measure")
+    parser.add_argument("-t", "--timeout", type=float, default=600,
+                        help="seconds to wait for the server to become ready")
+    args = parser.parse_args()
+
+    cfg = run_cfg(args.apachectl, args.conf)
+    error_log = cfg.get("Main ErrorLog")
+    pid_file = cfg.get("PidFile")
+    if not error_log or not pid_file:
+        sys.stderr.write("unable to get ErrorLog and PidFile of %s\n" % args.conf)
+        return 1
+
+    start = time.monotonic()
+    p = subprocess.run([args.apachectl, "-f", args.conf, "-t"], capture_output=True, text=True)
+    report("config-check", time.monotonic() - start, status=p.returncode)
+    if p.returncode != 0:
+        sys.stderr.write(p.stderr)
+        return 1
+
+    count = ready_count(error_log)
+    start = time.monotonic()
+    subprocess.run([args.apachectl, "-f", args.conf, "-k", "start"])
+    if not wait_ready(error_log, count, args.timeout):
+        sys.stderr.write("server did not start within %d seconds\n" % args.timeout)
+        return 1
+    report("start", time.monotonic() - start, **memory(pid_file))
+
+    rv = 0
+    for i in range(args.restarts):
+        count = ready_count(error_log)
+        start = time.monotonic()
+        subprocess.run([args.apachectl, "-f", args.conf, "-k", "graceful"])
+        if not wait_ready(error_log, count, args.timeout):
+            sys.stderr.write("server did not restart within %d seconds\n" % args.timeout)
+            rv = 1
+            break
+        report("graceful", time.monotonic() - start, run=i + 1, **memory(pid_file))
+
+    subprocess.run([args.apachectl, "-f", args.conf, "-k", "stop"])
+    return rv
+
+
+if __name__ == "__main__":
+    sys.exit(main())
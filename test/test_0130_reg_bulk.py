@@ -0,0 +1,118 @@
+# test a2md bulk add/update of managed domains
+
+import json
+import os
+import pytest
+
+from TestEnv import TestEnv
+
+def setup_module(module):
+    print("setup_module: %s" % module.__name__)
+    TestEnv.init()
+    TestEnv.a2md_stdargs([TestEnv.A2MD, "-a", TestEnv.ACME_URL, "-d", TestEnv.STORE_DIR, "-j" ])
+    TestEnv.a2md_rawargs([TestEnv.A2MD, "-a", TestEnv.ACME_URL, "-d", TestEnv.STORE_DIR ])
+
+def teardown_module(module):
+    print("teardown_module: %s" % module.__name__)
+
+
+class TestRegBulk :
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+        TestEnv.clear_store()
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    def _bulk_file(self, name, lines):
+        fpath = os.path.join(TestEnv.GEN_DIR, name)
+        with open(fpath, 'w') as fd:
+            for line in lines:
+                fd.write((line if isinstance(line, str) else json.dumps(line)) + "\n")
+        return fpath
+
+    # test case: add several managed domains in one run
+    def test_130_000(self):
+        fpath = self._bulk_file("bulk-130-000.jsonl", [
+            { "domains": [ "test130-000a.com", "www.test130-000a.com" ] },
+            { "op": "add", "name": "md130", "domains": [ "test130-000b.com" ],
+              "contacts": [ "admin@test130-000b.com" ] },
+            "",
+            "# a comment",
+            { "domains": [ "test130-000c.com" ] },
+        ])
+        jout = TestEnv.a2md([ "bulk", fpath ])['jout']
+        assert len(jout['output']) == 3
+        assert [ r['line'] for r in jout['output'] ] == [ 1, 2, 5 ]
+        for r in jout['output']:
+            assert r['result']['status'] == 0
+        assert jout['output'][1]['name'] == "md130"
+        TestEnv.check_json_contains( jout['output'][1]['md'], {
+            "name": "md130",
+            "domains": [ "test130-000b.com" ],
+            "contacts": [ "mailto:admin@test130-000b.com" ],
+            "ca": {
+                "url": TestEnv.ACME_URL,
+                "proto": "ACME"
+            },
+            "state": TestEnv.MD_S_INCOMPLETE
+        })
+        assert len(TestEnv.a2md([ "list" ])['jout']['output']) == 3
+
+    # test case: overlaps are detected, also against mds added in the same run
+    def test_130_001(self):
+        assert TestEnv.a2md([ "add", "test130-001a.com" ])['rv'] == 0
+        fpath = self._bulk_file("bulk-130-001.jsonl", [
+            { "domains": [ "test130-001b.com", "test130-001a.com" ] },
+            { "domains": [ "test130-001c.com" ] },
+            { "domains": [ "test130-001d.com", "test130-001c.com" ] },
+            "not json",
+            { "op": "delete", "name": "test130-001a.com" },
+        ])
+        run = TestEnv.a2md([ "bulk", fpath ])
+        assert run['rv'] != 0
+        status = [ r['result']['status'] for r in run['jout']['output'] ]
+        assert status[0] != 0
+        assert status[1] == 0
+        assert status[2] != 0
+        assert status[3] != 0
+        assert status[4] != 0
+        names = [ md['name'] for md in TestEnv.a2md([ "list" ])['jout']['output'] ]
+        assert sorted(names) == [ "test130-001a.com", "test130-001c.com" ]
+
+    # test case: update managed domains, domain changes are seen by later lines
+    def test_130_002(self):
+        assert TestEnv.a2md([ "add", "test130-002a.com" ])['rv'] == 0
+        assert TestEnv.a2md([ "add", "test130-002b.com", "www.test130-002b.com" ])['rv'] == 0
+        fpath = self._bulk_file("bulk-130-002.jsonl", [
+            { "op": "update", "name": "test130-002b.com", "domains": [ "test130-002b.com" ],
+              "contacts": [ "admin@test130-002b.com" ] },
+            { "op": "update", "name": "test130-002a.com", 
+              "domains": [ "test130-002a.com", "www.test130-002b.com" ] },
+            { "op": "update", "name": "test130-002x.com", "contacts": [ "x@y.com" ] },
+        ])
+        jout = TestEnv.a2md([ "bulk", fpath ])['jout']
+        status = [ r['result']['status'] for r in jout['output'] ]
+        assert status[0] == 0
+        assert status[1] == 0
+        assert status[2] != 0
+        md = TestEnv.a2md([ "list", "test130-002a.com" ])['jout']['output'][0]
+        assert md['domains'] == [ "test130-002a.com", "www.test130-002b.com" ]
+        md = TestEnv.a2md([ "list", "test130-002b.com" ])['jout']['output'][0]
+        assert md['contacts'] == [ "mailto:admin@test130-002b.com" ]
+
+    # test case: without -j, each result is written as a line of JSON
+    def test_130_003(self):
+        fpath = self._bulk_file("bulk-130-003.jsonl", [
+            { "domains": [ "test130-003a.com" ] },
+            { "domains": [ "test130-003b.com" ] },
+        ])
+        run = TestEnv.a2md([ "bulk", fpath ], raw=True)
+        assert run['rv'] == 0
+        lines = run['stdout'].splitlines()
+        assert len(lines) == 2
+        for line in lines:
+            r = json.loads(line)
+            assert r['result']['status'] == 0
+            assert r['md']['state'] == TestEnv.MD_S_INCOMPLETE
@@ -376,6 +376,23 @@ class TestDrivev2:
         # assert that no crash is reported in the log
         assert not TestEnv.httpd_error_log_scan( re.compile("^.* child pid \S+ exit .*$") )
 
+    def test_502_110(self):
+        # test case: drive several mds in parallel
+        domain = self.test_domain
+        names = [ "www." + domain, "test." + domain, "mail." + domain ]
+        for name in names:
+            self._prepare_md([ name ])
+        assert TestEnv.apache_start() == 0
+        run = TestEnv.a2md( [ "drive", "-c", "http-01", "--jobs", "3" ] + names )
+        assert run['rv'] == 0
+        assert len(run['jout']['output']) == len(names)
+        for r in run['jout']['output']:
+            assert r['result']['status'] == 0
+            assert r['renew']
+            assert 'msecs' in r
+        for name in names:
+            TestEnv.check_md_credentials([ name ])
+
     # --------- critical state change -> drive again ---------
 
     def test_502_200(self):
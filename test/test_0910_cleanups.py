@@ -62,3 +62,31 @@ class TestCleanups:
         for name in missing_after:
             assert not os.path.exists(os.path.join( challenges_dir, name ))
 
+
+    def test_910_02(self):
+        # with a cleanup journal, only the challenges in it are looked at
+        domain = self.test_domain
+        domains = [ domain ]
+        conf = HttpdConf()
+        conf.add_admin( "admin@not-forbidden.org" )
+        conf.add_drive_mode( "manual" )
+        conf.add_md( domains )
+        conf.add_vhost(domain)
+        conf.install()
+        assert TestEnv.apache_restart() == 0
+        journal = os.path.join(TestEnv.STORE_DIR, 'journal', 'challenges.log')
+        assert os.path.isfile(journal)
+
+        challenges_dir = TestEnv.store_challenges()
+        for name in [ "journaled", "unknown" ]:
+            os.makedirs(os.path.join( challenges_dir, name ))
+            open(os.path.join( challenges_dir, name, "acme-http-01.txt" ), "w").write("x")
+        with open(journal, "a") as fd:
+            fd.write("%d journaled acme-http-01.txt\n" % (time.time() * 1000000))
+
+        assert TestEnv.apache_restart() == 0
+        assert not os.path.exists(os.path.join( challenges_dir, "journaled" ))
+        # not created by mod_md, left alone
+        assert os.path.isdir(os.path.join( challenges_dir, "unknown" ))
+        # the entry is gone from the journal
+        assert "journaled" not in open(journal).read()
@@ -13,6 +13,10 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <apr_buckets.h>
+#include <apr_strings.h>
 
 #include "test_common.h"
 #include "md_json.h"
@@ -345,6 +349,84 @@ START_TEST(copies)
 }
 END_TEST
 
+START_TEST(writer)
+{
+    apr_bucket_alloc_t *ba = apr_bucket_alloc_create(g_pool);
+    apr_bucket_brigade *bb = apr_brigade_create(g_pool, ba);
+    md_json_t *sub = md_json_create(g_pool);
+    md_json_writer_t *w;
+    char *s;
+    apr_size_t len;
+
+    md_json_setl(1, sub, "long", NULL);
+    w = md_json_writer_create(bb, MD_JSON_FMT_COMPACT, NULL, NULL, g_pool);
+    md_json_writer_begin_object(w, NULL);
+    md_json_writer_sets(w, "string", "a \"quoted\"\ttext\x01");
+    md_json_writer_setb(w, "boolean", 1);
+    md_json_writer_begin_array(w, "array");
+    md_json_writer_setl(w, NULL, -2);
+    md_json_writer_setj(w, NULL, sub);
+    md_json_writer_begin_object(w, NULL);
+    md_json_writer_end_object(w);
+    md_json_writer_end_array(w);
+    md_json_writer_sets(w, "null", NULL);
+    ck_assert_int_eq( md_json_writer_end_object(w), 0 );
+    /* more ends than begins */
+    ck_assert_int_eq( md_json_writer_end_object(w), APR_EINVAL );
+    ck_assert_int_eq( md_json_writer_setl(w, "long", 1), APR_EINVAL );
+
+    ck_assert_int_eq( apr_brigade_pflatten(bb, &s, &len, g_pool), 0 );
+    ck_assert_str_eq( apr_pstrndup(g_pool, s, len), 
+                      "{\"string\":\"a \\\"quoted\\\"\\ttext\\u0001\",\"boolean\":true,"
+                      "\"array\":[-2,{\"long\":1},{}],\"null\":null}");
+}
+END_TEST
+
+typedef struct {
+    const char *name;
+    int count;
+    long size;
+    int enabled;
+} fields_t;
+
+START_TEST(paths_and_fields)
+{
+    static const char * const path[] = { "outer", "inner", NULL };
+    static const char * const name_path[] = { "outer", "inner", "name", NULL };
+    static const char * const count_path[] = { "outer", "inner", "count", NULL };
+    static const md_json_field_t fields[] = {
+        MD_JSON_FIELD("name", MD_JSON_FIELD_DUPS, fields_t, name),
+        MD_JSON_FIELD("count", MD_JSON_FIELD_INT, fields_t, count),
+        MD_JSON_FIELD("size", MD_JSON_FIELD_LONG, fields_t, size),
+        MD_JSON_FIELD("enabled", MD_JSON_FIELD_BOOL, fields_t, enabled),
+    };
+    md_json_t *json = md_json_create(g_pool);
+    fields_t f;
+
+    md_json_sets("test", json, "outer", "inner", "name", NULL);
+    md_json_setl(42, json, "outer", "inner", "count", NULL);
+    md_json_setb(1, json, "outer", "inner", "enabled", NULL);
+
+    ck_assert_str_eq( md_json_path_gets(json, name_path), "test" );
+    ck_assert_int_eq( md_json_path_getl(json, count_path), 42 );
+    /* not a string */
+    ck_assert_ptr_eq( md_json_path_gets(json, path), NULL );
+
+    memset(&f, 0xff, sizeof(f));
+    md_json_get_fields(&f, fields, sizeof(fields)/sizeof(fields[0]), json, path, g_pool);
+    ck_assert_str_eq( f.name, "test" );
+    ck_assert_int_eq( f.count, 42 );
+    /* missing members are zeroed, as the single getters return */
+    ck_assert_int_eq( f.size, 0 );
+    ck_assert_int_eq( f.enabled, 1 );
+
+    md_json_get_fields(&f, fields, sizeof(fields)/sizeof(fields[0]), json, NULL, g_pool);
+    ck_assert_ptr_eq( f.name, NULL );
+    ck_assert_int_eq( f.count, 0 );
+    ck_assert_int_eq( f.enabled, 0 );
+}
+END_TEST
+
 START_TEST(json_writep_returns_NULL_for_corrupted_json_struct)
 {
     md_json_t *json = md_json_create(g_pool);
@@ -380,6 +462,8 @@ TCase *md_json_test_case(void)
     tcase_add_test(testcase, json_arrays);
     tcase_add_test(testcase, objects);
     tcase_add_test(testcase, copies);
+    tcase_add_test(testcase, writer);
+    tcase_add_test(testcase, paths_and_fields);
 
     tcase_add_test(testcase, json_writep_returns_NULL_for_corrupted_json_struct);
 
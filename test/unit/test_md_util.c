@@ -13,6 +13,9 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+
+#include <apr_strings.h>
 
 #include "test_common.h"
 #include "md_util.h"
@@ -99,6 +102,96 @@ START_TEST(base64_md_util_largetrip)
 }
 END_TEST
 
+static void base64_simd_cmp(const char *buf_in, size_t buf_len)
+{
+    const char *enc_scalar, *enc_simd;
+    md_data_t buffer, dec_scalar, dec_simd;
+    
+    buffer.data = buf_in;
+    buffer.len = buf_len;
+    
+    md_util_base64url_simd(0);
+    enc_scalar = md_util_base64url_encode(&buffer, g_pool);
+    md_util_base64url_decode(&dec_scalar, enc_scalar, g_pool);
+    md_util_base64url_simd(1);
+    enc_simd = md_util_base64url_encode(&buffer, g_pool);
+    md_util_base64url_decode(&dec_simd, enc_scalar, g_pool);
+    
+    ck_assert_str_eq(enc_scalar, enc_simd);
+    ck_assert_int_eq(dec_scalar.len, dec_simd.len);
+    ck_assert_mem_eq(dec_scalar.data, dec_simd.data, dec_simd.len);
+}
+
+static void base64_simd_cmp_dec(const char *encoded)
+{
+    md_data_t dec_scalar, dec_simd;
+    
+    md_util_base64url_simd(0);
+    md_util_base64url_decode(&dec_scalar, encoded, g_pool);
+    md_util_base64url_simd(1);
+    md_util_base64url_decode(&dec_simd, encoded, g_pool);
+    
+    ck_assert_int_eq(dec_scalar.len, dec_simd.len);
+    ck_assert_mem_eq(dec_scalar.data, dec_simd.data, dec_simd.len);
+}
+
+START_TEST(base64_md_util_simd)
+{
+    static const char bad[] = "=+/ \x80";
+    char buffer[320], *enc;
+    md_data_t data;
+    size_t len, i;
+    
+    srand(23);
+    for (len = 0; len < sizeof(buffer); ++len) {
+        for (i = 0; i < len; ++i) {
+            buffer[i] = (char)rand();
+        }
+        base64_simd_cmp(buffer, len);
+        
+        /* decoding stops at the first character not in the alphabet */
+        data.data = buffer;
+        data.len = len;
+        enc = apr_pstrdup(g_pool, md_util_base64url_encode(&data, g_pool));
+        if (enc[0]) {
+            enc[(size_t)rand() % strlen(enc)] = bad[(size_t)rand() % (sizeof(bad) - 1)];
+        }
+        base64_simd_cmp_dec(enc);
+        base64_simd_cmp_dec(apr_pstrcat(g_pool, enc, "==", NULL));
+    }
+}
+END_TEST
+
+START_TEST(dns_md_util_names)
+{
+    apr_array_header_t *domains, *dns_names;
+    
+    domains = apr_array_make(g_pool, 5, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "*.Example.org";
+    APR_ARRAY_PUSH(domains, const char *) = "FOO.bar.com";
+    dns_names = md_dns_names_make(g_pool, domains);
+    
+    ck_assert_str_eq("*.example.org", APR_ARRAY_IDX(dns_names, 0, md_dns_name_t).name);
+    ck_assert(md_dns_names_match(dns_names, "www.EXAMPLE.org"));
+    ck_assert(!md_dns_names_match(dns_names, "example.org"));
+    ck_assert(!md_dns_names_match(dns_names, "a.www.example.org"));
+    ck_assert(md_dns_names_match(dns_names, "foo.BAR.com"));
+    ck_assert(!md_dns_names_match(dns_names, "foo.bar.co"));
+    ck_assert_int_eq(1, md_dns_names_index(dns_names, "Foo.Bar.Com"));
+    ck_assert_int_eq(-1, md_dns_names_index(dns_names, "www.example.org"));
+    
+    APR_ARRAY_PUSH(domains, const char *) = "a-b.c";
+    md_dns_names_add(dns_names, domains, dns_names->nelts, g_pool);
+    ck_assert_int_eq(2, md_dns_names_index(dns_names, "A-B.C"));
+    
+    ck_assert(md_dns_matches("*.example.org", "A.example.ORG"));
+    ck_assert(!md_dns_matches("abc.de", "abc.d"));
+    ck_assert(md_dns_is_name(g_pool, "a-b.example.org", 1));
+    ck_assert(!md_dns_is_name(g_pool, "a..b", 1));
+    ck_assert(!md_dns_is_name(g_pool, "a_b.org", 1));
+}
+END_TEST
+
 TCase *md_util_test_case(void)
 {
     TCase *testcase = tcase_create("md_util");
@@ -107,6 +200,8 @@ TCase *md_util_test_case(void)
 
     tcase_add_test(testcase, base64_md_util_roundtrip);
     tcase_add_test(testcase, base64_md_util_largetrip);
+    tcase_add_test(testcase, base64_md_util_simd);
+    tcase_add_test(testcase, dns_md_util_names);
 
     return testcase;
 }